@@ -5,49 +5,95 @@
  * there will be ``hole'' in it. The intent of this program is to also copý holes
  * when copying two files.
  *
+ * Where the file system can tell where the data of a file is (via the SEEK_DATA and
+ * SEEK_HOLE options of lseek(2)), only the extents holding data are read, and they are
+ * copied with copy_file_range(2), without going through this process. Otherwise, or
+ * with `-z`, every block is read, and those made only of zeroes are skipped over;
+ * that check uses SIMD instructions (SSE2 or AVX2) where the processor has them.
+ *
+ * With `-q depth`, the extents are copied through io_uring instead (see
+ * lib/uringcopy.h), with up to `depth` reads and writes in flight at a time: on
+ * fast storage, and between file systems (where copy_file_range(2) falls back to
+ * copying a buffer at a time), that keeps the device busy. Where io_uring is not
+ * available, copy_file_range(2) is used as usual.
+ *
  * Usage examples
  *
  *    $ ./hcp file newfile
+ *    $ ./hcp -z file newfile
+ *    $ ./hcp -q 32 file newfile
+ *
+ * Built along with uringcopy.c:
+ *
+ *    $ gcc -o hcp hcp.c ../lib/uringcopy.c
  *
  * Author: Renato Mascarenhas Costa
  */
 
+/* get definitions of SEEK_DATA, SEEK_HOLE and `copy_file_range` */
+#define _GNU_SOURCE
+
 #include <unistd.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <errno.h>
 
 #include <string.h>
 
+#include "../lib/uringcopy.h"
+
 #ifndef BUF_SIZ
 #define BUF_SIZ 1024
 #endif
 
+/* largest buffer the zero scan grows to */
+#ifndef MAX_BUF_SIZ
+#define MAX_BUF_SIZ (8 * 1024 * 1024)
+#endif
+
 typedef enum { FALSE, TRUE } Bool;
 
+/* the ring extents are copied through with `-q`; its depth is 0 otherwise */
+static struct uringCopy ring;
+
 void helpAndLeave(const char *progname, int status);
 void pexit(const char *fCall);
 int safeOpen(const char *pathname, int flags, ...);
 void safeClose(int fd);
+int copyExtents(int inputFd, int outputFd);
+void copyRange(int inputFd, int outputFd, off_t offset, off_t len);
+void copyScanning(int inputFd, int outputFd);
 
 int
 main(int argc, char *argv[]) {
-  if (argc != 3) {
+  int opt, depth = 0;
+  Bool scan = FALSE;
+
+  while ((opt = getopt(argc, argv, "zq:")) != -1) {
+    switch (opt) {
+      case 'z': scan = TRUE; break;
+      case 'q': depth = atoi(optarg); break;
+      default: helpAndLeave(argv[0], EXIT_FAILURE);
+    }
+  }
+
+  if (argc != optind + 2 || depth < 0 || (scan && depth > 0)) {
     helpAndLeave(argv[0], EXIT_FAILURE);
   }
 
+  if (depth > 0 && uringCopyInit(&ring, depth, 0) == -1) {
+    perror("hcp: io_uring not available, copying without it");
+  }
+
   int inputFd, outputFd, inputFlags, outputFlags;
   mode_t outputMode;
   char *inputFile, *outputFile;
 
-  ssize_t numRead;
-  char buf[BUF_SIZ];
-  char zeroes[BUF_SIZ];
-
-  inputFile = argv[1];
-  outputFile = argv[2];
+  inputFile = argv[optind];
+  outputFile = argv[optind + 1];
 
   inputFlags = O_RDONLY;
   outputFlags = O_WRONLY | O_CREAT | O_TRUNC;
@@ -56,31 +102,257 @@ main(int argc, char *argv[]) {
   inputFd = safeOpen(inputFile, inputFlags);
   outputFd = safeOpen(outputFile, outputFlags, outputMode);
 
-  while ((numRead = read(inputFd, buf, BUF_SIZ)) > 0) {
+  if (scan || copyExtents(inputFd, outputFd) == -1) {
+    copyScanning(inputFd, outputFd);
+  }
+
+  if (ring.depth > 0) {
+    uringCopyDestroy(&ring);
+  }
+
+  safeClose(inputFd);
+  safeClose(outputFd);
+
+  return EXIT_SUCCESS;
+}
+
+/* copies only the extents of the input file that hold data, leaving the rest of the
+ * output file as holes. Returns -1, before anything is copied, if the file system
+ * cannot tell where the data is */
+int
+copyExtents(int inputFd, int outputFd) {
+  struct stat st;
+  off_t data, hole = 0; /* no extent was copied while `hole` is 0 */
+
+  if (fstat(inputFd, &st) == -1) {
+    pexit("fstat");
+  }
+
+  for (data = 0; data < st.st_size; data = hole) {
+    data = lseek(inputFd, data, SEEK_DATA);
+    if (data == -1) {
+      if (errno == ENXIO) {
+        break; /* only a hole is left until the end of the file */
+      }
+
+      if (hole == 0 && (errno == EINVAL || errno == ENOTSUP)) {
+        return -1; /* not supported: scan for zeroes instead */
+      }
+
+      pexit("lseek");
+    }
+
+    hole = lseek(inputFd, data, SEEK_HOLE);
+    if (hole == -1) {
+      pexit("lseek");
+    }
+
+    copyRange(inputFd, outputFd, data, hole - data);
+  }
+
+  /* the file may end on a hole, which was not written */
+  if (ftruncate(outputFd, st.st_size) == -1) {
+    pexit("ftruncate");
+  }
+
+  return 0;
+}
+
+/* copies `len` bytes at `offset` in the input file to the same offset in the output
+ * file. Copies between file systems where `copy_file_range` is not available go
+ * through a buffer instead */
+void
+copyRange(int inputFd, int outputFd, off_t offset, off_t len) {
+  off_t inOffset = offset, outOffset = offset;
+  ssize_t numCopied, numRead;
+  char buf[BUF_SIZ];
+
+  if (ring.depth > 0) {
+    if (uringCopyRange(&ring, inputFd, outputFd, offset, len) == -1) {
+      pexit("uringCopyRange");
+    }
+    return;
+  }
+
+  while (len > 0) {
+    numCopied = copy_file_range(inputFd, &inOffset, outputFd, &outOffset, len, 0);
+    if (numCopied == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+      numRead = pread(inputFd, buf, (len < BUF_SIZ) ? len : BUF_SIZ, inOffset);
+      if (numRead == -1) {
+        pexit("pread");
+      }
+
+      if (numRead > 0 && pwrite(outputFd, buf, numRead, outOffset) != numRead) {
+        pexit("pwrite");
+      }
+
+      inOffset += numRead;
+      outOffset += numRead;
+      numCopied = numRead;
+    }
+
+    if (numCopied == -1) {
+      pexit("copy_file_range");
+    }
+
+    if (numCopied == 0) {
+      break; /* the file was truncated meanwhile */
+    }
+
+    len -= numCopied;
+  }
+}
+
+/* whether `len` bytes at `buf` are all zeroes. Whole words (or vectors, below) are
+ * compared at a time, rather than bytes */
+Bool
+isZeroScalar(const char *buf, size_t len) {
+  unsigned long word, acc = 0;
+  size_t i;
+
+  for (i = 0; i + sizeof(word) <= len; i += sizeof(word)) {
+    memcpy(&word, buf + i, sizeof(word));
+    acc |= word;
+
+    /* give up as soon as a cache line has data */
+    if ((i & 63) == 64 - sizeof(word) && acc != 0) {
+      return FALSE;
+    }
+  }
+
+  for (; i < len; i++) {
+    acc |= (unsigned char) buf[i];
+  }
+
+  return acc == 0;
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+/* SSE2 is always available on x86-64 */
+Bool
+isZeroSse2(const char *buf, size_t len) {
+  __m128i acc;
+  size_t i;
+
+  for (i = 0; i + 64 <= len; i += 64) {
+    acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i *) (buf + i)),
+                                    _mm_loadu_si128((const __m128i *) (buf + i + 16))),
+                       _mm_or_si128(_mm_loadu_si128((const __m128i *) (buf + i + 32)),
+                                    _mm_loadu_si128((const __m128i *) (buf + i + 48))));
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff) {
+      return FALSE;
+    }
+  }
+
+  return isZeroScalar(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+Bool
+isZeroAvx2(const char *buf, size_t len) {
+  __m256i acc;
+  size_t i;
+
+  for (i = 0; i + 128 <= len; i += 128) {
+    acc = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256((const __m256i *) (buf + i)),
+                                          _mm256_loadu_si256((const __m256i *) (buf + i + 32))),
+                          _mm256_or_si256(_mm256_loadu_si256((const __m256i *) (buf + i + 64)),
+                                          _mm256_loadu_si256((const __m256i *) (buf + i + 96))));
+
+    if (!_mm256_testz_si256(acc, acc)) {
+      return FALSE;
+    }
+  }
+
+  return isZeroSse2(buf + i, len - i);
+}
+#endif
+
+/* the best zero check the processor running this supports */
+Bool (*chooseIsZero(void))(const char *, size_t) {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return isZeroAvx2;
+  }
+
+  return isZeroSse2;
+#else
+  return isZeroScalar;
+#endif
+}
+
+/* reads the whole input file, skipping over the blocks made only of zeroes. Holes
+ * are found at the granularity of the file system's blocks (`st_blksize`), while
+ * reads start at that size and grow up to MAX_BUF_SIZ as long as they come back
+ * full, so that large files take few system calls */
+void
+copyScanning(int inputFd, int outputFd) {
+  Bool (*isZero)(const char *, size_t) = chooseIsZero();
+  struct stat st;
+  ssize_t numRead;
+  size_t blockSize, bufSize, chunk, pos, dataStart;
+  off_t offset = 0;
+  char *buf;
+
+  if (fstat(inputFd, &st) == -1) {
+    pexit("fstat");
+  }
+
+  blockSize = (st.st_blksize > 0) ? (size_t) st.st_blksize : BUF_SIZ;
+  bufSize = blockSize;
+
+  if (posix_memalign((void **) &buf, 64, MAX_BUF_SIZ) != 0) {
+    fprintf(stderr, "Could not allocate buffer\n");
+    exit(EXIT_FAILURE);
+  }
+
+  while ((numRead = read(inputFd, buf, bufSize)) != 0) {
     if (numRead == -1) {
       pexit("read");
     }
 
-    if (memcmp(buf, zeroes, numRead) == 0) {
-      /* hole found, do not copy over */
-      lseek(outputFd, numRead, SEEK_CUR);
+    /* write each run of blocks that hold data with a single call */
+    dataStart = (size_t) numRead;
+    for (pos = 0; pos < (size_t) numRead; pos += chunk) {
+      chunk = ((size_t) numRead - pos < blockSize) ? (size_t) numRead - pos : blockSize;
+
+      if (isZero(buf + pos, chunk)) {
+        /* hole found, do not copy over */
+        if (dataStart < pos && pwrite(outputFd, buf + dataStart, pos - dataStart, offset + dataStart) != (ssize_t) (pos - dataStart)) {
+          pexit("pwrite");
+        }
 
-    } else {
-      if (write(outputFd, buf, numRead) != numRead) {
-        pexit("write");
+        dataStart = (size_t) numRead;
+      } else if (dataStart == (size_t) numRead) {
+        dataStart = pos;
       }
     }
+
+    if (dataStart < (size_t) numRead && pwrite(outputFd, buf + dataStart, numRead - dataStart, offset + dataStart) != (ssize_t) (numRead - dataStart)) {
+      pexit("pwrite");
+    }
+
+    offset += numRead;
+    if ((size_t) numRead == bufSize && bufSize < MAX_BUF_SIZ) {
+      bufSize = (bufSize * 2 < MAX_BUF_SIZ) ? bufSize * 2 : MAX_BUF_SIZ;
+    }
   }
 
-  safeClose(inputFd);
-  safeClose(outputFd);
+  free(buf);
 
-  return EXIT_SUCCESS;
+  /* a hole at the end of the file was skipped over, but not written */
+  if (ftruncate(outputFd, offset) == -1) {
+    pexit("ftruncate");
+  }
 }
 
 void
 helpAndLeave(const char *progname, int status) {
-  fprintf(stderr, "Usage: %s <file> <newfile>\n", progname);
+  fprintf(stderr, "Usage: %s [-z | -q depth] <file> <newfile>\n", progname);
   exit(status);
 }
 
@@ -11,21 +11,43 @@
  * By dfefault, tee will overwrite the contents of the passed file. Passing the -a option
  * tells _tee to append to the file instead.
  *
+ * When the standard input is a pipe, its contents are never copied to this process:
+ * they are duplicated with tee(2) into a pipe of our own, and moved from there to each
+ * output with splice(2), the last output taking them from the standard input directly.
+ * Otherwise (and when appending, since files opened with O_APPEND cannot be spliced to)
+ * the input is read into a buffer and written to each output.
+ *
+ * Either way, outputs are written to one after the other, so a slow one holds back
+ * every other. With -w, each output gets a thread of its own instead, fed through a
+ * bounded ring buffer, and goes at its own pace. What happens when an output falls so
+ * far behind that its buffer is full is up to the policy given:
+ *
+ *    block  wait for the output to catch up, holding back reading the input (and so
+ *           every other output, once their buffers are drained)
+ *    drop   discard data for that output (how much is reported on exit)
+ *    spill  keep the data in a temporary file, to be written once the output
+ *           catches up
+ *
  * Supported command line options:
  *
- *    -a    Append to the file instead of overwriting it
- *    -h    Displays help message and exit
+ *    -a         Append to the file instead of overwriting it
+ *    -w policy  Write to each output on its own thread (block, drop or spill)
+ *    -b size    Size of the buffer of each output with -w, in KiB (default 1024)
+ *    -h         Displays help message and exit
  *
  * Author: Renato Mascarenhas Costa
  */
 
-#define _XOPEN_SOURCE /* getopt function */
+#define _GNU_SOURCE /* getopt, tee and splice functions */
 
 #include <unistd.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
 
 #ifndef BUF_SIZ
 #define BUF_SIZ 1024
@@ -35,18 +57,56 @@
 #define MAX_OUT_FILES 128
 #endif
 
+#ifndef ASYNC_READ_SIZ
+#define ASYNC_READ_SIZ (64 * 1024)
+#endif
+
 typedef enum { FALSE, TRUE } Bool;
+typedef enum { POLICY_BLOCK, POLICY_DROP, POLICY_SPILL } Policy;
+
+/* an output written to by a thread of its own. `ring` holds `len` bytes of data
+ * starting at `head`; with the spill policy, data that did not fit is kept in
+ * `spillFd` between the `spillRead` and `spillWrite` offsets, and is newer than
+ * anything in the ring */
+struct sink {
+  int fd;
+  const char *name;
+
+  char *ring;
+  size_t size, head, len;
+
+  int spillFd;
+  off_t spillRead, spillWrite;
+
+  unsigned long long dropped; /* bytes discarded with the drop policy */
+  Bool done;                  /* no more data will be given */
+
+  pthread_mutex_t lock;
+  pthread_cond_t canRead, canWrite;
+  pthread_t thread;
+};
 
 void helpAndLeave(const char *progname, int status);
 void failure(const char *fCall);
+Bool canSplice(int *fds, int numFds);
+void spliceFully(int in, int out, size_t len);
+void spliceAll(int *fds, int numFds);
+void writeFully(int fd, const char *buf, size_t len);
+void *sinkWriter(void *arg);
+void ringPut(struct sink *sink, const char *buf, size_t len);
+void sinkPut(struct sink *sink, const char *buf, size_t len, Policy policy);
+void fanOut(int *fds, const char **names, int numFds, Policy policy, size_t bufSize);
 
 int
 main(int argc, char *argv[]) {
   int opt;
-  Bool append = FALSE;
+  Bool append = FALSE, async = FALSE;
+  Policy policy = POLICY_BLOCK;
+  size_t bufSize = 1024 * 1024;
 
   int fd, flags;
-  int fds[MAX_OUT_FILES];
+  int fds[MAX_OUT_FILES + 1];
+  const char *names[MAX_OUT_FILES + 1];
   mode_t mode;
   char buf[BUF_SIZ + 1];
   ssize_t numRead;
@@ -56,11 +116,30 @@ main(int argc, char *argv[]) {
   /* Command line arguments parsing */
 
   opterr = 0;
-  while ((opt = getopt(argc, argv, "+a")) != -1) {
+  while ((opt = getopt(argc, argv, "+ahw:b:")) != -1) {
     switch(opt) {
       case '?': helpAndLeave(argv[0], EXIT_FAILURE); break;
       case 'h': helpAndLeave(argv[0], EXIT_SUCCESS); break;
       case 'a': append = TRUE;                       break;
+      case 'w':
+        async = TRUE;
+        if (!strcmp(optarg, "block")) {
+          policy = POLICY_BLOCK;
+        } else if (!strcmp(optarg, "drop")) {
+          policy = POLICY_DROP;
+        } else if (!strcmp(optarg, "spill")) {
+          policy = POLICY_SPILL;
+        } else {
+          helpAndLeave(argv[0], EXIT_FAILURE);
+        }
+        break;
+      case 'b':
+        bufSize = strtoul(optarg, NULL, 10) * 1024;
+        if (bufSize < ASYNC_READ_SIZ) {
+          fprintf(stderr, "Buffers must hold at least %d KiB\n", ASYNC_READ_SIZ / 1024);
+          exit(EXIT_FAILURE);
+        }
+        break;
     }
   }
 
@@ -79,8 +158,14 @@ main(int argc, char *argv[]) {
     flags |= O_TRUNC;
   }
 
+  if (argc - optind > MAX_OUT_FILES) {
+    fprintf(stderr, "Too many files: at most %d are supported\n", MAX_OUT_FILES);
+    exit(EXIT_FAILURE);
+  }
+
   for (i = optind; i < argc; ++i) {
     fds[i - optind] = fd = open(argv[i], flags, mode);
+    names[i - optind] = argv[i];
 
     if (fd == -1) {
       failure("open");
@@ -89,6 +174,17 @@ main(int argc, char *argv[]) {
     ++numFiles;
   }
 
+  /* when splicing, the standard output is the last output: it takes the data from
+   * the standard input once the files have their copies. Afterwards, reading below
+   * finds the end of the input right away */
+  fds[numFiles] = STDOUT_FILENO;
+  names[numFiles] = "standard output";
+  if (async) {
+    fanOut(fds, names, numFiles + 1, policy, bufSize);
+  } else if (canSplice(fds, numFiles + 1)) {
+    spliceAll(fds, numFiles + 1);
+  }
+
   while ((numRead = read(STDIN_FILENO, buf, BUF_SIZ)) > 0) {
     if (write(STDOUT_FILENO, buf, numRead) != numRead) {
       failure("write");
@@ -115,9 +211,332 @@ main(int argc, char *argv[]) {
   return 0;
 }
 
+/* whether the input can be duplicated with tee(2), and spliced to every output */
+Bool
+canSplice(int *fds, int numFds) {
+  struct stat st;
+  int i, fl;
+
+  if (fstat(STDIN_FILENO, &st) == -1) {
+    failure("fstat");
+  }
+
+  if (!S_ISFIFO(st.st_mode)) {
+    return FALSE;
+  }
+
+  for (i = 0; i < numFds; ++i) {
+    if ((fl = fcntl(fds[i], F_GETFL)) == -1) {
+      failure("fcntl");
+    }
+
+    if (fl & O_APPEND) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+/* moves `len` bytes from the pipe `in` to `out` */
+void
+spliceFully(int in, int out, size_t len) {
+  ssize_t numMoved;
+
+  while (len > 0) {
+    numMoved = splice(in, NULL, out, NULL, len, SPLICE_F_MOVE);
+    if (numMoved == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      failure("splice");
+    }
+
+    len -= numMoved;
+  }
+}
+
+/* copies the standard input, a pipe, to every output with no copy to userspace. Every
+ * round, the data in the input pipe is duplicated into `dup` and spliced from there to
+ * each output but the last one, which then consumes it from the input. Since the
+ * duplicate pipe is as large as the input one, and empty, every `tee` call duplicates
+ * the same bytes */
+void
+spliceAll(int *fds, int numFds) {
+  int dup[2], i;
+  long pipeSize;
+  ssize_t numTeed, len;
+
+  if (pipe(dup) == -1) {
+    failure("pipe");
+  }
+
+  if ((pipeSize = fcntl(STDIN_FILENO, F_GETPIPE_SZ)) == -1) {
+    failure("fcntl");
+  }
+
+  if (fcntl(dup[1], F_SETPIPE_SZ, pipeSize) == -1) {
+    failure("fcntl");
+  }
+
+  for (;;) {
+    len = pipeSize;
+
+    for (i = 0; i < numFds - 1; ++i) {
+      while ((numTeed = tee(STDIN_FILENO, dup[1], len, 0)) == -1 && errno == EINTR)
+        ;
+
+      if (numTeed == -1) {
+        failure("tee");
+      }
+
+      if (numTeed == 0) {
+        break; /* end of input */
+      }
+
+      if (i > 0 && numTeed != len) {
+        fprintf(stderr, "tee: short duplicate of the input\n");
+        exit(EXIT_FAILURE);
+      }
+
+      len = numTeed;
+      spliceFully(dup[0], fds[i], len);
+    }
+
+    if (numTeed == 0) {
+      break;
+    }
+
+    spliceFully(STDIN_FILENO, fds[numFds - 1], len);
+  }
+
+  if (close(dup[0]) == -1 || close(dup[1]) == -1) {
+    failure("close");
+  }
+}
+
+/* writes `len` bytes to `fd`, failing the program if it cannot */
+void
+writeFully(int fd, const char *buf, size_t len) {
+  ssize_t numWritten;
+
+  while (len > 0) {
+    numWritten = write(fd, buf, len);
+    if (numWritten == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      failure("write");
+    }
+
+    buf += numWritten;
+    len -= numWritten;
+  }
+}
+
+/* the thread writing to a sink: drains the ring first, then whatever was spilled.
+ * Writes happen with the lock released, on data the reader does not touch until
+ * it is marked as consumed */
+void *
+sinkWriter(void *arg) {
+  struct sink *sink = arg;
+  char *spillBuf = NULL;
+  size_t chunk;
+  ssize_t numRead;
+  off_t offset;
+
+  pthread_mutex_lock(&sink->lock);
+  for (;;) {
+    while (sink->len == 0 && sink->spillRead == sink->spillWrite && !sink->done) {
+      pthread_cond_wait(&sink->canRead, &sink->lock);
+    }
+
+    if (sink->len > 0) {
+      chunk = (sink->len < sink->size - sink->head) ? sink->len : sink->size - sink->head;
+
+      pthread_mutex_unlock(&sink->lock);
+      writeFully(sink->fd, sink->ring + sink->head, chunk);
+      pthread_mutex_lock(&sink->lock);
+
+      sink->head = (sink->head + chunk) % sink->size;
+      sink->len -= chunk;
+      pthread_cond_signal(&sink->canWrite);
+      continue;
+    }
+
+    if (sink->spillRead < sink->spillWrite) {
+      if (spillBuf == NULL && (spillBuf = malloc(ASYNC_READ_SIZ)) == NULL) {
+        failure("malloc");
+      }
+
+      offset = sink->spillRead;
+      chunk = (sink->spillWrite - offset < ASYNC_READ_SIZ) ? sink->spillWrite - offset : ASYNC_READ_SIZ;
+
+      pthread_mutex_unlock(&sink->lock);
+      if ((numRead = pread(sink->spillFd, spillBuf, chunk, offset)) <= 0) {
+        failure("pread");
+      }
+      writeFully(sink->fd, spillBuf, numRead);
+      pthread_mutex_lock(&sink->lock);
+
+      /* once caught up, new data goes to the ring again */
+      sink->spillRead += numRead;
+      if (sink->spillRead == sink->spillWrite) {
+        sink->spillRead = sink->spillWrite = 0;
+        if (ftruncate(sink->spillFd, 0) == -1) {
+          failure("ftruncate");
+        }
+      }
+      continue;
+    }
+
+    break; /* done, and everything was written */
+  }
+  pthread_mutex_unlock(&sink->lock);
+
+  free(spillBuf);
+  return NULL;
+}
+
+/* copies `len` bytes into the free space of the ring of `sink`, which must fit them */
+void
+ringPut(struct sink *sink, const char *buf, size_t len) {
+  size_t tail, first;
+
+  tail = (sink->head + sink->len) % sink->size;
+  first = (len < sink->size - tail) ? len : sink->size - tail;
+
+  memcpy(sink->ring + tail, buf, first);
+  memcpy(sink->ring, buf + first, len - first);
+  sink->len += len;
+}
+
+/* hands data read from the input to a sink, according to the policy for when it
+ * has no room for them */
+void
+sinkPut(struct sink *sink, const char *buf, size_t len, Policy policy) {
+  char spillPath[] = "/tmp/teeXXXXXX";
+
+  pthread_mutex_lock(&sink->lock);
+
+  switch (policy) {
+    case POLICY_BLOCK:
+      while (sink->size - sink->len < len) {
+        pthread_cond_wait(&sink->canWrite, &sink->lock);
+      }
+      ringPut(sink, buf, len);
+      break;
+
+    case POLICY_DROP:
+      if (sink->size - sink->len < len) {
+        sink->dropped += len;
+      } else {
+        ringPut(sink, buf, len);
+      }
+      break;
+
+    case POLICY_SPILL:
+      /* while anything is spilled, newer data must follow it */
+      if (sink->spillWrite == sink->spillRead && sink->size - sink->len >= len) {
+        ringPut(sink, buf, len);
+        break;
+      }
+
+      if (sink->spillFd == -1) {
+        if ((sink->spillFd = mkstemp(spillPath)) == -1) {
+          failure("mkstemp");
+        }
+        unlink(spillPath);
+      }
+
+      if (pwrite(sink->spillFd, buf, len, sink->spillWrite) != (ssize_t) len) {
+        failure("pwrite");
+      }
+      sink->spillWrite += len;
+      break;
+  }
+
+  pthread_cond_signal(&sink->canRead);
+  pthread_mutex_unlock(&sink->lock);
+}
+
+/* copies the standard input to every output, each written to by a thread of its own */
+void
+fanOut(int *fds, const char **names, int numFds, Policy policy, size_t bufSize) {
+  struct sink *sinks;
+  char *buf;
+  ssize_t numRead;
+  int i, s;
+
+  sinks = calloc(numFds, sizeof(struct sink));
+  buf = malloc(ASYNC_READ_SIZ);
+  if (sinks == NULL || buf == NULL) {
+    failure("malloc");
+  }
+
+  for (i = 0; i < numFds; ++i) {
+    sinks[i].fd = fds[i];
+    sinks[i].name = names[i];
+    sinks[i].size = bufSize;
+    sinks[i].spillFd = -1;
+
+    if ((sinks[i].ring = malloc(bufSize)) == NULL) {
+      failure("malloc");
+    }
+
+    pthread_mutex_init(&sinks[i].lock, NULL);
+    pthread_cond_init(&sinks[i].canRead, NULL);
+    pthread_cond_init(&sinks[i].canWrite, NULL);
+
+    if ((s = pthread_create(&sinks[i].thread, NULL, sinkWriter, &sinks[i])) != 0) {
+      errno = s;
+      failure("pthread_create");
+    }
+  }
+
+  while ((numRead = read(STDIN_FILENO, buf, ASYNC_READ_SIZ)) != 0) {
+    if (numRead == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      failure("read");
+    }
+
+    for (i = 0; i < numFds; ++i) {
+      sinkPut(&sinks[i], buf, numRead, policy);
+    }
+  }
+
+  for (i = 0; i < numFds; ++i) {
+    pthread_mutex_lock(&sinks[i].lock);
+    sinks[i].done = TRUE;
+    pthread_cond_signal(&sinks[i].canRead);
+    pthread_mutex_unlock(&sinks[i].lock);
+  }
+
+  for (i = 0; i < numFds; ++i) {
+    pthread_join(sinks[i].thread, NULL);
+
+    if (sinks[i].dropped > 0) {
+      fprintf(stderr, "tee: dropped %llu bytes for %s\n", sinks[i].dropped, sinks[i].name);
+    }
+
+    if (sinks[i].spillFd != -1) {
+      close(sinks[i].spillFd);
+    }
+    free(sinks[i].ring);
+  }
+
+  free(sinks);
+  free(buf);
+}
+
 void
 helpAndLeave(const char *progname, int status) {
-  fprintf(stderr, "Usage: %s [-a] <file1> <file2> ... <fileN>\n", progname);
+  fprintf(stderr, "Usage: %s [-a] [-w block|drop|spill] [-b KiB] <file1> <file2> ... <fileN>\n", progname);
   exit(status);
 }
 
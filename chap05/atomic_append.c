@@ -44,6 +44,27 @@
  * For this reason, to be sure a write(2) call will write to the end of the file without
  * overriding existing content, the O_APPEND flag must be passed.
  *
+ * Benchmark
+ *
+ * With -b, a number of threads (-w) append fixed size records (-s bytes each) to the
+ * file, -r records in total, the way writers of a log do, in one of these modes (-m):
+ *
+ *    append  every record is written with a write(2) to the file open with O_APPEND
+ *    pwrite  space for every record is reserved by atomically advancing a shared
+ *            offset, and the record is written there with pwrite(2)
+ *    group   group commit: records are gathered in a batch (of at most -g records)
+ *            while the previous batch is being written; the writer that finds no
+ *            batch being written writes the current one with a single write(2) and
+ *            fdatasync(2), and every writer whose record it holds goes on
+ *
+ * In the first two modes, each record is made durable with its own fdatasync(2),
+ * unless -n is given (in which case no mode calls it). The program reports the
+ * records written per second and the latency of each record, from being handed to
+ * the log until it is durable (or written, with -n), then checks that every record
+ * in the file is whole.
+ *
+ *    $ ./atomic_append -b -m group -w 16 -r 100000 -s 128 wal.log
+ *
  * Author: Renato Mascarenhas Costa
  */
 
@@ -53,6 +74,10 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #ifndef AA_BYTE
 #define AA_BYTE 'a'
@@ -63,6 +88,7 @@ typedef enum { FALSE, TRUE } Bool;
 void helpAndLeave(const char *progname, int status);
 void pexit(const char *fCall);
 int writeBytes(int fd, int numBytes, Bool useAppend);
+int benchmark(int argc, char *argv[]);
 
 static const char byte[] = { AA_BYTE };
 
@@ -73,6 +99,10 @@ main(int argc, char *argv[]) {
   mode_t mode;
   Bool useAppend;
 
+  if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+    return benchmark(argc, argv);
+  }
+
   if (argc < 3 || argc > 4) {
     helpAndLeave(argv[0], EXIT_FAILURE);
   }
@@ -130,9 +160,329 @@ writeBytes(int fd, int numBytes, Bool useAppend) {
   return totalWritten;
 }
 
+typedef enum { MODE_APPEND, MODE_PWRITE, MODE_GROUP } Mode;
+
+/* the state shared by the writers of the benchmark */
+struct log {
+  int fd;
+  Mode mode;
+  Bool sync;
+  size_t recordSize;
+
+  off_t nextOffset; /* pwrite: the next offset to be reserved */
+
+  /* group commit: records are added to `batch` while `flushing` is set, and the
+   * batch is swapped for `spare` once it is taken to be written. Batches are
+   * numbered, so that writers know when theirs is durable */
+  pthread_mutex_t lock;
+  pthread_cond_t flushed;
+  char *batch, *spare;
+  size_t used, capacity;
+  unsigned long openBatch, durableBatch;
+  Bool flushing;
+
+  unsigned long writes, syncs;
+};
+
+struct writer {
+  struct log *log;
+  int id, numRecords;
+  long long *latencies; /* nanoseconds, one per record */
+  pthread_t thread;
+};
+
+void
+writeFully(int fd, const char *buf, size_t len) {
+  ssize_t numWritten;
+
+  while (len > 0) {
+    numWritten = write(fd, buf, len);
+    if (numWritten == -1) {
+      pexit("write");
+    }
+
+    buf += numWritten;
+    len -= numWritten;
+  }
+}
+
+long long
+nowNs(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* writes the current batch, and makes it durable. Called with the lock held, and
+ * returns with it held; the lock is released while writing, so that records keep
+ * being added to the next batch */
+void
+flushBatch(struct log *log) {
+  char *buf = log->batch;
+  size_t len = log->used;
+  unsigned long number = log->openBatch;
+
+  if (len == 0) {
+    return;
+  }
+
+  log->flushing = TRUE;
+  log->batch = log->spare;
+  log->used = 0;
+  log->openBatch++;
+  pthread_mutex_unlock(&log->lock);
+
+  writeFully(log->fd, buf, len);
+  if (log->sync && fdatasync(log->fd) == -1) {
+    pexit("fdatasync");
+  }
+
+  pthread_mutex_lock(&log->lock);
+  log->spare = buf;
+  log->writes++;
+  log->syncs += log->sync;
+  log->durableBatch = number;
+  log->flushing = FALSE;
+  pthread_cond_broadcast(&log->flushed);
+}
+
+/* adds a record to the log, returning once it is durable (or written, if syncing
+ * is disabled) */
+void
+appendRecord(struct log *log, const char *record) {
+  unsigned long mine;
+  off_t offset;
+
+  switch (log->mode) {
+    case MODE_APPEND:
+      writeFully(log->fd, record, log->recordSize);
+      break;
+
+    case MODE_PWRITE:
+      offset = __atomic_fetch_add(&log->nextOffset, (off_t) log->recordSize, __ATOMIC_RELAXED);
+      if (pwrite(log->fd, record, log->recordSize, offset) != (ssize_t) log->recordSize) {
+        pexit("pwrite");
+      }
+      break;
+
+    case MODE_GROUP:
+      pthread_mutex_lock(&log->lock);
+
+      /* a full batch is written right away, unless one is being written already */
+      while (log->used + log->recordSize > log->capacity) {
+        if (log->flushing) {
+          pthread_cond_wait(&log->flushed, &log->lock);
+        } else {
+          flushBatch(log);
+        }
+      }
+
+      memcpy(log->batch + log->used, record, log->recordSize);
+      log->used += log->recordSize;
+      mine = log->openBatch;
+
+      while (log->durableBatch < mine) {
+        if (log->flushing) {
+          pthread_cond_wait(&log->flushed, &log->lock);
+        } else {
+          flushBatch(log);
+        }
+      }
+
+      pthread_mutex_unlock(&log->lock);
+      return;
+  }
+
+  if (log->sync && fdatasync(log->fd) == -1) {
+    pexit("fdatasync");
+  }
+
+  __atomic_fetch_add(&log->writes, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&log->syncs, log->sync, __ATOMIC_RELAXED);
+}
+
+/* records are lines filled up to their size, so that torn or overlapping writes are
+ * found when the file is checked */
+void
+formatRecord(char *record, size_t size, int writer, int seq) {
+  int n;
+
+  memset(record, 'x', size);
+  n = snprintf(record, size, "w%04d r%010d ", writer, seq);
+  record[n] = 'x';
+  record[size - 1] = '\n';
+}
+
+void *
+writerMain(void *arg) {
+  struct writer *w = arg;
+  char *record;
+  long long start;
+  int i;
+
+  record = malloc(w->log->recordSize);
+  if (record == NULL) {
+    pexit("malloc");
+  }
+
+  for (i = 0; i < w->numRecords; ++i) {
+    formatRecord(record, w->log->recordSize, w->id, i);
+
+    start = nowNs();
+    appendRecord(w->log, record);
+    w->latencies[i] = nowNs() - start;
+  }
+
+  free(record);
+  return NULL;
+}
+
+int
+compareLatencies(const void *a, const void *b) {
+  long long x = *(const long long *) a, y = *(const long long *) b;
+  return (x > y) - (x < y);
+}
+
+/* checks that the file holds exactly `numRecords` whole records */
+Bool
+checkRecords(const char *filename, size_t size, int numRecords) {
+  char *record;
+  int fd, count = 0;
+  ssize_t numRead;
+  Bool ok = TRUE;
+
+  fd = open(filename, O_RDONLY);
+  record = malloc(size);
+  if (fd == -1 || record == NULL) {
+    pexit("open");
+  }
+
+  while (ok && (numRead = read(fd, record, size)) > 0) {
+    ok = (size_t) numRead == size && record[0] == 'w' && record[size - 1] == '\n' &&
+         memchr(record, '\n', size - 1) == NULL;
+    count++;
+  }
+
+  close(fd);
+  free(record);
+  return ok && count == numRecords;
+}
+
+int
+benchmark(int argc, char *argv[]) {
+  int opt, i, s, numWriters = 8, numRecords = 100000, maxBatch = 64, flags;
+  size_t recordSize = 128;
+  long long start, elapsed, *latencies;
+  struct writer *writers;
+  struct log log;
+  char *filename;
+  double seconds;
+
+  memset(&log, 0, sizeof(struct log));
+  log.mode = MODE_APPEND;
+  log.sync = TRUE;
+
+  optind = 2;
+  while ((opt = getopt(argc, argv, "m:w:r:s:g:n")) != -1) {
+    switch (opt) {
+      case 'm':
+        if (!strcmp(optarg, "append")) {
+          log.mode = MODE_APPEND;
+        } else if (!strcmp(optarg, "pwrite")) {
+          log.mode = MODE_PWRITE;
+        } else if (!strcmp(optarg, "group")) {
+          log.mode = MODE_GROUP;
+        } else {
+          helpAndLeave(argv[0], EXIT_FAILURE);
+        }
+        break;
+      case 'w': numWriters = atoi(optarg); break;
+      case 'r': numRecords = atoi(optarg); break;
+      case 's': recordSize = (size_t) atol(optarg); break;
+      case 'g': maxBatch = atoi(optarg); break;
+      case 'n': log.sync = FALSE; break;
+      default: helpAndLeave(argv[0], EXIT_FAILURE);
+    }
+  }
+
+  if (optind != argc - 1 || numWriters < 1 || numRecords < numWriters || recordSize < 32 || maxBatch < 1) {
+    helpAndLeave(argv[0], EXIT_FAILURE);
+  }
+
+  filename = argv[optind];
+  numRecords -= numRecords % numWriters;
+
+  flags = O_WRONLY | O_CREAT | O_TRUNC;
+  if (log.mode != MODE_PWRITE) {
+    flags |= O_APPEND;
+  }
+
+  log.fd = open(filename, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+  if (log.fd == -1) {
+    pexit("open");
+  }
+
+  log.recordSize = recordSize;
+  log.capacity = maxBatch * recordSize;
+  log.batch = malloc(log.capacity);
+  log.spare = malloc(log.capacity);
+  writers = calloc(numWriters, sizeof(struct writer));
+  latencies = malloc(numRecords * sizeof(long long));
+  if (log.batch == NULL || log.spare == NULL || writers == NULL || latencies == NULL) {
+    pexit("malloc");
+  }
+
+  pthread_mutex_init(&log.lock, NULL);
+  pthread_cond_init(&log.flushed, NULL);
+
+  start = nowNs();
+  for (i = 0; i < numWriters; ++i) {
+    writers[i].log = &log;
+    writers[i].id = i;
+    writers[i].numRecords = numRecords / numWriters;
+    writers[i].latencies = latencies + i * (numRecords / numWriters);
+
+    if ((s = pthread_create(&writers[i].thread, NULL, writerMain, &writers[i])) != 0) {
+      errno = s;
+      pexit("pthread_create");
+    }
+  }
+
+  for (i = 0; i < numWriters; ++i) {
+    pthread_join(writers[i].thread, NULL);
+  }
+  elapsed = nowNs() - start;
+
+  if (close(log.fd) == -1) {
+    pexit("close");
+  }
+
+  qsort(latencies, numRecords, sizeof(long long), compareLatencies);
+  seconds = elapsed / 1e9;
+
+  printf("mode %s, %d writers, %d records of %zu bytes%s\n",
+         (log.mode == MODE_APPEND) ? "append" : (log.mode == MODE_PWRITE) ? "pwrite" : "group",
+         numWriters, numRecords, recordSize, log.sync ? "" : ", no fdatasync");
+  printf("%.3f s, %.0f records/s, %lu writes, %lu fdatasyncs (%.1f records per write)\n",
+         seconds, numRecords / seconds, log.writes, log.syncs, (double) numRecords / log.writes);
+  printf("latency (us): p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+         latencies[numRecords / 2] / 1e3, latencies[(long) numRecords * 99 / 100] / 1e3,
+         latencies[(long) numRecords * 999 / 1000] / 1e3, latencies[numRecords - 1] / 1e3);
+  printf("records check: %s\n", checkRecords(filename, recordSize, numRecords) ? "ok" : "FAILED");
+
+  free(log.batch);
+  free(log.spare);
+  free(writers);
+  free(latencies);
+
+  return EXIT_SUCCESS;
+}
+
 void
 helpAndLeave(const char *progname, int status) {
   fprintf(stderr, "Usage: %s <file> <numBytes> [x]\n", progname);
+  fprintf(stderr, "       %s -b [-m append|pwrite|group] [-w writers] [-r records] [-s size] [-g batch] [-n] <file>\n", progname);
   exit(status);
 }
 
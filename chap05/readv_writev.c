@@ -5,15 +5,32 @@
  * reading or writing multiple buffers to a file, while guarateeing atomicity, i.e.,
  * the bytes written or read will be consecutive.
  *
+ * _readv and _writev go through a temporary buffer of the total size, allocated on
+ * every call. _readvCoalesced and _writevCoalesced instead gather runs of small
+ * buffers in a buffer of COALESCE_BUF_SIZE bytes (kept from call to call, one per
+ * thread), and pass buffers of at least COALESCE_MIN_DIRECT bytes straight to
+ * read(2) and write(2), since copying them costs more than the system call saved.
+ * Note that, unlike the kernel calls, they may then perform more than one read(2)
+ * or write(2), so they are not atomic with respect to other writers of the file.
+ *
+ * Measured with -b below, gathering is cheaper than the kernel calls while the
+ * iovecs are small (tens to hundreds of bytes each; more so the more iovecs there
+ * are), and the kernel calls win from a few KiB per iovec on.
+ *
  * Usage:
  *
  *    $ ./readv_writev
  *    # Print performed steps to ensure implementation is correct.
  *
+ *    $ ./readv_writev -b
+ *    # Compare the time each call takes, for the kernel and both implementations
+ *    # above, across iovec counts and sizes, on a temporary file.
+ *
  * Author: Renato Mascarenhas Costa
  */
 
 #define _BSD_SOURCE /* mkstemp function */
+#define _DEFAULT_SOURCE
 
 #include <unistd.h>
 #include <sys/types.h>
@@ -23,9 +40,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #define STR_SIZE 13
 
+/* size of the buffer small iovecs are gathered in */
+#ifndef COALESCE_BUF_SIZE
+#define COALESCE_BUF_SIZE (64 * 1024)
+#endif
+
+/* iovecs at least this large are not copied */
+#ifndef COALESCE_MIN_DIRECT
+#define COALESCE_MIN_DIRECT (16 * 1024)
+#endif
+
+static __thread char coalesceBuf[COALESCE_BUF_SIZE];
+
 static char tmpFilePath[] = "/tmp/readv_writevXXXXXX";
 
 void pexit(const char *fCall);
@@ -33,10 +63,52 @@ void fatal(const char *mesg);
 
 ssize_t _readv(int fd, const struct iovec *iov, int iovcnt);
 ssize_t _writev(int fd, const struct iovec *iov, int iovcnt);
+ssize_t _readvCoalesced(int fd, const struct iovec *iov, int iovcnt);
+ssize_t _writevCoalesced(int fd, const struct iovec *iov, int iovcnt);
+
+void checkCalls(int fd, ssize_t (*readvFn)(int, const struct iovec *, int),
+                ssize_t (*writevFn)(int, const struct iovec *, int));
+int accountPart(ssize_t result, size_t len, ssize_t *total);
+int readRun(int fd, const struct iovec *iov, int first, int last, size_t len, ssize_t *total);
+double timeCalls(int fd, ssize_t (*fn)(int, const struct iovec *, int), const struct iovec *iov,
+                 int iovcnt, size_t total, int iterations);
+int benchmark(void);
 
 int
-main() {
+main(int argc, char *argv[]) {
   int fd;
+
+  if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+    return benchmark();
+  }
+
+  fd = mkstemp(tmpFilePath);
+  if (fd == -1) {
+    pexit("open");
+  }
+
+  printf("Created file %s for scather-gather I/O\n", tmpFilePath);
+  unlink(tmpFilePath);
+
+  checkCalls(fd, _readv, _writev);
+
+  if (ftruncate(fd, 0) == -1) {
+    pexit("ftruncate");
+  }
+
+  lseek(fd, 0, SEEK_SET);
+  checkCalls(fd, _readvCoalesced, _writevCoalesced);
+
+  if (close(fd) == -1) {
+    pexit("close");
+  }
+
+  return EXIT_SUCCESS;
+}
+
+void
+checkCalls(int fd, ssize_t (*readvFn)(int, const struct iovec *, int),
+           ssize_t (*writevFn)(int, const struct iovec *, int)) {
   struct iovec iovInput[3];
   struct iovec iovOutput[3];
 
@@ -50,14 +122,6 @@ main() {
 
   ssize_t numRead, numWritten, required = 0;
 
-  fd = mkstemp(tmpFilePath);
-  if (fd == -1) {
-    pexit("open");
-  }
-
-  printf("Created file %s for scather-gather I/O\n", tmpFilePath);
-  unlink(tmpFilePath);
-
   /* Set up input */
   iovInput[0].iov_base = &code;
   iovInput[0].iov_len = sizeof(code);
@@ -71,7 +135,7 @@ main() {
   iovInput[2].iov_len = sizeof(str);
   required += iovInput[2].iov_len;
 
-  numWritten = _writev(fd, iovInput, 3);
+  numWritten = writevFn(fd, iovInput, 3);
   if (numWritten == -1) {
     fatal("Something wrong happened @_writev.");
   }
@@ -91,18 +155,12 @@ main() {
   iovOutput[2].iov_len = sizeof(strOutput);
 
   lseek(fd, 0, SEEK_SET);
-  numRead = _readv(fd, iovOutput, 3);
+  numRead = readvFn(fd, iovOutput, 3);
   if (numRead == -1) {
     fatal("Something wrong happened @_readv");
   }
 
   printf("\nScather-gather I/O finished. Read data: code = %c, n = %d and str = \"%s\"\n", codeOutput, nOutput, strOutput);
-
-  if (close(fd) == -1) {
-    pexit("close");
-  }
-
-  return EXIT_SUCCESS;
 }
 
 ssize_t
@@ -172,6 +230,200 @@ _writev(int fd, const struct iovec *iov, int iovcnt) {
   return numWritten;
 }
 
+/* adds the result of a read(2) or write(2) of `len` bytes to the running `*total`
+ * of a call. Returns 0 if the call must stop there: on errors (the call returns
+ * -1 if nothing was transferred yet), and on short transfers */
+int
+accountPart(ssize_t result, size_t len, ssize_t *total) {
+  if (result == -1) {
+    if (*total == 0) {
+      *total = -1;
+    }
+    return 0;
+  }
+
+  *total += result;
+  return (size_t) result == len;
+}
+
+/* reads `len` bytes into the coalescing buffer, and scatters them over the iovecs
+ * from `first` up to `last` (not included) */
+int
+readRun(int fd, const struct iovec *iov, int first, int last, size_t len, ssize_t *total) {
+  ssize_t numRead;
+  size_t copied, n;
+  int i;
+
+  numRead = read(fd, coalesceBuf, len);
+
+  copied = 0;
+  for (i = first; i < last && numRead > 0 && copied < (size_t) numRead; ++i) {
+    n = (size_t) numRead - copied;
+    if (n > iov[i].iov_len) {
+      n = iov[i].iov_len;
+    }
+
+    memcpy(iov[i].iov_base, coalesceBuf + copied, n);
+    copied += n;
+  }
+
+  return accountPart(numRead, len, total);
+}
+
+ssize_t
+_readvCoalesced(int fd, const struct iovec *iov, int iovcnt) {
+  int i, first = 0;
+  size_t used = 0;
+  ssize_t total = 0;
+
+  for (i = 0; i < iovcnt; ++i) {
+    /* the pending run of small iovecs is read before a large one, or when the
+     * buffer cannot take this iovec */
+    if (used > 0 && (iov[i].iov_len >= COALESCE_MIN_DIRECT || used + iov[i].iov_len > COALESCE_BUF_SIZE)) {
+      if (!readRun(fd, iov, first, i, used, &total)) {
+        return total;
+      }
+      used = 0;
+    }
+
+    if (iov[i].iov_len >= COALESCE_MIN_DIRECT) {
+      if (!accountPart(read(fd, iov[i].iov_base, iov[i].iov_len), iov[i].iov_len, &total)) {
+        return total;
+      }
+      continue;
+    }
+
+    if (used == 0) {
+      first = i;
+    }
+    used += iov[i].iov_len;
+  }
+
+  if (used > 0) {
+    readRun(fd, iov, first, iovcnt, used, &total);
+  }
+
+  return total;
+}
+
+ssize_t
+_writevCoalesced(int fd, const struct iovec *iov, int iovcnt) {
+  int i;
+  size_t used = 0;
+  ssize_t total = 0;
+
+  for (i = 0; i < iovcnt; ++i) {
+    if (used > 0 && (iov[i].iov_len >= COALESCE_MIN_DIRECT || used + iov[i].iov_len > COALESCE_BUF_SIZE)) {
+      if (!accountPart(write(fd, coalesceBuf, used), used, &total)) {
+        return total;
+      }
+      used = 0;
+    }
+
+    if (iov[i].iov_len >= COALESCE_MIN_DIRECT) {
+      if (!accountPart(write(fd, iov[i].iov_base, iov[i].iov_len), iov[i].iov_len, &total)) {
+        return total;
+      }
+      continue;
+    }
+
+    memcpy(coalesceBuf + used, iov[i].iov_base, iov[i].iov_len);
+    used += iov[i].iov_len;
+  }
+
+  if (used > 0) {
+    accountPart(write(fd, coalesceBuf, used), used, &total);
+  }
+
+  return total;
+}
+
+/* microseconds each of `iterations` calls of `fn` takes, transferring all of `iov`
+ * from the start of the file */
+double
+timeCalls(int fd, ssize_t (*fn)(int, const struct iovec *, int), const struct iovec *iov,
+          int iovcnt, size_t total, int iterations) {
+  struct timespec start, end;
+  int i;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < iterations; ++i) {
+    if (lseek(fd, 0, SEEK_SET) == -1) {
+      pexit("lseek");
+    }
+
+    if (fn(fd, iov, iovcnt) != (ssize_t) total) {
+      fatal("Short transfer during the benchmark.");
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  return ((end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3) / iterations;
+}
+
+int
+benchmark(void) {
+  static const int counts[] = { 1, 4, 16, 64, 256, 1024 };
+  static const size_t sizes[] = { 16, 256, 4096, 16384, 65536 };
+
+  int fd, c, z, i, iterations;
+  struct iovec iov[1024];
+  size_t total;
+  char *data;
+
+  fd = mkstemp(tmpFilePath);
+  if (fd == -1) {
+    pexit("open");
+  }
+  unlink(tmpFilePath);
+
+  data = malloc(1024 * 65536);
+  if (data == NULL) {
+    pexit("malloc");
+  }
+  memset(data, 'x', 1024 * 65536);
+
+  printf("microseconds per call (direct above %d bytes)\n", COALESCE_MIN_DIRECT);
+  printf("%6s %6s | %10s %10s %10s | %10s %10s %10s\n", "iovcnt", "size",
+         "writev", "_writev", "coalesced", "readv", "_readv", "coalesced");
+
+  for (c = 0; c < (int) (sizeof(counts) / sizeof(counts[0])); ++c) {
+    for (z = 0; z < (int) (sizeof(sizes) / sizeof(sizes[0])); ++z) {
+      total = counts[c] * sizes[z];
+      for (i = 0; i < counts[c]; ++i) {
+        iov[i].iov_base = data + i * sizes[z];
+        iov[i].iov_len = sizes[z];
+      }
+
+      /* about 64MiB go through each of the calls, with at least 20 iterations */
+      iterations = (int) ((64 * 1024 * 1024) / total);
+      if (iterations < 20) {
+        iterations = 20;
+      } else if (iterations > 100000) {
+        iterations = 100000;
+      }
+
+      if (ftruncate(fd, 0) == -1) {
+        pexit("ftruncate");
+      }
+
+      printf("%6d %6zu | %10.2f %10.2f %10.2f |", counts[c], sizes[z],
+             timeCalls(fd, writev, iov, counts[c], total, iterations),
+             timeCalls(fd, _writev, iov, counts[c], total, iterations),
+             timeCalls(fd, _writevCoalesced, iov, counts[c], total, iterations));
+      printf(" %10.2f %10.2f %10.2f\n",
+             timeCalls(fd, readv, iov, counts[c], total, iterations),
+             timeCalls(fd, _readv, iov, counts[c], total, iterations),
+             timeCalls(fd, _readvCoalesced, iov, counts[c], total, iterations));
+    }
+  }
+
+  free(data);
+  close(fd);
+
+  return EXIT_SUCCESS;
+}
+
 void
 pexit(const char *fCall) {
   perror(fCall);
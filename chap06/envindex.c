@@ -0,0 +1,283 @@
+/* envindex.c - Manages the process environment with a hash index of its names.
+ * See envindex.h.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#include <errno.h>
+#include <stdint.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "envindex.h"
+
+#define EI_EMPTY ((size_t) -1)
+
+extern char **environ;
+
+static char **vars;       /* what `environ` points to, NULL terminated */
+static char *owned;       /* whether each variable was allocated here */
+static size_t count, capacity;
+
+static size_t *index_;    /* slots of `vars`, or EI_EMPTY; open addressing */
+static size_t indexSize;  /* a power of two, at least twice `count` */
+
+/* the length of the name in a NAME=VALUE string */
+static size_t
+nameLength(const char *var) {
+  const char *eq = strchr(var, '=');
+
+  return (eq == NULL) ? strlen(var) : (size_t) (eq - var);
+}
+
+static uint64_t
+hashName(const char *name, size_t len) {
+  uint64_t h = 14695981039346656037ULL; /* FNV-1a */
+  size_t i;
+
+  for (i = 0; i < len; ++i) {
+    h = (h ^ (unsigned char) name[i]) * 1099511628211ULL;
+  }
+
+  return h;
+}
+
+/* the position in the index of the name `name` (`len` bytes long): where it is,
+ * or the empty position where it would go */
+static size_t
+findName(const char *name, size_t len) {
+  size_t pos = hashName(name, len) & (indexSize - 1);
+  const char *var;
+
+  while (index_[pos] != EI_EMPTY) {
+    var = vars[index_[pos]];
+    if (!strncmp(var, name, len) && (var[len] == '=' || var[len] == '\0')) {
+      break;
+    }
+
+    pos = (pos + 1) & (indexSize - 1);
+  }
+
+  return pos;
+}
+
+/* builds the index anew, with room for `size` positions */
+static int
+rebuildIndex(size_t size) {
+  size_t i, *newIndex;
+
+  newIndex = malloc(size * sizeof(size_t));
+  if (newIndex == NULL) {
+    return -1;
+  }
+
+  free(index_);
+  index_ = newIndex;
+  indexSize = size;
+
+  for (i = 0; i < indexSize; ++i) {
+    index_[i] = EI_EMPTY;
+  }
+
+  for (i = 0; i < count; ++i) {
+    index_[findName(vars[i], nameLength(vars[i]))] = i;
+  }
+
+  return 0;
+}
+
+/* makes room for one more variable, in the array and in the index */
+static int
+reserve(void) {
+  size_t newCapacity;
+  char **newVars, *newOwned;
+
+  if (count + 2 > capacity) {
+    newCapacity = 2 * capacity;
+
+    newVars = realloc(vars, newCapacity * sizeof(char *));
+    if (newVars == NULL) {
+      return -1;
+    }
+    vars = environ = newVars;
+
+    newOwned = realloc(owned, newCapacity);
+    if (newOwned == NULL) {
+      return -1;
+    }
+    owned = newOwned;
+
+    capacity = newCapacity;
+  }
+
+  if (2 * (count + 1) > indexSize) {
+    return rebuildIndex(2 * indexSize);
+  }
+
+  return 0;
+}
+
+int
+envIndexInit(void) {
+  size_t i, n, pos, size;
+
+  if (vars != NULL && environ == vars) {
+    return 0;
+  }
+
+  /* variables allocated here for the array replaced are leaked: `environ` could
+   * have been copied from it, and they could still be in use */
+  free(vars);
+  free(owned);
+  free(index_);
+  vars = NULL;
+  owned = NULL;
+  index_ = NULL;
+  count = indexSize = 0;
+
+  for (n = 0; environ != NULL && environ[n] != NULL; ++n)
+    ;
+
+  capacity = (n + 1 < 64) ? 64 : 2 * (n + 1);
+  for (size = 64; size < 2 * capacity; size *= 2)
+    ;
+
+  vars = malloc(capacity * sizeof(char *));
+  owned = calloc(capacity, 1);
+  index_ = malloc(size * sizeof(size_t));
+  if (vars == NULL || owned == NULL || index_ == NULL) {
+    return -1;
+  }
+
+  indexSize = size;
+  for (i = 0; i < indexSize; ++i) {
+    index_[i] = EI_EMPTY;
+  }
+
+  for (i = 0; i < n; ++i) {
+    pos = findName(environ[i], nameLength(environ[i]));
+    if (index_[pos] == EI_EMPTY) {
+      index_[pos] = count;
+      vars[count++] = environ[i];
+    }
+  }
+
+  vars[count] = NULL;
+  environ = vars;
+  return 0;
+}
+
+/* checks a name, and that the environment is the one indexed */
+static int
+prepare(const char *name) {
+  if (name == NULL || *name == '\0' || strchr(name, '=') != NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (vars == NULL || environ != vars) {
+    return envIndexInit();
+  }
+
+  return 0;
+}
+
+char *
+envIndexGet(const char *name) {
+  size_t len, pos;
+
+  if (prepare(name) == -1) {
+    return NULL;
+  }
+
+  len = strlen(name);
+  pos = findName(name, len);
+  return (index_[pos] == EI_EMPTY) ? NULL : vars[index_[pos]] + len + 1;
+}
+
+int
+envIndexSet(const char *name, const char *value, int overwrite) {
+  size_t len, valueLen, pos;
+  char *var;
+
+  if (prepare(name) == -1 || reserve() == -1) {
+    return -1;
+  }
+
+  len = strlen(name);
+  pos = findName(name, len);
+  if (index_[pos] != EI_EMPTY && !overwrite) {
+    return 0;
+  }
+
+  valueLen = strlen(value);
+  var = malloc(len + valueLen + 2);
+  if (var == NULL) {
+    return -1;
+  }
+
+  memcpy(var, name, len);
+  var[len] = '=';
+  memcpy(var + len + 1, value, valueLen + 1);
+
+  if (index_[pos] != EI_EMPTY) {
+    if (owned[index_[pos]]) {
+      free(vars[index_[pos]]);
+    }
+  } else {
+    index_[pos] = count++;
+    vars[count] = NULL;
+  }
+
+  vars[index_[pos]] = var;
+  owned[index_[pos]] = 1;
+  return 0;
+}
+
+int
+envIndexUnset(const char *name) {
+  size_t len, pos, slot, next, home;
+
+  if (prepare(name) == -1) {
+    return -1;
+  }
+
+  len = strlen(name);
+  pos = findName(name, len);
+  if (index_[pos] == EI_EMPTY) {
+    return 0;
+  }
+
+  /* removes the name from the index, moving back the names after it which
+   * would not be found past the hole left otherwise */
+  slot = index_[pos];
+  index_[pos] = EI_EMPTY;
+  for (next = (pos + 1) & (indexSize - 1); index_[next] != EI_EMPTY; next = (next + 1) & (indexSize - 1)) {
+    home = hashName(vars[index_[next]], nameLength(vars[index_[next]])) & (indexSize - 1);
+
+    /* whether `home` is cyclically in (pos, next]: then it stays */
+    if ((next > pos) ? (home > pos && home <= next) : (home > pos || home <= next)) {
+      continue;
+    }
+
+    index_[pos] = index_[next];
+    index_[next] = EI_EMPTY;
+    pos = next;
+  }
+
+  if (owned[slot]) {
+    free(vars[slot]);
+  }
+
+  /* the last variable takes the slot */
+  --count;
+  if (slot != count) {
+    vars[slot] = vars[count];
+    owned[slot] = owned[count];
+    index_[findName(vars[slot], nameLength(vars[slot]))] = slot;
+  }
+  vars[count] = NULL;
+
+  return 0;
+}
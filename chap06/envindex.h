@@ -0,0 +1,48 @@
+/* envindex.h - Manages the process environment with a hash index of its names.
+ *
+ * getenv(3), putenv(3), setenv(3) and unsetenv(3) all scan `environ` from the
+ * start, comparing names: building an environment of n variables one at a time
+ * takes time quadratic in n - and unsetting a variable scans all of it, as it
+ * could be defined more than once.
+ *
+ * The functions here keep the environment in an array of their own, which
+ * `environ` points to, along with a hash index from each name to its slot in the
+ * array: getting, setting and unsetting a variable take constant time, on
+ * average. Names are never defined more than once (duplicates found in the
+ * environment taken over are dropped, keeping the first definition, the one
+ * getenv(3) returns), so unsetting one is a lookup. The slot of an unset variable
+ * is taken by the last one, so the order of the environment is not kept.
+ *
+ * All changes to the environment must then be made with these functions. If
+ * `environ` is found to point elsewhere (after a call to setenv(3) or putenv(3),
+ * or an assignment to it), the environment it points to is taken over again,
+ * and indexed anew.
+ *
+ * Programs using it are built along with envindex.c:
+ *
+ *    $ gcc -o setenv_unsetenv setenv_unsetenv.c envindex.c
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#ifndef ENVINDEX_H
+#define ENVINDEX_H
+
+/* takes over the environment `environ` points to, indexing it. Called by the
+ * other functions when needed: calling it first is only a way of building the
+ * index up front. Returns 0 on success, -1 on error (with errno set) */
+int envIndexInit(void);
+
+/* the value of the variable `name`, or NULL if it is not defined */
+char *envIndexGet(const char *name);
+
+/* defines the variable `name` with `value` (a copy is made), replacing its value
+ * if already defined, unless `overwrite` is zero. Returns 0 on success, -1 on
+ * error (with errno set), as setenv(3) does */
+int envIndexSet(const char *name, const char *value, int overwrite);
+
+/* removes the variable `name` from the environment, if defined. Returns 0 on
+ * success, -1 on error (with errno set), as unsetenv(3) does */
+int envIndexUnset(const char *name);
+
+#endif
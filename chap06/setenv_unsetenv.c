@@ -9,13 +9,15 @@
  *
  * Usage
  *
- *    $ ./setenv_unsetenv [-s NAME=VALUE] [-u NAME] [-g NAME]
+ *    $ ./setenv_unsetenv [-s NAME=VALUE] [-u NAME] [-g NAME] [-b COUNT]
  *
  *    Options:
  *      s - sets an environment variable. Takes an argument of the form NAME=VALUE. Note
  *          that consecutive set arguments will overwrite the previous values.
  *      u - unsets the environment variable with the passed name.
  *      g - gets the value of an environment variable.
+ *      b - builds an environment of COUNT variables and takes it apart again, with the
+ *          functions here and with those of envindex.h, and shows how long each took.
  *
  * Example
  *
@@ -26,18 +28,31 @@
  *    Env var NAME value: Renato
  *    Env var CODE is not set.
  *
+ *    $ ./setenv_unsetenv -b 20000
+ *
+ * Both functions here scan the whole environment (getenv(3) and putenv(3) do), so building
+ * an environment takes time quadratic in its size. envindex.h keeps an index of names
+ * instead, taking constant time per variable.
+ *
+ * Built along with envindex.c:
+ *
+ *    $ gcc -o setenv_unsetenv setenv_unsetenv.c envindex.c
+ *
  * Author: Renato Mascarenhas Costa
  */
 
-#define _XOPEN_SOURCE /* getopt function */
+#define _XOPEN_SOURCE 600 /* getopt function, clock_gettime */
 
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "envindex.h"
+
 #ifndef SU_BUF_SIZ
 #define SU_BUF_SIZ 1024
 #endif
@@ -62,6 +77,9 @@ int getEnvValue(char *env, char *buf);
 int _setenv(const char *envname, const char *envval, int overwrite);
 int _unsetenv(const char *envname);
 
+/* Sets and unsets `count` variables with each implementation, and prints the time taken. */
+void benchmark(long count);
+
 extern char **environ;
 
 int
@@ -75,7 +93,7 @@ main(int argc, char *argv[]) {
   }
 
   opterr = 0;
-  while ((opt = getopt(argc, argv, "+s:u:g:")) != -1) {
+  while ((opt = getopt(argc, argv, "+s:u:g:b:")) != -1) {
     switch(opt) {
     case 's':
       if (getEnvName(optarg, name) == -1 || getEnvValue(optarg, value) == -1) {
@@ -112,6 +130,10 @@ main(int argc, char *argv[]) {
 
       break;
 
+    case 'b':
+      benchmark(atol(optarg));
+      break;
+
     case '?':
       helpAndLeave(argv[0], EXIT_FAILURE);
     }
@@ -130,7 +152,7 @@ helpAndLeave(const char *progname, int status) {
     stream = stderr;
   }
 
-  fprintf(stream, "Usage: %s [-s NAME=VALUE] [-g NAME]\n", progname);
+  fprintf(stream, "Usage: %s [-s NAME=VALUE] [-u NAME] [-g NAME] [-b COUNT]\n", progname);
   exit(status);
 }
 
@@ -235,3 +257,58 @@ _unsetenv(const char *envname) {
 
   return 0;
 }
+
+static double
+now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+benchmark(long count) {
+  char name[SU_BUF_SIZ];
+  double start, set, unset;
+  long i;
+
+  start = now();
+  for (i = 0; i < count; ++i) {
+    snprintf(name, SU_BUF_SIZ, "BENCH_VAR_%ld", i);
+    if (_setenv(name, "value", TRUE) == -1) {
+      pexit("_setenv");
+    }
+  }
+  set = now() - start;
+
+  start = now();
+  for (i = 0; i < count; ++i) {
+    snprintf(name, SU_BUF_SIZ, "BENCH_VAR_%ld", i);
+    if (_unsetenv(name) == -1) {
+      pexit("_unsetenv");
+    }
+  }
+  unset = now() - start;
+
+  printf("getenv/putenv: %ld variables set in %.3fs, unset in %.3fs\n", count, set, unset);
+
+  start = now();
+  for (i = 0; i < count; ++i) {
+    snprintf(name, SU_BUF_SIZ, "BENCH_VAR_%ld", i);
+    if (envIndexSet(name, "value", TRUE) == -1) {
+      pexit("envIndexSet");
+    }
+  }
+  set = now() - start;
+
+  start = now();
+  for (i = 0; i < count; ++i) {
+    snprintf(name, SU_BUF_SIZ, "BENCH_VAR_%ld", i);
+    if (envIndexUnset(name) == -1) {
+      pexit("envIndexUnset");
+    }
+  }
+  unset = now() - start;
+
+  printf("envindex:      %ld variables set in %.3fs, unset in %.3fs\n", count, set, unset);
+}
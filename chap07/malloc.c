@@ -1,18 +1,80 @@
-/* malloc.c - a malloc(3) and free(3) implementation.
+/* malloc.c - an implementation of the malloc(3) family of functions.
  *
- * This is an extremely simple implementation of the malloc(3) and free(3)
- * library functions, responsible for allocatiing memory from the heap to
- * a process.
+ * This is a simple implementation of the malloc(3), free(3), realloc(3),
+ * calloc(3) and posix_memalign(3) library functions (along with their
+ * obsolete aligned variants), responsible for allocatiing memory from the heap
+ * to a process.
  *
- * This implementation uses a very basic algorithm as described in
- * "The Linux Programming Interface" book, maintaining a doubly-linked list
- * of free memory blocks to reduce the number of brk(2) system calls.
- * Contiguous blocks of memory may be given back to the system if they
- * are larger than _MALLOC_MAX_FREE_BLK (which defaults to 128KB). Note that
- * critical issues such as thread-safety are not at all considered here, since
- * that completeness is not the goal here, obviously. This implementation
- * will be enough only for the most basic usages, and has a few glitches
- * on certain undetermined occasions.
+ * This implementation started out from the very basic algorithm described in
+ * "The Linux Programming Interface" book, maintaining a list of free memory
+ * blocks to reduce the number of brk(2) system calls. Free blocks are kept in
+ * segregated size-class bins, each one with its own doubly-linked free list:
+ * small blocks get one bin per exact size (in _MALLOC_ALIGNMENT steps) and
+ * larger blocks are grouped in power-of-two classes. A bitmap of non-empty bins
+ * allows finding a suitable block without walking every free list, so most
+ * allocations and frees are done in constant time.
+ *
+ * Every block carries its size both in a header and in a footer (boundary
+ * tags), along with a bit telling whether it is in use. That way, a block being
+ * freed can find out in constant time whether its physical neighbours are free
+ * as well, and coalesce with them. The free block adjacent to the program break
+ * (the "top" block) is tracked separately: it is used when no bin can fulfil
+ * a request, and is given back to the system when it is larger than
+ * _MALLOC_MAX_FREE_BLK (which defaults to 128KB).
+ *
+ * The heap grows and shrinks in steps of _MALLOC_HUGEPAGE_SIZE (2MB by default):
+ * the program break is always moved to a multiple of it, and the new memory is
+ * marked with MADV_HUGEPAGE, so that transparent hugepages can back the parts of
+ * the heap in use, and fewer TLB entries are needed to reach them. Growing the
+ * heap further than asked for costs nothing but address space, since pages are
+ * only backed by memory once they are touched.
+ *
+ * Free blocks in the middle of the heap cannot be given back to the system, but
+ * the pages they span can: the kernel drops them with madvise(2), and gives
+ * zeroed pages back if they are ever touched again. Free blocks spanning at least
+ * _MALLOC_PURGE_MIN bytes (64KB by default) of whole pages are kept on a list,
+ * ordered by the time they were freed, and purged once they stay free for
+ * _MALLOC_PURGE_DECAY_MS milliseconds (1 second by default) - blocks that are
+ * reused quickly never have their pages dropped and faulted back in. The same
+ * goes for the pages of the top block that were ever handed out. Purging
+ * happens as blocks are freed; malloc_trim(3) purges everything right away.
+ * MADV_DONTNEED is used by default, which lowers the resident set size at once;
+ * with _MALLOC_PURGE_LAZY defined, MADV_FREE is used instead, and the kernel
+ * only takes the pages when it runs short of memory.
+ *
+ * Requests of at least _MALLOC_MMAP_THRESHOLD bytes (128KB by default) are
+ * not served from the heap at all: each one of them gets its own anonymous
+ * mapping, which is unmapped as soon as it is freed. That way, large buffers
+ * do not get stuck below small long-lived blocks in the heap. Both thresholds
+ * can also be changed at runtime through mallopt(3), with the M_TRIM_THRESHOLD
+ * and M_MMAP_THRESHOLD parameters.
+ *
+ * The heap is shared by all threads and protected by a single lock. To keep
+ * threads from contending on it, each thread has its own small arena: a cache
+ * of recently freed blocks (up to _MALLOC_TCACHE_LIMIT bytes long), kept per
+ * size class and accessed without any locking. Whenever a cache bin runs empty,
+ * it is refilled with a batch of blocks taken from the shared heap with a
+ * single lock acquisition; when it gets full, half of it is given back to the
+ * heap in the same fashion. Cached blocks remain marked as in use, so they are
+ * never coalesced while in a cache. When a thread exits, its cache is flushed.
+ *
+ * realloc(3) avoids copying whenever it can: a block is grown in place by
+ * absorbing its next physical neighbour if that one is free (or if it is the top
+ * block, in which case the program break is moved if necessary), and mapped
+ * blocks are resized with mremap(2). calloc(3) keeps track of the heap memory
+ * that was never handed out, which the kernel guarantees to be zeroed, and only
+ * clears what might have been used before.
+ *
+ * A few counters are always kept: the size of the heap, the bytes in free
+ * blocks, the number of system calls made to get or give back memory, and how
+ * many allocations were made for each size class. These are cheap to maintain:
+ * heap counters are only updated with the heap lock held, and the histogram is
+ * kept in the thread caches. They can be retrieved through malloc_stats(3) and
+ * mallinfo2(3), and are printed to standard error when the process exits if
+ * the MALLOC_STATS environment variable is set.
+ *
+ * This implementation will be enough only for the most basic usages, and has a
+ * few glitches on certain undetermined occasions.
  *
  * You can test this implementation using the LD_PRELOAD environment
  * variable to override the malloc implementation with the one provided
@@ -23,26 +85,167 @@
 
 #define _BSD_SOURCE
 #define _POSIX_SOURCE
+#define _GNU_SOURCE /* mremap(2) */
 
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
 #include <signal.h>
+#include <time.h>
 
-#ifdef _MALLOC_DEBUG
-#  include <stdio.h>
-#  include <stdarg.h>
-#  include <string.h>
-#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
 
 #ifndef _MALLOC_MAX_FREE_BLK
 #  define _MALLOC_MAX_FREE_BLK (128 * 1024)
 #endif
 
+#ifndef _MALLOC_MMAP_THRESHOLD
+#  define _MALLOC_MMAP_THRESHOLD (128 * 1024)
+#endif
+
+#ifndef _MALLOC_TCACHE_COUNT
+#  define _MALLOC_TCACHE_COUNT (16)
+#endif
+
+/* the heap is grown and shrunk to a multiple of this size; 0 disables it */
+#ifndef _MALLOC_HUGEPAGE_SIZE
+#  define _MALLOC_HUGEPAGE_SIZE (2 * 1024 * 1024)
+#endif
+
+#ifndef _MALLOC_PURGE_MIN
+#  define _MALLOC_PURGE_MIN (64 * 1024)
+#endif
+
+#ifndef _MALLOC_PURGE_DECAY_MS
+#  define _MALLOC_PURGE_DECAY_MS (1000)
+#endif
+
+#ifdef _MALLOC_PURGE_LAZY
+#  define _MALLOC_PURGE_ADVICE (MADV_FREE)
+#else
+#  define _MALLOC_PURGE_ADVICE (MADV_DONTNEED)
+#endif
+
 #define _MALLOC_MAX_DEBUG_STR  (1024)
+#define _MALLOC_MAX_STATS_STR  (256)
 #define _MALLOC_HEADER_SIZE    (sizeof(size_t))
+#define _MALLOC_FOOTER_SIZE    (sizeof(size_t))
+#define _MALLOC_OVERHEAD       (_MALLOC_HEADER_SIZE + _MALLOC_FOOTER_SIZE)
 #define _MALLOC_POINTER_SIZE   (sizeof(void *))
 
-static char *_free_list = NULL;
+/* since block sizes are always aligned, the lower bits of the size information
+ * are free to be used as flags */
+#define _MALLOC_IN_USE         (0x1)
+#define _MALLOC_MMAPPED        (0x2)
+#define _MALLOC_PURGE_PENDING  (0x4) /* header only: the block is on the purge list */
+#define _MALLOC_FLAGS          (_MALLOC_IN_USE | _MALLOC_MMAPPED | _MALLOC_PURGE_PENDING)
+
+/* every block (metadata included) is a multiple of _MALLOC_ALIGNMENT bytes long,
+ * and blocks are placed so that the memory returned to the user is aligned to
+ * that same boundary. The smallest block must be able to hold the free list
+ * pointers when it is released */
+#define _MALLOC_ALIGNMENT      (2 * sizeof(size_t))
+#define _MALLOC_MIN_BLK_SIZE   (align_up(_MALLOC_OVERHEAD + 2 * _MALLOC_POINTER_SIZE))
+
+/* size classes: blocks smaller than _MALLOC_SMALL_LIMIT get one bin per
+ * possible size, so that any block found in one of those bins is an exact
+ * fit. Larger blocks are kept in power-of-two classes: the bin for class `k`
+ * holds blocks whose total size lies in [2^k, 2^(k+1)) */
+#define _MALLOC_SMALL_LIMIT    (1024)
+#define _MALLOC_SMALL_BINS     (_MALLOC_SMALL_LIMIT / _MALLOC_ALIGNMENT)
+#define _MALLOC_SMALL_LIMIT_LOG (10)
+#define _MALLOC_NBINS          (128)
+
+/* thread caches hold blocks whose total size is at most _MALLOC_TCACHE_LIMIT,
+ * one list per (exact) size class. Blocks move between a cache and the shared
+ * heap _MALLOC_TCACHE_BATCH at a time */
+#define _MALLOC_TCACHE_LIMIT   (512)
+#define _MALLOC_TCACHE_BINS    (_MALLOC_TCACHE_LIMIT / _MALLOC_ALIGNMENT + 1)
+#define _MALLOC_TCACHE_BATCH   (_MALLOC_TCACHE_COUNT / 2)
+
+#define _MALLOC_BITS_PER_WORD  (8 * sizeof(unsigned long))
+#define _MALLOC_BINMAP_WORDS   (_MALLOC_NBINS / _MALLOC_BITS_PER_WORD)
+
+static void *_bins[_MALLOC_NBINS];
+static unsigned long _binmap[_MALLOC_BINMAP_WORDS];
+
+/* the address where the heap managed by this allocator currently ends, and the
+ * free block adjacent to it, if any. The heap is delimited by a prologue footer
+ * and an epilogue header, both marked as in use, so that coalescing never has
+ * to check for the heap boundaries */
+static char *_heap_end = NULL;
+static void *_top = NULL;
+
+/* heap memory from this address on was never handed out to the user, and is
+ * therefore known to be zeroed (except for block metadata) */
+static char *_heap_clean = NULL;
+
+/* free blocks (in the bins) whose pages are yet to be purged, most recently
+ * freed first. Whether the top block has pages to be purged, and since when, is
+ * kept apart, since it moves every time it is sliced */
+static void *_purge_head = NULL;
+static void *_purge_tail = NULL;
+static int _top_dirty = 0;
+static unsigned long _top_freed_at = 0;
+
+/* tunables, see mallopt(3) */
+static size_t _trim_threshold = _MALLOC_MAX_FREE_BLK;
+static size_t _mmap_threshold = _MALLOC_MMAP_THRESHOLD;
+static size_t _page_size = 0;
+
+/* protects everything above: the bins, the heap boundaries and tunables */
+static pthread_mutex_t _heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef enum {
+	TCACHE_UNINITIALIZED = 0,
+	TCACHE_INITIALIZING,
+	TCACHE_ACTIVE,
+	TCACHE_DISABLED
+} tcache_state;
+
+struct thread_cache {
+	void *bins[_MALLOC_TCACHE_BINS];
+	unsigned int counts[_MALLOC_TCACHE_BINS];
+	tcache_state state;
+
+	/* allocations made by this thread, per size class. Active caches are
+	 * linked together so that statistics can be gathered */
+	unsigned long allocs[_MALLOC_NBINS];
+	struct thread_cache *next;
+};
+
+/* the initial-exec model makes sure accessing the cache never needs to allocate
+ * memory, which could happen with the dynamic TLS model used by shared
+ * libraries by default */
+static __thread struct thread_cache _tcache __attribute__((tls_model("initial-exec")));
+
+static pthread_key_t _tcache_key;
+static pthread_once_t _tcache_once = PTHREAD_ONCE_INIT;
+static struct thread_cache *_tcaches = NULL;
+
+/* allocator statistics. Heap related counters are protected by the heap lock;
+ * mapping related ones are updated atomically, since mapped blocks are handled
+ * without locking. Allocations made by threads without an active cache are
+ * counted in `allocs`, as well as those of caches that were already flushed */
+static struct {
+	size_t heap_size, heap_peak;
+	size_t free_bytes, free_blocks;
+	size_t mmapped_bytes, mmapped_blocks;
+	unsigned long sbrk_calls, mmap_calls, munmap_calls, mremap_calls;
+	unsigned long madvise_calls;
+	size_t purged_bytes;
+	unsigned long allocs[_MALLOC_NBINS];
+} _stats;
+
+#define stat_add(field, n) (__atomic_fetch_add(&_stats.field, (n), __ATOMIC_RELAXED))
+#define stat_sub(field, n) (__atomic_fetch_sub(&_stats.field, (n), __ATOMIC_RELAXED))
 
 #ifdef _MALLOC_DEBUG
 static void
@@ -61,18 +264,88 @@ static void
 debug(__attribute__((unused)) const char *format, ...) {}
 #endif
 
-/* adds size information at the start of a block */
+/* rounds the given size up to the next multiple of _MALLOC_ALIGNMENT */
+static size_t
+align_up(size_t size) {
+	return (size + _MALLOC_ALIGNMENT - 1) & ~(_MALLOC_ALIGNMENT - 1);
+}
+
+/* adds size information at the start of a block. The size is also replicated
+ * at the end of the block (the footer), so that the block following it can find
+ * it. Blocks are written as free */
 static void
 write_size(void *ptr, size_t size) {
 	size_t *sizep = ptr;
+	char *footer = ptr;
+
+	footer += _MALLOC_HEADER_SIZE + size;
 	*sizep = size;
+	*((size_t *) footer) = size;
 }
 
 /* reads the size of a block, which is located as metadata in its first bytes */
 static size_t
 read_size(void *ptr) {
 	size_t *sizep = ptr;
-	return *sizep;
+	return *sizep & ~_MALLOC_FLAGS;
+}
+
+/* the total size of a block, including its metadata */
+static size_t
+block_size(void *ptr) {
+	return _MALLOC_OVERHEAD + read_size(ptr);
+}
+
+static int
+mmapped(void *ptr) {
+	size_t *sizep = ptr;
+	return *sizep & _MALLOC_MMAPPED;
+}
+
+static int
+in_use(void *ptr) {
+	size_t *sizep = ptr;
+	return *sizep & _MALLOC_IN_USE;
+}
+
+/* sets the in-use bit of a block, both in its header and footer */
+static void
+mark_in_use(void *ptr) {
+	size_t *sizep = ptr;
+	char *footer = ptr;
+
+	footer += _MALLOC_HEADER_SIZE + read_size(ptr);
+	*sizep |= _MALLOC_IN_USE;
+	*((size_t *) footer) |= _MALLOC_IN_USE;
+}
+
+/* the physical neighbours of a block. The previous block is found through
+ * its footer, located right before the header of the given block */
+static void *
+next_block(void *ptr) {
+	char *p = ptr;
+	return p + block_size(ptr);
+}
+
+static int
+previous_in_use(void *ptr) {
+	size_t *footer = ptr;
+	return *(footer - 1) & _MALLOC_IN_USE;
+}
+
+static void *
+previous_block(void *ptr) {
+	size_t *footer = ptr;
+	char *p = ptr;
+
+	return p - (_MALLOC_OVERHEAD + (*(footer - 1) & ~_MALLOC_FLAGS));
+}
+
+/* heap boundaries: a zero-sized footer/header marked as in use */
+static void
+write_boundary(void *ptr) {
+	size_t *sizep = ptr;
+	*sizep = _MALLOC_IN_USE;
 }
 
 /* what follows are a set of helper functions to read and write the previous and
@@ -133,263 +406,1425 @@ get_base_address(void *ptr) {
 	return (sizep - 1);
 }
 
-/* the last free block is the one whose end is adjacent to the current program
- * break. When expanding the program break, it is useful to take into account
- * what is the condition of this block */
-static void *
-last_free_block() {
-	void *curr, *prev;
-	curr = _free_list;
+/* the size class of a block whose total size (metadata included) is `size` */
+static int
+bin_index(size_t size) {
+	int log;
+
+	if (size < _MALLOC_SMALL_LIMIT)
+		return size / _MALLOC_ALIGNMENT;
+
+	log = 8 * sizeof(size_t) - 1 - __builtin_clzl(size);
+	return _MALLOC_SMALL_BINS + (log - _MALLOC_SMALL_LIMIT_LOG);
+}
 
-	while (curr) {
-		prev = curr;
-		curr = get_next_free_block(prev);
+static void
+mark_bin(int idx) {
+	_binmap[idx / _MALLOC_BITS_PER_WORD] |= 1UL << (idx % _MALLOC_BITS_PER_WORD);
+}
+
+static void
+unmark_bin(int idx) {
+	_binmap[idx / _MALLOC_BITS_PER_WORD] &= ~(1UL << (idx % _MALLOC_BITS_PER_WORD));
+}
+
+/* finds the first non-empty bin whose index is equal to or larger than `idx`,
+ * returning -1 if there is none */
+static int
+next_nonempty_bin(int idx) {
+	int word = idx / _MALLOC_BITS_PER_WORD;
+	unsigned long bits = _binmap[word] & (~0UL << (idx % _MALLOC_BITS_PER_WORD));
+
+	for (;;) {
+		if (bits)
+			return word * _MALLOC_BITS_PER_WORD + __builtin_ctzl(bits);
+
+		if (++word == _MALLOC_BINMAP_WORDS)
+			return -1;
+
+		bits = _binmap[word];
 	}
+}
+
+/* the purge list links of a free block, stored right after its free list
+ * pointers. Only blocks large enough to be purged are ever on the list, so there
+ * is always room for them */
+struct purge_links {
+	void *previous, *next;
+	unsigned long freed_at;
+};
 
-	return prev;
+static struct purge_links *
+purge_links(void *ptr) {
+	char *p = ptr;
+	return (struct purge_links *) (p + _MALLOC_HEADER_SIZE + 2 * _MALLOC_POINTER_SIZE);
 }
 
-/* slice: takes a block of memory pointed by ptr and slice it, returning a
- * block of `size` bytes. `ptr` is required to be larger than the requested
- * size. All links in the free list are maintained and the block of memory
- * returned already skips size information */
-static void *
-slice(void *ptr, size_t size) {
-	void *previous_ptr = get_previous_free_block(ptr),
-	     *next_ptr     = get_next_free_block(ptr);
+static int
+purge_pending(void *ptr) {
+	size_t *sizep = ptr;
+	return *sizep & _MALLOC_PURGE_PENDING;
+}
 
-	size_t original_size = read_size(ptr);
-	if (original_size <= size)
-		return NULL;
+/* a coarse monotonic clock, in milliseconds, which is read without entering the
+ * kernel */
+static unsigned long
+now_ms() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+/* the whole pages between `from` and `to`. Returns whether they are worth
+ * purging */
+static int
+purge_range(char *from, char *to, char **start, char **end) {
+	if (!_page_size)
+		_page_size = sysconf(_SC_PAGESIZE);
+
+	*start = (char *) (((uintptr_t) from + _page_size - 1) & ~(_page_size - 1));
+	*end = (char *) ((uintptr_t) to & ~(_page_size - 1));
+
+	return *end > *start && (size_t) (*end - *start) >= _MALLOC_PURGE_MIN;
+}
 
+/* the pages of a free block that can be purged, leaving its metadata alone */
+static int
+block_purge_range(void *ptr, char **start, char **end) {
 	char *p = ptr;
-	char *base = ptr;
-	p += _MALLOC_HEADER_SIZE + size;
+
+	return purge_range(p + _MALLOC_HEADER_SIZE + 2 * _MALLOC_POINTER_SIZE + sizeof(struct purge_links),
+			p + _MALLOC_HEADER_SIZE + read_size(ptr), start, end);
+}
+
+static void
+purge_link(void *ptr) {
+	struct purge_links *links = purge_links(ptr);
+
+	links->previous = NULL;
+	links->next = _purge_head;
+	links->freed_at = now_ms();
+
+	if (_purge_head)
+		purge_links(_purge_head)->previous = ptr;
+	else
+		_purge_tail = ptr;
+
+	_purge_head = ptr;
+	*((size_t *) ptr) |= _MALLOC_PURGE_PENDING;
+}
+
+static void
+purge_unlink(void *ptr) {
+	struct purge_links *links = purge_links(ptr);
+
+	if (links->previous)
+		purge_links(links->previous)->next = links->next;
+	else
+		_purge_head = links->next;
+
+	if (links->next)
+		purge_links(links->next)->previous = links->previous;
+	else
+		_purge_tail = links->previous;
+
+	*((size_t *) ptr) &= ~_MALLOC_PURGE_PENDING;
+}
+
+/* gives the pages between `start` and `end` back to the kernel. Returns 0 on
+ * success and -1 on failure */
+static int
+purge_pages(char *start, char *end) {
+	int status;
+
+	debug("Purging %ld bytes at %p", (long) (end - start), start);
+	++_stats.madvise_calls;
+	status = madvise(start, end - start, _MALLOC_PURGE_ADVICE);
+
+#ifdef _MALLOC_PURGE_LAZY
+	/* MADV_FREE is only known to Linux 4.5 and later */
+	if (status == -1 && errno == EINVAL) {
+		++_stats.madvise_calls;
+		status = madvise(start, end - start, MADV_DONTNEED);
+	}
+#endif
+
+	if (status == 0)
+		_stats.purged_bytes += end - start;
+
+	return status;
+}
+
+/* purges the pages of the top block that were ever handed out. Pages dropped
+ * with MADV_DONTNEED read back as zeroes, so they count as never handed out
+ * afterwards */
+static void
+purge_top() {
+	char *p = _top, *clean_end, *start, *end;
+
+	_top_dirty = 0;
+	if (!_top)
+		return;
+
+	clean_end = p + _MALLOC_HEADER_SIZE + read_size(_top);
+	if (_heap_clean < clean_end)
+		clean_end = _heap_clean;
+
+	if (!purge_range(p + _MALLOC_HEADER_SIZE, clean_end, &start, &end) ||
+			purge_pages(start, end) == -1)
+		return;
+
+#ifndef _MALLOC_PURGE_LAZY
+	/* what was handed out past the last whole page is cleared by hand */
+	memset(end, 0, clean_end - end);
+	if (_heap_clean > start)
+		_heap_clean = start;
+#endif
+}
+
+/* purges the free blocks that stayed free for _MALLOC_PURGE_DECAY_MS, or all of
+ * them if `force` is set. Must be called with the heap lock held */
+static void
+purge_decayed(int force) {
+	unsigned long now;
+	char *start, *end;
+	void *p;
+
+	if (!_purge_tail && !_top_dirty)
+		return;
+
+	now = now_ms();
+	while ((p = _purge_tail) &&
+			(force || now - purge_links(p)->freed_at >= _MALLOC_PURGE_DECAY_MS)) {
+		purge_unlink(p);
+		if (block_purge_range(p, &start, &end))
+			purge_pages(start, end);
+	}
+
+	if (_top_dirty && (force || now - _top_freed_at >= _MALLOC_PURGE_DECAY_MS))
+		purge_top();
+}
+
+/* inserts a free block at the head of the bin matching its size. Blocks large
+ * enough to be purged go on the purge list as well */
+static void
+insert_free_block(void *ptr) {
+	int idx = bin_index(block_size(ptr));
+	void *head = _bins[idx];
+	char *start, *end;
+
+	set_previous_free_block(ptr, NULL);
+	set_next_free_block(ptr, head);
+	if (head)
+		set_previous_free_block(head, ptr);
+
+	_bins[idx] = ptr;
+	mark_bin(idx);
+
+	if (block_purge_range(ptr, &start, &end))
+		purge_link(ptr);
+
+	_stats.free_bytes += block_size(ptr);
+	++_stats.free_blocks;
+}
+
+/* removes a block from the free list of its bin, keeping all links consistent */
+static void
+remove_free_block(void *ptr) {
+	int idx = bin_index(block_size(ptr));
+	void *previous_ptr = get_previous_free_block(ptr),
+	     *next_ptr     = get_next_free_block(ptr);
+
 	if (previous_ptr)
-		set_next_free_block(previous_ptr, p);
+		set_next_free_block(previous_ptr, next_ptr);
 	else
-		_free_list = p;
+		_bins[idx] = next_ptr;
 
 	if (next_ptr)
-		set_previous_free_block(next_ptr, p);
+		set_previous_free_block(next_ptr, previous_ptr);
+
+	if (!_bins[idx])
+		unmark_bin(idx);
+
+	if (purge_pending(ptr))
+		purge_unlink(ptr);
+
+	_stats.free_bytes -= block_size(ptr);
+	--_stats.free_blocks;
+}
 
-	write_size(ptr, size);
-	write_size(p, original_size - size - _MALLOC_HEADER_SIZE);
-	set_previous_free_block(p, previous_ptr);
-	set_next_free_block(p, next_ptr);
+/* split: takes a block of memory pointed by ptr (which must not be in any free
+ * list) and slice it, returning a block of `size` bytes (metadata included)
+ * marked as in use. `ptr` is required to be at least as large as the requested
+ * size. If what remains is large enough to be a block on its own, it is split
+ * off and returned in `rest`; otherwise, `rest` is set to NULL. The block of
+ * memory returned already skips size information */
+static void *
+split(void *ptr, size_t size, void **rest) {
+	size_t original_size = block_size(ptr);
+	char *base = ptr;
+
+	*rest = NULL;
+	if (original_size - size >= _MALLOC_MIN_BLK_SIZE) {
+		write_size(ptr, size - _MALLOC_OVERHEAD);
+		write_size(base + size, original_size - size - _MALLOC_OVERHEAD);
+		*rest = base + size;
+	}
 
+	mark_in_use(ptr);
 	return (base + _MALLOC_HEADER_SIZE);
 }
 
-/* returns the address of the last position of the given memory block */
+/* slices a block taken from the bins. Since free blocks are always coalesced,
+ * whatever remains is surrounded by blocks in use and goes back to the bins */
 static void *
-end_address(void *ptr) {
-	char *p = ptr;
-	return (p + _MALLOC_HEADER_SIZE + read_size(ptr));
+slice(void *ptr, size_t size) {
+	void *rest, *user_ptr;
+
+	user_ptr = split(ptr, size, &rest);
+	if (rest)
+		insert_free_block(rest);
+
+	return user_ptr;
 }
 
-/* checks if the two given memory block pointers are continuous */
-static int
-continuous(void *ptr1, void *ptr2) {
-	return end_address(ptr1) == ptr2;
+/* slices the top block. What remains (if anything) becomes the new top block */
+static void *
+slice_top(size_t size) {
+	void *rest, *user_ptr;
+
+	user_ptr = split(_top, size, &rest);
+	_top = rest;
+
+	return user_ptr;
 }
 
-/* coalesces two memory blocks (assumed to be continuous) and updates related
- * metadata */
-static void
-coalesce(void *ptr1, void *ptr2) {
-	size_t new_size = read_size(ptr1) + _MALLOC_HEADER_SIZE + read_size(ptr2);
-	write_size(ptr1, new_size);
+/* rounds an address up to the next hugepage boundary */
+static char *
+huge_align_up(char *p) {
+	if (!_MALLOC_HUGEPAGE_SIZE)
+		return p;
+
+	return (char *) (((uintptr_t) p + _MALLOC_HUGEPAGE_SIZE - 1) &
+			~((uintptr_t) _MALLOC_HUGEPAGE_SIZE - 1));
 }
 
-/* checks if the last free block in the free memory list is larger than the
- * allowed _MALLOC_MAX_FREE_BLK, in which case memory is given back to the
- * system, reducing the process' memory footprint */
+/* checks if the top block is larger than the allowed trim threshold, in
+ * which case memory is given back to the system, reducing the process' memory
+ * footprint */
 static void
 check_footprint() {
-	void *last = last_free_block(),
-	     *prev = get_previous_free_block(last);
+	size_t size;
+	char *page_end, *cut, *top = _top;
+
+	if (!_top || block_size(_top) < _trim_threshold)
+		return;
 
-	size_t last_size = read_size(last);
+	/* some other piece of code moved the program break; it is not safe to
+	 * shrink it anymore */
+	if (sbrk(0) != _heap_end)
+		return;
+
+	/* the heap only shrinks down to a hugepage boundary, so that the hugepages
+	 * below it can stay whole. Whatever is left of the top block must still be
+	 * large enough to be a block on its own */
+	cut = huge_align_up(top + _MALLOC_HEADER_SIZE);
+	if (cut != top + _MALLOC_HEADER_SIZE &&
+			(size_t) (cut - top) < _MALLOC_MIN_BLK_SIZE + _MALLOC_HEADER_SIZE)
+		cut += _MALLOC_HUGEPAGE_SIZE;
+
+	if (cut >= _heap_end || (size = _heap_end - cut) < _trim_threshold)
+		return;
 
-	if (last_size >= _MALLOC_MAX_FREE_BLK) {
-		if (prev)
-			set_next_free_block(prev, NULL);
+	debug("Giving %ld bytes back to the system", (long) size);
+	++_stats.sbrk_calls;
+	if (sbrk(-1 * size) == (void *) -1)
+		return;
+
+	_stats.heap_size -= size;
 
-		sbrk(-1 * (last_size + _MALLOC_HEADER_SIZE));
+	if (cut == top + _MALLOC_HEADER_SIZE) {
+		/* the top block header is now the heap epilogue */
+		write_boundary(_top);
+		_top = NULL;
+		_top_dirty = 0;
+	} else {
+		write_size(_top, cut - top - _MALLOC_HEADER_SIZE - _MALLOC_OVERHEAD);
+		write_boundary(cut - _MALLOC_HEADER_SIZE);
 	}
+
+	_heap_end = cut;
+
+	/* whatever is left beyond the new program break in its last page is not
+	 * released by the kernel, and will not be zeroed when the heap grows again */
+	if (!_page_size)
+		_page_size = sysconf(_SC_PAGESIZE);
+
+	page_end = (char *) (((uintptr_t) _heap_end + _page_size - 1) & ~(_page_size - 1));
+	if (_heap_clean > page_end)
+		_heap_clean = page_end;
 }
 
 static void
 print_free_list() {
 #ifdef _MALLOC_DEBUG
-	void *p = _free_list;
+	void *p;
+	int idx;
 	char list[_MALLOC_MAX_DEBUG_STR], node[_MALLOC_MAX_DEBUG_STR];
 
-	snprintf(list, _MALLOC_MAX_DEBUG_STR, "FL:");
+	snprintf(list, _MALLOC_MAX_DEBUG_STR, "FL: [top %p S=%ld]", _top,
+			_top ? (long) read_size(_top) : 0L);
 
-	while (p) {
-		strncat(list, " -> ", _MALLOC_MAX_DEBUG_STR);
-		snprintf(node, _MALLOC_MAX_DEBUG_STR, "[%p S=%ld P=%p N=%p]",
-				p, read_size(p), get_previous_free_block(p), get_next_free_block(p));
-		strncat(list, node, _MALLOC_MAX_DEBUG_STR);
+	for (idx = next_nonempty_bin(0); idx != -1; idx = next_nonempty_bin(idx + 1)) {
+		snprintf(node, _MALLOC_MAX_DEBUG_STR, " {%d}", idx);
+		strncat(list, node, _MALLOC_MAX_DEBUG_STR - strlen(list) - 1);
+
+		for (p = _bins[idx]; p; p = get_next_free_block(p)) {
+			strncat(list, " -> ", _MALLOC_MAX_DEBUG_STR - strlen(list) - 1);
+			snprintf(node, _MALLOC_MAX_DEBUG_STR, "[%p S=%ld P=%p N=%p]",
+					p, read_size(p), get_previous_free_block(p), get_next_free_block(p));
+			strncat(list, node, _MALLOC_MAX_DEBUG_STR - strlen(list) - 1);
+		}
 
-		p = get_next_free_block(p);
+		if (idx == _MALLOC_NBINS - 1)
+			break;
 	}
 
 	debug(list);
 #endif
 }
 
-void *
-malloc(size_t size) {
-	char *breakp;
+/* looks for a free block of at least `size` bytes (metadata included) in the
+ * bins, removing it from its free list. Returns NULL if there is none */
+static void *
+find_free_block(size_t size) {
+	int idx = bin_index(size);
+	void *p;
+
+	/* blocks in the small bins are an exact fit, and so is the head of
+	 * any larger bin. Within a power-of-two class, however, block sizes vary
+	 * and the bin must be searched for a large enough block */
+	if (size >= _MALLOC_SMALL_LIMIT) {
+		for (p = _bins[idx]; p; p = get_next_free_block(p)) {
+			if (block_size(p) >= size) {
+				remove_free_block(p);
+				return p;
+			}
+		}
 
-	/* SUSv3 allows an implementation to return either NULL or a small
-	 * memory block in this situation. We follow the latter, which is
-	 * the behavior implemented on Linux */
-	if (size == 0)
-		size = 1;
+		++idx;
+	}
 
-	debug("Malloc request of size %ld", (long) size);
+	if (idx >= _MALLOC_NBINS || (idx = next_nonempty_bin(idx)) == -1)
+		return NULL;
 
-	if (!_free_list) {
-		debug("No free list found, creating one of size %ld", (long) 2 * size);
+	p = _bins[idx];
+	remove_free_block(p);
+	return p;
+}
 
-		/* if there is no free list (i.e., the first call of the function
-		 * in the process life), we allocate twice as much memory as
-		 * requested as an attempt to avoid further system calls */
-		breakp = sbrk(2 * size + _MALLOC_HEADER_SIZE);
-		if (breakp == (void *) -1)
-			return NULL;
+static void
+heap_grown(size_t increase) {
+	_stats.heap_size += increase;
+	if (_stats.heap_size > _stats.heap_peak)
+		_stats.heap_peak = _stats.heap_size;
+}
 
-		_free_list = breakp;
-		write_size(_free_list, 2 * size);
-		set_previous_free_block(_free_list, NULL);
-		set_next_free_block(_free_list, NULL);
-	}
+/* moves the program break `increase` bytes up, and then some more, up to the
+ * next hugepage boundary; the extra bytes are returned in `extra`. Whole
+ * hugepages among the new memory are marked as such. Returns 0 on success and -1
+ * on failure */
+static int
+grow_break(char *breakp, size_t increase, size_t *extra) {
+	char *start, *end;
 
-	print_free_list();
+	*extra = huge_align_up(breakp + increase) - (breakp + increase);
 
-	/* look for a suitable free block of memory to be used. Note that, for
-	 * simplicity sake, the search uses a first-fit fashion algorithm, returning
-	 * the first block of memory large enough to fulfil the request. */
-	char *p = _free_list;
-	while (p) {
-		if (read_size(p) > size + _MALLOC_HEADER_SIZE)
-			return slice(p, size);
+	debug("Expanding program break by %ld bytes", (long) (increase + *extra));
+	++_stats.sbrk_calls;
+	if (sbrk(increase + *extra) == (void *) -1) {
+		if (!*extra) {
+			debug("Fail to increase program break");
+			return -1;
+		}
 
-		p = get_next_free_block(p);
+		/* the extra bytes might be just what goes over RLIMIT_DATA */
+		*extra = 0;
+		++_stats.sbrk_calls;
+		if (sbrk(increase) == (void *) -1) {
+			debug("Fail to increase program break");
+			return -1;
+		}
 	}
 
+	heap_grown(increase + *extra);
 
-	/* if we get to this point, it means there was no large enough memory block
-	 * that could fulfil the request. In this case, we move the program break,
-	 * increasing the memory footprint of the process */
-	void *last = last_free_block();
-	size_t last_size = read_size(last),
-	       break_increase = 2 * size + _MALLOC_HEADER_SIZE;
-
-	debug("No large enough free block, expanding program break by %ld bytes.", (long) break_increase);
-	if (sbrk(break_increase) == (void *) -1) {
-		debug("Fail to increase program break");
-		return NULL;
+	start = huge_align_up(breakp);
+	end = breakp + increase + *extra;
+	if (_MALLOC_HUGEPAGE_SIZE && (size_t) (end - start) >= _MALLOC_HUGEPAGE_SIZE) {
+		end = start + ((end - start) & ~((uintptr_t) _MALLOC_HUGEPAGE_SIZE - 1));
+		++_stats.madvise_calls;
+		madvise(start, end - start, MADV_HUGEPAGE);
 	}
 
-	write_size(last, last_size + break_increase);
-	return slice(last, size);
+	return 0;
 }
 
-void
-free(void *ptr) {
-	/* SUSv3 allows the pointer given to `free` to be NULL, in which case
-	 * nothing should be done */
-	if (!ptr)
-		return;
+/* moves the program break so that the top block is at least `size` bytes
+ * long (metadata included). Returns 0 on success and -1 on failure */
+static int
+expand_heap(size_t size) {
+	char *breakp;
+	size_t increase, pad, extra;
 
-	/* if the free list was not created yet, this means that the memory block
-	 * passed to this function was not obtained through malloc, and indicates
-	 * memory corruption. We indicate that by sending the current process
-	 * a SIGSEGV signal */
-	if (!_free_list) {
-		debug("Memory block not allocated by malloc");
-		kill(getpid(), SIGSEGV);
+	breakp = sbrk(0);
+	if (breakp == (void *) -1)
+		return -1;
+
+	if (_heap_end && breakp == _heap_end) {
+		/* the heap is still contiguous: the current epilogue becomes the header
+		 * of the new memory, which is merged with the top block, if any */
+		increase = _top ? size - block_size(_top) : size;
+
+		if (grow_break(breakp, increase, &extra) == -1)
+			return -1;
+
+		increase += extra;
+		size += extra;
+
+		/* the footer of the top block and the old epilogue end up in the
+		 * middle of the new top block, and are cleared so that the new memory
+		 * can still be handed out as zeroed */
+		if (_top)
+			memset(_heap_end - _MALLOC_OVERHEAD, 0, _MALLOC_OVERHEAD);
+		else
+			_top = _heap_end - _MALLOC_HEADER_SIZE;
+
+		write_size(_top, size - _MALLOC_OVERHEAD);
+		_heap_end += increase;
+		write_boundary(_heap_end - _MALLOC_HEADER_SIZE);
+
+		return 0;
 	}
 
-	void *base_address = get_base_address(ptr), *p;
-	size_t blk_size = read_size(base_address);
+	/* either this is the first call, or some other piece of code moved the
+	 * program break. A new heap region is started, with its own prologue and
+	 * epilogue, aligned such that the memory handed to the user is aligned as
+	 * well */
+	pad = align_up((uintptr_t) breakp) - (uintptr_t) breakp;
+	increase = pad + _MALLOC_FOOTER_SIZE + size + _MALLOC_HEADER_SIZE;
 
-	debug("Free request for block of size %ld", (long) blk_size);
-	print_free_list();
+	debug("Starting new heap region");
+	if (grow_break(breakp, increase, &extra) == -1)
+		return -1;
 
-	/* we must find where to insert the given memory block in the existing
-	 * free list, keeping in mind that the list should be in the same ordered
-	 * that the actual memory is (virtual memory-wise, of course). */
-	void *curr = _free_list, *prev = NULL;
-	while (curr && curr < base_address) {
-		prev = curr;
-		curr = get_next_free_block(prev);
-	}
-
-	/* here, we either got to the end of the free list, or found out the
-	 * blocks between which the new block should be inserted */
-	if (prev) {
-		if (curr) {
-			/* prev -> ptr -> curr */
-			debug("Freed block being inserted in the middle of the free list");
-
-			if (continuous(prev, base_address)) {
-				coalesce(prev, base_address);
-			} else if (continuous(base_address, curr)) {
-				coalesce(base_address, curr);
-
-				set_next_free_block(prev, base_address);
-				set_previous_free_block(base_address, prev);
-				set_next_free_block(base_address, get_next_free_block(curr));
-
-				check_footprint();
-			} else {
-				set_next_free_block(prev, base_address);
-				set_previous_free_block(curr, base_address);
-
-				set_previous_free_block(base_address, prev);
-				set_next_free_block(base_address, curr);
-			}
-		} else {
-			/* prev -> ptr */
-			debug("Appending freed block at the end of the list");
-			if (continuous(prev, base_address)) {
-				coalesce(prev, base_address);
-				check_footprint();
-
-			} else {
-				set_next_free_block(prev, base_address);
-				set_previous_free_block(base_address, prev);
-				set_next_free_block(base_address, NULL);
-			}
-		}
-	} else {
-		/* free_list = ptr -> curr */
-		debug("Freed block should be the new free list head pointer");
-		if (continuous(base_address, curr)) {
-			debug("actually joined with current head");
-			coalesce(base_address, curr);
+	size += extra;
 
-			p = get_next_free_block(curr);
-			if (p)
-				set_previous_free_block(p, base_address);
+	if (_top)
+		insert_free_block(_top);
 
-			set_previous_free_block(base_address, NULL);
-			set_next_free_block(base_address, p);
+	breakp += pad;
+	_heap_clean = breakp;
+	write_boundary(breakp);
+	breakp += _MALLOC_FOOTER_SIZE;
 
-			check_footprint();
+	_top = breakp;
+	write_size(_top, size - _MALLOC_OVERHEAD);
+	_heap_end = breakp + size + _MALLOC_HEADER_SIZE;
+	write_boundary(_heap_end - _MALLOC_HEADER_SIZE);
 
-		} else {
-			set_previous_free_block(curr, base_address);
-			set_previous_free_block(base_address, NULL);
-			set_next_free_block(base_address, curr);
-		}
+	return 0;
+}
 
-		_free_list = base_address;
+/* large blocks are placed in their own anonymous mapping. The word right before
+ * the header (where a footer of a previous block would be) stores the distance
+ * between the start of the mapping and the header, so that the whole mapping
+ * can be released later. No footer is needed since these blocks are never
+ * coalesced */
+static void *
+map_block(size_t size) {
+	size_t length;
+	char *p;
+
+	if (!_page_size)
+		_page_size = sysconf(_SC_PAGESIZE);
+
+	length = size + _MALLOC_FOOTER_SIZE + _MALLOC_HEADER_SIZE;
+	length = (length + _page_size - 1) & ~(_page_size - 1);
+
+	debug("Mapping %ld bytes for large block", (long) length);
+	stat_add(mmap_calls, 1);
+	p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		debug("Fail to map memory");
+		return NULL;
 	}
+
+	stat_add(mmapped_bytes, length);
+	stat_add(mmapped_blocks, 1);
+
+	*((size_t *) p) = _MALLOC_FOOTER_SIZE;
+	p += _MALLOC_FOOTER_SIZE;
+	*((size_t *) p) = (length - _MALLOC_FOOTER_SIZE - _MALLOC_HEADER_SIZE) |
+		_MALLOC_IN_USE | _MALLOC_MMAPPED;
+
+	return p + _MALLOC_HEADER_SIZE;
+}
+
+static void
+unmap_block(void *ptr) {
+	size_t offset = *((size_t *) ptr - 1),
+	       length = offset + _MALLOC_HEADER_SIZE + read_size(ptr);
+	char *p = ptr;
+
+	debug("Unmapping large block of size %ld", (long) read_size(ptr));
+	stat_add(munmap_calls, 1);
+	stat_sub(mmapped_bytes, length);
+	stat_sub(mmapped_blocks, 1);
+
+	munmap(p - offset, length);
+}
+
+/* finds or creates a block of `blk_size` bytes (metadata included) in the
+ * shared heap */
+static void *
+heap_take(size_t blk_size) {
+	void *p;
+
+	print_free_list();
+
+	p = find_free_block(blk_size);
+	if (p)
+		return slice(p, blk_size);
+
+	if (_top && block_size(_top) >= blk_size)
+		return slice_top(blk_size);
+
+	/* if we get to this point, it means there was no large enough memory block
+	 * that could fulfil the request. In this case, we move the program break,
+	 * increasing the memory footprint of the process. Twice as much memory
+	 * as requested is allocated as an attempt to avoid further system calls */
+	debug("No large enough free block found");
+	if (expand_heap(2 * blk_size) == -1)
+		return NULL;
+
+	return slice_top(blk_size);
+}
+
+/* moves the clean heap mark past a block being handed out to the user */
+static void
+mark_dirty(void *base_address) {
+	char *end = next_block(base_address);
+
+	if (end > _heap_clean)
+		_heap_clean = end;
+}
+
+/* allocates a block of `blk_size` bytes (metadata included) from the shared
+ * heap. If `dirty` is given, it is set to the number of bytes at the start of the
+ * block that might not be zeroed. Must be called with the heap lock held */
+static void *
+heap_alloc(size_t blk_size, size_t *dirty) {
+	char *p, *end;
+
+	if (!(p = heap_take(blk_size)))
+		return NULL;
+
+	end = p + read_size(get_base_address(p));
+	if (dirty)
+		*dirty = _heap_clean <= p ? 0 : (size_t) ((end < _heap_clean ? end : _heap_clean) - p);
+
+	mark_dirty(get_base_address(p));
+	return p;
+}
+
+/* gives a block back to the shared heap, coalescing it with its neighbours.
+ * Must be called with the heap lock held */
+static void
+heap_free(void *base_address) {
+	void *next, *p;
+
+	/* if the heap was not created yet, this means that the memory block
+	 * passed to this function was not obtained through malloc, and indicates
+	 * memory corruption */
+	if (!_heap_end) {
+		debug("Memory block not allocated by malloc");
+		kill(getpid(), SIGSEGV);
+	}
+
+	debug("Free request for block of size %ld", (long) read_size(base_address));
+	print_free_list();
+
+	/* the boundary tags tell whether the physical neighbours of the block are
+	 * free as well. Those are taken out of their bins and merged with the
+	 * block being freed, so that no two free blocks are ever adjacent */
+	next = next_block(base_address);
+	if (!previous_in_use(base_address)) {
+		debug("Coalescing with previous block");
+		base_address = previous_block(base_address);
+		remove_free_block(base_address);
+	}
+
+	if (next == _top) {
+		/* the header of the top block might lie in memory that was never
+		 * handed out, and is cleared so that it can be handed out as zeroed */
+		debug("Coalescing with the top block");
+		_top = NULL;
+		p = next;
+		next = next_block(p);
+		*((size_t *) p) = 0;
+	} else if (!in_use(next)) {
+		debug("Coalescing with next block");
+		remove_free_block(next);
+		next = next_block(next);
+	}
+
+	write_size(base_address, ((char *) next - (char *) base_address) -
+			_MALLOC_OVERHEAD);
+
+	/* a free block followed by the epilogue becomes the new top block */
+	if (next == _heap_end - _MALLOC_HEADER_SIZE) {
+		_top = base_address;
+		if (!_top_dirty) {
+			_top_dirty = 1;
+			_top_freed_at = now_ms();
+		}
+
+		check_footprint();
+	} else {
+		insert_free_block(base_address);
+	}
+
+	purge_decayed(0);
+}
+
+/* cuts a block in use down to `blk_size` bytes (metadata included), giving the
+ * rest back to the heap if it is large enough to be a block on its own. Must be
+ * called with the heap lock held */
+static void
+shrink_block(void *base_address, size_t blk_size) {
+	void *rest;
+
+	split(base_address, blk_size, &rest);
+	if (rest) {
+		mark_in_use(rest);
+		heap_free(rest);
+	}
+}
+
+/* called when a thread exits: every cached block goes back to the shared heap.
+ * Further allocations made by this thread (by other destructors, for instance)
+ * go straight to the heap */
+static void
+tcache_flush(void *arg) {
+	struct thread_cache *tcache = arg;
+	void *p;
+	int idx;
+
+	struct thread_cache **tc;
+
+	pthread_mutex_lock(&_heap_lock);
+	for (idx = 0; idx < (int) _MALLOC_TCACHE_BINS; ++idx) {
+		while ((p = tcache->bins[idx])) {
+			tcache->bins[idx] = *((void **) p);
+			heap_free(get_base_address(p));
+		}
+
+		tcache->counts[idx] = 0;
+	}
+
+	/* the allocation histogram of the thread is kept in the global counters */
+	for (tc = &_tcaches; *tc; tc = &(*tc)->next) {
+		if (*tc == tcache) {
+			*tc = tcache->next;
+			break;
+		}
+	}
+
+	for (idx = 0; idx < _MALLOC_NBINS; ++idx)
+		stat_add(allocs[idx], tcache->allocs[idx]);
+
+	tcache->state = TCACHE_DISABLED;
+	pthread_mutex_unlock(&_heap_lock);
+}
+
+/* the heap lock must not be held by some other thread while the process forks,
+ * or it would never be released in the child */
+static void
+lock_heap() {
+	pthread_mutex_lock(&_heap_lock);
+}
+
+static void
+unlock_heap() {
+	pthread_mutex_unlock(&_heap_lock);
+}
+
+static void
+tcache_setup() {
+	pthread_key_create(&_tcache_key, tcache_flush);
+	pthread_atfork(lock_heap, unlock_heap, unlock_heap);
+}
+
+/* checks whether the calling thread can use its cache, setting it up on first
+ * use. While that is done, allocations (which the pthread functions might do)
+ * bypass the cache */
+static int
+tcache_active() {
+	if (_tcache.state == TCACHE_UNINITIALIZED) {
+		_tcache.state = TCACHE_INITIALIZING;
+
+		pthread_once(&_tcache_once, tcache_setup);
+		if (pthread_setspecific(_tcache_key, &_tcache) == 0) {
+			pthread_mutex_lock(&_heap_lock);
+			_tcache.next = _tcaches;
+			_tcaches = &_tcache;
+			_tcache.state = TCACHE_ACTIVE;
+			pthread_mutex_unlock(&_heap_lock);
+		} else {
+			_tcache.state = TCACHE_DISABLED;
+		}
+	}
+
+	return _tcache.state == TCACHE_ACTIVE;
+}
+
+/* cached blocks are linked through the first word of their user memory; the
+ * pointers stored in the cache are the ones handed to the user */
+static void
+tcache_push(int idx, void *ptr) {
+	*((void **) ptr) = _tcache.bins[idx];
+	_tcache.bins[idx] = ptr;
+	++_tcache.counts[idx];
+}
+
+static void *
+tcache_pop(int idx) {
+	void *ptr = _tcache.bins[idx];
+
+	_tcache.bins[idx] = *((void **) ptr);
+	--_tcache.counts[idx];
+	return ptr;
+}
+
+static void *
+tcache_alloc(size_t blk_size) {
+	int i, idx = bin_index(blk_size);
+	void *p;
+
+	if (_tcache.bins[idx])
+		return tcache_pop(idx);
+
+	/* cache miss: take a batch of blocks from the heap at once */
+	pthread_mutex_lock(&_heap_lock);
+	for (i = 0; i < _MALLOC_TCACHE_BATCH; ++i) {
+		if (!(p = heap_alloc(blk_size, NULL)))
+			break;
+
+		tcache_push(idx, p);
+	}
+	pthread_mutex_unlock(&_heap_lock);
+
+	return _tcache.bins[idx] ? tcache_pop(idx) : NULL;
+}
+
+static void
+tcache_free(void *ptr, size_t blk_size) {
+	int i, idx = bin_index(blk_size);
+
+	if (_tcache.counts[idx] < _MALLOC_TCACHE_COUNT) {
+		tcache_push(idx, ptr);
+		return;
+	}
+
+	/* the cache is full: return a batch of blocks to the heap at once */
+	pthread_mutex_lock(&_heap_lock);
+	heap_free(get_base_address(ptr));
+	for (i = 0; i < _MALLOC_TCACHE_BATCH; ++i)
+		heap_free(get_base_address(tcache_pop(idx)));
+	pthread_mutex_unlock(&_heap_lock);
+}
+
+/* the total size of the block (metadata included) needed to hold `size` bytes.
+ * Returns 0 if the request is too large to ever be fulfilled */
+static size_t
+request_size(size_t size) {
+	size_t blk_size;
+
+	/* SUSv3 allows an implementation to return either NULL or a small
+	 * memory block in this situation. We follow the latter, which is
+	 * the behavior implemented on Linux */
+	if (size == 0)
+		size = 1;
+
+	/* requests that would overflow once metadata is accounted for can never
+	 * be fulfilled */
+	if (size > SIZE_MAX / 4) {
+		errno = ENOMEM;
+		return 0;
+	}
+
+	blk_size = align_up(size + _MALLOC_OVERHEAD);
+	if (blk_size < _MALLOC_MIN_BLK_SIZE)
+		blk_size = _MALLOC_MIN_BLK_SIZE;
+
+	return blk_size;
+}
+
+/* accounts for an allocation in the size class histogram */
+static void
+count_alloc(size_t blk_size) {
+	int idx = bin_index(blk_size);
+
+	if (tcache_active())
+		++_tcache.allocs[idx];
+	else
+		stat_add(allocs[idx], 1);
+}
+
+/* the allocation routine behind both malloc(3) and calloc(3). The meaning of
+ * `dirty` is the same as in heap_alloc; memory coming from the thread caches is
+ * always assumed to be dirty */
+static void *
+allocate(size_t size, size_t *dirty) {
+	size_t blk_size;
+	void *p;
+
+	debug("Malloc request of size %ld", (long) size);
+
+	if (!(blk_size = request_size(size)))
+		return NULL;
+
+	count_alloc(blk_size);
+	if (blk_size >= _mmap_threshold) {
+		if (dirty)
+			*dirty = 0;
+
+		return map_block(size);
+	}
+
+	if (blk_size <= _MALLOC_TCACHE_LIMIT && tcache_active()) {
+		p = tcache_alloc(blk_size);
+		if (dirty && p)
+			*dirty = read_size(get_base_address(p));
+
+		return p;
+	}
+
+	pthread_mutex_lock(&_heap_lock);
+	p = heap_alloc(blk_size, dirty);
+	pthread_mutex_unlock(&_heap_lock);
+
+	return p;
+}
+
+void *
+malloc(size_t size) {
+	return allocate(size, NULL);
+}
+
+void
+free(void *ptr) {
+	void *base_address;
+	size_t blk_size;
+
+	/* SUSv3 allows the pointer given to `free` to be NULL, in which case
+	 * nothing should be done */
+	if (!ptr)
+		return;
+
+	base_address = get_base_address(ptr);
+
+	/* a block which is not marked as in use was not obtained through malloc,
+	 * and indicates memory corruption. We indicate that by sending the
+	 * current process a SIGSEGV signal */
+	if (!in_use(base_address)) {
+		debug("Memory block not allocated by malloc");
+		kill(getpid(), SIGSEGV);
+	}
+
+	if (mmapped(base_address)) {
+		unmap_block(base_address);
+		return;
+	}
+
+	blk_size = block_size(base_address);
+	if (blk_size <= _MALLOC_TCACHE_LIMIT && tcache_active()) {
+		tcache_free(ptr, blk_size);
+		return;
+	}
+
+	pthread_mutex_lock(&_heap_lock);
+	heap_free(base_address);
+	pthread_mutex_unlock(&_heap_lock);
+}
+
+void *
+calloc(size_t nmemb, size_t size) {
+	size_t total, dirty;
+	void *p;
+
+	if (__builtin_mul_overflow(nmemb, size, &total)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	p = allocate(total, &dirty);
+	if (p && dirty)
+		memset(p, 0, dirty < total ? dirty : total);
+
+	return p;
+}
+
+/* tries to resize a heap block in place, returning whether it succeeded. Must
+ * be called with the heap lock held */
+static int
+heap_resize(void *base_address, size_t blk_size) {
+	size_t curr_size = block_size(base_address), needed;
+	void *next, *rest;
+
+	if (blk_size <= curr_size) {
+		shrink_block(base_address, blk_size);
+		return 1;
+	}
+
+	/* a block followed by the top block (or the epilogue) can always grow,
+	 * provided the program break can be moved. Just as in malloc, twice the
+	 * missing space is requested to avoid further system calls when the block
+	 * keeps growing */
+	needed = blk_size - curr_size;
+	next = next_block(base_address);
+	if ((next == _top || next == _heap_end - _MALLOC_HEADER_SIZE) &&
+			(!_top || block_size(_top) < needed)) {
+		if (expand_heap(2 * needed) == -1)
+			return 0;
+
+		next = next_block(base_address);
+	}
+
+	if (next == _top && block_size(_top) >= needed) {
+		debug("Growing block into the top block");
+		write_size(base_address, curr_size + block_size(_top) - _MALLOC_OVERHEAD);
+		split(base_address, blk_size, &rest);
+		_top = rest;
+		mark_dirty(base_address);
+
+		return 1;
+	}
+
+	if (next != _top && !in_use(next) && block_size(next) >= needed) {
+		debug("Growing block into next free block");
+		remove_free_block(next);
+		write_size(base_address, curr_size + block_size(next) - _MALLOC_OVERHEAD);
+		slice(base_address, blk_size);
+		mark_dirty(base_address);
+
+		return 1;
+	}
+
+	return 0;
+}
+
+/* mapped blocks are resized with mremap(2), which is able to move the pages
+ * around without copying the data. Blocks that shrink below the mmap threshold
+ * stay mapped */
+static void *
+remap_block(void *base_address, size_t size) {
+	size_t offset = *((size_t *) base_address - 1), length, old_length;
+	char *p = base_address;
+
+	length = size + _MALLOC_FOOTER_SIZE + _MALLOC_HEADER_SIZE;
+	length = (length + _page_size - 1) & ~(_page_size - 1);
+
+	debug("Remapping large block of size %ld to %ld bytes",
+			(long) read_size(base_address), (long) length);
+
+	old_length = offset + _MALLOC_HEADER_SIZE + read_size(base_address);
+	stat_add(mremap_calls, 1);
+	p = mremap(p - offset, old_length, offset + length - _MALLOC_FOOTER_SIZE, MREMAP_MAYMOVE);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	stat_add(mmapped_bytes, offset + length - _MALLOC_FOOTER_SIZE);
+	stat_sub(mmapped_bytes, old_length);
+
+	p += offset;
+	*((size_t *) p) = (length - _MALLOC_FOOTER_SIZE - _MALLOC_HEADER_SIZE) |
+		_MALLOC_IN_USE | _MALLOC_MMAPPED;
+
+	return p + _MALLOC_HEADER_SIZE;
+}
+
+void *
+realloc(void *ptr, size_t size) {
+	void *base_address, *p;
+	size_t blk_size, copy_size;
+	int resized;
+
+	if (!ptr)
+		return malloc(size);
+
+	/* as in glibc, shrinking a block to zero bytes is the same as freeing it */
+	if (size == 0) {
+		free(ptr);
+		return NULL;
+	}
+
+	base_address = get_base_address(ptr);
+	if (!in_use(base_address)) {
+		debug("Memory block not allocated by malloc");
+		kill(getpid(), SIGSEGV);
+	}
+
+	if (!(blk_size = request_size(size)))
+		return NULL;
+
+	if (mmapped(base_address)) {
+		if (size <= read_size(base_address) && blk_size >= _mmap_threshold)
+			return ptr;
+
+		if (blk_size >= _mmap_threshold)
+			return remap_block(base_address, size);
+	} else {
+		pthread_mutex_lock(&_heap_lock);
+		resized = heap_resize(base_address, blk_size);
+		pthread_mutex_unlock(&_heap_lock);
+
+		if (resized)
+			return ptr;
+	}
+
+	/* the block could not be resized in place: a new one is allocated and the
+	 * data is copied over */
+	debug("Moving block to a new location");
+	if (!(p = malloc(size)))
+		return NULL;
+
+	copy_size = read_size(base_address);
+	memcpy(p, ptr, copy_size < size ? copy_size : size);
+	free(ptr);
+
+	return p;
+}
+
+/* places a block in its own mapping, such that the address returned is aligned
+ * to `alignment` bytes. The offset of the header to the start of the mapping
+ * is stored as described in `map_block` */
+static void *
+map_aligned_block(size_t alignment, size_t size) {
+	size_t length;
+	char *p, *user_ptr;
+
+	if (!_page_size)
+		_page_size = sysconf(_SC_PAGESIZE);
+
+	length = size + alignment + _MALLOC_FOOTER_SIZE + _MALLOC_HEADER_SIZE;
+	length = (length + _page_size - 1) & ~(_page_size - 1);
+
+	stat_add(mmap_calls, 1);
+	p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	stat_add(mmapped_bytes, length);
+	stat_add(mmapped_blocks, 1);
+
+	user_ptr = (char *) (((uintptr_t) p + _MALLOC_OVERHEAD + alignment - 1) & ~(alignment - 1));
+	*((size_t *) user_ptr - 2) = user_ptr - _MALLOC_HEADER_SIZE - p;
+	*((size_t *) user_ptr - 1) = (p + length - user_ptr) | _MALLOC_IN_USE | _MALLOC_MMAPPED;
+
+	return user_ptr;
+}
+
+/* carves a block aligned to `alignment` bytes out of a larger heap block. The
+ * leading part (if any) must be large enough to be a free block on its own, and
+ * the trailing part is given back to the heap as well */
+static void *
+heap_aligned_alloc(size_t alignment, size_t blk_size) {
+	char *p, *base_address, *aligned_ptr;
+	size_t total;
+
+	pthread_mutex_lock(&_heap_lock);
+	p = heap_alloc(blk_size + alignment + _MALLOC_MIN_BLK_SIZE, NULL);
+	if (!p) {
+		pthread_mutex_unlock(&_heap_lock);
+		return NULL;
+	}
+
+	base_address = get_base_address(p);
+	aligned_ptr = (char *) (((uintptr_t) p + alignment - 1) & ~(alignment - 1));
+	while (aligned_ptr != p && (size_t) (aligned_ptr - p) < _MALLOC_MIN_BLK_SIZE)
+		aligned_ptr += alignment;
+
+	if (aligned_ptr != p) {
+		total = block_size(base_address);
+		p = get_base_address(aligned_ptr);
+
+		/* the aligned block must be marked as in use before the leading block
+		 * is freed, so that they are not coalesced */
+		write_size(p, total - (p - base_address) - _MALLOC_OVERHEAD);
+		mark_in_use(p);
+		write_size(base_address, (p - base_address) - _MALLOC_OVERHEAD);
+		mark_in_use(base_address);
+		heap_free(base_address);
+
+		base_address = p;
+	}
+
+	shrink_block(base_address, blk_size);
+	pthread_mutex_unlock(&_heap_lock);
+
+	return aligned_ptr;
+}
+
+void *
+memalign(size_t alignment, size_t size) {
+	size_t blk_size;
+
+	/* the alignment must be a power of two. Anything up to the alignment
+	 * all blocks already have is just a regular allocation */
+	if (alignment == 0 || (alignment & (alignment - 1))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (alignment <= _MALLOC_ALIGNMENT)
+		return malloc(size);
+
+	if (!(blk_size = request_size(size)) || alignment > SIZE_MAX / 4) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	count_alloc(blk_size);
+
+	if (blk_size + alignment >= _mmap_threshold)
+		return map_aligned_block(alignment, size);
+
+	return heap_aligned_alloc(alignment, blk_size);
+}
+
+int
+posix_memalign(void **memptr, size_t alignment, size_t size) {
+	void *p;
+
+	if (alignment % sizeof(void *) || (alignment & (alignment - 1)) || !alignment)
+		return EINVAL;
+
+	if (!(p = memalign(alignment, size)))
+		return ENOMEM;
+
+	*memptr = p;
+	return 0;
+}
+
+void *
+aligned_alloc(size_t alignment, size_t size) {
+	return memalign(alignment, size);
+}
+
+void *
+valloc(size_t size) {
+	if (!_page_size)
+		_page_size = sysconf(_SC_PAGESIZE);
+
+	return memalign(_page_size, size);
+}
+
+void *
+pvalloc(size_t size) {
+	if (!_page_size)
+		_page_size = sysconf(_SC_PAGESIZE);
+
+	if (size > SIZE_MAX - _page_size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return memalign(_page_size, (size + _page_size - 1) & ~(_page_size - 1));
+}
+
+size_t
+malloc_usable_size(void *ptr) {
+	if (!ptr)
+		return 0;
+
+	return read_size(get_base_address(ptr));
+}
+
+/* only the parameters relevant to this implementation are supported. As in
+ * glibc, returns 1 on success and 0 on error */
+int
+mallopt(int param, int value) {
+	if (value < 0)
+		return 0;
+
+	pthread_mutex_lock(&_heap_lock);
+	switch (param) {
+		case M_TRIM_THRESHOLD:
+			_trim_threshold = value;
+			check_footprint();
+			break;
+
+		case M_MMAP_THRESHOLD:
+			_mmap_threshold = value;
+			break;
+
+		default:
+			value = -1;
+	}
+	pthread_mutex_unlock(&_heap_lock);
+
+	return value != -1;
+}
+
+/* purges the pages of every free block right away, instead of waiting for
+ * them to decay. The top block is purged rather than trimmed, so `pad` does not
+ * matter. As in glibc, returns 1 if memory was given back and 0 otherwise */
+int
+malloc_trim(__attribute__((unused)) size_t pad) {
+	size_t purged;
+
+	pthread_mutex_lock(&_heap_lock);
+	purged = _stats.purged_bytes;
+
+	_top_dirty = 1;
+	purge_decayed(1);
+
+	purged = _stats.purged_bytes - purged;
+	pthread_mutex_unlock(&_heap_lock);
+
+	return purged > 0;
+}
+
+/* what follows is the statistics reporting surface */
+
+/* the histogram of allocations made so far for the given size class. Must be
+ * called with the heap lock held, so that the list of thread caches does not
+ * change. Counters of other threads are read while they might be updated,
+ * which is fine for statistics purposes */
+static unsigned long
+allocs_for_class(int idx) {
+	struct thread_cache *tc;
+	unsigned long total = __atomic_load_n(&_stats.allocs[idx], __ATOMIC_RELAXED);
+
+	for (tc = _tcaches; tc; tc = tc->next)
+		total += tc->allocs[idx];
+
+	return total;
+}
+
+/* bytes held in thread caches, which are in use from the heap point of view.
+ * Must be called with the heap lock held */
+static size_t
+cached_bytes() {
+	struct thread_cache *tc;
+	size_t total = 0;
+	int idx;
+
+	for (tc = _tcaches; tc; tc = tc->next)
+		for (idx = 0; idx < (int) _MALLOC_TCACHE_BINS; ++idx)
+			total += tc->counts[idx] * (size_t) idx * _MALLOC_ALIGNMENT;
+
+	return total;
+}
+
+struct mallinfo2
+mallinfo2() {
+	struct mallinfo2 info;
+	size_t top_size, mmapped_bytes;
+
+	memset(&info, 0, sizeof(info));
+
+	mmapped_bytes = __atomic_load_n(&_stats.mmapped_bytes, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&_heap_lock);
+	top_size = _top ? block_size(_top) : 0;
+
+	info.arena = _stats.heap_size;
+	info.ordblks = _stats.free_blocks + (_top != NULL);
+	info.hblks = __atomic_load_n(&_stats.mmapped_blocks, __ATOMIC_RELAXED);
+	info.hblkhd = mmapped_bytes;
+	info.usmblks = _stats.heap_peak;
+	info.fsmblks = cached_bytes();
+	info.fordblks = _stats.free_bytes + top_size;
+	info.uordblks = _stats.heap_size - info.fordblks - info.fsmblks;
+	info.keepcost = top_size;
+	pthread_mutex_unlock(&_heap_lock);
+
+	return info;
+}
+
+/* statistics are formatted in a local buffer and written straight to standard
+ * error, so that no memory needs to be allocated in order to print them */
+static void
+print_stat(const char *format, ...) {
+	char buf[_MALLOC_MAX_STATS_STR];
+	va_list args;
+	int len;
+
+	va_start(args, format);
+	len = vsnprintf(buf, _MALLOC_MAX_STATS_STR, format, args);
+	va_end(args);
+
+	if (len > _MALLOC_MAX_STATS_STR - 1)
+		len = _MALLOC_MAX_STATS_STR - 1;
+
+	if (len > 0 && write(STDERR_FILENO, buf, len) == -1)
+		return;
+}
+
+/* the range of total block sizes (metadata included) of a size class */
+static size_t
+class_size(int idx) {
+	if (idx < (int) _MALLOC_SMALL_BINS)
+		return idx * _MALLOC_ALIGNMENT;
+
+	return (size_t) 1 << (idx - _MALLOC_SMALL_BINS + _MALLOC_SMALL_LIMIT_LOG);
+}
+
+void
+malloc_stats() {
+	struct mallinfo2 info = mallinfo2();
+	unsigned long allocs;
+	int idx;
+
+	print_stat("heap bytes       = %12zu (peak %zu)\n", info.arena, info.usmblks);
+	print_stat("in use bytes     = %12zu\n", info.uordblks);
+	print_stat("free bytes       = %12zu (%zu blocks, %zu in top block)\n",
+			info.fordblks, info.ordblks, info.keepcost);
+	print_stat("cached bytes     = %12zu\n", info.fsmblks);
+	print_stat("mmapped bytes    = %12zu (%zu blocks)\n", info.hblkhd, info.hblks);
+	print_stat("sbrk calls       = %12lu\n", _stats.sbrk_calls);
+	print_stat("mmap calls       = %12lu\n", __atomic_load_n(&_stats.mmap_calls, __ATOMIC_RELAXED));
+	print_stat("munmap calls     = %12lu\n", __atomic_load_n(&_stats.munmap_calls, __ATOMIC_RELAXED));
+	print_stat("mremap calls     = %12lu\n", __atomic_load_n(&_stats.mremap_calls, __ATOMIC_RELAXED));
+	print_stat("madvise calls    = %12lu\n", _stats.madvise_calls);
+	print_stat("purged bytes     = %12zu\n", _stats.purged_bytes);
+
+	print_stat("allocations per size class (block sizes include %zu bytes of metadata):\n",
+			(size_t) _MALLOC_OVERHEAD);
+
+	pthread_mutex_lock(&_heap_lock);
+	for (idx = 0; idx < _MALLOC_NBINS; ++idx) {
+		if (!(allocs = allocs_for_class(idx)))
+			continue;
+
+		if (idx < (int) _MALLOC_SMALL_BINS)
+			print_stat("  %10zu         : %lu\n", class_size(idx), allocs);
+		else
+			print_stat("  %10zu - %-10zu: %lu\n", class_size(idx),
+					2 * class_size(idx) - 1, allocs);
+	}
+	pthread_mutex_unlock(&_heap_lock);
+}
+
+/* when the MALLOC_STATS environment variable is set, statistics are printed
+ * when the process exits */
+__attribute__((destructor))
+static void
+stats_at_exit() {
+	if (getenv("MALLOC_STATS"))
+		malloc_stats();
 }
@@ -0,0 +1,593 @@
+/* malloc_bench.c - benchmarks a malloc(3) implementation.
+ *
+ * This program runs a series of allocation patterns and reports how fast they
+ * were executed (in operations per second), the peak resident set size of the
+ * process and how much memory was used beyond what was actually requested
+ * (the fragmentation overhead). It is meant to compare the allocator in
+ * malloc.c against the one in the C library: the allocator being measured is
+ * simply whatever `malloc(3)` resolves to, so that the malloc.c implementation
+ * can be benchmarked through the LD_PRELOAD environment variable:
+ *
+ * 	$ cc -O2 -shared -fPIC -pthread -o malloc.so malloc.c
+ * 	$ LD_PRELOAD=./malloc.so ./malloc_bench -p random
+ *
+ * The -c option runs the same benchmark twice, once with the C library
+ * allocator and once with the given library preloaded, printing both results.
+ *
+ * Supported patterns:
+ *
+ * 	lifo     - allocates a batch of blocks and frees them in reverse order
+ * 	fifo     - allocates a batch of blocks and frees them in allocation order
+ * 	random   - randomly allocates or frees blocks from a fixed set of slots
+ * 	prodcons - half the threads allocate blocks, the other half frees them
+ * 	trace    - replays an allocation trace read from a file (see below)
+ *
+ * Except for `trace`, every pattern can be run by multiple threads at the same
+ * time, each of them executing the given number of operations. Traces are text
+ * files with one operation per line, referring to blocks by a slot number:
+ *
+ * 	a <slot> <size>   - allocates a block of <size> bytes into <slot>
+ * 	r <slot> <size>   - reallocates the block in <slot> to <size> bytes
+ * 	f <slot>          - frees the block in <slot>
+ *
+ * Usage:
+ *
+ * 	$ ./malloc_bench [-p pattern] [-n ops] [-t threads] [-s min-max]
+ * 	                 [-b batch] [-f trace] [-c lib] [-z]
+ *
+ * 	-p pattern - allocation pattern to be executed (default: random)
+ * 	-n ops     - number of operations per thread (default: 1000000)
+ * 	-t threads - number of threads (default: 1)
+ * 	-s min-max - range of block sizes, in bytes (default: 16-512)
+ * 	-b batch   - blocks per batch in lifo/fifo, slots in random (default: 1000)
+ * 	-f trace   - trace file to be replayed by the `trace` pattern
+ * 	-c lib     - compare the C library allocator with the one in `lib`
+ * 	-z         - do not touch allocated memory
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <limits.h>
+#ifndef LONG_MIN
+#  include <linux/limits.h>
+#endif
+
+#define MAX_THREADS  (256)
+#define MAX_LINE     (256)
+#define QUEUE_SIZE   (1024)
+#define PAGE         (4096)
+
+static char *progname = "malloc_bench";
+
+/* benchmark parameters */
+static char *pattern  = "random";
+static long numOps    = 1000000;
+static long numThreads = 1;
+static long minSize   = 16;
+static long maxSize   = 512;
+static long batchSize = 1000;
+static char *traceFile = NULL;
+static int touch      = 1;
+
+/* bytes requested and not yet freed, and its peak value */
+static long liveBytes = 0, peakLive = 0;
+
+/* queue shared by producers and consumers */
+static struct {
+	void *blocks[QUEUE_SIZE];
+	size_t sizes[QUEUE_SIZE];
+	int head, tail, count;
+	pthread_mutex_t mutex;
+	pthread_cond_t notEmpty, notFull;
+} queue = { .mutex = PTHREAD_MUTEX_INITIALIZER,
+            .notEmpty = PTHREAD_COND_INITIALIZER,
+            .notFull = PTHREAD_COND_INITIALIZER };
+
+static void usage();
+static void error(const char *msg);
+static void pexit(const char *func);
+static long getInt(const char *arg);
+static void compare(char *argv[], const char *lib);
+static double now();
+static long rssKB();
+
+static void *allocBlock(size_t size);
+static void freeBlock(void *ptr, size_t size);
+static size_t randomSize(unsigned int *seed);
+
+static void *runLifo(void *arg);
+static void *runFifo(void *arg);
+static void *runRandom(void *arg);
+static void *runProducer(void *arg);
+static void *runConsumer(void *arg);
+static long runTrace(double *elapsed);
+
+int
+main(int argc, char *argv[]) {
+	int opt;
+	long i, totalOps, baseRSS, peakRSS;
+	char *dash, *compareLib = NULL;
+	void *(*worker)(void *) = NULL;
+	pthread_t threads[MAX_THREADS];
+	double start, elapsed;
+	struct rusage ru;
+
+	while ((opt = getopt(argc, argv, "p:n:t:s:b:f:c:zh")) != -1) {
+		switch (opt) {
+			case 'p': pattern = optarg;               break;
+			case 'n': numOps = getInt(optarg);        break;
+			case 't': numThreads = getInt(optarg);    break;
+			case 'b': batchSize = getInt(optarg);     break;
+			case 'f': traceFile = optarg;             break;
+			case 'c': compareLib = optarg;            break;
+			case 'z': touch = 0;                      break;
+			case 's':
+				if ((dash = strchr(optarg, '-')) == NULL)
+					error("size range must be given as min-max");
+
+				*dash = '\0';
+				minSize = getInt(optarg);
+				maxSize = getInt(dash + 1);
+				*dash = '-';
+				break;
+
+			default: usage();
+		}
+	}
+
+	if (numOps <= 0 || batchSize <= 0 || minSize <= 0 || maxSize < minSize)
+		error("invalid benchmark parameters");
+
+	if (numThreads <= 0 || numThreads > MAX_THREADS)
+		error("invalid number of threads");
+
+	if (compareLib) {
+		compare(argv, compareLib);
+		exit(EXIT_SUCCESS);
+	}
+
+	if (!strcmp(pattern, "lifo"))
+		worker = runLifo;
+	else if (!strcmp(pattern, "fifo"))
+		worker = runFifo;
+	else if (!strcmp(pattern, "random"))
+		worker = runRandom;
+	else if (!strcmp(pattern, "prodcons")) {
+		if (numThreads < 2)
+			numThreads = 2;
+	} else if (!strcmp(pattern, "trace")) {
+		if (!traceFile)
+			error("the trace pattern requires a trace file (-f)");
+	} else
+		error("unknown pattern");
+
+	baseRSS = rssKB();
+	start = now();
+
+	if (!strcmp(pattern, "trace")) {
+		totalOps = runTrace(&elapsed);
+	} else {
+		for (i = 0; i < numThreads; ++i) {
+			if (worker)
+				errno = pthread_create(&threads[i], NULL, worker, (void *) i);
+			else
+				errno = pthread_create(&threads[i], NULL,
+						i % 2 ? runConsumer : runProducer, (void *) i);
+
+			if (errno)
+				pexit("pthread_create");
+		}
+
+		for (i = 0; i < numThreads; ++i)
+			if ((errno = pthread_join(threads[i], NULL)))
+				pexit("pthread_join");
+
+		/* producers and consumers each count their own operations */
+		totalOps = numOps * numThreads;
+		elapsed = now() - start;
+	}
+
+	if (getrusage(RUSAGE_SELF, &ru) == -1)
+		pexit("getrusage");
+
+	peakRSS = ru.ru_maxrss;
+
+	printf("%-24s %-10s %8ld ops/s(k) %10ld KB peak RSS %8ld KB peak live %8.1f%% overhead\n",
+			getenv("LD_PRELOAD") ? getenv("LD_PRELOAD") : "libc",
+			pattern,
+			(long) (totalOps / elapsed / 1000),
+			peakRSS,
+			peakLive / 1024,
+			peakLive ? 100.0 * ((peakRSS - baseRSS) * 1024.0 - peakLive) / peakLive : 0.0);
+
+	exit(EXIT_SUCCESS);
+}
+
+/* runs this same program with the given arguments (minus the -c option) twice:
+ * once with the default allocator and once with `lib` preloaded */
+static void
+compare(char *argv[], const char *lib) {
+	char *args[64], preload[PATH_MAX];
+	int i, j, status, run;
+
+	for (i = 0, j = 0; argv[i] && j < 63; ++i) {
+		if (!strcmp(argv[i], "-c")) {
+			if (argv[i + 1])
+				++i;
+
+			continue;
+		}
+
+		if (!strncmp(argv[i], "-c", 2))
+			continue;
+
+		args[j++] = argv[i];
+	}
+	args[j] = NULL;
+
+	for (run = 0; run < 2; ++run) {
+		fflush(stdout);
+
+		switch (fork()) {
+			case -1:
+				pexit("fork");
+				break;
+
+			case 0:
+				if (run == 0) {
+					unsetenv("LD_PRELOAD");
+				} else {
+					/* the dynamic linker needs a path to find the library */
+					if (!strchr(lib, '/'))
+						snprintf(preload, PATH_MAX, "./%s", lib);
+					else
+						snprintf(preload, PATH_MAX, "%s", lib);
+
+					setenv("LD_PRELOAD", preload, 1);
+				}
+
+				execv("/proc/self/exe", args);
+				pexit("execv");
+				break;
+
+			default:
+				if (wait(&status) == -1)
+					pexit("wait");
+
+				if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+					error("benchmark run failed");
+		}
+	}
+}
+
+static double
+now() {
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		pexit("clock_gettime");
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* current resident set size of the process, in kilobytes */
+static long
+rssKB() {
+	FILE *statm;
+	long size, resident;
+
+	if ((statm = fopen("/proc/self/statm", "r")) == NULL)
+		pexit("fopen");
+
+	if (fscanf(statm, "%ld %ld", &size, &resident) != 2)
+		error("could not read /proc/self/statm");
+
+	fclose(statm);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static size_t
+randomSize(unsigned int *seed) {
+	return minSize + rand_r(seed) % (maxSize - minSize + 1);
+}
+
+/* allocates a block, touching one byte per page so that it is accounted for
+ * in the resident set size, and keeps track of the live memory */
+static void *
+allocBlock(size_t size) {
+	char *p;
+	size_t i;
+	long live;
+
+	if ((p = malloc(size)) == NULL)
+		pexit("malloc");
+
+	if (touch)
+		for (i = 0; i < size; i += PAGE)
+			p[i] = 1;
+
+	live = __atomic_add_fetch(&liveBytes, size, __ATOMIC_RELAXED);
+	if (live > __atomic_load_n(&peakLive, __ATOMIC_RELAXED))
+		__atomic_store_n(&peakLive, live, __ATOMIC_RELAXED);
+
+	return p;
+}
+
+static void
+freeBlock(void *ptr, size_t size) {
+	free(ptr);
+	__atomic_sub_fetch(&liveBytes, size, __ATOMIC_RELAXED);
+}
+
+/* lifo and fifo: each operation is either an allocation or a free. Every batch
+ * of `batchSize` allocations is then freed in the given order */
+static void
+runBatches(long id, int reverse) {
+	void **blocks;
+	size_t *sizes;
+	unsigned int seed = id + 1;
+	long done, i, n;
+
+	if ((blocks = malloc(batchSize * sizeof(void *))) == NULL ||
+			(sizes = malloc(batchSize * sizeof(size_t))) == NULL)
+		pexit("malloc");
+
+	for (done = 0; done < numOps; done += 2 * n) {
+		n = (numOps - done) / 2 < batchSize ? (numOps - done + 1) / 2 : batchSize;
+
+		for (i = 0; i < n; ++i) {
+			sizes[i] = randomSize(&seed);
+			blocks[i] = allocBlock(sizes[i]);
+		}
+
+		for (i = 0; i < n; ++i) {
+			if (reverse)
+				freeBlock(blocks[n - i - 1], sizes[n - i - 1]);
+			else
+				freeBlock(blocks[i], sizes[i]);
+		}
+	}
+
+	free(blocks);
+	free(sizes);
+}
+
+static void *
+runLifo(void *arg) {
+	runBatches((long) arg, 1);
+	return NULL;
+}
+
+static void *
+runFifo(void *arg) {
+	runBatches((long) arg, 0);
+	return NULL;
+}
+
+/* random: a set of `batchSize` slots is kept. Each operation picks a slot at
+ * random, allocating a block if it is empty or freeing it otherwise */
+static void *
+runRandom(void *arg) {
+	void **blocks;
+	size_t *sizes;
+	unsigned int seed = (long) arg + 1;
+	long i, slot;
+
+	if ((blocks = calloc(batchSize, sizeof(void *))) == NULL ||
+			(sizes = calloc(batchSize, sizeof(size_t))) == NULL)
+		pexit("calloc");
+
+	for (i = 0; i < numOps; ++i) {
+		slot = rand_r(&seed) % batchSize;
+
+		if (blocks[slot]) {
+			freeBlock(blocks[slot], sizes[slot]);
+			blocks[slot] = NULL;
+		} else {
+			sizes[slot] = randomSize(&seed);
+			blocks[slot] = allocBlock(sizes[slot]);
+		}
+	}
+
+	for (slot = 0; slot < batchSize; ++slot)
+		if (blocks[slot])
+			freeBlock(blocks[slot], sizes[slot]);
+
+	free(blocks);
+	free(sizes);
+	return NULL;
+}
+
+/* producer/consumer: blocks are allocated by one thread and freed by another,
+ * which stresses the handling of memory crossing thread boundaries */
+static void *
+runProducer(void *arg) {
+	unsigned int seed = (long) arg + 1;
+	size_t size;
+	void *p;
+	long i;
+
+	for (i = 0; i < numOps; ++i) {
+		size = randomSize(&seed);
+		p = allocBlock(size);
+
+		pthread_mutex_lock(&queue.mutex);
+		while (queue.count == QUEUE_SIZE)
+			pthread_cond_wait(&queue.notFull, &queue.mutex);
+
+		queue.blocks[queue.tail] = p;
+		queue.sizes[queue.tail] = size;
+		queue.tail = (queue.tail + 1) % QUEUE_SIZE;
+		++queue.count;
+
+		pthread_cond_signal(&queue.notEmpty);
+		pthread_mutex_unlock(&queue.mutex);
+	}
+
+	return NULL;
+}
+
+static void *
+runConsumer(__attribute__((unused)) void *arg) {
+	size_t size;
+	void *p;
+	long i;
+
+	for (i = 0; i < numOps; ++i) {
+		pthread_mutex_lock(&queue.mutex);
+		while (queue.count == 0)
+			pthread_cond_wait(&queue.notEmpty, &queue.mutex);
+
+		p = queue.blocks[queue.head];
+		size = queue.sizes[queue.head];
+		queue.head = (queue.head + 1) % QUEUE_SIZE;
+		--queue.count;
+
+		pthread_cond_signal(&queue.notFull);
+		pthread_mutex_unlock(&queue.mutex);
+
+		freeBlock(p, size);
+	}
+
+	return NULL;
+}
+
+/* replays a trace file, returning the number of operations executed. The
+ * trace is fully loaded in memory before the clock starts, so that parsing
+ * is not measured; the time taken by the replay is stored in `elapsed` */
+static long
+runTrace(double *elapsed) {
+	FILE *trace;
+	char line[MAX_LINE], op;
+	long slot, size, maxSlot = 0, numLines = 0, capacity = 1024, i;
+	struct traceOp { char op; long slot, size; } *ops;
+	void **blocks;
+	size_t *sizes;
+	double start;
+
+	if ((trace = fopen(traceFile, "r")) == NULL)
+		pexit("fopen");
+
+	if ((ops = malloc(capacity * sizeof(*ops))) == NULL)
+		pexit("malloc");
+
+	while (fgets(line, MAX_LINE, trace) != NULL) {
+		size = 0;
+		if (sscanf(line, " %c %ld %ld", &op, &slot, &size) < 2 || slot < 0)
+			continue;
+
+		if ((op == 'a' || op == 'r') && size <= 0)
+			continue;
+
+		if (numLines == capacity) {
+			capacity *= 2;
+			if ((ops = realloc(ops, capacity * sizeof(*ops))) == NULL)
+				pexit("realloc");
+		}
+
+		ops[numLines].op = op;
+		ops[numLines].slot = slot;
+		ops[numLines].size = size;
+		++numLines;
+
+		if (slot > maxSlot)
+			maxSlot = slot;
+	}
+
+	fclose(trace);
+
+	if ((blocks = calloc(maxSlot + 1, sizeof(void *))) == NULL ||
+			(sizes = calloc(maxSlot + 1, sizeof(size_t))) == NULL)
+		pexit("calloc");
+
+	start = now();
+	for (i = 0; i < numLines; ++i) {
+		slot = ops[i].slot;
+
+		switch (ops[i].op) {
+			case 'a':
+				if (blocks[slot])
+					freeBlock(blocks[slot], sizes[slot]);
+
+				sizes[slot] = ops[i].size;
+				blocks[slot] = allocBlock(sizes[slot]);
+				break;
+
+			case 'r':
+				if ((blocks[slot] = realloc(blocks[slot], ops[i].size)) == NULL)
+					pexit("realloc");
+
+				liveBytes += ops[i].size - sizes[slot];
+				if (liveBytes > peakLive)
+					peakLive = liveBytes;
+
+				sizes[slot] = ops[i].size;
+				break;
+
+			case 'f':
+				if (blocks[slot])
+					freeBlock(blocks[slot], sizes[slot]);
+
+				blocks[slot] = NULL;
+				break;
+		}
+	}
+
+	*elapsed = now() - start;
+
+	for (slot = 0; slot <= maxSlot; ++slot)
+		if (blocks[slot])
+			freeBlock(blocks[slot], sizes[slot]);
+
+	free(blocks);
+	free(sizes);
+	free(ops);
+
+	return numLines;
+}
+
+static long
+getInt(const char *arg) {
+	long narg;
+	char *endptr;
+
+	narg = strtol(arg, &endptr, 10);
+	if (endptr == arg || *endptr != '\0' || narg == LONG_MIN || narg == LONG_MAX) {
+		error("invalid numeric argument");
+	}
+
+	return narg;
+}
+
+static void
+error(const char *msg) {
+	fprintf(stderr, "%s: %s\n", progname, msg);
+	exit(EXIT_FAILURE);
+}
+
+static void
+pexit(const char *func) {
+	perror(func);
+	exit(EXIT_FAILURE);
+}
+
+static void
+usage() {
+	fprintf(stderr, "Usage: %s [-p pattern] [-n ops] [-t threads] [-s min-max] "
+			"[-b batch] [-f trace] [-c lib] [-z]\n", progname);
+	exit(EXIT_FAILURE);
+}
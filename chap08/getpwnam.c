@@ -5,11 +5,20 @@
  * program builds one implementation of this function on top of the setpwent(3),
  * getpwent(3) and endpwent(3) library functions.
  *
+ * Scanning the file for every lookup gets slow when many users are looked up,
+ * though: with -c, users are looked up in the cache of lib/idcache.c instead,
+ * which reads the file (with the same functions) into a hash table once, and
+ * only again if it changes.
+ *
  * Usage:
  *
- *    $ ./getpwnam renato
+ *    $ ./getpwnam [-c] renato [<name>...]
  *    # Available information on user `renato`
  *
+ * Built along with the cache:
+ *
+ *    $ gcc -o getpwnam getpwnam.c ../lib/idcache.c
+ *
  * Author: Renato Mascarenhas Costa
  */
 
@@ -24,6 +33,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "../lib/idcache.h"
+
 void helpAndLeave(const char *progname, int status);
 void pexit(const char *fCall);
 
@@ -33,38 +44,55 @@ int
 main (int argc, char *argv[]) {
   char *name;
   struct passwd *info;
+  struct passwd *(*lookup)(const char *) = _getpwnam;
+  int opt, i, status = EXIT_SUCCESS;
+
+  while ((opt = getopt(argc, argv, "ch")) != -1) {
+    switch (opt) {
+      case 'c': lookup = idcacheUserByName; break;
+      case 'h': helpAndLeave(argv[0], EXIT_SUCCESS); break;
+      default: helpAndLeave(argv[0], EXIT_FAILURE);
+    }
+  }
 
-  if (argc != 2) {
+  if (optind == argc) {
     helpAndLeave(argv[0], EXIT_FAILURE);
   }
 
-  name = argv[1];
-  errno = 0; /* errno must be set to zero to identify error scenario from non existent user */
-  info = _getpwnam(name);
+  for (i = optind; i < argc; ++i) {
+    name = argv[i];
+    errno = 0; /* errno must be set to zero to identify error scenario from non existent user */
+    info = lookup(name);
+
+    if (info == NULL) {
+      if (errno == 0) {
+        printf("User %s does not exist in this system.\n", name);
+        status = EXIT_FAILURE;
+        continue;
+      } else {
+        pexit("_getpwnam");
+      }
+    }
 
-  if (info == NULL) {
-    if (errno == 0) {
-      printf("User %s does not exist in this system.\n", name);
-      exit(EXIT_FAILURE);
-    } else {
-      pexit("_getpwnam");
+    if (i > optind) {
+      printf("\n");
     }
-  }
 
-  printf("User name: %s\n", info->pw_name);
-  printf("Encrypted password: %s\n", info->pw_passwd);
-  printf("User ID: %ld\n", (long) info->pw_uid);
-  printf("Group ID: %ld\n", (long) info->pw_gid);
-  printf("Comment: %s\n", info->pw_gecos);
-  printf("Home directory: %s\n", info->pw_dir);
-  printf("Login shell: %s\n", info->pw_shell);
+    printf("User name: %s\n", info->pw_name);
+    printf("Encrypted password: %s\n", info->pw_passwd);
+    printf("User ID: %ld\n", (long) info->pw_uid);
+    printf("Group ID: %ld\n", (long) info->pw_gid);
+    printf("Comment: %s\n", info->pw_gecos);
+    printf("Home directory: %s\n", info->pw_dir);
+    printf("Login shell: %s\n", info->pw_shell);
+  }
 
-  return EXIT_SUCCESS;
+  return status;
 }
 
 void
 helpAndLeave(const char *progname, int status) {
-  fprintf(status == EXIT_FAILURE ? stderr : stdout, "Usage: %s <file>\n", progname);
+  fprintf(status == EXIT_FAILURE ? stderr : stdout, "Usage: %s [-c] <name>...\n", progname);
   exit(status);
 }
 
@@ -5,9 +5,14 @@
  * group. It is used mainly by the `login(1)` utility, which sets a couple of process
  * credentials before starting the user's login shell.
  *
+ * Finding the groups of the user means scanning the whole groups file. With -c,
+ * they are found in the cache of lib/idcache.c instead, which reads the file
+ * once into hash tables - among them, one of the groups of each user - and only
+ * again if it changes. Groups are then looked up by name and ID in there too.
+ *
  * Usage
  *
- *    $ ./initgroups <username> <groupname>
+ *    $ ./initgroups [-c] <username> <groupname>
  *    Supplementary groups are now:
  *    100 - users
  *    2 - wheel
@@ -16,6 +21,10 @@
  *    <username>  - the user name to be looked for in the groups file
  *    <groupname> - the group name to be also set for the process
  *
+ * Built along with the cache:
+ *
+ *    $ gcc -o initgroups initgroups.c ../lib/idcache.c
+ *
  * Author: Renato Mascarenhas Costa
  */
 
@@ -32,6 +41,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "../lib/idcache.h"
+
 #define MAX_GROUPS_SIZ (NGROUPS_MAX + 1)
 
 void helpAndLeave(const char *progname, int status);
@@ -59,18 +70,29 @@ char *groupNameFromId(gid_t gid);
 
 int _initgroups(const char *user, gid_t group);
 
+/* whether to look up groups in the cache */
+int useCache = 0;
+
 int
 main(int argc, char *argv[]) {
   char *user, *group;
   gid_t gid, suppGroups[MAX_GROUPS_SIZ];
-  int nGroups, i, status;
+  int nGroups, i, status, opt;
 
-  if (argc != 3) {
+  while ((opt = getopt(argc, argv, "ch")) != -1) {
+    switch (opt) {
+      case 'c': useCache = 1; break;
+      case 'h': helpAndLeave(argv[0], EXIT_SUCCESS); break;
+      default: helpAndLeave(argv[0], EXIT_FAILURE);
+    }
+  }
+
+  if (argc != optind + 2) {
     helpAndLeave(argv[0], EXIT_FAILURE);
   }
 
-  user = argv[1];
-  group = argv[2];
+  user = argv[optind];
+  group = argv[optind + 1];
   status = groupIdFromName(group);
 
   if (status == -1) {
@@ -107,7 +129,7 @@ helpAndLeave(const char *progname, int status) {
     stream = stdout;
   }
 
-  fprintf(stream, "Usage: %s <username> <groupname>\n", progname);
+  fprintf(stream, "Usage: %s [-c] <username> <groupname>\n", progname);
   exit(status);
 }
 
@@ -121,7 +143,8 @@ gid_t
 groupIdFromName(const char *name) {
   struct group *g;
 
-  if ((g = getgrnam(name)) == NULL) {
+  g = useCache ? idcacheGroupByName(name) : getgrnam(name);
+  if (g == NULL) {
     return -1;
   }
 
@@ -132,7 +155,8 @@ char *
 groupNameFromId(gid_t gid) {
   struct group *g;
 
-  if ((g = getgrgid(gid)) == NULL) {
+  g = useCache ? idcacheGroupById(gid) : getgrgid(gid);
+  if (g == NULL) {
     return NULL;
   }
 
@@ -146,6 +170,10 @@ getGroups(const char *user, int size, gid_t *groupsList) {
   long usernameMax;
   char **p;
 
+  if (useCache) {
+    return idcacheUserGroups(user, groupsList, size);
+  }
+
   usernameMax = sysconf(_SC_LOGIN_NAME_MAX);
   if (usernameMax == -1) {
     usernameMax = 256; /* make a guess */
@@ -33,6 +33,13 @@
  *    _PC_PATH_MAX: 1024
  *    _PC_PIPE_BUF: 512
  *
+ * With -c, the limits are asked for twice, through the cache of lib/syslimits.c:
+ * only the first time calls fpathconf(3).
+ *
+ * Built along with syslimits.c:
+ *
+ *    $ gcc -o fpathconf_demo fpathconf_demo.c ../lib/syslimits.c -pthread
+ *
  * Adaptations by: Renato Mascarenhas Costa
  */
 
@@ -41,6 +48,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
+
+#include "../lib/syslimits.h"
+
+static long (*lookup)(int fd, int name) = fpathconf;
 
 static void pexit(const char *fCall);
 static void helpAndLeave(const char *progname, int status);
@@ -48,13 +60,20 @@ static void fpathconfPrint(const char *msg, int fd, int name);
 
 int
 main(int argc, char *argv[]) {
-  if (argc != 1) {
+  int rounds = 1, i;
+
+  if (argc == 2 && !strcmp(argv[1], "-c")) {
+    lookup = sysLimitsPathconf;
+    rounds = 2;
+  } else if (argc != 1) {
     helpAndLeave(argv[0], EXIT_FAILURE);
   }
 
-  fpathconfPrint("_PC_NAME_MAX:", STDIN_FILENO, _PC_NAME_MAX);
-  fpathconfPrint("_PC_PATH_MAX:", STDIN_FILENO, _PC_PATH_MAX);
-  fpathconfPrint("_PC_PIPE_BUF:", STDIN_FILENO, _PC_PIPE_BUF);
+  for (i = 0; i < rounds; ++i) {
+    fpathconfPrint("_PC_NAME_MAX:", STDIN_FILENO, _PC_NAME_MAX);
+    fpathconfPrint("_PC_PATH_MAX:", STDIN_FILENO, _PC_PATH_MAX);
+    fpathconfPrint("_PC_PIPE_BUF:", STDIN_FILENO, _PC_PIPE_BUF);
+  }
 
   return EXIT_SUCCESS;
 }
@@ -67,7 +86,7 @@ helpAndLeave(const char *progname, int status) {
     stream = stdout;
   }
 
-  fprintf(stream, "Usage: %s", progname);
+  fprintf(stream, "Usage: %s [-c]\n", progname);
   exit(status);
 }
 
@@ -82,7 +101,7 @@ fpathconfPrint(const char *msg, int fd, int name) {
   long limit;
 
   errno = 0;
-  limit = fpathconf(fd, name);
+  limit = lookup(fd, name);
 
   if (limit == -1) {
     /* call succeeded, limit undefined */
@@ -34,6 +34,13 @@
  * As we can see from the output above, OpenBSD errors out when given the
  * _SC_RTSIG_MAX sysconf name.
  *
+ * With -s, the snapshot of lib/syslimits.c is printed instead: the limits tools
+ * usually need, all taken once per process.
+ *
+ * Built along with syslimits.c:
+ *
+ *    $ gcc -o sysconf_demo sysconf_demo.c ../lib/syslimits.c -pthread
+ *
  * Adaptations by: Renato Mascarenhas Costa
  */
 
@@ -42,6 +49,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
+
+#include "../lib/syslimits.h"
 
 static void pexit(const char *fCall);
 static void helpAndLeave(const char *progname, int status);
@@ -49,6 +59,22 @@ static void sysconfPrint(const char *msg, int name);
 
 int
 main(int argc, char *argv[]) {
+  const struct sysLimits *limits;
+
+  if (argc == 2 && !strcmp(argv[1], "-s")) {
+    limits = sysLimits();
+
+    printf("page size:   %ld\n", limits->pageSize);
+    printf("pid_max:     %ld\n", limits->pidMax);
+    printf("open max:    %ld\n", limits->openMax);
+    printf("path max:    %ld\n", limits->pathMax);
+    printf("clock ticks: %ld\n", limits->clockTicks);
+    printf("CPUs:        %ld\n", limits->cpus);
+    printf("arg max:     %ld\n", limits->argMax);
+
+    return EXIT_SUCCESS;
+  }
+
   if (argc != 1) {
     helpAndLeave(argv[0], EXIT_FAILURE);
   }
@@ -71,7 +97,7 @@ helpAndLeave(const char *progname, int status) {
     stream = stdout;
   }
 
-  fprintf(stream, "Usage: %s", progname);
+  fprintf(stream, "Usage: %s [-s]\n", progname);
   exit(status);
 }
 
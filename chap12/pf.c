@@ -7,139 +7,131 @@
  *
  * Usage
  *
- *    $ sudo ./pf <filename>
+ *    $ sudo ./pf [-i] [-j threads] <filename>
  *     PID   FD             COMMAND
  *    2703    4               vim
  *    4491    8               nano
  *    6645    3               more
+ *    7012  mem              python
  *
  *    <filename> - the name of the file that is going to be considered.
+ *    -i: match the file itself rather than its name (see below).
+ *    -j: the number of threads inspecting processes (default: one per CPU).
  *
  * Note that the filename argument must be given as an absolute path to the
- * destination, since the links are stored this way.
+ * destination, since the links are stored this way. A file that was deleted
+ * is matched as well (its links are the name it had, followed by "(deleted)").
+ *
+ * With -i, the file is stat(2)ed once, and the descriptors of processes match it
+ * if they refer to the same device and inode - with fstatat(2) on each link, no
+ * names are compared. Files a process has mapped in memory (as listed in
+ * /proc/PID/maps) are matched too, and shown with `mem` in the FD column. Any
+ * name of the file will do, including the links in /proc/PID/fd: a deleted file
+ * can be named through a descriptor of one process that still has it open (say,
+ * /proc/2703/fd/4) to find all the others.
+ *
+ * Processes are found, and inspected in parallel, with the scanner in procscan.c.
  *
  * Author: Renato Mascarenhas Costa
  */
 
-#define _BSD_SOURCE /* readlink function */
+#define _DEFAULT_SOURCE /* readlinkat and fdopendir functions */
 
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#define PROC_FS ("/proc")
+#include "procscan.h"
+
 #define BUF_SIZ (512)
-#define STATUS_FILE_MAX (10240)
+#define DELETED_SUFFIX (" (deleted)")
 
-typedef enum { FALSE, TRUE } Bool;
+#define FD_END    (-1) /* ends the list of descriptors of a process */
+#define FD_MAPPED (-2) /* the file is mapped in memory by the process */
+
+/* the file searched for */
+struct target {
+  const char *filename;
+  int byInode; /* match on device and inode instead of name */
+  dev_t dev;
+  ino_t ino;
+};
 
 void helpAndLeave(const char *progname, int status);
 void pexit(const char *fCall);
 
-/* Internal: prints formatted PID and command for a given process. The statusFd argument
- * must be a descriptor of the status file of the corresponding process, and the fd
- * argument represents the fd currently being verified */
-void printProcessInfo(int statusFd, char *fd, char *pid);
+/* Internal: scan filter keeping the processes that have the `target` file open.
+ * The descriptors found are stored in the `data` of the process, as an array
+ * ending in FD_END */
+int hasFileOpen(int pidDirFd, struct psProcess *proc, void *target);
+
+/* Internal: whether the descriptor link `name` in /proc/PID/fd refers to the target */
+int fdMatches(int fdDirFd, const char *name, const struct target *target);
+
+/* Internal: whether the process whose /proc/PID directory is given maps the target */
+int mapsTarget(int pidDirFd, const struct target *target);
 
 int
 main(int argc, char *argv[]) {
-  if (argc != 2) {
-    helpAndLeave(argv[0], EXIT_FAILURE);
+  struct psProcess *procs;
+  struct target target;
+  struct stat st;
+  size_t count, i;
+  int *fd, opt, nthreads = 0;
+
+  memset(&target, 0, sizeof(struct target));
+
+  while ((opt = getopt(argc, argv, "ij:h")) != -1) {
+    switch (opt) {
+      case 'i': target.byInode = 1; break;
+      case 'j': nthreads = atoi(optarg); break;
+      case 'h': helpAndLeave(argv[0], EXIT_SUCCESS); break;
+      default: helpAndLeave(argv[0], EXIT_FAILURE);
+    }
   }
 
-  char *filename = argv[1];
-  char pathname[BUF_SIZ], buf[BUF_SIZ];
-  int statusFd;
-  ssize_t numRead;
-
-  DIR *proc, *procpid;                    /* /proc and /proc/PID/fd, respectively */
-  struct dirent *procpid_d, *procpidfd_d; /* /proc/PID/status and /proc/PID/fd/FD, respectively */
-
-  proc = opendir(PROC_FS);
-  if (proc == NULL) {
-    pexit("opendir");
+  if (argc != optind + 1) {
+    helpAndLeave(argv[0], EXIT_FAILURE);
   }
 
-  printf("%8s%5s%20s\n", "PID", "FD", "COMMAND");
-  for (errno = 0; (procpid_d = readdir(proc)) != NULL; errno = 0) {
-    /* skip /proc/self link */
-    if (strncmp(procpid_d->d_name, "self", 4) == 0) {
-      continue;
-    }
-
-    snprintf(buf, BUF_SIZ, "%s/%s/status", PROC_FS, procpid_d->d_name);
-    statusFd = open(buf, O_RDONLY);
-
-    if (statusFd == -1) {
-      if (errno != ENOENT && errno != ENOTDIR) {
-        pexit("open");
-      }
-
-      /* skip directories under /proc that do not have a status file - that is
-       * our logic to identify process directories under the proc filesystem */
-      continue;
+  target.filename = argv[optind];
+  if (target.byInode) {
+    if (stat(target.filename, &st) == -1) {
+      pexit("stat");
     }
 
-    /* /proc/PID/fd directory */
-    snprintf(buf, BUF_SIZ, "%s/%s/fd", PROC_FS, procpid_d->d_name);
-
-    procpid = opendir(buf);
-    if (procpid == NULL) {
-      pexit("opendir");
-    }
-
-    /* loop through every file descriptor open for a process */
-    for (errno = 0; (procpidfd_d = readdir(procpid)) != NULL; errno = 0) {
-      /* skip . and .. entries */
-      if (strncmp(procpidfd_d->d_name, ".", 1) == 0 || strncmp(procpidfd_d->d_name, "..", 2) == 0) {
-        continue;
-      }
-
-      /* build full path to the file descriptor link */
-      snprintf(pathname, BUF_SIZ, "%s/%s/fd/%s", PROC_FS, procpid_d->d_name, procpidfd_d->d_name);
-
-      numRead = readlink(pathname, buf, BUF_SIZ);
-      if (numRead == -1) {
-        pexit("readlink");
-      }
+    target.dev = st.st_dev;
+    target.ino = st.st_ino;
+  }
 
-      /* readlink(2) does not append the null byte at the end of the read data,
-       * so we do it ourselves */
-      buf[numRead] = '\0';
+  procs = psScan(PS_FIELD_NAME, nthreads, hasFileOpen, &target, &count);
+  if (procs == NULL) {
+    pexit("psScan");
+  }
 
-      if (strncmp(buf, filename, BUF_SIZ) == 0) {
-        printProcessInfo(statusFd, procpidfd_d->d_name, procpid_d->d_name);
+  printf("%8s%5s%20s\n", "PID", "FD", "COMMAND");
+  for (i = 0; i < count; ++i) {
+    for (fd = procs[i].data; *fd != FD_END; ++fd) {
+      if (*fd == FD_MAPPED) {
+        printf("%8ld%5s%20s\n", (long) procs[i].pid, "mem", procs[i].name);
+      } else {
+        printf("%8ld%5d%20s\n", (long) procs[i].pid, *fd, procs[i].name);
       }
     }
 
-    /* left the loop with error */
-    if (errno != 0) {
-      pexit("readdir");
-    }
-
-    if (closedir(procpid) == -1) {
-      pexit("closedir");
-    }
-
-    if (close(statusFd) == -1) {
-      pexit("close");
-    }
-  }
-
-  if (errno != 0) {
-    pexit("readdir");
+    free(procs[i].data);
   }
 
-  if (closedir(proc) == -1) {
-    pexit("closedir");
-  }
+  free(procs);
 
   return EXIT_SUCCESS;
 }
@@ -152,7 +144,7 @@ helpAndLeave(const char *progname, int status) {
     stream = stdout;
   }
 
-  fprintf(stream, "Usage: %s <filename>\n", progname);
+  fprintf(stream, "Usage: %s [-i] [-j threads] <filename>\n", progname);
   exit(status);
 }
 
@@ -162,34 +154,115 @@ pexit(const char *fCall) {
   exit(EXIT_FAILURE);
 }
 
-void
-printProcessInfo(int statusFd, char *fd, char *pid) {
-  char command[BUF_SIZ], statusFile[STATUS_FILE_MAX], *line;
+/* appends a descriptor to the list being built in `*fds` */
+static void
+addFd(int **fds, int *count, int *capacity, int fd) {
+  int *more;
+
+  /* leave room for FD_END */
+  if (*count + 2 > *capacity) {
+    *capacity = (*capacity == 0) ? 4 : 2 * *capacity;
+    more = realloc(*fds, *capacity * sizeof(int));
+    if (more == NULL) {
+      pexit("realloc");
+    }
+    *fds = more;
+  }
+
+  (*fds)[(*count)++] = fd;
+}
+
+int
+hasFileOpen(int pidDirFd, struct psProcess *proc, void *arg) {
+  const struct target *target = arg;
+  int fdDirFd, *fds = NULL, count = 0, capacity = 0;
+  DIR *fdDir;
+  struct dirent *d;
+
+  fdDirFd = openat(pidDirFd, "fd", O_RDONLY | O_DIRECTORY);
+
+  /* processes of other users cannot be inspected unless running as root, and
+   * processes may exit while being inspected */
+  if (fdDirFd != -1) {
+    fdDir = fdopendir(fdDirFd);
+    if (fdDir == NULL) {
+      pexit("fdopendir");
+    }
+
+    while ((d = readdir(fdDir)) != NULL) {
+      /* skip . and .. entries */
+      if (d->d_name[0] != '.' && fdMatches(fdDirFd, d->d_name, target)) {
+        addFd(&fds, &count, &capacity, atoi(d->d_name));
+      }
+    }
+
+    closedir(fdDir);
+  }
+
+  if (target->byInode && mapsTarget(pidDirFd, target)) {
+    addFd(&fds, &count, &capacity, FD_MAPPED);
+  }
+
+  if (count == 0) {
+    return 0;
+  }
+
+  fds[count] = FD_END;
+  proc->data = fds;
+  return 1;
+}
+
+int
+fdMatches(int fdDirFd, const char *name, const struct target *target) {
+  char buf[BUF_SIZ];
+  struct stat st;
   ssize_t numRead;
-  Bool commandFound;
+  size_t len;
 
-  numRead = read(statusFd, statusFile, STATUS_FILE_MAX);
+  /* descriptors may be closed in the meantime: they just do not match */
+  if (target->byInode) {
+    return fstatat(fdDirFd, name, &st, 0) == 0 && st.st_dev == target->dev && st.st_ino == target->ino;
+  }
+
+  numRead = readlinkat(fdDirFd, name, buf, BUF_SIZ - 1);
   if (numRead == -1) {
-    pexit("read");
-  } else if (numRead == STATUS_FILE_MAX) {
-    fprintf(stderr, "Your status file seems to be too big (> 10kB). Nothing we can do.\n");
-    exit(EXIT_FAILURE);
+    return 0;
   }
 
-  line = strtok(statusFile, "\n");
-  commandFound = FALSE;
+  /* readlink(2) does not append the null byte at the end of the read data,
+   * so we do it ourselves */
+  buf[numRead] = '\0';
 
-  while (!commandFound && line != NULL) {
-    /* check for the Name field */
-    if (strncmp(line, "Name:", 5) == 0) {
-      strncpy(command, line + 5, BUF_SIZ);
-      commandFound = TRUE;
-    }
+  len = strlen(target->filename);
+  return strncmp(buf, target->filename, len) == 0 &&
+         (buf[len] == '\0' || strcmp(buf + len, DELETED_SUFFIX) == 0);
+}
+
+int
+mapsTarget(int pidDirFd, const struct target *target) {
+  char line[BUF_SIZ + PATH_MAX];
+  unsigned int major, minor;
+  unsigned long inode;
+  int mapsFd, found = 0;
+  FILE *maps;
+
+  mapsFd = openat(pidDirFd, "maps", O_RDONLY);
+  if (mapsFd == -1) {
+    return 0;
+  }
 
-    line = strtok(NULL, "\n");
+  maps = fdopen(mapsFd, "r");
+  if (maps == NULL) {
+    pexit("fdopen");
   }
 
-  if (commandFound) {
-    printf("%8s%5s%20s\n", pid, fd, command);
+  /* each line reads: start-end perms offset major:minor inode [pathname] */
+  while (!found && fgets(line, sizeof(line), maps) != NULL) {
+    if (sscanf(line, "%*x-%*x %*s %*x %x:%x %lu", &major, &minor, &inode) == 3) {
+      found = inode != 0 && (ino_t) inode == target->ino && makedev(major, minor) == target->dev;
+    }
   }
+
+  fclose(maps);
+  return found;
 }
@@ -0,0 +1,282 @@
+/* procscan.c - Scans the processes of the system. See procscan.h.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <errno.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "procscan.h"
+
+#define PROC_FS ("/proc")
+#define DENTS_BUF_SIZ (256 * 1024) /* bytes of directory entries read at a time */
+#define STATUS_FILE_MAX (10240)
+#define STATUS_CHUNK (512)         /* bytes of a status file read at a time */
+#define SCAN_CHUNK (64)            /* processes a thread takes at a time */
+#define SCAN_THREADS_MAX (16)
+#define SCAN_MIN_PER_THREAD (256)  /* fewer processes than this per thread are not worth it */
+
+/* as returned by getdents64(2), which glibc does not declare */
+struct linuxDirent64 {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+struct scan {
+  int fields;
+  psFilter filter;
+  void *arg;
+
+  struct psProcess *procs;
+  char *keep;   /* whether each of `procs` is in the results */
+  size_t count;
+
+  size_t next;  /* the next process to be scanned; taken atomically */
+  int error;    /* errno of the first error of a thread, 0 if none */
+};
+
+/* descriptor of /proc, opened on the first scan and kept for the next ones */
+static int procFd = -1;
+
+/* lists the PIDs in /proc, into a newly allocated array. Returns -1 on errors */
+static int
+listPids(struct scan *scan) {
+  char *buf, *p;
+  struct linuxDirent64 *d;
+  struct psProcess *procs;
+  size_t capacity = 1024;
+  long numRead;
+
+  if (procFd == -1) {
+    procFd = open(PROC_FS, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (procFd == -1) {
+      return -1;
+    }
+  } else if (lseek(procFd, 0, SEEK_SET) == -1) {
+    return -1;
+  }
+
+  buf = malloc(DENTS_BUF_SIZ);
+  scan->procs = malloc(capacity * sizeof(struct psProcess));
+  if (buf == NULL || scan->procs == NULL) {
+    free(buf);
+    return -1;
+  }
+
+  scan->count = 0;
+  while ((numRead = syscall(SYS_getdents64, procFd, buf, DENTS_BUF_SIZ)) > 0) {
+    for (p = buf; p < buf + numRead; p += d->d_reclen) {
+      d = (struct linuxDirent64 *) p;
+
+      /* only process directories have numeric names */
+      if (d->d_name[0] < '0' || d->d_name[0] > '9') {
+        continue;
+      }
+
+      if (scan->count == capacity) {
+        capacity *= 2;
+        procs = realloc(scan->procs, capacity * sizeof(struct psProcess));
+        if (procs == NULL) {
+          free(buf);
+          return -1;
+        }
+        scan->procs = procs;
+      }
+
+      memset(&scan->procs[scan->count], 0, sizeof(struct psProcess));
+      scan->procs[scan->count++].pid = (pid_t) atol(d->d_name);
+    }
+  }
+
+  free(buf);
+  return (numRead == -1) ? -1 : 0;
+}
+
+/* parses the fields asked for out of the whole lines in `len` bytes of a status
+ * file. Returns the number of bytes parsed, up to the last newline */
+static size_t
+parseStatus(char *status, size_t len, int fields, struct psProcess *proc) {
+  char *line, *end, *nl;
+  size_t n;
+
+  end = status + len;
+  for (line = status; line < end && (proc->found & fields) != fields; line = nl + 1) {
+    nl = memchr(line, '\n', end - line);
+    if (nl == NULL) {
+      break;
+    }
+
+    if ((fields & PS_FIELD_NAME) && strncmp(line, "Name:\t", 6) == 0) {
+      n = nl - line - 6;
+      if (n >= PS_NAME_MAX) {
+        n = PS_NAME_MAX - 1;
+      }
+
+      memcpy(proc->name, line + 6, n);
+      proc->name[n] = '\0';
+      proc->found |= PS_FIELD_NAME;
+    } else if ((fields & PS_FIELD_PPID) && strncmp(line, "PPid:", 5) == 0) {
+      proc->ppid = (pid_t) atol(line + 5);
+      proc->found |= PS_FIELD_PPID;
+    } else if ((fields & PS_FIELD_UID) && strncmp(line, "Uid:", 4) == 0) {
+      proc->uid = (uid_t) atol(line + 4);
+      proc->found |= PS_FIELD_UID;
+    }
+  }
+
+  return line - status;
+}
+
+/* scans one process. Returns -1 on errors; processes that exited are not kept */
+static int
+scanProcess(struct scan *scan, size_t i, char *status) {
+  struct psProcess *proc = &scan->procs[i];
+  char name[32];
+  int pidDirFd, statusFd;
+  ssize_t numRead;
+  size_t used, parsed, len;
+
+  snprintf(name, sizeof(name), "%ld", (long) proc->pid);
+  pidDirFd = openat(procFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (pidDirFd == -1) {
+    return (errno == ENOENT) ? 0 : -1;
+  }
+
+  if (scan->fields != 0) {
+    statusFd = openat(pidDirFd, "status", O_RDONLY | O_CLOEXEC);
+    if (statusFd == -1) {
+      close(pidDirFd);
+      return (errno == ENOENT || errno == ESRCH) ? 0 : -1;
+    }
+
+    /* the fields come early on in the file (Name first, and Uid at around 300
+     * bytes), so it is read a chunk at a time, until they are all found */
+    used = parsed = 0;
+    numRead = 1;
+    while ((proc->found & scan->fields) != scan->fields && used < STATUS_FILE_MAX) {
+      len = STATUS_FILE_MAX - used;
+      numRead = read(statusFd, status + used, (len < STATUS_CHUNK) ? len : STATUS_CHUNK);
+      if (numRead <= 0) {
+        break;
+      }
+
+      used += numRead;
+      parsed += parseStatus(status + parsed, used - parsed, scan->fields, proc);
+    }
+    close(statusFd);
+
+    /* the process exited after its directory was opened */
+    if (used == 0) {
+      close(pidDirFd);
+      return (numRead == 0 || errno == ESRCH) ? 0 : -1;
+    }
+  }
+
+  scan->keep[i] = (scan->filter == NULL) || scan->filter(pidDirFd, proc, scan->arg);
+
+  close(pidDirFd);
+  return 0;
+}
+
+static void *
+scanWorker(void *arg) {
+  struct scan *scan = arg;
+  char status[STATUS_FILE_MAX];
+  size_t first, i;
+
+  for (;;) {
+    first = __atomic_fetch_add(&scan->next, SCAN_CHUNK, __ATOMIC_RELAXED);
+    if (first >= scan->count || __atomic_load_n(&scan->error, __ATOMIC_RELAXED) != 0) {
+      return NULL;
+    }
+
+    for (i = first; i < first + SCAN_CHUNK && i < scan->count; ++i) {
+      if (scanProcess(scan, i, status) == -1) {
+        __atomic_store_n(&scan->error, errno, __ATOMIC_RELAXED);
+        return NULL;
+      }
+    }
+  }
+}
+
+struct psProcess *
+psScan(int fields, int nthreads, psFilter filter, void *arg, size_t *count) {
+  struct scan scan;
+  pthread_t threads[SCAN_THREADS_MAX];
+  size_t i, kept;
+  int t, s;
+
+  memset(&scan, 0, sizeof(struct scan));
+  scan.fields = fields;
+  scan.filter = filter;
+  scan.arg = arg;
+
+  if (listPids(&scan) == -1) {
+    free(scan.procs);
+    return NULL;
+  }
+
+  scan.keep = calloc(scan.count + 1, 1);
+  if (scan.keep == NULL) {
+    free(scan.procs);
+    return NULL;
+  }
+
+  if (nthreads <= 0) {
+    nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (nthreads > SCAN_THREADS_MAX) {
+    nthreads = SCAN_THREADS_MAX;
+  }
+  if ((size_t) nthreads > scan.count / SCAN_MIN_PER_THREAD) {
+    nthreads = (int) (scan.count / SCAN_MIN_PER_THREAD);
+  }
+
+  /* the calling thread scans as well */
+  for (t = 0; t < nthreads - 1; ++t) {
+    if ((s = pthread_create(&threads[t], NULL, scanWorker, &scan)) != 0) {
+      /* do with the threads already running */
+      break;
+    }
+  }
+
+  scanWorker(&scan);
+  while (--t >= 0) {
+    pthread_join(threads[t], NULL);
+  }
+
+  if (scan.error != 0) {
+    for (i = 0; i < scan.count; ++i) {
+      free(scan.procs[i].data);
+    }
+    free(scan.procs);
+    free(scan.keep);
+    errno = scan.error;
+    return NULL;
+  }
+
+  /* leave only the processes kept, in order */
+  for (i = kept = 0; i < scan.count; ++i) {
+    if (scan.keep[i]) {
+      scan.procs[kept++] = scan.procs[i];
+    }
+  }
+
+  free(scan.keep);
+  *count = kept;
+  return scan.procs;
+}
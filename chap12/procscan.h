@@ -0,0 +1,54 @@
+/* procscan.h - Scans the processes of the system, for the tools in this directory.
+ *
+ * All of pf, pstree and running walk /proc looking at every process. This does it
+ * once, and faster than one process at a time through absolute paths: /proc is
+ * opened once and its entries read with getdents64(2) in large batches; the PIDs
+ * found are then handed out, in chunks, to a number of threads, which open each
+ * process directory relative to /proc (openat(2)), and parse out of its status
+ * file only the fields asked for - reading it in small chunks, and stopping as soon
+ * as they are all found.
+ *
+ * Programs using it are built along with procscan.c, and linked with -pthread.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#ifndef PROCSCAN_H
+#define PROCSCAN_H
+
+#include <sys/types.h>
+
+/* fields of /proc/PID/status that can be asked for */
+#define PS_FIELD_NAME (1 << 0) /* Name: */
+#define PS_FIELD_PPID (1 << 1) /* PPid: */
+#define PS_FIELD_UID  (1 << 2) /* Uid: (the real user ID) */
+
+#define PS_NAME_MAX (64)
+
+struct psProcess {
+  pid_t pid;
+  int found;              /* which of the fields asked for were found, PS_FIELD_* */
+  char name[PS_NAME_MAX];
+  pid_t ppid;
+  uid_t uid;
+  void *data;             /* free for the filter to use; NULL unless set by it */
+};
+
+/* called for every process, once its fields are parsed, with a descriptor of its
+ * /proc/PID directory (valid only during the call). Returns whether the process is
+ * to be kept in the results. Filters run from several threads at once: they must
+ * not modify anything shared without synchronization */
+typedef int (*psFilter)(int pidDirFd, struct psProcess *proc, void *arg);
+
+/* scans every process in the system, parsing the `fields` asked for (an OR of
+ * PS_FIELD_*), with `nthreads` threads - or as many as there are CPUs (up to a
+ * limit), if 0. Processes the `filter` (if not NULL) rejects are left out, as are
+ * those that exit while being scanned.
+ *
+ * Returns an array of the processes, in the order /proc lists them (that is, by
+ * increasing PID), storing their number in `count`. The array is to be released by
+ * the caller with free(3), along with the `data` of each process, if any. On
+ * error, returns NULL with `errno` set. */
+struct psProcess *psScan(int fields, int nthreads, psFilter filter, void *arg, size_t *count);
+
+#endif
@@ -6,7 +6,7 @@
  *
  * Usage
  *
- *    $ ./pstree
+ *    $ ./pstree [-w]
  *    - (1) init
  *      - (454) udevd
  *        - (18252) udevd
@@ -15,24 +15,53 @@
  *      - (2191) ntpd
    *   # lots more...
  *
+ *    -w: watch mode. After printing the tree, keep it up to date as processes are
+ *        created, execute programs and exit, printing a line for each change:
+ *
+ *        + (18300) bash [18253]     # created, as a child of 18253
+ *        * (18300) ls               # executed (or renamed itself to) ls
+ *        - (18300) ls               # exited
+ *
+ *        The whole tree, as it stands, is printed again on SIGUSR1.
+ *
+ * Processes are kept in a hash table keyed by PID, which grows with the number of
+ * processes found, and each one links to its parent, first child and siblings,
+ * so the memory used depends on how many processes are alive, not on the largest
+ * PID the system may assign (which can be in the millions). Processes are found
+ * with the scanner in procscan.c.
+ *
+ * In watch mode, /proc is only scanned once. Changes come from the kernel's proc
+ * connector (a netlink socket, which requires CAP_NET_ADMIN), one event for every
+ * fork, exec and exit, and each of them updates only the processes involved: the
+ * work done is proportional to the changes, not to the number of processes. The
+ * children of processes that exit are moved to their new parent, read from /proc.
+ * Should the kernel drop events (when they come faster than they are read), the
+ * tree is built anew.
+ *
  * Author: Renato Mascarenhas Costa
  */
 
+#define _DEFAULT_SOURCE /* strdup function */
+
 #include <unistd.h>
 #include <sys/types.h>
-#include <sys/stat.h>
+#include <sys/socket.h>
 #include <fcntl.h>
-#include <dirent.h>
+#include <signal.h>
 #include <errno.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#define PROC_FS ("/proc")
+#include "procscan.h"
+
 #define BUF_SIZ (512)
-#define CHILDREN_MAX (30567)
-#define STATUS_FILE_MAX (10240)
+#define TABLE_INITIAL_SIZE (1024) /* slots in the process table, always a power of 2 */
+#define EVENTS_BUF_SIZ (64 * 1024)
 
 /* the root of the process hierarchy is the `init` process with PID 1 in
  * UNIX systems. */
@@ -40,50 +69,112 @@
 
 typedef enum { FALSE, TRUE } Bool;
 
+/* processes are linked by PID: a process points to its parent, to its first and
+ * last child (so that children are kept in the order they are found), and to its
+ * previous and next siblings. A PID of 0 means there is none */
 struct process {
-  char command[BUF_SIZ];
-  int children_count;
-  uid_t children[CHILDREN_MAX];
+  pid_t pid;   /* 0 for empty slots of the table */
+  char *command;
+  pid_t parent;
+  pid_t firstChild, lastChild;
+  pid_t prevSibling, nextSibling;
+};
+
+/* open addressing hash table of processes, keyed by PID */
+struct processTable {
+  struct process *slots;
+  size_t size, count;
 };
 
+static volatile sig_atomic_t treeRequested = 0;
+
 void pexit(const char *fCall);
 
-/* Reads the /proc filesystem to fetch the maximum number allowed for a PID
- * in the system */
-long getPidMax();
+/* Returns the process with the given PID in the table, or NULL if it is not there */
+struct process *findProcess(struct processTable *table, pid_t pid);
+
+/* Returns the process with the given PID in the table, adding it if it is not there.
+ * Adding a process may grow the table, which moves the processes already in it: the
+ * pointers previously returned must not be used anymore. */
+struct process *addProcess(struct processTable *table, pid_t pid);
 
-/* Scans the /proc filesystem for each process and fills in the given array of
- * `process` structure, which must have been allocated beforehand. */
-void buildProcessDataStructure(struct process *processes);
+/* Removes the process with the given PID from the table, if it is there. It must
+ * not be linked to a parent, nor have children, anymore. */
+void removeProcess(struct processTable *table, pid_t pid);
 
-/* Prints a tree with the data containing in the array of processes passed as
+/* Makes `child` the last child of `parent`, leaving its previous parent, if any.
+ * Both must be in the table. */
+void setParent(struct processTable *table, pid_t child, pid_t parent);
+
+/* Unlinks a process from its parent and siblings. */
+void unlinkProcess(struct processTable *table, pid_t pid);
+
+/* Sets the command of a process in the table. */
+void setCommand(struct process *p, const char *command);
+
+/* Scans the processes in the system and fills in the given table of
+ * processes, which must have been initialized beforehand. */
+void buildProcessDataStructure(struct processTable *processes);
+
+/* Removes every process from the table. */
+void clearTable(struct processTable *processes);
+
+/* Prints a tree with the data containing in the table of processes passed as
  * argument. A call to `buildProcessDataStructure` must procede a call to this
  * function so that the process hierarchy is correctly calculated. The tree
  * is built from the `root` parameter passed. */
-void printTree(struct process *processes, int root, int level);
+void printTree(struct processTable *processes, pid_t root, int level);
+
+/* Subscribes to the events of the proc connector, returning the netlink socket the
+ * events are to be read from. */
+int subscribeEvents(void);
+
+/* Keeps the table up to date with the events read from the given socket, printing
+ * each change. Never returns. */
+void watchEvents(struct processTable *processes, int sock);
 
 int
-main() {
-  long pid_max;
+main(int argc, char *argv[]) {
+  int opt, sock = -1;
+  Bool watch = FALSE;
 
   /* this is the data structure that will hold all the information of the whole
    * operating system process hierarchy. After the /proc filesystem is parsed,
    * this data structure is filled and will allow the program to correctly print
    * the process tree from the root */
-  struct process *processes;
+  struct processTable processes;
+
+  while ((opt = getopt(argc, argv, "w")) != -1) {
+    switch (opt) {
+      case 'w': watch = TRUE; break;
+      default:
+        fprintf(stderr, "Usage: %s [-w]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
 
-  /* get the maximum PID number for the current system */
-  pid_max = getPidMax();
-  if (pid_max == -1) {
-    pexit("getPidMax");
+  processes.size = TABLE_INITIAL_SIZE;
+  processes.count = 0;
+  processes.slots = calloc(processes.size, sizeof(struct process));
+  if (processes.slots == NULL) {
+    pexit("calloc");
   }
 
-  processes = malloc(pid_max * sizeof(struct process));
+  /* subscribe before scanning, so that no process is missed in between. Events
+   * about processes already found are applied to them again, harmlessly */
+  if (watch) {
+    sock = subscribeEvents();
+  }
 
-  buildProcessDataStructure(processes);
-  printTree(processes, INIT_PID, 0);
+  buildProcessDataStructure(&processes);
+  printTree(&processes, INIT_PID, 0);
 
-  free(processes);
+  if (watch) {
+    watchEvents(&processes, sock);
+  }
+
+  clearTable(&processes);
+  free(processes.slots);
 
   return EXIT_SUCCESS;
 }
@@ -94,147 +185,463 @@ pexit(const char *fCall) {
   exit(EXIT_FAILURE);
 }
 
-long
-getPidMax() {
-  char buf[BUF_SIZ];
-  ssize_t numRead;
-  int fd;
-  long pid_max;
+static size_t
+homeSlot(pid_t pid, size_t size) {
+  return ((size_t) pid * 2654435761u) & (size - 1);
+}
 
-  snprintf(buf, BUF_SIZ, "%s/sys/kernel/pid_max", PROC_FS);
-  fd = open(buf, O_RDONLY);
-  if (fd == -1) {
-    return -1;
+/* the slot of the table where the process with the given PID is, or else where it
+ * would be added */
+static struct process *
+slotOf(struct process *slots, size_t size, pid_t pid) {
+  size_t i = homeSlot(pid, size);
+
+  while (slots[i].pid != 0 && slots[i].pid != pid) {
+    i = (i + 1) & (size - 1);
   }
 
-  numRead = read(fd, buf, BUF_SIZ);
-  if (numRead == -1) {
-    return -1;
+  return &slots[i];
+}
+
+struct process *
+findProcess(struct processTable *table, pid_t pid) {
+  struct process *p = slotOf(table->slots, table->size, pid);
+  return (p->pid == pid) ? p : NULL;
+}
+
+struct process *
+addProcess(struct processTable *table, pid_t pid) {
+  struct process *p, *slots;
+  size_t i;
+
+  p = slotOf(table->slots, table->size, pid);
+  if (p->pid == pid) {
+    return p;
   }
 
-  pid_max = atol(buf);
+  /* keep the table at most half full, so that probe sequences stay short */
+  if (2 * (table->count + 1) > table->size) {
+    slots = calloc(2 * table->size, sizeof(struct process));
+    if (slots == NULL) {
+      pexit("calloc");
+    }
+
+    for (i = 0; i < table->size; ++i) {
+      if (table->slots[i].pid != 0) {
+        *slotOf(slots, 2 * table->size, table->slots[i].pid) = table->slots[i];
+      }
+    }
+
+    free(table->slots);
+    table->slots = slots;
+    table->size *= 2;
 
-  if (pid_max == 0) {
-    /* could not convert to a number */
-    return -1;
+    p = slotOf(table->slots, table->size, pid);
   }
 
-  return pid_max;
+  memset(p, 0, sizeof(struct process));
+  p->pid = pid;
+  table->count++;
+
+  return p;
 }
 
 void
-buildProcessDataStructure(struct process *processes) {
-  DIR *proc;
-  struct dirent *procpid;
-  ssize_t numRead;
-  long pid, ppid;
-  int statusFd;
-  char buf[BUF_SIZ], statusFile[STATUS_FILE_MAX], command[BUF_SIZ];
-  char *line;
-  Bool parentFound, commandFound;
+removeProcess(struct processTable *table, pid_t pid) {
+  struct process *p;
+  size_t i, j, home, mask = table->size - 1;
 
-  proc = opendir(PROC_FS);
-  if (proc == NULL) {
-    pexit("opendir");
+  p = findProcess(table, pid);
+  if (p == NULL) {
+    return;
   }
 
-  for (errno = 0; (procpid = readdir(proc)) != NULL; errno = 0) {
-    /* skip `self` link */
-    if (strncmp(procpid->d_name, "self", 4) == 0) {
-      continue;
+  free(p->command);
+  i = p - table->slots;
+  memset(&table->slots[i], 0, sizeof(struct process));
+  table->count--;
+
+  /* move back the processes after the hole that would not be found past it: those
+   * whose home slot is not between the hole and where they are */
+  for (j = (i + 1) & mask; table->slots[j].pid != 0; j = (j + 1) & mask) {
+    home = homeSlot(table->slots[j].pid, table->size);
+
+    if ((i <= j) ? (home <= i || home > j) : (home <= i && home > j)) {
+      table->slots[i] = table->slots[j];
+      memset(&table->slots[j], 0, sizeof(struct process));
+      i = j;
     }
+  }
+}
 
-    snprintf(buf, BUF_SIZ, "%s/%s/status", PROC_FS, procpid->d_name);
-    statusFd = open(buf, O_RDONLY);
+void
+unlinkProcess(struct processTable *table, pid_t pid) {
+  struct process *p, *parent;
 
-    if (statusFd == -1) {
-      if (errno != ENOENT && errno != ENOTDIR) {
-        pexit("open");
-      }
+  p = findProcess(table, pid);
+  if (p == NULL || p->parent == 0) {
+    return;
+  }
 
-      /* if the directory does not contain a status file or is not even a directory, move on */
-      continue;
-    }
+  parent = findProcess(table, p->parent);
 
-    /* load the whole status file in memory to make sure field comparisons will work */
-    numRead = read(statusFd, statusFile, STATUS_FILE_MAX);
-    if (numRead == -1) {
-      pexit("read");
-    } else if (numRead == STATUS_FILE_MAX) {
-      fprintf(stderr, "Your status file seems to be too big (> 10kB). Nothing we can do.\n");
-      exit(EXIT_FAILURE);
-    }
+  if (p->prevSibling != 0) {
+    findProcess(table, p->prevSibling)->nextSibling = p->nextSibling;
+  } else {
+    parent->firstChild = p->nextSibling;
+  }
 
-    if (close(statusFd) == -1) {
-      pexit("close");
-    }
+  if (p->nextSibling != 0) {
+    findProcess(table, p->nextSibling)->prevSibling = p->prevSibling;
+  } else {
+    parent->lastChild = p->prevSibling;
+  }
 
-    pid = atol(procpid->d_name);
-    if (pid == 0) {
-      fprintf(stderr, "FATAL: Invalid PID directory %s/%s/status\n", PROC_FS, procpid->d_name);
-      exit(EXIT_FAILURE);
-    }
+  p->parent = p->prevSibling = p->nextSibling = 0;
+}
 
-    parentFound = commandFound = FALSE;
-    line = strtok(statusFile, "\n");
-    ppid = -1;
-    while (line != NULL) {
-      /* check for parent PID */
-      if (strncmp(line, "PPid:", 5) == 0) {
-        strncpy(buf, line + 6, BUF_SIZ);
-        ppid = atol(buf);
-        parentFound = TRUE;
-      }
+void
+setParent(struct processTable *table, pid_t child, pid_t parent) {
+  struct process *p, *pp;
 
-      /* check for command */
-      if (strncmp(line, "Name:", 5) == 0) {
-        strncpy(command, line + 6, BUF_SIZ);
-        commandFound = TRUE;
-      }
+  unlinkProcess(table, child);
 
-      line = strtok(NULL, "\n");
-    }
+  p = findProcess(table, child);
+  pp = findProcess(table, parent);
+
+  p->parent = parent;
+  p->prevSibling = pp->lastChild;
+  if (pp->lastChild == 0) {
+    pp->firstChild = child;
+  } else {
+    findProcess(table, pp->lastChild)->nextSibling = child;
+  }
+  pp->lastChild = child;
+}
+
+void
+setCommand(struct process *p, const char *command) {
+  free(p->command);
+  p->command = strdup(command);
+  if (p->command == NULL) {
+    pexit("strdup");
+  }
+}
+
+void
+buildProcessDataStructure(struct processTable *processes) {
+  struct psProcess *procs;
+  size_t count, i;
+  pid_t pid, ppid;
+
+  procs = psScan(PS_FIELD_NAME | PS_FIELD_PPID, 0, NULL, NULL, &count);
+  if (procs == NULL) {
+    pexit("psScan");
+  }
 
-    if (!parentFound || !commandFound) {
-      fprintf(stderr, "Something seems wrong with the status file of process %ld. It is missing fields.\n", pid);
+  for (i = 0; i < count; ++i) {
+    if (procs[i].found != (PS_FIELD_NAME | PS_FIELD_PPID)) {
+      fprintf(stderr, "Something seems wrong with the status file of process %ld. It is missing fields.\n", (long) procs[i].pid);
       exit(EXIT_FAILURE);
     }
 
-    /* save process data in hierarchy data structure */
-    strncpy(processes[pid].command, command, BUF_SIZ);
+    pid = procs[i].pid;
+    ppid = procs[i].ppid;
 
+    /* save process data in hierarchy data structure. The parent may not have been
+     * found yet, in which case it is added now, and its command filled in later */
+    addProcess(processes, pid);
     if (ppid > 0) {
-      processes[ppid].children[processes[ppid].children_count++] = pid;
+      addProcess(processes, ppid);
     }
-  }
 
-  if (errno != 0) {
-    pexit("readdir");
+    setCommand(findProcess(processes, pid), procs[i].name);
+
+    if (ppid > 0) {
+      setParent(processes, pid, ppid);
+    }
   }
 
-  if (closedir(proc) == -1) {
-    pexit("closedir");
+  free(procs);
+}
+
+void
+clearTable(struct processTable *processes) {
+  size_t i;
+
+  for (i = 0; i < processes->size; ++i) {
+    free(processes->slots[i].command);
   }
+
+  memset(processes->slots, 0, processes->size * sizeof(struct process));
+  processes->count = 0;
 }
 
 void
-printTree(struct process *processes, int root, int level) {
-  struct process rootp = processes[root];
+printTree(struct processTable *processes, pid_t root, int level) {
+  struct process *rootp = findProcess(processes, root);
+  pid_t child;
   int i;
 
+  if (rootp == NULL) {
+    return;
+  }
+
   /* properly ident according to the level in the hierarchy */
   for (i = 0; i < level; ++i) {
     printf("  ");
   }
 
-  printf("- (%ld) %s\n", (long) root, processes[root].command);
+  printf("- (%ld) %s\n", (long) root, rootp->command ? rootp->command : "?");
+
+  /* print children */
+  for (child = rootp->firstChild; child != 0; child = findProcess(processes, child)->nextSibling) {
+    printTree(processes, child, level + 1);
+  }
+}
+
+static void
+requestTree(int sig) {
+  (void) sig;
+  treeRequested = 1;
+}
+
+int
+subscribeEvents(void) {
+  struct sockaddr_nl addr;
+  struct {
+    struct nlmsghdr header;
+    struct cn_msg msg;
+    enum proc_cn_mcast_op op;
+  } __attribute__((packed)) request;
+  int sock;
+
+  sock = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+  if (sock == -1) {
+    pexit("socket");
+  }
+
+  memset(&addr, 0, sizeof(struct sockaddr_nl));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = CN_IDX_PROC;
+  addr.nl_pid = getpid();
+
+  if (bind(sock, (struct sockaddr *) &addr, sizeof(struct sockaddr_nl)) == -1) {
+    pexit("bind");
+  }
+
+  memset(&request, 0, sizeof(request));
+  request.header.nlmsg_len = sizeof(request);
+  request.header.nlmsg_type = NLMSG_DONE;
+  request.header.nlmsg_pid = getpid();
+  request.msg.id.idx = CN_IDX_PROC;
+  request.msg.id.val = CN_VAL_PROC;
+  request.msg.len = sizeof(enum proc_cn_mcast_op);
+  request.op = PROC_CN_MCAST_LISTEN;
+
+  if (send(sock, &request, sizeof(request), 0) == -1) {
+    pexit("send");
+  }
+
+  return sock;
+}
+
+/* reads the parent of a process from /proc. Returns 0 if it could not be read */
+static pid_t
+readParent(pid_t pid) {
+  char path[BUF_SIZ], buf[BUF_SIZ], *line;
+  ssize_t numRead;
+  int fd;
+
+  snprintf(path, BUF_SIZ, "/proc/%ld/status", (long) pid);
+  fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return 0;
+  }
+
+  /* PPid is in the first few lines */
+  numRead = read(fd, buf, BUF_SIZ - 1);
+  close(fd);
+  if (numRead <= 0) {
+    return 0;
+  }
+
+  buf[numRead] = '\0';
+  line = strstr(buf, "\nPPid:");
+  return (line == NULL) ? 0 : (pid_t) atol(line + 6);
+}
+
+/* reads the command of a process from /proc into `buf`. Returns FALSE if it could
+ * not be read */
+static Bool
+readCommand(pid_t pid, char *buf) {
+  char path[BUF_SIZ];
+  ssize_t numRead;
+  int fd;
+
+  snprintf(path, BUF_SIZ, "/proc/%ld/comm", (long) pid);
+  fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return FALSE;
+  }
+
+  numRead = read(fd, buf, BUF_SIZ - 1);
+  close(fd);
+  if (numRead <= 0) {
+    return FALSE;
+  }
+
+  buf[numRead - (buf[numRead - 1] == '\n')] = '\0';
+  return TRUE;
+}
+
+static void
+processForked(struct processTable *processes, pid_t parent, pid_t child) {
+  struct process *p;
+  const char *command;
+
+  addProcess(processes, parent);
+  addProcess(processes, child);
+
+  /* the child runs the same program as its parent, until it executes another */
+  p = findProcess(processes, parent);
+  command = p->command ? p->command : "?";
+  setCommand(findProcess(processes, child), command);
+  setParent(processes, child, parent);
+
+  printf("+ (%ld) %s [%ld]\n", (long) child, command, (long) parent);
+}
+
+static void
+processRenamed(struct processTable *processes, pid_t pid, const char *command) {
+  struct process *p;
+  char buf[BUF_SIZ];
+
+  p = findProcess(processes, pid);
+  if (p == NULL) {
+    return;
+  }
+
+  if (command == NULL) {
+    if (!readCommand(pid, buf)) {
+      return;
+    }
+    command = buf;
+  }
+
+  setCommand(p, command);
+  printf("* (%ld) %s\n", (long) pid, command);
+}
+
+static void
+processExited(struct processTable *processes, pid_t pid) {
+  struct process *p;
+  pid_t child, ppid;
+
+  p = findProcess(processes, pid);
+  if (p == NULL) {
+    return;
+  }
+
+  /* orphans are adopted by init, or by a subreaper: ask /proc which */
+  while ((child = p->firstChild) != 0) {
+    ppid = readParent(child);
+    if (ppid == 0 || ppid == pid) {
+      ppid = INIT_PID;
+    }
+
+    addProcess(processes, ppid);
+    setParent(processes, child, ppid);
+    p = findProcess(processes, pid);
+  }
+
+  printf("- (%ld) %s\n", (long) pid, p->command ? p->command : "?");
+
+  unlinkProcess(processes, pid);
+  removeProcess(processes, pid);
+}
+
+void
+watchEvents(struct processTable *processes, int sock) {
+  char buf[EVENTS_BUF_SIZ];
+  struct nlmsghdr *header;
+  struct cn_msg *msg;
+  struct proc_event *ev;
+  struct sigaction sa;
+  ssize_t numRead;
+
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0; /* interrupt recv(2), so that the tree is printed right away */
+  sa.sa_handler = requestTree;
+  if (sigaction(SIGUSR1, &sa, NULL) == -1) {
+    pexit("sigaction");
+  }
+
+  for (;;) {
+    fflush(stdout);
+    numRead = recv(sock, buf, EVENTS_BUF_SIZ, 0);
+
+    if (treeRequested) {
+      treeRequested = 0;
+      printTree(processes, INIT_PID, 0);
+    }
+
+    if (numRead == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      if (errno == ENOBUFS) {
+        /* events were lost: start over */
+        printf("# events lost, rescanning\n");
+        clearTable(processes);
+        buildProcessDataStructure(processes);
+        printTree(processes, INIT_PID, 0);
+        continue;
+      }
+
+      pexit("recv");
+    }
 
-  if (processes[root].children_count > 0) {
-    ++level;
+    for (header = (struct nlmsghdr *) buf; NLMSG_OK(header, (size_t) numRead); header = NLMSG_NEXT(header, numRead)) {
+      if (header->nlmsg_type == NLMSG_NOOP || header->nlmsg_type == NLMSG_ERROR) {
+        continue;
+      }
 
-    /* print children */
-    for (i = 0; i < rootp.children_count; ++i) {
-      printTree(processes, rootp.children[i], level);
+      msg = NLMSG_DATA(header);
+      if (msg->id.idx != CN_IDX_PROC || msg->id.val != CN_VAL_PROC) {
+        continue;
+      }
+
+      /* events about threads other than the main one of their process are ignored:
+       * the tree only has processes */
+      ev = (struct proc_event *) msg->data;
+      switch (ev->what) {
+        case PROC_EVENT_FORK:
+          if (ev->event_data.fork.child_pid == ev->event_data.fork.child_tgid) {
+            processForked(processes, ev->event_data.fork.parent_tgid, ev->event_data.fork.child_tgid);
+          }
+          break;
+
+        case PROC_EVENT_EXEC:
+          processRenamed(processes, ev->event_data.exec.process_tgid, NULL);
+          break;
+
+        case PROC_EVENT_COMM:
+          if (ev->event_data.comm.process_pid == ev->event_data.comm.process_tgid) {
+            processRenamed(processes, ev->event_data.comm.process_tgid, ev->event_data.comm.comm);
+          }
+          break;
+
+        case PROC_EVENT_EXIT:
+          if (ev->event_data.exit.process_pid == ev->event_data.exit.process_tgid) {
+            processExited(processes, ev->event_data.exit.process_tgid);
+          }
+          break;
+
+        default:
+          break;
+      }
     }
   }
 }
@@ -6,7 +6,9 @@
  *
  * Usage
  *
- *    $ ./running [<username>]
+ *    $ ./running [-a] [<username>...]
+ *    Process information for user renato (ID #1000)
+ *
  *      PID             COMMAND
  *    28418             running
  *     2864     gnome-keyring-d
@@ -16,145 +18,228 @@
  *     2990         dbus-daemon
  *     3000               tint2
  *
- *    <username> - the username to be searched. If omitted, the current user
+ *    $ ./running -d 1 [-n 10] [-a] [<username>...]
+ *
+ *    <username> - the usernames to be searched. If omitted, the current user
  *    (owner of the parent process) is used.
+ *    -a: show the processes of every user.
+ *    -d: sampling mode. Every given number of seconds, show the processes with the
+ *    CPU time each used since the previous sample, the busiest first.
+ *    -n: in sampling mode, the number of samples to show (default: until interrupted.)
+ *
+ * All users are answered by a single scan of the processes: the users asked for are
+ * looked up once, and kept in a table sorted by user ID, which each process is
+ * checked against (and, with -a, the table is filled with the user IDs found, each
+ * looked up once). Only the status fields needed are parsed, and the status file is
+ * not read any further than the Uid line.
+ *
+ * Sampling mode does not scan /proc from scratch every time. The stat file of every
+ * process shown is opened once and kept open, and read again from the start with
+ * pread(2) on every sample. The PIDs in /proc are listed again with getdents64(2),
+ * which lists them in order, and merged with the processes already known: only the
+ * processes new since the previous sample have files opened (and their status read,
+ * for their user), and those that are gone have theirs closed. A sample thus takes a
+ * single system call per process shown, besides listing /proc, and none for the
+ * processes of other users. The user of a process is only looked up when it is
+ * first seen.
  *
  * Author: Renato Mascarenhas Costa
  */
 
+#define _GNU_SOURCE
+
 #include <unistd.h>
 #include <sys/types.h>
-#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
 #include <fcntl.h>
 #include <pwd.h>
-#include <dirent.h>
 #include <errno.h>
+#include <limits.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-#define PROC_FS ("/proc")
-#define BUF_SIZ (512)
-#define STATUS_FILE_MAX (10240)
+#include "procscan.h"
 
-typedef enum { FALSE, TRUE } Bool;
+#ifndef LOGIN_NAME_MAX
+#define LOGIN_NAME_MAX (256)
+#endif
+
+struct user {
+  uid_t uid;
+  char name[LOGIN_NAME_MAX];
+};
+
+/* users, sorted by user ID */
+struct userTable {
+  struct user *users;
+  int count, capacity;
+};
+
+/* as returned by getdents64(2), which glibc does not declare */
+struct linuxDirent64 {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+#define DENTS_BUF_SIZ (256 * 1024) /* bytes of directory entries read at a time */
+#define STAT_FILE_MAX (1024)      /* enough of a stat file to reach the CPU times */
+#define STATUS_UID_MAX (1024)     /* enough of a status file to reach the Uid line */
+#define SPARE_FDS (16)            /* descriptors left free for anything else */
+
+/* a process known in sampling mode */
+struct sample {
+  pid_t pid;
+  ino64_t ino;              /* of its /proc directory, when first listed */
+  int shown;                /* whether it belongs to one of the users asked for */
+  int fd;                   /* its stat file, if shown; -1 if it could not be kept open */
+  uid_t uid;
+  char name[PS_NAME_MAX];
+  unsigned long long ticks; /* CPU time used so far, in clock ticks */
+  unsigned long long delta; /* CPU time used since the previous sample */
+};
+
+/* processes known, by PID. Each sample is merged into `next`, which then takes the
+ * place of `procs` */
+struct sampler {
+  int procFd;
+  char *dents;
+  struct sample *procs, *next;
+  size_t count, nextCount, capacity;
+  struct userTable *table;
+  int all;
+  size_t kept, maxKept;     /* stat files kept open, and how many can be */
+  int primed;               /* whether a sample was taken before */
+  size_t started, exited;   /* processes shown that started or exited since the previous sample */
+};
 
 void helpAndLeave(const char *progname, int status);
 void pexit(const char *fCall);
 
 uid_t uidFromUsername(char *username);
 
+/* Internal: returns the user with the given ID in the table, or NULL */
+struct user *findUser(struct userTable *table, uid_t uid);
+
+/* Internal: adds a user to the table, unless it is there already. If `name` is
+ * NULL, it is looked up (and the user ID used as name, for users not in the user
+ * database) */
+void addUser(struct userTable *table, uid_t uid, const char *name);
+
+/* Internal: scan filter keeping the processes whose real user ID is in the table
+ * of users pointed to by `table` */
+int ownedBy(int pidDirFd, struct psProcess *proc, void *table);
+
+int compareUsers(const void *a, const void *b);
+int compareProcesses(const void *a, const void *b);
+
+/* Internal: takes a sample every `interval` seconds, `count` times (or until
+ * interrupted, if 0), showing the processes of the users in the table */
+void sampleLoop(struct userTable *table, int all, double interval, long count);
+
+/* Internal: lists /proc and brings the processes known up to date */
+void takeSample(struct sampler *sampler);
+
+/* Internal: reads the stat file of a process shown, updating its CPU time. Returns
+ * -1 if the process is gone */
+int readStat(struct sampler *sampler, struct sample *proc);
+
+int compareSamples(const void *a, const void *b);
+
 int
 main(int argc, char *argv[]) {
-  int status;
+  struct userTable table = { NULL, 0, 0 };
+  struct psProcess *procs;
+  struct user *user;
+  size_t count, i, n;
+  int opt, u, all = 0;
+  double interval = 0;
+  long samples = 0;
+  char *endp;
   uid_t uid;
 
-  if (argc == 1) {
-    uid = geteuid();
-  } else if (argc == 2) {
-    status = uidFromUsername(argv[1]);
-
-    if (status == -1) {
-      fprintf(stderr, "%s: Username not found: %s\n", argv[0], argv[1]);
-      exit(EXIT_FAILURE);
-    } else {
-      uid = status;
+  while ((opt = getopt(argc, argv, "ad:n:h")) != -1) {
+    switch (opt) {
+      case 'a': all = 1; break;
+      case 'd':
+        interval = strtod(optarg, &endp);
+        if (*endp != '\0' || interval <= 0) {
+          helpAndLeave(argv[0], EXIT_FAILURE);
+        }
+        break;
+      case 'n':
+        samples = strtol(optarg, &endp, 10);
+        if (*endp != '\0' || samples < 1) {
+          helpAndLeave(argv[0], EXIT_FAILURE);
+        }
+        break;
+      case 'h': helpAndLeave(argv[0], EXIT_SUCCESS); break;
+      default: helpAndLeave(argv[0], EXIT_FAILURE);
     }
-  } else {
-    helpAndLeave(argv[0], EXIT_FAILURE);
   }
 
-  struct dirent *procpid;
-  int statusFd;
-  ssize_t numRead;
-  long pid, processCount;
-  char statusFile[BUF_SIZ], matching[BUF_SIZ], command[BUF_SIZ], buf[STATUS_FILE_MAX];
-  char *line;
-  Bool done, ownerFound, pidFound, commandFound;
-
-  DIR *proc = opendir(PROC_FS);
-  if (proc == NULL) {
-    pexit("opendir");
+  if ((all && optind < argc) || (samples > 0 && interval == 0)) {
+    helpAndLeave(argv[0], EXIT_FAILURE);
   }
 
-  printf("Process information for user ID #%ld\n\n", (long) uid);
-  processCount = 0;
-
-  printf("%8s%20s\n", "PID", "COMMAND");
-  for (errno = 0; (procpid = readdir(proc)) != NULL; errno = 0) {
-    snprintf(statusFile, BUF_SIZ, "%s/%s/status", PROC_FS, procpid->d_name);
-    statusFd = open(statusFile, O_RDONLY);
-
-    if (statusFd == -1) {
-      /* the directory do not contain a status file */
-      if (errno != ENOENT && errno != ENOTDIR) {
-        pexit("open");
-      }
+  if (!all && optind == argc) {
+    addUser(&table, geteuid(), NULL);
+  }
 
-      continue;
-    }
+  for (; optind < argc; ++optind) {
+    uid = uidFromUsername(argv[optind]);
 
-    /* read the whole file in memory to make sure field comparisons will work */
-    numRead = read(statusFd, buf, STATUS_FILE_MAX);
-    if (numRead == -1) {
-      pexit("read");
-    } else if (numRead == STATUS_FILE_MAX) {
-      fprintf(stderr, "Your status file seems to be too big (> 10kB). Nothing we can do.\n");
+    if (uid == (uid_t) -1) {
+      fprintf(stderr, "%s: Username not found: %s\n", argv[0], argv[optind]);
       exit(EXIT_FAILURE);
     }
 
-    if (close(statusFd)) {
-      pexit("close");
-    }
-
-    done  = FALSE; /* are we done processing the status file? */
-    ownerFound = pidFound = commandFound = FALSE;
-    while (!done) {
-      line = strtok(buf, "\n");
+    addUser(&table, uid, argv[optind]);
+  }
 
-      pid = -1;
-      while (line != NULL) {
-        /* check for the user of the process */
-        if (strncmp(line, "Uid:", 4) == 0) {
-          snprintf(matching, BUF_SIZ, "Uid:\t%ld", (long) uid);
-          if (strncmp(line, matching, strlen(matching)) == 0) {
-            ownerFound = TRUE;
-          } else {
-            /* this process is not from the user we want, we can stop processing */
-            done = TRUE;
-          }
-        }
+  if (interval > 0) {
+    sampleLoop(&table, all, interval, samples);
+    free(table.users);
+    return EXIT_SUCCESS;
+  }
 
-        /* check for Pid */
-        if (strncmp(line, "Pid:", 4) == 0) {
-          pid = atol(line + 4);
-          pidFound = TRUE;
-        }
+  procs = psScan(PS_FIELD_NAME | PS_FIELD_UID, 0, all ? NULL : ownedBy, &table, &count);
+  if (procs == NULL) {
+    pexit("psScan");
+  }
 
-        /* check for command name */
-        if (strncmp(line, "Name:", 5) == 0) {
-          strncpy(command, line + 6, BUF_SIZ);
-          commandFound = TRUE;
-        }
+  /* processes are listed by user, and then by PID */
+  qsort(procs, count, sizeof(struct psProcess), compareProcesses);
 
-        line = strtok(NULL, "\n");
-        done = done || (ownerFound && pidFound && commandFound);
-      }
+  if (all) {
+    for (i = 0; i < count; ++i) {
+      addUser(&table, procs[i].uid, NULL);
     }
+  }
+
+  /* both users and processes are sorted by user ID */
+  for (u = 0, i = 0; u < table.count; ++u) {
+    user = &table.users[u];
+
+    printf("%sProcess information for user %s (ID #%ld)\n\n", (u > 0) ? "\n" : "", user->name, (long) user->uid);
+    printf("%8s%20s\n", "PID", "COMMAND");
 
-    /* process if from user being searched */
-    if (ownerFound) {
-      ++processCount;
-      printf("%8ld%20s\n", pid, command);
+    for (n = 0; i < count && procs[i].uid == user->uid; ++i, ++n) {
+      printf("%8ld%20s\n", (long) procs[i].pid, procs[i].name);
     }
-  }
 
-  if (closedir(proc) == -1) {
-    pexit("closedir");
+    printf("%ld processes found.\n", (long) n);
   }
 
-  printf("%ld processes found.\n", processCount);
+  free(procs);
+  free(table.users);
+
   return EXIT_SUCCESS;
 }
 
@@ -166,7 +251,7 @@ helpAndLeave(const char *progname, int status) {
     stream = stdout;
   }
 
-  fprintf(stream, "%s [<username>]\n", progname);
+  fprintf(stream, "%s [-d seconds [-n samples]] [-a] [<username>...]\n", progname);
   exit(status);
 }
 
@@ -196,3 +281,425 @@ uidFromUsername(char *username) {
     return -1; /* should never get to this point */
   }
 }
+
+struct user *
+findUser(struct userTable *table, uid_t uid) {
+  struct user key;
+
+  key.uid = uid;
+  return bsearch(&key, table->users, table->count, sizeof(struct user), compareUsers);
+}
+
+void
+addUser(struct userTable *table, uid_t uid, const char *name) {
+  struct passwd *pw;
+  struct user *users;
+  int i;
+
+  if (findUser(table, uid) != NULL) {
+    return;
+  }
+
+  if (table->count == table->capacity) {
+    table->capacity = (table->capacity == 0) ? 16 : 2 * table->capacity;
+    users = realloc(table->users, table->capacity * sizeof(struct user));
+    if (users == NULL) {
+      pexit("realloc");
+    }
+    table->users = users;
+  }
+
+  /* keep the table sorted */
+  for (i = table->count; i > 0 && table->users[i - 1].uid > uid; --i) {
+    table->users[i] = table->users[i - 1];
+  }
+
+  table->users[i].uid = uid;
+  if (name == NULL) {
+    pw = getpwuid(uid);
+    if (pw != NULL) {
+      name = pw->pw_name;
+    }
+  }
+
+  if (name != NULL) {
+    snprintf(table->users[i].name, LOGIN_NAME_MAX, "%s", name);
+  } else {
+    snprintf(table->users[i].name, LOGIN_NAME_MAX, "%ld", (long) uid);
+  }
+
+  table->count++;
+}
+
+int
+ownedBy(int pidDirFd, struct psProcess *proc, void *table) {
+  (void) pidDirFd;
+  return (proc->found & PS_FIELD_UID) && findUser(table, proc->uid) != NULL;
+}
+
+int
+compareUsers(const void *a, const void *b) {
+  uid_t x = ((const struct user *) a)->uid, y = ((const struct user *) b)->uid;
+  return (x > y) - (x < y);
+}
+
+int
+compareProcesses(const void *a, const void *b) {
+  const struct psProcess *x = a, *y = b;
+
+  if (x->uid != y->uid) {
+    return (x->uid > y->uid) - (x->uid < y->uid);
+  }
+
+  return (x->pid > y->pid) - (x->pid < y->pid);
+}
+
+void
+sampleLoop(struct userTable *table, int all, double interval, long count) {
+  struct sampler sampler;
+  struct sample **shown;
+  struct timespec prev, now, delay;
+  struct rlimit rl;
+  struct user *user;
+  double elapsed, ticksPerSec, total;
+  size_t i, n;
+  long taken;
+
+  memset(&sampler, 0, sizeof(sampler));
+  sampler.table = table;
+  sampler.all = all;
+
+  /* a descriptor is kept open for every process shown: allow as many as possible.
+   * Past the limit, stat files are opened for each read instead */
+  if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+    pexit("getrlimit");
+  }
+
+  if (rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+      getrlimit(RLIMIT_NOFILE, &rl);
+    }
+  }
+
+  if (rl.rlim_cur > SPARE_FDS) {
+    sampler.maxKept = (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > INT_MAX) ? INT_MAX : rl.rlim_cur - SPARE_FDS;
+  }
+
+  sampler.procFd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (sampler.procFd == -1) {
+    pexit("open");
+  }
+
+  sampler.dents = malloc(DENTS_BUF_SIZ);
+  if (sampler.dents == NULL) {
+    pexit("malloc");
+  }
+
+  ticksPerSec = sysconf(_SC_CLK_TCK);
+  delay.tv_sec = (time_t) interval;
+  delay.tv_nsec = (long) ((interval - delay.tv_sec) * 1e9);
+
+  /* the first sample only tells where every process starts from */
+  takeSample(&sampler);
+  clock_gettime(CLOCK_MONOTONIC, &prev);
+
+  for (taken = 0; count == 0 || taken < count; ++taken) {
+    while (nanosleep(&delay, &delay) == -1 && errno == EINTR)
+      ;
+    delay.tv_sec = (time_t) interval;
+    delay.tv_nsec = (long) ((interval - delay.tv_sec) * 1e9);
+
+    takeSample(&sampler);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - prev.tv_sec) + (now.tv_nsec - prev.tv_nsec) / 1e9;
+    prev = now;
+
+    shown = malloc((sampler.count + 1) * sizeof(struct sample *));
+    if (shown == NULL) {
+      pexit("malloc");
+    }
+
+    total = 0;
+    for (i = 0, n = 0; i < sampler.count; ++i) {
+      if (sampler.procs[i].shown) {
+        shown[n++] = &sampler.procs[i];
+        total += sampler.procs[i].delta;
+      }
+    }
+
+    /* the busiest first, like top(1) */
+    qsort(shown, n, sizeof(struct sample *), compareSamples);
+
+    printf("%s%ld processes (%ld started, %ld exited), %.1f%% CPU in %.2fs\n\n", (taken > 0) ? "\n" : "",
+        (long) n, (long) sampler.started, (long) sampler.exited, total / ticksPerSec / elapsed * 100, elapsed);
+    printf("%8s%16s%8s%20s\n", "PID", "USER", "%CPU", "COMMAND");
+
+    for (i = 0; i < n; ++i) {
+      user = findUser(table, shown[i]->uid);
+      printf("%8ld%16s%8.1f%20s\n", (long) shown[i]->pid, (user != NULL) ? user->name : "?",
+          shown[i]->delta / ticksPerSec / elapsed * 100, shown[i]->name);
+    }
+
+    if (fflush(stdout) == EOF) {
+      pexit("fflush");
+    }
+
+    free(shown);
+  }
+
+  for (i = 0; i < sampler.count; ++i) {
+    if (sampler.procs[i].fd != -1) {
+      close(sampler.procs[i].fd);
+    }
+  }
+
+  close(sampler.procFd);
+  free(sampler.dents);
+  free(sampler.procs);
+  free(sampler.next);
+}
+
+/* Internal: appends a process to the next list of processes known */
+static struct sample *
+appendSample(struct sampler *sampler) {
+  struct sample *procs;
+  size_t capacity;
+
+  if (sampler->nextCount == sampler->capacity) {
+    capacity = (sampler->capacity == 0) ? 1024 : 2 * sampler->capacity;
+
+    procs = realloc(sampler->procs, capacity * sizeof(struct sample));
+    if (procs == NULL) {
+      pexit("realloc");
+    }
+    sampler->procs = procs;
+
+    procs = realloc(sampler->next, capacity * sizeof(struct sample));
+    if (procs == NULL) {
+      pexit("realloc");
+    }
+    sampler->next = procs;
+
+    sampler->capacity = capacity;
+  }
+
+  return &sampler->next[sampler->nextCount++];
+}
+
+/* Internal: forgets a process that is gone */
+static void
+dropSample(struct sampler *sampler, struct sample *proc) {
+  if (proc->fd != -1) {
+    close(proc->fd);
+    proc->fd = -1;
+    sampler->kept--;
+  }
+
+  if (proc->shown) {
+    sampler->exited++;
+  }
+}
+
+/* Internal: finds out the user of a process new since the previous sample, and, if
+ * it is to be shown, opens its stat file. Returns -1 if the process is gone */
+static int
+newSample(struct sampler *sampler, struct sample *proc, pid_t pid, ino64_t ino) {
+  char path[32], buf[STATUS_UID_MAX], *uid;
+  ssize_t numRead;
+  int fd;
+
+  proc->pid = pid;
+  proc->ino = ino;
+  proc->fd = -1;
+  proc->ticks = proc->delta = 0;
+
+  /* the real user ID, as in the scans of procscan.c: the owner of the directory
+   * is the effective one */
+  snprintf(path, sizeof(path), "%ld/status", (long) pid);
+  fd = openat(sampler->procFd, path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return -1;
+  }
+
+  numRead = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (numRead <= 0) {
+    return -1;
+  }
+
+  buf[numRead] = '\0';
+  uid = strstr(buf, "\nUid:");
+  if (uid == NULL) {
+    return -1;
+  }
+  proc->uid = (uid_t) strtoul(uid + strlen("\nUid:"), NULL, 10);
+
+  proc->shown = sampler->all || findUser(sampler->table, proc->uid) != NULL;
+  if (!proc->shown) {
+    return 0;
+  }
+
+  if (sampler->all) {
+    addUser(sampler->table, proc->uid, NULL);
+  }
+
+  if (sampler->kept < sampler->maxKept) {
+    snprintf(path, sizeof(path), "%ld/stat", (long) pid);
+    proc->fd = openat(sampler->procFd, path, O_RDONLY | O_CLOEXEC);
+    if (proc->fd == -1) {
+      return -1;
+    }
+    sampler->kept++;
+  }
+
+  if (readStat(sampler, proc) == -1) {
+    return -1;
+  }
+
+  /* a process new since the previous sample used all its CPU time since then */
+  proc->delta = sampler->primed ? proc->ticks : 0;
+  if (sampler->primed) {
+    sampler->started++;
+  }
+
+  return 0;
+}
+
+int
+readStat(struct sampler *sampler, struct sample *proc) {
+  char path[32], buf[STAT_FILE_MAX], *start, *end;
+  unsigned long long utime, stime;
+  ssize_t numRead;
+  size_t len;
+  int fd;
+
+  /* out of descriptors: the file is opened just for this read */
+  fd = proc->fd;
+  if (fd == -1) {
+    snprintf(path, sizeof(path), "%ld/stat", (long) proc->pid);
+    fd = openat(sampler->procFd, path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      return -1;
+    }
+  }
+
+  numRead = pread(fd, buf, sizeof(buf) - 1, 0);
+  if (proc->fd == -1) {
+    close(fd);
+  }
+
+  /* the file of a process that exited reads as an error (ESRCH), or as nothing */
+  if (numRead <= 0) {
+    return -1;
+  }
+  buf[numRead] = '\0';
+
+  /* the command name is in parentheses, and may hold parentheses itself */
+  start = strchr(buf, '(');
+  end = strrchr(buf, ')');
+  if (start == NULL || end == NULL || end < start) {
+    return -1;
+  }
+
+  len = end - start - 1;
+  if (len >= PS_NAME_MAX) {
+    len = PS_NAME_MAX - 1;
+  }
+  memcpy(proc->name, start + 1, len);
+  proc->name[len] = '\0';
+
+  /* utime and stime are the 14th and 15th fields, the command being the 2nd */
+  if (sscanf(end + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2) {
+    return -1;
+  }
+
+  proc->delta = utime + stime - proc->ticks;
+  proc->ticks = utime + stime;
+  return 0;
+}
+
+void
+takeSample(struct sampler *sampler) {
+  struct linuxDirent64 *d;
+  struct sample *proc, *swap;
+  size_t i = 0;
+  long numRead;
+  pid_t pid;
+  char *p;
+
+  if (lseek(sampler->procFd, 0, SEEK_SET) == -1) {
+    pexit("lseek");
+  }
+
+  sampler->nextCount = 0;
+  sampler->started = sampler->exited = 0;
+
+  /* both /proc and the processes known are in PID order: merge them */
+  while ((numRead = syscall(SYS_getdents64, sampler->procFd, sampler->dents, DENTS_BUF_SIZ)) > 0) {
+    for (p = sampler->dents; p < sampler->dents + numRead; p += d->d_reclen) {
+      d = (struct linuxDirent64 *) p;
+
+      /* only process directories have numeric names */
+      if (d->d_name[0] < '0' || d->d_name[0] > '9') {
+        continue;
+      }
+      pid = (pid_t) atol(d->d_name);
+
+      for (; i < sampler->count && sampler->procs[i].pid < pid; ++i) {
+        dropSample(sampler, &sampler->procs[i]);
+      }
+
+      proc = appendSample(sampler);
+
+      if (i < sampler->count && sampler->procs[i].pid == pid) {
+        /* the same PID as before. A descriptor kept open still refers to the same
+         * process if the PID was reused: the file reads as if the process exited.
+         * For processes not shown, a new directory tells a reused PID */
+        *proc = sampler->procs[i++];
+        if (proc->shown ? readStat(sampler, proc) == 0 : proc->ino == d->d_ino) {
+          continue;
+        }
+
+        dropSample(sampler, proc);
+        if (newSample(sampler, proc, pid, d->d_ino) == 0) {
+          continue;
+        }
+      } else if (newSample(sampler, proc, pid, d->d_ino) == 0) {
+        continue;
+      }
+
+      /* gone before it could be looked at */
+      if (proc->fd != -1) {
+        close(proc->fd);
+        sampler->kept--;
+      }
+      sampler->nextCount--;
+    }
+  }
+
+  if (numRead == -1) {
+    pexit("getdents64");
+  }
+
+  for (; i < sampler->count; ++i) {
+    dropSample(sampler, &sampler->procs[i]);
+  }
+
+  swap = sampler->procs;
+  sampler->procs = sampler->next;
+  sampler->next = swap;
+  sampler->count = sampler->nextCount;
+  sampler->primed = 1;
+}
+
+int
+compareSamples(const void *a, const void *b) {
+  const struct sample *x = *(struct sample * const *) a, *y = *(struct sample * const *) b;
+
+  if (x->delta != y->delta) {
+    return (x->delta < y->delta) - (x->delta > y->delta);
+  }
+
+  return (x->pid > y->pid) - (x->pid < y->pid);
+}
@@ -64,74 +64,673 @@
  * impact as can be seen in the results. For smaller buffer sizes, the time is just
  * too big to even consider (I left it copying overnight and it was not enough
  * for a whole copy).
+ *
+ * Strategies and the benchmark matrix
+ * ===================================
+ *
+ * Besides read/write, the copy can be done with other strategies, chosen at run
+ * time with `-s`, along with the buffer size (`-b`, which accepts K, M and G
+ * suffixes). For the strategies that do not use a buffer, it is the amount asked
+ * for on each call:
+ *
+ *    rw               read(2) and write(2) (the default)
+ *    pread            pread(2) and pwrite(2)
+ *    mmap             memcpy(3) between mappings of both files, as in chap49/mmcp.c
+ *    direct           read/write, with both files opened with O_DIRECT
+ *    fadvise          read/write, advising sequential access and dropping the pages
+ *                     of the input from the cache behind the copy
+ *    sendfile         sendfile(2)
+ *    copy_file_range  copy_file_range(2)
+ *    splice           splice(2) through a pipe
+ *    io_uring         reads and writes through io_uring, `-q` chunks of the buffer
+ *                     size in flight at a time (default 32; see lib/uringcopy.h)
+ *
+ *    $ ./copy_c_tests -s sendfile -b 1M oldfile newfile
+ *    $ ./copy_c_tests -s io_uring -b 256K -q 64 oldfile newfile
+ *
+ * With `-m`, every combination of the strategies and buffer sizes listed (comma
+ * separated) is run on each directory given, usually on different file systems. A
+ * file of `-S` bytes (default 256M) is created in each directory and copied `-n`
+ * times (default 3), and the averages are written as CSV: throughput, and the user
+ * and system CPU time the copy took. With `-c`, the input is dropped from the page
+ * cache before every copy, so that it is read from the disk; with `-y`, the output
+ * is flushed to the disk with fsync(2) as part of the copy.
+ *
+ *    $ ./copy_c_tests -m -s rw,mmap,sendfile -b 4K,64K,1M /tmp /home > results.csv
+ *
+ * Combinations a file system does not support (O_DIRECT on tmpfs, for instance)
+ * are reported on the standard error and skipped.
+ *
+ * Built along with uringcopy.c:
+ *
+ *    $ c99 -o copy_c_tests copy_c_tests.c ../lib/uringcopy.c
  */
 
+/* get definitions of O_DIRECT, `copy_file_range` and `splice` */
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/statfs.h>
+#include <sys/resource.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include "../lib/uringcopy.h"
 
 #ifndef BUF_SIZE
 #  define BUF_SIZE 1024
 #endif
 
+/* O_DIRECT transfers must be aligned to the logical block size of the device; the
+ * page size is a multiple of it everywhere that matters */
+#define DIRECT_ALIGN 4096
+
+#define MAX_SIZES 32
+#define QUEUE_DEPTH 32
+#define BENCH_INPUT  ".copy_c_tests.in"
+#define BENCH_OUTPUT ".copy_c_tests.out"
+
+typedef int (*copyFn)(int inputFd, int outputFd, off_t size, size_t bufSize, char *buf);
+
+struct strategy {
+  const char *name;
+  copyFn copy;
+  int openFlags; /* added when opening both files */
+};
+
 static void helpAndLeave(const char *progname, int status);
 static void pexit(const char *fCall);
 
+static int copyReadWrite(int inputFd, int outputFd, off_t size, size_t bufSize, char *buf);
+static int copyPread(int inputFd, int outputFd, off_t size, size_t bufSize, char *buf);
+static int copyMmap(int inputFd, int outputFd, off_t size, size_t bufSize, char *buf);
+static int copyDirect(int inputFd, int outputFd, off_t size, size_t bufSize, char *buf);
+static int copyFadvise(int inputFd, int outputFd, off_t size, size_t bufSize, char *buf);
+static int copySendfile(int inputFd, int outputFd, off_t size, size_t bufSize, char *buf);
+static int copyRange(int inputFd, int outputFd, off_t size, size_t bufSize, char *buf);
+static int copySplice(int inputFd, int outputFd, off_t size, size_t bufSize, char *buf);
+static int copyUring(int inputFd, int outputFd, off_t size, size_t bufSize, char *buf);
+
+static const struct strategy strategies[] = {
+  { "rw",              copyReadWrite, 0 },
+  { "pread",           copyPread,     0 },
+  { "mmap",            copyMmap,      0 },
+  { "direct",          copyDirect,    O_DIRECT },
+  { "fadvise",         copyFadvise,   0 },
+  { "sendfile",        copySendfile,  0 },
+  { "copy_file_range", copyRange,     0 },
+  { "splice",          copySplice,    0 },
+  { "io_uring",        copyUring,     0 },
+};
+
+/* chunks in flight with io_uring */
+static unsigned queueDepth = QUEUE_DEPTH;
+
+#define NUM_STRATEGIES (sizeof(strategies) / sizeof(strategies[0]))
+
+static const struct strategy *findStrategy(const char *name);
+static size_t parseSize(const char *s);
+static char *allocBuffer(size_t size);
+static int copyFile(const struct strategy *st, const char *src, const char *dst, size_t bufSize,
+                    char *buf, int openFlags, int cold, int sync);
+static void runMatrix(const struct strategy **sts, int numSts, size_t *sizes, int numSizes,
+                      char **dirs, int numDirs, off_t fileSize, int runs, int cold, int sync);
+
 int
 main(int argc, char *argv[]) {
-  int inputFd, outputFd, openFlags;
-  mode_t filePerms;
-  ssize_t numRead;
-  char buf[BUF_SIZE];
+  const struct strategy *sts[NUM_STRATEGIES];
+  size_t sizes[MAX_SIZES];
+  int opt, matrix = 0, cold = 0, sync = 0, runs = 3, numSts = 0, numSizes = 0;
+  off_t fileSize = 256 * 1024 * 1024;
+  int openFlags = O_CREAT | O_WRONLY | O_TRUNC;
+  char *tok, *saveptr;
+  int i;
+
+  while ((opt = getopt(argc, argv, "hms:b:S:n:q:cy")) != -1) {
+    switch (opt) {
+      case 'h': helpAndLeave(argv[0], EXIT_SUCCESS); break;
+      case 'm': matrix = 1; break;
+      case 'c': cold = 1; break;
+      case 'y': sync = 1; break;
+      case 'n': runs = atoi(optarg); break;
+      case 'S': fileSize = (off_t) parseSize(optarg); break;
+      case 'q': queueDepth = (unsigned) atoi(optarg); break;
+      case 's':
+        for (tok = strtok_r(optarg, ",", &saveptr); tok != NULL; tok = strtok_r(NULL, ",", &saveptr)) {
+          if (numSts == (int) NUM_STRATEGIES || (sts[numSts] = findStrategy(tok)) == NULL) {
+            fprintf(stderr, "Unknown strategy: %s\n", tok);
+            exit(EXIT_FAILURE);
+          }
+          numSts++;
+        }
+        break;
+      case 'b':
+        for (tok = strtok_r(optarg, ",", &saveptr); tok != NULL; tok = strtok_r(NULL, ",", &saveptr)) {
+          if (numSizes == MAX_SIZES || (sizes[numSizes] = parseSize(tok)) == 0) {
+            fprintf(stderr, "Invalid buffer size: %s\n", tok);
+            exit(EXIT_FAILURE);
+          }
+          numSizes++;
+        }
+        break;
+      default: helpAndLeave(argv[0], EXIT_FAILURE);
+    }
+  }
 
-  if (argc != 3) {
+  /* by default, the matrix runs every strategy with a few buffer sizes, and a
+   * single copy uses read/write with BUF_SIZE */
+  if (numSts == 0) {
+    for (i = 0; i < (matrix ? (int) NUM_STRATEGIES : 1); i++) {
+      sts[numSts++] = &strategies[i];
+    }
+  }
+
+  if (numSizes == 0) {
+    if (matrix) {
+      sizes[numSizes++] = 4 * 1024;
+      sizes[numSizes++] = 64 * 1024;
+      sizes[numSizes++] = 1024 * 1024;
+    } else {
+      sizes[numSizes++] = BUF_SIZE;
+    }
+  }
+
+  if (runs < 1 || fileSize < 1 || queueDepth < 1) {
     helpAndLeave(argv[0], EXIT_FAILURE);
   }
 
-  /* open input and output files */
+  if (matrix) {
+    if (optind >= argc) {
+      helpAndLeave(argv[0], EXIT_FAILURE);
+    }
 
-  inputFd = open(argv[1], O_RDONLY);
-  if (inputFd == -1) {
-    pexit("open");
+    runMatrix(sts, numSts, sizes, numSizes, argv + optind, argc - optind, fileSize, runs, cold, sync);
+    return EXIT_SUCCESS;
+  }
+
+  /* a single copy, of the files given */
+  if (argc != optind + 2 || numSts != 1 || numSizes != 1) {
+    helpAndLeave(argv[0], EXIT_FAILURE);
   }
 
-  openFlags = O_CREAT | O_WRONLY | O_TRUNC;
 #ifdef SYNC_WRITE
   openFlags |= O_SYNC;
 #endif
 
+  if (copyFile(sts[0], argv[optind], argv[optind + 1], sizes[0], allocBuffer(sizes[0]), openFlags, cold, sync) == -1) {
+    pexit(sts[0]->name);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+static const struct strategy *
+findStrategy(const char *name) {
+  size_t i;
+
+  for (i = 0; i < NUM_STRATEGIES; i++) {
+    if (!strcmp(strategies[i].name, name)) {
+      return &strategies[i];
+    }
+  }
+
+  return NULL;
+}
+
+/* a size in bytes, with an optional K, M or G suffix. Returns 0 if invalid */
+static size_t
+parseSize(const char *s) {
+  char *end;
+  unsigned long long n;
+
+  n = strtoull(s, &end, 10);
+  switch (*end) {
+    case 'k': case 'K': n <<= 10; end++; break;
+    case 'm': case 'M': n <<= 20; end++; break;
+    case 'g': case 'G': n <<= 30; end++; break;
+  }
+
+  return (*end == '\0') ? (size_t) n : 0;
+}
+
+/* buffers are aligned for O_DIRECT, and a multiple of its alignment in size */
+static char *
+allocBuffer(size_t size) {
+  void *buf;
+
+  size = (size + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+  if (posix_memalign(&buf, DIRECT_ALIGN, size) != 0) {
+    fprintf(stderr, "Could not allocate a buffer of %zu bytes\n", size);
+    exit(EXIT_FAILURE);
+  }
+
+  return buf;
+}
+
+/* writes `len` bytes, retrying on short writes */
+static int
+writeFully(int fd, const char *buf, size_t len) {
+  ssize_t numWritten;
+
+  while (len > 0) {
+    numWritten = write(fd, buf, len);
+    if (numWritten == -1) {
+      return -1;
+    }
+
+    buf += numWritten;
+    len -= numWritten;
+  }
+
+  return 0;
+}
+
+static int
+copyReadWrite(int inputFd, int outputFd, __attribute__((unused)) off_t size, size_t bufSize, char *buf) {
+  ssize_t numRead;
+
+  while ((numRead = read(inputFd, buf, bufSize)) > 0) {
+    if (writeFully(outputFd, buf, numRead) == -1) {
+      return -1;
+    }
+  }
+
+  return (numRead == -1) ? -1 : 0;
+}
+
+static int
+copyPread(int inputFd, int outputFd, off_t size, size_t bufSize, char *buf) {
+  ssize_t numRead, numWritten;
+  off_t offset, done;
+
+  for (offset = 0; offset < size; offset += numRead) {
+    numRead = pread(inputFd, buf, bufSize, offset);
+    if (numRead <= 0) {
+      return (numRead == -1) ? -1 : 0;
+    }
+
+    for (done = 0; done < numRead; done += numWritten) {
+      numWritten = pwrite(outputFd, buf + done, numRead - done, offset + done);
+      if (numWritten == -1) {
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* both files are mapped whole, and copied `bufSize` bytes at a time */
+static int
+copyMmap(int inputFd, int outputFd, off_t size, size_t bufSize, __attribute__((unused)) char *buf) {
+  char *src, *dst;
+  off_t offset;
+  size_t len;
+
+  if (ftruncate(outputFd, size) == -1) {
+    return -1;
+  }
+
+  src = mmap(NULL, size, PROT_READ, MAP_PRIVATE, inputFd, 0);
+  if (src == MAP_FAILED) {
+    return -1;
+  }
+
+  dst = mmap(NULL, size, PROT_WRITE, MAP_SHARED, outputFd, 0);
+  if (dst == MAP_FAILED) {
+    munmap(src, size);
+    return -1;
+  }
+
+  madvise(src, size, MADV_SEQUENTIAL);
+  for (offset = 0; offset < size; offset += len) {
+    len = (size - offset < (off_t) bufSize) ? (size_t) (size - offset) : bufSize;
+    memcpy(dst + offset, src + offset, len);
+  }
+
+  munmap(src, size);
+  return munmap(dst, size);
+}
+
+/* with O_DIRECT, every transfer must be a multiple of the block size: the last one
+ * writes a whole block, and the output is cut to size afterwards */
+static int
+copyDirect(int inputFd, int outputFd, off_t size, size_t bufSize, char *buf) {
+  ssize_t numRead;
+  size_t len;
+
+  bufSize = (bufSize + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+  while ((numRead = read(inputFd, buf, bufSize)) > 0) {
+    len = ((size_t) numRead + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+    memset(buf + numRead, 0, len - numRead);
+
+    if (writeFully(outputFd, buf, len) == -1) {
+      return -1;
+    }
+  }
+
+  if (numRead == -1) {
+    return -1;
+  }
+
+  return ftruncate(outputFd, size);
+}
+
+/* pages of the input already copied are dropped from the cache as the copy goes,
+ * so that a large copy does not push everything else out of it */
+static int
+copyFadvise(int inputFd, int outputFd, __attribute__((unused)) off_t size, size_t bufSize, char *buf) {
+  ssize_t numRead;
+  off_t offset = 0;
+
+  posix_fadvise(inputFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  while ((numRead = read(inputFd, buf, bufSize)) > 0) {
+    if (writeFully(outputFd, buf, numRead) == -1) {
+      return -1;
+    }
+
+    posix_fadvise(inputFd, offset, numRead, POSIX_FADV_DONTNEED);
+    offset += numRead;
+  }
+
+  return (numRead == -1) ? -1 : 0;
+}
+
+static int
+copySendfile(int inputFd, int outputFd, off_t size, size_t bufSize, __attribute__((unused)) char *buf) {
+  ssize_t numSent;
+  off_t done;
+
+  for (done = 0; done < size; done += numSent) {
+    numSent = sendfile(outputFd, inputFd, NULL, bufSize);
+    if (numSent <= 0) {
+      return (numSent == -1) ? -1 : 0;
+    }
+  }
+
+  return 0;
+}
+
+static int
+copyRange(int inputFd, int outputFd, off_t size, size_t bufSize, __attribute__((unused)) char *buf) {
+  ssize_t numCopied;
+  off_t done;
+
+  for (done = 0; done < size; done += numCopied) {
+    numCopied = copy_file_range(inputFd, NULL, outputFd, NULL, bufSize, 0);
+    if (numCopied <= 0) {
+      return (numCopied == -1) ? -1 : 0;
+    }
+  }
+
+  return 0;
+}
+
+/* the input is spliced into a pipe as large as the buffer (as far as the pipe size
+ * limit allows), and from the pipe to the output */
+static int
+copySplice(int inputFd, int outputFd, __attribute__((unused)) off_t size, size_t bufSize, __attribute__((unused)) char *buf) {
+  int pfd[2], pipeSize, status = 0, savedErrno;
+  ssize_t numIn, numOut;
+
+  if (pipe(pfd) == -1) {
+    return -1;
+  }
+
+  pipeSize = fcntl(pfd[1], F_SETPIPE_SZ, (int) bufSize);
+  if (pipeSize == -1) {
+    pipeSize = fcntl(pfd[1], F_GETPIPE_SZ);
+  }
+
+  if (bufSize > (size_t) pipeSize) {
+    bufSize = pipeSize;
+  }
+
+  while ((numIn = splice(inputFd, NULL, pfd[1], NULL, bufSize, SPLICE_F_MOVE)) > 0) {
+    for (; numIn > 0; numIn -= numOut) {
+      numOut = splice(pfd[0], NULL, outputFd, NULL, numIn, SPLICE_F_MOVE);
+      if (numOut == -1) {
+        break;
+      }
+    }
+
+    if (numIn > 0) {
+      status = -1;
+      break;
+    }
+  }
+
+  if (numIn == -1) {
+    status = -1;
+  }
+
+  savedErrno = errno;
+  close(pfd[0]);
+  close(pfd[1]);
+  errno = savedErrno;
+
+  return status;
+}
+
+/* the ring is set up as part of the copy: it takes a few system calls, and the
+ * buffers it copies through are its own */
+static int
+copyUring(int inputFd, int outputFd, off_t size, size_t bufSize, __attribute__((unused)) char *buf) {
+  struct uringCopy ring;
+  int status, savedErrno;
+
+  if (uringCopyInit(&ring, queueDepth, bufSize) == -1) {
+    return -1;
+  }
+
+  status = uringCopyRange(&ring, inputFd, outputFd, 0, size);
+
+  savedErrno = errno;
+  uringCopyDestroy(&ring);
+  errno = savedErrno;
+
+  return status;
+}
+
+/* copies `src` into `dst` with the strategy given. Errors are returned with errno
+ * set, for the caller to report */
+static int
+copyFile(const struct strategy *st, const char *src, const char *dst, size_t bufSize,
+         char *buf, int openFlags, int cold, int sync) {
+  int inputFd, outputFd, status, savedErrno;
+  mode_t filePerms;
+  struct stat sb;
+
+  inputFd = open(src, O_RDONLY | st->openFlags);
+  if (inputFd == -1) {
+    return -1;
+  }
+
   filePerms = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH; /* rw-rw-rw */
-  outputFd = open(argv[2], openFlags, filePerms);
 
+  /* mappings must be readable to be writable */
+  if (st->copy == copyMmap) {
+    openFlags = (openFlags & ~O_WRONLY) | O_RDWR;
+  }
+
+  outputFd = open(dst, openFlags | st->openFlags, filePerms);
   if (outputFd == -1) {
+    savedErrno = errno;
+    close(inputFd);
+    errno = savedErrno;
+    return -1;
+  }
+
+  if (cold) {
+    posix_fadvise(inputFd, 0, 0, POSIX_FADV_DONTNEED);
+  }
+
+  status = fstat(inputFd, &sb);
+  if (status == 0) {
+    status = st->copy(inputFd, outputFd, sb.st_size, bufSize, buf);
+  }
+
+  if (status == 0 && sync) {
+    status = fsync(outputFd);
+  }
+
+  savedErrno = errno;
+  close(inputFd);
+  if (close(outputFd) == -1 && status == 0) {
+    return -1;
+  }
+  errno = savedErrno;
+
+  return status;
+}
+
+/* the name of the type of the file system a directory is on */
+static const char *
+fsName(const char *dir, char *buf, size_t len) {
+  struct statfs sfs;
+
+  if (statfs(dir, &sfs) == -1) {
+    return "unknown";
+  }
+
+  switch ((unsigned long) sfs.f_type) {
+    case 0xEF53:     return "ext4";
+    case 0x01021994: return "tmpfs";
+    case 0x58465342: return "xfs";
+    case 0x9123683E: return "btrfs";
+    case 0x6969:     return "nfs";
+    case 0x794C7630: return "overlayfs";
+    case 0x2FC12FC1: return "zfs";
+    case 0x65735546: return "fuse";
+  }
+
+  snprintf(buf, len, "0x%lx", (unsigned long) sfs.f_type);
+  return buf;
+}
+
+/* creates the input file of the matrix: data that does not compress, flushed to the
+ * disk so that its pages can be dropped from the cache */
+static void
+createInput(const char *path, off_t size, char *buf, size_t bufSize) {
+  unsigned long long x = 88172645463325252ULL;
+  size_t i, len;
+  off_t done;
+  int fd;
+
+  fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd == -1) {
     pexit("open");
   }
 
-  /* transfer data until we encounter an end of input or an error */
+  for (done = 0; done < size; done += len) {
+    for (i = 0; i + sizeof(x) <= bufSize; i += sizeof(x)) {
+      x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+      memcpy(buf + i, &x, sizeof(x));
+    }
 
-  while ((numRead = read(inputFd, buf, BUF_SIZE)) > 0) {
-    if (write(outputFd, buf, numRead) != numRead) {
+    len = (size - done < (off_t) bufSize) ? (size_t) (size - done) : bufSize;
+    if (writeFully(fd, buf, len) == -1) {
       pexit("write");
     }
   }
 
-  if (numRead == -1) {
-    pexit("read");
+  if (fsync(fd) == -1 || close(fd) == -1) {
+    pexit("fsync");
   }
+}
+
+static double
+elapsed(const struct timespec *start, const struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static double
+cpuTime(const struct timeval *tv) {
+  return tv->tv_sec + tv->tv_usec / 1e6;
+}
 
-  if (close(inputFd) == -1) {
-    pexit("close");
+static void
+runMatrix(const struct strategy **sts, int numSts, size_t *sizes, int numSizes,
+          char **dirs, int numDirs, off_t fileSize, int runs, int cold, int sync) {
+  char src[PATH_MAX], dst[PATH_MAX], fsBuf[32], *buf;
+  const char *fs;
+  struct timespec start, end;
+  struct rusage before, after;
+  double seconds, user, sys;
+  size_t maxSize = 1024 * 1024;
+  struct stat sb;
+  int d, s, b, r, failed;
+
+  for (b = 0; b < numSizes; b++) {
+    maxSize = (sizes[b] > maxSize) ? sizes[b] : maxSize;
   }
+  buf = allocBuffer(maxSize);
+
+  printf("filesystem,directory,strategy,buffer_size,bytes,runs,seconds,mib_per_s,user_s,sys_s\n");
 
-  if (close(outputFd) == -1) {
-    pexit("close");
+  for (d = 0; d < numDirs; d++) {
+    snprintf(src, PATH_MAX, "%s/%s", dirs[d], BENCH_INPUT);
+    snprintf(dst, PATH_MAX, "%s/%s", dirs[d], BENCH_OUTPUT);
+    fs = fsName(dirs[d], fsBuf, sizeof(fsBuf));
+
+    createInput(src, fileSize, buf, maxSize);
+
+    for (s = 0; s < numSts; s++) {
+      for (b = 0; b < numSizes; b++) {
+        seconds = user = sys = 0;
+        failed = 0;
+
+        for (r = 0; r < runs && !failed; r++) {
+          getrusage(RUSAGE_SELF, &before);
+          clock_gettime(CLOCK_MONOTONIC, &start);
+
+          if (copyFile(sts[s], src, dst, sizes[b], buf, O_CREAT | O_WRONLY | O_TRUNC, cold, sync) == -1) {
+            fprintf(stderr, "%s (%s), %s, %zu bytes: %s\n", dirs[d], fs, sts[s]->name, sizes[b], strerror(errno));
+            failed = 1;
+            break;
+          }
+
+          clock_gettime(CLOCK_MONOTONIC, &end);
+          getrusage(RUSAGE_SELF, &after);
+
+          if (stat(dst, &sb) == -1 || sb.st_size != fileSize) {
+            fprintf(stderr, "%s (%s), %s, %zu bytes: incomplete copy\n", dirs[d], fs, sts[s]->name, sizes[b]);
+            failed = 1;
+            break;
+          }
+
+          seconds += elapsed(&start, &end);
+          user += cpuTime(&after.ru_utime) - cpuTime(&before.ru_utime);
+          sys += cpuTime(&after.ru_stime) - cpuTime(&before.ru_stime);
+        }
+
+        if (failed) {
+          continue;
+        }
+
+        printf("%s,%s,%s,%zu,%lld,%d,%.6f,%.1f,%.6f,%.6f\n", fs, dirs[d], sts[s]->name, sizes[b],
+               (long long) fileSize, runs, seconds / runs, fileSize / (seconds / runs) / (1024 * 1024),
+               user / runs, sys / runs);
+        fflush(stdout);
+      }
+    }
+
+    unlink(src);
+    unlink(dst);
   }
 
-  return EXIT_SUCCESS;
+  free(buf);
 }
 
 static void
@@ -142,7 +741,9 @@ helpAndLeave(const char *progname, int status) {
     stream = stdout;
   }
 
-  fprintf(stream, "%s <oldfile> <newfile>\n", progname);
+  fprintf(stream, "%s [-s strategy] [-b size] [-q depth] [-c] [-y] <oldfile> <newfile>\n", progname);
+  fprintf(stream, "%s -m [-s strategy,...] [-b size,...] [-q depth] [-S file size] [-n runs] [-c] [-y] <dir> ...\n", progname);
+  fprintf(stream, "strategies: rw pread mmap direct fadvise sendfile copy_file_range splice io_uring\n");
   exit(status);
 }
 
@@ -7,24 +7,57 @@
  *
  * Usage
  *
- *    $ ./tail [-n NUM] <file>
+ *    $ ./tail [-n NUM] [-f] <file> ...
  *    Line 1
  *    Line 2
  *    Line 3
  *    ...
  *
  *    -n: tells the program to print the last NUM lines
- *    <file> - the file to be print
+ *    -f: keep printing data appended to the files, until interrupted
+ *    <file> - the file to be print. When more than one is given, the output
+ *             of each is preceded by a header with its name
  *
  * Note that this program do not support arbitrarily long strings. However,
  * it should produce an output in constant time regarding the input size and
  * linear time according to the number of lines to be print.
  *
+ * Regular files are mapped into memory instead of read: newlines are searched for
+ * backwards from the end of the mapping with memrchr(3), which compares many bytes
+ * at a time, only the pages holding the lines printed are read, and the lines are
+ * written with a single call, straight from the mapping. Files that cannot be
+ * mapped are read backwards a buffer at a time.
+ *
+ * The mapping is searched through chap49/safemap.h, since the files tail is used
+ * on are often logs, which may be truncated or rotated while being searched: the
+ * pages past the new end of the file would otherwise kill the program with SIGBUS.
+ * The file is then read backwards instead, from where it now ends.
+ *
+ * Following files
+ *
+ * With -f, the files are not polled: a single inotify instance watches every
+ * file given, along with the directory each is in, and only the bytes past the
+ * last offset read are read once a file is modified (see chap19/dlog.c for the
+ * event loop.) A file that shrinks below that offset was truncated, and is read
+ * again from its start. When a file is renamed or removed, as log rotation does,
+ * whatever was still written to it is printed, and the new file that takes its
+ * name in the directory is followed from its start.
+ *
+ * Built along with safemap.c:
+ *
+ *    $ gcc -o tail tail.c ../chap49/safemap.c -pthread
+ *
  * Author: Renato Mascarenhas Costa
  */
 
-#define _XOPEN_SOURCE 600 /* getopt and posix_fadivse */
+#define _GNU_SOURCE /* getopt, posix_fadivse and memrchr */
+
+#include <limits.h>
+#ifndef NAME_MAX
+#  include <linux/limits.h>
+#endif
 
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -34,29 +67,55 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "../chap49/safemap.h"
+
 #ifndef TAIL_BUFSIZ
 #  define TAIL_BUFSIZ BUFSIZ
 #endif
 
+#ifndef TAIL_MAX_FILES
+#  define TAIL_MAX_FILES (1024)
+#endif
+
+/* buffer size enough to allocate at least 10 events at once */
+#ifndef TAIL_EVBUFSIZ
+#  define TAIL_EVBUFSIZ (10 * (sizeof (struct inotify_event) + NAME_MAX + 1))
+#endif
+
 #define Min(a, b) ((a) < (b) ? (a) : (b))
 
 typedef enum { FALSE, TRUE } Bool;
 
+/* a file being followed. The file is watched through its descriptor's inode
+ * (`wd`), and its name through the directory it is in (`dirWd`), so that a new
+ * file taking its place is noticed. `fd` is -1 while there is no such file */
+struct st_followed {
+  char path[PATH_MAX];
+  const char *name; /* last component of `path` */
+  int fd, wd, dirWd;
+  off_t offset;     /* bytes of the file printed so far */
+};
+
 static void helpAndLeave(const char *progname, int status);
 static void pexit(const char *fCall);
 
+static off_t printLastLines(int fd, int count);
+static void follow(struct st_followed *files, int numFiles);
+
+/* the file whose data was last printed, so that headers are only printed when the
+ * output switches to another file */
+static struct st_followed *lastPrinted = NULL;
+static Bool printHeaders = FALSE;
+
 int
 main(int argc, char *argv[]) {
-  if (argc != 2 && argc != 3) {
-    helpAndLeave(argv[0], EXIT_FAILURE);
-  }
-
   int opt;
   int count = 10;
-  char *file, *p;
+  char *p;
+  Bool followFiles = FALSE;
 
   opterr = 0;
-  while ((opt = getopt(argc, argv, "n:")) != -1) {
+  while ((opt = getopt(argc, argv, "n:f")) != -1) {
     switch (opt) {
       case 'n':
         errno = 0;
@@ -72,32 +131,138 @@ main(int argc, char *argv[]) {
 
         break;
 
+      case 'f':
+        followFiles = TRUE;
+        break;
+
       case '?':
         helpAndLeave(argv[0], EXIT_FAILURE);
         break;
     }
   }
 
-  file = argv[optind];
-  if (file == NULL) {
+  if (optind >= argc || argc - optind > TAIL_MAX_FILES) {
     helpAndLeave(argv[0], EXIT_FAILURE);
   }
 
-  int fd, numLines, i, textSize;
-  char buf[TAIL_BUFSIZ + 1], text[count * BUFSIZ];
-  off_t fileSize, offCur;
-  ssize_t numRead;
-  Bool done;
+  int fd, i, numFiles = argc - optind;
+  struct st_followed *files;
+  char *slash;
 
-  fd = open(file, O_RDONLY);
-  if (fd == -1) {
-    pexit("open");
+  files = calloc(numFiles, sizeof(struct st_followed));
+  if (files == NULL) {
+    pexit("calloc");
   }
 
-  if ((fileSize = lseek(fd, 0, SEEK_END)) == -1) {
-    pexit("lseek");
+  printHeaders = numFiles > 1;
+  for (i = 0; i < numFiles; ++i) {
+    fd = open(argv[optind + i], O_RDONLY);
+    if (fd == -1) {
+      pexit("open");
+    }
+
+    if (printHeaders) {
+      printf("%s==> %s <==\n", (i == 0) ? "" : "\n", argv[optind + i]);
+    }
+
+    strncpy(files[i].path, argv[optind + i], PATH_MAX - 1);
+    slash = strrchr(files[i].path, '/');
+    files[i].name = (slash == NULL) ? files[i].path : slash + 1;
+    files[i].offset = printLastLines(fd, count);
+    files[i].fd = fd;
+    lastPrinted = &files[i];
+
+    if (!followFiles && close(fd) == -1) {
+      pexit("close");
+    }
+  }
+
+  if (followFiles) {
+    fflush(stdout);
+    follow(files, numFiles);
+  }
+
+  free(files);
+  return EXIT_SUCCESS;
+}
+
+static void writeOut(const char *buf, size_t len);
+
+/* where the last `count` lines of a mapped file start, as found by `findLastLines` */
+struct lastLines {
+  int count;
+  size_t start;
+};
+
+/* searches the mapping for the start of the last lines. Called through
+ * safeMapRead, so nothing but `lines` is changed */
+static int
+findLastLines(const char *data, size_t len, void *arg) {
+  struct lastLines *lines = arg;
+  const char *nl;
+  size_t end;
+  int numLines;
+
+  /* like the loop in readLastLines: the newline ending the last line counts as one */
+  lines->start = 0;
+  end = len;
+  for (numLines = 0; (nl = memrchr(data, '\n', end)) != NULL; end = nl - data) {
+    if (++numLines > lines->count) {
+      lines->start = nl - data + 1;
+      break;
+    }
+  }
+
+  return 0;
+}
+
+/* prints the last `count` lines of a file that can be mapped into memory, returning
+ * FALSE if it cannot, or if it was truncated while being searched */
+static Bool
+mapLastLines(int fd, off_t fileSize, int count) {
+  struct safeMap map;
+  struct lastLines lines;
+  int status;
+
+  if (fileSize == 0) {
+    return TRUE;
+  }
+
+  if (safeMapOpen(&map, fd, 0, fileSize) == -1) {
+    return FALSE;
+  }
+
+  lines.count = count;
+  status = safeMapRead(&map, 0, map.length, findLastLines, &lines);
+  if (status == -1 && errno != ENODATA) {
+    pexit("safeMapRead");
+  }
+
+  /* headers were printed with stdio. Should the file shrink past the lines
+   * found before they are written, write(2) fails with EFAULT rather than
+   * raising SIGBUS */
+  if (status == 0) {
+    fflush(stdout);
+    writeOut(map.data + lines.start, map.length - lines.start);
+  }
+
+  if (safeMapClose(&map) == -1) {
+    pexit("munmap");
   }
 
+  return status == 0;
+}
+
+/* prints the last `count` lines of a file by reading it backwards, a buffer at a
+ * time */
+static void
+readLastLines(int fd, off_t fileSize, int count) {
+  int numLines, i, textSize;
+  char buf[TAIL_BUFSIZ + 1], text[count * BUFSIZ];
+  off_t offCur;
+  ssize_t numRead;
+  Bool done;
+
   /* we are going to read the file backwards, so we continuouly position the file
    * cursor a number of bytes before its end */
   if ((offCur = lseek(fd, -1 * Min(TAIL_BUFSIZ, fileSize), SEEK_CUR)) == -1) {
@@ -135,15 +300,186 @@ main(int argc, char *argv[]) {
     pexit("read");
   }
 
-  if (close(fd) == -1) {
-    pexit("close");
-  }
-
   for (i = textSize -1; i >= 0; --i) {
     printf("%c", text[i]);
   }
+}
 
-  return EXIT_SUCCESS;
+/* prints the last `count` lines of the file, and returns its size, which is where
+ * following the file starts from */
+static off_t
+printLastLines(int fd, int count) {
+  off_t fileSize;
+
+  if ((fileSize = lseek(fd, 0, SEEK_END)) == -1) {
+    pexit("lseek");
+  }
+
+  if (!mapLastLines(fd, fileSize, count)) {
+    /* the file may have been truncated since its size was taken */
+    if ((fileSize = lseek(fd, 0, SEEK_END)) == -1) {
+      pexit("lseek");
+    }
+
+    readLastLines(fd, fileSize, count);
+  }
+
+  return fileSize;
+}
+
+/* the inotify descriptor, shared by every file followed */
+static int inotifyFd;
+
+static void
+writeOut(const char *buf, size_t len) {
+  ssize_t numWritten;
+
+  while (len > 0) {
+    if ((numWritten = write(STDOUT_FILENO, buf, len)) == -1) {
+      pexit("write");
+    }
+
+    buf += numWritten;
+    len -= numWritten;
+  }
+}
+
+/* prints whatever was appended to the file since it was last read. A file smaller
+ * than what was already read was truncated, and is read from its start again */
+static void
+readAppended(struct st_followed *file) {
+  char buf[TAIL_BUFSIZ], header[PATH_MAX + 16];
+  struct stat sb;
+  ssize_t numRead;
+
+  if (file->fd == -1) {
+    return;
+  }
+
+  if (fstat(file->fd, &sb) == -1) {
+    pexit("fstat");
+  }
+
+  if (sb.st_size < file->offset) {
+    fprintf(stderr, "tail: %s: file truncated\n", file->path);
+    file->offset = 0;
+  }
+
+  while ((numRead = pread(file->fd, buf, TAIL_BUFSIZ, file->offset)) > 0) {
+    if (printHeaders && lastPrinted != file) {
+      snprintf(header, sizeof(header), "\n==> %s <==\n", file->path);
+      writeOut(header, strlen(header));
+      lastPrinted = file;
+    }
+
+    writeOut(buf, numRead);
+    file->offset += numRead;
+  }
+
+  if (numRead == -1) {
+    pexit("pread");
+  }
+}
+
+/* starts following the file now at the path of `file`, if there is one, from its
+ * start. Its previous file, if any, is printed until its end and left behind */
+static void
+reopen(struct st_followed *file) {
+  int fd;
+
+  fd = open(file->path, O_RDONLY);
+  if (fd == -1) {
+    return; /* not there yet */
+  }
+
+  if (file->fd != -1) {
+    readAppended(file);
+    inotify_rm_watch(inotifyFd, file->wd);
+    close(file->fd);
+    fprintf(stderr, "tail: %s has been replaced; following new file\n", file->path);
+  }
+
+  file->fd = fd;
+  file->offset = 0;
+  file->wd = inotify_add_watch(inotifyFd, file->path, IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF);
+  if (file->wd == -1) {
+    pexit("inotify_add_watch");
+  }
+
+  readAppended(file);
+}
+
+/* watches every file, and the directories they are in, and prints data as it is
+ * appended to them. Does not return */
+static void
+follow(struct st_followed *files, int numFiles) {
+  char buf[TAIL_EVBUFSIZ], dir[PATH_MAX], *p;
+  struct inotify_event *event;
+  ssize_t numRead;
+  int i;
+
+  inotifyFd = inotify_init();
+  if (inotifyFd == -1) {
+    pexit("inotify_init");
+  }
+
+  for (i = 0; i < numFiles; ++i) {
+    files[i].wd = inotify_add_watch(inotifyFd, files[i].path, IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF);
+    if (files[i].wd == -1) {
+      pexit("inotify_add_watch");
+    }
+
+    /* watching the directory of many files yields the same watch descriptor */
+    if (files[i].name == files[i].path) {
+      strcpy(dir, ".");
+    } else {
+      snprintf(dir, PATH_MAX, "%.*s", (int) (files[i].name - files[i].path - 1), files[i].path);
+    }
+
+    files[i].dirWd = inotify_add_watch(inotifyFd, (dir[0] == '\0') ? "/" : dir, IN_CREATE | IN_MOVED_TO);
+    if (files[i].dirWd == -1) {
+      pexit("inotify_add_watch");
+    }
+
+    /* data may have been appended since the last lines were printed */
+    readAppended(&files[i]);
+  }
+
+  for (;;) {
+    numRead = read(inotifyFd, buf, TAIL_EVBUFSIZ);
+    if (numRead == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      pexit("read");
+    }
+
+    for (p = buf; p < buf + numRead; ) {
+      event = (struct inotify_event *) p;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        /* events were lost: check every file */
+        for (i = 0; i < numFiles; ++i) {
+          readAppended(&files[i]);
+        }
+      }
+
+      for (i = 0; i < numFiles; ++i) {
+        /* a file renamed or removed is kept until another file takes its name,
+         * since whatever is still written to it must be printed */
+        if (files[i].fd != -1 && event->wd == files[i].wd) {
+          readAppended(&files[i]);
+        }
+
+        if (event->wd == files[i].dirWd && event->len > 0 && !strcmp(event->name, files[i].name)) {
+          reopen(&files[i]);
+        }
+      }
+
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
 }
 
 static void
@@ -154,7 +490,7 @@ helpAndLeave(const char *progname, int status) {
     stream = stdout;
   }
 
-  fprintf(stream, "Usage: %s [-n NUM] <file>\n", progname);
+  fprintf(stream, "Usage: %s [-n NUM] [-f] <file> ...\n", progname);
   exit(status);
 }
 
@@ -6,13 +6,28 @@
  * The order can be enforced to be alphabetical on creation as well on compilation
  * time by defining FS_TEST_ALPHA_ORDER.
  *
+ * Each operation is timed, in phases: every file is created (and written one byte),
+ * then stat(2)ed, renamed and finally unlinked - with threads, if asked to, sharing
+ * the files of each phase. For every phase, the operations per second and the
+ * 50th, 99th and 99.9th percentiles of the latency of an operation are reported.
+ *
  * Usage
  *
- *    $ ./fs_test <NF> <DIR>
- *    # No output generated. You can analyse the time taken on multiple calls.
+ *    $ ./fs_test [-t threads] [-D dirs] [-f] <NF> <DIR>
  *
  *    - NF: the number of files to be created/deleted.
  *    - DIR: the directory in which the temporary files should be created.
+ *    -t: the number of threads performing each phase (default 1).
+ *    -D: spread the files over this many subdirectories of DIR (default 0: no
+ *        subdirectories, all files in DIR).
+ *    -f: fsync(2) each file after writing it, so creating includes making it durable.
+ *
+ *    $ ./fs_test -t 8 -D 16 -f 100000 /mnt/xfs/spool
+ *    phase        ops    seconds      ops/s   p50 (us)   p99 (us)  p999 (us)   max (us)
+ *    create    100000      ...
+ *
+ * The results below are from the times of the first version of this program,
+ * which only created and unlinked the files, from a single thread.
  *
  * Running this program in a Linux machine, with ext4 filesystem:
  *
@@ -69,19 +84,50 @@
  * Author: Renato Mascarenhas Costa
  */
 
+#define _GNU_SOURCE
+
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <time.h>
+#include <pthread.h>
+#include <errno.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #define FS_TEST_BYTE ("w") /* one char is always one word long */
+#define FS_TEST_NAME_SIZ (64)
+
+typedef enum { PHASE_CREATE, PHASE_STAT, PHASE_RENAME, PHASE_UNLINK, NUM_PHASES } Phase;
+
+static const char *phaseNames[NUM_PHASES] = { "create", "stat", "rename", "unlink" };
+
+/* a file of the test. Names carry the index, so that random stamps never clash */
+struct sample {
+  int stamp, index;
+};
+
+struct worker {
+  pthread_t thread;
+  Phase phase;
+  int first, last; /* samples handled: from first up to last, not included */
+};
 
-static int intComparison(const void *a, const void *b);
+static struct sample *samples;
+static long long *latencies; /* of the current phase, in nanoseconds, one per sample */
+static int nDirs;
+static int useFsync;
+
+static void *runPhase(void *arg);
+static void sampleName(const struct sample *s, int renamed, char *buf);
+static long long nowNs(void);
+static void report(Phase phase, int nSamples, long long elapsed);
+
+static int sampleComparison(const void *a, const void *b);
+static int latencyComparison(const void *a, const void *b);
 
 static void helpAndLeave(const char *progname, int status);
 static void pexit(const char *fCall);
@@ -91,60 +137,194 @@ main(int argc, char *argv[]) {
 #define usageErr() \
   (helpAndLeave(argv[0], EXIT_FAILURE))
 
-  char *location, *p;
-  int nSamples, i;
+  char *location, *p, buf[BUFSIZ];
+  int nSamples, nThreads = 1, i, s, opt;
+  struct worker *workers;
+  long long start;
+  Phase phase;
 
-  if (argc != 3) {
+  while ((opt = getopt(argc, argv, "t:D:fh")) != -1) {
+    switch (opt) {
+      case 't': nThreads = atoi(optarg); break;
+      case 'D': nDirs = atoi(optarg); break;
+      case 'f': useFsync = 1; break;
+      case 'h': helpAndLeave(argv[0], EXIT_SUCCESS); break;
+      default: usageErr();
+    }
+  }
+
+  if (argc != optind + 2 || nThreads < 1 || nDirs < 0) {
     usageErr();
   }
 
-  nSamples = strtol(argv[1], &p, 10);
-  if (p == argv[1]) {
+  nSamples = strtol(argv[optind], &p, 10);
+  if (p == argv[optind] || nSamples < 1) {
     usageErr();
   }
 
-  location = argv[2];
+  location = argv[optind + 1];
 
   if (chdir(location) == -1) {
     pexit("chdir");
   }
 
-  char buf[BUFSIZ];
-  int fd, filenameStamps[nSamples];
+  for (i = 0; i < nDirs; ++i) {
+    snprintf(buf, BUFSIZ, "d%05d", i);
+    if (mkdir(buf, S_IRWXU) == -1 && errno != EEXIST) {
+      pexit("mkdir");
+    }
+  }
+
+  samples = malloc(nSamples * sizeof(struct sample));
+  latencies = malloc(nSamples * sizeof(long long));
+  workers = calloc(nThreads, sizeof(struct worker));
+  if (samples == NULL || latencies == NULL || workers == NULL) {
+    pexit("malloc");
+  }
 
   srand(time(NULL));
   for (i = 0; i < nSamples; ++i) {
+    samples[i].index = i;
 #ifdef FS_TEST_ALPHA_ORDER
-    filenameStamps[i] = i;
+    samples[i].stamp = i;
 #else
-    filenameStamps[i] = rand() % 900000000 + 100000000;
+    samples[i].stamp = rand() % 900000000 + 100000000;
 #endif
+  }
+
+  printf("%-8s %10s %10s %10s %10s %10s %10s %10s\n", "phase", "ops", "seconds", "ops/s",
+         "p50 (us)", "p99 (us)", "p999 (us)", "max (us)");
 
-    snprintf(buf, BUFSIZ, "x%06d", filenameStamps[i]);
-    if ((fd = open(buf, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR)) == -1) {
-      pexit("open");
+  for (phase = PHASE_CREATE; phase < NUM_PHASES; ++phase) {
+    /* files are removed in alphabetical order */
+    if (phase == PHASE_UNLINK) {
+      qsort(samples, nSamples, sizeof(struct sample), sampleComparison);
     }
 
-    if (write(fd, FS_TEST_BYTE, 1) < 1) {
-      pexit("write");
+    start = nowNs();
+    for (i = 0; i < nThreads; ++i) {
+      workers[i].phase = phase;
+      workers[i].first = (long) nSamples * i / nThreads;
+      workers[i].last = (long) nSamples * (i + 1) / nThreads;
+
+      if ((s = pthread_create(&workers[i].thread, NULL, runPhase, &workers[i])) != 0) {
+        errno = s;
+        pexit("pthread_create");
+      }
     }
 
-    if (close(fd) == -1) {
-      pexit("close");
+    for (i = 0; i < nThreads; ++i) {
+      pthread_join(workers[i].thread, NULL);
     }
+
+    report(phase, nSamples, nowNs() - start);
+  }
+
+  for (i = 0; i < nDirs; ++i) {
+    snprintf(buf, BUFSIZ, "d%05d", i);
+    rmdir(buf);
   }
 
-  qsort(filenameStamps, nSamples, sizeof(int), intComparison);
+  free(samples);
+  free(latencies);
+  free(workers);
 
-  for (i = 0; i < nSamples; ++i) {
-    snprintf(buf, BUFSIZ, "x%06d", filenameStamps[i]);
+  return EXIT_SUCCESS;
+}
+
+/* performs the operation of the phase on each sample of the worker, timing them */
+static void *
+runPhase(void *arg) {
+  struct worker *w = arg;
+  char name[FS_TEST_NAME_SIZ], renamed[FS_TEST_NAME_SIZ];
+  struct stat st;
+  long long start;
+  int i, fd;
+
+  for (i = w->first; i < w->last; ++i) {
+    sampleName(&samples[i], w->phase > PHASE_RENAME, name);
+    start = nowNs();
+
+    switch (w->phase) {
+      case PHASE_CREATE:
+        if ((fd = open(name, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR)) == -1) {
+          pexit("open");
+        }
 
-    if (unlink(buf) == -1) {
-      pexit("unlink");
+        if (write(fd, FS_TEST_BYTE, 1) < 1) {
+          pexit("write");
+        }
+
+        if (useFsync && fsync(fd) == -1) {
+          pexit("fsync");
+        }
+
+        if (close(fd) == -1) {
+          pexit("close");
+        }
+        break;
+
+      case PHASE_STAT:
+        if (stat(name, &st) == -1) {
+          pexit("stat");
+        }
+        break;
+
+      case PHASE_RENAME:
+        sampleName(&samples[i], 1, renamed);
+        if (rename(name, renamed) == -1) {
+          pexit("rename");
+        }
+        break;
+
+      case PHASE_UNLINK:
+        if (unlink(name) == -1) {
+          pexit("unlink");
+        }
+        break;
+
+      default:
+        break;
     }
+
+    latencies[i] = nowNs() - start;
   }
 
-  return EXIT_SUCCESS;
+  return NULL;
+}
+
+/* the name of the file of a sample, before or after being renamed */
+static void
+sampleName(const struct sample *s, int renamed, char *buf) {
+  char dir[16] = "";
+
+  if (nDirs > 0) {
+    snprintf(dir, sizeof(dir), "d%05d/", s->index % nDirs);
+  }
+
+  snprintf(buf, FS_TEST_NAME_SIZ, "%sx%09d.%d%s", dir, s->stamp, s->index, renamed ? ".r" : "");
+}
+
+static long long
+nowNs(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void
+report(Phase phase, int nSamples, long long elapsed) {
+  double seconds = elapsed / 1e9;
+
+  qsort(latencies, nSamples, sizeof(long long), latencyComparison);
+
+  printf("%-8s %10d %10.3f %10.0f %10.1f %10.1f %10.1f %10.1f\n", phaseNames[phase], nSamples,
+         seconds, nSamples / seconds,
+         latencies[nSamples / 2] / 1e3,
+         latencies[(long) nSamples * 99 / 100] / 1e3,
+         latencies[(long) nSamples * 999 / 1000] / 1e3,
+         latencies[nSamples - 1] / 1e3);
 }
 
 static void
@@ -155,7 +335,7 @@ helpAndLeave(const char *progname, int status) {
     stream = stdout;
   }
 
-  fprintf(stream, "Usage: %s <NF> <DIR>\n", progname);
+  fprintf(stream, "Usage: %s [-t threads] [-D dirs] [-f] <NF> <DIR>\n", progname);
   exit(status);
 }
 
@@ -166,6 +346,18 @@ pexit(const char *fCall) {
 }
 
 static int
-intComparison(const void *a, const void *b) {
-  return *(int *)a - *(int *)b;
+sampleComparison(const void *a, const void *b) {
+  const struct sample *x = a, *y = b;
+
+  if (x->stamp != y->stamp) {
+    return (x->stamp > y->stamp) - (x->stamp < y->stamp);
+  }
+
+  return x->index - y->index;
+}
+
+static int
+latencyComparison(const void *a, const void *b) {
+  long long x = *(const long long *) a, y = *(const long long *) b;
+  return (x > y) - (x < y);
 }
@@ -25,7 +25,7 @@
  *
  * Usage:
  *
- *    $ ./chattr <+-=><flags> <file> [<file2> <file3> ...]
+ *    $ ./chattr [-R] [-P threads] <+-=><flags> <file> [<file2> <file3> ...]
  *
  *    - + = indicate if the given flags should be removed, added or set
  *    (removing previously set flags)
@@ -34,43 +34,126 @@
  *
  *    <files1..N> - the files to have attributes changed
  *
+ *    -R - change the attributes of directories and everything under them
+ *
+ *    -P - the number of threads changing attributes with -R (default: the
+ *    number of CPUs)
+ *
  * Examples:
  *
  *    $ ./chattr +i file   # adds immutable flag to file
  *    $ ./chattr -jd file  # removes flags j and d from file
  *    $ ./chattr =acD file # sets the extended attributes to exactly a, c and D
+ *    $ ./chattr -R +A dataset # no access time updates anywhere under dataset
+ *
+ * Recursive mode
+ *
+ * With -R, trees are walked by a number of threads with lib/treewalk.c, each
+ * taking open directories from a deque of its own, and stealing from the others
+ * when it runs out. Entries are opened relative to their directory; the flags are
+ * read and set on the descriptor opened, and the descriptor of a directory is
+ * the one it is then read from. Files which have
+ * the flags asked for already are left alone - no FS_IOC_SETFLAGS for them.
+ *
+ * As with chattr(1), symbolic links and special files found while walking a
+ * tree are skipped (opening devices could have side effects). Errors are
+ * reported, and the walk goes on; a summary is printed at the end.
+ *
+ * Built along with treewalk.c:
+ *
+ *    $ gcc -o chattr chattr.c ../lib/treewalk.c -pthread
  *
  * Author: Renato Mascarenhas Costa
  */
 
+#define _GNU_SOURCE /* openat(2) and O_NOFOLLOW */
+
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
+#include <dirent.h>
 
 #include <linux/fs.h>
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include "../lib/treewalk.h"
+
+#ifndef CHATTR_NOPENFD
+#  define CHATTR_NOPENFD (1024)
+#endif
 
 typedef enum { RM, ADD, SET } chtype;
+typedef enum { FALSE, TRUE } Bool;
+
+/* what changing the flags of a file came to */
+typedef enum { CHANGED, UNCHANGED, FAILED } outcome;
 
 static void helpAndLeave(const char *progname, int status);
 static void pexit(const char *fCall);
 
+static int changeTree(char *paths[], int npaths, int nthreads);
+
+static chtype type;
+static int attrs;
+
+/* changes the flags of the file open as `fd` */
+static outcome
+changeFlags(int fd) {
+  int current_attrs, new_attrs;
+
+  if (ioctl(fd, FS_IOC_GETFLAGS, &current_attrs) == -1) {
+    return FAILED;
+  }
+
+  switch (type) {
+    case ADD: new_attrs = current_attrs | attrs;  break;
+    case RM:  new_attrs = current_attrs & ~attrs; break;
+    case SET: new_attrs = attrs;                  break;
+  }
+
+  if (new_attrs == current_attrs) {
+    return UNCHANGED;
+  }
+
+  if (ioctl(fd, FS_IOC_SETFLAGS, &new_attrs) == -1) {
+    return FAILED;
+  }
+
+  return CHANGED;
+}
+
 int
 main(int argc, char *argv[]) {
-  if (argc < 2) {
-    helpAndLeave(argv[0], EXIT_FAILURE);
+  int fd, i, nthreads = 0;
+  Bool recursive = FALSE;
+  char *p;
+
+  /* options cannot be parsed with getopt(3): "-jd" is a mode, not options. They
+   * are spelled with letters that are not flags */
+  for (i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-R")) {
+      recursive = TRUE;
+    } else if (!strcmp(argv[i], "-P") && i + 1 < argc) {
+      nthreads = atoi(argv[++i]);
+      if (nthreads < 1) {
+        helpAndLeave(argv[0], EXIT_FAILURE);
+      }
+    } else {
+      break;
+    }
   }
 
-  int attrs, current_attrs, fd, i;
-  char *p;
-  chtype type;
+  if (i + 1 >= argc) {
+    helpAndLeave(argv[0], EXIT_FAILURE);
+  }
 
   attrs = 0;
-  p = argv[1];
+  p = argv[i];
 
   switch (p[0]) {
     case '-': type = RM;                           break;
@@ -79,7 +162,7 @@ main(int argc, char *argv[]) {
     default:  helpAndLeave(argv[0], EXIT_FAILURE); break;
   }
 
-  for (p = argv[1] + 1; *p != '\0'; ++p) {
+  for (p = argv[i] + 1; *p != '\0'; ++p) {
     switch (*p) {
       case 'a': attrs |= FS_APPEND_FL;                break;
       case 'c': attrs |= FS_COMPR_FL;                 break;
@@ -97,32 +180,159 @@ main(int argc, char *argv[]) {
     }
   }
 
-  for (i = 2; i < argc; ++i) {
+  if (recursive) {
+    if (nthreads == 0) {
+      nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    exit(changeTree(argv + i + 1, argc - i - 1, (nthreads > 0) ? nthreads : 1));
+  }
+
+  for (++i; i < argc; ++i) {
     fd = open(argv[i], O_RDONLY);
     if (fd == -1) {
       pexit("open");
     }
 
-    if (ioctl(fd, FS_IOC_GETFLAGS, &current_attrs) == -1) {
+    if (changeFlags(fd) == FAILED) {
       pexit("ioctl");
     }
 
-    switch (type) {
-      case ADD: attrs |= current_attrs;             break;
-      case RM:  attrs = current_attrs & ~attrs;     break;
-      case SET: /* just set the given attributes */ break;
+    if (close(fd) == -1) {
+      pexit("close");
     }
+  }
 
-    if (ioctl(fd, FS_IOC_SETFLAGS, &attrs) == -1) {
-      pexit("ioctl");
+  exit(EXIT_SUCCESS);
+}
+
+/* what was done by a thread, with -R */
+struct counts {
+  long changed, unchanged, skipped, failed;
+};
+
+static void
+count(struct counts *c, outcome result) {
+  switch (result) {
+    case CHANGED:   ++c->changed;   break;
+    case UNCHANGED: ++c->unchanged; break;
+    case FAILED:    ++c->failed;    break;
+  }
+}
+
+/* changes the flags of the entry `name` of the directory open as `fd`, and has
+ * it read if it is a directory itself */
+static int
+changeEntry(struct treeWalk *tw, int worker, int fd, const char *name, unsigned char dtype, void *arg) {
+  struct counts *c = (struct counts *) arg + worker;
+  struct stat sb;
+  outcome result;
+  int efd;
+
+  /* symbolic links and special files are not opened at all */
+  if (dtype == DT_UNKNOWN) {
+    if (fstatat(fd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+      treeWalkError(tw, fd, name, "fstatat");
+      ++c->failed;
+      return 0;
     }
+    dtype = S_ISDIR(sb.st_mode) ? DT_DIR : (S_ISREG(sb.st_mode) ? DT_REG : DT_LNK);
+  }
 
-    if (close(fd) == -1) {
-      pexit("close");
+  if (dtype != DT_REG && dtype != DT_DIR) {
+    ++c->skipped;
+    return 0;
+  }
+
+  efd = openat(fd, name, O_RDONLY | O_NONBLOCK | O_NOFOLLOW | O_NOCTTY | O_CLOEXEC |
+                         ((dtype == DT_DIR) ? O_DIRECTORY : 0));
+  if (efd == -1) {
+    treeWalkError(tw, fd, name, "openat");
+    ++c->failed;
+    return 0;
+  }
+
+  result = changeFlags(efd);
+  if (result == FAILED) {
+    treeWalkError(tw, fd, name, "ioctl");
+  }
+  count(c, result);
+
+  if (dtype != DT_DIR) {
+    close(efd);
+    return 0;
+  }
+
+  /* the directory is read from the descriptor its flags were changed through */
+  return treeWalkDir(tw, worker, efd);
+}
+
+/* changes the flags of `paths`, and of everything under those which are
+ * directories. Returns the exit status */
+static int
+changeTree(char *paths[], int npaths, int nthreads) {
+  long changed = 0, unchanged = 0, skipped = 0, failed = 0, unread;
+  struct treeWalk *tw;
+  struct counts *counts;
+  outcome result;
+  struct stat sb;
+  int fd, i;
+
+  counts = calloc(nthreads, sizeof(struct counts));
+  if (counts == NULL) {
+    pexit("calloc");
+  }
+
+  tw = treeWalkNew(nthreads, CHATTR_NOPENFD, "chattr", changeEntry, counts);
+  if (tw == NULL) {
+    pexit("treeWalkNew");
+  }
+
+  /* paths given are followed if they are symbolic links, as chattr(1) does */
+  for (i = 0; i < npaths; ++i) {
+    fd = open(paths[i], O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &sb) == -1) {
+      treeWalkError(tw, AT_FDCWD, paths[i], "open");
+      ++counts[0].failed;
+      if (fd != -1) {
+        close(fd);
+      }
+      continue;
+    }
+
+    result = changeFlags(fd);
+    if (result == FAILED) {
+      treeWalkError(tw, AT_FDCWD, paths[i], "ioctl");
+    }
+    count(&counts[0], result);
+
+    if (!S_ISDIR(sb.st_mode)) {
+      close(fd);
+    } else if (treeWalkDir(tw, 0, fd) == -1) {
+      pexit("treeWalkDir");
     }
   }
 
-  exit(EXIT_SUCCESS);
+  unread = treeWalkRun(tw);
+  if (unread == -1) {
+    pexit("treeWalkRun");
+  }
+
+  for (i = 0; i < nthreads; ++i) {
+    changed += counts[i].changed;
+    unchanged += counts[i].unchanged;
+    skipped += counts[i].skipped;
+    failed += counts[i].failed;
+  }
+  failed += unread;
+
+  treeWalkFree(tw);
+  free(counts);
+
+  printf("%ld changed, %ld already as asked, %ld skipped (links and special files), %ld failed\n",
+      changed, unchanged, skipped, failed);
+
+  return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 static void
@@ -133,7 +343,7 @@ helpAndLeave(const char *progname, int status) {
     stream = stdout;
   }
 
-  fprintf(stream, "Usage: %s <-+=><flags> <file> [<file2> <file3 ...]\n", progname);
+  fprintf(stream, "Usage: %s [-R] [-P threads] <-+=><flags> <file> [<file2> <file3 ...]\n", progname);
   exit(status);
 }
 
@@ -13,51 +13,116 @@
  *
  * Usage:
  *
- *    $ ./chmod_arx <file1> ... <fileN>
+ *    $ ./chmod_arx [-R] [-j threads] <file1> ... <fileN>
  *
  *    <file1..N> - the files to have their permissions changes
  *
+ *    -R - change the permissions of directories and everything under them
+ *
+ *    -j - the number of threads changing permissions with -R (default: the
+ *    number of CPUs)
+ *
+ * Recursive mode
+ *
+ * With -R, trees are walked by a number of threads with lib/treewalk.c, each
+ * taking open directories from a deque of its own, and stealing from the others
+ * when it runs out. Entries are looked up and changed relative to the descriptor
+ * of their directory, with fstatat(2) and fchmodat(2): no path is resolved past
+ * the ones given. Files whose permissions are already as asked are not changed -
+ * on a tree fixed before, that is a single fstatat(2) per file.
+ *
+ * A directory has its permissions changed before it is opened, so that it can be
+ * read even if it could not before. Symbolic links found while walking are not
+ * followed, nor changed; errors are reported, and the walk goes on.
+ *
+ * Built along with treewalk.c:
+ *
+ *    $ gcc -o chmod_arx chmod_arx.c ../lib/treewalk.c -pthread
+ *
  * Author: Renato Mascarenhas Costa
  */
 
+#define _GNU_SOURCE /* openat(2), fstatat(2) and O_NOFOLLOW */
+
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "../lib/treewalk.h"
+
+#ifndef CHMOD_NOPENFD
+#  define CHMOD_NOPENFD (1024)
+#endif
+
+typedef enum { FALSE, TRUE } Bool;
+
 static void helpAndLeave(const char *progname, int status);
 static void pexit(const char *fCall);
 
+static int changeTree(char *paths[], int npaths, int nthreads);
+
+/* the permissions a file with `mode` has after a+rX */
+static mode_t
+arxMode(mode_t mode) {
+  mode_t newMode;
+
+  /* every type of user gains read access */
+  newMode = mode | S_IRUSR | S_IRGRP | S_IROTH;
+
+  if (S_ISDIR(mode)) {
+    /* if file is a directory, everyone gains search permissions */
+    newMode |= S_IXUSR | S_IXGRP | S_IXOTH;
+  } else {
+    /* file is not a directory: only give execute permissions to everyone
+     * if at least one type of user is able to execute it*/
+    if ((mode & S_IXUSR) || (mode & S_IXGRP) || (mode & S_IXOTH)) {
+      newMode |= S_IXUSR | S_IXGRP | S_IXOTH;
+    }
+  }
+
+  return newMode & ~S_IFMT;
+}
+
 int
 main(int argc, char *argv[]) {
-  if (argc == 1) {
+  struct stat info;
+  mode_t mode;
+  int opt, i, nthreads = 0;
+  Bool recursive = FALSE;
+
+  while ((opt = getopt(argc, argv, "Rj:")) != -1) {
+    switch (opt) {
+      case 'R': recursive = TRUE;                      break;
+      case 'j': nthreads = atoi(optarg);               break;
+      default:  helpAndLeave(argv[0], EXIT_FAILURE);   break;
+    }
+  }
+
+  if (optind == argc || nthreads < 0) {
     helpAndLeave(argv[0], EXIT_FAILURE);
   }
 
-  struct stat info;
-  mode_t mode;
-  int i;
+  if (recursive) {
+    if (nthreads == 0) {
+      nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
 
-  for (i = 1; i < argc; ++i) {
+    exit(changeTree(argv + optind, argc - optind, (nthreads > 0) ? nthreads : 1));
+  }
+
+  for (i = optind; i < argc; ++i) {
     if (stat(argv[i], &info) == -1) {
       pexit("stat");
     }
 
-    /* every type of user gains read access */
-    mode = info.st_mode;
-    mode |= S_IRUSR | S_IRGRP | S_IROTH;
-
-    if (S_ISDIR(info.st_mode)) {
-      /* if file is a directory, everyone gains search permissions */
-      mode |= S_IXUSR | S_IXGRP | S_IXOTH;
-    } else {
-      /* file is not a directory: only give execute permissions to everyone
-       * if at least one type of user is able to execute it*/
-      if ((info.st_mode & S_IXUSR) || (info.st_mode & S_IXGRP) || (info.st_mode & S_IXOTH)) {
-        mode |= S_IXUSR | S_IXGRP | S_IXOTH;
-      }
+    mode = arxMode(info.st_mode);
+    if (mode == (info.st_mode & ~S_IFMT)) {
+      continue;
     }
 
     if (chmod(argv[i], mode) == -1) {
@@ -68,6 +133,110 @@ main(int argc, char *argv[]) {
   exit(EXIT_SUCCESS);
 }
 
+/* what was done by a thread, with -R */
+struct counts {
+  long changed, unchanged, links, failed;
+};
+
+/* changes the permissions of the entry `name` of the directory open as `fd`, and
+ * has it read if it is a directory itself */
+static int
+changeEntry(struct treeWalk *tw, int worker, int fd, const char *name, unsigned char dtype, void *arg) {
+  struct counts *c = (struct counts *) arg + worker;
+  struct stat sb;
+  mode_t mode;
+  int dirfd;
+
+  /* symbolic links are known from their entries, and need not be stat'ed */
+  if (dtype == DT_LNK) {
+    ++c->links;
+    return 0;
+  }
+
+  if (fstatat(fd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+    treeWalkError(tw, fd, name, "fstatat");
+    ++c->failed;
+    return 0;
+  }
+
+  if (S_ISLNK(sb.st_mode)) {
+    ++c->links;
+    return 0;
+  }
+
+  mode = arxMode(sb.st_mode);
+  if (mode == (sb.st_mode & ~S_IFMT)) {
+    ++c->unchanged;
+  } else if (fchmodat(fd, name, mode, 0) == -1) {
+    treeWalkError(tw, fd, name, "fchmodat");
+    ++c->failed;
+  } else {
+    ++c->changed;
+  }
+
+  if (!S_ISDIR(sb.st_mode)) {
+    return 0;
+  }
+
+  dirfd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (dirfd == -1) {
+    treeWalkError(tw, fd, name, "openat");
+    ++c->failed;
+    return 0;
+  }
+
+  return treeWalkDir(tw, worker, dirfd);
+}
+
+/* changes the permissions of `paths`, and of everything under those which are
+ * directories. Returns the exit status */
+static int
+changeTree(char *paths[], int npaths, int nthreads) {
+  long changed = 0, unchanged = 0, links = 0, failed = 0, unread;
+  struct treeWalk *tw;
+  struct counts *counts;
+  int i;
+
+  counts = calloc(nthreads, sizeof(struct counts));
+  if (counts == NULL) {
+    pexit("calloc");
+  }
+
+  tw = treeWalkNew(nthreads, CHMOD_NOPENFD, "chmod_arx", changeEntry, counts);
+  if (tw == NULL) {
+    pexit("treeWalkNew");
+  }
+
+  /* paths given are taken as entries of the working directory: symbolic links
+   * given are not followed either */
+  for (i = 0; i < npaths; ++i) {
+    if (changeEntry(tw, 0, AT_FDCWD, paths[i], DT_UNKNOWN, counts) == -1) {
+      pexit("changeEntry");
+    }
+  }
+
+  unread = treeWalkRun(tw);
+  if (unread == -1) {
+    pexit("treeWalkRun");
+  }
+
+  for (i = 0; i < nthreads; ++i) {
+    changed += counts[i].changed;
+    unchanged += counts[i].unchanged;
+    links += counts[i].links;
+    failed += counts[i].failed;
+  }
+  failed += unread;
+
+  treeWalkFree(tw);
+  free(counts);
+
+  printf("%ld changed, %ld already as asked, %ld symbolic links skipped, %ld failed\n",
+      changed, unchanged, links, failed);
+
+  return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 static void
 helpAndLeave(const char *progname, int status) {
   FILE *stream = stderr;
@@ -76,7 +245,7 @@ helpAndLeave(const char *progname, int status) {
     stream = stdout;
   }
 
-  fprintf(stream, "Usage: %s <file> [<file2> <file3> ...]\n", progname);
+  fprintf(stream, "Usage: %s [-R] [-j threads] <file> [<file2> <file3> ...]\n", progname);
   exit(status);
 }
 
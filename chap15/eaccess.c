@@ -12,6 +12,8 @@
  *    $ ./eaccess <frwx> <file>
  *    file: permission granted
  *
+ *    $ find /srv -print | ./eaccess -b <frwx> [list]
+ *
  *    <frwx> - specify as many flags as wanted for the access check:
  *        f - checks if the file exist (F_OK)
  *        r - checks for read permission (R_OK)
@@ -20,30 +22,82 @@
  *
  *    <file> - the file to be checked against
  *
+ *    -b - check every path in `list` (one per line; the standard input if none
+ *    is given), printing the result for each, and how many were granted at the
+ *    end.
+ *
+ * Batch checks
+ *
+ * Checking a path takes checking search permission on every directory on the
+ * way to it. With -b, the directories of the path last checked are kept open
+ * (with O_PATH), one per component, along with whether they could be searched:
+ * the next path only has the components it does not share with the previous one
+ * opened and checked, and its file is checked relative to its directory. Paths
+ * listed in the order find(1) prints them share most of their components, and
+ * are checked with a single system call each.
+ *
+ * Checks are made with faccessat2(2) and AT_EACCESS, which checks the effective
+ * IDs the way opening the file would (ACLs and capabilities included). On kernels
+ * without it (before Linux 5.8), they are made as described in `eaccessat` below,
+ * with the effective IDs and supplementary groups of the process taken once.
+ *
  * Author: Renato Mascarenhas Costa
  */
 
+#define _DEFAULT_SOURCE /* not _GNU_SOURCE, which declares glibc's own eaccess */
+
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
 #include <errno.h>
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifndef O_PATH
+#  define O_PATH (010000000)
+#endif
+
+#ifndef SYS_faccessat2
+#  define SYS_faccessat2 (439)
+#endif
+
+#ifndef EACCESS_OUTBUFSIZ
+#  define EACCESS_OUTBUFSIZ (1024 * 1024)
+#endif
+
+/* a directory on the way to the paths checked in a batch */
+struct st_level {
+  char *name;
+  int fd;     /* O_PATH descriptor, -1 if it could not be reached */
+  int error;  /* why not (EACCES if a directory before it cannot be searched) */
+};
 
 static int eaccess(const char *pathname, int mode);
+static int eaccessat(int dirfd, const char *pathname, int mode);
+static int checkBatch(FILE *list, int mode);
 
 static void helpAndLeave(const char *progname, int status);
 static void pexit(const char *fCall);
 
 int
 main(int argc, char *argv[]) {
-  if (argc != 3) {
-    helpAndLeave(argv[0], EXIT_FAILURE);
+  char *accessString, *filename, *p;
+  FILE *list = stdin;
+  int mode, batch = 0;
+
+  if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+    batch = 1;
+    --argc;
+    ++argv;
   }
 
-  char *accessString, *filename, *p;
-  int mode;
+  if (argc != 3 && !(batch && argc == 2)) {
+    helpAndLeave(argv[0], EXIT_FAILURE);
+  }
 
   accessString = argv[1];
   filename = argv[2];
@@ -61,6 +115,17 @@ main(int argc, char *argv[]) {
     }
   }
 
+  if (batch) {
+    if (filename != NULL && (list = fopen(filename, "r")) == NULL) {
+      pexit(filename);
+    }
+
+    if (checkBatch(list, mode) == -1) {
+      pexit("checkBatch");
+    }
+    exit(EXIT_SUCCESS);
+  }
+
   errno = 0;
   if (eaccess(filename, mode) == 0) {
     printf("%s: permission granted\n", filename);
@@ -84,6 +149,7 @@ helpAndLeave(const char *progname, int status) {
   }
 
   fprintf(stream, "Usage: %s <frwx> <file>\n", progname);
+  fprintf(stream, "       %s -b <frwx> [list]\n", progname);
   exit(status);
 }
 
@@ -93,34 +159,89 @@ pexit(const char *fCall) {
   exit(EXIT_FAILURE);
 }
 
+/* the credentials permissions are checked with, when the kernel cannot */
+static int credsTaken;
+static uid_t euid;
+static gid_t egid;
+static gid_t *groups;
+static int ngroups;
+
+static void
+takeCreds(void) {
+  euid = geteuid();
+  egid = getegid();
+
+  ngroups = getgroups(0, NULL);
+  if (ngroups == -1) {
+    pexit("getgroups");
+  }
+
+  groups = malloc((ngroups + 1) * sizeof(gid_t));
+  if (groups == NULL) {
+    pexit("malloc");
+  }
+
+  ngroups = getgroups(ngroups, groups);
+  if (ngroups == -1) {
+    pexit("getgroups");
+  }
+
+  credsTaken = 1;
+}
+
+static int
+inGroup(gid_t gid) {
+  int i;
+
+  if (gid == egid) {
+    return 1;
+  }
+
+  for (i = 0; i < ngroups; ++i) {
+    if (groups[i] == gid) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
 /* Implement the permission check algorithm to determine if a file is accessible,
  * using the effective credentials:
  *
  *  * If the process owner is the owner of the file, owner permissions are checked;
- *  * If it is not the owner, but belongs to the owner group, group permissions
- *    are checked;
+ *  * If it is not the owner, but belongs to the owner group (or to one of its
+ *    supplementary groups), group permissions are checked;
  *  * If none of the above, then the `other' permissions apply.
+ *
+ * The superuser can read and write anything, and execute files any execute
+ * permission is granted on (and search any directory).
+ *
+ * `pathname` is relative to `dirfd`, as with faccessat(2). ACLs are not taken
+ * into account.
  */
 static int
-eaccess(const char *pathname, int mode) {
+emulateAccess(int dirfd, const char *pathname, int mode) {
   struct stat info;
+  int r, w, x;
 
-  if (stat(pathname, &info) == -1) {
+  if (fstatat(dirfd, pathname, &info, 0) == -1) {
     return -1;
   }
 
-  uid_t euid, egid;
-  int r, w, x;
-
-  euid = geteuid();
-  egid = getegid();
+  if (!credsTaken) {
+    takeCreds();
+  }
 
-  if (info.st_uid == euid) {
+  if (euid == 0) {
+    r = w = 1;
+    x = S_ISDIR(info.st_mode) || (info.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH));
+  } else if (info.st_uid == euid) {
     /* owner of the file */
     r = info.st_mode & S_IRUSR;
     w = info.st_mode & S_IWUSR;
     x = info.st_mode & S_IXUSR;
-  } else if (info.st_gid == egid) {
+  } else if (inGroup(info.st_gid)) {
     /* belongs to the group owner */
     r = info.st_mode & S_IRGRP;
     w = info.st_mode & S_IWGRP;
@@ -133,8 +254,224 @@ eaccess(const char *pathname, int mode) {
   }
 
   if (((mode & R_OK) && !r) || ((mode & W_OK) && !w) || ((mode & X_OK) && !x)) {
+    errno = EACCES;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* checks `pathname`, relative to `dirfd`, with the effective IDs. Returns -1
+ * with `errno` set to EACCES if permission is denied, or to what prevented the
+ * check */
+static int
+eaccessat(int dirfd, const char *pathname, int mode) {
+  static int haveFaccessat2 = 1;
+
+  if (haveFaccessat2) {
+    if (syscall(SYS_faccessat2, dirfd, pathname, mode, AT_EACCESS) == 0) {
+      return 0;
+    }
+
+    if (errno != ENOSYS) {
+      return -1;
+    }
+    haveFaccessat2 = 0;
+  }
+
+  return emulateAccess(dirfd, pathname, mode);
+}
+
+static int
+eaccess(const char *pathname, int mode) {
+  if (eaccessat(AT_FDCWD, pathname, mode) == -1) {
+    /* denied, rather than failed */
+    if (errno == EACCES) {
+      errno = 0;
+    }
+    return -1;
+  }
+
+  return 0;
+}
+
+/* closes the levels of the stack from `from` on */
+static void
+popLevels(struct st_level *levels, size_t *depth, size_t from) {
+  while (*depth > from) {
+    --*depth;
+    if (levels[*depth].fd != -1) {
+      close(levels[*depth].fd);
+    }
+    free(levels[*depth].name);
+  }
+}
+
+/* the directory `name`, under `parent` (AT_FDCWD if it is the working directory):
+ * opened if `parent` could be searched */
+static void
+pushLevel(struct st_level *level, const struct st_level *parent, int parentFd, const char *name) {
+  level->name = strdup(name);
+  if (level->name == NULL) {
+    pexit("strdup");
+  }
+
+  level->fd = -1;
+  level->error = (parent != NULL) ? parent->error : 0;
+  if (level->error != 0) {
+    return;
+  }
+
+  /* opening with O_PATH only takes search permission on the parent */
+  level->fd = openat(parentFd, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (level->fd == -1) {
+    level->error = errno;
+    return;
+  }
+
+  /* and the files under it, search permission on the directory itself */
+  if (eaccessat(level->fd, ".", X_OK) == -1) {
+    level->error = errno;
+  }
+}
+
+/* the result of checking a path, as printed */
+static void
+report(const char *path, int error, unsigned long *granted, unsigned long *denied, unsigned long *failed) {
+  if (error == 0) {
+    printf("%s: permission granted\n", path);
+    ++*granted;
+  } else if (error == EACCES) {
+    printf("%s: permission denied\n", path);
+    ++*denied;
+  } else {
+    printf("%s: %s\n", path, strerror(error));
+    ++*failed;
+  }
+}
+
+/* makes room for one more level on the stack */
+static int
+growLevels(struct st_level **levels, size_t *capacity, size_t depth) {
+  struct st_level *tmp;
+
+  if (depth < *capacity) {
+    return 0;
+  }
+
+  tmp = realloc(*levels, 2 * (*capacity + 32) * sizeof(struct st_level));
+  if (tmp == NULL) {
     return -1;
   }
 
+  *levels = tmp;
+  *capacity = 2 * (*capacity + 32);
   return 0;
 }
+
+/* checks the paths in `list`, one per line. The stack of directories starts at
+ * the root for absolute paths, and at the working directory for the others */
+static int
+checkBatch(FILE *list, int mode) {
+  struct st_level *levels = NULL;
+  unsigned long granted = 0, denied = 0, failed = 0;
+  size_t depth = 0, capacity = 0, used, len, lineSize = 0, workSize = 0;
+  char *line = NULL, *work = NULL, *dir, *base, *comp, *save;
+  ssize_t numRead;
+  int absolute = -1, error;
+
+  if (setvbuf(stdout, NULL, _IOFBF, EACCESS_OUTBUFSIZ) != 0) {
+    return -1;
+  }
+
+  while ((numRead = getline(&line, &lineSize, list)) != -1) {
+    if (numRead > 0 && line[numRead - 1] == '\n') {
+      line[--numRead] = '\0';
+    }
+    if (numRead == 0) {
+      continue;
+    }
+
+    if (workSize < lineSize) {
+      free(work);
+      workSize = lineSize;
+      if ((work = malloc(workSize)) == NULL) {
+        return -1;
+      }
+    }
+
+    /* ending slashes do not name anything else */
+    memcpy(work, line, numRead + 1);
+    for (len = numRead; len > 1 && work[len - 1] == '/'; --len) {
+      work[len - 1] = '\0';
+    }
+
+    /* the stack starts over when going from relative paths to absolute ones */
+    if (absolute != (work[0] == '/')) {
+      popLevels(levels, &depth, 0);
+      absolute = (work[0] == '/');
+    }
+
+    if (depth == 0) {
+      if (growLevels(&levels, &capacity, depth) == -1) {
+        return -1;
+      }
+      pushLevel(&levels[0], NULL, AT_FDCWD, absolute ? "/" : ".");
+      depth = 1;
+    }
+
+    /* the file checked, in directory `dir` (the root, "/", is checked as "."
+     * in itself) */
+    base = strrchr(work, '/');
+    if (base == NULL) {
+      dir = "";
+      base = work;
+    } else {
+      *base++ = '\0';
+      dir = work;
+      if (*base == '\0') {
+        base = ".";
+      }
+    }
+
+    /* the directories shared with the previous path are kept */
+    used = 1;
+    for (comp = strtok_r(dir, "/", &save); comp != NULL; comp = strtok_r(NULL, "/", &save)) {
+      if (strcmp(comp, ".") == 0) {
+        continue;
+      }
+
+      if (used < depth && strcmp(levels[used].name, comp) == 0) {
+        ++used;
+        continue;
+      }
+
+      popLevels(levels, &depth, used);
+      if (growLevels(&levels, &capacity, depth) == -1) {
+        return -1;
+      }
+
+      pushLevel(&levels[depth], &levels[depth - 1], levels[depth - 1].fd, comp);
+      ++depth;
+      ++used;
+    }
+    popLevels(levels, &depth, used);
+
+    error = levels[depth - 1].error;
+    if (error == 0 && eaccessat(levels[depth - 1].fd, base, mode) == -1) {
+      error = errno;
+    }
+
+    report(line, error, &granted, &denied, &failed);
+  }
+
+  printf("\n%lu paths: %lu granted, %lu denied, %lu could not be checked\n",
+         granted + denied + failed, granted, denied, failed);
+
+  popLevels(levels, &depth, 0);
+  free(levels);
+  free(work);
+  free(line);
+
+  return (fflush(stdout) == EOF) ? -1 : 0;
+}
@@ -13,12 +13,47 @@
  *    <value> - the value to be set.
  *    <file>  - the file to which the program should add the EA.
  *
+ *    $ ./setfattr -d <dir> > attrs
+ *    $ ./setfattr -r <dir> < attrs
+ *
+ *    -d - dumps the user EAs of <dir> and of every file under it to the standard
+ *    output, as a binary stream.
+ *    -r - restores the EAs in the stream read from the standard input to the
+ *    files under <dir> with the same relative paths.
+ *
+ * Dump and restore
+ *
+ * The stream starts with XATTR_DUMP_MAGIC, followed by a record for each file
+ * with user EAs:
+ *
+ *    uint32_t pathLength, char path[pathLength]  (relative to <dir>, "." for it)
+ *    uint32_t count
+ *    count times: uint32_t nameLength, uint32_t valueLength, name, value
+ *
+ * Lengths are in the byte order of the machine dumping. The tree is walked with
+ * getdents64(2), files being opened relative to their directory, and their EAs
+ * are read from the descriptor with flistxattr(2) and fgetxattr(2) into buffers
+ * as large as the kernel allows (XATTR_LIST_MAX and XATTR_SIZE_MAX), so sizes
+ * are never asked first: a file without EAs costs opening it and one call, a file
+ * with them one more call for each. Only regular files and directories are
+ * considered, as they are the only ones which can have user EAs. On restore, each
+ * file is opened once and its EAs are set with fsetxattr(2).
+ *
  * Author: Renato Mascarenhas Costa
  */
 
+#define _GNU_SOURCE /* openat(2) and O_NOFOLLOW */
+
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/xattr.h>
+#include <sys/syscall.h>
+#include <linux/limits.h> /* XATTR_LIST_MAX, XATTR_SIZE_MAX */
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <errno.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,8 +62,21 @@
 static void helpAndLeave(const char *progname, int status);
 static void pexit(const char *fCall);
 
+static void dumpTree(const char *dir);
+static void restoreTree(const char *dir);
+
 int
 main(int argc, char *argv[]) {
+  if (argc == 3 && !strcmp(argv[1], "-d")) {
+    dumpTree(argv[2]);
+    exit(EXIT_SUCCESS);
+  }
+
+  if (argc == 3 && !strcmp(argv[1], "-r")) {
+    restoreTree(argv[2]);
+    exit(EXIT_SUCCESS);
+  }
+
   if (argc != 4) {
     helpAndLeave(argv[0], EXIT_FAILURE);
   }
@@ -42,13 +90,293 @@ main(int argc, char *argv[]) {
 
   snprintf(ea_name, BUFSIZ, "user.%s", name);
 
-  if (setxattr(file, ea_name, value, strlen(ea_name), 0) == -1) {
+  if (setxattr(file, ea_name, value, strlen(value), 0) == -1) {
     pexit("setxattr");
   }
 
   exit(EXIT_SUCCESS);
 }
 
+#define XATTR_DUMP_MAGIC "XATTRDMP1"
+#define DENTS_BUF_SIZ (32 * 1024) /* bytes of directory entries read at a time */
+
+/* as returned by getdents64(2), which glibc does not declare */
+struct linux_dirent64 {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+static char names[XATTR_LIST_MAX];
+static char value[XATTR_SIZE_MAX];
+static char path[PATH_MAX];
+static long nfiles, nattrs;
+
+static void
+put(const void *buf, size_t len) {
+  if (fwrite(buf, 1, len, stdout) != len) {
+    pexit("fwrite");
+  }
+}
+
+static void
+putLength(size_t len) {
+  uint32_t n = len;
+  put(&n, sizeof(n));
+}
+
+/* writes the record of the file open as `fd`, whose path is in `path`, if it
+ * has user EAs */
+static void
+dumpFile(int fd) {
+  ssize_t listLen, valueLen;
+  uint32_t count = 0;
+  char *name;
+
+  if ((listLen = flistxattr(fd, names, sizeof(names))) == -1) {
+    if (errno == ENOTSUP) {
+      return;
+    }
+    pexit("flistxattr");
+  }
+
+  for (name = names; name < names + listLen; name += strlen(name) + 1) {
+    if (!strncmp(name, "user.", 5)) {
+      ++count;
+    }
+  }
+
+  if (count == 0) {
+    return;
+  }
+
+  putLength(strlen(path));
+  put(path, strlen(path));
+  putLength(count);
+
+  for (name = names; name < names + listLen; name += strlen(name) + 1) {
+    if (strncmp(name, "user.", 5)) {
+      continue;
+    }
+
+    if ((valueLen = fgetxattr(fd, name, value, sizeof(value))) == -1) {
+      pexit("fgetxattr");
+    }
+
+    putLength(strlen(name));
+    putLength(valueLen);
+    put(name, strlen(name));
+    put(value, valueLen);
+    ++nattrs;
+  }
+
+  ++nfiles;
+}
+
+/* dumps the entries of the directory open as `dirfd`, whose path is `path`
+ * (`pathLen` bytes long), and closes it */
+static void
+dumpDir(int dirfd, size_t pathLen) {
+  struct linux_dirent64 *e;
+  struct stat sb;
+  unsigned char type;
+  char *buf, *p;
+  long numRead;
+  size_t nameLen;
+  int fd;
+
+  buf = malloc(DENTS_BUF_SIZ);
+  if (buf == NULL) {
+    pexit("malloc");
+  }
+
+  while ((numRead = syscall(SYS_getdents64, dirfd, buf, DENTS_BUF_SIZ)) > 0) {
+    for (p = buf; p < buf + numRead; p += e->d_reclen) {
+      e = (struct linux_dirent64 *) p;
+
+      /* do not handle . and .. entries */
+      if (e->d_name[0] == '.' && (e->d_name[1] == '\0' || (e->d_name[1] == '.' && e->d_name[2] == '\0'))) {
+        continue;
+      }
+
+      type = e->d_type;
+      if (type == DT_UNKNOWN) {
+        if (fstatat(dirfd, e->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+          pexit("fstatat");
+        }
+        type = S_ISDIR(sb.st_mode) ? DT_DIR : (S_ISREG(sb.st_mode) ? DT_REG : DT_UNKNOWN);
+      }
+
+      /* only regular files and directories can have user EAs */
+      if (type != DT_REG && type != DT_DIR) {
+        continue;
+      }
+
+      nameLen = strlen(e->d_name);
+      if (pathLen + 1 + nameLen >= PATH_MAX) {
+        fprintf(stderr, "path too long: %s/%s\n", path, e->d_name);
+        exit(EXIT_FAILURE);
+      }
+
+      fd = openat(dirfd, e->d_name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+      if (fd == -1) {
+        pexit("openat");
+      }
+
+      if (pathLen == 1 && path[0] == '.') {
+        memcpy(path, e->d_name, nameLen + 1);
+        dumpFile(fd);
+        if (type == DT_DIR) {
+          dumpDir(fd, nameLen);
+        } else {
+          close(fd);
+        }
+        memcpy(path, ".", 2);
+      } else {
+        path[pathLen] = '/';
+        memcpy(path + pathLen + 1, e->d_name, nameLen + 1);
+        dumpFile(fd);
+        if (type == DT_DIR) {
+          dumpDir(fd, pathLen + 1 + nameLen);
+        } else {
+          close(fd);
+        }
+        path[pathLen] = '\0';
+      }
+    }
+  }
+
+  if (numRead == -1) {
+    pexit("getdents64");
+  }
+
+  free(buf);
+  close(dirfd);
+}
+
+static void
+dumpTree(const char *dir) {
+  static char outbuf[1024 * 1024];
+  int fd;
+
+  if (isatty(STDOUT_FILENO)) {
+    fprintf(stderr, "refusing to write a binary dump to a terminal\n");
+    exit(EXIT_FAILURE);
+  }
+
+  setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+  put(XATTR_DUMP_MAGIC, strlen(XATTR_DUMP_MAGIC));
+
+  fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    pexit("open");
+  }
+
+  strcpy(path, ".");
+  dumpFile(fd);
+  dumpDir(fd, 1);
+
+  if (fflush(stdout) == EOF) {
+    pexit("fflush");
+  }
+
+  fprintf(stderr, "%ld attributes of %ld files dumped\n", nattrs, nfiles);
+}
+
+/* reads exactly `len` bytes of the dump. Returns 0 at the end of it, if it
+ * comes before any byte is read */
+static int
+get(void *buf, size_t len) {
+  size_t numRead = fread(buf, 1, len, stdin);
+
+  if (numRead == len) {
+    return 1;
+  }
+
+  if (ferror(stdin)) {
+    pexit("fread");
+  }
+
+  if (numRead != 0) {
+    fprintf(stderr, "truncated dump\n");
+    exit(EXIT_FAILURE);
+  }
+
+  return 0;
+}
+
+static size_t
+getLength(size_t max) {
+  uint32_t n;
+
+  if (!get(&n, sizeof(n)) || n > max) {
+    fprintf(stderr, "corrupted dump\n");
+    exit(EXIT_FAILURE);
+  }
+
+  return n;
+}
+
+static void
+restoreTree(const char *dir) {
+  static char inbuf[1024 * 1024];
+  char magic[sizeof(XATTR_DUMP_MAGIC) - 1], name[XATTR_NAME_MAX + 1];
+  uint32_t pathLen, count, i;
+  size_t nameLen, valueLen;
+  int rootfd, fd;
+
+  setvbuf(stdin, inbuf, _IOFBF, sizeof(inbuf));
+
+  if (!get(magic, sizeof(magic)) || memcmp(magic, XATTR_DUMP_MAGIC, sizeof(magic))) {
+    fprintf(stderr, "not an EA dump\n");
+    exit(EXIT_FAILURE);
+  }
+
+  rootfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (rootfd == -1) {
+    pexit("open");
+  }
+
+  while (get(&pathLen, sizeof(pathLen))) {
+    if (pathLen >= PATH_MAX) {
+      fprintf(stderr, "corrupted dump\n");
+      exit(EXIT_FAILURE);
+    }
+
+    get(path, pathLen);
+    path[pathLen] = '\0';
+    count = getLength(UINT32_MAX);
+
+    fd = openat(rootfd, path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    if (fd == -1) {
+      fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    }
+
+    for (i = 0; i < count; ++i) {
+      nameLen = getLength(XATTR_NAME_MAX);
+      valueLen = getLength(XATTR_SIZE_MAX);
+
+      get(name, nameLen);
+      name[nameLen] = '\0';
+      get(value, valueLen);
+
+      if (fd != -1 && fsetxattr(fd, name, value, valueLen, 0) == -1) {
+        pexit("fsetxattr");
+      }
+      nattrs += (fd != -1);
+    }
+
+    if (fd != -1) {
+      close(fd);
+      ++nfiles;
+    }
+  }
+
+  fprintf(stderr, "%ld attributes of %ld files restored\n", nattrs, nfiles);
+}
+
 static void
 helpAndLeave(const char *progname, int status) {
   FILE *stream = stderr;
@@ -58,6 +386,8 @@ helpAndLeave(const char *progname, int status) {
   }
 
   fprintf(stream, "Usage: %s <name> <value> <file>\n", progname);
+  fprintf(stream, "       %s -d <dir> > <dump>\n", progname);
+  fprintf(stream, "       %s -r <dir> < <dump>\n", progname);
   exit(status);
 }
 
@@ -10,20 +10,69 @@
  *
  * Usage
  *
- *    $ ./dirstats [-n] [<directory>]
+ *    $ ./dirstats [-n] [-j threads] [-c cache] [<directory>]
  *
  *    -n - do not follow symbolic links (default is to follow)
+ *    -j - traverse the tree with this many threads, instead of using nftw(3)
+ *    -c - keep what was found of each directory in this file, and reuse it on
+ *    later runs (implies -j 1, unless -j is given)
  *
  *    directory - the directory to traverse. If none is given, the current working
  *    directory is taken.
  *
+ * Parallel traversal
+ *
+ * With -j, the tree is walked by a number of threads, each with a deque of open
+ * directories waiting to be read. A thread reads the directories at the bottom of
+ * its own deque, pushing the subdirectories it finds there, and once it runs out
+ * of work, it steals directories from the top of the deques of the others - the
+ * oldest ones, which tend to be the roots of the largest subtrees left. Each thread
+ * counts files on its own, and the counts are added up at the end.
+ *
+ * Entries are read with getdents64(2), and files are only stat'ed when their type
+ * is not in the directory entry, or when symbolic links are followed (then, as
+ * nftw(3) does, directories already visited are not visited again). Directories
+ * are opened relative to their parents, and at most DIRSTATS_NOPENFD of them are
+ * kept open waiting to be read: past that, a thread reads subdirectories right
+ * away, instead of queueing them.
+ *
+ * Cached runs
+ *
+ * With -c, the number of entries of each type found directly in every directory,
+ * and the names of its subdirectories, are saved to a cache file, along with the
+ * device, inode and modification time of the directory. On the next run, a
+ * directory whose modification time did not change - that is, no entry in it was
+ * created, deleted or renamed - is not read: its counts are taken from the cache,
+ * and its subdirectories are entered by name. That does not hold for whole
+ * subtrees (a directory is not modified when something in its subdirectories
+ * is), so every directory is still opened and stat'ed, but the entries of the
+ * ones that did not change are neither read nor stat'ed.
+ *
+ * Directories modified less than a second before a run started are read again on
+ * the next one, as they could have changed in the meantime with no change to
+ * their timestamp. So are directories with symbolic links in them, unless -n is
+ * given, since what a link points to can change with no change to the directory.
+ * The cache is written to a temporary file, renamed over the old one once the
+ * walk is done.
+ *
  * Author: Renato Mascarenhas Costa
  */
 
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE /* nftw(3) and openat(2) */
 
 #include <ftw.h>
 #include <getopt.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,14 +82,21 @@
 #  define DIRSTATS_NOPENFD (4096)
 #endif
 
+#define DIRSTATS_CACHE_MAGIC ("DSTCACHE")
+#define DIRSTATS_CACHE_VERSION (1)
+
 typedef enum { FALSE, TRUE } Bool;
 
 static void helpAndLeave(const char *progname, int status);
 static void pexit(const char *fCall);
 
 static int getStats(const char *dir, const int flags);
+static int getStatsParallel(const char *dir, const int flags, int nthreads);
 static void printStats(const char *dir);
 
+static void loadCache(const char *path, int flags);
+static int saveCache(const char *path, int flags);
+
 struct file_count {
   size_t reg, dir, chr, blk, fifo, lnk, sock;
   size_t unreadDir, unreadFile;
@@ -58,19 +114,27 @@ struct file_count fstats = {
   .sock = 0
 };
 
+/* with -c: the cache file, when the walk started, and how many directories were
+ * read or taken from the cache */
+static char *cachePath;
+static struct timespec walkStart;
+static size_t dirsRead, dirsCached;
+
 int
 main(int argc, char *argv[]) {
-  if (argc > 3) {
+  if (argc > 7) {
     helpAndLeave(argv[0], EXIT_FAILURE);
   }
 
   char *dir;
-  int flags, opt;
+  int flags, opt, nthreads = 0;
 
   flags = 0;
-  while ((opt = getopt(argc, argv, "n")) != -1) {
+  while ((opt = getopt(argc, argv, "nj:c:")) != -1) {
     switch (opt) {
       case 'n': flags |= FTW_PHYS;                   break;
+      case 'j': nthreads = atoi(optarg);             break;
+      case 'c': cachePath = optarg;                  break;
       default:  helpAndLeave(argv[0], EXIT_FAILURE); break;
     }
   }
@@ -81,8 +145,20 @@ main(int argc, char *argv[]) {
     dir = ".";
   }
 
+  if (cachePath != NULL) {
+    clock_gettime(CLOCK_REALTIME, &walkStart);
+    loadCache(cachePath, flags);
+    if (nthreads == 0) {
+      nthreads = 1;
+    }
+  }
+
   printf("Scanning files...\n");
-  if (getStats(dir, flags) == -1) {
+  if (nthreads > 0) {
+    if (getStatsParallel(dir, flags, nthreads) == -1) {
+      pexit("getStatsParallel");
+    }
+  } else if (getStats(dir, flags) == -1) {
     pexit("getStats");
   }
 
@@ -99,7 +175,7 @@ helpAndLeave(const char *progname, int status) {
     stream = stdout;
   }
 
-  fprintf(stream, "Usage: %s [-n] [<directory>]\n", progname);
+  fprintf(stream, "Usage: %s [-n] [-j threads] [-c cache] [<directory>]\n", progname);
   exit(status);
 }
 
@@ -170,6 +246,727 @@ getStats(const char *dir, const int flags) {
   return 0;
 }
 
+#define DENTS_BUF_SIZ (32 * 1024) /* bytes of directory entries read at a time */
+
+/* as returned by getdents64(2), which glibc does not declare */
+struct linux_dirent64 {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/* directories waiting to be read by a thread: the thread itself takes them from
+ * the bottom (`tail`), others steal from the top (`head`) */
+struct deque {
+  pthread_mutex_t lock;
+  int *fds;
+  size_t size, head, tail;
+};
+
+struct worker {
+  pthread_t thread;
+  int id;
+  struct deque queue;
+  struct file_count counts;
+  size_t dirsRead, dirsCached;
+  char *cache;              /* with -c: the cache entries of the directories seen */
+  size_t cacheLength, cacheSize, cacheEntries;
+};
+
+/* a directory visited, when following symbolic links - empty if `ino` is 0 */
+struct object {
+  dev_t dev;
+  ino_t ino;
+};
+
+static struct worker *workers;
+static int nworkers, walkFlags;
+static long outstanding; /* directories queued or being read, by all threads */
+static int fdBudget;     /* directories that can still be queued open */
+static int walkError;    /* errno of the first error, stopping the walk */
+
+static pthread_mutex_t seenLock = PTHREAD_MUTEX_INITIALIZER;
+static struct object *seen;
+static size_t seenSize, seenCount;
+
+/* a directory in the cache file: the entries found directly in it, by type (its
+ * subdirectories are counted as they are entered), and the number of its
+ * subdirectories, whose names follow it, null terminated and padded to 8 bytes */
+struct cacheEntry {
+  uint64_t dev, ino;
+  int64_t mtimeSec, mtimeNsec;
+  struct file_count counts;
+  uint32_t nsubdirs;
+  uint32_t namesLength;
+};
+
+struct cacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;     /* FTW_PHYS, if symbolic links were not followed */
+  int64_t startSec;   /* when the walk started */
+  uint64_t entries;
+};
+
+/* the cache of the previous run: the file, read whole, and its entries in an open
+ * addressing table by device and inode. Only read once the walk starts */
+static char *cacheData;
+static struct cacheEntry **cacheSlots;
+static size_t cacheSlotsSize;
+
+/* records a directory as visited. Returns whether it was not visited before, or -1
+ * on errors */
+static int
+markSeen(const struct stat *sb) {
+  struct object *table, *o;
+  size_t i, size;
+  int isNew = 1;
+
+  pthread_mutex_lock(&seenLock);
+
+  if (2 * (seenCount + 1) > seenSize) {
+    size = (seenSize == 0) ? 1024 : 2 * seenSize;
+    table = calloc(size, sizeof(struct object));
+    if (table == NULL) {
+      pthread_mutex_unlock(&seenLock);
+      return -1;
+    }
+
+    for (i = 0; i < seenSize; ++i) {
+      if (seen[i].ino != 0) {
+        o = &table[(seen[i].ino * 2654435761u + seen[i].dev) & (size - 1)];
+        while (o->ino != 0) {
+          o = (o == &table[size - 1]) ? table : o + 1;
+        }
+        *o = seen[i];
+      }
+    }
+
+    free(seen);
+    seen = table;
+    seenSize = size;
+  }
+
+  o = &seen[(sb->st_ino * 2654435761u + sb->st_dev) & (seenSize - 1)];
+  while (o->ino != 0 && isNew) {
+    isNew = !(o->ino == sb->st_ino && o->dev == sb->st_dev);
+    o = (o == &seen[seenSize - 1]) ? seen : o + 1;
+  }
+
+  if (isNew) {
+    o->dev = sb->st_dev;
+    o->ino = sb->st_ino;
+    ++seenCount;
+  }
+
+  pthread_mutex_unlock(&seenLock);
+  return isNew;
+}
+
+static int
+pushDir(struct deque *q, int fd) {
+  int *fds;
+
+  pthread_mutex_lock(&q->lock);
+
+  if (q->tail == q->size) {
+    if (q->head > 0) {
+      memmove(q->fds, q->fds + q->head, (q->tail - q->head) * sizeof(int));
+      q->tail -= q->head;
+      q->head = 0;
+    } else {
+      fds = realloc(q->fds, 2 * q->size * sizeof(int));
+      if (fds == NULL) {
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+      }
+      q->fds = fds;
+      q->size *= 2;
+    }
+  }
+
+  q->fds[q->tail++] = fd;
+  pthread_mutex_unlock(&q->lock);
+  return 0;
+}
+
+/* takes a directory from the bottom (or top, when stealing) of a deque. Returns -1
+ * if it is empty */
+static int
+popDir(struct deque *q, Bool steal) {
+  int fd = -1;
+
+  pthread_mutex_lock(&q->lock);
+
+  if (q->head < q->tail) {
+    fd = steal ? q->fds[q->head++] : q->fds[--q->tail];
+    if (q->head == q->tail) {
+      q->head = q->tail = 0;
+    }
+  }
+
+  pthread_mutex_unlock(&q->lock);
+  return fd;
+}
+
+static void
+countType(struct file_count *c, mode_t mode) {
+  switch (mode & S_IFMT) {
+    case S_IFREG:  ++c->reg;  break;
+    case S_IFDIR:  ++c->dir;  break;
+    case S_IFCHR:  ++c->chr;  break;
+    case S_IFBLK:  ++c->blk;  break;
+    case S_IFLNK:  ++c->lnk;  break;
+    case S_IFIFO:  ++c->fifo; break;
+    case S_IFSOCK: ++c->sock; break;
+    default: break;
+  }
+}
+
+static mode_t
+typeOfEntry(unsigned char type) {
+  switch (type) {
+    case DT_REG:  return S_IFREG;
+    case DT_DIR:  return S_IFDIR;
+    case DT_CHR:  return S_IFCHR;
+    case DT_BLK:  return S_IFBLK;
+    case DT_LNK:  return S_IFLNK;
+    case DT_FIFO: return S_IFIFO;
+    case DT_SOCK: return S_IFSOCK;
+    default:      return 0;
+  }
+}
+
+static void
+addCounts(struct file_count *to, const struct file_count *from) {
+  to->reg += from->reg;
+  to->dir += from->dir;
+  to->chr += from->chr;
+  to->blk += from->blk;
+  to->fifo += from->fifo;
+  to->lnk += from->lnk;
+  to->sock += from->sock;
+  to->unreadDir += from->unreadDir;
+  to->unreadFile += from->unreadFile;
+}
+
+static size_t
+cacheSlot(uint64_t dev, uint64_t ino, size_t size) {
+  return (ino * 2654435761u + dev) & (size - 1);
+}
+
+/* reads the cache at `path`, if there is one from a walk made with the same
+ * `flags`. A cache that cannot be used is ignored: every directory is read */
+static void
+loadCache(const char *path, int flags) {
+  struct cacheHeader *header;
+  struct cacheEntry *e;
+  struct stat sb;
+  char *p, *end, *name;
+  ssize_t numRead;
+  size_t done, i;
+  uint64_t inserted = 0;
+  uint32_t n;
+  int fd;
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    if (errno != ENOENT) {
+      perror(path);
+    }
+    return;
+  }
+
+  if (fstat(fd, &sb) == -1) {
+    pexit("fstat");
+  }
+
+  cacheData = malloc(sb.st_size + 1);
+  if (cacheData == NULL) {
+    pexit("malloc");
+  }
+
+  for (done = 0; done < (size_t) sb.st_size; done += numRead) {
+    numRead = read(fd, cacheData + done, sb.st_size - done);
+    if (numRead == -1) {
+      pexit("read");
+    }
+    if (numRead == 0) {
+      break;
+    }
+  }
+  close(fd);
+
+  header = (struct cacheHeader *) cacheData;
+  if (done < sizeof(struct cacheHeader) ||
+      memcmp(header->magic, DIRSTATS_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != DIRSTATS_CACHE_VERSION || header->flags != (uint32_t) (flags & FTW_PHYS)) {
+    fprintf(stderr, "%s: not a cache of this kind of walk, ignored\n", path);
+    goto ignore;
+  }
+
+  if (header->entries > (done - sizeof(struct cacheHeader)) / sizeof(struct cacheEntry)) {
+    fprintf(stderr, "%s: corrupt, ignored\n", path);
+    goto ignore;
+  }
+
+  for (cacheSlotsSize = 1024; cacheSlotsSize < 2 * header->entries; cacheSlotsSize *= 2) {
+    ;
+  }
+
+  cacheSlots = calloc(cacheSlotsSize, sizeof(struct cacheEntry *));
+  if (cacheSlots == NULL) {
+    pexit("calloc");
+  }
+
+  end = cacheData + done;
+  for (p = cacheData + sizeof(struct cacheHeader); p < end; p += sizeof(struct cacheEntry) + e->namesLength) {
+    e = (struct cacheEntry *) p;
+    if ((size_t) (end - p) < sizeof(struct cacheEntry) ||
+        e->namesLength > (size_t) (end - p) - sizeof(struct cacheEntry) || e->namesLength % 8 != 0) {
+      fprintf(stderr, "%s: truncated, ignored\n", path);
+      goto ignore;
+    }
+
+    /* the names must all be there */
+    name = (char *) (e + 1);
+    for (n = 0; n < e->nsubdirs && name < (char *) (e + 1) + e->namesLength; ++n) {
+      name += strnlen(name, (char *) (e + 1) + e->namesLength - name) + 1;
+    }
+    if (n < e->nsubdirs || name > (char *) (e + 1) + e->namesLength) {
+      fprintf(stderr, "%s: corrupt, ignored\n", path);
+      goto ignore;
+    }
+
+    /* modified around the time it was read: it may have been modified again, in
+     * the same tick */
+    if (e->mtimeSec >= header->startSec - 1) {
+      continue;
+    }
+
+    /* the table is sized by the entries the header claims: more would fill it,
+     * and the search for a free slot would never end */
+    if (++inserted > header->entries) {
+      fprintf(stderr, "%s: corrupt, ignored\n", path);
+      goto ignore;
+    }
+
+    for (i = cacheSlot(e->dev, e->ino, cacheSlotsSize); cacheSlots[i] != NULL; i = (i + 1) & (cacheSlotsSize - 1)) {
+      ;
+    }
+    cacheSlots[i] = e;
+  }
+
+  return;
+
+ignore:
+  free(cacheSlots);
+  free(cacheData);
+  cacheSlots = NULL;
+  cacheData = NULL;
+}
+
+/* the cache entry of the directory of `sb`, if it was not modified since */
+static const struct cacheEntry *
+cacheLookup(const struct stat *sb) {
+  struct cacheEntry *e;
+  size_t i;
+
+  if (cacheSlots == NULL) {
+    return NULL;
+  }
+
+  for (i = cacheSlot(sb->st_dev, sb->st_ino, cacheSlotsSize); (e = cacheSlots[i]) != NULL;
+       i = (i + 1) & (cacheSlotsSize - 1)) {
+    if (e->dev == sb->st_dev && e->ino == sb->st_ino) {
+      if (e->mtimeSec == sb->st_mtim.tv_sec && e->mtimeNsec == sb->st_mtim.tv_nsec) {
+        return e;
+      }
+      return NULL;
+    }
+  }
+
+  return NULL;
+}
+
+/* adds a directory to the cache to be saved */
+static int
+cacheAppend(struct worker *w, const struct cacheEntry *e, const char *names) {
+  size_t length = sizeof(struct cacheEntry) + e->namesLength, size;
+  char *cache;
+
+  if (w->cacheLength + length > w->cacheSize) {
+    for (size = (w->cacheSize == 0) ? 64 * 1024 : w->cacheSize; w->cacheLength + length > size; size *= 2) {
+      ;
+    }
+
+    cache = realloc(w->cache, size);
+    if (cache == NULL) {
+      return -1;
+    }
+    w->cache = cache;
+    w->cacheSize = size;
+  }
+
+  memcpy(w->cache + w->cacheLength, e, sizeof(struct cacheEntry));
+  memcpy(w->cache + w->cacheLength + sizeof(struct cacheEntry), names, e->namesLength);
+  w->cacheLength += length;
+  ++w->cacheEntries;
+  return 0;
+}
+
+/* writes the cache of the walk just made, replacing that at `path` */
+static int
+saveCache(const char *path, int flags) {
+  struct cacheHeader header;
+  char *tmp;
+  FILE *f;
+  int i;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, DIRSTATS_CACHE_MAGIC, sizeof(header.magic));
+  header.version = DIRSTATS_CACHE_VERSION;
+  header.flags = flags & FTW_PHYS;
+  header.startSec = walkStart.tv_sec;
+  for (i = 0; i < nworkers; ++i) {
+    header.entries += workers[i].cacheEntries;
+  }
+
+  if (asprintf(&tmp, "%s.tmp", path) == -1) {
+    return -1;
+  }
+
+  f = fopen(tmp, "w");
+  if (f == NULL) {
+    free(tmp);
+    return -1;
+  }
+
+  fwrite(&header, sizeof(header), 1, f);
+  for (i = 0; i < nworkers; ++i) {
+    fwrite(workers[i].cache, 1, workers[i].cacheLength, f);
+  }
+
+  if (ferror(f) || fclose(f) == EOF || rename(tmp, path) == -1) {
+    unlink(tmp);
+    free(tmp);
+    return -1;
+  }
+
+  free(tmp);
+  return 0;
+}
+
+static int readDir(struct worker *w, int fd);
+
+/* handles a subdirectory `name` of the directory open as `fd`: queues it to be read,
+ * or reads it right away if too many directories are open already */
+static int
+enterDir(struct worker *w, int fd, const char *name) {
+  struct stat sb;
+  int dirfd, isNew;
+
+  dirfd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | ((walkFlags & FTW_PHYS) ? O_NOFOLLOW : 0));
+  if (dirfd == -1) {
+    ++w->counts.unreadDir;
+    return 0;
+  }
+
+  if (!(walkFlags & FTW_PHYS)) {
+    if (fstat(dirfd, &sb) == -1 || (isNew = markSeen(&sb)) == -1) {
+      close(dirfd);
+      return -1;
+    }
+
+    if (!isNew) {
+      close(dirfd);
+      return 0;
+    }
+  }
+
+  ++w->counts.dir;
+
+  if (__atomic_sub_fetch(&fdBudget, 1, __ATOMIC_RELAXED) >= 0) {
+    __atomic_add_fetch(&outstanding, 1, __ATOMIC_RELAXED);
+    if (pushDir(&w->queue, dirfd) == -1) {
+      return -1;
+    }
+    return 0;
+  }
+
+  __atomic_add_fetch(&fdBudget, 1, __ATOMIC_RELAXED);
+  return readDir(w, dirfd);
+}
+
+/* counts the entries of a directory found in the cache, and closes it */
+static int
+replayDir(struct worker *w, int fd, const struct cacheEntry *e) {
+  const char *name = (const char *) (e + 1);
+  uint32_t i;
+  int status;
+
+  addCounts(&w->counts, &e->counts);
+  ++w->dirsCached;
+
+  status = cacheAppend(w, e, name);
+  for (i = 0; status == 0 && i < e->nsubdirs; ++i, name += strlen(name) + 1) {
+    status = enterDir(w, fd, name);
+  }
+
+  close(fd);
+  return status;
+}
+
+/* adds the name of a subdirectory to a cache entry being built, leaving room to
+ * pad the names */
+static int
+addSubdir(char **names, size_t *size, struct cacheEntry *entry, const char *name) {
+  size_t len = strlen(name) + 1;
+  char *p;
+
+  if (entry->namesLength + len + 7 > *size) {
+    *size = 2 * (*size + len);
+    p = realloc(*names, *size);
+    if (p == NULL) {
+      return -1;
+    }
+    *names = p;
+  }
+
+  memcpy(*names + entry->namesLength, name, len);
+  entry->namesLength += len;
+  ++entry->nsubdirs;
+  return 0;
+}
+
+/* counts the entries of a directory, and closes it */
+static int
+readDir(struct worker *w, int fd) {
+  struct linux_dirent64 *e;
+  struct cacheEntry entry;
+  const struct cacheEntry *cached;
+  struct file_count *counts = &w->counts;
+  struct stat sb;
+  char *buf, *p, *names = NULL;
+  size_t namesSize = 0;
+  long numRead;
+  mode_t mode;
+  int status = 0;
+  Bool cacheable = FALSE;
+
+  /* counts go to the cache entry, added up once the directory is read */
+  if (cachePath != NULL) {
+    if (fstat(fd, &sb) == -1) {
+      close(fd);
+      return -1;
+    }
+
+    if ((cached = cacheLookup(&sb)) != NULL) {
+      return replayDir(w, fd, cached);
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    entry.dev = sb.st_dev;
+    entry.ino = sb.st_ino;
+    entry.mtimeSec = sb.st_mtim.tv_sec;
+    entry.mtimeNsec = sb.st_mtim.tv_nsec;
+    counts = &entry.counts;
+    cacheable = TRUE;
+    ++w->dirsRead;
+  }
+
+  buf = malloc(DENTS_BUF_SIZ);
+  if (buf == NULL) {
+    close(fd);
+    return -1;
+  }
+
+  while (status == 0 && (numRead = syscall(SYS_getdents64, fd, buf, DENTS_BUF_SIZ)) > 0) {
+    for (p = buf; status == 0 && p < buf + numRead; p += e->d_reclen) {
+      e = (struct linux_dirent64 *) p;
+
+      /* do not handle . and .. entries */
+      if (e->d_name[0] == '.' && (e->d_name[1] == '\0' || (e->d_name[1] == '.' && e->d_name[2] == '\0'))) {
+        continue;
+      }
+
+      /* the type in the entry is enough, unless symbolic links are followed */
+      mode = typeOfEntry(e->d_type);
+      if (mode == 0 || (mode == S_IFLNK && !(walkFlags & FTW_PHYS))) {
+        /* what links point to can change with the directory left as it is */
+        if (!(walkFlags & FTW_PHYS)) {
+          cacheable = FALSE;
+        }
+
+        if (fstatat(fd, e->d_name, &sb, (walkFlags & FTW_PHYS) ? AT_SYMLINK_NOFOLLOW : 0) == -1) {
+          /* symbolic links to missing files are counted as links, like nftw(3) does */
+          if (errno == ENOENT && fstatat(fd, e->d_name, &sb, AT_SYMLINK_NOFOLLOW) == 0) {
+            countType(counts, sb.st_mode);
+          } else {
+            ++counts->unreadFile;
+          }
+          continue;
+        }
+        mode = sb.st_mode & S_IFMT;
+      }
+
+      if (S_ISDIR(mode)) {
+        if (cacheable && addSubdir(&names, &namesSize, &entry, e->d_name) == -1) {
+          status = -1;
+          break;
+        }
+        status = enterDir(w, fd, e->d_name);
+      } else {
+        countType(counts, mode);
+      }
+    }
+  }
+
+  if (numRead == -1) {
+    status = -1;
+  }
+
+  if (counts != &w->counts) {
+    addCounts(&w->counts, counts);
+
+    if (cacheable && status == 0) {
+      /* names are padded, so that entries stay aligned */
+      while (entry.namesLength % 8 != 0) {
+        names[entry.namesLength++] = '\0';
+      }
+      status = cacheAppend(w, &entry, names);
+    }
+  }
+
+  free(names);
+  free(buf);
+  close(fd);
+  return status;
+}
+
+static void *
+walker(void *arg) {
+  struct worker *w = arg;
+  int fd, i, error, expected;
+
+  for (;;) {
+    /* own work first, then the oldest directories of the others */
+    fd = popDir(&w->queue, FALSE);
+    for (i = 1; fd == -1 && i < nworkers; ++i) {
+      fd = popDir(&workers[(w->id + i) % nworkers].queue, TRUE);
+    }
+
+    if (fd != -1) {
+      __atomic_add_fetch(&fdBudget, 1, __ATOMIC_RELAXED);
+      if (readDir(w, fd) == -1) {
+        error = errno;
+        expected = 0;
+        __atomic_compare_exchange_n(&walkError, &expected, error, FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+      }
+      __atomic_sub_fetch(&outstanding, 1, __ATOMIC_RELEASE);
+      continue;
+    }
+
+    /* nothing to be stolen: done once no thread has directories left to read
+     * (which could bring more) */
+    if (__atomic_load_n(&outstanding, __ATOMIC_ACQUIRE) == 0) {
+      return NULL;
+    }
+
+    sched_yield();
+  }
+}
+
+static int
+getStatsParallel(const char *dir, const int flags, int nthreads) {
+  struct stat sb;
+  int fd, i, s;
+
+  walkFlags = flags;
+  if (fstatat(AT_FDCWD, dir, &sb, (flags & FTW_PHYS) ? AT_SYMLINK_NOFOLLOW : 0) == -1) {
+    ++fstats.unreadFile;
+    return 0;
+  }
+
+  countType(&fstats, sb.st_mode);
+  if (!S_ISDIR(sb.st_mode)) {
+    return 0;
+  }
+
+  fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    --fstats.dir;
+    ++fstats.unreadDir;
+    return 0;
+  }
+
+  if (!(flags & FTW_PHYS) && markSeen(&sb) == -1) {
+    return -1;
+  }
+
+  nworkers = nthreads;
+  workers = calloc(nworkers, sizeof(struct worker));
+  if (workers == NULL) {
+    return -1;
+  }
+
+  for (i = 0; i < nworkers; ++i) {
+    workers[i].id = i;
+    workers[i].queue.size = 64;
+    workers[i].queue.fds = malloc(workers[i].queue.size * sizeof(int));
+    if (workers[i].queue.fds == NULL) {
+      return -1;
+    }
+    pthread_mutex_init(&workers[i].queue.lock, NULL);
+  }
+
+  fdBudget = DIRSTATS_NOPENFD - 1;
+  outstanding = 1;
+  pushDir(&workers[0].queue, fd);
+
+  for (i = 1; i < nworkers; ++i) {
+    if ((s = pthread_create(&workers[i].thread, NULL, walker, &workers[i])) != 0) {
+      errno = s;
+      return -1;
+    }
+  }
+
+  walker(&workers[0]);
+
+  for (i = 0; i < nworkers; ++i) {
+    if (i > 0) {
+      pthread_join(workers[i].thread, NULL);
+    }
+
+    addCounts(&fstats, &workers[i].counts);
+    dirsRead += workers[i].dirsRead;
+    dirsCached += workers[i].dirsCached;
+  }
+
+  if (cachePath != NULL && walkError == 0 && saveCache(cachePath, flags) == -1) {
+    walkError = errno;
+  }
+
+  for (i = 0; i < nworkers; ++i) {
+    free(workers[i].queue.fds);
+    free(workers[i].cache);
+  }
+
+  free(workers);
+  free(seen);
+  free(cacheSlots);
+  free(cacheData);
+
+  if (walkError != 0) {
+    errno = walkError;
+    return -1;
+  }
+
+  return 0;
+}
+
 static void
 printStat(const char *ftype, size_t num, size_t total) {
   if (num > 0) {
@@ -201,4 +998,8 @@ printStats(const char *dir) {
 
   printf("\nFinished. %ld unread directories and %ld unread files\n",
     (long) fstats.unreadDir, (long) fstats.unreadFile);
+
+  if (cachePath != NULL) {
+    printf("%ld directories read, %ld unchanged since the last run\n", (long) dirsRead, (long) dirsCached);
+  }
 }
@@ -5,39 +5,34 @@
  * restore it. To achieve this behavior, both the `chdir` and the `fchdir` system
  * calls can be used.
  *
- * To benchmark their performance, this program can be told to perform the above
- * operation a number of times. The time spent can then be measured using tools
- * such as the UNIX `time(1)` command.
+ * To benchmark their performance, this program times the above operation done
+ * each way, a number of times, with the harness in lib/bench.c.
  *
  * Usage
  *
- *    $ ./fchdir_bench <numops> <syscall>
+ *    $ ./fchdir_bench [-i iterations] [-w warmup] [-c cpu] [-o text|csv|json] [syscall]
  *
- *    numops  - the number of operations to be performed.
- *    syscall - can be either c or f, to denote chdir or fchdir, respectively
+ *    syscall - can be either c or f, to denote chdir or fchdir, respectively.
+ *    Both are benchmarked if not given.
  *
- * Running this program to perform the operation a milion times, the results were
- * mostly around the values of:
+ *    The options are those of the harness (see lib/bench.h); 100,000 operations
+ *    are timed by default.
  *
- *    % time ./fchdir_bench 1000000 c
- *    Done. Performed 1000000 chdir operations
+ * Pinned to a CPU, the results were along the lines of:
  *
- *    real  0m3.822s
- *    user  0m0.152s
- *    sys 0m3.664s
+ *    $ ./fchdir_bench -c 0
+ *    benchmark        iterations        min     median        p99        max       mean     stddev outliers
+ *    chdir                100000       1556       2488       5237    1658767       2658        719      477
+ *    fchdir               100000       2017       3490       6632     759809       3650        865      410
  *
- *    % time ./fchdir_bench 1000000 f
- *    Done. Performed 1000000 fchdir operations
+ *    (times in ns, including 28ns of clock overhead)
  *
- *    real  0m2.997s
- *    user  0m0.168s
- *    sys 0m2.772s
- *
- * As can be seen, performing the `fchdir(2)` calls is faster and the difference
- * increases as the number of operation rises. This happens since we do not need
- * to get the current working directory on every operation and also because
+ * The `fchdir(2)` version would be expected to be faster, since we do not need to
+ * get the current working directory on every operation and also because
  * manipulating number identifiers (file descriptors) is faster than doing so with
- * strings.
+ * strings. On a recent kernel it is not, though: getcwd(3) is a single system
+ * call, answered from the cache of directory entries, which with a short path
+ * costs less than the open(2) and close(2) calls the descriptor takes.
  *
  * Author: Renato Mascarenhas Costa
  */
@@ -59,46 +54,54 @@
 #include <stdlib.h>
 #include <string.h>
 
-enum { CHDIR, FCHDIR };
+#include "../lib/bench.h"
+
+#define DEFAULT_ITERATIONS (100000)
 
 static void helpAndLeave(const char *progname, int status);
 static void pexit(const char *fCall);
 
-static void chdirOperation();
-static void fchdirOperation();
+static void chdirOperation(void *arg);
+static void fchdirOperation(void *arg);
 
 int
 main(int argc, char *argv[]) {
-  if (argc != 3) {
-    helpAndLeave(argv[0], EXIT_FAILURE);
-  }
+  struct bench bench;
+  int opt;
 
-  long numops;
-  int syscall, i;
-  char *endptr;
+  benchInit(&bench, DEFAULT_ITERATIONS);
 
-  numops = strtol(argv[1], &endptr, 10);
-  if (numops == 0 || numops == LONG_MIN || numops == LONG_MAX) {
-    helpAndLeave(argv[0], EXIT_FAILURE);
+  while ((opt = getopt(argc, argv, BENCH_OPTIONS "h")) != -1) {
+    if (opt == 'h') {
+      helpAndLeave(argv[0], EXIT_SUCCESS);
+    }
+
+    if (benchOption(&bench, opt, optarg) == -1) {
+      helpAndLeave(argv[0], EXIT_FAILURE);
+    }
   }
 
-  if (!strncmp(argv[2], "c", 2)) {
-    syscall = CHDIR;
-  } else if (!strncmp(argv[2], "f", 2)) {
-    syscall = FCHDIR;
-  } else {
+  if (argc > optind + 1) {
     helpAndLeave(argv[0], EXIT_FAILURE);
   }
 
-  for (i = 0; i < numops; ++i) {
-    if (syscall == CHDIR) {
-      chdirOperation();
-    } else {
-      fchdirOperation();
+  if (argc == optind || !strncmp(argv[optind], "c", 2)) {
+    if (benchRun(&bench, "chdir", chdirOperation, NULL) == -1) {
+      pexit("benchRun");
+    }
+  }
+
+  if (argc == optind || !strncmp(argv[optind], "f", 2)) {
+    if (benchRun(&bench, "fchdir", fchdirOperation, NULL) == -1) {
+      pexit("benchRun");
     }
   }
 
-  printf("Done. Performed %ld %s operations\n", numops, syscall == CHDIR ? "chdir" : "fchdir");
+  if (bench.count == 0) {
+    helpAndLeave(argv[0], EXIT_FAILURE);
+  }
+
+  benchReport(&bench);
 
   exit(EXIT_SUCCESS);
 }
@@ -111,7 +114,7 @@ helpAndLeave(const char *progname, int status) {
     stream = stdout;
   }
 
-  fprintf(stream, "Usage: %s <numops> <syscall>\n", progname);
+  fprintf(stream, "Usage: %s " BENCH_USAGE " [syscall]\n", progname);
   exit(status);
 }
 
@@ -122,7 +125,7 @@ pexit(const char *fCall) {
 }
 
 static void
-chdirOperation() {
+chdirOperation(__attribute__((unused)) void *arg) {
   char cwd[PATH_MAX];
 
   /* get current working directory */
@@ -148,7 +151,7 @@ chdirOperation() {
 }
 
 static void
-fchdirOperation() {
+fchdirOperation(__attribute__((unused)) void *arg) {
   int fd;
 
   /* get current working directory */
@@ -7,11 +7,56 @@
  * same directory. The only difference is that the custom `nftw` function is used
  * here. Refer to that file for more info and usage examples.
  *
+ * Two implementations are provided. `_nftw` reads directories with readdir_r(3),
+ * stats every file through its full path and, when it runs out of descriptors,
+ * reads a directory again from the start to get back to where it was. `_nftwFast`
+ * (used with the -f flag) instead:
+ *
+ *    - keeps a descriptor for each directory being traversed, and opens and stats
+ *      its entries relative to it, with openat(2) and statx(2);
+ *    - reads entries with getdents64(2), in large batches;
+ *    - when more directories are open than `nopenfd` allows, reads what is left of
+ *      the outermost one into memory and closes it - so no directory is ever read
+ *      twice, and the work is linear in the number of entries;
+ *    - when following symbolic links, remembers the directories visited (by device
+ *      and inode, in a hash table), and does not visit them again: like nftw(3),
+ *      which also saves it from looping forever on links to a parent directory;
+ *    - skips stat(2) altogether when the type of a file is all the caller needs:
+ *      with the FTW_TYPEONLY flag (an extension), files whose type is told by
+ *      their directory entry are not stat'ed when not following symbolic links
+ *      (FTW_PHYS), or when they are not symbolic links; and only the type and mode
+ *      are asked for from statx(2) in every other case. The `stat` structure given
+ *      to the function then only has `st_mode` (and `st_dev`, `st_ino`, for
+ *      directories) set;
+ *    - takes a filter, called with the name and the type (`d_type`) of every
+ *      entry as soon as it is read, before anything else is done with it: when
+ *      it returns FTW_SKIP_SUBTREE, the entry is left out, and the function is
+ *      not called for it - a directory left out is not stat'ed, opened or read,
+ *      so it costs no system calls at all. The filter may also return
+ *      FTW_SKIP_SIBLINGS (the entries left in the directory are left out too),
+ *      FTW_STOP (the traversal ends, returning FTW_STOP) or FTW_CONTINUE;
+ *    - honours FTW_ACTIONRETVAL, as nftw(3) does: the function then returns
+ *      FTW_CONTINUE, FTW_SKIP_SUBTREE (for FTW_D, the directory is not read),
+ *      FTW_SKIP_SIBLINGS (the entries left in the parent directory are not
+ *      handled; for FTW_D, the directory is not read either) or FTW_STOP.
+ *
+ * Usage
+ *
+ *    $ ./nftw [-n] [-f] [-x name]... [-l level] [<directory>]
+ *
+ *    -n - do not follow symbolic links (default is to follow)
+ *    -f - use `_nftwFast`
+ *    -x - leave out the files and directories called `name` (such as .git or
+ *         node_modules), without stat'ing them. Implies -f
+ *    -l - do not read directories deeper than `level` (the directory given is at
+ *         level 0). Implies -f
+ *
+ *    $ ./nftw -x .git -x node_modules ~/src
+ *
  * Author: Renato Mascarenhas Costa
  */
 
-#define _XOPEN_SOURCE 500
-#define _BSD_SOURCE
+#define _GNU_SOURCE /* nftw(3), and statx(2) */
 
 #include <limits.h>
 
@@ -31,17 +76,26 @@
 #include <stdlib.h>
 #include <string.h>
 #include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 
 #ifndef DIRSTATS_NOPENFD
 #  define DIRSTATS_NOPENFD (100)
 #endif
 
+/* `_nftwFast` extension: the function only looks at the file type (see above) */
+#define FTW_TYPEONLY (1 << 8)
+
+#define DENTS_BUF_SIZ (32 * 1024) /* bytes of directory entries read at a time */
+
+#define MAX_EXCLUDES (64) /* names given with -x */
+
 typedef enum { FALSE, TRUE } Bool;
 
 static void helpAndLeave(const char *progname, int status);
 static void pexit(const char *fCall);
 
-static int getStats(const char *dir, const int flags);
+static int getStats(const char *dir, const int flags, Bool fast);
 static void printStats(const char *dir);
 
 static int _nftw(const char *dirpath,
@@ -49,6 +103,12 @@ static int _nftw(const char *dirpath,
                int typeflag, struct FTW *ftwbuf),
     int nopenfd, int flags);
 
+static int _nftwFast(const char *dirpath,
+    int (*fn) (const char *fpath, const struct stat *sb,
+               int typeflag, struct FTW *ftwbuf),
+    int (*filter) (const char *name, unsigned char type, int level),
+    int nopenfd, int flags);
+
 struct file_count {
   size_t reg, dir, chr, blk, fifo, lnk, sock;
   size_t unreadDir, unreadFile;
@@ -66,23 +126,47 @@ struct file_count fstats = {
   .sock = 0
 };
 
+/* names left out with -x, and the deepest level read with -l (-1 for all) */
+static const char *excludes[MAX_EXCLUDES];
+static int numExcludes = 0;
+static int maxLevel = -1;
+
 int
 main(int argc, char *argv[]) {
-  if (argc > 3) {
-    helpAndLeave(argv[0], EXIT_FAILURE);
-  }
-
-  char *dir;
+  char *dir, *endp;
   int flags, opt;
+  Bool fast = FALSE;
 
   flags = 0;
-  while ((opt = getopt(argc, argv, "n")) != -1) {
+  while ((opt = getopt(argc, argv, "nfx:l:")) != -1) {
     switch (opt) {
       case 'n': flags |= FTW_PHYS;                   break;
+      case 'f': fast = TRUE;                         break;
+
+      case 'x':
+        if (numExcludes == MAX_EXCLUDES) {
+          helpAndLeave(argv[0], EXIT_FAILURE);
+        }
+        excludes[numExcludes++] = optarg;
+        fast = TRUE;
+        break;
+
+      case 'l':
+        maxLevel = strtol(optarg, &endp, 10);
+        if (*endp != '\0' || maxLevel < 0) {
+          helpAndLeave(argv[0], EXIT_FAILURE);
+        }
+        fast = TRUE;
+        break;
+
       default:  helpAndLeave(argv[0], EXIT_FAILURE); break;
     }
   }
 
+  if (argc > optind + 1) {
+    helpAndLeave(argv[0], EXIT_FAILURE);
+  }
+
   if (argv[optind]) {
     dir = argv[optind];
   } else {
@@ -90,7 +174,7 @@ main(int argc, char *argv[]) {
   }
 
   printf("Scanning files...\n");
-  if (getStats(dir, flags) == -1) {
+  if (getStats(dir, flags, fast) == -1) {
     pexit("getStats");
   }
 
@@ -107,7 +191,7 @@ helpAndLeave(const char *progname, int status) {
     stream = stdout;
   }
 
-  fprintf(stream, "Usage: %s [-n] [<directory>]\n", progname);
+  fprintf(stream, "Usage: %s [-n] [-f] [-x name]... [-l level] [<directory>]\n", progname);
   exit(status);
 }
 
@@ -166,12 +250,44 @@ analyzeFile(const char *pathname, const struct stat *sbuf, int type, struct FTW
       return -1;
   }
 
-  return 0;
+  /* counted, but not read */
+  if (type == FTW_D && maxLevel != -1 && ftwb->level >= maxLevel) {
+    return FTW_SKIP_SUBTREE;
+  }
+
+  return FTW_CONTINUE;
 }
 
+/* filter given to `_nftwFast`: leaves out the names given with -x */
 static int
-getStats(const char *dir, const int flags) {
-  if (_nftw(dir, analyzeFile, DIRSTATS_NOPENFD, flags) == -1) {
+excludeEntry(const char *name, unsigned char type, int level) {
+  int i;
+
+  (void) type;
+  (void) level;
+
+  for (i = 0; i < numExcludes; ++i) {
+    if (strcmp(name, excludes[i]) == 0) {
+      return FTW_SKIP_SUBTREE;
+    }
+  }
+
+  return FTW_CONTINUE;
+}
+
+static int
+getStats(const char *dir, const int flags, Bool fast) {
+  int status;
+
+  /* `analyzeFile` only looks at the type of files */
+  if (fast) {
+    status = _nftwFast(dir, analyzeFile, (numExcludes > 0) ? excludeEntry : NULL,
+                       DIRSTATS_NOPENFD, flags | FTW_TYPEONLY | FTW_ACTIONRETVAL);
+  } else {
+    status = _nftw(dir, analyzeFile, DIRSTATS_NOPENFD, flags);
+  }
+
+  if (status == -1) {
     return -1;
   }
 
@@ -408,3 +524,577 @@ _nftw(const char *dirpath,
 
   return status;
 }
+
+/* as returned by getdents64(2), which glibc does not declare */
+struct linux_dirent64 {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/* a directory being traversed by `_nftwFast` */
+struct ftw_level {
+  int fd;            /* -1 once closed - its entries left are all in `buf`, then */
+  char *buf;         /* entries read, from `pos` up to `len` not handled yet */
+  size_t size, len, pos;
+  Bool eof;
+  size_t pathLen;    /* length of the path of the directory */
+  int base;
+  struct stat sb;
+};
+
+/* a directory visited, as a slot of the `seen` hash table - empty if `ino` is 0 */
+struct ftw_object {
+  dev_t dev;
+  ino_t ino;
+};
+
+struct ftw_walk {
+  struct ftw_level *levels;
+  int depth, capacity; /* levels in use, and allocated */
+  int openCount, firstOpen; /* descriptors open, and the outermost level still open */
+  int startFd;       /* the working directory at the start; paths are relative to it */
+  int cwdLevel;      /* with FTW_CHDIR: the level that is the working directory */
+  char path[PATH_MAX];
+  int flags, nopenfd;
+  dev_t dev;
+
+  /* directories visited, when following symbolic links */
+  struct ftw_object *seen;
+  size_t seenSize, seenCount;
+};
+
+/* reads the next batch of entries of a directory. Returns -1 on errors */
+static int
+readBatch(struct ftw_level *l) {
+  long numRead;
+
+  if (l->eof) {
+    return 0;
+  }
+
+  numRead = syscall(SYS_getdents64, l->fd, l->buf, l->size);
+  if (numRead == -1) {
+    return -1;
+  }
+
+  l->len = numRead;
+  l->pos = 0;
+  l->eof = (numRead == 0);
+  return 0;
+}
+
+/* reads all the entries left of the outermost directory still open into memory,
+ * so that its descriptor can be closed */
+static int
+closeOutermost(struct ftw_walk *w) {
+  struct ftw_level *l = &w->levels[w->firstOpen];
+  long numRead;
+  char *buf;
+
+  memmove(l->buf, l->buf + l->pos, l->len - l->pos);
+  l->len -= l->pos;
+  l->pos = 0;
+
+  while (!l->eof) {
+    if (l->size - l->len < DENTS_BUF_SIZ) {
+      buf = realloc(l->buf, 2 * l->size);
+      if (buf == NULL) {
+        return -1;
+      }
+      l->buf = buf;
+      l->size *= 2;
+    }
+
+    numRead = syscall(SYS_getdents64, l->fd, l->buf + l->len, l->size - l->len);
+    if (numRead == -1) {
+      return -1;
+    }
+
+    l->len += numRead;
+    l->eof = (numRead == 0);
+  }
+
+  close(l->fd);
+  l->fd = -1;
+  --w->openCount;
+  ++w->firstOpen;
+  return 0;
+}
+
+/* the descriptor files in the directory at `level` are opened relative to, and the
+ * name they are to be opened with */
+static int
+dirFdOf(struct ftw_walk *w, int level, const char *name, const char **pathname) {
+  if (w->levels[level].fd != -1) {
+    *pathname = name;
+    return w->levels[level].fd;
+  }
+
+  *pathname = w->path;
+  return w->startFd;
+}
+
+/* stats a file, asking only for what is needed. Returns -1 on errors */
+static int
+statEntry(struct ftw_walk *w, int dirfd, const char *name, struct stat *sb) {
+  struct statx stx;
+  unsigned int mask;
+  int flags;
+
+  flags = (w->flags & FTW_PHYS) ? AT_SYMLINK_NOFOLLOW : 0;
+  mask = (w->flags & FTW_TYPEONLY) ? (STATX_TYPE | STATX_MODE | STATX_INO) : STATX_BASIC_STATS;
+
+  if (statx(dirfd, name, flags, mask, &stx) == -1) {
+    return -1;
+  }
+
+  memset(sb, 0, sizeof(struct stat));
+  sb->st_mode = stx.stx_mode;
+  sb->st_ino = stx.stx_ino;
+  sb->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+  sb->st_nlink = stx.stx_nlink;
+  sb->st_uid = stx.stx_uid;
+  sb->st_gid = stx.stx_gid;
+  sb->st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+  sb->st_size = stx.stx_size;
+  sb->st_blksize = stx.stx_blksize;
+  sb->st_blocks = stx.stx_blocks;
+  sb->st_atim.tv_sec = stx.stx_atime.tv_sec;
+  sb->st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+  sb->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+  sb->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+  sb->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+  sb->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+
+  return 0;
+}
+
+/* the file type told by a directory entry, as in `st_mode`, or 0 if unknown */
+static mode_t
+typeOfEntry(unsigned char type) {
+  switch (type) {
+    case DT_REG:  return S_IFREG;
+    case DT_DIR:  return S_IFDIR;
+    case DT_CHR:  return S_IFCHR;
+    case DT_BLK:  return S_IFBLK;
+    case DT_LNK:  return S_IFLNK;
+    case DT_FIFO: return S_IFIFO;
+    case DT_SOCK: return S_IFSOCK;
+    default:      return 0;
+  }
+}
+
+/* starts traversing the directory `name`, whose stat information is `sb`, inside
+ * the current deepest level (or the starting directory). `w->path` must hold its
+ * path already. Returns -1 on errors, or FTW_DNR if it could not be read */
+static int
+pushLevel(struct ftw_walk *w, const char *name, const struct stat *sb, int base) {
+  struct ftw_level *l, *levels;
+  const char *pathname;
+  int dirfd, fd, oflags;
+
+  oflags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+  if (w->flags & FTW_PHYS) {
+    oflags |= O_NOFOLLOW;
+  }
+
+  dirfd = (w->depth == 0) ? w->startFd : dirFdOf(w, w->depth - 1, name, &pathname);
+  if (w->depth == 0) {
+    pathname = w->path;
+  }
+
+  fd = openat(dirfd, pathname, oflags);
+  if (fd == -1) {
+    return (errno == EACCES) ? FTW_DNR : -1;
+  }
+
+  if (w->depth == w->capacity) {
+    levels = realloc(w->levels, 2 * w->capacity * sizeof(struct ftw_level));
+    if (levels == NULL) {
+      close(fd);
+      return -1;
+    }
+    memset(levels + w->capacity, 0, w->capacity * sizeof(struct ftw_level));
+    w->levels = levels;
+    w->capacity *= 2;
+  }
+
+  l = &w->levels[w->depth++];
+  if (l->buf == NULL) {
+    l->buf = malloc(DENTS_BUF_SIZ);
+    l->size = DENTS_BUF_SIZ;
+    if (l->buf == NULL) {
+      close(fd);
+      return -1;
+    }
+  }
+
+  l->fd = fd;
+  l->len = l->pos = 0;
+  l->eof = FALSE;
+  l->pathLen = strlen(w->path);
+  l->base = base;
+  l->sb = *sb;
+
+  if (++w->openCount > w->nopenfd && closeOutermost(w) == -1) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/* records a directory as visited. Returns whether it was not visited before, or -1
+ * on errors */
+static int
+markSeen(struct ftw_walk *w, const struct stat *sb) {
+  struct ftw_object *seen, *o;
+  size_t i, size;
+
+  if (2 * (w->seenCount + 1) > w->seenSize) {
+    size = (w->seenSize == 0) ? 1024 : 2 * w->seenSize;
+    seen = calloc(size, sizeof(struct ftw_object));
+    if (seen == NULL) {
+      return -1;
+    }
+
+    for (i = 0; i < w->seenSize; ++i) {
+      if (w->seen[i].ino != 0) {
+        o = &seen[(w->seen[i].ino * 2654435761u + w->seen[i].dev) & (size - 1)];
+        while (o->ino != 0) {
+          o = (o == &seen[size - 1]) ? seen : o + 1;
+        }
+        *o = w->seen[i];
+      }
+    }
+
+    free(w->seen);
+    w->seen = seen;
+    w->seenSize = size;
+  }
+
+  o = &w->seen[(sb->st_ino * 2654435761u + sb->st_dev) & (w->seenSize - 1)];
+  while (o->ino != 0) {
+    if (o->ino == sb->st_ino && o->dev == sb->st_dev) {
+      return 0;
+    }
+    o = (o == &w->seen[w->seenSize - 1]) ? w->seen : o + 1;
+  }
+
+  o->dev = sb->st_dev;
+  o->ino = sb->st_ino;
+  ++w->seenCount;
+  return 1;
+}
+
+/* with FTW_CHDIR, makes the directory at `level` (the starting directory, if -1)
+ * the working directory */
+static int
+changeDir(struct ftw_walk *w, int level) {
+  struct ftw_level *l;
+  char saved;
+  int status;
+
+  if (!(w->flags & FTW_CHDIR) || w->cwdLevel == level) {
+    return 0;
+  }
+
+  if (level == -1 || w->levels[level].fd == -1) {
+    if (fchdir(w->startFd) == -1) {
+      return -1;
+    }
+  }
+
+  if (level != -1) {
+    l = &w->levels[level];
+
+    if (l->fd != -1) {
+      status = fchdir(l->fd);
+    } else {
+      saved = w->path[l->pathLen];
+      w->path[l->pathLen] = '\0';
+      status = chdir(w->path);
+      w->path[l->pathLen] = saved;
+    }
+
+    if (status == -1) {
+      return -1;
+    }
+  }
+
+  w->cwdLevel = level;
+  return 0;
+}
+
+/* leaves the entries not handled yet in the directory at `level` out */
+static void
+skipRest(struct ftw_walk *w, int level) {
+  struct ftw_level *l = &w->levels[level];
+
+  l->pos = l->len;
+  l->eof = TRUE;
+}
+
+/* calls the function for a file. With FTW_ACTIONRETVAL, acts on what it returned,
+ * and returns 0 to go on, or what it returned to stop; otherwise returns what it
+ * returned as is */
+static int
+callFn(struct ftw_walk *w,
+    int (*fn) (const char *fpath, const struct stat *sb,
+               int typeflag, struct FTW *ftwbuf),
+    const struct stat *sb, int type, struct FTW *ftwbuf) {
+  int status, level, i;
+
+  status = fn(w->path, sb, type, ftwbuf);
+  if (!(w->flags & FTW_ACTIONRETVAL)) {
+    return status;
+  }
+
+  /* the directory the file is in (-1 for the starting point) */
+  level = ftwbuf->level - 1;
+
+  switch (status) {
+    case FTW_CONTINUE:
+      return 0;
+
+    case FTW_SKIP_SUBTREE:
+      /* only a directory just entered is deeper than its parent */
+      if (w->depth > level + 1) {
+        skipRest(w, level + 1);
+      }
+      return 0;
+
+    case FTW_SKIP_SIBLINGS:
+      for (i = (level < 0) ? 0 : level; i < w->depth; ++i) {
+        skipRest(w, i);
+      }
+      return 0;
+
+    default:
+      return status;
+  }
+}
+
+/* starts the traversal of a directory, calling the function for it first, unless
+ * FTW_DEPTH was given. Returns what the function returned (0 for going on), or -1
+ * on errors */
+static int
+enterDir(struct ftw_walk *w,
+    int (*fn) (const char *fpath, const struct stat *sb,
+               int typeflag, struct FTW *ftwbuf),
+    const char *name, const struct stat *sb, struct FTW *ftwbuf) {
+  int status;
+
+  if (!(w->flags & FTW_PHYS)) {
+    status = markSeen(w, sb);
+    if (status != 1) {
+      /* visited already */
+      return status;
+    }
+  }
+
+  status = pushLevel(w, name, sb, ftwbuf->base);
+  if (status == -1) {
+    return -1;
+  }
+
+  if (status == FTW_DNR) {
+    return callFn(w, fn, sb, FTW_DNR, ftwbuf);
+  }
+
+  if (!(w->flags & FTW_DEPTH)) {
+    return callFn(w, fn, sb, FTW_D, ftwbuf);
+  }
+
+  return 0;
+}
+
+static int
+_nftwFast(const char *dirpath,
+    int (*fn) (const char *fpath, const struct stat *sb,
+               int typeflag, struct FTW *ftwbuf),
+    int (*filter) (const char *name, unsigned char type, int level),
+    int nopenfd, int flags) {
+
+  struct ftw_walk w;
+  struct ftw_level *l;
+  struct linux_dirent64 *e;
+  struct stat sb;
+  struct FTW ftwbuf;
+  const char *slash, *pathname;
+  size_t nameLen, pathLen;
+  int status = 0, d, dirfd, i, action;
+  Bool needStat;
+  mode_t mode;
+
+  memset(&w, 0, sizeof(struct ftw_walk));
+  w.flags = flags;
+  w.nopenfd = (nopenfd < 1) ? 1 : nopenfd;
+  w.cwdLevel = -1;
+
+  if (strlen(dirpath) >= PATH_MAX) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  w.startFd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (w.startFd == -1) {
+    return -1;
+  }
+
+  w.capacity = 16;
+  w.levels = calloc(w.capacity, sizeof(struct ftw_level));
+  if (w.levels == NULL) {
+    close(w.startFd);
+    return -1;
+  }
+
+  strcpy(w.path, dirpath);
+  slash = strrchr(dirpath, '/');
+  ftwbuf.base = (slash == NULL || slash[1] == '\0') ? 0 : slash - dirpath + 1;
+  ftwbuf.level = 0;
+
+  /* the starting point itself */
+  if (fstatat(w.startFd, w.path, &sb, (flags & FTW_PHYS) ? AT_SYMLINK_NOFOLLOW : 0) == -1) {
+    status = callFn(&w, fn, &sb, FTW_NS, &ftwbuf);
+    goto done;
+  }
+
+  w.dev = sb.st_dev;
+  if (!S_ISDIR(sb.st_mode)) {
+    status = callFn(&w, fn, &sb, S_ISLNK(sb.st_mode) ? FTW_SL : FTW_F, &ftwbuf);
+    goto done;
+  }
+
+  status = enterDir(&w, fn, w.path, &sb, &ftwbuf);
+
+  while (status == 0 && w.depth > 0) {
+    d = w.depth - 1;
+    l = &w.levels[d];
+
+    if (l->pos >= l->len && l->fd != -1 && readBatch(l) == -1) {
+      status = -1;
+      break;
+    }
+
+    /* all entries of the directory were handled: leave it */
+    if (l->pos >= l->len) {
+      w.path[l->pathLen] = '\0';
+      if (l->fd != -1) {
+        close(l->fd);
+        l->fd = -1;
+        --w.openCount;
+      }
+
+      --w.depth;
+      if (w.firstOpen > w.depth) {
+        w.firstOpen = w.depth;
+      }
+
+      if (flags & FTW_DEPTH) {
+        ftwbuf.base = l->base;
+        ftwbuf.level = d;
+
+        if (changeDir(&w, d - 1) == -1) {
+          status = -1;
+          break;
+        }
+        status = callFn(&w, fn, &l->sb, FTW_DP, &ftwbuf);
+      }
+      continue;
+    }
+
+    e = (struct linux_dirent64 *) (l->buf + l->pos);
+    l->pos += e->d_reclen;
+
+    /* do not handle . and .. entries */
+    if (e->d_name[0] == '.' && (e->d_name[1] == '\0' || (e->d_name[1] == '.' && e->d_name[2] == '\0'))) {
+      continue;
+    }
+
+    /* left out before anything is done with it */
+    if (filter != NULL && (action = filter(e->d_name, e->d_type, d + 1)) != FTW_CONTINUE) {
+      if (action == FTW_SKIP_SIBLINGS) {
+        skipRest(&w, d);
+      } else if (action != FTW_SKIP_SUBTREE) {
+        status = action;
+      }
+      continue;
+    }
+
+    /* the path of the entry */
+    pathLen = l->pathLen;
+    if (pathLen > 0 && w.path[pathLen - 1] != '/') {
+      w.path[pathLen++] = '/';
+    }
+
+    nameLen = strlen(e->d_name);
+    if (pathLen + nameLen >= PATH_MAX) {
+      errno = ENAMETOOLONG;
+      status = -1;
+      break;
+    }
+
+    memcpy(w.path + pathLen, e->d_name, nameLen + 1);
+    ftwbuf.base = pathLen;
+    ftwbuf.level = d + 1;
+
+    if (changeDir(&w, d) == -1) {
+      status = -1;
+      break;
+    }
+
+    /* the type in the entry is enough, unless more than the type is needed, or
+     * symbolic links are followed (directories are then told apart by inode) */
+    mode = typeOfEntry(e->d_type);
+    needStat = !(flags & FTW_TYPEONLY) || (flags & FTW_MOUNT) || mode == 0 ||
+               ((mode == S_IFLNK || mode == S_IFDIR) && !(flags & FTW_PHYS));
+
+    if (needStat) {
+      dirfd = dirFdOf(&w, d, e->d_name, &pathname);
+      if (statEntry(&w, dirfd, pathname, &sb) == -1) {
+        /* symbolic links to files that do not exist are given as such, like in nftw(3) */
+        if (!(flags & FTW_PHYS) && errno == ENOENT && (mode == 0 || mode == S_IFLNK) &&
+            fstatat(dirfd, pathname, &sb, AT_SYMLINK_NOFOLLOW) == 0 && S_ISLNK(sb.st_mode)) {
+          status = callFn(&w, fn, &sb, FTW_SLN, &ftwbuf);
+        } else {
+          status = callFn(&w, fn, NULL, (mode == S_IFDIR) ? FTW_DNR : FTW_NS, &ftwbuf);
+        }
+        continue;
+      }
+
+      /* do not cross mount points if FTW_MOUNT was passed */
+      if ((flags & FTW_MOUNT) && sb.st_dev != w.dev) {
+        continue;
+      }
+    } else {
+      memset(&sb, 0, sizeof(struct stat));
+      sb.st_mode = mode;
+    }
+
+    if (S_ISDIR(sb.st_mode)) {
+      status = enterDir(&w, fn, e->d_name, &sb, &ftwbuf);
+    } else {
+      status = callFn(&w, fn, &sb, S_ISLNK(sb.st_mode) ? FTW_SL : FTW_F, &ftwbuf);
+    }
+  }
+
+done:
+  for (i = 0; i < w.capacity; ++i) {
+    if (i < w.depth && w.levels[i].fd != -1) {
+      close(w.levels[i].fd);
+    }
+    free(w.levels[i].buf);
+  }
+  free(w.levels);
+  free(w.seen);
+
+  if ((flags & FTW_CHDIR) && fchdir(w.startFd) == -1) {
+    status = -1;
+  }
+  close(w.startFd);
+
+  return status;
+}
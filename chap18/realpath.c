@@ -6,14 +6,38 @@
  *
  * Usage
  *
- *    $ ./realpath <path>
+ *    $ ./realpath [-s] [-t ttl] [path...]
  *
- *    <name> - the path to be expanded.
+ *    <path> - the paths to be expanded. If none is given, they are read from
+ *    the standard input, one per line.
+ *    -s: print to stderr how many of the lookups were answered from the cache
+ *    (not counted with -t 0).
+ *    -t: the number of seconds cached lookups are trusted for (default: -1,
+ *    for as long as the program runs; 0 disables the cache).
+ *
+ * Paths are resolved with a resolver context (`struct resolver`), which
+ * remembers what every component it looked up turned out to be - a directory,
+ * some other file, or a symbolic link and its target - keyed by its canonical
+ * path. Paths sharing prefixes with ones seen before (as in `/usr/lib/x/a` and
+ * `/usr/lib/x/b`) are then resolved without any lstat(2) or readlink(2) for the
+ * shared part, and links are read once no matter how many paths go through them.
+ * Lookups that failed (say, with ENOENT) are remembered as well.
+ *
+ * What is cached can go stale if the file system changes. Entries are trusted
+ * for `ttl` seconds, and looked up again after that; `resolverInvalidate` drops
+ * what is known of a path and of everything under it, for callers that know
+ * what changed. The cache is emptied when it grows past RESOLVER_MAX_ENTRIES.
+ *
+ * `resolverResolveBatch` resolves a number of paths at once, which also asks
+ * for the current working directory only once for all the relative ones.
+ *
+ * `_realpath` itself resolves a single path with a context that caches nothing,
+ * which is what is used with `-t 0`.
  *
  * Author: Renato Mascarenhas Costa
  */
 
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 700
 
 #include <limits.h>
 
@@ -24,8 +48,8 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <fcntl.h>
 #include <errno.h>
+#include <time.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,28 +60,145 @@
 #  define REALPATH_PATH_SEPARATOR_CSTR ("/")
 #endif
 
+#define RESOLVER_MAX_LINKS (40)            /* links followed before giving up with ELOOP */
+#define RESOLVER_INITIAL_CAPACITY (1024)
+#define RESOLVER_MAX_ENTRIES (1024 * 1024)
+#define BATCH_SIZ (1024)                   /* paths read from stdin resolved at a time */
+
+/* what is known of a path: its canonical directory, plus one more component */
+struct resolverEntry {
+  char *path;   /* NULL if the slot is free */
+  int error;    /* errno of its lookup, 0 if it succeeded */
+  mode_t type;  /* the S_IFMT bits of its lstat(2) */
+  char *target; /* the contents of the link, if the type is S_IFLNK */
+  time_t stamp; /* when it was looked up */
+};
+
+struct resolverStats {
+  unsigned long lookups;   /* of components */
+  unsigned long hits;      /* lookups answered from the cache */
+  unsigned long lstats;
+  unsigned long readlinks;
+};
+
+struct resolver {
+  struct resolverEntry *entries; /* open addressing hash table */
+  size_t capacity, count;
+  int ttl;                       /* seconds entries are trusted for; negative for ever, 0 for no caching */
+  struct resolverEntry scratch;  /* the lookup, when not caching */
+  const char *cwd;               /* the working directory, if known */
+  struct resolverStats stats;
+};
+
 static char *_realpath(const char *path, char *resolved_path);
 
+/* initializes a resolver context, trusting what it looks up for `ttl` seconds.
+ * Returns -1 on errors */
+static int resolverInit(struct resolver *r, int ttl);
+
+/* releases everything cached by a resolver context */
+static void resolverFree(struct resolver *r);
+
+/* forgets what is known of the canonical `path`, and of everything under it.
+ * The whole cache is emptied if `path` is NULL */
+static int resolverInvalidate(struct resolver *r, const char *path);
+
+/* resolves `path` to the canonical path in `resolved_path` (of PATH_MAX bytes,
+ * or allocated if NULL), as realpath(3) */
+static char *resolverResolve(struct resolver *r, const char *path, char *resolved_path);
+
+/* resolves `n` paths, storing each canonical path, allocated, in `resolved` -
+ * or NULL, along with an errno in `errors`, for those that failed. Returns the
+ * number of paths resolved, or -1 if none could be */
+static int resolverResolveBatch(struct resolver *r, char *const *paths, size_t n, char **resolved, int *errors);
+
 static void helpAndLeave(const char *progname, int status);
 static void pexit(const char *fCall);
 
 int
 main(int argc, char *argv[]) {
-  if (argc != 2) {
-    helpAndLeave(argv[0], EXIT_FAILURE);
+  struct resolver r;
+  char *lines[BATCH_SIZ], *resolved[BATCH_SIZ], *line = NULL;
+  int errors[BATCH_SIZ], opt, fromArgs, stats = 0, ttl = -1, status = EXIT_SUCCESS;
+  size_t n, i, lineSiz = 0;
+  ssize_t len;
+
+  while ((opt = getopt(argc, argv, "st:h")) != -1) {
+    switch (opt) {
+      case 's': stats = 1; break;
+      case 't': ttl = atoi(optarg); break;
+      case 'h': helpAndLeave(argv[0], EXIT_SUCCESS); break;
+      default: helpAndLeave(argv[0], EXIT_FAILURE);
+    }
   }
 
-  char *resolved_path = _realpath(argv[1], NULL);
+  if (resolverInit(&r, ttl) == -1) {
+    pexit("resolverInit");
+  }
 
-  if (resolved_path == NULL) {
-    pexit("_realpath");
+  fromArgs = optind < argc;
+
+  /* paths given as arguments are resolved as a single batch; those read from
+   * stdin, BATCH_SIZ at a time */
+  for (;;) {
+    n = 0;
+    if (fromArgs) {
+      for (; optind < argc && n < BATCH_SIZ; ++optind) {
+        lines[n++] = strdup(argv[optind]);
+      }
+    } else {
+      while (n < BATCH_SIZ && (len = getline(&line, &lineSiz, stdin)) != -1) {
+        if (len > 0 && line[len - 1] == '\n') {
+          line[len - 1] = '\0';
+        }
+        lines[n++] = strdup(line);
+      }
+    }
+
+    if (n == 0) {
+      break;
+    }
+
+    for (i = 0; i < n; ++i) {
+      if (lines[i] == NULL) {
+        pexit("strdup");
+      }
+    }
+
+    if (ttl == 0) {
+      /* nothing to be shared between the paths */
+      for (i = 0; i < n; ++i) {
+        resolved[i] = _realpath(lines[i], NULL);
+        errors[i] = errno;
+      }
+    } else if (resolverResolveBatch(&r, lines, n, resolved, errors) == -1) {
+      pexit("resolverResolveBatch");
+    }
+
+    for (i = 0; i < n; ++i) {
+      if (resolved[i] == NULL) {
+        fprintf(stderr, "%s: %s: %s\n", argv[0], lines[i], strerror(errors[i]));
+        status = EXIT_FAILURE;
+      } else {
+        printf("%s\n", resolved[i]);
+      }
+
+      free(resolved[i]);
+      free(lines[i]);
+    }
   }
 
-  printf("%s\n", resolved_path);
+  if (stats) {
+    fprintf(stderr, "%lu lookups, %lu cached (%.1f%%): %lu lstat and %lu readlink calls\n",
+            r.stats.lookups, r.stats.hits,
+            r.stats.lookups ? 100.0 * r.stats.hits / r.stats.lookups : 0.0,
+            r.stats.lstats, r.stats.readlinks);
+  }
 
-  free(resolved_path);
+  free(line);
+  resolverFree(&r);
 
-  exit(EXIT_SUCCESS);
+  exit(status);
 }
 
 static void
@@ -68,7 +209,7 @@ helpAndLeave(const char *progname, int status) {
     stream = stdout;
   }
 
-  fprintf(stream, "Usage: %s <path>\n", progname);
+  fprintf(stream, "Usage: %s [-s] [-t ttl] [path...]\n", progname);
   exit(status);
 }
 
@@ -80,121 +221,420 @@ pexit(const char *fCall) {
 
 static char *
 _realpath(const char *path, char *resolved_path) {
+  struct resolver r;
+  char *p;
+
+  if (resolverInit(&r, 0) == -1) {
+    return NULL;
+  }
+
+  p = resolverResolve(&r, path, resolved_path);
+  resolverFree(&r);
+
+  return p;
+}
+
+/* hashes a path (FNV-1a) */
+static size_t
+hashPath(const char *path) {
+  size_t h = 2166136261u;
+
+  for (; *path != '\0'; ++path) {
+    h = (h ^ (unsigned char) *path) * 16777619u;
+  }
+
+  return h;
+}
+
+static time_t
+now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+/* the slot of `path` in the table, or the free one where it would go */
+static struct resolverEntry *
+slotOf(struct resolver *r, const char *path) {
+  size_t i = hashPath(path) & (r->capacity - 1);
+
+  while (r->entries[i].path != NULL && strcmp(r->entries[i].path, path) != 0) {
+    i = (i + 1) & (r->capacity - 1);
+  }
+
+  return &r->entries[i];
+}
+
+static void
+clearEntry(struct resolverEntry *e) {
+  free(e->path);
+  free(e->target);
+  memset(e, 0, sizeof(struct resolverEntry));
+}
+
+/* moves the entries to a table of `capacity` slots, leaving out those whose
+ * path is `prefix`, or is under it */
+static int
+rebuildTable(struct resolver *r, size_t capacity, const char *prefix) {
+  struct resolverEntry *old = r->entries, *e;
+  size_t oldCapacity = r->capacity, i, len = 0;
+
+  r->entries = calloc(capacity, sizeof(struct resolverEntry));
+  if (r->entries == NULL) {
+    r->entries = old;
+    return -1;
+  }
+
+  r->capacity = capacity;
+  r->count = 0;
+
+  if (prefix != NULL) {
+    len = strlen(prefix);
+
+    /* everything is under the root */
+    if (len == 1) {
+      len = 0;
+    }
+  }
+
+  for (i = 0; i < oldCapacity; ++i) {
+    e = &old[i];
+    if (e->path == NULL) {
+      continue;
+    }
+
+    if (prefix != NULL && strncmp(e->path, prefix, len) == 0 &&
+        (e->path[len] == '\0' || e->path[len] == REALPATH_PATH_SEPARATOR)) {
+      clearEntry(e);
+      continue;
+    }
+
+    *slotOf(r, e->path) = *e;
+    ++r->count;
+  }
+
+  free(old);
+  return 0;
+}
+
+static int
+resolverInit(struct resolver *r, int ttl) {
+  memset(r, 0, sizeof(struct resolver));
+  r->ttl = ttl;
+
+  if (ttl != 0) {
+    r->capacity = RESOLVER_INITIAL_CAPACITY;
+    r->entries = calloc(r->capacity, sizeof(struct resolverEntry));
+    if (r->entries == NULL) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static void
+resolverFree(struct resolver *r) {
+  size_t i;
+
+  for (i = 0; i < r->capacity; ++i) {
+    clearEntry(&r->entries[i]);
+  }
+
+  clearEntry(&r->scratch);
+  free(r->entries);
+  r->entries = NULL;
+  r->capacity = r->count = 0;
+}
+
+static int
+resolverInvalidate(struct resolver *r, const char *path) {
+  size_t i;
+
+  if (r->capacity == 0) {
+    return 0;
+  }
+
+  if (path == NULL) {
+    for (i = 0; i < r->capacity; ++i) {
+      clearEntry(&r->entries[i]);
+    }
+
+    r->count = 0;
+    return 0;
+  }
+
+  return rebuildTable(r, r->capacity, path);
+}
+
+/* lstat's and, if it is a link, reads the canonical directory plus one
+ * component `path` into `e` */
+static void
+lookUp(struct resolver *r, const char *path, struct resolverEntry *e) {
+  struct stat sBuf;
+  char buf[PATH_MAX];
+  ssize_t len;
+
+  free(e->target);
+  e->target = NULL;
+  e->error = 0;
+  e->type = 0;
+  e->stamp = (r->ttl > 0) ? now() : 0;
+
+  ++r->stats.lstats;
+  if (lstat(path, &sBuf) == -1) {
+    e->error = errno;
+    return;
+  }
+
+  e->type = sBuf.st_mode & S_IFMT;
+  if (!S_ISLNK(sBuf.st_mode)) {
+    return;
+  }
+
+  ++r->stats.readlinks;
+  len = readlink(path, buf, PATH_MAX);
+  if (len == -1) {
+    e->error = errno;
+    return;
+  }
+
+  if (len == PATH_MAX) {
+    e->error = ENAMETOOLONG;
+    return;
+  }
+
+  e->target = malloc(len + 1);
+  if (e->target == NULL) {
+    e->error = errno;
+    return;
+  }
+
+  memcpy(e->target, buf, len);
+  e->target[len] = '\0';
+}
+
+/* what `path` (a canonical directory, plus one component) is. The entry
+ * returned is valid until the next lookup. Returns NULL on errors */
+static struct resolverEntry *
+component(struct resolver *r, const char *path) {
+  struct resolverEntry *e;
+
+  ++r->stats.lookups;
+
+  if (r->ttl == 0) {
+    lookUp(r, path, &r->scratch);
+    return &r->scratch;
+  }
+
+  e = slotOf(r, path);
+  if (e->path != NULL) {
+    if (r->ttl < 0 || now() - e->stamp < r->ttl) {
+      ++r->stats.hits;
+      return e;
+    }
+
+    /* expired: look it up again, in place */
+    lookUp(r, path, e);
+    return e;
+  }
+
+  if (r->count >= RESOLVER_MAX_ENTRIES) {
+    resolverInvalidate(r, NULL);
+    e = slotOf(r, path);
+  } else if (2 * (r->count + 1) > r->capacity) {
+    if (rebuildTable(r, 2 * r->capacity, NULL) == -1) {
+      return NULL;
+    }
+    e = slotOf(r, path);
+  }
+
+  e->path = strdup(path);
+  if (e->path == NULL) {
+    return NULL;
+  }
+
+  ++r->count;
+  lookUp(r, path, e);
+  return e;
+}
+
+static char *
+resolverResolve(struct resolver *r, const char *path, char *resolved_path) {
+  struct resolverEntry *e;
+  char rest[PATH_MAX], *name, *next, *allocated = NULL;
+  size_t len, nameLen, restLen;
+  int links = 0;
+
   /* sanity checking */
   if (path == NULL) {
     errno = EINVAL;
     return NULL;
   }
 
+  if (*path == '\0') {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  if (strlen(path) >= PATH_MAX) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+
   /* this is a GNU extension to SUSv3: if second argument is null, allocate
    * enough space using `malloc`. It is up to the caller to free the returned
    * buffer, though.
    *
    * This behavior is defined in SUSv4 */
   if (resolved_path == NULL) {
-    resolved_path = malloc(PATH_MAX);
+    resolved_path = allocated = malloc(PATH_MAX);
     if (resolved_path == NULL) {
       return NULL;
     }
   }
 
-  *resolved_path = '\0';
-
   /* if the first character in the given path is a slash, then it the path is
-   * absolute; otherwise it is relative. Note that it is assumed that there is
-   * no leading space in the string - they are not handled by this function and
-   * should be removed by the caller */
-  if (path[0] != REALPATH_PATH_SEPARATOR) {
-    if (getcwd(resolved_path, PATH_MAX) == NULL) {
-      return NULL;
-    }
+   * absolute; otherwise it is relative, to the current working directory.
+   * Note that it is assumed that there is no leading space in the string -
+   * they are not handled by this function and should be removed by the caller */
+  if (path[0] == REALPATH_PATH_SEPARATOR) {
+    strcpy(resolved_path, REALPATH_PATH_SEPARATOR_CSTR);
+  } else if (r->cwd != NULL) {
+    strcpy(resolved_path, r->cwd);
+  } else if (getcwd(resolved_path, PATH_MAX) == NULL) {
+    goto fail;
   }
 
-  struct stat sBuf;
-  char *p, *dir, pathdup[PATH_MAX], buf[PATH_MAX], *saveptr;
-  int len;
+  /* `resolved_path` always holds a canonical path, with no trailing slash
+   * (but for the root); `rest` is what is left to be resolved of the path,
+   * with the targets of the links found spliced in */
+  strcpy(rest, path);
+  len = strlen(resolved_path);
 
-  p = strrchr(resolved_path, REALPATH_PATH_SEPARATOR);
+  for (name = rest; *name != '\0'; name = next) {
+    while (*name == REALPATH_PATH_SEPARATOR) {
+      ++name;
+    }
 
-  /* use a thrown-away copy of the given path that we can manipulate */
-  strncpy(pathdup, path, PATH_MAX);
+    for (next = name; *next != '\0' && *next != REALPATH_PATH_SEPARATOR; ++next)
+      ;
+    nameLen = next - name;
 
-  /* add trailing slash, if it does not exist */
-  len = strlen(pathdup);
+    if (nameLen == 0 || (nameLen == 1 && name[0] == '.')) {
+      continue;
+    }
 
-  if (len > 0 && pathdup[len - 1] != REALPATH_PATH_SEPARATOR) {
-    pathdup[len] = REALPATH_PATH_SEPARATOR;
-    pathdup[len + 1] = '\0';
-  }
+    if (nameLen == 2 && name[0] == '.' && name[1] == '.') {
+      /* go up one level; if there are no more levels to go up, keep at the
+       * root level */
+      while (len > 1 && resolved_path[len - 1] != REALPATH_PATH_SEPARATOR) {
+        --len;
+      }
+      if (len > 1) {
+        --len;
+      }
+      resolved_path[len] = '\0';
+      continue;
+    }
 
-  dir = strtok_r(pathdup, REALPATH_PATH_SEPARATOR_CSTR, &saveptr);
+    if (len + 1 + nameLen >= PATH_MAX) {
+      errno = ENAMETOOLONG;
+      goto fail;
+    }
 
-  while (dir != NULL) {
-    if (strncmp(dir, ".", NAME_MAX)) {
-      if (!strncmp(dir, "..", NAME_MAX)) {
-        /* go up one level */
-        *p = '\0';
-        p = strrchr(resolved_path, REALPATH_PATH_SEPARATOR);
+    if (len > 1) {
+      resolved_path[len++] = REALPATH_PATH_SEPARATOR;
+    }
+    memcpy(resolved_path + len, name, nameLen);
+    resolved_path[len + nameLen] = '\0';
 
-        /* if there are no more levels to go up, keep at the root level */
-        if (p == NULL) {
-          *p = REALPATH_PATH_SEPARATOR;
-        }
+    e = component(r, resolved_path);
+    if (e == NULL) {
+      goto fail;
+    }
 
-      } else {
-        len = strlen(resolved_path);
-        resolved_path[len] = REALPATH_PATH_SEPARATOR;
-        resolved_path[len + 1] = '\0';
+    if (e->error != 0) {
+      errno = e->error;
+      goto fail;
+    }
 
-        strncat(resolved_path, dir, PATH_MAX);
+    if (e->type == S_IFLNK) {
+      if (++links > RESOLVER_MAX_LINKS) {
+        errno = ELOOP;
+        goto fail;
+      }
 
-        if (lstat(resolved_path, &sBuf) == -1) {
-          return NULL;
-        }
+      /* symbolic link locations are calculated related to the path of the
+       * link: the target takes the place of the link in what is left to be
+       * resolved, which starts again from the root if the target is absolute */
+      restLen = strlen(next);
+      nameLen = strlen(e->target);
+      if (nameLen + restLen >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        goto fail;
+      }
 
-        if (S_ISLNK(sBuf.st_mode)) {
-          /* a link was found: just follow it */
-          if (readlink(resolved_path, buf, PATH_MAX) == -1) {
-            return NULL;
-          }
-
-          int fd;
-          fd = open(".", O_RDONLY);
-          if (fd == -1) {
-            return NULL;
-          }
-
-          /* remove the appended dir */
-          p = strrchr(resolved_path, REALPATH_PATH_SEPARATOR);
-          *p = '\0';
-
-          /* symbolic link locations are calculated related to the path of
-           * the link (not to the current process */
-          if (chdir(resolved_path) == -1) {
-            return NULL;
-          }
-
-          /* recursively find the realpath of the link */
-          if (_realpath(buf, resolved_path) == NULL) {
-            return NULL;
-          }
-
-          /* go back to where we were */
-          if (fchdir(fd) == -1) {
-            return NULL;
-          }
-
-          if (close(fd) == -1) {
-            return NULL;
-          }
-        }
+      /* what is left starts with a separator, if anything */
+      memmove(rest + nameLen, next, restLen + 1);
+      memcpy(rest, e->target, nameLen);
+      next = rest;
 
-        p = strrchr(resolved_path, REALPATH_PATH_SEPARATOR);
+      if (e->target[0] == REALPATH_PATH_SEPARATOR) {
+        len = 1;
+      } else if (len > 1) {
+        /* remove the appended component, and its separator */
+        --len;
       }
+      resolved_path[len] = '\0';
+      continue;
     }
 
-    dir = strtok_r(NULL, REALPATH_PATH_SEPARATOR_CSTR, &saveptr);
+    len += nameLen;
+
+    /* only directories can have more components (or a trailing slash) after them */
+    if (e->type != S_IFDIR) {
+      if (*next != '\0') {
+        errno = ENOTDIR;
+        goto fail;
+      }
+    }
   }
 
   return resolved_path;
+
+fail:
+  free(allocated);
+  return NULL;
+}
+
+static int
+resolverResolveBatch(struct resolver *r, char *const *paths, size_t n, char **resolved, int *errors) {
+  char cwd[PATH_MAX];
+  size_t i;
+  int count = 0;
+
+  /* the working directory is the same for all the paths */
+  for (i = 0; i < n && paths[i][0] == REALPATH_PATH_SEPARATOR; ++i)
+    ;
+  if (i < n) {
+    if (getcwd(cwd, PATH_MAX) == NULL) {
+      return -1;
+    }
+    r->cwd = cwd;
+  }
+
+  for (i = 0; i < n; ++i) {
+    resolved[i] = resolverResolve(r, paths[i], NULL);
+    if (resolved[i] == NULL) {
+      errors[i] = errno;
+    } else {
+      errors[i] = 0;
+      ++count;
+    }
+  }
+
+  r->cwd = NULL;
+  return count;
 }
@@ -0,0 +1,175 @@
+/* djcat.c - prints the events in a dlog journal.
+ *
+ * Reads a journal written by `dlog -j` (see djournal.h) and prints its events, one
+ * per line, with their time, their flags and the path of the file they happened
+ * to. With -s, it starts at the first event at or after a given time, found
+ * without reading the events before it. With -c, it only counts the events,
+ * which tells how fast a journal can be replayed.
+ *
+ * Usage
+ *
+ *    $ ./djcat [-s time] [-c] <journal>
+ *
+ *    <journal> - the journal to read.
+ *    -s: the time to start at, in seconds since the Epoch (as printed by
+ *    `date +%s.%N`).
+ *    -c: print the number of events, and how long it took to read them.
+ *
+ * Built along with djournal.c:
+ *
+ *    $ gcc -o djcat djcat.c djournal.c
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "djournal.h"
+
+#ifndef DJCAT_OUTBUFSIZ
+#  define DJCAT_OUTBUFSIZ (1024 * 1024)
+#endif
+
+static void helpAndLeave(const char *progname, int status);
+static void pexit(const char *fCall);
+
+static void printEvent(struct djournalReader *r, const struct djournalEvent *e);
+
+int
+main(int argc, char *argv[]) {
+  struct djournalReader r;
+  const struct djournalEvent *e;
+  struct timespec start, end;
+  unsigned long long count = 0;
+  double since = -1, elapsed;
+  char *endp;
+  int opt, countOnly = 0;
+
+  while ((opt = getopt(argc, argv, "s:ch")) != -1) {
+    switch (opt) {
+      case 's':
+        since = strtod(optarg, &endp);
+        if (*endp != '\0' || since < 0) {
+          helpAndLeave(argv[0], EXIT_FAILURE);
+        }
+        break;
+      case 'c': countOnly = 1; break;
+      case 'h': helpAndLeave(argv[0], EXIT_SUCCESS); break;
+      default: helpAndLeave(argv[0], EXIT_FAILURE);
+    }
+  }
+
+  if (argc != optind + 1) {
+    helpAndLeave(argv[0], EXIT_FAILURE);
+  }
+
+  if (setvbuf(stdout, NULL, _IOFBF, DJCAT_OUTBUFSIZ) != 0) {
+    pexit("setvbuf");
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (djournalReaderOpen(&r, argv[optind]) == -1) {
+    if (errno == EINVAL) {
+      fprintf(stderr, "%s: not a dlog journal\n", argv[optind]);
+      exit(EXIT_FAILURE);
+    }
+    pexit(argv[optind]);
+  }
+
+  if (since >= 0) {
+    djournalSeek(&r, (uint64_t) (since * 1e9));
+  }
+
+  while ((e = djournalNext(&r)) != NULL) {
+    ++count;
+    if (!countOnly) {
+      printEvent(&r, e);
+    }
+  }
+
+  djournalReaderClose(&r);
+
+  if (countOnly) {
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%llu events in %.3f s (%.0f events/s)\n", count, elapsed, count / elapsed);
+  }
+
+  exit(EXIT_SUCCESS);
+}
+
+static void
+helpAndLeave(const char *progname, int status) {
+  FILE *stream = stderr;
+
+  if (status == EXIT_SUCCESS) {
+    stream = stdout;
+  }
+
+  fprintf(stream, "Usage: %s [-s time] [-c] <journal>\n", progname);
+  exit(status);
+}
+
+static void
+pexit(const char *fCall) {
+  perror(fCall);
+  exit(EXIT_FAILURE);
+}
+
+static void
+printEvent(struct djournalReader *r, const struct djournalEvent *e) {
+  static const struct {
+    uint32_t mask;
+    const char *name;
+  } flags[] = {
+    { IN_ACCESS, "IN_ACCESS" }, { IN_ATTRIB, "IN_ATTRIB" },
+    { IN_CLOSE_NOWRITE, "IN_CLOSE_NOWRITE" }, { IN_CLOSE_WRITE, "IN_CLOSE_WRITE" },
+    { IN_CREATE, "IN_CREATE" }, { IN_DELETE, "IN_DELETE" },
+    { IN_DELETE_SELF, "IN_DELETE_SELF" }, { IN_IGNORED, "IN_IGNORED" },
+    { IN_MODIFY, "IN_MODIFY" }, { IN_MOVE_SELF, "IN_MOVE_SELF" },
+    { IN_MOVED_FROM, "IN_MOVED_FROM" }, { IN_MOVED_TO, "IN_MOVED_TO" },
+    { IN_OPEN, "IN_OPEN" }, { IN_UNMOUNT, "IN_UNMOUNT" },
+    { IN_Q_OVERFLOW, "IN_Q_OVERFLOW" }, { IN_ISDIR, "IN_ISDIR" }
+  };
+  char date[32];
+  const char *dir, *sep = "";
+  time_t secs = e->record.time / 1000000000;
+  struct tm tm;
+  size_t i;
+
+  localtime_r(&secs, &tm);
+  strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+  printf("%s.%09llu ", date, (unsigned long long) (e->record.time % 1000000000));
+
+  for (i = 0; i < sizeof(flags) / sizeof(flags[0]); ++i) {
+    if (e->mask & flags[i].mask) {
+      printf("%s%s", sep, flags[i].name);
+      sep = "|";
+    }
+  }
+
+  dir = djournalEventPath(r, e);
+  if (dir != NULL) {
+    printf(" %s%s%s", dir, (e->name[0] != '\0') ? "/" : "", e->name);
+  }
+
+  if (e->mask & IN_MOVED_FROM || e->mask & IN_MOVED_TO) {
+    printf(" (cookie %u)", e->cookie);
+  }
+
+  if (e->count > 1) {
+    printf(" (%u times)", e->count);
+  }
+
+  printf("\n");
+}
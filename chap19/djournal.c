@@ -0,0 +1,547 @@
+/* djournal.c - a binary journal of the events logged by dlog.
+ *
+ * See djournal.h.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "djournal.h"
+
+#if DJOURNAL_BUFSIZ < 2 * DJOURNAL_BLOCK
+#  error "DJOURNAL_BUFSIZ must hold two blocks at least"
+#endif
+
+#define DJOURNAL_INITIAL_PATHS (64)
+
+/* records are padded to 8 bytes */
+#define Align(n) (((n) + 7) & ~(size_t) 7)
+
+/* a path record written, in the writer's open addressing table */
+struct djournalPathSlot {
+  char *path;
+  uint64_t offset;
+};
+
+static uint64_t
+nowNs(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* the record at `pos`, if it is whole and fits in its block; NULL otherwise (a
+ * record of length 0 included: that is padding) */
+static const struct djournalRecord *
+validRecord(const struct djournalReader *r, size_t pos) {
+  const struct djournalRecord *rec;
+  size_t room, min;
+
+  room = (pos / r->blockSize + 1) * r->blockSize;
+  room = ((room < r->length) ? room : r->length) - pos;
+  if (pos % 8 != 0 || pos >= r->length || room < sizeof(struct djournalRecord)) {
+    return NULL;
+  }
+
+  rec = (const struct djournalRecord *) (r->data + pos);
+  if (rec->length < sizeof(struct djournalRecord) || rec->length % 8 != 0 || rec->length > room) {
+    return NULL;
+  }
+
+  switch (rec->type) {
+    case DJOURNAL_PATH: min = sizeof(struct djournalPath); break;
+    case DJOURNAL_EVENT: min = sizeof(struct djournalEvent); break;
+    default: return rec; /* of a later version: skipped */
+  }
+
+  /* the path or name is null terminated within the record */
+  if (rec->length < min + rec->nameLength + 1 || r->data[pos + min + rec->nameLength] != '\0') {
+    return NULL;
+  }
+
+  return rec;
+}
+
+/* the record at `*pos`, moving `*pos` past the padding at the end of a block
+ * first. NULL at the end of the journal */
+static const struct djournalRecord *
+recordAt(const struct djournalReader *r, size_t *pos) {
+  const struct djournalRecord *rec;
+  size_t blockEnd;
+
+  for (;;) {
+    if (*pos >= r->length) {
+      return NULL;
+    }
+
+    rec = validRecord(r, *pos);
+    if (rec != NULL) {
+      return rec;
+    }
+
+    /* padding, and not a torn record? */
+    blockEnd = (*pos / r->blockSize + 1) * r->blockSize;
+    if (blockEnd - *pos >= sizeof(uint32_t) && *pos + sizeof(uint32_t) <= r->length &&
+        ((const struct djournalRecord *) (r->data + *pos))->length != 0) {
+      return NULL;
+    }
+
+    *pos = blockEnd;
+  }
+}
+
+/* maps the journal open on `fd` */
+static int
+mapJournal(struct djournalReader *r, int fd) {
+  const struct djournalHeader *header;
+  struct stat st;
+
+  if (fstat(fd, &st) == -1) {
+    return -1;
+  }
+
+  if ((size_t) st.st_size < sizeof(struct djournalHeader)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  r->length = st.st_size;
+  r->data = mmap(NULL, r->length, PROT_READ, MAP_SHARED, fd, 0);
+  if (r->data == MAP_FAILED) {
+    return -1;
+  }
+
+  header = (const struct djournalHeader *) r->data;
+  if (memcmp(header->magic, DJOURNAL_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != DJOURNAL_VERSION || header->blockSize < 2 * sizeof(struct djournalHeader) ||
+      header->blockSize % 8 != 0) {
+    munmap((void *) r->data, r->length);
+    errno = EINVAL;
+    return -1;
+  }
+
+  r->blockSize = header->blockSize;
+  r->pos = sizeof(struct djournalHeader);
+  return 0;
+}
+
+/* where the next record of the journal on `fd` goes, and the time of its last
+ * record: the last two blocks are read to find out, since the last may have
+ * no record whole */
+static int
+findEnd(int fd, off_t *end, uint64_t *lastTime) {
+  const struct djournalRecord *rec;
+  struct djournalReader r;
+  size_t pos;
+
+  if (mapJournal(&r, fd) == -1) {
+    return -1;
+  }
+
+  if (r.blockSize != DJOURNAL_BLOCK) {
+    munmap((void *) r.data, r.length);
+    errno = EINVAL;
+    return -1;
+  }
+
+  pos = (r.length - 1) / r.blockSize;
+  pos = (pos > 0) ? (pos - 1) * r.blockSize : 0;
+  if (pos < sizeof(struct djournalHeader)) {
+    pos = sizeof(struct djournalHeader);
+  }
+
+  *end = pos;
+  *lastTime = ((const struct djournalHeader *) r.data)->created;
+  while ((rec = recordAt(&r, &pos)) != NULL) {
+    *lastTime = rec->time;
+    pos += rec->length;
+    *end = pos;
+  }
+
+  munmap((void *) r.data, r.length);
+  return 0;
+}
+
+int
+djournalOpen(struct djournalWriter *w, const char *path) {
+  struct djournalHeader *header;
+  struct stat st;
+  int s;
+
+  w->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (w->fd == -1) {
+    return -1;
+  }
+
+  w->buf = malloc(DJOURNAL_BUFSIZ);
+  w->pathCapacity = 2 * DJOURNAL_INITIAL_PATHS;
+  w->paths = calloc(w->pathCapacity, sizeof(struct djournalPathSlot));
+  w->pathCount = 0;
+  w->used = 0;
+
+  if (w->buf == NULL || w->paths == NULL || fstat(w->fd, &st) == -1) {
+    goto fail;
+  }
+
+  if (st.st_size == 0) {
+    w->offset = 0;
+    w->lastTime = nowNs();
+
+    header = (struct djournalHeader *) w->buf;
+    memset(header, 0, sizeof(struct djournalHeader));
+    memcpy(header->magic, DJOURNAL_MAGIC, sizeof(header->magic));
+    header->version = DJOURNAL_VERSION;
+    header->blockSize = DJOURNAL_BLOCK;
+    header->created = w->lastTime;
+    w->used = sizeof(struct djournalHeader);
+  } else {
+    if (findEnd(w->fd, &w->offset, &w->lastTime) == -1) {
+      goto fail;
+    }
+
+    /* a torn record, from a crash, is dropped */
+    if (w->offset < st.st_size && ftruncate(w->fd, w->offset) == -1) {
+      goto fail;
+    }
+  }
+
+  return 0;
+
+fail:
+  s = errno;
+  free(w->buf);
+  free(w->paths);
+  close(w->fd);
+  errno = s;
+  return -1;
+}
+
+int
+djournalFlush(struct djournalWriter *w) {
+  ssize_t numWritten;
+  size_t done;
+
+  for (done = 0; done < w->used; done += numWritten) {
+    numWritten = write(w->fd, w->buf + done, w->used - done);
+    if (numWritten == -1) {
+      if (errno == EINTR) {
+        numWritten = 0;
+        continue;
+      }
+
+      /* what was written stays written */
+      memmove(w->buf, w->buf + done, w->used - done);
+      w->offset += done;
+      w->used -= done;
+      return -1;
+    }
+  }
+
+  w->offset += w->used;
+  w->used = 0;
+  return 0;
+}
+
+/* room for a record of `length` bytes, zero filling the rest of the block first
+ * if it does not fit in there. Returns its offset in the journal */
+static char *
+reserve(struct djournalWriter *w, size_t length, uint64_t *offset) {
+  size_t inBlock, pad = 0;
+  char *p;
+
+  inBlock = (w->offset + w->used) % DJOURNAL_BLOCK;
+  if (inBlock + length > DJOURNAL_BLOCK) {
+    pad = DJOURNAL_BLOCK - inBlock;
+  }
+
+  if (w->used + pad + length > DJOURNAL_BUFSIZ && djournalFlush(w) == -1) {
+    return NULL;
+  }
+
+  memset(w->buf + w->used, 0, pad);
+  w->used += pad;
+
+  p = w->buf + w->used;
+  memset(p, 0, length);
+  *offset = w->offset + w->used;
+  w->used += length;
+
+  return p;
+}
+
+static size_t
+pathSlot(const char *path, size_t capacity) {
+  size_t h = 2166136261u;
+
+  /* FNV-1a */
+  for (; *path != '\0'; ++path) {
+    h = (h ^ (unsigned char) *path) * 16777619u;
+  }
+
+  return h & (capacity - 1);
+}
+
+static size_t
+findPath(struct djournalPathSlot *paths, size_t capacity, const char *path) {
+  size_t i = pathSlot(path, capacity);
+
+  while (paths[i].path != NULL && strcmp(paths[i].path, path) != 0) {
+    i = (i + 1) & (capacity - 1);
+  }
+
+  return i;
+}
+
+static int
+growPaths(struct djournalWriter *w) {
+  struct djournalPathSlot *paths;
+  size_t i, capacity = 2 * w->pathCapacity;
+
+  paths = calloc(capacity, sizeof(struct djournalPathSlot));
+  if (paths == NULL) {
+    return -1;
+  }
+
+  for (i = 0; i < w->pathCapacity; ++i) {
+    if (w->paths[i].path != NULL) {
+      paths[findPath(paths, capacity, w->paths[i].path)] = w->paths[i];
+    }
+  }
+
+  free(w->paths);
+  w->paths = paths;
+  w->pathCapacity = capacity;
+  return 0;
+}
+
+/* the offset of the path record of `dir`, appending one if there is none yet */
+static int
+pathOffset(struct djournalWriter *w, const char *dir, uint64_t time, uint64_t *offset) {
+  struct djournalPath *rec;
+  size_t i, len = strlen(dir), length;
+  char *copy;
+
+  i = findPath(w->paths, w->pathCapacity, dir);
+  if (w->paths[i].path != NULL) {
+    *offset = w->paths[i].offset;
+    return 0;
+  }
+
+  length = Align(sizeof(struct djournalPath) + len + 1);
+  if (len > UINT16_MAX || length > DJOURNAL_BLOCK) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  if (2 * (w->pathCount + 1) > w->pathCapacity) {
+    if (growPaths(w) == -1) {
+      return -1;
+    }
+    i = findPath(w->paths, w->pathCapacity, dir);
+  }
+
+  if ((copy = strdup(dir)) == NULL) {
+    return -1;
+  }
+
+  rec = (struct djournalPath *) reserve(w, length, offset);
+  if (rec == NULL) {
+    free(copy);
+    return -1;
+  }
+
+  rec->record.length = length;
+  rec->record.type = DJOURNAL_PATH;
+  rec->record.nameLength = len;
+  rec->record.time = time;
+  memcpy(rec->path, dir, len + 1);
+
+  w->paths[i].path = copy;
+  w->paths[i].offset = *offset;
+  ++w->pathCount;
+  return 0;
+}
+
+int
+djournalAppend(struct djournalWriter *w, const char *dir, const char *name,
+               uint32_t mask, uint32_t cookie, uint32_t count) {
+  struct djournalEvent *rec;
+  uint64_t time, path = 0, offset;
+  size_t len, length;
+
+  if (name == NULL) {
+    name = "";
+  }
+
+  len = strlen(name);
+  length = Align(sizeof(struct djournalEvent) + len + 1);
+  if (len > UINT16_MAX || length > DJOURNAL_BLOCK) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  /* clocks can be set back: timestamps never are */
+  time = nowNs();
+  if (time < w->lastTime) {
+    time = w->lastTime;
+  }
+  w->lastTime = time;
+
+  if (dir != NULL && pathOffset(w, dir, time, &path) == -1) {
+    return -1;
+  }
+
+  rec = (struct djournalEvent *) reserve(w, length, &offset);
+  if (rec == NULL) {
+    return -1;
+  }
+
+  rec->record.length = length;
+  rec->record.type = DJOURNAL_EVENT;
+  rec->record.nameLength = len;
+  rec->record.time = time;
+  rec->path = path;
+  rec->mask = mask;
+  rec->cookie = cookie;
+  rec->count = count;
+  memcpy(rec->name, name, len + 1);
+
+  return 0;
+}
+
+int
+djournalClose(struct djournalWriter *w) {
+  size_t i;
+  int s = 0;
+
+  if (djournalFlush(w) == -1) {
+    s = errno;
+  }
+
+  for (i = 0; i < w->pathCapacity; ++i) {
+    free(w->paths[i].path);
+  }
+  free(w->paths);
+  free(w->buf);
+
+  if (close(w->fd) == -1 && s == 0) {
+    s = errno;
+  }
+
+  if (s != 0) {
+    errno = s;
+    return -1;
+  }
+
+  return 0;
+}
+
+int
+djournalReaderOpen(struct djournalReader *r, const char *path) {
+  int fd, s;
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return -1;
+  }
+
+  if (mapJournal(r, fd) == -1) {
+    s = errno;
+    close(fd);
+    errno = s;
+    return -1;
+  }
+
+  /* the mapping stays valid with the descriptor closed */
+  close(fd);
+
+  /* replays read the journal from start to end */
+  madvise((void *) r->data, r->length, MADV_SEQUENTIAL);
+  return 0;
+}
+
+const struct djournalEvent *
+djournalNext(struct djournalReader *r) {
+  const struct djournalRecord *rec;
+
+  while ((rec = recordAt(r, &r->pos)) != NULL) {
+    r->pos += rec->length;
+
+    if (rec->type == DJOURNAL_EVENT) {
+      return (const struct djournalEvent *) rec;
+    }
+  }
+
+  return NULL;
+}
+
+const char *
+djournalEventPath(struct djournalReader *r, const struct djournalEvent *e) {
+  const struct djournalRecord *rec;
+
+  if (e->path == 0 || e->path > r->length) {
+    return NULL;
+  }
+
+  rec = validRecord(r, e->path);
+  if (rec == NULL || rec->type != DJOURNAL_PATH) {
+    return NULL;
+  }
+
+  return ((const struct djournalPath *) rec)->path;
+}
+
+/* the time of the first record of block `b`, or UINT64_MAX if it has none */
+static uint64_t
+blockTime(const struct djournalReader *r, size_t b) {
+  const struct djournalRecord *rec;
+  size_t pos = b * r->blockSize;
+
+  if (b == 0) {
+    pos = sizeof(struct djournalHeader);
+  }
+
+  rec = validRecord(r, pos);
+  return (rec != NULL) ? rec->time : UINT64_MAX;
+}
+
+void
+djournalSeek(struct djournalReader *r, uint64_t time) {
+  const struct djournalRecord *rec;
+  size_t lo = 0, hi, mid;
+
+  /* the first block starting at `time` or later: events from `time` on start in
+   * the block before it */
+  hi = (r->length + r->blockSize - 1) / r->blockSize;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (blockTime(r, mid) < time) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  r->pos = (lo > 1) ? (lo - 1) * r->blockSize : sizeof(struct djournalHeader);
+  while ((rec = recordAt(r, &r->pos)) != NULL && (rec->type != DJOURNAL_EVENT || rec->time < time)) {
+    r->pos += rec->length;
+  }
+}
+
+void
+djournalReaderClose(struct djournalReader *r) {
+  munmap((void *) r->data, r->length);
+}
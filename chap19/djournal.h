@@ -0,0 +1,141 @@
+/* djournal.h - a binary journal of the events logged by dlog.
+ *
+ * dlog prints events as lines of text, with the path of the directory each
+ * happened in. Programs that replay events (an indexer catching up after a
+ * restart, say) are better served by a journal they can read back fast, and
+ * start reading at a given time.
+ *
+ * A journal is a file of records, only ever appended to. It starts with a header
+ * (struct djournalHeader), and is made of blocks of DJOURNAL_BLOCK bytes: no record
+ * crosses from one block into the next, the rest of a block being zero filled
+ * when a record does not fit in it. Records are aligned to 8 bytes, and all have
+ * a timestamp, in nanoseconds since the Epoch, never smaller than that of the
+ * records before them. Since every block starts with a record, the reader finds
+ * the events from a given time on with a binary search over the blocks, and then
+ * reads a single block up to them.
+ *
+ * Events do not hold the path of their directory, but the offset of a path record
+ * in the journal: the first time a path is used the writer appends a record for
+ * it, and every event in that directory afterwards refers to that record. Watch
+ * descriptors, which mean nothing once dlog exits, never make it to the journal.
+ *
+ * The writer appends records to a large buffer, written out with a single
+ * write(2) when it fills up or when djournalFlush is called (dlog does after each
+ * batch of events it reads). A journal that already exists is appended to: a
+ * record left torn by a crash at its end is dropped first. The reader maps the
+ * journal with mmap(2), and hands out pointers into the mapping: nothing is read
+ * or copied that is not looked at.
+ *
+ * Programs using it are built along with djournal.c:
+ *
+ *    $ gcc -o dlog dlog.c djournal.c
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#ifndef DJOURNAL_H
+#define DJOURNAL_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define DJOURNAL_MAGIC ("DLOGJNL1")
+#define DJOURNAL_VERSION (1)
+
+#ifndef DJOURNAL_BLOCK
+#  define DJOURNAL_BLOCK (64 * 1024)
+#endif
+
+/* the writer's buffer */
+#ifndef DJOURNAL_BUFSIZ
+#  define DJOURNAL_BUFSIZ (1024 * 1024)
+#endif
+
+#define DJOURNAL_PATH (1)
+#define DJOURNAL_EVENT (2)
+
+struct djournalHeader {
+  char magic[8];          /* DJOURNAL_MAGIC, with no null byte */
+  uint32_t version;
+  uint32_t blockSize;     /* DJOURNAL_BLOCK, when the journal was created */
+  uint64_t created;       /* nanoseconds since the Epoch */
+  uint64_t reserved;
+};
+
+/* the start of every record. A length of 0 means the rest of the block is
+ * padding */
+struct djournalRecord {
+  uint32_t length;        /* of the whole record, a multiple of 8 */
+  uint16_t type;          /* DJOURNAL_PATH or DJOURNAL_EVENT */
+  uint16_t nameLength;    /* of the path or name that follows, null byte excluded */
+  uint64_t time;
+};
+
+/* a path, null terminated, referred to by events by its offset */
+struct djournalPath {
+  struct djournalRecord record;
+  char path[];
+};
+
+struct djournalEvent {
+  struct djournalRecord record;
+  uint64_t path;          /* offset of the path record of the directory, 0 if none */
+  uint32_t mask;          /* IN_* flags, as in inotify(7) */
+  uint32_t cookie;        /* of IN_MOVED_FROM and IN_MOVED_TO */
+  uint32_t count;         /* of IN_MODIFY events logged as one */
+  uint32_t reserved;
+  char name[];            /* of the file in the directory; empty if the event is
+                             about the directory itself */
+};
+
+struct djournalWriter {
+  int fd;
+  char *buf;
+  size_t used;
+  off_t offset;           /* of the start of the buffer in the file */
+  uint64_t lastTime;
+  struct djournalPathSlot *paths; /* path records written, by path */
+  size_t pathCapacity;
+  size_t pathCount;
+};
+
+struct djournalReader {
+  const char *data;
+  size_t length;
+  size_t blockSize;
+  size_t pos;             /* of the next record */
+};
+
+/* opens the journal at `path` for appending, creating it if needed. Returns -1
+ * on error, with `errno` set (EINVAL if the file is not a journal) */
+int djournalOpen(struct djournalWriter *w, const char *path);
+
+/* appends an event in directory `dir` (NULL if none) on its file `name` (NULL
+ * if it is about the directory itself). Returns -1 on error, with `errno` set */
+int djournalAppend(struct djournalWriter *w, const char *dir, const char *name,
+                   uint32_t mask, uint32_t cookie, uint32_t count);
+
+/* writes out the records appended. Returns -1 on error, with `errno` set */
+int djournalFlush(struct djournalWriter *w);
+
+/* flushes and closes the journal */
+int djournalClose(struct djournalWriter *w);
+
+/* maps the journal at `path`, to be read from its first event. Returns -1 on
+ * error, with `errno` set (EINVAL if the file is not a journal) */
+int djournalReaderOpen(struct djournalReader *r, const char *path);
+
+/* the next event, or NULL once there are no more. A record torn at the end of
+ * the journal ends it */
+const struct djournalEvent *djournalNext(struct djournalReader *r);
+
+/* the path of the directory of an event, or NULL if it has none */
+const char *djournalEventPath(struct djournalReader *r, const struct djournalEvent *e);
+
+/* positions the reader at the first event at or after `time` */
+void djournalSeek(struct djournalReader *r, uint64_t time);
+
+void djournalReaderClose(struct djournalReader *r);
+
+#endif
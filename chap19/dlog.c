@@ -6,15 +6,52 @@
  *
  * Usage
  *
- *    $ ./dlog <dir>
+ *    $ ./dlog [-f] [-w window] [-j journal] <dir>
  *    # Logs information indefinitely
  *
  *    <dir> - the directory to be monitored.
+ *    -f: monitor the file system with fanotify(7), rather than inotify(7) (see
+ *    below).
+ *    -w: the window, in milliseconds, in which modifications of a file are
+ *    logged as one (default: 100; 0 logs each on its own).
+ *    -j: append the events to a binary journal (see djournal.h), rather than
+ *    printing them. It is read back with djcat.
+ *
+ * Events come in bursts (think of a `git checkout`): they are read many at a time,
+ * into a large buffer, so that the kernel queue does not overflow; and logged
+ * through a large output buffer, written out once per batch read rather than once
+ * per line. A file being written generates an IN_MODIFY event per write(2): those
+ * are counted rather than logged, and a single line, with how many there were,
+ * logged when the window ends - or when anything else happens to that file, so
+ * that its events are still logged in order.
+ *
+ * The watches are kept in a hash table, indexed both by watch descriptor - to
+ * find, for every event, the path of the directory it happened in - and by path,
+ * to find the watch of a directory that was renamed, whose path (and that of
+ * every directory under it) then changes. The table grows as needed: the only
+ * limit to the number of directories watched is that of the kernel, in
+ * /proc/sys/fs/inotify/max_user_watches.
+ *
+ * That takes a walk of the whole tree on startup, and kernel memory for every
+ * directory in it. With -f, a single fanotify mark is put on the file system the
+ * directory is in instead (FAN_MARK_FILESYSTEM), which makes for constant startup
+ * time regardless of the size of the tree. Events then identify the directory they
+ * happened in by its file handle, along with the name of the file (that is,
+ * FAN_REPORT_DFID_NAME); the path of the directory is found - once, and cached
+ * along with the handle - by opening the handle (open_by_handle_at(2)) and reading
+ * the link of the descriptor in /proc/self/fd. Events in directories outside the
+ * tree are skipped. The events are the same as those of inotify (and fanotify
+ * gives their flags the same values), and are logged the same way, but this
+ * requires the CAP_SYS_ADMIN capability, and Linux 5.9 or later.
+ *
+ * Built along with djournal.c:
+ *
+ *    $ gcc -o dlog dlog.c djournal.c
  *
  * Author: Renato Mascarenhas Costa
  */
 
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE /* open_by_handle_at and struct file_handle */
 
 #include <limits.h>
 #ifndef NAME_MAX
@@ -22,25 +59,47 @@
 #endif
 
 #include <ftw.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <sys/inotify.h>
+#include <sys/fanotify.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "djournal.h"
 
 #ifndef DLOG_NOPENFD
 #  define DLOG_NOPENFD (100)
 #endif
 
-/* buffer size enough to allocate at least 10 events at once */
+/* buffer size enough to read thousands of events at once */
 #ifndef DLOG_BUFSIZ
-#  define DLOG_BUFSIZ (10 * (sizeof (struct inotify_event) + NAME_MAX + 1))
+#  define DLOG_BUFSIZ (256 * 1024)
+#endif
+
+#ifndef DLOG_OUTBUFSIZ
+#  define DLOG_OUTBUFSIZ (1024 * 1024)
 #endif
 
-#ifndef DLOG_MAX_SUBDIRS
-#  define DLOG_MAX_SUBDIRS (128)
+#ifndef DLOG_WINDOW_MS
+#  define DLOG_WINDOW_MS (100)
+#endif
+
+/* files with modifications counted at once; they are all logged when half of
+ * them are in use */
+#ifndef DLOG_PENDING_MAX
+#  define DLOG_PENDING_MAX (4096)
+#endif
+
+#ifndef DLOG_INITIAL_WATCHES
+#  define DLOG_INITIAL_WATCHES (64)
 #endif
 
 #define Fatal(...) { \
@@ -54,7 +113,39 @@
  * system calls */
 struct st_watched_subdir {
   int wd;
-  char fpath[PATH_MAX];
+  char *fpath;
+};
+
+/* the watched subdirectories, in two open addressing hash tables of the same
+ * capacity (a power of two, at most half full): by watch descriptor, and by path */
+struct st_watch_table {
+  struct st_watched_subdir **byWd;
+  struct st_watched_subdir **byPath;
+  size_t capacity;
+  size_t count;
+};
+
+/* modifications of a file not logged yet */
+struct st_pending_modify {
+  int wd;                   /* -1 if the slot is free */
+  char name[NAME_MAX + 1];
+  unsigned long count;      /* 0 if they were logged in the meantime */
+};
+
+/* a directory fanotify reported events in, known by its file handle. It is
+ * given an identifier, standing for the watch descriptor of inotify, under which
+ * its path is in the table of watched subdirs (if it is in the tree monitored) */
+struct st_fid_dir {
+  int id;                     /* -1 once the directory is deleted */
+  int inside;                 /* whether it is in the tree monitored */
+  struct file_handle *handle;
+};
+
+/* open addressing hash table of the directories, by handle */
+struct st_fid_table {
+  struct st_fid_dir **slots;
+  size_t capacity;
+  size_t count;
 };
 
 static void helpAndLeave(const char *progname, int status);
@@ -64,11 +155,36 @@ static void pexit(const char *fCall);
  * command line argument and needs to be known by the nftw traverse function */
 int inotifyFd;
 
-/* list of watched subdirs and control variable to indicate how many elements the
- * list currently holds. They are global since they can be modified by the
- * nftw iterator and when reading inotify events as well */
-struct st_watched_subdir *watchedDirs[DLOG_MAX_SUBDIRS];
-int watchedDirsCount = 0;
+/* with -f: the fanotify descriptor, a descriptor in the file system monitored
+ * (for open_by_handle_at), the canonical path of the tree monitored, and the
+ * directories seen in events */
+int fanotifyFd = -1;
+int mountFd;
+char *rootPath;
+struct st_fid_table fidDirs;
+int nextFidId = 1;
+
+/* the watched subdirs. Global since they can be modified by the nftw iterator
+ * and when reading inotify events as well */
+struct st_watch_table watchedDirs;
+
+/* cookie of the last directory moved from a watched directory, whose name it had
+ * in there, and the watch descriptor of that directory; the matching move to
+ * event (if it stayed in the tree) tells its new path */
+uint32_t movedCookie = 0;
+int movedFromWd = -1;
+char movedFromName[NAME_MAX + 1];
+
+/* modifications counted in the current window, which started at `windowStart`
+ * (in milliseconds) and lasts `windowMs` */
+struct st_pending_modify pending[DLOG_PENDING_MAX];
+size_t pendingCount = 0;
+long long windowStart;
+long windowMs = DLOG_WINDOW_MS;
+
+/* with -j: the journal events are appended to */
+struct djournalWriter journal;
+int journaling = 0;
 
 /* the function that will be passed to nftw in order to install a monitor in every
  * directory in the subtree */
@@ -78,41 +194,131 @@ static int installMonitor(const char *fpath, const struct stat *sb, int typeflag
 static void logEvent(struct inotify_event *event);
 
 static void addWatch(const char *path);
+static void setWatch(int wd, const char *path);
+static void startFanotify(const char *dir);
+static void readFanotify(char *buf, ssize_t numRead);
 static void rmWatch(int wd);
+static void renameWatches(const char *from, const char *to);
+
+static long long now();
+static void countModify(struct inotify_event *event);
+static void logPending(struct inotify_event *event);
+static void logAllPending();
 
 int
 main(int argc, char *argv[]) {
   ssize_t numRead;
-  char *p, buf[DLOG_BUFSIZ];
+  char *p, *buf;
   struct inotify_event *event;
+  struct pollfd pfd;
+  long long elapsed;
+  int opt, timeout, ready, useFanotify = 0;
+  size_t i;
+
+  while ((opt = getopt(argc, argv, "fw:j:h")) != -1) {
+    switch (opt) {
+      case 'f': useFanotify = 1; break;
+      case 'w': windowMs = atol(optarg); break;
+      case 'j':
+        if (djournalOpen(&journal, optarg) == -1) {
+          pexit(optarg);
+        }
+        journaling = 1;
+        break;
+      case 'h': helpAndLeave(argv[0], EXIT_SUCCESS); break;
+      default: helpAndLeave(argv[0], EXIT_FAILURE);
+    }
+  }
 
-  if (argc != 2) {
+  if (argc != optind + 1 || windowMs < 0) {
     helpAndLeave(argv[0], EXIT_FAILURE);
   }
 
-  inotifyFd = inotify_init();
-  if (inotifyFd == -1) {
-    pexit("inotify_init");
+  /* aligned as events are */
+  buf = malloc(DLOG_BUFSIZ);
+  if (buf == NULL) {
+    pexit("malloc");
+  }
+
+  if (setvbuf(stdout, NULL, _IOFBF, DLOG_OUTBUFSIZ) != 0) {
+    pexit("setvbuf");
   }
 
-  /* traverse the directory tree and monitor all directories */
-  if (nftw(argv[1], installMonitor, DLOG_NOPENFD, FTW_PHYS) == -1) {
-    pexit("nftw");
+  for (i = 0; i < DLOG_PENDING_MAX; ++i) {
+    pending[i].wd = -1;
   }
 
+  watchedDirs.capacity = 2 * DLOG_INITIAL_WATCHES;
+  watchedDirs.byWd = calloc(watchedDirs.capacity, sizeof(struct st_watched_subdir *));
+  watchedDirs.byPath = calloc(watchedDirs.capacity, sizeof(struct st_watched_subdir *));
+  if (watchedDirs.byWd == NULL || watchedDirs.byPath == NULL) {
+    pexit("calloc");
+  }
+
+  if (useFanotify) {
+    startFanotify(argv[optind]);
+    printf("Listening for events on %s (the whole file system it is in)...\n", rootPath);
+  } else {
+    inotifyFd = inotify_init();
+    if (inotifyFd == -1) {
+      pexit("inotify_init");
+    }
+
+    /* traverse the directory tree and monitor all directories */
+    if (nftw(argv[optind], installMonitor, DLOG_NOPENFD, FTW_PHYS) == -1) {
+      pexit("nftw");
+    }
+
+    printf("Listening for events on %s (%zu directories)...\n", argv[optind], watchedDirs.count);
+  }
+  fflush(stdout);
+
   /* read incoming events indefinitely */
-  printf("Listening for events on %s...\n", argv[1]);
+  pfd.fd = useFanotify ? fanotifyFd : inotifyFd;
+  pfd.events = POLLIN;
+
   for (;;) {
-    numRead = read(inotifyFd, buf, DLOG_BUFSIZ);
-    if (numRead == -1) {
-      pexit("read");
+    /* wait for events only until the window of the modifications counted ends */
+    timeout = -1;
+    if (pendingCount > 0) {
+      elapsed = now() - windowStart;
+      timeout = (elapsed >= windowMs) ? 0 : (int) (windowMs - elapsed);
     }
 
-    for (p = buf; p < buf + numRead; ) {
-      event = (struct inotify_event *) p;
-      logEvent(event);
+    ready = poll(&pfd, 1, timeout);
+    if (ready == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      pexit("poll");
+    }
 
-      p += sizeof(struct inotify_event) + event->len;
+    if (ready > 0) {
+      numRead = read(pfd.fd, buf, DLOG_BUFSIZ);
+      if (numRead == -1) {
+        pexit("read");
+      }
+
+      if (useFanotify) {
+        readFanotify(buf, numRead);
+      } else {
+        for (p = buf; p < buf + numRead; ) {
+          event = (struct inotify_event *) p;
+          logEvent(event);
+
+          p += sizeof(struct inotify_event) + event->len;
+        }
+      }
+    }
+
+    if (pendingCount > 0 && now() - windowStart >= windowMs) {
+      logAllPending();
+    }
+
+    /* the whole batch is written at once */
+    fflush(stdout);
+    if (journaling && djournalFlush(&journal) == -1) {
+      pexit("djournalFlush");
     }
   }
 
@@ -127,7 +333,7 @@ helpAndLeave(const char *progname, int status) {
     stream = stdout;
   }
 
-  fprintf(stream, "Usage: %s <dir>\n", progname);
+  fprintf(stream, "Usage: %s [-f] [-w window] [-j journal] <dir>\n", progname);
   exit(status);
 }
 
@@ -137,41 +343,425 @@ pexit(const char *fCall) {
   exit(EXIT_FAILURE);
 }
 
+/* home slots of a watch in each of the tables */
+static size_t
+wdSlot(int wd, size_t capacity) {
+  return ((size_t) wd * 2654435761u) & (capacity - 1);
+}
+
+static size_t
+pathSlot(const char *path, size_t capacity) {
+  size_t h = 2166136261u;
+
+  /* FNV-1a */
+  for (; *path != '\0'; ++path) {
+    h = (h ^ (unsigned char) *path) * 16777619u;
+  }
+
+  return h & (capacity - 1);
+}
+
+/* the slot of the watch `wd` in the table, or the empty one where it would go */
+static size_t
+findWd(int wd) {
+  size_t i = wdSlot(wd, watchedDirs.capacity);
+
+  while (watchedDirs.byWd[i] != NULL && watchedDirs.byWd[i]->wd != wd) {
+    i = (i + 1) & (watchedDirs.capacity - 1);
+  }
+
+  return i;
+}
+
+static size_t
+findPath(const char *path) {
+  size_t i = pathSlot(path, watchedDirs.capacity);
+
+  while (watchedDirs.byPath[i] != NULL && strcmp(watchedDirs.byPath[i]->fpath, path) != 0) {
+    i = (i + 1) & (watchedDirs.capacity - 1);
+  }
+
+  return i;
+}
+
 static void
-addWatch(const char *path) {
-  int wd;
-  struct st_watched_subdir *entry;
+insertWatch(struct st_watched_subdir *entry) {
+  watchedDirs.byWd[findWd(entry->wd)] = entry;
+  watchedDirs.byPath[findPath(entry->fpath)] = entry;
+  ++watchedDirs.count;
+}
+
+/* empties slot `i` of one of the tables, moving back the entries after it
+ * that would no longer be found otherwise */
+static void
+clearSlot(struct st_watched_subdir **slots, size_t i, int byWd) {
+  size_t mask = watchedDirs.capacity - 1, j, home;
+
+  slots[i] = NULL;
 
-  if (watchedDirsCount >= DLOG_MAX_SUBDIRS) {
-    Fatal("Max watched dir limit reached: %d\n", DLOG_MAX_SUBDIRS);
+  for (j = (i + 1) & mask; slots[j] != NULL; j = (j + 1) & mask) {
+    home = byWd ? wdSlot(slots[j]->wd, watchedDirs.capacity) : pathSlot(slots[j]->fpath, watchedDirs.capacity);
+
+    /* the entry can stay if its home is cyclically in (i, j] */
+    if ((i < j) ? (home > i && home <= j) : (home > i || home <= j)) {
+      continue;
+    }
+
+    slots[i] = slots[j];
+    slots[j] = NULL;
+    i = j;
   }
+}
+
+static void
+removeWatch(struct st_watched_subdir *entry) {
+  clearSlot(watchedDirs.byWd, findWd(entry->wd), 1);
+  clearSlot(watchedDirs.byPath, findPath(entry->fpath), 0);
+  --watchedDirs.count;
+}
+
+/* doubles the capacity of the tables */
+static void
+growTable() {
+  struct st_watched_subdir **byWd = watchedDirs.byWd;
+  size_t i, capacity = watchedDirs.capacity;
+
+  free(watchedDirs.byPath);
+
+  watchedDirs.capacity *= 2;
+  watchedDirs.count = 0;
+  watchedDirs.byWd = calloc(watchedDirs.capacity, sizeof(struct st_watched_subdir *));
+  watchedDirs.byPath = calloc(watchedDirs.capacity, sizeof(struct st_watched_subdir *));
+  if (watchedDirs.byWd == NULL || watchedDirs.byPath == NULL) {
+    pexit("calloc");
+  }
+
+  for (i = 0; i < capacity; ++i) {
+    if (byWd[i] != NULL) {
+      insertWatch(byWd[i]);
+    }
+  }
+
+  free(byWd);
+}
+
+static void
+addWatch(const char *path) {
+  int wd;
 
   wd = inotify_add_watch(inotifyFd, path, IN_ALL_EVENTS);
   if (wd == -1) {
+    if (errno == ENOSPC) {
+      Fatal("Max watched dir limit reached: %zu (see /proc/sys/fs/inotify/max_user_watches)\n",
+            watchedDirs.count);
+    }
+
     pexit("inotify_add_watch");
   }
 
-  entry = malloc(sizeof(struct st_watched_subdir));
-  if (entry == NULL) {
-    pexit("malloc");
+  setWatch(wd, path);
+}
+
+/* stores `path` as that of watch `wd` */
+static void
+setWatch(int wd, const char *path) {
+  struct st_watched_subdir *entry;
+
+  /* already watched under another name (or the directory was created and
+   * renamed before being watched): the watch is the same */
+  entry = watchedDirs.byWd[findWd(wd)];
+  if (entry != NULL) {
+    removeWatch(entry);
+    free(entry->fpath);
+  } else {
+    if (2 * (watchedDirs.count + 1) > watchedDirs.capacity) {
+      growTable();
+    }
+
+    entry = malloc(sizeof(struct st_watched_subdir));
+    if (entry == NULL) {
+      pexit("malloc");
+    }
   }
 
   entry->wd = wd;
-  strncpy(entry->fpath, path, PATH_MAX);
+  entry->fpath = strdup(path);
+  if (entry->fpath == NULL) {
+    pexit("strdup");
+  }
 
-  watchedDirs[watchedDirsCount++] = entry;
+  insertWatch(entry);
 }
 
 static void
 rmWatch(int wd) {
-  int i;
+  struct st_watched_subdir *entry;
+
+  entry = watchedDirs.byWd[findWd(wd)];
+  if (entry != NULL) {
+    removeWatch(entry);
+    free(entry->fpath);
+    free(entry);
+  }
+}
+
+/* a watched directory was renamed from `from` to `to`: so were all the
+ * directories under it */
+static void
+renameWatches(const char *from, const char *to) {
+  struct st_watched_subdir **renamed, *entry;
+  size_t i, n = 0, fromLen = strlen(from), toLen = strlen(to);
+  char *fpath;
+
+  if (watchedDirs.byPath[findPath(from)] == NULL) {
+    return;
+  }
+
+  /* the entries move about in the tables as they are renamed: find them all first */
+  renamed = malloc(watchedDirs.count * sizeof(struct st_watched_subdir *));
+  if (renamed == NULL) {
+    pexit("malloc");
+  }
+
+  for (i = 0; i < watchedDirs.capacity; ++i) {
+    entry = watchedDirs.byWd[i];
+    if (entry != NULL && strncmp(entry->fpath, from, fromLen) == 0 &&
+        (entry->fpath[fromLen] == '\0' || entry->fpath[fromLen] == '/')) {
+      renamed[n++] = entry;
+    }
+  }
+
+  for (i = 0; i < n; ++i) {
+    entry = renamed[i];
+
+    fpath = malloc(toLen + strlen(entry->fpath + fromLen) + 1);
+    if (fpath == NULL) {
+      pexit("malloc");
+    }
+    strcpy(fpath, to);
+    strcat(fpath, entry->fpath + fromLen);
+
+    removeWatch(entry);
+    free(entry->fpath);
+    entry->fpath = fpath;
+    insertWatch(entry);
+  }
+
+  free(renamed);
+}
+
+static size_t
+handleSlot(const struct file_handle *handle, size_t capacity) {
+  size_t h = (2166136261u ^ (unsigned) handle->handle_type) * 16777619u;
+  unsigned int i;
+
+  /* FNV-1a */
+  for (i = 0; i < handle->handle_bytes; ++i) {
+    h = (h ^ handle->f_handle[i]) * 16777619u;
+  }
 
-  for (i = 0; i < watchedDirsCount; ++i) {
-    if (watchedDirs[i]->wd == wd) {
-      free(watchedDirs[i]);
-      watchedDirs[i] = NULL;
+  return h & (capacity - 1);
+}
 
-      return;
+/* the slot of the directory of `handle` in the table, or the empty one where it
+ * would go */
+static size_t
+findFid(const struct file_handle *handle) {
+  struct st_fid_dir *dir;
+  size_t i = handleSlot(handle, fidDirs.capacity);
+
+  for (; (dir = fidDirs.slots[i]) != NULL; i = (i + 1) & (fidDirs.capacity - 1)) {
+    if (dir->handle->handle_type == handle->handle_type &&
+        dir->handle->handle_bytes == handle->handle_bytes &&
+        memcmp(dir->handle->f_handle, handle->f_handle, handle->handle_bytes) == 0) {
+      break;
+    }
+  }
+
+  return i;
+}
+
+static void
+growFids() {
+  struct st_fid_dir **slots = fidDirs.slots;
+  size_t i, capacity = fidDirs.capacity;
+
+  fidDirs.capacity *= 2;
+  fidDirs.slots = calloc(fidDirs.capacity, sizeof(struct st_fid_dir *));
+  if (fidDirs.slots == NULL) {
+    pexit("calloc");
+  }
+
+  for (i = 0; i < capacity; ++i) {
+    if (slots[i] != NULL) {
+      fidDirs.slots[findFid(slots[i]->handle)] = slots[i];
+    }
+  }
+
+  free(slots);
+}
+
+/* the directory of `handle`: found out the first time it is seen. Returns NULL
+ * if it cannot be opened (it may be gone by now) */
+static struct st_fid_dir *
+fidDirectory(struct file_handle *handle) {
+  struct st_fid_dir *dir;
+  char link[64], path[PATH_MAX];
+  size_t i, rootLen;
+  ssize_t len;
+  int fd;
+
+  i = findFid(handle);
+  if (fidDirs.slots[i] != NULL) {
+    return fidDirs.slots[i];
+  }
+
+  fd = open_by_handle_at(mountFd, handle, O_PATH);
+  if (fd == -1) {
+    if (errno == ESTALE || errno == ENOENT) {
+      return NULL;
+    }
+    pexit("open_by_handle_at");
+  }
+
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+  len = readlink(link, path, PATH_MAX - 1);
+  if (len == -1) {
+    pexit("readlink");
+  }
+  path[len] = '\0';
+  close(fd);
+
+  if (2 * (fidDirs.count + 1) > fidDirs.capacity) {
+    growFids();
+    i = findFid(handle);
+  }
+
+  dir = malloc(sizeof(struct st_fid_dir));
+  if (dir == NULL) {
+    pexit("malloc");
+  }
+
+  dir->handle = malloc(sizeof(struct file_handle) + handle->handle_bytes);
+  if (dir->handle == NULL) {
+    pexit("malloc");
+  }
+  memcpy(dir->handle, handle, sizeof(struct file_handle) + handle->handle_bytes);
+
+  /* the root path is canonical, and so is the link */
+  rootLen = strlen(rootPath);
+  dir->inside = strncmp(path, rootPath, rootLen) == 0 &&
+                (path[rootLen] == '\0' || path[rootLen] == '/' || rootLen == 1);
+  dir->id = nextFidId++;
+  if (dir->inside) {
+    setWatch(dir->id, path);
+  }
+
+  fidDirs.slots[i] = dir;
+  ++fidDirs.count;
+
+  return dir;
+}
+
+static void
+startFanotify(const char *dir) {
+  rootPath = realpath(dir, NULL);
+  if (rootPath == NULL) {
+    pexit("realpath");
+  }
+
+  mountFd = open(rootPath, O_RDONLY | O_DIRECTORY);
+  if (mountFd == -1) {
+    pexit("open");
+  }
+
+  fidDirs.capacity = 2 * DLOG_INITIAL_WATCHES;
+  fidDirs.slots = calloc(fidDirs.capacity, sizeof(struct st_fid_dir *));
+  if (fidDirs.slots == NULL) {
+    pexit("calloc");
+  }
+
+  fanotifyFd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC, O_RDONLY);
+  if (fanotifyFd == -1) {
+    pexit("fanotify_init");
+  }
+
+  /* the flags of the events are those of inotify */
+  if (fanotify_mark(fanotifyFd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                    FAN_ACCESS | FAN_MODIFY | FAN_ATTRIB | FAN_CLOSE | FAN_OPEN | FAN_MOVE |
+                    FAN_CREATE | FAN_DELETE | FAN_DELETE_SELF | FAN_MOVE_SELF | FAN_ONDIR,
+                    AT_FDCWD, rootPath) == -1) {
+    pexit("fanotify_mark");
+  }
+}
+
+/* logs the events read from fanotify, as those of inotify */
+static void
+readFanotify(char *buf, ssize_t numRead) {
+  struct fanotify_event_metadata *meta;
+  struct fanotify_event_info_header *header;
+  struct fanotify_event_info_fid *fid;
+  struct file_handle *handle;
+  struct st_fid_dir *dir;
+  union {
+    struct inotify_event event;
+    char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+  } translated;
+  struct inotify_event *event = &translated.event;
+  const char *name;
+  char *p;
+
+  for (meta = (struct fanotify_event_metadata *) buf; FAN_EVENT_OK(meta, numRead);
+       meta = FAN_EVENT_NEXT(meta, numRead)) {
+    if (meta->vers != FANOTIFY_METADATA_VERSION) {
+      Fatal("Unexpected fanotify metadata version %d\n", meta->vers);
+    }
+
+    memset(event, 0, sizeof(struct inotify_event));
+
+    if (meta->mask & FAN_Q_OVERFLOW) {
+      event->wd = -1;
+      event->mask = IN_Q_OVERFLOW;
+      logEvent(event);
+      continue;
+    }
+
+    /* the directory is in the first record with a handle */
+    handle = NULL;
+    name = ".";
+    for (p = (char *) (meta + 1); p < (char *) meta + meta->event_len; p += header->len) {
+      header = (struct fanotify_event_info_header *) p;
+
+      if (header->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME || header->info_type == FAN_EVENT_INFO_TYPE_DFID) {
+        fid = (struct fanotify_event_info_fid *) header;
+        handle = (struct file_handle *) fid->handle;
+
+        if (header->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+          name = (const char *) handle->f_handle + handle->handle_bytes;
+        }
+        break;
+      }
+    }
+
+    if (handle == NULL || (dir = fidDirectory(handle)) == NULL || !dir->inside) {
+      continue;
+    }
+
+    /* events on the directory itself are named "." */
+    event->wd = dir->id;
+    event->mask = meta->mask & (IN_ALL_EVENTS | IN_ISDIR);
+    if (strcmp(name, ".") != 0) {
+      strncpy(event->name, name, NAME_MAX);
+      event->len = strlen(event->name) + 1;
+    }
+
+    logEvent(event);
+
+    if (event->mask & IN_DELETE_SELF) {
+      logAllPending();
+      rmWatch(dir->id);
+      dir->inside = 0;
+      dir->id = -1;
     }
   }
 }
@@ -193,53 +783,195 @@ installMonitor(const char *fpath, const struct stat *sb, int typeflag, __attribu
 
 char *
 pathPrefix(int wd) {
-  int i;
+  struct st_watched_subdir *entry;
+
+  entry = watchedDirs.byWd[findWd(wd)];
+  if (entry == NULL) {
+    Fatal("Could not find path prefix for wd %d\n", wd);
+  }
+
+  return entry->fpath;
+}
+
+static long long
+now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void
+logModify(int wd, const char *name, unsigned long count) {
+  if (journaling) {
+    if (djournalAppend(&journal, pathPrefix(wd), name, IN_MODIFY, 0, count) == -1) {
+      pexit("djournalAppend");
+    }
+  } else if (count == 1) {
+    printf("[INFO] File %s/%s was modified\n", pathPrefix(wd), name);
+  } else {
+    printf("[INFO] File %s/%s was modified (%lu times)\n", pathPrefix(wd), name, count);
+  }
+}
+
+/* the slot of the modifications of file `name` in watched directory `wd` in
+ * the pending table, or the free one where they would go */
+static struct st_pending_modify *
+findPending(int wd, const char *name) {
+  size_t i;
+  const char *c;
+
+  /* FNV-1a, of the watch descriptor and the name */
+  i = (2166136261u ^ (unsigned) wd) * 16777619u;
+  for (c = name; *c != '\0'; ++c) {
+    i = (i ^ (unsigned char) *c) * 16777619u;
+  }
+
+  for (i &= DLOG_PENDING_MAX - 1; pending[i].wd != -1; i = (i + 1) & (DLOG_PENDING_MAX - 1)) {
+    if (pending[i].wd == wd && strcmp(pending[i].name, name) == 0) {
+      break;
+    }
+  }
+
+  return &pending[i];
+}
+
+static void
+countModify(struct inotify_event *event) {
+  struct st_pending_modify *entry;
+
+  if (2 * pendingCount >= DLOG_PENDING_MAX) {
+    logAllPending();
+  }
 
-  for (i = 0; i < watchedDirsCount; ++i) {
-    if (watchedDirs[i]->wd == wd) {
-      return watchedDirs[i]->fpath;
+  entry = findPending(event->wd, event->name);
+  if (entry->wd == -1) {
+    if (pendingCount == 0) {
+      windowStart = now();
     }
+
+    entry->wd = event->wd;
+    strncpy(entry->name, event->name, NAME_MAX);
+    entry->count = 0;
+    ++pendingCount;
   }
 
-  Fatal("Could not find path prefix for wd %d\n", wd);
+  ++entry->count;
+}
+
+/* logs the modifications counted of the file of `event`, before the event itself */
+static void
+logPending(struct inotify_event *event) {
+  struct st_pending_modify *entry;
+
+  entry = findPending(event->wd, event->name);
+  if (entry->wd != -1 && entry->count > 0) {
+    logModify(entry->wd, entry->name, entry->count);
+    entry->count = 0;
+  }
+}
+
+/* logs all the modifications counted, ending the window */
+static void
+logAllPending() {
+  size_t i;
+
+  for (i = 0; i < DLOG_PENDING_MAX; ++i) {
+    if (pending[i].wd != -1) {
+      if (pending[i].count > 0) {
+        logModify(pending[i].wd, pending[i].name, pending[i].count);
+      }
+
+      pending[i].wd = -1;
+    }
+  }
+
+  pendingCount = 0;
 }
 
 static void
 logEvent(struct inotify_event *event) {
 #define Dlog(label, msg) { \
-  printf("[%s] ", label); \
   if (event->len > 0) { \
-    if (event->mask & IN_ISDIR) { \
-      printf("Directory %s/%s %s\n", pathPrefix(event->wd), event->name, msg); \
-    } else { \
-      printf("File %s/%s %s\n", pathPrefix(event->wd), event->name, msg); \
-    } \
+    printf("[%s] %s %s/%s %s\n", label, (event->mask & IN_ISDIR) ? "Directory" : "File", \
+           pathPrefix(event->wd), event->name, msg); \
   } else { \
-    printf("Directory %s %s\n", pathPrefix(event->wd), msg); \
+    printf("[%s] Directory %s %s\n", label, pathPrefix(event->wd), msg); \
   } \
 }
 
-  if (event->mask & IN_ACCESS)        Dlog("INFO", "was accessed");
-  if (event->mask & IN_ATTRIB)        Dlog("INFO", "had its metadata changed");
-  if (event->mask & IN_CLOSE_NOWRITE) Dlog("INFO", "was closed (read-only)");
-  if (event->mask & IN_CLOSE_WRITE)   Dlog("INFO", "was closed");
-  if (event->mask & IN_CREATE)        Dlog("INFO", "was created");
-  if (event->mask & IN_DELETE)        Dlog("INFO", "was deleted");
-  if (event->mask & IN_DELETE_SELF)   Dlog("WARNING", "was deleted (watched directory)");
-  if (event->mask & IN_IGNORED)       Dlog("WARNING", "is no longer being watched (maybe it was deleted?)");
-  if (event->mask & IN_MODIFY)        Dlog("INFO", "was modified");
-  if (event->mask & IN_MOVE_SELF)     Dlog("INFO", "was moved");
-  if (event->mask & IN_MOVED_FROM)    Dlog("INFO", "was moved");
-  if (event->mask & IN_MOVED_TO)      Dlog("INFO", "was moved");
-  if (event->mask & IN_OPEN)          Dlog("INFO", "was opened");
-  if (event->mask & IN_Q_OVERFLOW)    Dlog("FATAL", "too many queued file events");
-  if (event->mask & IN_UNMOUNT)       Dlog("INFO", "was unmounted");
+  /* the event is not about any watch */
+  if (event->mask & IN_Q_OVERFLOW) {
+    if (journaling) {
+      if (djournalAppend(&journal, NULL, NULL, IN_Q_OVERFLOW, 0, 0) == -1) {
+        pexit("djournalAppend");
+      }
+    } else {
+      printf("[FATAL] too many queued file events: some were lost\n");
+    }
+    return;
+  }
+
+  if (pendingCount > 0) {
+    /* the paths pending modifications are logged with are about to change */
+    if (event->mask & (IN_IGNORED | IN_MOVED_FROM | IN_MOVED_TO) &&
+        (event->mask & IN_ISDIR || event->len == 0)) {
+      logAllPending();
+    } else if (event->len > 0 && event->mask != IN_MODIFY) {
+      logPending(event);
+    }
+  }
+
+  if (event->mask == IN_MODIFY && event->len > 0 && windowMs > 0) {
+    countModify(event);
+    return;
+  }
+
+  if (journaling) {
+    if (djournalAppend(&journal, pathPrefix(event->wd), (event->len > 0) ? event->name : NULL,
+                       event->mask, event->cookie, 1) == -1) {
+      pexit("djournalAppend");
+    }
+  } else {
+    if (event->mask & IN_ACCESS)        Dlog("INFO", "was accessed");
+    if (event->mask & IN_ATTRIB)        Dlog("INFO", "had its metadata changed");
+    if (event->mask & IN_CLOSE_NOWRITE) Dlog("INFO", "was closed (read-only)");
+    if (event->mask & IN_CLOSE_WRITE)   Dlog("INFO", "was closed");
+    if (event->mask & IN_CREATE)        Dlog("INFO", "was created");
+    if (event->mask & IN_DELETE)        Dlog("INFO", "was deleted");
+    if (event->mask & IN_DELETE_SELF)   Dlog("WARNING", "was deleted (watched directory)");
+    if (event->mask & IN_IGNORED)       Dlog("WARNING", "is no longer being watched (maybe it was deleted?)");
+    if (event->mask & IN_MODIFY)        Dlog("INFO", "was modified");
+    if (event->mask & IN_MOVE_SELF)     Dlog("INFO", "was moved");
+    if (event->mask & IN_MOVED_FROM)    Dlog("INFO", "was moved");
+    if (event->mask & IN_MOVED_TO)      Dlog("INFO", "was moved");
+    if (event->mask & IN_OPEN)          Dlog("INFO", "was opened");
+    if (event->mask & IN_UNMOUNT)       Dlog("INFO", "was unmounted");
+  }
 
   if (event->mask & IN_IGNORED) {
     rmWatch(event->wd);
   }
 
-  if (event->mask & IN_ISDIR && event->mask & IN_CREATE) {
+  /* a directory moved within the tree takes its watches along */
+  if (event->mask & IN_ISDIR && event->mask & IN_MOVED_FROM) {
+    movedCookie = event->cookie;
+    movedFromWd = event->wd;
+    strncpy(movedFromName, event->name, NAME_MAX);
+  }
+
+  if (event->mask & IN_ISDIR && event->mask & IN_MOVED_TO && event->cookie == movedCookie &&
+      movedFromWd != -1 && watchedDirs.byWd[findWd(movedFromWd)] != NULL) {
+    char from[PATH_MAX], to[PATH_MAX];
+    snprintf(from, PATH_MAX, "%s/%s", pathPrefix(movedFromWd), movedFromName);
+    snprintf(to, PATH_MAX, "%s/%s", pathPrefix(event->wd), event->name);
+
+    renameWatches(from, to);
+    movedFromWd = -1;
+  }
+
+  /* fanotify reports events in new directories already */
+  if (event->mask & IN_ISDIR && event->mask & IN_CREATE && fanotifyFd == -1) {
     char path[PATH_MAX];
     snprintf(path, PATH_MAX, "%s/%s", pathPrefix(event->wd), event->name);
 
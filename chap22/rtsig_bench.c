@@ -0,0 +1,381 @@
+/* rtsig_bench.c - measures the throughput and latency of realtime signals.
+ *
+ * A number of sender processes queue realtime signals to their parent with
+ * sigqueue(3), as fast as they can, each carrying the time it was sent as its
+ * data. The parent receives them in one of three ways:
+ *
+ *    handler - an SA_SIGINFO signal handler, waiting with sigsuspend(2).
+ *    wait    - sigwaitinfo(2), one signal per call, with the signal blocked.
+ *    fd      - read(2)s of a signalfd(2), many signals per call.
+ *
+ * and reports how many signals per second arrived, how long they took to arrive
+ * (from sigqueue(3) until the receiver got them) and how many were dropped.
+ *
+ * Realtime signals are queued, but the queue is bounded, by RLIMIT_SIGPENDING:
+ * the number of signals pending for all the processes of a real user ID. Once
+ * it is full, sigqueue(3) fails with EAGAIN and the signal is never delivered;
+ * senders count those as drops, or retry until the signal is queued with -r.
+ * The limit can be lowered with -q, to see how receivers cope with overflows.
+ *
+ * Senders start together, once they are all created, and tell the receiver they
+ * are done with a last signal carrying no timestamp, which is never dropped.
+ *
+ * Usage
+ *
+ *    $ ./rtsig_bench [-s senders] [-n signals] [-m handler|wait|fd] [-b batch] [-r]
+ *                    [-q sigpending] [-S sig]
+ *
+ *    -s: the number of sender processes (default: 4).
+ *    -n: the number of signals each sender queues (default: 100000).
+ *    -m: how signals are received (default: fd).
+ *    -b: the number of signals read at a time from the signalfd (default: 64).
+ *    -r: retry signals not queued, instead of dropping them.
+ *    -q: the RLIMIT_SIGPENDING soft limit to set (default: unchanged).
+ *    -S: the signal number to use (default: SIGRTMIN).
+ *
+ * Example
+ *
+ *    $ ./rtsig_bench -s 4 -n 100000 -m fd -b 256
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _GNU_SOURCE /* signalfd and sigqueue */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_SENDERS (4)
+#define DEFAULT_SIGNALS (100000)
+#define DEFAULT_BATCH (64)
+
+enum receiveMode { RECEIVE_HANDLER, RECEIVE_WAIT, RECEIVE_FD };
+
+/* what each sender did, in memory shared with the receiver */
+struct senderStats {
+  long sent;
+  long dropped;
+  long retries;
+};
+
+static void helpAndLeave(const char *progname, int status);
+static void pexit(const char *fCall);
+
+/* latencies of the signals received, in nanoseconds */
+static long long *latencies;
+static volatile long received;
+static volatile int sendersDone;
+
+static long long
+now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* accounts for a signal carrying `value`: the time it was sent, or zero for the
+ * last signal of a sender */
+static void
+receive(long long value, long long at) {
+  if (value == 0) {
+    ++sendersDone;
+  } else {
+    latencies[received++] = at - value;
+  }
+}
+
+static void
+handler(__attribute__((unused)) int sig, siginfo_t *si, __attribute__((unused)) void *ucontext) {
+  receive((long long) (intptr_t) si->si_value.sival_ptr, now());
+}
+
+static void
+queueSignal(pid_t pid, int sig, long long value, int retry, struct senderStats *stats) {
+  union sigval sv;
+
+  sv.sival_ptr = (void *) (intptr_t) value;
+  while (sigqueue(pid, sig, sv) == -1) {
+    if (errno != EAGAIN) {
+      pexit("sigqueue");
+    }
+
+    /* the queue is full: let the receiver catch up */
+    if (!retry) {
+      ++stats->dropped;
+      return;
+    }
+
+    ++stats->retries;
+    sched_yield();
+  }
+
+  ++stats->sent;
+}
+
+static void
+sender(pid_t receiver, int sig, long signals, int retry, int startFd, struct senderStats *stats) {
+  char c;
+  long i;
+
+  /* wait for the other senders to be created */
+  if (read(startFd, &c, 1) == -1) {
+    pexit("read");
+  }
+
+  for (i = 0; i < signals; ++i) {
+    queueSignal(receiver, sig, now(), retry, stats);
+  }
+
+  /* the last one always gets there */
+  queueSignal(receiver, sig, 0, 1, stats);
+  --stats->sent;
+}
+
+static int
+compareLatencies(const void *a, const void *b) {
+  long long x = *(const long long *) a, y = *(const long long *) b;
+
+  return (x > y) - (x < y);
+}
+
+static double
+percentile(double p) {
+  long i = (long) (p * (received - 1));
+
+  return latencies[i] / 1000.0;
+}
+
+int
+main(int argc, char *argv[]) {
+  long senders = DEFAULT_SENDERS, signals = DEFAULT_SIGNALS, batch = DEFAULT_BATCH;
+  enum receiveMode mode = RECEIVE_FD;
+  int opt, retry = 0, sig = SIGRTMIN;
+  long sigpending = -1;
+
+  while ((opt = getopt(argc, argv, "s:n:m:b:rq:S:h")) != -1) {
+    switch (opt) {
+      case 's': senders = atol(optarg); break;
+      case 'n': signals = atol(optarg); break;
+      case 'b': batch = atol(optarg); break;
+      case 'r': retry = 1; break;
+      case 'q': sigpending = atol(optarg); break;
+      case 'S': sig = atoi(optarg); break;
+      case 'h': helpAndLeave(argv[0], EXIT_SUCCESS); break;
+
+      case 'm':
+        if (!strcmp(optarg, "handler")) {
+          mode = RECEIVE_HANDLER;
+        } else if (!strcmp(optarg, "wait")) {
+          mode = RECEIVE_WAIT;
+        } else if (!strcmp(optarg, "fd")) {
+          mode = RECEIVE_FD;
+        } else {
+          helpAndLeave(argv[0], EXIT_FAILURE);
+        }
+        break;
+
+      default:
+        helpAndLeave(argv[0], EXIT_FAILURE);
+    }
+  }
+
+  if (senders < 1 || signals < 1 || batch < 1 || sig < SIGRTMIN || sig > SIGRTMAX) {
+    helpAndLeave(argv[0], EXIT_FAILURE);
+  }
+
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_SIGPENDING, &rl) == -1) {
+    pexit("getrlimit");
+  }
+
+  if (sigpending >= 0) {
+    rl.rlim_cur = sigpending;
+    if (setrlimit(RLIMIT_SIGPENDING, &rl) == -1) {
+      pexit("setrlimit");
+    }
+  }
+
+  latencies = malloc(senders * signals * sizeof(long long));
+  if (latencies == NULL) {
+    pexit("malloc");
+  }
+
+  struct senderStats *stats = mmap(NULL, senders * sizeof(struct senderStats),
+                                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (stats == MAP_FAILED) {
+    pexit("mmap");
+  }
+
+  /* the signal is blocked all along (but within sigsuspend(2), for handlers),
+   * so that none is missed while setting up */
+  sigset_t mask, prevMask;
+  sigemptyset(&mask);
+  sigaddset(&mask, sig);
+  if (sigprocmask(SIG_BLOCK, &mask, &prevMask) == -1) {
+    pexit("sigprocmask");
+  }
+
+  int sfd = -1;
+  struct signalfd_siginfo *infos = NULL;
+  struct sigaction sa;
+
+  switch (mode) {
+    case RECEIVE_HANDLER:
+      memset(&sa, 0, sizeof(struct sigaction));
+      sa.sa_sigaction = handler;
+      sa.sa_flags = SA_SIGINFO | SA_RESTART;
+      sigemptyset(&sa.sa_mask);
+
+      if (sigaction(sig, &sa, NULL) == -1) {
+        pexit("sigaction");
+      }
+      break;
+
+    case RECEIVE_FD:
+      sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+      if (sfd == -1) {
+        pexit("signalfd");
+      }
+
+      infos = malloc(batch * sizeof(struct signalfd_siginfo));
+      if (infos == NULL) {
+        pexit("malloc");
+      }
+      break;
+
+    case RECEIVE_WAIT:
+      break;
+  }
+
+  int startPipe[2];
+  if (pipe(startPipe) == -1) {
+    pexit("pipe");
+  }
+
+  pid_t receiver = getpid();
+  long i;
+
+  pid_t pid;
+  for (i = 0; i < senders; ++i) {
+    if ((pid = fork()) == -1) {
+      pexit("fork");
+    }
+
+    if (pid == 0) {
+      close(startPipe[1]);
+      sender(receiver, sig, signals, retry, startPipe[0], &stats[i]);
+      _exit(EXIT_SUCCESS);
+    }
+  }
+
+  /* closing the pipe wakes all the senders up at once */
+  close(startPipe[0]);
+  long long start = now();
+  close(startPipe[1]);
+
+  siginfo_t si;
+  ssize_t numRead;
+  long reads = 0, j;
+
+  while (sendersDone < senders) {
+    switch (mode) {
+      case RECEIVE_HANDLER:
+        sigsuspend(&prevMask);
+        ++reads;
+        break;
+
+      case RECEIVE_WAIT:
+        if (sigwaitinfo(&mask, &si) == -1) {
+          if (errno == EINTR) {
+            continue;
+          }
+          pexit("sigwaitinfo");
+        }
+
+        receive((long long) (intptr_t) si.si_value.sival_ptr, now());
+        ++reads;
+        break;
+
+      case RECEIVE_FD:
+        numRead = read(sfd, infos, batch * sizeof(struct signalfd_siginfo));
+        if (numRead == -1) {
+          if (errno == EINTR) {
+            continue;
+          }
+          pexit("read");
+        }
+
+        long long at = now();
+        for (j = 0; j < numRead / (ssize_t) sizeof(struct signalfd_siginfo); ++j) {
+          receive((long long) infos[j].ssi_ptr, at);
+        }
+        ++reads;
+        break;
+    }
+  }
+
+  long long elapsed = now() - start;
+
+  while (wait(NULL) > 0) {
+    continue;
+  }
+
+  long sent = 0, dropped = 0, retries = 0;
+  for (i = 0; i < senders; ++i) {
+    sent += stats[i].sent;
+    dropped += stats[i].dropped;
+    retries += stats[i].retries;
+  }
+
+  printf("mode:        %s\n", (mode == RECEIVE_HANDLER) ? "handler" : (mode == RECEIVE_WAIT) ? "wait" : "fd");
+  printf("senders:     %ld x %ld signals\n", senders, signals);
+  printf("sigpending:  %lld\n", (long long) rl.rlim_cur);
+  printf("sent:        %ld\n", sent);
+  printf("received:    %ld\n", (long) received);
+  printf("dropped:     %ld (%.2f%%)\n", dropped, 100.0 * dropped / (senders * signals));
+  printf("retries:     %ld\n", retries);
+  printf("wake-ups:    %ld (%.1f signals each)\n", reads, reads ? (double) received / reads : 0.0);
+  printf("elapsed:     %.3fs\n", elapsed / 1e9);
+  printf("throughput:  %.0f signals/s\n", received / (elapsed / 1e9));
+
+  if (received > 0) {
+    qsort(latencies, received, sizeof(long long), compareLatencies);
+    printf("latency:     median %.1fus, p99 %.1fus, max %.1fus\n",
+           percentile(0.5), percentile(0.99), percentile(1));
+  }
+
+  exit(EXIT_SUCCESS);
+}
+
+static void
+helpAndLeave(const char *progname, int status) {
+  FILE *stream = stderr;
+
+  if (status == EXIT_SUCCESS) {
+    stream = stdout;
+  }
+
+  fprintf(stream, "Usage: %s [-s senders] [-n signals] [-m handler|wait|fd] [-b batch] [-r] "
+                  "[-q sigpending] [-S sig]\n", progname);
+  exit(status);
+}
+
+static void
+pexit(const char *fCall) {
+  perror(fCall);
+  exit(EXIT_FAILURE);
+}
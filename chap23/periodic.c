@@ -0,0 +1,409 @@
+/* periodic.c - Periodic tasks on POSIX timers, run by a fixed pool of threads.
+ * See periodic.h.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _GNU_SOURCE /* SIGEV_THREAD_ID and pthread_sigqueue */
+
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <stdlib.h>
+
+#include "periodic.h"
+
+#ifndef sigev_notify_thread_id
+#  define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/* signals read from the signalfd at a time */
+#define BATCH (64)
+
+/* `slot` of tasks removed */
+#define REMOVED ((size_t) -1)
+
+/* the value carried by the signals of the timer of the task in `slot` */
+#define ENCODE(slot, generation) ((void *) (uintptr_t) (((uint64_t) (generation) << 32) | (slot)))
+#define SLOT(value) ((size_t) ((value) & 0xffffffff))
+#define GENERATION(value) ((uint32_t) ((value) >> 32))
+
+static void
+enqueue(struct periodicScheduler *sched, struct periodicTask *task) {
+  task->next = NULL;
+  task->queued = 1;
+
+  if (sched->tail == NULL) {
+    sched->head = task;
+  } else {
+    sched->tail->next = task;
+  }
+  sched->tail = task;
+}
+
+static struct periodicTask *
+dequeue(struct periodicScheduler *sched) {
+  struct periodicTask *task = sched->head;
+
+  sched->head = task->next;
+  if (sched->head == NULL) {
+    sched->tail = NULL;
+  }
+
+  task->queued = 0;
+  return task;
+}
+
+/* reads the signals of the timers, adding up the expirations of each task and
+ * queueing those not queued or running already */
+static void *
+dispatch(void *arg) {
+  struct periodicScheduler *sched = arg;
+  struct signalfd_siginfo infos[BATCH];
+  struct periodicSlot *slot;
+  struct periodicTask *task;
+  ssize_t numRead;
+  int i, n, queued, stop;
+
+  pthread_mutex_lock(&sched->lock);
+  sched->dispatcherTid = syscall(SYS_gettid);
+  pthread_cond_broadcast(&sched->idle);
+  pthread_mutex_unlock(&sched->lock);
+
+  for (;;) {
+    numRead = read(sched->sfd, infos, sizeof(infos));
+    if (numRead == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    n = numRead / sizeof(struct signalfd_siginfo);
+    queued = 0;
+
+    pthread_mutex_lock(&sched->lock);
+    for (i = 0; i < n; ++i) {
+      /* anything else is periodicDestroy waking us up */
+      if (infos[i].ssi_code != SI_TIMER) {
+        continue;
+      }
+
+      /* signals of timers deleted before they were read are stale */
+      if (SLOT(infos[i].ssi_ptr) >= sched->maxTasks) {
+        continue;
+      }
+
+      slot = &sched->slots[SLOT(infos[i].ssi_ptr)];
+      if (slot->generation != GENERATION(infos[i].ssi_ptr) || slot->task == NULL) {
+        continue;
+      }
+
+      task = slot->task;
+      task->expirations += 1 + infos[i].ssi_overrun;
+      ++sched->signals;
+
+      if (!task->queued && !task->running) {
+        enqueue(sched, task);
+        ++queued;
+      }
+    }
+
+    ++sched->reads;
+    if (queued == 1) {
+      pthread_cond_signal(&sched->ready);
+    } else if (queued > 1) {
+      pthread_cond_broadcast(&sched->ready);
+    }
+
+    stop = sched->stopping;
+    pthread_mutex_unlock(&sched->lock);
+
+    if (stop) {
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+static void *
+work(void *arg) {
+  struct periodicScheduler *sched = arg;
+  struct periodicTask *task;
+  long expirations;
+
+  pthread_mutex_lock(&sched->lock);
+  for (;;) {
+    while (sched->head == NULL && !sched->stopping) {
+      pthread_cond_wait(&sched->ready, &sched->lock);
+    }
+
+    if (sched->stopping) {
+      break;
+    }
+
+    task = dequeue(sched);
+    if (task->slot == REMOVED) {
+      pthread_cond_broadcast(&sched->idle);
+      continue;
+    }
+
+    expirations = task->expirations;
+    task->expirations = 0;
+    task->running = 1;
+    task->worker = pthread_self();
+    ++task->runs;
+    task->coalesced += expirations - 1;
+    pthread_mutex_unlock(&sched->lock);
+
+    task->fn(task, expirations, task->arg);
+
+    pthread_mutex_lock(&sched->lock);
+    task->running = 0;
+
+    if (task->slot == REMOVED) {
+      pthread_cond_broadcast(&sched->idle);
+    } else if (task->expirations > 0) {
+      /* it expired while running: back to the end of the queue */
+      enqueue(sched, task);
+    }
+  }
+  pthread_mutex_unlock(&sched->lock);
+
+  return NULL;
+}
+
+/* stops the threads started, and wakes up the dispatcher with a signal that
+ * does not come from a timer */
+static void
+stopThreads(struct periodicScheduler *sched, int workers, int dispatcher) {
+  union sigval sv;
+  int i;
+
+  pthread_mutex_lock(&sched->lock);
+  sched->stopping = 1;
+  pthread_cond_broadcast(&sched->ready);
+  pthread_mutex_unlock(&sched->lock);
+
+  for (i = 0; i < workers; ++i) {
+    pthread_join(sched->workers[i], NULL);
+  }
+
+  if (dispatcher) {
+    sv.sival_ptr = NULL;
+    pthread_sigqueue(sched->dispatcher, sched->sig, sv);
+    pthread_join(sched->dispatcher, NULL);
+  }
+}
+
+static void
+freeScheduler(struct periodicScheduler *sched) {
+  if (sched->sfd != -1) {
+    close(sched->sfd);
+  }
+
+  pthread_cond_destroy(&sched->idle);
+  pthread_cond_destroy(&sched->ready);
+  pthread_mutex_destroy(&sched->lock);
+
+  free(sched->workers);
+  free(sched->slots);
+}
+
+int
+periodicInit(struct periodicScheduler *sched, int workers, size_t maxTasks, int sig) {
+  sigset_t mask, prevMask;
+  size_t i;
+  int s, started;
+
+  if (workers < 1 || maxTasks < 1 || maxTasks > 0xffffffff) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  sched->sig = sig;
+  sched->sfd = -1;
+  sched->dispatcherTid = 0;
+  sched->nworkers = workers;
+  sched->head = sched->tail = NULL;
+  sched->stopping = 0;
+  sched->maxTasks = maxTasks;
+  sched->firstFree = 0;
+  sched->count = 0;
+  sched->signals = sched->reads = 0;
+
+  pthread_mutex_init(&sched->lock, NULL);
+  pthread_cond_init(&sched->ready, NULL);
+  pthread_cond_init(&sched->idle, NULL);
+
+  sched->workers = malloc(workers * sizeof(pthread_t));
+  sched->slots = malloc(maxTasks * sizeof(struct periodicSlot));
+  if (sched->workers == NULL || sched->slots == NULL) {
+    freeScheduler(sched);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  for (i = 0; i < maxTasks; ++i) {
+    sched->slots[i].task = NULL;
+    sched->slots[i].generation = 0;
+    sched->slots[i].nextFree = i + 1;
+  }
+
+  sigemptyset(&mask);
+  sigaddset(&mask, sig);
+
+  sched->sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+  if (sched->sfd == -1) {
+    s = errno;
+    freeScheduler(sched);
+    errno = s;
+    return -1;
+  }
+
+  /* the dispatcher is created with the signal blocked - the one thread that has
+   * it blocked, and the one its signals are sent to */
+  pthread_sigmask(SIG_BLOCK, &mask, &prevMask);
+  s = pthread_create(&sched->dispatcher, NULL, dispatch, sched);
+  pthread_sigmask(SIG_SETMASK, &prevMask, NULL);
+
+  if (s != 0) {
+    freeScheduler(sched);
+    errno = s;
+    return -1;
+  }
+
+  for (started = 0; started < workers; ++started) {
+    s = pthread_create(&sched->workers[started], NULL, work, sched);
+    if (s != 0) {
+      stopThreads(sched, started, 1);
+      freeScheduler(sched);
+      errno = s;
+      return -1;
+    }
+  }
+
+  /* timers cannot be created before the dispatcher tells its thread ID */
+  pthread_mutex_lock(&sched->lock);
+  while (sched->dispatcherTid == 0) {
+    pthread_cond_wait(&sched->idle, &sched->lock);
+  }
+  pthread_mutex_unlock(&sched->lock);
+
+  return 0;
+}
+
+void
+periodicDestroy(struct periodicScheduler *sched) {
+  size_t i;
+
+  /* no more signals for the dispatcher, which is about to go away */
+  pthread_mutex_lock(&sched->lock);
+  for (i = 0; i < sched->maxTasks; ++i) {
+    if (sched->slots[i].task != NULL) {
+      timer_delete(sched->slots[i].task->timer);
+      sched->slots[i].task->slot = REMOVED;
+      sched->slots[i].task = NULL;
+    }
+  }
+  pthread_mutex_unlock(&sched->lock);
+
+  stopThreads(sched, sched->nworkers, 1);
+  freeScheduler(sched);
+}
+
+int
+periodicAdd(struct periodicScheduler *sched, struct periodicTask *task,
+            const struct timespec *first, const struct timespec *period,
+            periodicFn fn, void *arg) {
+  struct periodicSlot *slot;
+  struct itimerspec its;
+  struct sigevent sev;
+  size_t index;
+  int s;
+
+  task->fn = fn;
+  task->arg = arg;
+  task->next = NULL;
+  task->expirations = 0;
+  task->queued = task->running = 0;
+  task->runs = task->coalesced = 0;
+  task->slot = REMOVED;
+
+  pthread_mutex_lock(&sched->lock);
+
+  if (sched->firstFree == sched->maxTasks) {
+    pthread_mutex_unlock(&sched->lock);
+    errno = EAGAIN;
+    return -1;
+  }
+
+  index = sched->firstFree;
+  slot = &sched->slots[index];
+
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = sched->sig;
+  sev.sigev_value.sival_ptr = ENCODE(index, slot->generation);
+  sev.sigev_notify_thread_id = sched->dispatcherTid;
+
+  if (timer_create(CLOCK_MONOTONIC, &sev, &task->timer) == -1) {
+    s = errno;
+    pthread_mutex_unlock(&sched->lock);
+    errno = s;
+    return -1;
+  }
+
+  /* in the table before it is armed: its first signal may be read as soon as
+   * the lock is released */
+  sched->firstFree = slot->nextFree;
+  slot->task = task;
+  task->slot = index;
+  ++sched->count;
+
+  its.it_value = *first;
+  its.it_interval = *period;
+  if (timer_settime(task->timer, TIMER_ABSTIME, &its, NULL) == -1) {
+    s = errno;
+    pthread_mutex_unlock(&sched->lock);
+    periodicRemove(sched, task);
+    errno = s;
+    return -1;
+  }
+
+  pthread_mutex_unlock(&sched->lock);
+  return 0;
+}
+
+void
+periodicRemove(struct periodicScheduler *sched, struct periodicTask *task) {
+  struct periodicSlot *slot;
+
+  pthread_mutex_lock(&sched->lock);
+
+  if (task->slot != REMOVED) {
+    timer_delete(task->timer);
+
+    /* a new generation, so that signals still queued for the timer deleted are
+     * not taken for those of the next task in the slot */
+    slot = &sched->slots[task->slot];
+    slot->task = NULL;
+    ++slot->generation;
+    slot->nextFree = sched->firstFree;
+    sched->firstFree = task->slot;
+    --sched->count;
+
+    task->slot = REMOVED;
+  }
+
+  if (!(task->running && pthread_equal(task->worker, pthread_self()))) {
+    while (task->queued || task->running) {
+      pthread_cond_wait(&sched->idle, &sched->lock);
+    }
+  }
+
+  pthread_mutex_unlock(&sched->lock);
+}
@@ -0,0 +1,121 @@
+/* periodic.h - Periodic tasks on POSIX timers, run by a fixed pool of threads.
+ *
+ * null_evp.c shows that timer_create(2) notifies expirations with SIGALRM unless
+ * told otherwise. Programs that would rather run a function than handle a signal
+ * may ask for SIGEV_THREAD - but glibc then starts a new thread for every
+ * expiration, which at thousands of timers firing every few milliseconds costs
+ * more than the functions themselves, and lets a slow task run many times at once.
+ *
+ * This scheduler instead directs the signal of every timer, with
+ * SIGEV_THREAD_ID, at a single dispatcher thread, which reads them in batches
+ * from a signalfd(2) and hands the tasks to a fixed number of worker threads:
+ *
+ *    - a timer has at most one signal queued at a time: expirations while it is
+ *      pending are counted as overruns (timer_getoverrun(2)), which signalfd(2)
+ *      reports along with the signal;
+ *    - a task is never queued twice, nor run by two workers at once: expirations
+ *      while it waits or runs are added to those it is run for next.
+ *
+ * Tasks are therefore called with the number of expirations since they last ran,
+ * rather than once for each, and a burst of expirations costs a single run.
+ *
+ * The signal is only blocked in the dispatcher, and is sent to that thread
+ * alone, so the rest of the program need not care about it - other than not
+ * using it for anything else. Every timer holds a queued signal of its own,
+ * counted against RLIMIT_SIGPENDING, which limits how many tasks there can be.
+ *
+ * Programs using it are built along with periodic.c, and linked with -pthread
+ * (and -lrt, with glibc older than 2.17):
+ *
+ *    $ gcc -o periodic_tasks periodic_tasks.c periodic.c -pthread
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#ifndef PERIODIC_H
+#define PERIODIC_H
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+struct periodicTask;
+
+/* called with the number of times the task's timer expired since it last ran */
+typedef void (*periodicFn)(struct periodicTask *task, long expirations, void *arg);
+
+/* a task, usually embedded in the structure it works on */
+struct periodicTask {
+  periodicFn fn;
+  void *arg;
+
+  timer_t timer;
+  size_t slot;               /* in the scheduler's table of tasks */
+
+  /* protected by the scheduler's lock */
+  struct periodicTask *next; /* in the queue of tasks to run */
+  long expirations;          /* not run yet */
+  int queued;
+  int running;
+  pthread_t worker;          /* running it, if `running` */
+
+  long runs;                 /* times it was run */
+  long coalesced;            /* expirations run along with others */
+};
+
+/* an entry of the table of tasks, whose index and generation identify the task
+ * to the signals of its timer - which may arrive after it is removed */
+struct periodicSlot {
+  struct periodicTask *task; /* NULL if free */
+  uint32_t generation;
+  size_t nextFree;
+};
+
+struct periodicScheduler {
+  int sig;
+  int sfd;                   /* the signalfd(2) of the dispatcher */
+  pid_t dispatcherTid;
+  pthread_t dispatcher;
+
+  pthread_t *workers;
+  int nworkers;
+
+  pthread_mutex_t lock;
+  pthread_cond_t ready;      /* tasks were queued, or the scheduler is stopping */
+  pthread_cond_t idle;       /* a task is neither queued nor running any more */
+  struct periodicTask *head, *tail;
+  int stopping;
+
+  struct periodicSlot *slots;
+  size_t maxTasks;
+  size_t firstFree;          /* maxTasks if none */
+  size_t count;
+
+  long signals;              /* timer signals read by the dispatcher */
+  long reads;                /* read(2)s of the signalfd that returned signals */
+};
+
+/* starts a scheduler of at most `maxTasks` tasks, with `workers` threads running
+ * them and expirations notified by signal `sig` (usually a realtime signal).
+ * Returns -1 on errors, with `errno` set */
+int periodicInit(struct periodicScheduler *sched, int workers, size_t maxTasks, int sig);
+
+/* stops the dispatcher and the workers - waiting for tasks running to return -
+ * and deletes the timers of the tasks still scheduled */
+void periodicDestroy(struct periodicScheduler *sched);
+
+/* schedules `task` to run `fn` with `arg` on CLOCK_MONOTONIC time `first`, and
+ * every `period` from then on (only once, if `period` is zero). Returns -1 on
+ * errors, with `errno` set - EAGAIN if there are `maxTasks` tasks already, or
+ * RLIMIT_SIGPENDING does not allow another timer */
+int periodicAdd(struct periodicScheduler *sched, struct periodicTask *task,
+                const struct timespec *first, const struct timespec *period,
+                periodicFn fn, void *arg);
+
+/* unschedules `task`, waiting for it to return if it is running. The task may
+ * be freed once this returns - unless it removed itself, from its own function,
+ * in which case it may only be freed after that function returns */
+void periodicRemove(struct periodicScheduler *sched, struct periodicTask *task);
+
+#endif
@@ -0,0 +1,316 @@
+/* periodic_tasks.c - runs many periodic tasks, on a thread pool or on SIGEV_THREAD.
+ *
+ * This program creates a number of POSIX timers, all with the same period, and
+ * runs a task on every expiration of each for a while. It then reports how many
+ * times tasks were run, how many expirations were coalesced into runs of others
+ * (overruns, or expirations while the task was waiting to run), how late tasks
+ * ran - the jitter of the timers - and the CPU time the process took.
+ *
+ * Tasks are run by the scheduler of periodic.c, on a fixed pool of threads - or,
+ * with -m thread, by glibc's SIGEV_THREAD notification, which starts a thread for
+ * every expiration (the notification that null_evp.c would get, if it asked for
+ * it), for comparison.
+ *
+ * Timers are started evenly spread over the period, unless -a is given, in
+ * which case they all expire at the same time.
+ *
+ * Every timer counts against RLIMIT_SIGPENDING: this tries to raise the limit if
+ * needed.
+ *
+ * Usage
+ *
+ *    $ ./periodic_tasks [-n tasks] [-p period_ms] [-d seconds] [-w workers] [-b busy_us]
+ *                       [-m pool|thread] [-a]
+ *
+ *    -n: the number of tasks (default: 2000).
+ *    -p: the period of every task, in milliseconds (default: 10).
+ *    -d: how long to run, in seconds (default: 5).
+ *    -w: the number of worker threads of the pool (default: 4).
+ *    -b: how long each run of a task keeps the CPU busy, in microseconds (default: 0).
+ *    -m: what runs the tasks (default: pool).
+ *    -a: start all timers at the same time.
+ *
+ * Built along with the scheduler:
+ *
+ *    $ gcc -o periodic_tasks periodic_tasks.c periodic.c -pthread
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/resource.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "periodic.h"
+
+#define DEFAULT_TASKS (2000)
+#define DEFAULT_PERIOD (10)
+#define DEFAULT_DURATION (5)
+#define DEFAULT_WORKERS (4)
+
+/* lateness histogram: buckets of a microsecond, the last one for anything later */
+#define HISTOGRAM_BUCKETS (100000)
+
+/* time given to set everything up before the first expiration */
+#define START_DELAY (200000000LL)
+
+struct job {
+  struct periodicTask task; /* on the pool */
+  timer_t timer;            /* or with SIGEV_THREAD */
+
+  long long first;          /* CLOCK_MONOTONIC time of the first expiration, in nanoseconds */
+  long expirations;         /* so far */
+};
+
+static void helpAndLeave(const char *progname, int status);
+static void pexit(const char *fCall);
+
+static long long period, busy;
+static long histogram[HISTOGRAM_BUCKETS];
+static long runs, coalesced;
+static long long maxLateness;
+
+static long long
+now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void
+toTimespec(long long ns, struct timespec *ts) {
+  ts->tv_sec = ns / 1000000000LL;
+  ts->tv_nsec = ns % 1000000000LL;
+}
+
+/* the task itself: accounts for how late its last expiration is run, and keeps
+ * the CPU busy for a while. Runs of the same job may overlap with SIGEV_THREAD */
+static void
+run(struct job *job, long expirations) {
+  long long at = now(), late, max;
+  long total;
+  long bucket;
+
+  total = __atomic_add_fetch(&job->expirations, expirations, __ATOMIC_RELAXED);
+  late = at - (job->first + (total - 1) * period);
+  if (late < 0) {
+    late = 0; /* only when runs overlap, and the later one accounts first */
+  }
+
+  bucket = late / 1000;
+  if (bucket >= HISTOGRAM_BUCKETS) {
+    bucket = HISTOGRAM_BUCKETS - 1;
+  }
+
+  __atomic_add_fetch(&histogram[bucket], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&runs, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&coalesced, expirations - 1, __ATOMIC_RELAXED);
+
+  max = __atomic_load_n(&maxLateness, __ATOMIC_RELAXED);
+  while (late > max &&
+         !__atomic_compare_exchange_n(&maxLateness, &max, late, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+
+  while (now() - at < busy)
+    ;
+}
+
+static void
+onPeriod(__attribute__((unused)) struct periodicTask *task, long expirations, void *arg) {
+  run(arg, expirations);
+}
+
+static void
+onThread(union sigval sv) {
+  struct job *job = sv.sival_ptr;
+  int overrun = timer_getoverrun(job->timer);
+
+  run(job, 1 + (overrun > 0 ? overrun : 0));
+}
+
+/* the lateness under which `fraction` of the runs were, in microseconds */
+static long
+percentile(double fraction) {
+  long i, seen = 0, target = (long) (fraction * runs);
+
+  for (i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+    seen += histogram[i];
+    if (seen > target) {
+      break;
+    }
+  }
+
+  return i;
+}
+
+static double
+cpuTime() {
+  struct rusage ru;
+
+  if (getrusage(RUSAGE_SELF, &ru) == -1) {
+    pexit("getrusage");
+  }
+
+  return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+         ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+int
+main(int argc, char *argv[]) {
+  long tasks = DEFAULT_TASKS, periodMs = DEFAULT_PERIOD, duration = DEFAULT_DURATION, busyUs = 0;
+  int opt, workers = DEFAULT_WORKERS, usePool = 1, aligned = 0;
+
+  while ((opt = getopt(argc, argv, "n:p:d:w:b:m:ah")) != -1) {
+    switch (opt) {
+      case 'n': tasks = atol(optarg); break;
+      case 'p': periodMs = atol(optarg); break;
+      case 'd': duration = atol(optarg); break;
+      case 'w': workers = atoi(optarg); break;
+      case 'b': busyUs = atol(optarg); break;
+      case 'a': aligned = 1; break;
+      case 'm':
+        if (!strcmp(optarg, "pool")) {
+          usePool = 1;
+        } else if (!strcmp(optarg, "thread")) {
+          usePool = 0;
+        } else {
+          helpAndLeave(argv[0], EXIT_FAILURE);
+        }
+        break;
+      case 'h': helpAndLeave(argv[0], EXIT_SUCCESS); break;
+      default: helpAndLeave(argv[0], EXIT_FAILURE);
+    }
+  }
+
+  if (tasks < 1 || periodMs < 1 || duration < 1 || workers < 1 || busyUs < 0) {
+    helpAndLeave(argv[0], EXIT_FAILURE);
+  }
+
+  period = periodMs * 1000000LL;
+  busy = busyUs * 1000LL;
+
+  struct job *jobs = calloc(tasks, sizeof(struct job));
+  if (jobs == NULL) {
+    pexit("calloc");
+  }
+
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_SIGPENDING, &rl) == -1) {
+    pexit("getrlimit");
+  }
+
+  if (rl.rlim_cur < (rlim_t) tasks + 64) {
+    rl.rlim_cur = tasks + 64;
+    if (rl.rlim_max < rl.rlim_cur) {
+      rl.rlim_max = rl.rlim_cur; /* privileged processes only */
+    }
+
+    if (setrlimit(RLIMIT_SIGPENDING, &rl) == -1) {
+      pexit("setrlimit");
+    }
+  }
+
+  struct periodicScheduler sched;
+  if (usePool && periodicInit(&sched, workers, tasks, SIGRTMIN) == -1) {
+    pexit("periodicInit");
+  }
+
+  struct timespec first, interval;
+  struct itimerspec its;
+  struct sigevent sev;
+  long i;
+
+  toTimespec(period, &interval);
+  long long start = now() + START_DELAY;
+
+  for (i = 0; i < tasks; ++i) {
+    jobs[i].first = start + (aligned ? 0 : i * period / tasks);
+    toTimespec(jobs[i].first, &first);
+
+    if (usePool) {
+      if (periodicAdd(&sched, &jobs[i].task, &first, &interval, onPeriod, &jobs[i]) == -1) {
+        pexit("periodicAdd");
+      }
+      continue;
+    }
+
+    memset(&sev, 0, sizeof(struct sigevent));
+    sev.sigev_notify = SIGEV_THREAD;
+    sev.sigev_notify_function = onThread;
+    sev.sigev_value.sival_ptr = &jobs[i];
+    if (timer_create(CLOCK_MONOTONIC, &sev, &jobs[i].timer) == -1) {
+      pexit("timer_create");
+    }
+
+    its.it_value = first;
+    its.it_interval = interval;
+    if (timer_settime(jobs[i].timer, TIMER_ABSTIME, &its, NULL) == -1) {
+      pexit("timer_settime");
+    }
+  }
+
+  double cpuStart = cpuTime();
+  sleep(duration);
+
+  long signals = 0, reads = 0;
+  if (usePool) {
+    signals = sched.signals;
+    reads = sched.reads;
+    periodicDestroy(&sched);
+  } else {
+    for (i = 0; i < tasks; ++i) {
+      timer_delete(jobs[i].timer);
+    }
+
+    usleep(100000); /* for threads started already to finish */
+  }
+  double cpu = cpuTime() - cpuStart;
+
+  long expirations = 0;
+  for (i = 0; i < tasks; ++i) {
+    expirations += jobs[i].expirations;
+  }
+
+  printf("tasks:       %ld, every %ldms for %lds, on %s\n", tasks, periodMs, duration,
+         usePool ? "the thread pool" : "SIGEV_THREAD");
+  printf("expirations: %ld (%.0f per second)\n", expirations, (double) expirations / duration);
+  printf("runs:        %ld, %ld expirations coalesced\n", runs, coalesced);
+  if (usePool) {
+    printf("signals:     %ld, %.1f per read(2)\n", signals, reads ? (double) signals / reads : 0.0);
+  }
+  if (runs > 0) {
+    printf("lateness:    p50 %ldus, p99 %ldus, p99.9 %ldus, max %.2fms\n",
+           percentile(0.5), percentile(0.99), percentile(0.999), maxLateness / 1e6);
+  }
+  printf("CPU time:    %.2fs (%.1f%% of a CPU)\n", cpu, 100 * cpu / duration);
+
+  exit(EXIT_SUCCESS);
+}
+
+static void
+helpAndLeave(const char *progname, int status) {
+  FILE *stream = stderr;
+
+  if (status == EXIT_SUCCESS) {
+    stream = stdout;
+  }
+
+  fprintf(stream, "Usage: %s [-n tasks] [-p period_ms] [-d seconds] [-w workers] [-b busy_us] "
+                  "[-m pool|thread] [-a]\n", progname);
+  exit(status);
+}
+
+static void
+pexit(const char *fCall) {
+  perror(fCall);
+  exit(EXIT_FAILURE);
+}
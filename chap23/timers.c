@@ -0,0 +1,296 @@
+/* timers.c - runs many timeouts at once, on a timer wheel or on a timerfd each.
+ *
+ * This program arms a number of timers, one per imaginary connection, with
+ * random timeouts, cancels some of them (as connections doing their work before
+ * they time out do), and waits in an epoll(7) loop for the rest to expire. It
+ * then reports what it took to arm and to cancel each timer, how many times the
+ * loop woke up, and how late timers expired.
+ *
+ * Timers are kept in the timer wheel of timerwheel.c, on a single timerfd - or,
+ * with -k, each gets its own timerfd, watched by epoll(7) as well, for comparison.
+ * The latter needs a file descriptor per timer: this tries to raise the limit of
+ * open files (RLIMIT_NOFILE) if needed.
+ *
+ * Usage
+ *
+ *    $ ./timers [-n timers] [-t max_timeout_ms] [-c cancel_percent] [-r tick_ms] [-k]
+ *
+ *    -n: the number of timers (default: 100000).
+ *    -t: timeouts are random, from 1 to this many milliseconds (default: 2000).
+ *    -c: the percentage of timers cancelled before they expire (default: 50).
+ *    -r: the resolution of the timer wheel, in milliseconds (default: 1).
+ *    -k: use a timerfd per timer, instead of the timer wheel.
+ *
+ * Built along with the timer wheel:
+ *
+ *    $ gcc -o timers timers.c timerwheel.c
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "timerwheel.h"
+
+#define DEFAULT_TIMERS (100000)
+#define DEFAULT_TIMEOUT (2000)
+#define DEFAULT_CANCEL (50)
+
+#define MAX_EVENTS (1024)
+
+struct connection {
+  struct timer timer; /* on the timer wheel */
+  int fd;             /* or its own timerfd */
+
+  long long due;      /* when it should time out, in nanoseconds */
+  int cancelled;
+};
+
+static void helpAndLeave(const char *progname, int status);
+static void pexit(const char *fCall);
+
+static long expired;
+static long long lateness, minLateness = INT64_MAX, maxLateness;
+
+static long long
+now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void
+timedOut(struct connection *conn) {
+  long long late = now() - conn->due;
+
+  if (late < minLateness) {
+    minLateness = late;
+  }
+
+  if (late > maxLateness) {
+    maxLateness = late;
+  }
+
+  lateness += late;
+  ++expired;
+}
+
+static void
+onTimeout(__attribute__((unused)) struct timer *timer, void *arg) {
+  timedOut(arg);
+}
+
+static void
+armTimerfd(int epfd, struct connection *conn, long ms) {
+  struct itimerspec its;
+  struct epoll_event ev;
+
+  conn->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (conn->fd == -1) {
+    pexit("timerfd_create");
+  }
+
+  memset(&its, 0, sizeof(struct itimerspec));
+  its.it_value.tv_sec = ms / 1000;
+  its.it_value.tv_nsec = (ms % 1000) * 1000000;
+  if (timerfd_settime(conn->fd, 0, &its, NULL) == -1) {
+    pexit("timerfd_settime");
+  }
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = conn;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev) == -1) {
+    pexit("epoll_ctl");
+  }
+}
+
+int
+main(int argc, char *argv[]) {
+  long timers = DEFAULT_TIMERS, timeout = DEFAULT_TIMEOUT, cancel = DEFAULT_CANCEL, tick = 1;
+  int opt, useTimerfds = 0;
+
+  while ((opt = getopt(argc, argv, "n:t:c:r:kh")) != -1) {
+    switch (opt) {
+      case 'n': timers = atol(optarg); break;
+      case 't': timeout = atol(optarg); break;
+      case 'c': cancel = atol(optarg); break;
+      case 'r': tick = atol(optarg); break;
+      case 'k': useTimerfds = 1; break;
+      case 'h': helpAndLeave(argv[0], EXIT_SUCCESS); break;
+      default: helpAndLeave(argv[0], EXIT_FAILURE);
+    }
+  }
+
+  if (timers < 1 || timeout < 1 || cancel < 0 || cancel > 100 || tick < 1) {
+    helpAndLeave(argv[0], EXIT_FAILURE);
+  }
+
+  struct connection *conns = calloc(timers, sizeof(struct connection));
+  if (conns == NULL) {
+    pexit("calloc");
+  }
+
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd == -1) {
+    pexit("epoll_create1");
+  }
+
+  struct timerWheel wheel;
+  struct epoll_event ev, events[MAX_EVENTS];
+  struct rlimit rl;
+
+  if (useTimerfds) {
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+      pexit("getrlimit");
+    }
+
+    if (rl.rlim_cur < (rlim_t) timers + 16) {
+      rl.rlim_cur = timers + 16;
+      if (rl.rlim_max < rl.rlim_cur) {
+        rl.rlim_max = rl.rlim_cur; /* privileged processes only */
+      }
+
+      if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+        pexit("setrlimit");
+      }
+    }
+  } else {
+    if (timerWheelInit(&wheel, tick) == -1) {
+      pexit("timerWheelInit");
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, timerWheelFd(&wheel), &ev) == -1) {
+      pexit("epoll_ctl");
+    }
+  }
+
+  long *timeouts = malloc(timers * sizeof(long));
+  if (timeouts == NULL) {
+    pexit("malloc");
+  }
+
+  long i;
+  srand(time(NULL));
+  for (i = 0; i < timers; ++i) {
+    timeouts[i] = 1 + rand() % timeout;
+  }
+
+  /* arm them all */
+  long long start = now();
+  for (i = 0; i < timers; ++i) {
+    conns[i].due = now() + timeouts[i] * 1000000LL;
+
+    if (useTimerfds) {
+      armTimerfd(epfd, &conns[i], timeouts[i]);
+    } else {
+      timerInit(&conns[i].timer, onTimeout, &conns[i]);
+      if (timerArm(&wheel, &conns[i].timer, timeouts[i]) == -1) {
+        pexit("timerArm");
+      }
+    }
+  }
+  long long armTime = now() - start;
+
+  /* and cancel some */
+  long cancelled = 0;
+  start = now();
+  for (i = 0; i < timers; ++i) {
+    if (i % 100 >= cancel) {
+      continue;
+    }
+
+    if (useTimerfds) {
+      close(conns[i].fd);
+    } else {
+      timerCancel(&wheel, &conns[i].timer);
+    }
+
+    conns[i].cancelled = 1;
+    ++cancelled;
+  }
+  long long cancelTime = now() - start;
+
+  long wakeups = 0;
+  int ready, j;
+  uint64_t expirations;
+  struct connection *conn;
+
+  while (expired < timers - cancelled) {
+    ready = epoll_wait(epfd, events, MAX_EVENTS, -1);
+    if (ready == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      pexit("epoll_wait");
+    }
+
+    ++wakeups;
+    for (j = 0; j < ready; ++j) {
+      conn = events[j].data.ptr;
+
+      if (conn == NULL) {
+        if (timerWheelRun(&wheel) == -1) {
+          pexit("timerWheelRun");
+        }
+        continue;
+      }
+
+      if (read(conn->fd, &expirations, sizeof(uint64_t)) == -1) {
+        pexit("read");
+      }
+
+      timedOut(conn);
+      close(conn->fd);
+    }
+  }
+
+  printf("timers:      %ld, timeouts 1-%ldms, on %s\n", timers, timeout,
+         useTimerfds ? "a timerfd each" : "the timer wheel");
+  printf("arm:         %.0fns per timer\n", (double) armTime / timers);
+  printf("cancel:      %ld, %.0fns per timer\n", cancelled, cancelled ? (double) cancelTime / cancelled : 0.0);
+  printf("expired:     %ld\n", expired);
+  printf("wake-ups:    %ld (%.1f timers each)\n", wakeups, (double) expired / wakeups);
+  if (expired > 0) {
+    printf("lateness:    min %.2fms, mean %.2fms, max %.2fms\n",
+           minLateness / 1e6, lateness / 1e6 / expired, maxLateness / 1e6);
+  }
+
+  if (!useTimerfds) {
+    timerWheelClose(&wheel);
+  }
+
+  exit(EXIT_SUCCESS);
+}
+
+static void
+helpAndLeave(const char *progname, int status) {
+  FILE *stream = stderr;
+
+  if (status == EXIT_SUCCESS) {
+    stream = stdout;
+  }
+
+  fprintf(stream, "Usage: %s [-n timers] [-t max_timeout_ms] [-c cancel_percent] [-r tick_ms] [-k]\n", progname);
+  exit(status);
+}
+
+static void
+pexit(const char *fCall) {
+  perror(fCall);
+  exit(EXIT_FAILURE);
+}
@@ -0,0 +1,333 @@
+/* timerwheel.c - Many timers on top of a single timerfd. See timerwheel.h.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <string.h>
+
+#include "timerwheel.h"
+
+#define MASK (TIMERWHEEL_SLOTS - 1)
+#define MAX_TICKS ((1ULL << (TIMERWHEEL_BITS * TIMERWHEEL_LEVELS)) - 1)
+
+/* the bucket of `level` a tick falls into */
+#define INDEX(tick, level) (((tick) >> (TIMERWHEEL_BITS * (level))) & MASK)
+
+static long long
+monotonic() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int
+isEmpty(const struct timer *head) {
+  return head->next == head;
+}
+
+static void
+removeTimer(struct timer *timer) {
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->next = timer->prev = NULL;
+}
+
+static void
+append(struct timer *head, struct timer *timer) {
+  timer->prev = head->prev;
+  timer->next = head;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+/* moves all the timers of list `from` to the end of list `to` */
+static void
+splice(struct timer *to, struct timer *from) {
+  if (isEmpty(from)) {
+    return;
+  }
+
+  from->next->prev = to->prev;
+  from->prev->next = to;
+  to->prev->next = from->next;
+  to->prev = from->prev;
+
+  from->next = from->prev = from;
+}
+
+/* the first bucket of `level`, from `slot` on, with timers - or
+ * TIMERWHEEL_SLOTS if there is none.
+ *
+ * Cancelling a timer does not know which bucket it was in, so empty buckets may
+ * still be marked as used: they are cleared here */
+static int
+nextUsed(struct timerWheel *wheel, int level, int slot) {
+  uint64_t word;
+  int i = slot, j;
+
+  while (i < TIMERWHEEL_SLOTS) {
+    word = wheel->used[level][i / 64] & (~0ULL << (i % 64));
+    if (word == 0) {
+      i = (i / 64 + 1) * 64;
+      continue;
+    }
+
+    j = (i / 64) * 64 + __builtin_ctzll(word);
+    if (!isEmpty(&wheel->buckets[level][j])) {
+      return j;
+    }
+
+    wheel->used[level][j / 64] &= ~(1ULL << (j % 64));
+    i = j + 1;
+  }
+
+  return TIMERWHEEL_SLOTS;
+}
+
+/* puts a timer in the bucket of its expiration, relative to the next tick to be
+ * processed */
+static void
+addTimer(struct timerWheel *wheel, struct timer *timer) {
+  uint64_t delta;
+  int level, slot;
+
+  if (timer->expires < wheel->now) {
+    timer->expires = wheel->now;
+  }
+
+  delta = timer->expires - wheel->now;
+  if (delta > MAX_TICKS) {
+    delta = MAX_TICKS;
+    timer->expires = wheel->now + MAX_TICKS;
+  }
+
+  for (level = 0; level < TIMERWHEEL_LEVELS - 1; ++level) {
+    if (delta < (1ULL << (TIMERWHEEL_BITS * (level + 1)))) {
+      break;
+    }
+  }
+
+  slot = INDEX(timer->expires, level);
+  append(&wheel->buckets[level][slot], timer);
+  wheel->used[level][slot / 64] |= 1ULL << (slot % 64);
+}
+
+/* redistributes a bucket into the levels below. Returns the slot, so that
+ * cascading goes on to the next level only when it wrapped around */
+static int
+cascade(struct timerWheel *wheel, int level, int slot) {
+  struct timer list, *timer;
+
+  list.next = list.prev = &list;
+  splice(&list, &wheel->buckets[level][slot]);
+  wheel->used[level][slot / 64] &= ~(1ULL << (slot % 64));
+
+  while (!isEmpty(&list)) {
+    timer = list.next;
+    removeTimer(timer);
+    addTimer(wheel, timer);
+  }
+
+  return slot;
+}
+
+/* processes all the ticks up to `target`, moving the timers expired to the
+ * expired list */
+static void
+advance(struct timerWheel *wheel, uint64_t target) {
+  uint64_t skip;
+  int index, level, next;
+
+  while (wheel->now <= target) {
+    if (wheel->count == 0) {
+      wheel->now = target + 1;
+      return;
+    }
+
+    index = wheel->now & MASK;
+    if (index == 0) {
+      for (level = 1; level < TIMERWHEEL_LEVELS; ++level) {
+        if (cascade(wheel, level, INDEX(wheel->now, level)) != 0) {
+          break;
+        }
+      }
+    }
+
+    splice(&wheel->expired, &wheel->buckets[0][index]);
+    ++wheel->now;
+
+    /* empty buckets need no processing: skip them, up to the next cascade */
+    index = wheel->now & MASK;
+    if (index != 0) {
+      next = nextUsed(wheel, 0, index);
+      skip = next - index;
+      if (skip > target + 1 - wheel->now) {
+        skip = target + 1 - wheel->now;
+      }
+
+      wheel->now += skip;
+    }
+  }
+}
+
+/* the next tick to be processed: the next with timers expiring in level 0, or
+ * the next cascade */
+static uint64_t
+nextWakeup(struct timerWheel *wheel) {
+  int index, next;
+
+  if (wheel->count == 0) {
+    return UINT64_MAX;
+  }
+
+  index = wheel->now & MASK;
+  if (index == 0 || !isEmpty(&wheel->expired)) {
+    return wheel->now;
+  }
+
+  next = nextUsed(wheel, 0, index);
+  return wheel->now + (next - index);
+}
+
+static int
+armFd(struct timerWheel *wheel, uint64_t tick) {
+  struct itimerspec its;
+  long long at;
+
+  if (tick == wheel->armedFor) {
+    return 0;
+  }
+
+  /* a zeroed value disarms the timer */
+  memset(&its, 0, sizeof(struct itimerspec));
+  if (tick != UINT64_MAX) {
+    at = wheel->start + (long long) tick * wheel->tick;
+    its.it_value.tv_sec = at / 1000000000LL;
+    its.it_value.tv_nsec = at % 1000000000LL;
+  }
+
+  if (timerfd_settime(wheel->fd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+    return -1;
+  }
+
+  wheel->armedFor = tick;
+  return 0;
+}
+
+int
+timerWheelInit(struct timerWheel *wheel, long tickMs) {
+  int level, slot;
+
+  if (tickMs <= 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(wheel, 0, sizeof(struct timerWheel));
+  for (level = 0; level < TIMERWHEEL_LEVELS; ++level) {
+    for (slot = 0; slot < TIMERWHEEL_SLOTS; ++slot) {
+      wheel->buckets[level][slot].next = wheel->buckets[level][slot].prev = &wheel->buckets[level][slot];
+    }
+  }
+
+  wheel->expired.next = wheel->expired.prev = &wheel->expired;
+  wheel->tick = tickMs * 1000000LL;
+  wheel->start = monotonic();
+  wheel->armedFor = UINT64_MAX;
+
+  wheel->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  return (wheel->fd == -1) ? -1 : 0;
+}
+
+void
+timerWheelClose(struct timerWheel *wheel) {
+  if (wheel->fd != -1) {
+    close(wheel->fd);
+  }
+
+  wheel->fd = -1;
+}
+
+int
+timerWheelFd(const struct timerWheel *wheel) {
+  return wheel->fd;
+}
+
+long
+timerWheelRun(struct timerWheel *wheel) {
+  struct timer *timer;
+  uint64_t expirations;
+  long count = 0;
+
+  /* just to reset its readiness: how many times it expired does not matter */
+  if (read(wheel->fd, &expirations, sizeof(uint64_t)) == -1 && errno != EAGAIN) {
+    return -1;
+  }
+  wheel->armedFor = UINT64_MAX;
+
+  advance(wheel, (monotonic() - wheel->start) / wheel->tick);
+
+  /* taken off the list before the callback runs, which may arm it again, or
+   * cancel other expired timers */
+  while (!isEmpty(&wheel->expired)) {
+    timer = wheel->expired.next;
+    removeTimer(timer);
+    --wheel->count;
+
+    timer->callback(timer, timer->arg);
+    ++count;
+  }
+
+  if (armFd(wheel, nextWakeup(wheel)) == -1) {
+    return -1;
+  }
+
+  return count;
+}
+
+void
+timerInit(struct timer *timer, timerCallback callback, void *arg) {
+  timer->next = timer->prev = NULL;
+  timer->expires = 0;
+  timer->callback = callback;
+  timer->arg = arg;
+}
+
+int
+timerArm(struct timerWheel *wheel, struct timer *timer, long ms) {
+  long long at;
+
+  timerCancel(wheel, timer);
+
+  /* the first tick at or after the timeout */
+  at = monotonic() + ((ms > 0) ? ms : 0) * 1000000LL - wheel->start;
+  timer->expires = (at + wheel->tick - 1) / wheel->tick;
+
+  addTimer(wheel, timer);
+  ++wheel->count;
+
+  if (timer->expires < wheel->armedFor) {
+    return armFd(wheel, timer->expires);
+  }
+
+  return 0;
+}
+
+void
+timerCancel(struct timerWheel *wheel, struct timer *timer) {
+  if (timerPending(timer)) {
+    removeTimer(timer);
+    --wheel->count;
+  }
+}
+
+int
+timerPending(const struct timer *timer) {
+  return timer->next != NULL;
+}
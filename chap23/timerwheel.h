@@ -0,0 +1,100 @@
+/* timerwheel.h - Many timers on top of a single timerfd.
+ *
+ * Creating a kernel timer per timeout - a POSIX timer, or a timerfd - costs a
+ * system call to arm and to cancel each, and a kernel object (and, for timerfds,
+ * a file descriptor) for every one. Programs with a timeout per connection can
+ * have hundreds of thousands of them, most of which are cancelled before they
+ * expire.
+ *
+ * A timer wheel keeps the timers in user space instead, in the buckets of a few
+ * circular arrays ("wheels") of increasing granularity, similar to what the Linux
+ * kernel used to do:
+ *
+ *    - level 0 has a bucket for each of the next 256 ticks;
+ *    - level 1 a bucket for every 256 ticks, for 256 * 256 ticks;
+ *    - and so on, for TIMERWHEEL_LEVELS levels.
+ *
+ * Arming a timer puts it in the bucket of its expiration, and cancelling it takes
+ * it out of there: both are constant time. As time goes by, the buckets of level
+ * 0 expire, and every 256 ticks a bucket of the next level is redistributed
+ * ("cascaded") into the level below. Expired timers are gathered first, and
+ * their callbacks run afterwards, so that they can arm or cancel any timer.
+ *
+ * The wheel has a single timerfd, always armed for the next tick with expiring
+ * timers (or the next cascade), which event loops wait on along with their other
+ * file descriptors, calling `timerWheelRun` when it is readable.
+ *
+ * Timers expire on the first tick at or after their timeout: a tick is the
+ * resolution of the wheel, given when it is created.
+ *
+ * Programs using it are built along with timerwheel.c:
+ *
+ *    $ gcc -o timers timers.c timerwheel.c
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TIMERWHEEL_BITS (8)
+#define TIMERWHEEL_SLOTS (1 << TIMERWHEEL_BITS)
+#define TIMERWHEEL_LEVELS (4) /* timeouts of up to 2^32 ticks */
+
+struct timer;
+typedef void (*timerCallback)(struct timer *timer, void *arg);
+
+/* a timer, usually embedded in the structure it is the timeout of */
+struct timer {
+  struct timer *next, *prev; /* in a bucket, or the list of expired timers */
+  uint64_t expires;          /* the tick it expires on */
+
+  timerCallback callback;
+  void *arg;
+};
+
+struct timerWheel {
+  struct timer buckets[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS]; /* list heads */
+  uint64_t used[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS / 64];    /* buckets not empty */
+  struct timer expired;
+
+  uint64_t now;        /* the next tick to be processed */
+  long long start;     /* CLOCK_MONOTONIC time of tick 0, in nanoseconds */
+  long long tick;      /* in nanoseconds */
+  size_t count;        /* armed timers */
+
+  int fd;              /* the timerfd */
+  uint64_t armedFor;   /* the tick the timerfd is armed for, UINT64_MAX for none */
+};
+
+/* initializes a wheel with ticks of `tickMs` milliseconds, creating its timerfd.
+ * Returns -1 on errors, with `errno` set */
+int timerWheelInit(struct timerWheel *wheel, long tickMs);
+
+/* closes the timerfd of the wheel. Timers still armed are left alone */
+void timerWheelClose(struct timerWheel *wheel);
+
+/* the timerfd, readable when timers are to be run */
+int timerWheelFd(const struct timerWheel *wheel);
+
+/* runs the callbacks of all the timers expired by now. Returns the number of
+ * timers expired, or -1 on errors, with `errno` set */
+long timerWheelRun(struct timerWheel *wheel);
+
+/* initializes a timer that calls `callback` with `arg` when it expires */
+void timerInit(struct timer *timer, timerCallback callback, void *arg);
+
+/* arms a timer to expire in `ms` milliseconds - re-arming it, if it was armed.
+ * Returns -1 if the timerfd could not be armed, with `errno` set */
+int timerArm(struct timerWheel *wheel, struct timer *timer, long ms);
+
+/* disarms a timer. Nothing happens if it was not armed */
+void timerCancel(struct timerWheel *wheel, struct timer *timer);
+
+/* whether a timer is armed (or expired, with its callback not run yet) */
+int timerPending(const struct timer *timer);
+
+#endif
@@ -0,0 +1,217 @@
+/* reaper.c - waits for any number of children, without SIGCHLD.
+ *
+ * See reaper.h.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "reaper.h"
+
+#ifndef P_PIDFD
+#  define P_PIDFD (3)
+#endif
+
+/* children collected per epoll_wait(2) call, at most */
+#define REAPER_BATCH (64)
+
+/* a child in the reaper, what its epoll event points to */
+struct entry {
+  pid_t pid;
+  int pidfd;
+  void *data;
+  struct entry *prev, *next;
+};
+
+struct reaper {
+  int epfd;
+  size_t count;
+  struct entry *entries; /* a list, so that the reaper can be released */
+};
+
+static void
+unlink_(struct reaper *r, struct entry *e) {
+  if (e->prev != NULL) {
+    e->prev->next = e->next;
+  } else {
+    r->entries = e->next;
+  }
+
+  if (e->next != NULL) {
+    e->next->prev = e->prev;
+  }
+
+  close(e->pidfd);
+  free(e);
+  --r->count;
+}
+
+/* waits for the child of `e` again, once it was reported */
+static void
+rearm(struct reaper *r, struct entry *e) {
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN | EPOLLONESHOT;
+  ev.data.ptr = e;
+  epoll_ctl(r->epfd, EPOLL_CTL_MOD, e->pidfd, &ev);
+}
+
+struct reaper *
+reaperCreate(void) {
+  struct reaper *r;
+
+  r = malloc(sizeof(struct reaper));
+  if (r == NULL) {
+    return NULL;
+  }
+
+  r->count = 0;
+  r->entries = NULL;
+  r->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (r->epfd == -1) {
+    free(r);
+    return NULL;
+  }
+
+  return r;
+}
+
+void
+reaperDestroy(struct reaper *r) {
+  while (r->entries != NULL) {
+    unlink_(r, r->entries);
+  }
+
+  close(r->epfd);
+  free(r);
+}
+
+int
+reaperFd(struct reaper *r) {
+  return r->epfd;
+}
+
+size_t
+reaperCount(struct reaper *r) {
+  return r->count;
+}
+
+int
+reaperAddPidfd(struct reaper *r, pid_t pid, int pidfd, void *data) {
+  struct epoll_event ev;
+  struct entry *e;
+  int s;
+
+  e = malloc(sizeof(struct entry));
+  if (e == NULL) {
+    return -1;
+  }
+
+  e->pid = pid;
+  e->pidfd = pidfd;
+  e->data = data;
+  e->prev = NULL;
+  e->next = r->entries;
+
+  ev.events = EPOLLIN | EPOLLONESHOT;
+  ev.data.ptr = e;
+  if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, pidfd, &ev) == -1) {
+    s = errno;
+    free(e);
+    errno = s;
+    return -1;
+  }
+
+  if (r->entries != NULL) {
+    r->entries->prev = e;
+  }
+  r->entries = e;
+  ++r->count;
+  return 0;
+}
+
+int
+reaperAdd(struct reaper *r, pid_t pid, void *data) {
+  int pidfd, s;
+
+  /* no race with the PID being reused: an unwaited child is a zombie, and keeps
+   * its PID, until waited for. pidfds are always close-on-exec */
+  pidfd = syscall(SYS_pidfd_open, pid, 0);
+  if (pidfd == -1) {
+    return -1;
+  }
+
+  if (reaperAddPidfd(r, pid, pidfd, data) == -1) {
+    s = errno;
+    close(pidfd);
+    errno = s;
+    return -1;
+  }
+
+  return 0;
+}
+
+int
+reaperWait(struct reaper *r, struct reaperChild *children, int max, int timeout) {
+  struct epoll_event events[REAPER_BATCH];
+  struct reaperChild *c;
+  struct entry *e;
+  int n, i, collected = 0, error = 0;
+
+  if (r->count == 0 || max <= 0) {
+    return 0;
+  }
+
+  n = epoll_wait(r->epfd, events, (max < REAPER_BATCH) ? max : REAPER_BATCH, timeout);
+  if (n == -1) {
+    return -1;
+  }
+
+  for (i = 0; i < n; ++i) {
+    e = events[i].data.ptr;
+    c = &children[collected];
+
+    /* glibc's waitid(3) does not return the resource usage: the system call does */
+    memset(&c->info, 0, sizeof(siginfo_t));
+    if (syscall(SYS_waitid, P_PIDFD, e->pidfd, &c->info, WEXITED | WNOHANG, &c->usage) == -1) {
+      /* ECHILD: waited for by other means, and gone */
+      error = errno;
+      if (error == ECHILD) {
+        unlink_(r, e);
+      } else {
+        rearm(r, e);
+      }
+      continue;
+    }
+
+    if (c->info.si_pid == 0) {
+      /* not terminated after all */
+      rearm(r, e);
+      continue;
+    }
+
+    c->pid = e->pid;
+    c->data = e->data;
+    ++collected;
+
+    unlink_(r, e);
+  }
+
+  if (collected == 0 && error != 0) {
+    errno = error;
+    return -1;
+  }
+
+  return collected;
+}
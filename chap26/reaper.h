@@ -0,0 +1,70 @@
+/* reaper.h - waits for any number of children, without SIGCHLD.
+ *
+ * Programs running lots of children usually learn of their termination through
+ * a SIGCHLD handler, or block in wait(2): handlers interrupt every blocking call
+ * (EINTR) and coalesce (a single SIGCHLD for several children, a waitpid(2) loop
+ * to find out which), and a blocking wait(2) cannot wait for anything else.
+ *
+ * A reaper holds a pidfd (see pidfd_open(2)) for each child, all added to one
+ * epoll instance: a pidfd becomes readable when its process terminates, so
+ * waiting for children is an epoll_wait(2) call, which can wait for other file
+ * descriptors too (the reaper's own, reaperFd, can be added to another epoll
+ * instance or poll(2) set). Each child that terminated is then collected with
+ * waitid(2) on its pidfd, which returns its status and its resource usage - what
+ * wait4(2) does, for a specific child, without any race on its PID.
+ *
+ * Children must not be waited for by other means (nor SIGCHLD ignored, which has
+ * them reaped by the kernel) while they are in a reaper.
+ *
+ * Programs using it are built along with reaper.c:
+ *
+ *    $ gcc -o reaper_bench reaper_bench.c reaper.c
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#ifndef REAPER_H
+#define REAPER_H
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <signal.h>
+
+struct reaper;
+
+/* a child collected */
+struct reaperChild {
+  pid_t pid;
+  void *data;           /* as given when the child was added */
+  siginfo_t info;       /* si_code (CLD_EXITED, CLD_KILLED, CLD_DUMPED) and si_status */
+  struct rusage usage;  /* of the child and of its waited-for descendants */
+};
+
+/* creates a reaper. Returns NULL on error, with `errno` set */
+struct reaper *reaperCreate(void);
+
+/* closes the pidfds of the children not collected (which are left as zombies),
+ * and releases the reaper */
+void reaperDestroy(struct reaper *r);
+
+/* a descriptor that is readable while a child in the reaper has terminated */
+int reaperFd(struct reaper *r);
+
+/* the number of children in the reaper, not collected yet */
+size_t reaperCount(struct reaper *r);
+
+/* adds the child `pid`, opening a pidfd for it; `data` is returned with it when
+ * collected. Returns -1 on error, with `errno` set */
+int reaperAdd(struct reaper *r, pid_t pid, void *data);
+
+/* adds the child `pid`, whose pidfd `pidfd` (from clone(2) with CLONE_PIDFD, for
+ * instance) the reaper takes over. Returns -1 on error, with `errno` set */
+int reaperAddPidfd(struct reaper *r, pid_t pid, int pidfd, void *data);
+
+/* waits up to `timeout` milliseconds (-1: with no limit, 0: not at all) for
+ * children to terminate, and collects up to `max` of them into `children`.
+ * Returns the number collected, 0 on timeout (or if the reaper is empty), -1 on
+ * error (with `errno` set; EINTR if interrupted by a signal handler) */
+int reaperWait(struct reaper *r, struct reaperChild *children, int max, int timeout);
+
+#endif
@@ -0,0 +1,234 @@
+/* reaper_bench.c - runs lots of children, reaping them with or without SIGCHLD.
+ *
+ * Runs a number of children, keeping up to a number of them running at once,
+ * each exiting right away with a status of its own, and collects each one's
+ * status and resource usage - as a build tool or a test runner would. Children
+ * are either reaped with a reaper (see reaper.h), or the classic way: a SIGCHLD
+ * handler waking up sigsuspend(2), and a loop of wait4(2) calls with WNOHANG
+ * collecting all the children that terminated, as signals do not queue.
+ *
+ * The time taken, the statuses collected (checked against those the children
+ * exited with) and the CPU time of the children, from their resource usage, are
+ * reported.
+ *
+ * The reaper is not cheaper per child: it takes a few more system calls for each
+ * (pidfd_open(2), epoll_ctl(2), waitid(2), close(2)) than a wait4(2) loop does,
+ * and for children exiting right away, it runs somewhat fewer of them per second.
+ * What it buys is no signal handler: no EINTR in the rest of the program, and
+ * children waited for along with other descriptors, in the same epoll_wait(2).
+ *
+ * Usage
+ *
+ *    $ ./reaper_bench [-n children] [-c concurrency] [-s]
+ *
+ *    -n: the children to run (default: 10000).
+ *    -c: the children running at a time, at most (default: 256).
+ *    -s: reap them with a SIGCHLD handler and wait4(2), instead of a reaper.
+ *
+ * Built along with reaper.c:
+ *
+ *    $ gcc -O2 -o reaper_bench reaper_bench.c reaper.c
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _GNU_SOURCE /* wait4 */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "reaper.h"
+
+#define DEFAULT_CHILDREN (10000)
+#define DEFAULT_CONCURRENCY (256)
+
+static void helpAndLeave(const char *progname, int status);
+static void pexit(const char *fCall);
+
+/* what the children collected add up to */
+struct totals {
+  long collected;
+  long statusSum;
+  double cpu;
+};
+
+static double
+now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+account(struct totals *t, int status, const struct rusage *ru) {
+  ++t->collected;
+  t->statusSum += status;
+  t->cpu += ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6 + ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+}
+
+/* runs child `i`, which exits with a status of its own */
+static pid_t
+spawn(long i) {
+  pid_t pid;
+
+  switch (pid = fork()) {
+    case -1:
+      pexit("fork");
+      break;
+
+    case 0:
+      _exit(i & 0xff);
+  }
+
+  return pid;
+}
+
+static void
+runWithReaper(long n, long concurrency, struct totals *t) {
+  struct reaperChild children[64];
+  struct reaper *r;
+  long started = 0;
+  int collected, i;
+
+  if ((r = reaperCreate()) == NULL) {
+    pexit("reaperCreate");
+  }
+
+  while (t->collected < n) {
+    for (; started < n && (long) reaperCount(r) < concurrency; ++started) {
+      if (reaperAdd(r, spawn(started), NULL) == -1) {
+        pexit("reaperAdd");
+      }
+    }
+
+    if ((collected = reaperWait(r, children, 64, -1)) == -1) {
+      pexit("reaperWait");
+    }
+
+    for (i = 0; i < collected; ++i) {
+      account(t, children[i].info.si_status, &children[i].usage);
+    }
+  }
+
+  reaperDestroy(r);
+}
+
+static volatile sig_atomic_t gotSigchld = 0;
+
+static void
+chldHandler(__attribute__((unused)) int sig) {
+  gotSigchld = 1;
+}
+
+static void
+runWithSigchld(long n, long concurrency, struct totals *t) {
+  sigset_t blocked, empty;
+  struct sigaction sa;
+  struct rusage ru;
+  long started = 0, running = 0;
+  int status;
+  pid_t pid;
+
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sa.sa_handler = chldHandler;
+  if (sigaction(SIGCHLD, &sa, NULL) == -1) {
+    pexit("sigaction");
+  }
+
+  /* SIGCHLD is only let in while waiting for it, not to be lost */
+  sigemptyset(&blocked);
+  sigaddset(&blocked, SIGCHLD);
+  sigemptyset(&empty);
+  if (sigprocmask(SIG_BLOCK, &blocked, NULL) == -1) {
+    pexit("sigprocmask");
+  }
+
+  while (t->collected < n) {
+    for (; started < n && running < concurrency; ++started, ++running) {
+      spawn(started);
+    }
+
+    while (!gotSigchld) {
+      sigsuspend(&empty);
+    }
+    gotSigchld = 0;
+
+    /* one signal for any number of children */
+    while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0) {
+      account(t, WEXITSTATUS(status), &ru);
+      --running;
+    }
+
+    if (pid == -1 && errno != ECHILD) {
+      pexit("wait4");
+    }
+  }
+}
+
+int
+main(int argc, char *argv[]) {
+  long n = DEFAULT_CHILDREN, concurrency = DEFAULT_CONCURRENCY, i, expected = 0;
+  struct totals t = { 0, 0, 0 };
+  int opt, useSigchld = 0;
+  double start, elapsed;
+
+  while ((opt = getopt(argc, argv, "n:c:sh")) != -1) {
+    switch (opt) {
+      case 'n': n = atol(optarg);                      break;
+      case 'c': concurrency = atol(optarg);            break;
+      case 's': useSigchld = 1;                        break;
+      case 'h': helpAndLeave(argv[0], EXIT_SUCCESS);   break;
+      default:  helpAndLeave(argv[0], EXIT_FAILURE);   break;
+    }
+  }
+
+  if (optind != argc || n < 1 || concurrency < 1) {
+    helpAndLeave(argv[0], EXIT_FAILURE);
+  }
+
+  start = now();
+  if (useSigchld) {
+    runWithSigchld(n, concurrency, &t);
+  } else {
+    runWithReaper(n, concurrency, &t);
+  }
+  elapsed = now() - start;
+
+  for (i = 0; i < n; ++i) {
+    expected += i & 0xff;
+  }
+
+  printf("%s: %ld children in %.3fs (%.0f per second), statuses %s, children CPU time %.3fs\n",
+      useSigchld ? "SIGCHLD and wait4" : "reaper", t.collected, elapsed, t.collected / elapsed,
+      (t.statusSum == expected) ? "all collected" : "MISSING", t.cpu);
+
+  exit(EXIT_SUCCESS);
+}
+
+static void
+helpAndLeave(const char *progname, int status) {
+  FILE *stream = stderr;
+
+  if (status == EXIT_SUCCESS) {
+    stream = stdout;
+  }
+
+  fprintf(stream, "Usage: %s [-n children] [-c concurrency] [-s]\n", progname);
+  exit(status);
+}
+
+static void
+pexit(const char *fCall) {
+  perror(fCall);
+  exit(EXIT_FAILURE);
+}
@@ -11,11 +11,28 @@
  *
  *    * the environment passed is the same of the calling process.
  *
+ * Searching PATH costs an execve(2) for every directory before the one the
+ * program is in. Programs launching many commands can have `_execlpCache` keep
+ * the path each command was found at, in a hash table, so that the next launch
+ * finds it with a single execve(2). The table is dropped when PATH changes, or
+ * when any of its directories is modified (programs added, removed or renamed
+ * change the mtime of the directory), which is checked at most every
+ * CACHE_CHECK_INTERVAL milliseconds (0 to check on every lookup). A cached path
+ * that fails to execute is forgotten, and PATH searched as usual.
+ *
+ * The cache lives in the memory of the process - and a successful exec is the
+ * end of it. Programs that fork(2) and exec commands should therefore resolve
+ * them with `_execlpResolve` before forking, so that children find them in the
+ * copy of the cache they inherit.
+ *
  * Usage
  *
- *    $ ./execlp <command>
+ *    $ ./execlp [-c] [-n count] <command>
  *
  *    comamnd - the command to be executed
+ *    -c      - use the cache of command paths.
+ *    -n      - launch the command this many times, each in a child process
+ *              with its output discarded, and report how long that took.
  *
  * This program will pass "Linux", "Programming", "Interface" as arguments to
  * the given command.
@@ -23,15 +40,20 @@
  * Author: Renato Mascarenhas Costa
  */
 
-#define _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
 
 #include <limits.h>
 #ifndef PATH_MAX
 #  include <linux/limits.h>
 #endif
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <time.h>
 
 #include <stdarg.h>
 #include <stdio.h>
@@ -43,20 +65,95 @@
 #define MAX_ARGS (1024)
 #define MAX_ENVS (MAX_ARGS)
 
+#ifndef CACHE_CHECK_INTERVAL
+#  define CACHE_CHECK_INTERVAL (1000)
+#endif
+
+#define CACHE_BUCKETS (256)
+
 enum { FALSE, TRUE } Bool;
 
 int _execlp(const char *file, const char *arg, ...);
+void _execlpCache(int enable);
+int _execlpResolve(const char *file, char *buffer, int size);
 
 static void helpAndLeave(const char *progname, int status);
 static void pexit(const char *fCall);
 
+static long long
+now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* forks `count` children, which _execlp the command with their output discarded */
+static void
+launch(const char *command, long count) {
+  char progname[PATH_MAX];
+  long long start;
+  long i;
+  pid_t pid;
+  int fd, status;
+
+  start = now();
+  for (i = 0; i < count; ++i) {
+    /* resolved here, so that the child inherits the cache with the command */
+    _execlpResolve(command, progname, PATH_MAX);
+
+    pid = fork();
+    if (pid == -1) {
+      pexit("fork");
+    }
+
+    if (pid == 0) {
+      fd = open("/dev/null", O_WRONLY);
+      if (fd != -1) {
+        dup2(fd, STDOUT_FILENO);
+      }
+
+      _execlp(command, "Linux", "Programming", "Interface", (char *) NULL);
+      _exit(127);
+    }
+
+    if (waitpid(pid, &status, 0) == -1) {
+      pexit("waitpid");
+    }
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+      fprintf(stderr, "%s could not be executed\n", command);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  printf("%ld launches of %s: %.1fus each\n", count, command, (now() - start) / 1e3 / count);
+}
+
 int
 main(int argc, char *argv[]) {
-  if (argc != 2) {
+  long count = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "cn:h")) != -1) {
+    switch (opt) {
+      case 'c': _execlpCache(TRUE); break;
+      case 'n': count = atol(optarg); break;
+      case 'h': helpAndLeave(argv[0], EXIT_SUCCESS); break;
+      default: helpAndLeave(argv[0], EXIT_FAILURE);
+    }
+  }
+
+  if (argc != optind + 1 || count < 0) {
     helpAndLeave(argv[0], EXIT_FAILURE);
   }
 
-  _execlp(argv[1], "Linux", "Programming", "Interface", (char *) NULL);
+  if (count > 0) {
+    launch(argv[optind], count);
+    exit(EXIT_SUCCESS);
+  }
+
+  _execlp(argv[optind], "Linux", "Programming", "Interface", (char *) NULL);
 
   /* if we get here, something went wrong with _execlp */
   pexit("_execlp");
@@ -110,6 +207,225 @@ tryShell(const char *argv[], char * const *envp) {
   return execve(SHELL, (char * const *) argv, envp);
 }
 
+/* the cache of the paths commands were found at */
+struct cacheEntry {
+  char *file;
+  char *path;
+  struct cacheEntry *next;
+};
+
+static struct {
+  int enabled;
+  char *path;                /* the PATH entries were found in */
+  struct timespec *mtimes;   /* of each of its directories, zero if missing */
+  size_t dirs;
+  long long checked;         /* when the directories were last checked */
+  struct cacheEntry *buckets[CACHE_BUCKETS];
+} cache;
+
+static size_t
+hashName(const char *name) {
+  size_t h = 2166136261u;
+
+  /* FNV-1a */
+  for (; *name != '\0'; ++name) {
+    h = (h ^ (unsigned char) *name) * 16777619u;
+  }
+
+  return h;
+}
+
+static void
+flushEntries() {
+  struct cacheEntry *entry, *next;
+  int i;
+
+  for (i = 0; i < CACHE_BUCKETS; ++i) {
+    for (entry = cache.buckets[i]; entry != NULL; entry = next) {
+      next = entry->next;
+      free(entry->file);
+      free(entry->path);
+      free(entry);
+    }
+
+    cache.buckets[i] = NULL;
+  }
+}
+
+/* stats every directory of the cached PATH, storing their mtimes. Returns
+ * whether any of them changed */
+static int
+statDirs() {
+  char *path, *prefix;
+  struct timespec mtime;
+  struct stat st;
+  size_t i = 0;
+  int changed = FALSE;
+
+  path = strdup(cache.path);
+  if (path == NULL) {
+    return TRUE;
+  }
+
+  for (prefix = strtok(path, PATH_SEP); prefix != NULL && i < cache.dirs; prefix = strtok(NULL, PATH_SEP), ++i) {
+    mtime.tv_sec = mtime.tv_nsec = 0;
+    if (stat(prefix, &st) == 0) {
+      mtime = st.st_mtim;
+    }
+
+    if (mtime.tv_sec != cache.mtimes[i].tv_sec || mtime.tv_nsec != cache.mtimes[i].tv_nsec) {
+      cache.mtimes[i] = mtime;
+      changed = TRUE;
+    }
+  }
+
+  free(path);
+  cache.checked = now();
+  return changed;
+}
+
+/* makes sure the cache matches `path` and the current contents of its
+ * directories, dropping the entries otherwise. Returns -1 if the cache could
+ * not be set up */
+static int
+validateCache(const char *path) {
+  const char *p;
+
+  if (cache.path != NULL && !strcmp(cache.path, path)) {
+    if (now() - cache.checked >= CACHE_CHECK_INTERVAL * 1000000LL && statDirs()) {
+      flushEntries();
+    }
+
+    return 0;
+  }
+
+  flushEntries();
+  free(cache.path);
+  free(cache.mtimes);
+
+  cache.dirs = 1;
+  for (p = path; *p != '\0'; ++p) {
+    cache.dirs += (*p == PATH_SEP[0]);
+  }
+
+  cache.path = strdup(path);
+  cache.mtimes = calloc(cache.dirs, sizeof(struct timespec));
+  if (cache.path == NULL || cache.mtimes == NULL) {
+    free(cache.path);
+    free(cache.mtimes);
+    cache.path = NULL;
+    cache.mtimes = NULL;
+    return -1;
+  }
+
+  statDirs();
+  return 0;
+}
+
+static struct cacheEntry **
+findEntry(const char *file) {
+  struct cacheEntry **entry = &cache.buckets[hashName(file) & (CACHE_BUCKETS - 1)];
+
+  while (*entry != NULL && strcmp((*entry)->file, file)) {
+    entry = &(*entry)->next;
+  }
+
+  return entry;
+}
+
+static void
+forget(const char *file) {
+  struct cacheEntry **entry = findEntry(file), *found = *entry;
+
+  if (found != NULL) {
+    *entry = found->next;
+    free(found->file);
+    free(found->path);
+    free(found);
+  }
+}
+
+/* looks `file` up in the cache, and in the directories of PATH - without
+ * executing anything - if it is not there. Stores its path in `progname` and
+ * returns TRUE if found */
+static int
+lookup(const char *file, char *progname, int size) {
+  char path[PATH_MAX], *prefix;
+  struct cacheEntry **slot, *entry;
+  struct stat st;
+
+  getPath(path, PATH_MAX);
+  if (validateCache(path) == -1) {
+    return FALSE;
+  }
+
+  slot = findEntry(file);
+  if (*slot != NULL) {
+    snprintf(progname, size, "%s", (*slot)->path);
+    return TRUE;
+  }
+
+  for (prefix = strtok(path, PATH_SEP); prefix != NULL; prefix = strtok(NULL, PATH_SEP)) {
+    snprintf(progname, size, "%s/%s", prefix, file);
+    if (stat(progname, &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111)) {
+      break;
+    }
+  }
+
+  if (prefix == NULL) {
+    return FALSE;
+  }
+
+  entry = malloc(sizeof(struct cacheEntry));
+  if (entry != NULL) {
+    entry->file = strdup(file);
+    entry->path = strdup(progname);
+    entry->next = NULL;
+
+    if (entry->file == NULL || entry->path == NULL) {
+      free(entry->file);
+      free(entry->path);
+      free(entry);
+    } else {
+      *slot = entry;
+    }
+  }
+
+  return TRUE;
+}
+
+void
+_execlpCache(int enable) {
+  cache.enabled = enable;
+
+  if (!enable) {
+    flushEntries();
+  }
+}
+
+/* stores in `buffer` the path `file` would be executed from, as _execlp would
+ * find it, through the cache. Returns -1 if it is not found, or the cache is not
+ * enabled (ENOSYS) */
+int
+_execlpResolve(const char *file, char *buffer, int size) {
+  if (strchr(file, '/')) {
+    snprintf(buffer, size, "%s", file);
+    return 0;
+  }
+
+  if (!cache.enabled) {
+    errno = ENOSYS;
+    return -1;
+  }
+
+  if (!lookup(file, buffer, size)) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  return 0;
+}
+
 int
 _execlp(const char *file, const char *arg, ...) {
   va_list arguments;
@@ -167,6 +483,18 @@ _execlp(const char *file, const char *arg, ...) {
   /* PATH lookup */
   char path[PATH_MAX], progname[PATH_MAX], *prefix;
   int eacces = FALSE;
+
+  if (cache.enabled && lookup(file, progname, PATH_MAX)) {
+    execve(progname, (char * const *) argv, environ);
+
+    if (errno == ENOEXEC) {
+      return tryShell(argv, environ);
+    }
+
+    /* it is not there any more, or cannot be executed: search for it again */
+    forget(file);
+  }
+
   getPath(path, PATH_MAX);
 
   prefix = strtok(path, PATH_SEP);
@@ -214,7 +542,7 @@ helpAndLeave(const char *progname, int status) {
     stream = stdout;
   }
 
-  fprintf(stream, "Usage: %s <command>\n", progname);
+  fprintf(stream, "Usage: %s [-c] [-n count] <command>\n", progname);
   exit(status);
 }
 
@@ -1,36 +1,75 @@
-/* fork_vfork_bench.c - executes a benchmark of the fork(2) and vfork(2) system calls.
+/* fork_vfork_bench.c - executes a benchmark of the ways of creating a process.
  *
  * Depending on the intended usage, on the caller process and  other factors, the
  * `vfork(2)` system call can create a significant performance improvement over
  * the traditional `fork(2)` syscall (though with its inherent drawbacks).
  *
- * This program attempts to benchmark both system calls by performing a series
- * of consecutive process creations (by default 10,000 - but can be overwritten
- * by defining BENCH_RUNS when compiling). The caller process will previously
- * allocate a certain amount of memory so that page table copying time can be
- * taken into account (by default, 1 MB of memory is allocated, but that can be
- * changed by defining the CALLER_HEAP variable to the number of KB to be allocated
- * by the caller). The `time(1)` utility can be used to extract useful information
- * on total and CPU times.
+ * This program attempts to benchmark process creation by timing a series
+ * of consecutive creations (by default 10,000 - but can be overwritten
+ * by defining BENCH_RUNS when compiling, or with the -i option), with the harness
+ * in lib/bench.c. Each creation is timed until the child is waited for. Processes
+ * are created with:
+ *
+ *    fork  - fork(2), the child exiting right away.
+ *    vfork - vfork(2), likewise.
+ *    clone - clone(2) with CLONE_VM | CLONE_VFORK, on a stack of its own.
+ *    spawn - posix_spawn(3) of a trivial program (by default /bin/true).
+ *    exec  - fork(2), and execve(2) of that same program.
+ *
+ * fork(2) copies the page tables of the caller (marking its pages copy-on-write),
+ * so its cost grows with the memory the caller has mapped and, above all, touched.
+ * The caller therefore maps a heap of each of the sizes given with -s (by
+ * default 1 MB, or the number of KB in CALLER_HEAP when compiling), in each of
+ * the states given with -m:
+ *
+ *    untouched - mapped, but never written: there is not much to copy.
+ *    touched   - every page written, so every one of them has a page table entry.
+ *    huge      - as touched, but madvise(2)d to be backed by transparent huge
+ *                pages, which take a single entry per 2 MB.
+ *
+ * Every combination of size, state and way of creating processes is a benchmark
+ * of its own, named after all three. The resident set size of the caller (and how
+ * much of it is in huge pages) is printed to stderr for each heap.
+ *
+ * Large heaps take a while to create processes from: fewer iterations do, then.
  *
  * Usage
  *
- *    $ ./fork_vfork_bench [vfork]
+ *    $ ./fork_vfork_bench [-i iterations] [-w warmup] [-c cpu] [-o text|csv|json]
+ *                         [-s sizes] [-m states] [-x program] [fork|vfork|clone|spawn|exec...]
+ *
+ *    -s: comma separated heap sizes, in KB - or with a K, M or G suffix.
+ *    -m: comma separated heap states: untouched, touched and huge (default: untouched).
+ *    -x: the program run by spawn and exec (default: /bin/true).
+ *
+ *    fork|vfork|clone|spawn|exec - the ways processes are created. All of them
+ *    are benchmarked if none is given.
+ *
+ *    The other options are those of the harness (see lib/bench.h).
+ *
+ * Example
  *
- *    vfork - if given, processes will be created using `vfork(2)` instead of
- *    the default `fork(2)`.
+ *    $ ./fork_vfork_bench -i 200 -s 64K,16M,1G -m untouched,touched,huge fork vfork spawn
  *
  * Author: Renato Mascarenhas Costa
  */
 
-#define _BSD_SOURCE
+#define _GNU_SOURCE /* clone and MADV_HUGEPAGE */
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
 #include <unistd.h>
+#include <stdint.h>
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include "../lib/bench.h"
 
 #ifndef BENCH_RUNS
 #  define BENCH_RUNS (10000)
@@ -40,65 +79,360 @@
 #  define CALLER_HEAP (1024)
 #endif
 
-#define SyscallStr(b) (b ? "fork" : "vfork")
+#define MAX_SIZES (8)
+#define CHILD_STACK (64 * 1024)
+#define HUGE_PAGE (2 * 1024 * 1024)
+
+enum heapState { HEAP_UNTOUCHED, HEAP_TOUCHED, HEAP_HUGE, HEAP_STATES };
+
+static const char *stateNames[HEAP_STATES] = { "untouched", "touched", "huge" };
+
+struct mode {
+  const char *name;
+  benchFn fn;
+};
 
 static void helpAndLeave(const char *progname, int status);
 static void pexit(const char *fCall);
 
-static void *growHeap();
-static void doBench(int forkSyscall);
+static void forkOperation(void *arg);
+static void vforkOperation(void *arg);
+static void cloneOperation(void *arg);
+static void spawnOperation(void *arg);
+static void execOperation(void *arg);
 
-int
-main(int argc, char *argv[]) {
-  if (argc > 2) {
-    helpAndLeave(argv[0], EXIT_FAILURE);
+static const struct mode modes[] = {
+  { "fork", forkOperation },
+  { "vfork", vforkOperation },
+  { "clone", cloneOperation },
+  { "spawn", spawnOperation },
+  { "exec", execOperation }
+};
+
+#define MODES ((int) (sizeof(modes) / sizeof(struct mode)))
+
+extern char **environ;
+
+static const char *program = "/bin/true";
+static char *childStack;
+
+/* benchmark names, which the harness keeps pointers to */
+static char names[BENCH_RESULTS_MAX][48];
+
+/* the size in bytes of `s`: KB, or with a K, M or G suffix. -1 if invalid */
+static long long
+parseSize(const char *s) {
+  char *endptr;
+  long long n = strtoll(s, &endptr, 10);
+
+  if (endptr == s || n <= 0) {
+    return -1;
   }
 
-  void *mem = growHeap();
-  int forkSyscall = argv[1] == NULL;
+  switch (*endptr) {
+    case '\0':
+    case 'k': case 'K': n <<= 10; break;
+    case 'm': case 'M': n <<= 20; break;
+    case 'g': case 'G': n <<= 30; break;
+    default: return -1;
+  }
 
-  printf("Benchmarking %s\n", SyscallStr(forkSyscall));
-  doBench(forkSyscall);
-  free(mem);
+  if (*endptr != '\0' && endptr[1] != '\0') {
+    return -1;
+  }
 
-  exit(EXIT_SUCCESS);
+  return n;
 }
 
+/* a short name for `bytes`, such as 64K or 1G */
 static void
-doBench(int forkSyscall) {
-  int i, status;
+sizeName(long long bytes, char *buf, size_t len) {
+  if (bytes >= (1LL << 30) && bytes % (1LL << 30) == 0) {
+    snprintf(buf, len, "%lldG", bytes >> 30);
+  } else if (bytes >= (1LL << 20) && bytes % (1LL << 20) == 0) {
+    snprintf(buf, len, "%lldM", bytes >> 20);
+  } else {
+    snprintf(buf, len, "%lldK", bytes >> 10);
+  }
+}
 
-  for (i = 0; i < BENCH_RUNS; ++i) {
-    switch (forkSyscall ? fork() : vfork()) {
-      case -1:
-        pexit(SyscallStr(forkSyscall));
+/* maps a heap of `bytes`, in `state`. Huge pages are aligned to their size, so
+ * that the whole heap can be backed by them */
+static void *
+mapHeap(long long bytes, enum heapState state, size_t *mapped) {
+  char *mem, *heap;
+  long long i;
+  long pageSize = sysconf(_SC_PAGESIZE);
+
+  *mapped = bytes + (state == HEAP_HUGE ? HUGE_PAGE : 0);
+  mem = mmap(NULL, *mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    pexit("mmap");
+  }
+
+  heap = mem;
+  if (state == HEAP_HUGE) {
+    heap = (char *) (((uintptr_t) mem + HUGE_PAGE - 1) & ~((uintptr_t) HUGE_PAGE - 1));
+
+    if (madvise(heap, bytes, MADV_HUGEPAGE) == -1) {
+      perror("madvise"); /* no transparent huge pages: carry on with small ones */
+    }
+  }
+
+  if (state != HEAP_UNTOUCHED) {
+    for (i = 0; i < bytes; i += pageSize) {
+      heap[i] = 1;
+    }
+  }
+
+  return mem;
+}
+
+/* prints the resident set size of the process, and how much of it is in
+ * transparent huge pages, as told by /proc/self/smaps_rollup */
+static void
+printRss(const char *size, const char *state) {
+  char line[256];
+  long rss = -1, huge = -1;
+  FILE *fp;
+
+  fp = fopen("/proc/self/smaps_rollup", "r");
+  if (fp == NULL) {
+    return;
+  }
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (!strncmp(line, "Rss:", 4)) {
+      rss = atol(line + 4);
+    } else if (!strncmp(line, "AnonHugePages:", 14)) {
+      huge = atol(line + 14);
+    }
+  }
+
+  fclose(fp);
+  fprintf(stderr, "heap %s %s: RSS %ld KB, %ld KB in huge pages\n", size, state, rss, huge);
+}
+
+/* adds the states in the comma separated `list` to `states`. -1 if invalid */
+static int
+parseStates(char *list, int states[HEAP_STATES]) {
+  char *s;
+  int i;
+
+  for (s = strtok(list, ","); s != NULL; s = strtok(NULL, ",")) {
+    for (i = 0; i < HEAP_STATES; ++i) {
+      if (!strcmp(s, stateNames[i])) {
+        states[i] = 1;
+        break;
+      }
+    }
+
+    if (i == HEAP_STATES) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int
+main(int argc, char *argv[]) {
+  struct bench bench;
+  long long sizes[MAX_SIZES];
+  int nsizes = 0, states[HEAP_STATES] = { 0 }, statesGiven = 0, selected[MODES] = { 0 };
+  char sizeBuf[24], *s;
+  size_t mapped;
+  void *mem;
+  int opt, i, j, k;
+
+  benchInit(&bench, BENCH_RUNS);
+
+  while ((opt = getopt(argc, argv, BENCH_OPTIONS "s:m:x:h")) != -1) {
+    switch (opt) {
+      case 'h':
+        helpAndLeave(argv[0], EXIT_SUCCESS);
+        break;
+
+      case 's':
+        for (s = strtok(optarg, ","); s != NULL; s = strtok(NULL, ",")) {
+          if (nsizes == MAX_SIZES || (sizes[nsizes++] = parseSize(s)) == -1) {
+            helpAndLeave(argv[0], EXIT_FAILURE);
+          }
+        }
+        break;
+
+      case 'm':
+        if (parseStates(optarg, states) == -1) {
+          helpAndLeave(argv[0], EXIT_FAILURE);
+        }
+        statesGiven = 1;
         break;
 
-      case 0:
-        /* child: immediately exits */
-        _exit(EXIT_SUCCESS);
+      case 'x':
+        program = optarg;
         break;
 
       default:
-        /* parent: wait for the child and continue */
-        if (wait(&status) == -1) {
-          pexit("wait");
+        if (benchOption(&bench, opt, optarg) == -1) {
+          helpAndLeave(argv[0], EXIT_FAILURE);
         }
     }
   }
-}
 
-/* grows the process heap as defined by the CALLER_HEAP constant */
-static void *
-growHeap() {
-  void *mem;
+  if (nsizes == 0) {
+    sizes[nsizes++] = CALLER_HEAP * 1024LL;
+  }
+
+  if (!statesGiven) {
+    states[HEAP_UNTOUCHED] = 1;
+  }
+
+  for (i = optind; i < argc; ++i) {
+    for (j = 0; j < MODES; ++j) {
+      if (!strcmp(argv[i], modes[j].name)) {
+        selected[j] = 1;
+        break;
+      }
+    }
 
-  mem = malloc(CALLER_HEAP * 1024);
-  if (mem == NULL) {
+    if (j == MODES) {
+      helpAndLeave(argv[0], EXIT_FAILURE);
+    }
+  }
+
+  if (argc == optind) {
+    for (j = 0; j < MODES; ++j) {
+      selected[j] = 1;
+    }
+  }
+
+  childStack = malloc(CHILD_STACK);
+  if (childStack == NULL) {
     pexit("malloc");
   }
 
-  return mem;
+  for (i = 0; i < nsizes; ++i) {
+    sizeName(sizes[i], sizeBuf, sizeof(sizeBuf));
+
+    for (k = 0; k < HEAP_STATES; ++k) {
+      if (!states[k]) {
+        continue;
+      }
+
+      mem = mapHeap(sizes[i], k, &mapped);
+      printRss(sizeBuf, stateNames[k]);
+
+      for (j = 0; j < MODES; ++j) {
+        if (!selected[j]) {
+          continue;
+        }
+
+        if (bench.count == BENCH_RESULTS_MAX) {
+          fprintf(stderr, "Too many benchmarks: at most %d are run\n", BENCH_RESULTS_MAX);
+          helpAndLeave(argv[0], EXIT_FAILURE);
+        }
+
+        snprintf(names[bench.count], sizeof(names[0]), "%s/%s/%s", modes[j].name, sizeBuf, stateNames[k]);
+        if (benchRun(&bench, names[bench.count], modes[j].fn, NULL) == -1) {
+          pexit("benchRun");
+        }
+      }
+
+      if (munmap(mem, mapped) == -1) {
+        pexit("munmap");
+      }
+    }
+  }
+
+  free(childStack);
+
+  benchReport(&bench);
+
+  exit(EXIT_SUCCESS);
+}
+
+/* the parent waits for the child, which immediately exits (or runs a program
+ * that does) */
+static void
+waitChild(pid_t pid, const char *fCall) {
+  int status;
+
+  if (pid == -1) {
+    pexit(fCall);
+  }
+
+  if (pid == 0) {
+    _exit(EXIT_SUCCESS);
+  }
+
+  if (waitpid(pid, &status, __WALL) == -1) {
+    pexit("waitpid");
+  }
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+    fprintf(stderr, "%s: child failed (status %d)\n", fCall, status);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void
+forkOperation(__attribute__((unused)) void *arg) {
+  waitChild(fork(), "fork");
+}
+
+static void
+vforkOperation(__attribute__((unused)) void *arg) {
+  pid_t pid;
+
+  /* the child must not return from the function that called vfork(2): it has to
+   * exit right here */
+  pid = vfork();
+  if (pid == 0) {
+    _exit(EXIT_SUCCESS);
+  }
+
+  waitChild(pid, "vfork");
+}
+
+static int
+cloneChild(__attribute__((unused)) void *arg) {
+  _exit(EXIT_SUCCESS);
+}
+
+static void
+cloneOperation(__attribute__((unused)) void *arg) {
+  /* the child shares our memory, and we are suspended until it exits, so its
+   * stack can be the same every time. Stacks grow down on most architectures */
+  waitChild(clone(cloneChild, childStack + CHILD_STACK, CLONE_VM | CLONE_VFORK | SIGCHLD, NULL), "clone");
+}
+
+static void
+spawnOperation(__attribute__((unused)) void *arg) {
+  char *args[] = { (char *) program, NULL };
+  pid_t pid;
+  int s;
+
+  s = posix_spawn(&pid, program, NULL, NULL, args, environ);
+  if (s != 0) {
+    fprintf(stderr, "posix_spawn: %s\n", strerror(s));
+    exit(EXIT_FAILURE);
+  }
+
+  waitChild(pid, "posix_spawn");
+}
+
+static void
+execOperation(__attribute__((unused)) void *arg) {
+  char *args[] = { (char *) program, NULL };
+  pid_t pid;
+
+  pid = fork();
+  if (pid == 0) {
+    execve(program, args, environ);
+    _exit(127);
+  }
+
+  waitChild(pid, "fork and execve");
 }
 
 static void
@@ -109,7 +443,8 @@ helpAndLeave(const char *progname, int status) {
     stream = stdout;
   }
 
-  fprintf(stream, "Usage: %s [syscall]\n", progname);
+  fprintf(stream, "Usage: %s " BENCH_USAGE " [-s sizes] [-m untouched,touched,huge] [-x program]\n"
+                  "       [fork|vfork|clone|spawn|exec...]\n", progname);
   exit(status);
 }
 
@@ -0,0 +1,363 @@
+/* counter_bench.c - benchmarks ways of incrementing a counter shared by threads.
+ *
+ * thread_inc_verbose.c shows that threads incrementing a shared variable without
+ * synchronization lose updates. This program measures what it costs not to, with
+ * a number of threads incrementing the same counter as fast as they can, in each
+ * of these ways:
+ *
+ *    mutex   - a pthread mutex around the increment.
+ *    spin    - a pthread spin lock around it.
+ *    atomic  - an atomic fetch-and-add on the counter.
+ *    shared  - a shard of the counter per thread, written by that thread alone,
+ *              all of them next to each other: threads share cache lines
+ *              (false sharing), even though they never touch the same shard.
+ *    padded  - as shared, but each shard in a cache line of its own.
+ *    local   - each thread counts in a local variable, adding what it counted
+ *              to the counter (atomically) every `batch` increments.
+ *
+ * Shards are written with plain (relaxed) atomic stores, rather than a locked
+ * instruction, as each has a single writer. Their total is what readers see: while
+ * the threads run, a merger thread adds up the shards every millisecond, as a
+ * program reporting the counter would.
+ *
+ * Every way is run for each number of threads, from one to the maximum, doubling
+ * it every time; the number of increments per second of all threads together is
+ * reported, and the final value of the counter checked.
+ *
+ * Usage
+ *
+ *    $ ./counter_bench [-t max_threads] [-n increments] [-b batch] [method...]
+ *
+ *    -t: the maximum number of threads (default: 8).
+ *    -n: the number of increments of each thread (default: 10000000).
+ *    -b: the increments counted locally before being added to the counter, with
+ *        local (default: 1024).
+ *
+ *    method - the ways benchmarked: mutex, spin, atomic, shared, padded and local.
+ *    All of them if none is given.
+ *
+ * Built with -pthread:
+ *
+ *    $ gcc -O2 -o counter_bench counter_bench.c -pthread
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_THREADS (8)
+#define DEFAULT_INCREMENTS (10000000)
+#define DEFAULT_BATCH (1024)
+
+#define CACHE_LINE (64)
+#define MERGE_INTERVAL_NS (1000000)
+
+enum method { MUTEX, SPIN, ATOMIC, SHARED, PADDED, LOCAL, METHODS };
+
+static const char *methodNames[METHODS] = { "mutex", "spin", "atomic", "shared", "padded", "local" };
+
+/* a shard of the counter, alone in its cache line */
+struct paddedShard {
+	long value;
+} __attribute__((aligned(CACHE_LINE)));
+
+struct threadinfo {
+	int index;
+	enum method method;
+	double start, end;
+};
+
+static void helpAndLeave(const char *progname, int status);
+static void thread_pexit(int err, const char *fCall);
+
+static long increments = DEFAULT_INCREMENTS, batch = DEFAULT_BATCH;
+
+/* the counter, in all its forms */
+static long counter;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_spinlock_t spin;
+static long *sharedShards;
+static struct paddedShard *paddedShards;
+static int nthreads;
+
+static pthread_barrier_t barrier;
+static int running;
+
+static double
+now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+incrementer(void *arg) {
+	struct threadinfo *info = arg;
+	long i, local, *shard;
+
+	pthread_barrier_wait(&barrier);
+	info->start = now();
+
+	switch (info->method) {
+	case MUTEX:
+		for (i = 0; i < increments; ++i) {
+			pthread_mutex_lock(&mutex);
+			++counter;
+			pthread_mutex_unlock(&mutex);
+		}
+		break;
+
+	case SPIN:
+		for (i = 0; i < increments; ++i) {
+			pthread_spin_lock(&spin);
+			++counter;
+			pthread_spin_unlock(&spin);
+		}
+		break;
+
+	case ATOMIC:
+		for (i = 0; i < increments; ++i) {
+			__atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED);
+		}
+		break;
+
+	case SHARED:
+	case PADDED:
+		/* the single writer of its shard: no read-modify-write needed */
+		shard = (info->method == SHARED) ? &sharedShards[info->index] : &paddedShards[info->index].value;
+		for (i = 0; i < increments; ++i) {
+			__atomic_store_n(shard, __atomic_load_n(shard, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+		}
+		break;
+
+	case LOCAL:
+		local = 0;
+		for (i = 0; i < increments; ++i) {
+			/* the compiler may not turn this into a single addition: it has to
+			 * publish every batch */
+			if (++local == batch) {
+				__atomic_fetch_add(&counter, local, __ATOMIC_RELAXED);
+				local = 0;
+			}
+		}
+		__atomic_fetch_add(&counter, local, __ATOMIC_RELAXED);
+		break;
+
+	default:
+		break;
+	}
+
+	info->end = now();
+	return NULL;
+}
+
+/* the total of the shards */
+static long
+merge(enum method method) {
+	long total = 0;
+	int i;
+
+	for (i = 0; i < nthreads; ++i) {
+		total += __atomic_load_n((method == SHARED) ? &sharedShards[i] : &paddedShards[i].value, __ATOMIC_RELAXED);
+	}
+
+	return total;
+}
+
+/* publishes the total of the shards periodically, while the incrementers run */
+static void *
+merger(void *arg) {
+	enum method method = *(enum method *) arg;
+	struct timespec interval = { 0, MERGE_INTERVAL_NS };
+
+	while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&counter, merge(method), __ATOMIC_RELAXED);
+		nanosleep(&interval, NULL);
+	}
+
+	return NULL;
+}
+
+/* runs `method` with `threads` threads, returning the increments per second */
+static double
+run(enum method method, int threads) {
+	pthread_t tids[threads], mergerTid;
+	struct threadinfo infos[threads];
+	double start = 0, end = 0;
+	int i, s, shards;
+
+	nthreads = threads;
+	shards = (method == SHARED || method == PADDED);
+
+	counter = 0;
+	memset(sharedShards, 0, threads * sizeof(long));
+	memset(paddedShards, 0, threads * sizeof(struct paddedShard));
+
+	s = pthread_barrier_init(&barrier, NULL, threads);
+	if (s != 0) {
+		thread_pexit(s, "pthread_barrier_init");
+	}
+
+	for (i = 0; i < threads; ++i) {
+		infos[i].index = i;
+		infos[i].method = method;
+
+		s = pthread_create(&tids[i], NULL, incrementer, &infos[i]);
+		if (s != 0) {
+			thread_pexit(s, "pthread_create");
+		}
+	}
+
+	__atomic_store_n(&running, 1, __ATOMIC_RELAXED);
+	if (shards) {
+		s = pthread_create(&mergerTid, NULL, merger, &method);
+		if (s != 0) {
+			thread_pexit(s, "pthread_create");
+		}
+	}
+
+	/* from the first thread starting to the last one finishing */
+	for (i = 0; i < threads; ++i) {
+		s = pthread_join(tids[i], NULL);
+		if (s != 0) {
+			thread_pexit(s, "pthread_join");
+		}
+
+		if (i == 0 || infos[i].start < start) {
+			start = infos[i].start;
+		}
+		if (infos[i].end > end) {
+			end = infos[i].end;
+		}
+	}
+
+	__atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+
+	if (shards) {
+		s = pthread_join(mergerTid, NULL);
+		if (s != 0) {
+			thread_pexit(s, "pthread_join");
+		}
+
+		counter = merge(method);
+	}
+
+	pthread_barrier_destroy(&barrier);
+
+	if (counter != threads * increments) {
+		fprintf(stderr, "%s with %d threads: counted %ld, expected %ld\n", methodNames[method],
+				threads, counter, threads * increments);
+		exit(EXIT_FAILURE);
+	}
+
+	return threads * increments / (end - start);
+}
+
+int
+main(int argc, char *argv[]) {
+	int opt, maxThreads = DEFAULT_THREADS, selected[METHODS] = { 0 }, threads, i, m, s;
+
+	while ((opt = getopt(argc, argv, "t:n:b:h")) != -1) {
+		switch (opt) {
+		case 't': maxThreads = atoi(optarg); break;
+		case 'n': increments = atol(optarg); break;
+		case 'b': batch = atol(optarg); break;
+		case 'h': helpAndLeave(argv[0], EXIT_SUCCESS); break;
+		default: helpAndLeave(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	if (maxThreads < 1 || increments < 1 || batch < 1) {
+		helpAndLeave(argv[0], EXIT_FAILURE);
+	}
+
+	for (i = optind; i < argc; ++i) {
+		for (m = 0; m < METHODS; ++m) {
+			if (!strcmp(argv[i], methodNames[m])) {
+				selected[m] = 1;
+				break;
+			}
+		}
+
+		if (m == METHODS) {
+			helpAndLeave(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	if (optind == argc) {
+		for (m = 0; m < METHODS; ++m) {
+			selected[m] = 1;
+		}
+	}
+
+	s = pthread_spin_init(&spin, PTHREAD_PROCESS_PRIVATE);
+	if (s != 0) {
+		thread_pexit(s, "pthread_spin_init");
+	}
+
+	sharedShards = calloc(maxThreads, sizeof(long));
+	s = posix_memalign((void **) &paddedShards, CACHE_LINE, maxThreads * sizeof(struct paddedShard));
+	if (sharedShards == NULL || s != 0) {
+		fprintf(stderr, "Could not allocate shards\n");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("%-8s", "threads");
+	for (m = 0; m < METHODS; ++m) {
+		if (selected[m]) {
+			printf(" %12s", methodNames[m]);
+		}
+	}
+	printf("   (millions of increments per second)\n");
+
+	/* doubling the threads, up to the maximum - run too, if not a power of two */
+	for (threads = 1; ; threads *= 2) {
+		if (threads > maxThreads) {
+			threads = maxThreads;
+		}
+
+		printf("%-8d", threads);
+		for (m = 0; m < METHODS; ++m) {
+			if (selected[m]) {
+				printf(" %12.1f", run(m, threads) / 1e6);
+				fflush(stdout);
+			}
+		}
+		printf("\n");
+
+		if (threads == maxThreads) {
+			break;
+		}
+	}
+
+	free(sharedShards);
+	free(paddedShards);
+	exit(EXIT_SUCCESS);
+}
+
+static void
+helpAndLeave(const char *progname, int status) {
+	FILE *stream = stderr;
+
+	if (status == EXIT_SUCCESS) {
+		stream = stdout;
+	}
+
+	fprintf(stream, "Usage: %s [-t max_threads] [-n increments] [-b batch] [mutex|spin|atomic|shared|padded|local...]\n", progname);
+	exit(status);
+}
+
+static void
+thread_pexit(int err, const char *fCall) {
+	fprintf(stderr, "%s: %s\n", fCall, strerror(err));
+	exit(EXIT_FAILURE);
+}
@@ -8,8 +8,11 @@
  * add [key, val] - adds a node to the tree.
  * delete [key] - tries to delete a node with the given key.
  * lookup [key] - retrieves the data associated with the given key.
+ * range [lo, hi] - lists the keys between lo and hi, inclusive, in order.
  * print - prints all keys available in sorted order (needs debug support).
  * visual [file] - saves a visual representation of the tree to the given file (needs debug support).
+ * stats - prints the shape of the tree, and where its operations spent their time
+ * (needs TSBT_STATS).
  * quit - finish session.
  *
  * The aim of this program is not to test the tsbintree library. See the `test/`
@@ -22,6 +25,23 @@
  * Usage
  *
  *    $ ./console
+ *    $ ./console -f <workload> [-j threads]
+ *
+ * Workloads
+ *
+ * With -f, the console runs the add, delete, lookup and range commands of a
+ * workload file (one per line, as typed at the prompt; other lines are skipped)
+ * instead, printing nothing for each: the file is read and parsed whole before
+ * any command runs, so only the tree operations are timed. With -j, the
+ * commands are dealt round-robin to a number of threads, which run them at the
+ * same time. Once done, the count, failures (keys missing, or already there),
+ * mean and percentile latencies of each kind of command are printed, along with
+ * the total throughput (and, when built with TSBT_STATS, what `stats` prints:
+ * whether slow commands went down long paths or waited for locks). A workload can be made up with awk(1), say:
+ *
+ *    $ awk 'BEGIN { srand(1); for (i = 0; i < 1000000; i++)
+ *        printf("%s %d v\n", (rand() < 0.2) ? "add" : "lookup", int(rand() * 100000)) }' > w
+ *    $ ./console -f w -j 4
  *
  * Author: Renato Mascarenhas Costa.
  *
@@ -30,9 +50,15 @@
  * purpose was not completeness, but just being a tool for simple tests.
  */
 
+#define _DEFAULT_SOURCE
 #define _BSD_SOURCE
 
 #include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -58,6 +84,12 @@ static void printHelp(void);
 static void doAdd(tsbintree *bt, char *key, char *value);
 static void doDelete(tsbintree *t, char *key);
 static void doLookup(tsbintree *bt, char *key);
+static void doRange(tsbintree *bt, char *lo, char *hi);
+static void runWorkload(const char *path, int nthreads);
+
+#ifdef TSBT_STATS
+static void doStats(tsbintree *bt);
+#endif
 
 #ifdef TSBT_DEBUG
 static void doPrint(tsbintree *bt);
@@ -65,10 +97,26 @@ static void doVisual(tsbintree *bt, char *filename);
 #endif
 
 int
-main() {
+main(int argc, char *argv[]) {
 	char buf[BUFSIZ];
-	char *command, *arg1, *arg2;
+	char *command, *arg1, *arg2, *workload = NULL;
 	ssize_t numRead;
+	int opt, nthreads = 1;
+
+	while ((opt = getopt(argc, argv, "f:j:")) != -1) {
+		switch (opt) {
+			case 'f': workload = optarg; break;
+			case 'j': nthreads = atoi(optarg); break;
+			default:
+				fprintf(stderr, "Usage: %s [-f workload [-j threads]]\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if (workload != NULL) {
+		runWorkload(workload, (nthreads > 0) ? nthreads : 1);
+		exit(EXIT_SUCCESS);
+	}
 
 	/* disable output buffering */
 	setbuf(stdout, NULL);
@@ -97,7 +145,16 @@ main() {
 			} else if (!strncmp(command, "lookup", BUFSIZ)) {
 				arg1 = strtok(NULL, " "); /* key to be searched */
 				doLookup(&bt, arg1);
+			} else if (!strncmp(command, "range", BUFSIZ)) {
+				arg1 = strtok(NULL, " "); /* lower bound */
+				arg2 = strtok(NULL, " "); /* upper bound */
+				doRange(&bt, arg1, arg2);
+			}
+#ifdef TSBT_STATS
+			else if (!strncmp(command, "stats", BUFSIZ)) {
+				doStats(&bt);
 			}
+#endif
 #ifdef TSBT_DEBUG
 			else if (!strncmp(command, "print", BUFSIZ)) {
 				doPrint(&bt);
@@ -127,6 +184,10 @@ printHelp() {
 	printf("%20s%70s\n", "add <key> <val>", "adds a node to the tree");
 	printf("%20s%70s\n", "delete <key>", "tries to delete a node with the given key");
 	printf("%20s%70s\n", "lookup <key>", "retrieves the data associated with the given key");
+	printf("%20s%70s\n", "range <lo> <hi>", "lists the keys between lo and hi in order");
+#ifdef TSBT_STATS
+	printf("%20s%70s\n", "stats", "prints the shape of the tree and lock waits");
+#endif
 #ifdef TSBT_DEBUG
 	printf("%20s%70s\n", "print", "prints all keys available in sorted order");
 	printf("%20s%70s\n", "visual <file>", "saves a visual representation of the tree to the given file");
@@ -189,7 +250,11 @@ doLookup(tsbintree *bt, char *key) {
 	}
 
 	if (tsbintree_lookup(bt, key, &val) == -1) {
-		CmdError("tsbintree_lookup: %s\n\n", strerror(errno));
+		if (errno == ENOKEY) {
+			CmdError("No such key: %s\n\n", key);
+		} else {
+			CmdError("tsbintree_lookup: %s\n\n", strerror(errno));
+		}
 	} else {
 		if (val == NULL) {
 			printf("=> No data associated with \"%s\" key.\n\n", key);
@@ -199,6 +264,298 @@ doLookup(tsbintree *bt, char *key) {
 	}
 }
 
+static int
+printEntry(char *key, void *value, void *arg) {
+	(void) arg;
+
+	printf("\t* %s=%s\n", key, (char *) value);
+	return 0;
+}
+
+static void
+doRange(tsbintree *bt, char *lo, char *hi) {
+	int n;
+
+	if (lo == NULL || hi == NULL) {
+		CmdError("Syntax: range <lo> <hi>\n\n");
+		return;
+	}
+
+	if ((n = tsbintree_range(bt, lo, hi, printEntry, NULL)) == -1) {
+		CmdError("tsbintree_range: %s\n\n", strerror(errno));
+	} else {
+		printf("(%d elements)\n\n", n);
+	}
+}
+
+/* the commands of a workload, parsed */
+enum opType { OP_ADD, OP_DELETE, OP_LOOKUP, OP_RANGE, OP_TYPES };
+
+static const char *opNames[OP_TYPES] = { "add", "delete", "lookup", "range" };
+
+struct op {
+	enum opType type;
+	char *arg1, *arg2; /* in the buffer the file was read into */
+};
+
+/* a thread running a workload: ops first, first + step, first + 2 * step... */
+struct replayer {
+	pthread_t thread;
+	tsbintree *bt;
+	struct op *ops;
+	size_t first, step, nops;
+	pthread_barrier_t *start;
+	uint64_t *latencies; /* of each op, in nanoseconds (shared: each thread writes its own) */
+	size_t counts[OP_TYPES], failures[OP_TYPES];
+};
+
+static uint64_t
+nowNs(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+countEntry(char *key, void *value, void *arg) {
+	(void) key;
+	(void) value;
+	(void) arg;
+
+	return 0;
+}
+
+static void *
+replay(void *arg) {
+	struct replayer *r = arg;
+	struct op *op;
+	uint64_t start;
+	void *val;
+	size_t i;
+	int result;
+
+	pthread_barrier_wait(r->start);
+
+	for (i = r->first; i < r->nops; i += r->step) {
+		op = &r->ops[i];
+
+		start = nowNs();
+		switch (op->type) {
+			case OP_ADD:    result = tsbintree_add(r->bt, op->arg1, op->arg2); break;
+			case OP_DELETE: result = tsbintree_delete(r->bt, op->arg1); break;
+			case OP_LOOKUP: result = tsbintree_lookup(r->bt, op->arg1, &val); break;
+			default:        result = tsbintree_range(r->bt, op->arg1, op->arg2, countEntry, NULL); break;
+		}
+		r->latencies[i] = nowNs() - start;
+
+		++r->counts[op->type];
+		if (result == -1) {
+			/* keys missing, or (EINVAL) added again */
+			if (errno != ENOKEY && !(op->type == OP_ADD && errno == EINVAL))
+				fatal(opNames[op->type]);
+			++r->failures[op->type];
+		}
+	}
+
+	return NULL;
+}
+
+static int
+byLatency(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* reads the workload at `path` whole, and parses its commands. Returns how many */
+static size_t
+loadWorkload(const char *path, struct op **opsp) {
+	char *buf, *line, *next, *command, *save;
+	size_t nops = 0, capacity = 1024;
+	struct op *ops, *o;
+	struct stat st;
+	ssize_t numRead = 0;
+	off_t total = 0;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		fatal("open");
+	if (fstat(fd, &st) == -1)
+		fatal("fstat");
+
+	/* never freed: keys and values stay in it, and the tree points to them */
+	if ((buf = malloc(st.st_size + 1)) == NULL)
+		fatal("malloc");
+
+	while (total < st.st_size && (numRead = read(fd, buf + total, st.st_size - total)) > 0)
+		total += numRead;
+	if (numRead == -1)
+		fatal("read");
+	buf[total] = '\0';
+	close(fd);
+
+	if ((ops = malloc(capacity * sizeof(struct op))) == NULL)
+		fatal("malloc");
+
+	for (line = buf; line != NULL && *line != '\0'; line = next) {
+		if ((next = strchr(line, '\n')) != NULL)
+			*next++ = '\0';
+
+		if ((command = strtok_r(line, " \t", &save)) == NULL)
+			continue;
+
+		if (nops == capacity) {
+			capacity *= 2;
+			if ((ops = realloc(ops, capacity * sizeof(struct op))) == NULL)
+				fatal("realloc");
+		}
+
+		o = &ops[nops];
+		o->arg1 = strtok_r(NULL, " \t", &save);
+		o->arg2 = strtok_r(NULL, " \t", &save);
+
+		if (!strcmp(command, "add") && o->arg2 != NULL)
+			o->type = OP_ADD;
+		else if (!strcmp(command, "delete") && o->arg1 != NULL)
+			o->type = OP_DELETE;
+		else if (!strcmp(command, "lookup") && o->arg1 != NULL)
+			o->type = OP_LOOKUP;
+		else if (!strcmp(command, "range") && o->arg2 != NULL)
+			o->type = OP_RANGE;
+		else
+			continue;
+
+		++nops;
+	}
+
+	*opsp = ops;
+	return nops;
+}
+
+static void
+runWorkload(const char *path, int nthreads) {
+	struct replayer *replayers;
+	pthread_barrier_t start;
+	uint64_t *latencies, *sorted, begin, elapsed, sum;
+	size_t nops, i, n, count, failures;
+	struct op *ops;
+	tsbintree bt;
+	int t, s, type;
+
+	nops = loadWorkload(path, &ops);
+	if (nops == 0) {
+		fprintf(stderr, "%s: no commands\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	latencies = malloc(nops * sizeof(uint64_t));
+	sorted = malloc(nops * sizeof(uint64_t));
+	replayers = calloc(nthreads, sizeof(struct replayer));
+	if (latencies == NULL || sorted == NULL || replayers == NULL)
+		fatal("malloc");
+
+	tsbintree_init(&bt);
+	pthread_barrier_init(&start, NULL, nthreads + 1);
+
+	for (t = 0; t < nthreads; ++t) {
+		replayers[t].bt = &bt;
+		replayers[t].ops = ops;
+		replayers[t].first = t;
+		replayers[t].step = nthreads;
+		replayers[t].nops = nops;
+		replayers[t].start = &start;
+		replayers[t].latencies = latencies;
+
+		if ((s = pthread_create(&replayers[t].thread, NULL, replay, &replayers[t])) != 0) {
+			errno = s;
+			fatal("pthread_create");
+		}
+	}
+
+	pthread_barrier_wait(&start);
+	begin = nowNs();
+	for (t = 0; t < nthreads; ++t)
+		pthread_join(replayers[t].thread, NULL);
+	elapsed = nowNs() - begin;
+
+	printf("%zu commands, %d threads: %.3f s, %.0f commands/s\n\n", nops, nthreads,
+			elapsed / 1e9, nops / (elapsed / 1e9));
+	printf("%-8s %10s %10s %10s %10s %10s %10s\n", "command", "count", "failed", "mean (ns)",
+			"p50 (ns)", "p99 (ns)", "max (ns)");
+
+	for (type = 0; type < OP_TYPES; ++type) {
+		for (i = 0, n = 0, sum = 0; i < nops; ++i) {
+			if (ops[i].type == (enum opType) type) {
+				sorted[n++] = latencies[i];
+				sum += latencies[i];
+			}
+		}
+
+		if (n == 0)
+			continue;
+
+		for (t = 0, count = 0, failures = 0; t < nthreads; ++t) {
+			count += replayers[t].counts[type];
+			failures += replayers[t].failures[type];
+		}
+
+		qsort(sorted, n, sizeof(uint64_t), byLatency);
+		printf("%-8s %10zu %10zu %10.0f %10llu %10llu %10llu\n", opNames[type], count, failures,
+				(double) sum / n, (unsigned long long) sorted[n / 2],
+				(unsigned long long) sorted[n * 99 / 100], (unsigned long long) sorted[n - 1]);
+	}
+
+#ifdef TSBT_STATS
+	printf("\n");
+	doStats(&bt);
+#endif
+
+	pthread_barrier_destroy(&start);
+	free(replayers);
+	free(sorted);
+	free(latencies);
+}
+
+#ifdef TSBT_STATS
+static void
+doStats(tsbintree *bt) {
+	static const char *names[TSBT_STATS_OPS] = { "add", "delete", "lookup" };
+	struct tsbintree_stats st;
+	struct tsbintree_op_stats *o;
+	unsigned int d, last;
+	int op;
+
+	if (tsbintree_stats(bt, &st) == -1) {
+		CmdError("tsbintree_stats: %s\n\n", strerror(errno));
+		return;
+	}
+
+	printf("%zu nodes, depth: mean %.2f, max %u\n", st.nodes,
+			st.nodes ? (double) st.depth_total / st.nodes : 0.0, st.max_depth);
+
+	/* the histogram, down to the deepest level with nodes */
+	last = (st.max_depth < TSBT_STATS_DEPTHS) ? st.max_depth : TSBT_STATS_DEPTHS;
+	for (d = 1; d <= last; ++d)
+		printf("  depth %2u%s %10lu\n", d, (d == TSBT_STATS_DEPTHS) ? "+" : " ", st.depths[d]);
+
+	printf("\n%-8s %10s %10s %10s %12s %10s %14s %12s\n", "op", "count", "mean path",
+			"max path", "locks/op", "waits", "mean wait (ns)", "max wait (ns)");
+	for (op = 0; op < TSBT_STATS_OPS; ++op) {
+		o = &st.ops[op];
+		if (o->count == 0)
+			continue;
+
+		printf("%-8s %10lu %10.2f %10lu %12.2f %10lu %14.0f %12llu\n", names[op], o->count,
+				(double) o->path_total / o->count, o->path_max, (double) o->locks / o->count,
+				o->lock_waits, o->lock_waits ? (double) o->wait_ns / o->lock_waits : 0.0,
+				o->wait_max_ns);
+	}
+
+	printf("lookups retried lock-free %lu times, fell back to locks %lu times\n\n",
+			st.lookup_retries, st.lookup_fallbacks);
+}
+#endif
 
 #ifdef TSBT_DEBUG
 static void
@@ -2,23 +2,60 @@
  *
  * The tsbintree is a thread-safe binary tree implementation. This test program aims to
  * exercise adding and removing elements from the tree from multiple threads at the same
- * time.
+ * time. Each thread inserts a run of sequential keys, looks them up again and finally
+ * deletes every other one, checking that the remaining keys can still be found.
+ *
+ * Trees loaded in bulk, with tsbintree_build and tsbintree_add_batch, are then put
+ * through the same checks: every key must be found and come out in order, and keys
+ * given twice must be rejected (or, in a batch, skipped) as documented. Range
+ * scans are checked against bounds that are keys and bounds between keys, open and
+ * empty ranges, and cursors are run from the start, from a key, past the last key
+ * and while other threads delete keys under them.
+ *
+ * `make check` runs the checks twice: once as built by default, with the tree
+ * keeping pointers to the keys, and once with TSBT_INLINE_KEYS defined.
  *
  * The number of threads used can be set by defining the NUM_THREADS constant.
  *
+ * When given the -b flag, the program instead benchmarks the tree: for each thread
+ * count, threads run a mix of lookups and updates against a pre-loaded tree for a
+ * fixed duration, and the aggregate throughput and latency percentiles are reported.
+ * With -H, the same runs are made against a tshashmap instead, for comparison.
+ *
  * Usage:
  *
  * 	$ ./test/threaded_operations
+ * 	$ ./test/threaded_operations -b [-H] [-t threads] [-d distribution] [-r reads]
+ * 	                                [-s seconds] [-k keys] [-z theta]
+ *
+ * 	-H: benchmark the tshashmap rather than the tree
+ * 	-t: comma separated list of thread counts to run with (default: 1,2,4,8)
+ * 	-d: key distribution: seq, uniform or zipf (default: uniform)
+ * 	-r: percentage of operations that are lookups (default: 95)
+ * 	-s: duration of each run, in seconds (default: 5)
+ * 	-k: number of distinct keys (default: 100000)
+ * 	-z: skew of the zipfian distribution (default: 0.99)
+ *
+ * Writes alternate between adding a key and deleting it again, so the tree keeps
+ * about the size it was loaded with (every key in the key space).
  *
  * Author: Renato Mascarenhas Costa
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <math.h>
 
 #include <pthread.h>
 
 #include "tsbintree.h"
+#include "tshashmap.h"
+#include "../../../lib/bench.h"
 
 #ifndef NUM_THREADS
 #  define NUM_THREADS (100)
@@ -39,11 +76,28 @@ struct thread_spec {
 static void pexit(const char *fCall);
 static void pthread_pexit(const int err, const char *fCall);
 
+static int run_check(void);
+static int run_benchmark(int argc, char *argv[]);
+
 static int thread_spec_create(struct thread_spec **spec, int tid, tsbintree *tree, int start);
 static void *add_nodes(void *spec);
+static int check_nodes(struct thread_spec *spec);
+
+static int check_build(void);
+static int check_add_batch(void);
+static int check_range(void);
+static int check_cursor(void);
 
 int
-main() {
+main(int argc, char *argv[]) {
+	if (argc > 1 && !strcmp(argv[1], "-b"))
+		return run_benchmark(argc, argv);
+
+	return run_check();
+}
+
+static int
+run_check() {
 	struct thread_spec *spec;
 	tsbintree tree;
 	int i, s, result, start;
@@ -76,7 +130,7 @@ main() {
 		if (s != 0)
 			pthread_pexit(s, "pthread_join");
 
-		result = (int) r;
+		result = (int) (long) r;
 		if (result != 0) {
 			printf("Thread %d failed with error %s\n", i+1, strerror(result));
 			exit(EXIT_FAILURE);
@@ -93,6 +147,16 @@ main() {
 
 	free(threads);
 
+	if (check_build() == -1 || check_add_batch() == -1)
+		exit(EXIT_FAILURE);
+
+	printf(">>> Bulk build and batched insert checks passed.\n");
+
+	if (check_range() == -1 || check_cursor() == -1)
+		exit(EXIT_FAILURE);
+
+	printf(">>> Range scan and cursor checks passed.\n");
+
 	return EXIT_SUCCESS;
 }
 
@@ -125,15 +189,510 @@ add_nodes(void *arg) {
 		if (tsbintree_add(spec->tree, key, VALUE) == -1) {
 			free(arg);
 			r = errno;
-			return (void *) r;
+			return (void *) (long) r;
 		}
 		printf("#%d: %s\n", spec->tid, key);
 	}
 
+	if (check_nodes(spec) == -1) {
+		r = errno;
+		free(arg);
+		return (void *) (long) r;
+	}
+
 	free(arg);
 	return (void *) 0;
 }
 
+static int
+check_nodes(struct thread_spec *spec) {
+	char key[MAX_KEY_LEN];
+	void *value;
+	int i;
+
+	for (i = 0; i < spec->delta; ++i) {
+		snprintf(key, MAX_KEY_LEN, "%d", spec->start + i);
+		if (tsbintree_lookup(spec->tree, key, &value) == -1)
+			return -1;
+
+		if (value != VALUE) {
+			errno = EFAULT;
+			return -1;
+		}
+	}
+
+	for (i = 0; i < spec->delta; i += 2) {
+		snprintf(key, MAX_KEY_LEN, "%d", spec->start + i);
+		if (tsbintree_delete(spec->tree, key) == -1)
+			return -1;
+	}
+
+	for (i = 0; i < spec->delta; ++i) {
+		snprintf(key, MAX_KEY_LEN, "%d", spec->start + i);
+		if ((tsbintree_lookup(spec->tree, key, &value) == -1) != (i % 2 == 0)) {
+			errno = (i % 2 == 0) ? EEXIST : ENOKEY;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Bulk loading checks */
+
+/* reports a failed check, along with the error that caused it, if any */
+static int
+check_failed(const char *what, int err) {
+	if (err != 0)
+		printf("%s: %s\n", what, strerror(err));
+	else
+		printf("%s\n", what);
+
+	return -1;
+}
+
+static int
+compare_keys(const void *a, const void *b) {
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* the keys `start` to `start + n - 1`, spelled as check_nodes does, in the order
+ * given by `stride` (coprime with `n`), and a value for each */
+static char **
+make_keys(int start, int n, int stride, void ***values) {
+	char **keys;
+	int i;
+
+	keys = malloc(n * sizeof(char *));
+	*values = malloc(n * sizeof(void *));
+	if (keys == NULL || *values == NULL)
+		pexit("malloc");
+
+	for (i = 0; i < n; ++i) {
+		keys[i] = malloc(MAX_KEY_LEN);
+		if (keys[i] == NULL)
+			pexit("malloc");
+
+		snprintf(keys[i], MAX_KEY_LEN, "%d", start + (int) (((long) i * stride) % n));
+		(*values)[i] = VALUE;
+	}
+
+	return keys;
+}
+
+static void
+free_keys(char **keys, void **values, int n) {
+	int i;
+
+	for (i = 0; i < n; ++i)
+		free(keys[i]);
+
+	free(keys);
+	free(values);
+}
+
+struct order_check {
+	char last[MAX_KEY_LEN];
+	int count;
+	int sorted;
+};
+
+static int
+order_callback(char *key, __attribute__((unused)) void *value, void *arg) {
+	struct order_check *oc = arg;
+
+	if (oc->count > 0 && strcmp(oc->last, key) >= 0)
+		oc->sorted = 0;
+
+	strncpy(oc->last, key, MAX_KEY_LEN - 1);
+	++oc->count;
+	return 0;
+}
+
+/* checks that the tree holds exactly `n` keys, and that they come out in order */
+static int
+check_in_order(tsbintree *tree, int n, const char *what) {
+	struct order_check oc = { .count = 0, .sorted = 1 };
+
+	if (tsbintree_range(tree, NULL, NULL, order_callback, &oc) == -1)
+		return check_failed(what, errno);
+
+	if (!oc.sorted || oc.count != n) {
+		printf("%s: %d keys%s, %d expected\n", what, oc.count,
+				oc.sorted ? "" : " out of order", n);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* checks that adding a key already in the tree fails as tsbintree_add does */
+static int
+check_duplicate_add(tsbintree *tree, char *key, const char *what) {
+	if (tsbintree_add(tree, key, VALUE) != -1)
+		return check_failed(what, 0);
+
+	if (errno != EINVAL)
+		return check_failed(what, errno);
+
+	return 0;
+}
+
+static int
+check_build(void) {
+	struct thread_spec spec;
+	tsbintree tree;
+	char **keys, *twice[2];
+	void **values;
+
+	tsbintree_init(&tree);
+	keys = make_keys(0, DELTA, 1, &values);
+	qsort(keys, DELTA, sizeof(char *), compare_keys);
+
+	/* keys must be strictly increasing: a key given twice is out of order */
+	twice[0] = twice[1] = keys[0];
+	if (tsbintree_build(&tree, twice, NULL, 2) != -1 || errno != EINVAL)
+		return check_failed("build: repeated key not rejected with EINVAL", 0);
+
+	if (tsbintree_build(&tree, keys, values, DELTA) == -1)
+		return check_failed("build", errno);
+
+	if (check_in_order(&tree, DELTA, "build: in order scan") == -1)
+		return -1;
+
+	if (tsbintree_build(&tree, keys, values, DELTA) != -1 || errno != EEXIST)
+		return check_failed("build: non-empty tree not rejected with EEXIST", 0);
+
+	if (check_duplicate_add(&tree, keys[DELTA / 2], "build: key added twice") == -1)
+		return -1;
+
+	spec.tree = &tree;
+	spec.tid = 0;
+	spec.start = 0;
+	spec.delta = DELTA;
+	if (check_nodes(&spec) == -1)
+		return check_failed("build: check_nodes", errno);
+
+	tsbintree_destroy(&tree);
+	free_keys(keys, values, DELTA);
+	return 0;
+}
+
+static int
+check_add_batch(void) {
+	struct thread_spec spec;
+	tsbintree tree;
+	char **keys, **more, **batch;
+	void **values, **moreValues, **batchValues;
+	int i, n, added, extra = DELTA / 10;
+
+	tsbintree_init(&tree);
+
+	/* every key once, out of order, followed by some of them again */
+	keys = make_keys(0, DELTA, 7919, &values);
+	batch = malloc((DELTA + extra) * sizeof(char *));
+	batchValues = malloc((DELTA + extra) * sizeof(void *));
+	if (batch == NULL || batchValues == NULL)
+		pexit("malloc");
+
+	for (i = 0; i < DELTA + extra; ++i) {
+		batch[i] = keys[(i < DELTA) ? i : (i * 13) % DELTA];
+		batchValues[i] = VALUE;
+	}
+
+	added = tsbintree_add_batch(&tree, batch, batchValues, DELTA + extra);
+	if (added == -1)
+		return check_failed("add_batch", errno);
+
+	if (added != DELTA) {
+		printf("add_batch: %d keys added, %d expected\n", added, DELTA);
+		return -1;
+	}
+
+	/* a second batch, half of it already in the tree */
+	n = extra;
+	more = make_keys(DELTA - n, 2 * n, 1, &moreValues);
+	added = tsbintree_add_batch(&tree, more, moreValues, 2 * n);
+	if (added == -1)
+		return check_failed("add_batch: second batch", errno);
+
+	if (added != n) {
+		printf("add_batch: %d keys of the second batch added, %d expected\n", added, n);
+		return -1;
+	}
+
+	if (check_in_order(&tree, DELTA + n, "add_batch: in order scan") == -1)
+		return -1;
+
+	if (check_duplicate_add(&tree, keys[0], "add_batch: key added twice") == -1)
+		return -1;
+
+	spec.tree = &tree;
+	spec.tid = 0;
+	spec.start = 0;
+	spec.delta = DELTA + n;
+	if (check_nodes(&spec) == -1)
+		return check_failed("add_batch: check_nodes", errno);
+
+	tsbintree_destroy(&tree);
+	free(batch);
+	free(batchValues);
+	free_keys(keys, values, DELTA);
+	free_keys(more, moreValues, 2 * n);
+	return 0;
+}
+
+/* Range scan and cursor checks */
+
+#define ORDERED_KEYS (2000)     /* keys of the trees scanned, all of them even */
+#define CURSOR_KEYS (20000)
+#define CURSOR_DELETERS (4)
+
+/* the even keys below 2 * `n`, zero padded so that they sort as numbers */
+static char **
+make_even_keys(int n, void ***values) {
+	char **keys;
+	int i;
+
+	keys = malloc(n * sizeof(char *));
+	*values = malloc(n * sizeof(void *));
+	if (keys == NULL || *values == NULL)
+		pexit("malloc");
+
+	for (i = 0; i < n; ++i) {
+		keys[i] = malloc(MAX_KEY_LEN);
+		if (keys[i] == NULL)
+			pexit("malloc");
+
+		snprintf(keys[i], MAX_KEY_LEN, "%06d", 2 * i);
+		(*values)[i] = VALUE;
+	}
+
+	return keys;
+}
+
+struct range_check {
+	char first[MAX_KEY_LEN];
+	char last[MAX_KEY_LEN];
+	int count;
+	int sorted;
+};
+
+static int
+range_callback(char *key, __attribute__((unused)) void *value, void *arg) {
+	struct range_check *rc = arg;
+
+	if (rc->count == 0)
+		strncpy(rc->first, key, MAX_KEY_LEN - 1);
+	else if (strcmp(rc->last, key) >= 0)
+		rc->sorted = 0;
+
+	strncpy(rc->last, key, MAX_KEY_LEN - 1);
+	++rc->count;
+	return 0;
+}
+
+/* scans from `lo` to `hi` and checks that `n` keys came out, in order, from
+ * `first` to `last` */
+static int
+check_scan(tsbintree *tree, char *lo, char *hi, int n, const char *first, const char *last) {
+	struct range_check rc = { .count = 0, .sorted = 1 };
+	int r;
+
+	r = tsbintree_range(tree, lo, hi, range_callback, &rc);
+	if (r == -1)
+		return check_failed("range", errno);
+
+	if (r != rc.count || rc.count != n || !rc.sorted ||
+	    (n > 0 && (strcmp(rc.first, first) != 0 || strcmp(rc.last, last) != 0))) {
+		printf("range [%s, %s]: %d keys%s, from %s to %s; %d expected, from %s to %s\n",
+				lo ? lo : "-", hi ? hi : "-", rc.count, rc.sorted ? "" : " out of order",
+				rc.count ? rc.first : "-", rc.count ? rc.last : "-",
+				n, n ? first : "-", n ? last : "-");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+check_range(void) {
+	tsbintree tree;
+	char **keys;
+	void **values;
+
+	tsbintree_init(&tree);
+	keys = make_even_keys(ORDERED_KEYS, &values);
+	if (tsbintree_build(&tree, keys, values, ORDERED_KEYS) == -1)
+		return check_failed("range: build", errno);
+
+	/* bounds are inclusive: keys equal to them come out, but no key beyond them,
+	 * whether the bounds are in the tree or fall between keys */
+	if (check_scan(&tree, "000100", "000200", 51, "000100", "000200") == -1 ||
+	    check_scan(&tree, "000101", "000199", 49, "000102", "000198") == -1 ||
+	    check_scan(&tree, "000100", "000100", 1, "000100", "000100") == -1)
+		return -1;
+
+	/* open bounds */
+	if (check_scan(&tree, NULL, "000010", 6, "000000", "000010") == -1 ||
+	    check_scan(&tree, "003990", NULL, 5, "003990", "003998") == -1 ||
+	    check_scan(&tree, NULL, NULL, ORDERED_KEYS, "000000", "003998") == -1)
+		return -1;
+
+	/* empty ranges: between two keys, reversed, and past either end */
+	if (check_scan(&tree, "000101", "000101", 0, NULL, NULL) == -1 ||
+	    check_scan(&tree, "000200", "000100", 0, NULL, NULL) == -1 ||
+	    check_scan(&tree, "003999", NULL, 0, NULL, NULL) == -1 ||
+	    check_scan(&tree, NULL, "0", 0, NULL, NULL) == -1)
+		return -1;
+
+	tsbintree_destroy(&tree);
+	free_keys(keys, values, ORDERED_KEYS);
+	return 0;
+}
+
+/* runs a cursor from `start` to the end, and checks that `n` keys came out in
+ * order, the first being `first` */
+static int
+check_walk(tsbintree *tree, char *start, int n, const char *first) {
+	tsbintree_cursor cursor;
+	char prev[MAX_KEY_LEN], *key;
+	int count;
+
+	if (tsbintree_cursor_init(&cursor, tree, start) == -1)
+		return check_failed("cursor_init", errno);
+
+	for (count = 0; tsbintree_cursor_next(&cursor, &key, NULL) != -1; ++count) {
+		if ((count == 0 && strcmp(key, first) != 0) || (count > 0 && strcmp(prev, key) >= 0)) {
+			printf("cursor from %s: %s after %d keys\n", start ? start : "-", key, count);
+			return -1;
+		}
+		strncpy(prev, key, MAX_KEY_LEN - 1);
+		prev[MAX_KEY_LEN - 1] = '\0';
+	}
+
+	if (errno != ENOKEY)
+		return check_failed("cursor_next", errno);
+
+	if (count != n) {
+		printf("cursor from %s: %d keys, %d expected\n", start ? start : "-", count, n);
+		return -1;
+	}
+
+	/* a cursor at the end stays there */
+	if (tsbintree_cursor_next(&cursor, &key, NULL) != -1 || errno != ENOKEY)
+		return check_failed("cursor: next key after the end", 0);
+
+	return 0;
+}
+
+struct deleter {
+	tsbintree *tree;
+	char **keys;
+	int first;
+};
+
+/* deletes a share of the keys at odd indexes, from `first` on */
+static void *
+delete_keys(void *arg) {
+	struct deleter *d = arg;
+	int i;
+
+	for (i = d->first; i < CURSOR_KEYS; i += 2 * CURSOR_DELETERS) {
+		if (tsbintree_delete(d->tree, d->keys[i]) == -1)
+			return (void *) (long) errno;
+	}
+
+	return NULL;
+}
+
+static int
+check_cursor(void) {
+	struct deleter deleters[CURSOR_DELETERS];
+	pthread_t threads[CURSOR_DELETERS];
+	tsbintree_cursor cursor;
+	tsbintree tree;
+	char **keys, *key, prev[MAX_KEY_LEN];
+	void **values, *r;
+	int i, s, count, kept, failed;
+
+	tsbintree_init(&tree);
+	keys = make_even_keys(ORDERED_KEYS, &values);
+	if (tsbintree_build(&tree, keys, values, ORDERED_KEYS) == -1)
+		return check_failed("cursor: build", errno);
+
+	if (check_walk(&tree, NULL, ORDERED_KEYS, "000000") == -1 ||
+	    check_walk(&tree, "000100", ORDERED_KEYS - 50, "000100") == -1 ||
+	    check_walk(&tree, "000101", ORDERED_KEYS - 51, "000102") == -1 ||
+	    check_walk(&tree, "003998", 1, "003998") == -1 ||
+	    check_walk(&tree, "003999", 0, NULL) == -1)
+		return -1;
+
+	tsbintree_destroy(&tree);
+	free_keys(keys, values, ORDERED_KEYS);
+
+	/* a cursor running while other threads delete half of the keys must still
+	 * return the other half, in order */
+	tsbintree_init(&tree);
+	keys = make_even_keys(CURSOR_KEYS, &values);
+	if (tsbintree_build(&tree, keys, values, CURSOR_KEYS) == -1)
+		return check_failed("cursor: build", errno);
+
+	if (tsbintree_cursor_init(&cursor, &tree, NULL) == -1)
+		return check_failed("cursor_init", errno);
+
+	for (i = 0; i < CURSOR_DELETERS; ++i) {
+		deleters[i].tree = &tree;
+		deleters[i].keys = keys;
+		deleters[i].first = 2 * i + 1;
+	}
+
+	for (i = 0; i < CURSOR_DELETERS; ++i) {
+		s = pthread_create(&threads[i], NULL, delete_keys, &deleters[i]);
+		if (s != 0)
+			pthread_pexit(s, "pthread_create");
+	}
+
+	failed = 0;
+	kept = 0;
+	for (count = 0; tsbintree_cursor_next(&cursor, &key, NULL) != -1; ++count) {
+		if (count > 0 && strcmp(prev, key) >= 0)
+			failed = 1;
+
+		/* keys are twice their index */
+		if ((atoi(key) / 2) % 2 == 0)
+			++kept;
+
+		strncpy(prev, key, MAX_KEY_LEN - 1);
+		prev[MAX_KEY_LEN - 1] = '\0';
+	}
+
+	if (errno != ENOKEY)
+		return check_failed("cursor_next", errno);
+
+	for (i = 0; i < CURSOR_DELETERS; ++i) {
+		s = pthread_join(threads[i], &r);
+		if (s != 0)
+			pthread_pexit(s, "pthread_join");
+
+		if (r != NULL)
+			return check_failed("cursor: delete", (int) (long) r);
+	}
+
+	if (failed || kept != CURSOR_KEYS / 2) {
+		printf("cursor under deletes: %d keys kept of %d%s\n", kept, CURSOR_KEYS / 2,
+				failed ? ", out of order" : "");
+		return -1;
+	}
+
+	if (check_walk(&tree, NULL, CURSOR_KEYS / 2, "000000") == -1)
+		return -1;
+
+	tsbintree_destroy(&tree);
+	free_keys(keys, values, CURSOR_KEYS);
+	return 0;
+}
+
 static void
 pexit(const char *fCall) {
 	perror(fCall);
@@ -146,3 +705,316 @@ pthread_pexit(const int err, const char *fCall) {
 	perror(fCall);
 	exit(EXIT_FAILURE);
 }
+
+/* Benchmark mode */
+
+#define MAX_RUNS (32)
+#define BENCH_KEY_LEN (24)
+
+enum distribution { DIST_SEQ, DIST_UNIFORM, DIST_ZIPF };
+
+struct bench_config {
+	int threads[MAX_RUNS];
+	int nruns;
+	enum distribution dist;
+	int reads;
+	int seconds;
+	long nkeys;
+	double theta;
+	int hashmap;
+};
+
+/* constants of the zipfian generator (Gray et al., "Quickly generating
+ * billion-record synthetic databases"), computed once per key count */
+struct zipf {
+	double theta;
+	double zetan;
+	double alpha;
+	double eta;
+};
+
+struct bench_thread {
+	tsbintree *tree;
+	tshashmap *map;
+	const struct bench_config *config;
+	const struct zipf *zipf;
+	uint64_t rng;
+	long next_key;
+	long ops;
+	uint64_t hist[BENCH_HIST_BUCKETS];
+};
+
+static char **bench_keys;
+static struct benchControl bench_control;
+
+static void
+bench_usage(const char *progName) {
+	fprintf(stderr, "Usage: %s -b [-H] [-t threads] [-d seq|uniform|zipf] [-r reads] "
+			"[-s seconds] [-k keys] [-z theta]\n", progName);
+	exit(EXIT_FAILURE);
+}
+
+static long
+parse_long(const char *arg, long min, const char *progName) {
+	long n;
+
+	if (benchParseLong(arg, min, LONG_MAX, &n) == -1)
+		bench_usage(progName);
+
+	return n;
+}
+
+static uint64_t
+xorshift(uint64_t *state) {
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+static void
+zipf_init(struct zipf *z, long n, double theta) {
+	double zeta2;
+	long i;
+
+	z->theta = theta;
+	z->zetan = 0;
+	for (i = 1; i <= n; ++i)
+		z->zetan += 1.0 / pow(i, theta);
+
+	zeta2 = 1.0 + 1.0 / pow(2, theta);
+	z->alpha = 1.0 / (1.0 - theta);
+	z->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+}
+
+static long
+zipf_next(const struct zipf *z, long n, uint64_t *rng) {
+	double u, uz;
+	long rank;
+
+	u = (xorshift(rng) >> 11) * (1.0 / 9007199254740992.0);
+	uz = u * z->zetan;
+
+	if (uz < 1.0)
+		rank = 0;
+	else if (uz < 1.0 + pow(0.5, z->theta))
+		rank = 1;
+	else
+		rank = (long) (n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+
+	if (rank >= n)
+		rank = n - 1;
+
+	/* scatter the popular ranks over the key space; otherwise the hottest keys
+	 * would all be neighbours in the tree */
+	return (long) (((uint64_t) rank * 0x9E3779B97F4A7C15ULL) % (uint64_t) n);
+}
+
+static long
+next_key(struct bench_thread *t) {
+	const struct bench_config *c = t->config;
+
+	switch (c->dist) {
+	case DIST_SEQ:
+		t->next_key = (t->next_key + 1) % c->nkeys;
+		return t->next_key;
+	case DIST_ZIPF:
+		return zipf_next(t->zipf, c->nkeys, &t->rng);
+	default:
+		return (long) (xorshift(&t->rng) % (uint64_t) c->nkeys);
+	}
+}
+
+static void *
+bench_worker(void *arg) {
+	struct bench_thread *t = arg;
+	uint64_t start, elapsed;
+	void *value;
+	long k;
+
+	while (!benchStopped(&bench_control)) {
+		k = next_key(t);
+
+		start = benchNowNs();
+		if (t->map != NULL) {
+			if ((long) (xorshift(&t->rng) % 100) < t->config->reads) {
+				tshashmap_lookup(t->map, bench_keys[k], &value);
+			} else if (tshashmap_add(t->map, bench_keys[k], VALUE) == -1) {
+				tshashmap_delete(t->map, bench_keys[k]);
+			}
+		} else if ((long) (xorshift(&t->rng) % 100) < t->config->reads) {
+			tsbintree_lookup(t->tree, bench_keys[k], &value);
+		} else if (tsbintree_add(t->tree, bench_keys[k], VALUE) == -1) {
+			tsbintree_delete(t->tree, bench_keys[k]);
+		}
+		elapsed = benchNowNs() - start;
+
+		t->hist[benchHistIndex(elapsed)]++;
+		t->ops++;
+	}
+
+	return NULL;
+}
+
+static void
+bench_run(const struct bench_config *config, const struct zipf *zipf, int nthreads) {
+	struct bench_thread *threads;
+	uint64_t hist[BENCH_HIST_BUCKETS], start, elapsed;
+	pthread_t *tids;
+	tsbintree tree;
+	tshashmap map;
+	long ops, k;
+	int i, s;
+
+	if (config->hashmap) {
+		if (tshashmap_init(&map) == -1)
+			pexit("tshashmap_init");
+		for (k = 0; k < config->nkeys; ++k) {
+			if (tshashmap_add(&map, bench_keys[k], NULL) == -1)
+				pexit("tshashmap_add");
+		}
+	} else {
+		tsbintree_init(&tree);
+		if (tsbintree_build(&tree, bench_keys, NULL, config->nkeys) == -1)
+			pexit("tsbintree_build");
+	}
+
+	threads = calloc(nthreads, sizeof(struct bench_thread));
+	tids = malloc(nthreads * sizeof(pthread_t));
+	if (threads == NULL || tids == NULL)
+		pexit("malloc");
+
+	memset(&bench_control, 0, sizeof(bench_control));
+	for (i = 0; i < nthreads; ++i) {
+		threads[i].tree = &tree;
+		threads[i].map = config->hashmap ? &map : NULL;
+		threads[i].config = config;
+		threads[i].zipf = zipf;
+		threads[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+		threads[i].next_key = (config->nkeys / nthreads) * i;
+	}
+
+	start = benchNowNs();
+	for (i = 0; i < nthreads; ++i) {
+		s = pthread_create(&tids[i], NULL, bench_worker, &threads[i]);
+		if (s != 0)
+			pthread_pexit(s, "pthread_create");
+	}
+
+	sleep(config->seconds);
+	benchStop(&bench_control);
+
+	for (i = 0; i < nthreads; ++i) {
+		s = pthread_join(tids[i], NULL);
+		if (s != 0)
+			pthread_pexit(s, "pthread_join");
+	}
+	elapsed = benchNowNs() - start;
+
+	memset(hist, 0, sizeof(hist));
+	ops = 0;
+	for (i = 0; i < nthreads; ++i) {
+		ops += threads[i].ops;
+		benchHistAdd(hist, threads[i].hist);
+	}
+
+	printf("%8d %14.0f %10llu %10llu\n", nthreads, ops / (elapsed / 1e9),
+			(unsigned long long) benchHistPercentile(hist, ops, 0.50),
+			(unsigned long long) benchHistPercentile(hist, ops, 0.99));
+
+	if (config->hashmap)
+		tshashmap_destroy(&map);
+	else
+		tsbintree_destroy(&tree);
+	free(threads);
+	free(tids);
+}
+
+static int
+run_benchmark(int argc, char *argv[]) {
+	static const char *dist_names[] = { "seq", "uniform", "zipf" };
+	struct bench_config config;
+	char default_list[] = "1,2,4,8";
+	struct zipf zipf;
+	char *list, *tok;
+	int opt, i;
+	long k;
+
+	config.nruns = 0;
+	config.dist = DIST_UNIFORM;
+	config.reads = 95;
+	config.seconds = 5;
+	config.nkeys = 100000;
+	config.theta = 0.99;
+	config.hashmap = 0;
+	list = default_list;
+
+	while ((opt = getopt(argc, argv, "bHt:d:r:s:k:z:")) != -1) {
+		switch (opt) {
+		case 'b': break;
+		case 'H': config.hashmap = 1; break;
+		case 't': list = optarg; break;
+		case 'd':
+			if (!strcmp(optarg, "seq")) config.dist = DIST_SEQ;
+			else if (!strcmp(optarg, "uniform")) config.dist = DIST_UNIFORM;
+			else if (!strcmp(optarg, "zipf")) config.dist = DIST_ZIPF;
+			else bench_usage(argv[0]);
+			break;
+		case 'r':
+			config.reads = parse_long(optarg, 0, argv[0]);
+			if (config.reads > 100)
+				bench_usage(argv[0]);
+			break;
+		case 's': config.seconds = parse_long(optarg, 1, argv[0]); break;
+		case 'k': config.nkeys = parse_long(optarg, 2, argv[0]); break;
+		case 'z':
+			config.theta = strtod(optarg, NULL);
+			if (config.theta <= 0 || config.theta >= 1)
+				bench_usage(argv[0]);
+			break;
+		default: bench_usage(argv[0]);
+		}
+	}
+
+	for (tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		if (config.nruns == MAX_RUNS)
+			bench_usage(argv[0]);
+		config.threads[config.nruns++] = parse_long(tok, 1, argv[0]);
+	}
+
+	if (config.nruns == 0)
+		bench_usage(argv[0]);
+
+	/* keys are zero padded so that their order matches their index, which
+	 * tsbintree_build needs */
+	bench_keys = malloc(config.nkeys * sizeof(char *));
+	if (bench_keys == NULL)
+		pexit("malloc");
+
+	for (k = 0; k < config.nkeys; ++k) {
+		bench_keys[k] = malloc(BENCH_KEY_LEN);
+		if (bench_keys[k] == NULL)
+			pexit("malloc");
+		snprintf(bench_keys[k], BENCH_KEY_LEN, "%012ld", k);
+	}
+
+	if (config.dist == DIST_ZIPF)
+		zipf_init(&zipf, config.nkeys, config.theta);
+
+	printf(">>> %s benchmark: %ld keys, %s keys, %d%% lookups, %ds per run\n",
+			config.hashmap ? "tshashmap" : "tsbintree", config.nkeys, dist_names[config.dist], config.reads, config.seconds);
+	printf("%8s %14s %10s %10s\n", "threads", "ops/s", "p50 (ns)", "p99 (ns)");
+
+	for (i = 0; i < config.nruns; ++i)
+		bench_run(&config, &zipf, config.threads[i]);
+
+	for (k = 0; k < config.nkeys; ++k)
+		free(bench_keys[k]);
+	free(bench_keys);
+
+	return EXIT_SUCCESS;
+}
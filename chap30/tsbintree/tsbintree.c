@@ -1,5 +1,14 @@
+#define _GNU_SOURCE
+
 #include "tsbintree.h"
 
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifdef TSBT_STATS
+# include <time.h>
+#endif
+
 #define PthreadCheck(status) do { \
 	if (status != 0) { \
 		errno = status; \
@@ -7,279 +16,1561 @@
 	} \
 } while (0);
 
-#define UnlockNode(bt, ivar) do { \
-	ivar = pthread_mutex_unlock(&bt->lock); \
+/* with TSBT_STATS, locks are tried first, and waiting for them is timed */
+#ifdef TSBT_STATS
+# define RdLock(lock) stats_lock((lock), pthread_rwlock_tryrdlock, pthread_rwlock_rdlock)
+# define WrLock(lock) stats_lock((lock), pthread_rwlock_trywrlock, pthread_rwlock_wrlock)
+#else
+# define RdLock(lock) pthread_rwlock_rdlock(lock)
+# define WrLock(lock) pthread_rwlock_wrlock(lock)
+#endif
+
+#define ReadLockNode(bt, ivar) do { \
+	ivar = RdLock(&bt->lock); \
 	PthreadCheck(ivar); \
 } while (0);
 
-#define Free(node) do { \
-	node->key = node->value = NULL; \
+#define WriteLockNode(bt, ivar) do { \
+	ivar = WrLock(&bt->lock); \
+	PthreadCheck(ivar); \
 } while (0);
 
+#define UnlockNode(bt, ivar) do { \
+	ivar = pthread_rwlock_unlock(&bt->lock); \
+	PthreadCheck(ivar); \
+} while (0);
+
+#define ValidKey(key) ((key) != NULL && strlen(key) <= TSBT_MAX_KEY_SIZE)
+
+/* child pointers (and the root pointer) are read without locks by lookups, so
+ * they are always written with release semantics: a node becomes visible only
+ * after it is fully initialized */
+#define SetLink(link, node) __atomic_store_n((link), (node), __ATOMIC_RELEASE)
+#define GetLink(link) __atomic_load_n((link), __ATOMIC_ACQUIRE)
+
+/* number of lock-free attempts a lookup makes before it falls back to lock
+ * coupling, e.g. while a long batch insert keeps part of the tree busy */
+#define TSBT_OPTIMISTIC_RETRIES (4)
+
+/* node priorities are a hash of the key rather than a random number. Equal keys
+ * therefore always have equal priorities, which means a duplicate key can never
+ * sit below a node the new key would displace: the descent in `tsbintree_add`
+ * meets it before deciding where to split. Only the first TSBT_MAX_KEY_SIZE bytes
+ * take part, matching what `strncmp` compares. */
+static unsigned int
+key_priority(const char *key) {
+	uint32_t h = 2166136261u;
+	int i;
+
+	for (i = 0; i < TSBT_MAX_KEY_SIZE && key[i] != '\0'; ++i) {
+		h ^= (unsigned char) key[i];
+		h *= 16777619u;
+	}
+
+	/* FNV alone leaves sequential keys (timestamps, counters) with correlated
+	 * high bits; finish with an avalanche step */
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+
+	return h;
+}
+
+/* a key being looked for, with its length and prefix computed up front so that
+ * comparisons against a node can usually be settled by the node's cached prefix */
+struct search_key {
+	const char *key;
+	unsigned int len;
+	uint64_t prefix;
+};
+
+/* the first TSBT_KEY_PREFIX_SIZE bytes of a key, big-endian and zero padded, so
+ * that comparing prefixes as integers orders keys like `strncmp` does */
+static uint64_t
+key_prefix(const char *key, size_t len) {
+	uint64_t prefix = 0;
+	size_t i;
+
+	for (i = 0; i < TSBT_KEY_PREFIX_SIZE; ++i) {
+		prefix <<= 8;
+		if (i < len)
+			prefix |= (unsigned char) key[i];
+	}
+
+	return prefix;
+}
+
+static int
+search_key(struct search_key *k, const char *key) {
+	size_t len;
+
+	if (key == NULL || (len = strlen(key)) > TSBT_MAX_KEY_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	k->key = key;
+	k->len = len;
+	k->prefix = key_prefix(key, len);
+
+	return 0;
+}
+
+static void
+node_search_key(struct search_key *k, const struct tsbintree_node *node) {
+	k->key = node->key;
+	k->len = node->keylen;
+	k->prefix = node->prefix;
+}
+
+/* compares the key of node `p` with `k`, with the same result as `strncmp`. Keys
+ * hold no NUL bytes, so equal prefixes with either key fitting in them mean one
+ * key is a prefix of the other and the lengths decide; only longer keys need the
+ * node's key memory to be touched */
+static int
+key_compare(const struct tsbintree_node *p, const struct search_key *k) {
+	if (p->prefix != k->prefix)
+		return (p->prefix > k->prefix) ? 1 : -1;
+
+	if (p->keylen <= TSBT_KEY_PREFIX_SIZE || k->len <= TSBT_KEY_PREFIX_SIZE)
+		return (int) p->keylen - (int) k->len;
+
+	return strncmp(p->key + TSBT_KEY_PREFIX_SIZE, k->key + TSBT_KEY_PREFIX_SIZE,
+			TSBT_MAX_KEY_SIZE - TSBT_KEY_PREFIX_SIZE);
+}
+
+/* node locks are reader-writer locks. With the default (reader-preferring) kind
+ * a steady stream of lookups would starve writers waiting on the upper levels of
+ * the tree, so ask for writer preference where the implementation offers it */
+static int
+lock_init(pthread_rwlock_t *lock) {
+	pthread_rwlockattr_t attr;
+	int s;
+
+	s = pthread_rwlockattr_init(&attr);
+	if (s != 0)
+		return s;
+
+	/* the kind itself is an enumeration constant; glibc only defines the matching
+	 * initializer as a macro */
+#ifdef PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+
+	s = pthread_rwlock_init(lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+
+	return s;
+}
+
+/* a writer brackets every change to the child pointers of a node (or to the
+ * root pointer) with these, while holding the corresponding write lock */
+static void
+write_begin(unsigned int *version) {
+	__atomic_store_n(version, *version + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+write_end(unsigned int *version) {
+	__atomic_store_n(version, *version + 1, __ATOMIC_RELEASE);
+}
+
+/* returns the version of a node ahead of reading it, or an odd value if it is
+ * being changed */
+static unsigned int
+read_begin(unsigned int *version) {
+	return __atomic_load_n(version, __ATOMIC_ACQUIRE);
+}
+
+/* tells whether the node is still at `expected`, i.e. whatever was read from it
+ * since `read_begin` is consistent */
+static int
+read_validate(unsigned int *version, unsigned int expected) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(version, __ATOMIC_RELAXED) == expected;
+}
+
+struct tsbintree_slab {
+	struct tsbintree_slab *next;
+	struct tsbintree_node nodes[TSBT_SLAB_NODES];
+};
+
+/* free list used by the calling thread. Lists are handed out round-robin the
+ * first time a thread touches any tree */
+static int
+pool_index(void) {
+	static unsigned int next_index = 0;
+	static __thread int index = -1;
+
+	if (index == -1)
+		index = __atomic_fetch_add(&next_index, 1, __ATOMIC_RELAXED) % TSBT_POOL_LISTS;
+
+	return index;
+}
+
+#ifdef TSBT_STATS
+/* the counters of the operation the calling thread is running, if any. They are
+ * added to the tree's when it is done */
+static __thread struct {
+	int active;
+	unsigned long path;
+	unsigned long locks;
+	unsigned long lock_waits;
+	unsigned long long wait_ns;
+	unsigned long long wait_max_ns;
+} stats_now;
+
+static int
+stats_lock(pthread_rwlock_t *lock, int (*try)(pthread_rwlock_t *),
+		int (*wait)(pthread_rwlock_t *)) {
+	struct timespec start, end;
+	unsigned long long ns;
+	int s;
+
+	if (!stats_now.active)
+		return wait(lock);
+
+	++stats_now.locks;
+	if ((s = try(lock)) != EBUSY)
+		return s;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	s = wait(lock);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	ns = (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+	++stats_now.lock_waits;
+	stats_now.wait_ns += ns;
+	if (ns > stats_now.wait_max_ns)
+		stats_now.wait_max_ns = ns;
+
+	return s;
+}
+
+/* raises the counter at `max` to `value`, if it is larger */
+#define StatsMax(max, value) do { \
+	__typeof__(*(max)) cur_ = __atomic_load_n((max), __ATOMIC_RELAXED); \
+	while ((value) > cur_ && !__atomic_compare_exchange_n((max), &cur_, (value), 1, \
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED)) \
+		; \
+} while (0)
+
+static void
+stats_begin(void) {
+	memset(&stats_now, 0, sizeof(stats_now));
+	stats_now.active = 1;
+}
+
+/* adds the counters of the operation just finished to those of the pool list of
+ * the thread, which normally no other thread updates */
+static void
+stats_end(tsbintree *bt, enum tsbintree_stats_op op) {
+	struct tsbintree_op_stats *o = &bt->stats[pool_index()].ops[op];
+
+	__atomic_fetch_add(&o->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&o->path_total, stats_now.path, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&o->locks, stats_now.locks, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&o->lock_waits, stats_now.lock_waits, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&o->wait_ns, stats_now.wait_ns, __ATOMIC_RELAXED);
+	StatsMax(&o->path_max, stats_now.path);
+	StatsMax(&o->wait_max_ns, stats_now.wait_max_ns);
+
+	stats_now.active = 0;
+}
+
+static void
+stats_count(tsbintree *bt, int fallback) {
+	struct tsbintree_counters *c = &bt->stats[pool_index()];
+
+	__atomic_fetch_add(fallback ? &c->lookup_fallbacks : &c->lookup_retries, 1, __ATOMIC_RELAXED);
+}
+
+# define StatsBegin() stats_begin()
+# define StatsEnd(bt, op) stats_end((bt), (op))
+# define StatsVisit() (++stats_now.path)
+# define StatsCount(bt, fallback) stats_count((bt), (fallback))
+#else
+# define StatsBegin() do { } while (0)
+# define StatsEnd(bt, op) do { } while (0)
+# define StatsVisit() do { } while (0)
+# define StatsCount(bt, fallback) do { } while (0)
+#endif
+
+static void
+node_free_key(struct tsbintree_node *node) {
+#ifdef TSBT_INLINE_KEYS
+	if (node->key != node->inline_key)
+		free(node->key);
+#else
+	(void) node;
+#endif
+}
+
+static void
+node_reclaim(struct tsbintree_node *node) {
+	pthread_rwlock_destroy(&node->lock);
+	node_free_key(node);
+}
+
+/* Epoch based reclamation.
+ *
+ * A lock-free lookup runs inside an epoch: it announces itself in the `readers`
+ * counter matching the parity of the tree's epoch on entry and leaves when done.
+ * A deleted node is put in limbo tagged with the epoch current after it was
+ * unlinked, so only lookups that entered in that epoch or earlier can still hold
+ * a reference to it. The epoch only moves from `e` to `e + 1` once no lookup
+ * from `e - 1` is left (their parity counter is zero); thus when the epoch
+ * reaches `r + 2`, every lookup from `r` or before is gone and nodes retired in
+ * `r` can be reused. Three limbo lists per pool list are enough to track that.
+ *
+ * Writers do not take part: lock coupling already keeps them from reaching an
+ * unlinked node. */
+
+static unsigned long
+epoch_enter(tsbintree *bt) {
+	struct tsbintree_freelist *list = &bt->pool[pool_index()];
+	unsigned long e;
+
+	for (;;) {
+		e = __atomic_load_n(&bt->epoch, __ATOMIC_SEQ_CST);
+		__atomic_fetch_add(&list->readers[e & 1], 1, __ATOMIC_SEQ_CST);
+
+		/* the epoch may have moved past `e` before we were counted, in which
+		 * case a writer might not have waited for us */
+		if (__atomic_load_n(&bt->epoch, __ATOMIC_SEQ_CST) == e)
+			return e;
+
+		__atomic_fetch_sub(&list->readers[e & 1], 1, __ATOMIC_RELEASE);
+	}
+}
+
+static void
+epoch_exit(tsbintree *bt, unsigned long e) {
+	__atomic_fetch_sub(&bt->pool[pool_index()].readers[e & 1], 1, __ATOMIC_RELEASE);
+}
+
+static void
+epoch_advance(tsbintree *bt) {
+	unsigned long e, readers;
+	int i;
+
+	e = __atomic_load_n(&bt->epoch, __ATOMIC_SEQ_CST);
+
+	readers = 0;
+	for (i = 0; i < TSBT_POOL_LISTS; ++i)
+		readers += __atomic_load_n(&bt->pool[i].readers[(e + 1) & 1], __ATOMIC_SEQ_CST);
+
+	if (readers == 0)
+		__atomic_compare_exchange_n(&bt->epoch, &e, e + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+/* moves the nodes of a limbo list to the free list. `list` is locked */
+static void
+limbo_flush(struct tsbintree_freelist *list, int slot) {
+	struct tsbintree_node *node, *next;
+
+	for (node = list->limbo[slot]; node != NULL; node = next) {
+		next = node->retired;
+		node_reclaim(node);
+
+		node->left = list->free;
+		list->free = node;
+	}
+
+	list->limbo[slot] = NULL;
+}
+
+/* frees whatever has been in limbo long enough. `list` is locked */
+static void
+limbo_collect(tsbintree *bt, struct tsbintree_freelist *list) {
+	unsigned long e = __atomic_load_n(&bt->epoch, __ATOMIC_SEQ_CST);
+	int slot;
+
+	for (slot = 0; slot < 3; ++slot) {
+		if (list->limbo[slot] != NULL && list->limbo_epoch[slot] + 2 <= e)
+			limbo_flush(list, slot);
+	}
+}
+
+/* hands a node that has just been unlinked from the tree over to reclamation */
+static void
+node_retire(tsbintree *bt, struct tsbintree_node *node) {
+	struct tsbintree_freelist *list;
+	unsigned long e;
+	int slot;
+
+	/* the unlinking must be visible before the epoch is read */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	e = __atomic_load_n(&bt->epoch, __ATOMIC_SEQ_CST);
+	slot = e % 3;
+
+	list = &bt->pool[pool_index()];
+	pthread_mutex_lock(&list->lock);
+
+	/* a slot still holding an older epoch holds one at least three behind */
+	if (list->limbo[slot] != NULL && list->limbo_epoch[slot] != e)
+		limbo_flush(list, slot);
+
+	node->retired = list->limbo[slot];
+	list->limbo[slot] = node;
+	list->limbo_epoch[slot] = e;
+
+	pthread_mutex_unlock(&list->lock);
+
+	epoch_advance(bt);
+}
+
+static struct tsbintree_node *
+node_alloc(tsbintree *bt) {
+	struct tsbintree_freelist *list;
+	struct tsbintree_node *node;
+	struct tsbintree_slab *slab;
+	int s;
+
+	list = &bt->pool[pool_index()];
+	s = pthread_mutex_lock(&list->lock);
+	if (s != 0) {
+		errno = s;
+		return NULL;
+	}
+
+	if (list->free == NULL)
+		limbo_collect(bt, list);
+
+	if (list->free != NULL) {
+		/* recycled nodes are chained through their left pointer */
+		node = list->free;
+		list->free = node->left;
+	} else {
+		if (list->next == list->end) {
+			slab = malloc(sizeof(struct tsbintree_slab));
+			if (slab == NULL) {
+				pthread_mutex_unlock(&list->lock);
+				errno = ENOMEM;
+				return NULL;
+			}
+
+			slab->next = list->slabs;
+			list->slabs = slab;
+			list->next = slab->nodes;
+			list->end = slab->nodes + TSBT_SLAB_NODES;
+		}
+
+		node = list->next++;
+	}
+
+	pthread_mutex_unlock(&list->lock);
+	return node;
+}
+
+/* returns a node to the calling thread's free list */
+static void
+node_release(tsbintree *bt, struct tsbintree_node *node) {
+	struct tsbintree_freelist *list;
+
+	list = &bt->pool[pool_index()];
+	pthread_mutex_lock(&list->lock);
+	node->left = list->free;
+	list->free = node;
+	pthread_mutex_unlock(&list->lock);
+}
+
+static struct tsbintree_node *
+node_create(tsbintree *bt, char *key, void *value) {
+	struct tsbintree_node *node;
+	size_t len;
+	int s;
+
+	if ((node = node_alloc(bt)) == NULL)
+		return NULL;
+
+	len = strlen(key);
+
+#ifdef TSBT_INLINE_KEYS
+	/* the tree keeps its own copy of every key: in the node itself when it is
+	 * short enough, which is the common case, or on the heap otherwise */
+	if (len < TSBT_INLINE_KEY_SIZE) {
+		node->key = node->inline_key;
+	} else if ((node->key = malloc(len + 1)) == NULL) {
+		node_release(bt, node);
+		errno = ENOMEM;
+		return NULL;
+	}
+	memcpy(node->key, key, len + 1);
+#else
+	node->key = key;
+#endif
+
+	s = lock_init(&node->lock);
+	if (s != 0) {
+		node_free_key(node);
+		node_release(bt, node);
+		errno = s;
+		return NULL;
+	}
+
+	node->keylen = len;
+	node->prefix = key_prefix(key, len);
+	node->value = value;
+	node->priority = key_priority(key);
+	node->left = node->right = NULL;
+	node->version = 0;
+	node->retired = NULL;
+
+	return node;
+}
+
+/* releases a node that was never reachable by other threads */
+static void
+node_free(tsbintree *bt, struct tsbintree_node *node) {
+	node_reclaim(node);
+	node_release(bt, node);
+}
 
 int
 tsbintree_init(tsbintree *bt) {
-	int s = pthread_mutex_init(&bt->lock, NULL);
+	int i, s;
+
+	s = lock_init(&bt->lock);
 	PthreadCheck(s);
 
-	s = pthread_mutex_lock(&bt->lock);
+	bt->root = NULL;
+	bt->version = 0;
+	bt->epoch = 0;
+	for (i = 0; i < TSBT_POOL_LISTS; ++i) {
+		s = pthread_mutex_init(&bt->pool[i].lock, NULL);
+		PthreadCheck(s);
+
+		bt->pool[i].free = bt->pool[i].next = bt->pool[i].end = NULL;
+		bt->pool[i].slabs = NULL;
+		bt->pool[i].readers[0] = bt->pool[i].readers[1] = 0;
+		bt->pool[i].limbo[0] = bt->pool[i].limbo[1] = bt->pool[i].limbo[2] = NULL;
+		bt->pool[i].limbo_epoch[0] = bt->pool[i].limbo_epoch[1] = bt->pool[i].limbo_epoch[2] = 0;
+	}
+
+#ifdef TSBT_STATS
+	memset(bt->stats, 0, sizeof(bt->stats));
+#endif
+
+	return 0;
+}
+
+/* Every operation walks down from the tree header using lock coupling: the lock
+ * of a node is taken before the lock of its parent is released, so a thread only
+ * ever holds locks on a short window of its path and always acquires them top-down.
+ *
+ * Lookups first try without any lock (see `lookup_optimistic`) and otherwise take
+ * every lock shared. Writers descend with shared locks too and only take a lock
+ * exclusively on the node whose child pointer they are about to change (see
+ * `struct path` below), so they do not shut readers out of the top of the tree.
+ *
+ * Restructuring (the split in `tsbintree_add` and the merge in `tsbintree_delete`)
+ * relies on the same property. The restructured subtree is entered through a single
+ * node that stays write-locked for the whole operation, so threads behind us queue on
+ * it, while threads already inside the subtree are necessarily further down the path;
+ * write-locking each node before relinking it is enough to make sure they have moved
+ * past. Lock-free readers are not held back by any of this; for them, every node
+ * whose child pointers are rewritten has an odd version from the moment it is
+ * locked until its last pointer is in place, even if that happens after unlocking
+ * it (the split and merge fill in a node's pointer once they know what goes there). */
+
+/* the locks held by a writer on its way down. `owner` protects `link`, the child
+ * pointer being looked at, and is held exclusively once `exclusive` is set. Until
+ * then `above`, the lock of the owner's parent, is held shared as well: that keeps
+ * the owner linked (unlinking it needs `above` exclusively) while its lock is
+ * released and retaken in write mode. */
+struct path {
+	pthread_rwlock_t *above;
+	pthread_rwlock_t *owner;
+	unsigned int *owner_version;
+	struct tsbintree_node **link;
+	int exclusive;
+};
+
+static int
+path_start(struct path *path, tsbintree *bt) {
+	int s;
+
+	ReadLockNode(bt, s);
+
+	path->above = NULL;
+	path->owner = &bt->lock;
+	path->owner_version = &bt->version;
+	path->link = &bt->root;
+	path->exclusive = 0;
+
+	return 0;
+}
+
+/* moves down to `p`, the node at `link`, following the result of comparing its
+ * key to the one being looked for */
+static int
+path_descend(struct path *path, struct tsbintree_node *p, int cmp) {
+	int s;
+
+	if (path->exclusive) {
+		WriteLockNode(p, s);
+	} else {
+		ReadLockNode(p, s);
+
+		if (path->above != NULL) {
+			s = pthread_rwlock_unlock(path->above);
+			PthreadCheck(s);
+		}
+		path->above = path->owner;
+	}
+
+	if (path->above != path->owner) {
+		s = pthread_rwlock_unlock(path->owner);
+		PthreadCheck(s);
+	}
+
+	path->owner = &p->lock;
+	path->owner_version = &p->version;
+	path->link = (cmp > 0) ? &p->left : &p->right;
+
+	return 0;
+}
+
+/* turns the shared lock on `owner` into an exclusive one. Other writers may get
+ * there first, so callers must look at `link` again afterwards */
+static int
+path_upgrade(struct path *path) {
+	int s;
+
+	s = pthread_rwlock_unlock(path->owner);
+	PthreadCheck(s);
+	s = WrLock(path->owner);
 	PthreadCheck(s);
 
-	bt->key = NULL;
-	bt->value = NULL;
-	bt->left = bt->right = NULL;
+	if (path->above != NULL) {
+		s = pthread_rwlock_unlock(path->above);
+		PthreadCheck(s);
+	}
 
-	UnlockNode(bt, s);
-	return s;
+	path->above = NULL;
+	path->exclusive = 1;
+
+	return 0;
+}
+
+static void
+path_release(struct path *path) {
+	pthread_rwlock_unlock(path->owner);
+	if (path->above != NULL)
+		pthread_rwlock_unlock(path->above);
+}
+
+/* splits the subtree rooted at `p` around the key of `node`, which has just
+ * been linked in its place and is write-locked by the caller, to become the
+ * node's left and right subtrees. The node's own version is left to the caller */
+static int
+split(struct tsbintree_node *node, struct tsbintree_node *p) {
+	struct tsbintree_node *next;
+	struct tsbintree_node **lhook, **rhook;
+	unsigned int *lversion, *rversion;
+	struct search_key k;
+	int s, cmp;
+
+	node_search_key(&k, node);
+	lhook = &node->left;
+	rhook = &node->right;
+	lversion = rversion = &node->version;
+	while (p != NULL) {
+		WriteLockNode(p, s);
+		write_begin(&p->version);
+
+		/* every key below has a lower priority than the new one, so it cannot
+		 * be a duplicate */
+		cmp = key_compare(p, &k);
+		assert(cmp != 0);
+
+		if (cmp < 0) {
+			next = p->right;
+			SetLink(lhook, p);
+			if (lversion != &node->version)
+				write_end(lversion);
+
+			lhook = &p->right;
+			lversion = &p->version;
+		} else {
+			next = p->left;
+			SetLink(rhook, p);
+			if (rversion != &node->version)
+				write_end(rversion);
+
+			rhook = &p->left;
+			rversion = &p->version;
+		}
+
+		UnlockNode(p, s);
+		p = next;
+	}
+
+	SetLink(lhook, NULL);
+	SetLink(rhook, NULL);
+	if (lversion != &node->version)
+		write_end(lversion);
+	if (rversion != &node->version)
+		write_end(rversion);
+
+	return 0;
+}
+
+static int
+add_key(tsbintree *bt, char *key, void *value) {
+	struct tsbintree_node *node, *p;
+	struct path path;
+	struct search_key k;
+	int s, cmp;
+
+	if (search_key(&k, key) == -1)
+		return -1;
+
+	if ((node = node_create(bt, key, value)) == NULL)
+		return -1;
+
+	if (path_start(&path, bt) == -1) {
+		node_free(bt, node);
+		return -1;
+	}
+
+	/* descend while the current node's priority dominates the new one */
+	for (;;) {
+		p = *path.link;
+		if (p == NULL || p->priority < node->priority) {
+			if (path.exclusive)
+				break;
+
+			if (path_upgrade(&path) == -1)
+				return -1;
+			continue;
+		}
+
+		StatsVisit();
+		cmp = key_compare(p, &k);
+		if (cmp == 0) {
+			path_release(&path);
+			node_free(bt, node);
+			errno = EINVAL;
+			return -1;
+		}
+
+		if (path_descend(&path, p, cmp) == -1)
+			return -1;
+	}
+
+	/* the new node takes the place of `p`; publish it locked so that it acts
+	 * as the gate to the subtree while that is split around the key */
+	WriteLockNode(node, s);
+	write_begin(&node->version);
+
+	write_begin(path.owner_version);
+	SetLink(path.link, node);
+	write_end(path.owner_version);
+	path_release(&path);
+
+	if (split(node, p) == -1)
+		return -1;
+
+	write_end(&node->version);
+	UnlockNode(node, s);
+	return 0;
 }
 
 int
 tsbintree_add(tsbintree *bt, char *key, void *value) {
-	if (key == NULL) {
-		errno = EINVAL;
+	int r;
+
+	StatsBegin();
+	r = add_key(bt, key, value);
+	StatsEnd(bt, TSBT_STATS_ADD);
+
+	return r;
+}
+
+enum lookup_result { LOOKUP_FOUND, LOOKUP_MISSING, LOOKUP_RETRY };
+
+/* descends without taking any lock, which is safe inside an epoch since no node
+ * reachable on the way can be reused meanwhile. Each pointer followed is valid
+ * only if the node it was read from did not change while reading it: the child's
+ * version is read before the parent is validated, so a child that was unlinked
+ * or restructured after that shows up as a version change at the next step */
+static enum lookup_result
+lookup_optimistic(tsbintree *bt, const struct search_key *k, void **value) {
+	struct tsbintree_node *p;
+	unsigned int *parent, expected, version;
+	int cmp;
+
+	parent = &bt->version;
+	expected = read_begin(parent);
+	if (expected & 1)
+		return LOOKUP_RETRY;
+
+	p = GetLink(&bt->root);
+	while (p != NULL) {
+		version = read_begin(&p->version);
+		if ((version & 1) || !read_validate(parent, expected))
+			return LOOKUP_RETRY;
+
+		/* keys, values and priorities never change once a node is linked */
+		StatsVisit();
+		cmp = key_compare(p, k);
+		if (cmp == 0) {
+			*value = p->value;
+			return LOOKUP_FOUND;
+		}
+
+		parent = &p->version;
+		expected = version;
+		p = GetLink((cmp > 0) ? &p->left : &p->right);
+	}
+
+	if (!read_validate(parent, expected))
+		return LOOKUP_RETRY;
+
+	return LOOKUP_MISSING;
+}
+
+static int
+lookup_key(tsbintree *bt, char *key, void **value) {
+	struct tsbintree_node *p;
+	pthread_rwlock_t *owner;
+	enum lookup_result r;
+	struct search_key k;
+	unsigned long e;
+	int i, s, cmp;
+
+	if (search_key(&k, key) == -1)
+		return -1;
+
+	e = epoch_enter(bt);
+	r = LOOKUP_RETRY;
+	for (i = 0; i < TSBT_OPTIMISTIC_RETRIES && r == LOOKUP_RETRY; ++i) {
+		if (i > 0)
+			StatsCount(bt, 0);
+		r = lookup_optimistic(bt, &k, value);
+	}
+	epoch_exit(bt, e);
+
+	if (r == LOOKUP_FOUND)
+		return 0;
+
+	if (r == LOOKUP_MISSING) {
+		errno = ENOKEY;
 		return -1;
 	}
 
-	int r = -1;
-	int s = pthread_mutex_lock(&bt->lock);
+	/* the nodes on the way stayed busy; queue on their locks instead */
+	StatsCount(bt, 1);
+	ReadLockNode(bt, s);
+
+	/* keys, values and priorities never change once a node is linked, so only
+	 * the lock of the parent is needed to read them */
+	owner = &bt->lock;
+	p = bt->root;
+	while (p != NULL) {
+		StatsVisit();
+		cmp = key_compare(p, &k);
+		if (cmp == 0) {
+			*value = p->value;
+			s = pthread_rwlock_unlock(owner);
+			PthreadCheck(s);
+			return 0;
+		}
+
+		ReadLockNode(p, s);
+		s = pthread_rwlock_unlock(owner);
+		PthreadCheck(s);
+
+		owner = &p->lock;
+		p = (cmp > 0) ? p->left : p->right;
+	}
+
+	s = pthread_rwlock_unlock(owner);
 	PthreadCheck(s);
 
-	/* base case for the recursion */
-	if (bt->key == NULL) {
-		bt->key = key;
-		bt->value = value;
+	errno = ENOKEY;
+	return -1;
+}
 
-		UnlockNode(bt, s);
-		return s;
+int
+tsbintree_lookup(tsbintree *bt, char *key, void **value) {
+	int r;
+
+	StatsBegin();
+	r = lookup_key(bt, key, value);
+	StatsEnd(bt, TSBT_STATS_LOOKUP);
+
+	return r;
+}
+
+static int
+delete_key(tsbintree *bt, char *key) {
+	struct tsbintree_node *p, *l, *r, *w, *gate;
+	struct tsbintree_node **link;
+	unsigned int *version;
+	struct path path;
+	struct search_key k;
+	int s, cmp;
+
+	if (search_key(&k, key) == -1)
+		return -1;
+
+	if (path_start(&path, bt) == -1)
+		return -1;
+
+	for (;;) {
+		if ((p = *path.link) == NULL) {
+			path_release(&path);
+			errno = ENOKEY;
+			return -1;
+		}
+
+		StatsVisit();
+		cmp = key_compare(p, &k);
+		if (cmp == 0) {
+			if (path.exclusive)
+				break;
+
+			if (path_upgrade(&path) == -1)
+				return -1;
+			continue;
+		}
+
+		if (path_descend(&path, p, cmp) == -1)
+			return -1;
 	}
 
-	/* if key is smaller than the current key, insert it at the left side;
-	 * otherwise insert it at the rigth */
-	int cmp = strncmp(bt->key, key, TSBT_MAX_KEY_SIZE);
-	if (cmp > 0) {
-		if (bt->left == NULL) {
-			bt->left = malloc(sizeof(tsbintree));
-			tsbintree_init(bt->left);
+	/* wait for threads ahead of us to leave the node, then merge its subtrees
+	 * in its place. The first node linked becomes the gate. The deleted node's
+	 * version is left odd: lock-free readers that get to it start over */
+	WriteLockNode(p, s);
+	write_begin(&p->version);
+
+	link = path.link;
+	version = path.owner_version;
+	write_begin(version);
+
+	l = p->left;
+	r = p->right;
+	gate = NULL;
+
+	while (l != NULL && r != NULL) {
+		if (l->priority >= r->priority) {
+			w = l;
+			WriteLockNode(w, s);
+			write_begin(&w->version);
+			l = w->right;
+
+			SetLink(link, w);
+			write_end(version);
+			link = &w->right;
+		} else {
+			w = r;
+			WriteLockNode(w, s);
+			write_begin(&w->version);
+			r = w->left;
+
+			SetLink(link, w);
+			write_end(version);
+			link = &w->left;
 		}
+		version = &w->version;
 
-		UnlockNode(bt, s);
-		r = tsbintree_add(bt->left, key, value);
-	} else if (cmp < 0) {
-		if (bt->right == NULL) {
-			bt->right = malloc(sizeof(tsbintree));
-			tsbintree_init(bt->right);
+		if (gate == NULL) {
+			gate = w;
+			path_release(&path);
+		} else {
+			UnlockNode(w, s);
 		}
+	}
+	SetLink(link, (l != NULL) ? l : r);
+	write_end(version);
 
-		UnlockNode(bt, s);
-		r =  tsbintree_add(bt->right, key, value);
+	if (gate == NULL) {
+		path_release(&path);
 	} else {
-		UnlockNode(bt, s);
-		errno = EINVAL;
+		UnlockNode(gate, s);
 	}
 
+	UnlockNode(p, s);
+	node_retire(bt, p);
+
+	return 0;
+}
+
+int
+tsbintree_delete(tsbintree *bt, char *key) {
+	int r;
+
+	StatsBegin();
+	r = delete_key(bt, key);
+	StatsEnd(bt, TSBT_STATS_DELETE);
+
 	return r;
 }
 
+static void
+free_rec(tsbintree *bt, struct tsbintree_node *node) {
+	if (node == NULL)
+		return;
+
+	free_rec(bt, node->left);
+	free_rec(bt, node->right);
+	node_free(bt, node);
+}
+
+/* the tree being empty, its shape is fully determined by the keys: with the
+ * keys in order and the heap property on priorities, it is their Cartesian tree,
+ * which can be built left to right keeping only the right spine on a stack */
 int
-tsbintree_lookup(tsbintree *bt, char *key, void **value) {
-	if (strlen(key) > TSBT_MAX_KEY_SIZE) {
+tsbintree_build(tsbintree *bt, char **keys, void **values, size_t n) {
+	struct tsbintree_node **spine, *node, *last;
+	size_t i, top;
+	int s;
+
+	if (keys == NULL) {
 		errno = EINVAL;
 		return -1;
 	}
 
+	for (i = 0; i < n; ++i) {
+		if (!ValidKey(keys[i]) ||
+		    (i > 0 && strncmp(keys[i - 1], keys[i], TSBT_MAX_KEY_SIZE) >= 0)) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
 
-	int r, s, cmp;
-	s = pthread_mutex_lock(&bt->lock);
-	PthreadCheck(s);
+	spine = malloc((n + 1) * sizeof(struct tsbintree_node *));
+	if (spine == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
 
-	/* recursion base case */
-	if (bt == NULL || bt->key == NULL) {
+	WriteLockNode(bt, s);
+	if (bt->root != NULL) {
 		UnlockNode(bt, s);
-		return 0;
+		free(spine);
+		errno = EEXIST;
+		return -1;
 	}
 
-	cmp = strncmp(bt->key, key, TSBT_MAX_KEY_SIZE);
+	/* nodes are not reachable by anyone else until the root is published, so
+	 * none of them is locked */
+	top = 0;
+	for (i = 0; i < n; ++i) {
+		node = node_create(bt, keys[i], values ? values[i] : NULL);
+		if (node == NULL) {
+			if (top > 0)
+				free_rec(bt, spine[0]);
+
+			UnlockNode(bt, s);
+			free(spine);
+			errno = ENOMEM;
+			return -1;
+		}
+
+		last = NULL;
+		while (top > 0 && spine[top - 1]->priority < node->priority)
+			last = spine[--top];
+
+		node->left = last;
+		if (top > 0)
+			spine[top - 1]->right = node;
+		spine[top++] = node;
+	}
+
+	write_begin(&bt->version);
+	SetLink(&bt->root, (top > 0) ? spine[0] : NULL);
+	write_end(&bt->version);
 	UnlockNode(bt, s);
 
-	if (cmp > 0) {
-		r = tsbintree_lookup(bt->left, key, value);
-	} else if (cmp > 0) {
-		r = tsbintree_lookup(bt->right, key, value);
+	free(spine);
+	return 0;
+}
+
+struct batch_entry {
+	struct search_key key;
+	void *value;
+	unsigned int priority;
+};
+
+static int
+batch_compare(const void *a, const void *b) {
+	const struct batch_entry *x = a, *y = b;
+	return strncmp(x->key.key, y->key.key, TSBT_MAX_KEY_SIZE);
+}
+
+/* inserts the sorted entries `batch[0..n)` into the subtree at `link`, whose
+ * owner is write-locked by the caller (with its version odd). Either an entry outranks the subtree's
+ * root and becomes the new root, or the root stays and the batch is partitioned
+ * around its key; both halves are then handled under the lock of the subtree's
+ * (new) root, which is released only once they are done */
+static int
+insert_batch(tsbintree *bt, struct tsbintree_node **link, struct batch_entry *batch,
+		size_t n, int *added) {
+	struct tsbintree_node *p, *node;
+	size_t i, m, lo, hi;
+	int s, r;
+
+	if (n == 0)
+		return 0;
+
+	m = 0;
+	for (i = 1; i < n; ++i) {
+		if (batch[i].priority > batch[m].priority)
+			m = i;
+	}
+
+	p = *link;
+	if (p == NULL || batch[m].priority > p->priority) {
+		if ((node = node_create(bt, (char *) batch[m].key.key, batch[m].value)) == NULL)
+			return -1;
+
+		WriteLockNode(node, s);
+		write_begin(&node->version);
+		SetLink(link, node);
+		if (split(node, p) == -1)
+			return -1;
+
+		++*added;
+		p = node;
+		lo = m;
+		hi = m + 1;
 	} else {
-		*value = bt->value;
-		r = 0;
+		WriteLockNode(p, s);
+		write_begin(&p->version);
+
+		/* first entry not smaller than the key of `p`; an equal one is already
+		 * in the tree and is skipped */
+		lo = 0;
+		hi = n;
+		while (lo < hi) {
+			m = lo + (hi - lo) / 2;
+			if (key_compare(p, &batch[m].key) > 0)
+				lo = m + 1;
+			else
+				hi = m;
+		}
+
+		hi = lo;
+		if (hi < n && key_compare(p, &batch[hi].key) == 0)
+			++hi;
 	}
 
+	r = insert_batch(bt, &p->left, batch, lo, added);
+	if (r != -1)
+		r = insert_batch(bt, &p->right, &batch[hi], n - hi, added);
+
+	write_end(&p->version);
+	s = pthread_rwlock_unlock(&p->lock);
+	PthreadCheck(s);
+
 	return r;
 }
 
-static int
-find_successor(tsbintree *root, tsbintree **successor, tsbintree **successor_parent) {
-	tsbintree *p, *parent;
-	int s;
+int
+tsbintree_add_batch(tsbintree *bt, char **keys, void **values, size_t n) {
+	struct batch_entry *batch;
+	struct tsbintree_node *p;
+	struct path path;
+	unsigned int maxprio;
+	size_t i, j;
+	int added, r;
+
+	if (keys == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	p = root;
-	parent = NULL;
+	if (n == 0)
+		return 0;
 
-	s = pthread_mutex_lock(&p->lock);
-	PthreadCheck(s);
+	batch = malloc(n * sizeof(struct batch_entry));
+	if (batch == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (i = 0; i < n; ++i) {
+		if (search_key(&batch[i].key, keys[i]) == -1) {
+			free(batch);
+			return -1;
+		}
 
-	while (p->right) {
-		parent = p;
-		p = p->right;
+		batch[i].value = values ? values[i] : NULL;
+		batch[i].priority = key_priority(keys[i]);
+	}
 
-		UnlockNode(parent, s);
-		s = pthread_mutex_lock(&p->lock);
-		PthreadCheck(s);
+	/* sort, dropping repeated keys within the batch itself */
+	qsort(batch, n, sizeof(struct batch_entry), batch_compare);
+	maxprio = batch[0].priority;
+	for (i = j = 1; i < n; ++i) {
+		if (batch_compare(&batch[j - 1], &batch[i]) != 0) {
+			batch[j++] = batch[i];
+			if (batch[i].priority > maxprio)
+				maxprio = batch[i].priority;
+		}
 	}
-	UnlockNode(p, s);
+	n = j;
+
+	if (path_start(&path, bt) == -1) {
+		free(batch);
+		return -1;
+	}
+
+	/* go down with shared locks for as long as the whole batch falls on one
+	 * side of the current node and none of its keys would displace it */
+	for (;;) {
+		p = *path.link;
+		if (p != NULL && p->priority >= maxprio) {
+			if (key_compare(p, &batch[n - 1].key) > 0) {
+				if (path_descend(&path, p, 1) == -1)
+					goto error;
+				continue;
+			}
+
+			if (key_compare(p, &batch[0].key) < 0) {
+				if (path_descend(&path, p, -1) == -1)
+					goto error;
+				continue;
+			}
+		}
+
+		if (path.exclusive)
+			break;
+
+		if (path_upgrade(&path) == -1)
+			goto error;
+	}
+
+	added = 0;
+	write_begin(path.owner_version);
+	r = insert_batch(bt, path.link, batch, n, &added);
+	write_end(path.owner_version);
+	path_release(&path);
+	free(batch);
+
+	return (r == -1) ? -1 : added;
+
+error:
+	free(batch);
+	return -1;
+}
+
+struct range {
+	struct search_key lo;
+	struct search_key hi;
+	int has_lo;
+	int has_hi;
+	int (*callback)(char *key, void *value, void *arg);
+	void *arg;
+	int visited;
+	int stop;
+};
+
+/* visits the keys of the subtree rooted at `p` that fall inside the range, in
+ * order. `p` is read-locked by the caller and is unlocked here. Locks are only
+ * kept on nodes whose right subtree still has to be visited: going right, the
+ * current node is released as soon as its child is locked */
+static int
+range_rec(struct tsbintree_node *p, struct range *range) {
+	struct tsbintree_node *child;
+	int s, lo, hi;
+
+	for (;;) {
+		lo = range->has_lo ? key_compare(p, &range->lo) : 1;
+		hi = range->has_hi ? key_compare(p, &range->hi) : -1;
+
+		if (lo > 0 && (child = p->left) != NULL) {
+			ReadLockNode(child, s);
+			if (range_rec(child, range) == -1)
+				return -1;
+		}
+
+		if (range->stop)
+			break;
+
+		if (lo >= 0 && hi <= 0) {
+			++range->visited;
+			if (range->callback(p->key, p->value, range->arg) != 0) {
+				range->stop = 1;
+				break;
+			}
+		}
+
+		if (hi >= 0 || (child = p->right) == NULL)
+			break;
 
-	*successor = p;
-	*successor_parent = parent;
+		ReadLockNode(child, s);
+		UnlockNode(p, s);
+		p = child;
+	}
 
+	UnlockNode(p, s);
 	return 0;
 }
 
-/* based on http://webdocs.cs.ualberta.ca/~holte/T26/del-from-bst.html */
 int
-tsbintree_delete(tsbintree *bt, char *key) {
-	if (key == NULL) {
+tsbintree_range(tsbintree *bt, char *lo, char *hi,
+		int (*callback)(char *key, void *value, void *arg), void *arg) {
+	struct tsbintree_node *p;
+	struct range range;
+	int s;
+
+	if (callback == NULL) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	int s;
-	s = pthread_mutex_lock(&bt->lock);
-	PthreadCheck(s);
+	range.has_lo = (lo != NULL);
+	range.has_hi = (hi != NULL);
+	if ((range.has_lo && search_key(&range.lo, lo) == -1) ||
+	    (range.has_hi && search_key(&range.hi, hi) == -1))
+		return -1;
 
-	if (bt == NULL || key == NULL) {
-		errno = EINVAL;
+	range.callback = callback;
+	range.arg = arg;
+	range.visited = 0;
+	range.stop = 0;
+
+	ReadLockNode(bt, s);
+	if ((p = bt->root) != NULL) {
+		ReadLockNode(p, s);
 		UnlockNode(bt, s);
+
+		if (range_rec(p, &range) == -1)
+			return -1;
+	} else {
+		UnlockNode(bt, s);
+	}
+
+	return range.visited;
+}
+
+int
+tsbintree_cursor_init(tsbintree_cursor *cursor, tsbintree *bt, char *start) {
+	if (start != NULL && !ValidKey(start)) {
+		errno = EINVAL;
 		return -1;
 	}
 
-	/* deleting from a recently initialized tree */
-	if (bt->key == NULL) {
-		UnlockNode(bt, s);
+	cursor->tree = bt;
+	cursor->state = (start == NULL) ? TSBT_CURSOR_FIRST : TSBT_CURSOR_FROM;
+	if (start != NULL) {
+		strncpy(cursor->key, start, TSBT_MAX_KEY_SIZE);
+		cursor->key[TSBT_MAX_KEY_SIZE] = '\0';
+	}
+
+	return 0;
+}
+
+/* each step is an independent descent for the smallest key after the one last
+ * returned, so no lock is held between calls and the cursor stays valid however
+ * the tree changes meanwhile */
+int
+tsbintree_cursor_next(tsbintree_cursor *cursor, char **key, void **value) {
+	struct tsbintree_node *p, *found;
+	pthread_rwlock_t *owner;
+	struct search_key k;
+	int s, cmp;
+
+	if (cursor->state == TSBT_CURSOR_END) {
 		errno = ENOKEY;
 		return -1;
 	}
 
-	tsbintree *p, *parent, *successor, *successor_parent, *tmp;
-	int cmp;
-	UnlockNode(bt, s);
+	if (cursor->state != TSBT_CURSOR_FIRST)
+		search_key(&k, cursor->key);
+
+	ReadLockNode(cursor->tree, s);
+
+	/* the best candidate so far stays read-locked, on top of the usual coupling,
+	 * until it is either replaced or its key has been copied: the key may live
+	 * in the node itself */
+	owner = &cursor->tree->lock;
+	p = cursor->tree->root;
+	found = NULL;
+	while (p != NULL) {
+		if (cursor->state == TSBT_CURSOR_FIRST)
+			cmp = 1;
+		else
+			cmp = key_compare(p, &k);
+
+		ReadLockNode(p, s);
+		if (found == NULL || owner != &found->lock) {
+			s = pthread_rwlock_unlock(owner);
+			PthreadCheck(s);
+		}
+		owner = &p->lock;
+
+		if (cmp > 0 || (cmp == 0 && cursor->state == TSBT_CURSOR_FROM)) {
+			if (found != NULL)
+				UnlockNode(found, s);
+			found = p;
+
+			if (cmp == 0)
+				break;
+		}
 
-	p = bt;
-	parent = NULL;
-	while (p) {
-		s = pthread_mutex_lock(&p->lock);
+		p = (cmp > 0) ? p->left : p->right;
+	}
+
+	if (found == NULL || owner != &found->lock) {
+		s = pthread_rwlock_unlock(owner);
 		PthreadCheck(s);
+	}
 
-		cmp = strncmp(p->key, key, TSBT_MAX_KEY_SIZE);
+	if (found == NULL) {
+		cursor->state = TSBT_CURSOR_END;
+		errno = ENOKEY;
+		return -1;
+	}
 
-		if (cmp > 0) {
-			UnlockNode(p, s);
-			parent = p;
-			p = p->left;
-		} else if (cmp < 0) {
-			UnlockNode(p, s);
-			parent = p;
-			p = p->right;
-		} else {
-			/* key found: delete it */
-			if (parent) {
-				assert(parent->left == p || parent->right == p);
+	memcpy(cursor->key, found->key, found->keylen + 1);
+	cursor->state = TSBT_CURSOR_AFTER;
+	if (value != NULL)
+		*value = found->value;
 
-				s = pthread_mutex_lock(&parent->lock);
-				PthreadCheck(s);
-			}
+	UnlockNode(found, s);
 
-			/* deleted node is a leaf */
-			if (!p->left && !p->right) {
-				if (parent && parent->left == p)
-					parent->left = NULL;
-				else if (parent && parent->right == p)
-					parent->right = NULL;
-
-				Free(p);
-			} else if (p->left && !p->right) {
-				if (parent) {
-					if (parent->left == p)
-						parent->left = p->left;
-					else if (parent->right == p)
-						parent->right = p->left;
-
-					Free(p);
-				} else {
-					tmp = p->left;
-
-					/* copy over new root */
-					p->key = p->left->key;
-					p->value = p->left->value;
-					p->left = p->left->left;
-					p->right = p->left->right;
-
-					Free(tmp);
-				}
-			} else if (!p->left && p->right) {
-				if (parent) {
-					if (parent->left == p)
-						parent->left = p->right;
-					else if (parent->right == p)
-						parent->right = p->right;
-
-					Free(p);
-				} else {
-					tmp = p->right;
-
-					/* copy over new root */
-					p->key = p->right->key;
-					p->value = p->right->value;
-					p->left = p->right->left;
-					p->right = p->right->right;
-
-					Free(tmp);
-				}
-
-			} else {
-				/* deleted node has both subtrees */
-				assert(find_successor(p->left, &successor, &successor_parent) != -1);
-				p->key = successor->key;
-				p->value = successor->value;
-
-				if (successor_parent)
-					successor_parent->right = successor->left;
-				else
-					p->left = NULL;
-
-				Free(successor);
-			}
+	*key = cursor->key;
+	return 0;
+}
 
-			UnlockNode(p, s);
-			if (parent) UnlockNode(parent, s);
-			return 0;
+static void
+destroy_rec(struct tsbintree_node *node) {
+	/* recursion base case */
+	if (node == NULL)
+		return;
+
+	destroy_rec(node->left);
+	destroy_rec(node->right);
+	pthread_rwlock_destroy(&node->lock);
+	node_free_key(node);
+}
+
+int
+tsbintree_destroy(tsbintree *bt) {
+	struct tsbintree_slab *slab, *next;
+	int i, slot;
+
+	/* nodes still in the tree only need their locks (and key copies) released:
+	 * the memory goes away with the slabs */
+	destroy_rec(bt->root);
+	bt->root = NULL;
+
+	/* no reader can be left by now, so retired nodes are freed regardless of
+	 * their epoch. They may sit in another list's slab, hence the separate pass */
+	for (i = 0; i < TSBT_POOL_LISTS; ++i)
+		for (slot = 0; slot < 3; ++slot)
+			limbo_flush(&bt->pool[i], slot);
+
+	for (i = 0; i < TSBT_POOL_LISTS; ++i) {
+		for (slab = bt->pool[i].slabs; slab != NULL; slab = next) {
+			next = slab->next;
+			free(slab);
 		}
+
+		bt->pool[i].slabs = NULL;
+		bt->pool[i].free = bt->pool[i].next = bt->pool[i].end = NULL;
+		pthread_mutex_destroy(&bt->pool[i].lock);
 	}
 
-	errno = ENOKEY;
-	return -1;
+	int s = pthread_rwlock_destroy(&bt->lock);
+	PthreadCheck(s);
+
+	return 0;
+}
+
+#ifdef TSBT_STATS
+/* counts the nodes of the subtree rooted at `p`, at `depth`, by depth. `p` is
+ * read-locked by the caller and is unlocked here; as in `range_rec`, only nodes
+ * whose right subtree is still to be visited stay locked */
+static int
+shape_rec(struct tsbintree_node *p, unsigned int depth, struct tsbintree_stats *stats) {
+	struct tsbintree_node *child;
+	int s;
+
+	for (;; ++depth) {
+		++stats->nodes;
+		stats->depth_total += depth;
+		++stats->depths[(depth < TSBT_STATS_DEPTHS) ? depth : TSBT_STATS_DEPTHS];
+		if (depth > stats->max_depth)
+			stats->max_depth = depth;
+
+		if ((child = p->left) != NULL) {
+			ReadLockNode(child, s);
+			if (shape_rec(child, depth + 1, stats) == -1)
+				return -1;
+		}
+
+		if ((child = p->right) == NULL)
+			break;
+
+		ReadLockNode(child, s);
+		UnlockNode(p, s);
+		p = child;
+	}
+
+	UnlockNode(p, s);
+	return 0;
 }
 
 int
-tsbintree_destroy(tsbintree *root) {
-	/* recursion base case */
-	if (root == NULL || root->key == NULL)
-		return 0;
+tsbintree_stats(tsbintree *bt, struct tsbintree_stats *stats) {
+	struct tsbintree_op_stats *o, *from;
+	struct tsbintree_node *p;
+	int i, op, s;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (i = 0; i < TSBT_POOL_LISTS; ++i) {
+		for (op = 0; op < TSBT_STATS_OPS; ++op) {
+			o = &stats->ops[op];
+			from = &bt->stats[i].ops[op];
+
+			o->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+			o->path_total += __atomic_load_n(&from->path_total, __ATOMIC_RELAXED);
+			o->locks += __atomic_load_n(&from->locks, __ATOMIC_RELAXED);
+			o->lock_waits += __atomic_load_n(&from->lock_waits, __ATOMIC_RELAXED);
+			o->wait_ns += __atomic_load_n(&from->wait_ns, __ATOMIC_RELAXED);
+			if (from->path_max > o->path_max)
+				o->path_max = from->path_max;
+			if (from->wait_max_ns > o->wait_max_ns)
+				o->wait_max_ns = from->wait_max_ns;
+		}
 
-	tsbintree_destroy(root->left);
-	tsbintree_destroy(root->right);
+		stats->lookup_retries += __atomic_load_n(&bt->stats[i].lookup_retries, __ATOMIC_RELAXED);
+		stats->lookup_fallbacks += __atomic_load_n(&bt->stats[i].lookup_fallbacks, __ATOMIC_RELAXED);
+	}
 
-	int s = pthread_mutex_destroy(&root->lock);
-	PthreadCheck(s);
+	ReadLockNode(bt, s);
+	if ((p = bt->root) != NULL) {
+		ReadLockNode(p, s);
+		UnlockNode(bt, s);
 
+		return shape_rec(p, 1, stats);
+	}
+
+	UnlockNode(bt, s);
 	return 0;
 }
 
+void
+tsbintree_stats_reset(tsbintree *bt) {
+	int i;
+
+	for (i = 0; i < TSBT_POOL_LISTS; ++i)
+		memset(&bt->stats[i], 0, sizeof(bt->stats[i]));
+}
+#endif
+
 #ifdef TSBT_DEBUG
 static int
 nextid(char *id) {
@@ -318,7 +1609,7 @@ nextid(char *id) {
 }
 
 static int
-tsbintree_to_dot_rec(tsbintree *root, char *buffer, int size, int script_size, char *id) {
+tsbintree_to_dot_rec(struct tsbintree_node *root, char *buffer, int size, int script_size, char *id) {
 #define AppendToBuffer(...) do { \
 	tmp = snprintf(&buffer[pos], size - pos, __VA_ARGS__); \
 	pos += tmp; \
@@ -342,7 +1633,7 @@ tsbintree_to_dot_rec(tsbintree *root, char *buffer, int size, int script_size, c
 	strncpy(rootid, id, TSBT_MAX_DOT_LABEL_SIZE);
 
 	/* print its own label */
-	if (root == NULL || root->key == NULL) {
+	if (root == NULL) {
 		/* print a single point to indicate a NULL child */
 		AppendToBuffer("%s[shape=point];", id);
 		NextId(id);
@@ -383,7 +1674,7 @@ tsbintree_to_dot(tsbintree *bt, char *buffer, int size) {
 	}
 
 	snprintf(buffer, size, TSBT_DOT_HEADER);
-	if ((written = tsbintree_to_dot_rec(bt, buffer, size, TSBT_DOT_HEADER_LEN, label)) == -1) {
+	if ((written = tsbintree_to_dot_rec(bt->root, buffer, size, TSBT_DOT_HEADER_LEN, label)) == -1) {
 		errno = ENOMEM;
 		return -1;
 	}
@@ -397,18 +1688,23 @@ tsbintree_to_dot(tsbintree *bt, char *buffer, int size) {
 	return size;
 }
 
-int
-tsbintree_print(tsbintree *bt) {
+static int
+print_rec(struct tsbintree_node *node) {
 	int nodes = 0;
 
-	if (bt != NULL && bt->key != NULL) {
+	if (node != NULL) {
 		++nodes;
 
-		nodes += tsbintree_print(bt->left);
-		printf("\t* %s=%s\n", bt->key, (char *) bt->value);
-		nodes += tsbintree_print(bt->right);
+		nodes += print_rec(node->left);
+		printf("\t* %s=%s\n", node->key, (char *) node->value);
+		nodes += print_rec(node->right);
 	}
 
 	return nodes;
 }
+
+int
+tsbintree_print(tsbintree *bt) {
+	return print_rec(bt->root);
+}
 #endif
@@ -1,8 +1,14 @@
 /* tsbintree - a thread-safe binary tree implementation.
  *
  * This header file defines an implementation of a thread-safe binary tree.
- * Note that the tree is left *unbalanced*. This can lead to poor performance
- * depending on the input, but greatly simplifies the locking strategy.
+ * The tree is kept balanced as a treap: every node carries a priority derived
+ * from its key and the tree is a heap on those priorities, which keeps the
+ * expected depth logarithmic even when keys arrive in sorted order. Nodes are
+ * locked individually and operations use lock coupling (hand-over-hand locking),
+ * so restructuring the tree never requires a global lock. Node locks are
+ * reader-writer locks, and lookups normally take no lock at all: they validate
+ * per-node version counters instead, while deleted nodes are reclaimed through
+ * epochs so that a lookup never touches freed memory.
  *
  * Data is stored in a key=value format.
  *
@@ -11,9 +17,19 @@
  * 	tsbintree_init(tsbintree *bt);
  * 	tsbintree_add(tsbintree *bt, char *key, void *value);
  * 	tsbintree_delete(tsbintree *bt, char *key);
- * 	tsbintree_lookup(tsbintree *bt, void **value);
+ * 	tsbintree_lookup(tsbintree *bt, char *key, void **value);
+ * 	tsbintree_build(tsbintree *bt, char **keys, void **values, size_t n);
+ * 	tsbintree_add_batch(tsbintree *bt, char **keys, void **values, size_t n);
+ * 	tsbintree_range(tsbintree *bt, char *lo, char *hi, callback, void *arg);
+ * 	tsbintree_cursor_init(tsbintree_cursor *cursor, tsbintree *bt, char *start);
+ * 	tsbintree_cursor_next(tsbintree_cursor *cursor, char **key, void **value);
  * 	tsbintree_destroy(tsbintree *bt);
  *
+ * By default the tree stores pointers to the caller's keys. If compiled with the
+ * TSBT_INLINE_KEYS constant defined, it copies keys instead: keys shorter than
+ * TSBT_INLINE_KEY_SIZE are stored inside the node and longer ones in a private
+ * heap copy, and callers are free to reuse their key buffers.
+ *
  * If compiled with the TSBT_DEBUG constant defined, then the following *non thread-safe*
  * functions are available:
  *
@@ -22,6 +38,22 @@
  *
  * See definitions above for the complete signature.
  *
+ * If compiled with the TSBT_STATS constant defined, the tree keeps counters telling
+ * where the time of its point operations (add, delete and lookup) goes, and the
+ * following functions are available:
+ *
+ * 	tsbintree_stats(tsbintree *bt, struct tsbintree_stats *stats);
+ * 	tsbintree_stats_reset(tsbintree *bt);
+ *
+ * For each kind of operation, it counts the nodes compared on the way to the key
+ * (the path length, which grows if the tree degenerates), the locks taken, and how
+ * many of them were held by another thread, along with the time spent waiting for
+ * those (a lock is tried first, and the wait is timed only if that fails).
+ * Counters are kept per thread for the duration of an operation, and added to
+ * those of the thread's pool list (see below) once it is done, so threads do not
+ * share cache lines to count. A snapshot adds them all up, along with the shape
+ * of the tree: its node count, and how many nodes are at each depth.
+ *
  * Author: Renato Mascarenhas Costa
  */
 
@@ -36,6 +68,8 @@
 #include <assert.h>
 #include <pthread.h>
 
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 
 #ifdef TSBT_DEBUG
@@ -47,18 +81,148 @@
 #define TSBT_DOT_HEADER_LEN ((int) strlen(TSBT_DOT_HEADER))
 #define TSBT_MAX_DOT_LABEL_SIZE (5)
 
-/* a tree is just a node with left and right pointers.
- * Each node contains a lock that controls access to that node's data */
-struct tsbintree {
+/* number of leading key bytes cached in every node. Comparisons are settled by
+ * them without following the key pointer unless both keys are longer and share
+ * the prefix */
+#define TSBT_KEY_PREFIX_SIZE (8)
+
+/* keys shorter than this are stored in the node itself when TSBT_INLINE_KEYS
+ * is defined */
+#ifndef TSBT_INLINE_KEY_SIZE
+#  define TSBT_INLINE_KEY_SIZE (24)
+#endif
+
+/* nodes are carved out of slabs of this many nodes */
+#ifndef TSBT_SLAB_NODES
+#  define TSBT_SLAB_NODES (256)
+#endif
+
+/* number of free lists in a tree's node pool. Threads are spread over them so
+ * that each one normally has a list to itself */
+#ifndef TSBT_POOL_LISTS
+#  define TSBT_POOL_LISTS (16)
+#endif
+
+/* a node contains a reader-writer lock that controls access to its child
+ * pointers. The key, value and priority are fixed when the node is created.
+ * `prefix` holds the first TSBT_KEY_PREFIX_SIZE bytes of the key, big-endian.
+ * `version` is odd while the child pointers are being changed and is bumped
+ * every time they are, so lock-free readers can tell what they read was stable */
+struct tsbintree_node {
+	uint64_t prefix;
+	unsigned int keylen;
+	unsigned int priority;
 	char *key;
 	void *value;
+	struct tsbintree_node *left;
+	struct tsbintree_node *right;
+	unsigned int version;
+	pthread_rwlock_t lock;
+	struct tsbintree_node *retired;
+#ifdef TSBT_INLINE_KEYS
+	char inline_key[TSBT_INLINE_KEY_SIZE];
+#endif
+};
+
+struct tsbintree_slab;
+
+/* one of the free lists of the node pool. Freed nodes are recycled first; new
+ * ones are taken in order from the list's current slab, so the nodes a thread
+ * inserts end up next to each other in memory.
+ *
+ * It also serves the threads using it for epoch based reclamation: `readers`
+ * counts lock-free lookups in progress by epoch parity, and deleted nodes wait
+ * in `limbo`, by the epoch they were deleted in, until no lookup can reach them */
+struct tsbintree_freelist {
 	pthread_mutex_t lock;
-	struct tsbintree *left;
-	struct tsbintree *right;
+	struct tsbintree_node *free;
+	struct tsbintree_node *next;
+	struct tsbintree_node *end;
+	struct tsbintree_slab *slabs;
+	unsigned long readers[2];
+	struct tsbintree_node *limbo[3];
+	unsigned long limbo_epoch[3];
+} __attribute__((aligned(64)));
+
+#ifdef TSBT_STATS
+/* nodes at a depth are counted separately up to this depth; deeper ones are
+ * counted together */
+#ifndef TSBT_STATS_DEPTHS
+#  define TSBT_STATS_DEPTHS (64)
+#endif
+
+enum tsbintree_stats_op {
+	TSBT_STATS_ADD,
+	TSBT_STATS_DELETE,
+	TSBT_STATS_LOOKUP,
+	TSBT_STATS_OPS
+};
+
+/* counters of one kind of operation */
+struct tsbintree_op_stats {
+	unsigned long count;
+	unsigned long path_total;          /* nodes compared, all operations together */
+	unsigned long path_max;
+	unsigned long locks;               /* locks taken */
+	unsigned long lock_waits;          /* of those, locks held by another thread */
+	unsigned long long wait_ns;        /* time spent waiting for them */
+	unsigned long long wait_max_ns;
+};
+
+/* the counters of the threads using one of the pool lists */
+struct tsbintree_counters {
+	struct tsbintree_op_stats ops[TSBT_STATS_OPS];
+	unsigned long lookup_retries;      /* lock-free descents started over */
+	unsigned long lookup_fallbacks;    /* lookups that took locks in the end */
+} __attribute__((aligned(64)));
+
+/* a snapshot of the counters and of the shape of a tree. The root is at depth 1,
+ * so the depth of a node is the length of the path to it */
+struct tsbintree_stats {
+	size_t nodes;
+	unsigned int max_depth;
+	unsigned long depth_total;
+	unsigned long depths[TSBT_STATS_DEPTHS + 1]; /* nodes at each depth; the last
+	                                                 counts every deeper one */
+	struct tsbintree_op_stats ops[TSBT_STATS_OPS];
+	unsigned long lookup_retries;
+	unsigned long lookup_fallbacks;
+};
+#endif
+
+/* a tree is a header pointing to the root node. Since rotations may replace
+ * the root, its lock (and version) guard the root pointer. Nodes come from the
+ * tree's own pool, which is released as a whole when the tree is destroyed */
+struct tsbintree {
+	pthread_rwlock_t lock;
+	struct tsbintree_node *root;
+	unsigned int version;
+	unsigned long epoch;
+	struct tsbintree_freelist pool[TSBT_POOL_LISTS];
+#ifdef TSBT_STATS
+	struct tsbintree_counters stats[TSBT_POOL_LISTS];
+#endif
 };
 
 typedef struct tsbintree tsbintree;
 
+enum tsbintree_cursor_state {
+	TSBT_CURSOR_FIRST, /* nothing returned yet, start at the smallest key */
+	TSBT_CURSOR_FROM,  /* nothing returned yet, start at `key` or after it */
+	TSBT_CURSOR_AFTER, /* `key` was the last key returned */
+	TSBT_CURSOR_END
+};
+
+/* an in-order cursor over a tree. It keeps its own copy of the last key it
+ * returned, so it holds no locks or references into the tree between calls */
+struct tsbintree_cursor {
+	tsbintree *tree;
+	enum tsbintree_cursor_state state;
+	char key[TSBT_MAX_KEY_SIZE + 1];
+};
+
+typedef struct tsbintree_cursor tsbintree_cursor;
+
 /* initializes a tsbintree structure. Must be called before any other function in
  * this library.
  *
@@ -66,34 +230,100 @@ typedef struct tsbintree tsbintree;
 int tsbintree_init(tsbintree *bt);
 
 /* adds a new node to the tree. It is an error to reuse a key.
- * Note that the keys and values are *not* copied. Thus, their references must
- * be valid throughout the use of the library functions.
+ * Note that values are *not* copied, and neither are keys unless TSBT_INLINE_KEYS
+ * is defined. Thus, their references must be valid throughout the use of the
+ * library functions.
  *
  * Returns a non-negative value on success or -1 on error. */
 int tsbintree_add(tsbintree *bt, char *key, void *value);
 
 /* deletes data referenced by key. It is an error to try to delete an inexisting key.
+ * Lookups running concurrently may still read the deleted node (and, unless
+ * TSBT_INLINE_KEYS is defined, its key) until they finish; the node itself is
+ * only reused once none of them can reach it.
  *
  * Returns a non-negative value on success or -1 on error. */
 int tsbintree_delete(tsbintree *bt, char *key);
 
-/* looks up data referenced by the given key. If it is found, then the `value` pointer
- * will point to the associated data block. Note that no memory copying occurs. If the
- * content of the data pointed to by `value` is changed, so is the related content in
- * the tree. However, such changes are not advisable since it may lead to errors in
- * multi-threaded environments.
+/* looks up data referenced by the given key without taking any lock, unless it keeps
+ * running into concurrent writers, in which case it falls back to lock coupling.
+ * If it is found, then the `value` pointer will point to the associated data block.
+ * Note that no memory copying occurs. If the content of the data pointed to by
+ * `value` is changed, so is the related content in the tree. However, such changes
+ * are not advisable since it may lead to errors in multi-threaded environments.
  *
  * In case there is no data associated with the given key, an error is returned
- * and the buffer is left unchanged.
+ * (errno is set to ENOKEY) and the buffer is left unchanged.
  *
  * Returns non-negative on success or -1 on error. */
 int tsbintree_lookup(tsbintree *bt, char *key, void **value);
 
-/* frees resources taken by a tree with the given root.
+/* builds the tree out of `n` keys given in strictly increasing order, with
+ * `values[i]` associated to `keys[i]` (all values are NULL if `values` is NULL).
+ * This is meant for loading a sorted snapshot: it takes O(n) time and locks only
+ * the tree header, once. The tree must be empty (EEXIST otherwise), and keys
+ * out of order are rejected with EINVAL. Keys and values are kept as with
+ * `tsbintree_add`.
+ *
+ * Returns non-negative on success or -1 on error. */
+int tsbintree_build(tsbintree *bt, char **keys, void **values, size_t n);
+
+/* adds `n` keys, given in any order, in a single descent of the tree: the batch
+ * is sorted and split between subtrees on the way down. Keys already in the tree
+ * or repeated in the batch are skipped rather than treated as errors. While the
+ * batch is being applied, the subtree spanning its keys is locked exclusively.
+ *
+ * Returns the number of keys added or -1 on error, in which case part of the
+ * batch may have been added. */
+int tsbintree_add_batch(tsbintree *bt, char **keys, void **values, size_t n);
+
+/* calls `callback` with every key between `lo` and `hi` (both inclusive) and its
+ * value, in increasing key order. A NULL bound leaves that side of the range open.
+ * Only subtrees that can hold keys in the range are visited, with shared locks,
+ * and the iteration stops early if `callback` returns non-zero. The callback runs
+ * while nodes are locked and must not modify the tree.
+ *
+ * Returns the number of keys passed to `callback` or -1 on error. */
+int tsbintree_range(tsbintree *bt, char *lo, char *hi,
+		int (*callback)(char *key, void *value, void *arg), void *arg);
+
+/* positions a cursor before the first key not smaller than `start`, or before
+ * the smallest key in the tree if `start` is NULL.
+ *
+ * Returns non-negative on success or -1 on error. */
+int tsbintree_cursor_init(tsbintree_cursor *cursor, tsbintree *bt, char *start);
+
+/* moves the cursor to the next key in order, storing it and its value (unless
+ * `value` is NULL). The key returned is the cursor's own copy and stays valid
+ * until the next call. Each call costs a descent from the root and the tree may be
+ * modified freely between calls: the cursor returns the smallest key after the
+ * previous one present at the time of the call.
+ *
+ * Returns non-negative on success or -1 on error. When there are no more keys,
+ * errno is set to ENOKEY. */
+int tsbintree_cursor_next(tsbintree_cursor *cursor, char **key, void **value);
+
+/* frees resources taken by the tree. Keys and values are not owned by the tree
+ * and are not freed.
  *
  * Returns non-negative on success or -1 on error. */
 int tsbintree_destroy(tsbintree *bt);
 
+#ifdef TSBT_STATS
+
+/* fills `stats` with the counters of the tree, and its shape. The shape is taken
+ * with shared locks, one subtree at a time, so writers running meanwhile make it
+ * approximate, but are not held back for the whole walk.
+ *
+ * Returns non-negative on success or -1 on error. */
+int tsbintree_stats(tsbintree *bt, struct tsbintree_stats *stats);
+
+/* sets the counters back to zero, to measure a part of a run on its own.
+ * Operations running meanwhile may or may not be counted. */
+void tsbintree_stats_reset(tsbintree *bt);
+
+#endif
+
 #ifdef TSBT_DEBUG
 
 /* generates a representation of the tree's current state usig the DOT language.
@@ -0,0 +1,499 @@
+#define _GNU_SOURCE
+
+#include "tshashmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ValidKey(key) ((key) != NULL && strlen(key) <= TSHM_MAX_KEY_SIZE)
+
+#define StripeOf(hash) ((hash) & (TSHM_STRIPES - 1))
+
+/* FNV-1a, finished with an avalanche step so that sequential keys spread over
+ * the low bits buckets and stripes are picked by */
+static uint32_t
+key_hash(const char *key) {
+	uint32_t h = 2166136261u;
+
+	for (; *key != '\0'; ++key) {
+		h ^= (unsigned char) *key;
+		h *= 16777619u;
+	}
+
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+
+	return h;
+}
+
+static int
+lock_init(pthread_rwlock_t *lock) {
+	pthread_rwlockattr_t attr;
+	int s;
+
+	s = pthread_rwlockattr_init(&attr);
+	if (s != 0)
+		return s;
+
+#ifdef PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+
+	s = pthread_rwlock_init(lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+
+	return s;
+}
+
+static struct tshashmap_bucket *
+buckets_alloc(size_t n) {
+	void *buckets;
+
+	if (posix_memalign(&buckets, 64, n * sizeof(struct tshashmap_bucket)) != 0)
+		return NULL;
+
+	memset(buckets, 0, n * sizeof(struct tshashmap_bucket));
+	return buckets;
+}
+
+/* frees the overflow buckets chained to every bucket, then the array itself */
+static void
+buckets_free(struct tshashmap_bucket *buckets, size_t n) {
+	struct tshashmap_bucket *b, *next;
+	size_t i;
+
+	for (i = 0; i < n; ++i) {
+		for (b = buckets[i].next; b != NULL; b = next) {
+			next = b->next;
+			free(b);
+		}
+	}
+
+	free(buckets);
+}
+
+/* looks for `key` in the chain of `head`, returning the bucket it is in and its
+ * slot, or NULL */
+static struct tshashmap_bucket *
+chain_find(struct tshashmap_bucket *head, uint32_t hash, const char *key, int *slot) {
+	struct tshashmap_bucket *b;
+	int i;
+
+	for (b = head; b != NULL; b = b->next) {
+		for (i = 0; i < TSHM_BUCKET_SLOTS; ++i) {
+			if (b->keys[i] != NULL && b->hashes[i] == hash && !strcmp(b->keys[i], key)) {
+				*slot = i;
+				return b;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/* stores a key in the first free slot of the chain of `head`, chaining a new
+ * overflow bucket if there is none */
+static int
+chain_insert(struct tshashmap_bucket *head, uint32_t hash, char *key, void *value) {
+	struct tshashmap_bucket *b;
+	void *mem;
+	int i;
+
+	for (b = head; b != NULL; b = b->next) {
+		for (i = 0; i < TSHM_BUCKET_SLOTS; ++i) {
+			if (b->keys[i] == NULL)
+				goto store;
+		}
+	}
+
+	if (posix_memalign(&mem, 64, sizeof(struct tshashmap_bucket)) != 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	b = mem;
+	memset(b, 0, sizeof(struct tshashmap_bucket));
+	b->next = head->next;
+	head->next = b;
+	i = 0;
+
+store:
+	b->hashes[i] = hash;
+	b->values[i] = value;
+	b->keys[i] = key;
+	return 0;
+}
+
+/* empties a slot, releasing its bucket if it is an overflow bucket left empty */
+static void
+chain_remove(struct tshashmap_bucket *head, struct tshashmap_bucket *b, int slot) {
+	struct tshashmap_bucket *prev;
+	int i;
+
+	b->keys[slot] = NULL;
+	if (b == head)
+		return;
+
+	for (i = 0; i < TSHM_BUCKET_SLOTS; ++i) {
+		if (b->keys[i] != NULL)
+			return;
+	}
+
+	for (prev = head; prev->next != b; prev = prev->next)
+		;
+
+	prev->next = b->next;
+	free(b);
+}
+
+/* moves the keys of old bucket `index` to the new table. Keys are removed from
+ * the old bucket as they are moved, so that an allocation failure halfway
+ * leaves each key in exactly one table */
+static int
+bucket_migrate(tshashmap *hm, size_t index) {
+	struct tshashmap_bucket *head = &hm->old[index], *b, *next;
+	uint32_t hash;
+	int i;
+
+	for (b = head; b != NULL; b = b->next) {
+		for (i = 0; i < TSHM_BUCKET_SLOTS; ++i) {
+			if (b->keys[i] == NULL)
+				continue;
+
+			hash = b->hashes[i];
+			if (chain_insert(&hm->buckets[hash & (hm->nbuckets - 1)], hash, b->keys[i], b->values[i]) == -1)
+				return -1;
+			b->keys[i] = NULL;
+		}
+	}
+
+	for (b = head->next; b != NULL; b = next) {
+		next = b->next;
+		free(b);
+	}
+	head->next = NULL;
+
+	return 0;
+}
+
+/* moves up to `max` old buckets of a stripe whose write lock is held. Returns 1
+ * if they were the last old buckets of the whole table, 0 otherwise, or -1 on
+ * error */
+static int
+stripe_migrate(tshashmap *hm, unsigned int stripe, size_t max) {
+	struct tshashmap_stripe *st = &hm->stripes[stripe];
+	size_t total = hm->old_nbuckets / TSHM_STRIPES;
+
+	if (hm->old == NULL || st->migrated == total)
+		return 0;
+
+	for (; max > 0 && st->migrated < total; --max) {
+		if (bucket_migrate(hm, stripe + st->migrated * TSHM_STRIPES) == -1)
+			return -1;
+		++st->migrated;
+	}
+
+	if (st->migrated < total)
+		return 0;
+
+	return __atomic_sub_fetch(&hm->pending, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+/* looks for `key` in both tables, with the lock of its stripe held */
+static struct tshashmap_bucket *
+map_find(tshashmap *hm, uint32_t hash, const char *key,
+		struct tshashmap_bucket **head, int *slot) {
+	struct tshashmap_bucket *b;
+	size_t index;
+
+	*head = &hm->buckets[hash & (hm->nbuckets - 1)];
+	if ((b = chain_find(*head, hash, key, slot)) != NULL)
+		return b;
+
+	if (hm->old == NULL)
+		return NULL;
+
+	index = hash & (hm->old_nbuckets - 1);
+	if (index / TSHM_STRIPES < hm->stripes[StripeOf(hash)].migrated)
+		return NULL;
+
+	*head = &hm->old[index];
+	return chain_find(*head, hash, key, slot);
+}
+
+static int
+lock_all(tshashmap *hm) {
+	int i, s;
+
+	for (i = 0; i < TSHM_STRIPES; ++i) {
+		s = pthread_rwlock_wrlock(&hm->stripes[i].lock);
+		if (s != 0) {
+			while (--i >= 0)
+				pthread_rwlock_unlock(&hm->stripes[i].lock);
+			errno = s;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void
+unlock_all(tshashmap *hm) {
+	int i;
+
+	for (i = TSHM_STRIPES - 1; i >= 0; --i)
+		pthread_rwlock_unlock(&hm->stripes[i].lock);
+}
+
+/* moves whatever is left of the old table, with every lock held, and releases it */
+static int
+finish_migration(tshashmap *hm) {
+	unsigned int i;
+
+	if (hm->old == NULL)
+		return 0;
+
+	for (i = 0; i < TSHM_STRIPES; ++i) {
+		if (stripe_migrate(hm, i, (size_t) -1) == -1)
+			return -1;
+	}
+
+	buckets_free(hm->old, hm->old_nbuckets);
+	hm->old = NULL;
+	hm->old_nbuckets = 0;
+	return 0;
+}
+
+/* releases the old table once its last bucket was moved. It takes every lock,
+ * but only to make sure no operation is still looking at the table */
+static void
+retire_old(tshashmap *hm) {
+	if (lock_all(hm) == -1)
+		return;
+
+	if (hm->old != NULL && hm->pending == 0)
+		finish_migration(hm);
+
+	unlock_all(hm);
+}
+
+/* doubles the table of `nbuckets` buckets, unless another thread did already.
+ * The keys are moved later; should the old table still have keys to move from
+ * the last time the map grew (its stripes seeing no writes since), they are
+ * moved now. Failures are not reported: the map is fine, only more loaded */
+static void
+grow(tshashmap *hm, size_t nbuckets) {
+	struct tshashmap_bucket *buckets;
+	int i;
+
+	if (lock_all(hm) == -1)
+		return;
+
+	if (hm->nbuckets != nbuckets || finish_migration(hm) == -1)
+		goto out;
+
+	if ((buckets = buckets_alloc(nbuckets * 2)) == NULL)
+		goto out;
+
+	hm->old = hm->buckets;
+	hm->old_nbuckets = hm->nbuckets;
+	hm->buckets = buckets;
+	hm->nbuckets = nbuckets * 2;
+
+	for (i = 0; i < TSHM_STRIPES; ++i)
+		hm->stripes[i].migrated = 0;
+	hm->pending = TSHM_STRIPES;
+
+out:
+	unlock_all(hm);
+}
+
+int
+tshashmap_init(tshashmap *hm) {
+	int i, s;
+
+	if (hm == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	hm->buckets = buckets_alloc(TSHM_INITIAL_BUCKETS);
+	if (hm->buckets == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	hm->nbuckets = TSHM_INITIAL_BUCKETS;
+	hm->old = NULL;
+	hm->old_nbuckets = 0;
+	hm->pending = 0;
+
+	for (i = 0; i < TSHM_STRIPES; ++i) {
+		s = lock_init(&hm->stripes[i].lock);
+		if (s != 0) {
+			while (--i >= 0)
+				pthread_rwlock_destroy(&hm->stripes[i].lock);
+			free(hm->buckets);
+			errno = s;
+			return -1;
+		}
+
+		hm->stripes[i].count = 0;
+		hm->stripes[i].migrated = 0;
+	}
+
+	return 0;
+}
+
+int
+tshashmap_add(tshashmap *hm, char *key, void *value) {
+	struct tshashmap_bucket *head;
+	struct tshashmap_stripe *st;
+	size_t nbuckets = 0;
+	uint32_t hash;
+	int s, slot, retire, result = -1;
+
+	if (hm == NULL || !ValidKey(key)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	hash = key_hash(key);
+	st = &hm->stripes[StripeOf(hash)];
+
+	s = pthread_rwlock_wrlock(&st->lock);
+	if (s != 0) {
+		errno = s;
+		return -1;
+	}
+
+	if ((retire = stripe_migrate(hm, StripeOf(hash), TSHM_MIGRATE_STEP)) == -1)
+		goto out;
+
+	if (map_find(hm, hash, key, &head, &slot) != NULL) {
+		errno = EINVAL;
+		goto out;
+	}
+
+	if (chain_insert(&hm->buckets[hash & (hm->nbuckets - 1)], hash, key, value) == -1)
+		goto out;
+
+	result = 0;
+	if (++st->count > TSHM_LOAD * (hm->nbuckets / TSHM_STRIPES) && hm->old == NULL)
+		nbuckets = hm->nbuckets;
+
+out:
+	pthread_rwlock_unlock(&st->lock);
+
+	if (retire == 1)
+		retire_old(hm);
+	if (nbuckets != 0)
+		grow(hm, nbuckets);
+
+	return result;
+}
+
+int
+tshashmap_delete(tshashmap *hm, char *key) {
+	struct tshashmap_bucket *head, *b;
+	struct tshashmap_stripe *st;
+	uint32_t hash;
+	int s, slot, retire, result = -1;
+
+	if (hm == NULL || !ValidKey(key)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	hash = key_hash(key);
+	st = &hm->stripes[StripeOf(hash)];
+
+	s = pthread_rwlock_wrlock(&st->lock);
+	if (s != 0) {
+		errno = s;
+		return -1;
+	}
+
+	if ((retire = stripe_migrate(hm, StripeOf(hash), TSHM_MIGRATE_STEP)) == -1)
+		goto out;
+
+	if ((b = map_find(hm, hash, key, &head, &slot)) == NULL) {
+		errno = ENOKEY;
+		goto out;
+	}
+
+	chain_remove(head, b, slot);
+	--st->count;
+	result = 0;
+
+out:
+	pthread_rwlock_unlock(&st->lock);
+
+	if (retire == 1)
+		retire_old(hm);
+
+	return result;
+}
+
+int
+tshashmap_lookup(tshashmap *hm, char *key, void **value) {
+	struct tshashmap_bucket *head, *b;
+	struct tshashmap_stripe *st;
+	uint32_t hash;
+	int s, slot;
+
+	if (hm == NULL || value == NULL || !ValidKey(key)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	hash = key_hash(key);
+	st = &hm->stripes[StripeOf(hash)];
+
+	s = pthread_rwlock_rdlock(&st->lock);
+	if (s != 0) {
+		errno = s;
+		return -1;
+	}
+
+	if ((b = map_find(hm, hash, key, &head, &slot)) != NULL)
+		*value = b->values[slot];
+
+	pthread_rwlock_unlock(&st->lock);
+
+	if (b == NULL) {
+		errno = ENOKEY;
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+tshashmap_destroy(tshashmap *hm) {
+	int i, s;
+
+	if (hm == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < TSHM_STRIPES; ++i) {
+		s = pthread_rwlock_destroy(&hm->stripes[i].lock);
+		if (s != 0) {
+			errno = s;
+			return -1;
+		}
+	}
+
+	buckets_free(hm->buckets, hm->nbuckets);
+	if (hm->old != NULL)
+		buckets_free(hm->old, hm->old_nbuckets);
+
+	hm->buckets = hm->old = NULL;
+	return 0;
+}
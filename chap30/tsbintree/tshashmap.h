@@ -0,0 +1,139 @@
+/* tshashmap - a thread-safe hash map with the point operations of tsbintree.
+ *
+ * When keys need no order, a tree costs more than it has to: every operation
+ * descends O(log n) nodes, each with its own lock (or version) to go through.
+ * This map finds a key in a single bucket, under a single lock.
+ *
+ * Buckets are guarded by lock striping: there are TSHM_STRIPES reader-writer
+ * locks, and bucket `i` is guarded by lock `i % TSHM_STRIPES`, so operations on
+ * keys in different stripes never contend. Since the number of buckets is always
+ * a multiple of the number of stripes, a key stays in the same stripe however
+ * large the table grows.
+ *
+ * The table doubles once the keys in a stripe average TSHM_LOAD per bucket, but
+ * growing only allocates the new table. Keys are moved there a few buckets at a
+ * time by the writers of each stripe (TSHM_MIGRATE_STEP buckets per add or
+ * delete), with only the lock of that stripe held; until a bucket is moved,
+ * operations look for its keys in both tables. All stripe locks are taken only
+ * briefly, to swap tables in and to release the old one.
+ *
+ * Buckets are cache line aligned and hold TSHM_BUCKET_SLOTS keys each, with
+ * more chained in overflow buckets. The hash of each key is kept next to its
+ * key pointer, so a lookup usually reads a single cache line and compares the
+ * key itself only when the hash matches.
+ *
+ * Available operations on the map, which match those of tsbintree: a program
+ * doing only point operations can switch between the two by changing its include
+ * and the `tsbintree` prefix.
+ *
+ * 	tshashmap_init(tshashmap *hm);
+ * 	tshashmap_add(tshashmap *hm, char *key, void *value);
+ * 	tshashmap_delete(tshashmap *hm, char *key);
+ * 	tshashmap_lookup(tshashmap *hm, char *key, void **value);
+ * 	tshashmap_destroy(tshashmap *hm);
+ *
+ * As with tsbintree, the map stores pointers to the caller's keys and values.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#ifndef _TSHASHMAP_H_
+#define _TSHASHMAP_H_
+
+#include <errno.h>
+#include <pthread.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TSHM_MAX_KEY_SIZE (1024)
+
+/* number of locks guarding the buckets. Must be a power of two */
+#ifndef TSHM_STRIPES
+#  define TSHM_STRIPES (64)
+#endif
+
+/* number of buckets of a new map. Must be a power of two, and no less than
+ * TSHM_STRIPES */
+#ifndef TSHM_INITIAL_BUCKETS
+#  define TSHM_INITIAL_BUCKETS (256)
+#endif
+
+/* keys held by a bucket before it overflows */
+#define TSHM_BUCKET_SLOTS (4)
+
+/* average number of keys per bucket the table grows at */
+#ifndef TSHM_LOAD
+#  define TSHM_LOAD (2)
+#endif
+
+/* old buckets a writer moves to the new table while the table grows */
+#ifndef TSHM_MIGRATE_STEP
+#  define TSHM_MIGRATE_STEP (4)
+#endif
+
+/* a bucket. Everything a lookup compares - hashes, key pointers and the link to
+ * the next overflow bucket - is in its first cache line; values follow. A slot
+ * is free if its key is NULL */
+struct tshashmap_bucket {
+	uint32_t hashes[TSHM_BUCKET_SLOTS];
+	char *keys[TSHM_BUCKET_SLOTS];
+	struct tshashmap_bucket *next;
+	void *values[TSHM_BUCKET_SLOTS];
+} __attribute__((aligned(64)));
+
+/* a lock, along with the state of the buckets it guards: how many keys they
+ * hold and, while the table grows, how many of its old buckets were moved
+ * (they are moved in order: `stripe`, `stripe + TSHM_STRIPES`, ...) */
+struct tshashmap_stripe {
+	pthread_rwlock_t lock;
+	size_t count;
+	size_t migrated;
+} __attribute__((aligned(64)));
+
+/* the bucket arrays change only while every stripe lock is held, so holding
+ * any of them is enough to read these fields */
+struct tshashmap {
+	struct tshashmap_stripe stripes[TSHM_STRIPES];
+	struct tshashmap_bucket *buckets;
+	size_t nbuckets;
+	struct tshashmap_bucket *old;      /* the table being moved from, or NULL */
+	size_t old_nbuckets;
+	unsigned int pending;              /* stripes with old buckets left to move */
+};
+
+typedef struct tshashmap tshashmap;
+
+/* initializes a tshashmap structure. Must be called before any other function
+ * in this library.
+ *
+ * Returns a non-negative value on success or -1 on error. */
+int tshashmap_init(tshashmap *hm);
+
+/* adds a new key to the map. It is an error (EINVAL) to reuse a key. Neither keys
+ * nor values are copied: their references must be valid throughout the use of
+ * the library functions.
+ *
+ * Returns a non-negative value on success or -1 on error. */
+int tshashmap_add(tshashmap *hm, char *key, void *value);
+
+/* deletes the key and its value. It is an error (ENOKEY) to try to delete an
+ * inexisting key.
+ *
+ * Returns a non-negative value on success or -1 on error. */
+int tshashmap_delete(tshashmap *hm, char *key);
+
+/* looks up the value of the given key, storing it in `value`. No memory copying
+ * occurs. In case there is no such key, an error is returned (errno is set to
+ * ENOKEY) and `value` is left unchanged.
+ *
+ * Returns non-negative on success or -1 on error. */
+int tshashmap_lookup(tshashmap *hm, char *key, void **value);
+
+/* frees resources taken by the map. Keys and values are not owned by the map
+ * and are not freed.
+ *
+ * Returns non-negative on success or -1 on error. */
+int tshashmap_destroy(tshashmap *hm);
+
+#endif
@@ -10,7 +10,9 @@
  * multithreaded application.
  *
  * This program implements the function in a reentrant manner, using the thread-
- * specific data API.
+ * specific data API. The name is found with pathSplit (see pathspan.h), which
+ * leaves the path untouched, and copied to the buffer of the thread. Programs
+ * that only look at the name can use pathSplit itself, with no copy at all.
  *
  * Usage
  *
@@ -21,6 +23,10 @@
  *    and so on. In order to test reentrancy, at least two paths must be given,
  *    but the user is free to pass as many paths as desired.
  *
+ * Built along with pathspan.c:
+ *
+ *    $ gcc -o basename_r basename_r.c pathspan.c -pthread
+ *
  * Author: Renato Mascarenhas Costa
  */
 
@@ -36,11 +42,13 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "pathspan.h"
+
 static void helpAndLeave(const char *progname, int status);
 static void pexit(const char *fCall);
 static void pthread_pexit(int err, const char *fCall);
 
-static char *basename_r(char *path);
+static char *basename_r(const char *path);
 
 static void *thread_function(void *arg);
 
@@ -135,25 +143,25 @@ get_basename_specific() {
 }
 
 static char *
-basename_r(char *path) {
+basename_r(const char *path) {
 	char *buf = get_basename_specific();
-	int pathlen = strlen(path);
+	struct pathSpan span;
 
-	/* if path is NULL or the empty string, basename should return "." */
-	if (!path || !strncmp(path, "", PATH_MAX)) {
-		strncpy(buf, ".", PATH_MAX);
-		return buf;
-	}
+	/* if path is NULL, basename should return "." */
+	if (!path)
+		path = "";
 
-	/* remove trailing slash, if any */
-	if (path[pathlen - 1] == '/')
-		path[pathlen - 1] = '\0';
+	pathSplit(path, strlen(path), NULL, &span);
 
-	char *p = strrchr(path, '/');
-	if (p) {
-		strncpy(buf, p + 1, PATH_MAX);
+	/* an empty span is "." */
+	if (span.length == 0) {
+		strncpy(buf, ".", PATH_MAX);
 	} else {
-		strncpy(buf, path, PATH_MAX);
+		if (span.length >= PATH_MAX)
+			span.length = PATH_MAX - 1;
+
+		memcpy(buf, path + span.offset, span.length);
+		buf[span.length] = '\0';
 	}
 
 	return buf;
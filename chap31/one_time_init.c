@@ -9,23 +9,53 @@
  * This program implements a clone of that function named one_time_init. As far as the
  * implementation goes, it receives a control and a function pointer argument, just
  * like pthread_once(3) does. The control paramenter is a statically allocated struct
- * comprised by a Boolean attribute indicating whether or not the initialization
- * already happened and a mutex to control access to this shared variable.
+ * comprised by a state word telling whether the initialization has not started,
+ * is running (possibly with other threads waiting for it) or is done.
+ *
+ * Once initialization is done, every call is a single load of the state word,
+ * with acquire semantics - so that what the initialization wrote is seen by the
+ * caller too - and no lock at all. Only calls that arrive before that go the slow
+ * way: the first one to change the state from not started to running with a
+ * compare-and-swap runs the initialization, while the others wait on the state
+ * word with futex(2), and are woken up when it is done. As with pthread_once(3),
+ * the initialization function must not call one_time_init for the same control;
+ * unlike it, cancellation of the initialization is not handled.
+ *
+ * one_time_init_locked is the first, simpler take on it: a Boolean and a mutex
+ * to control access to it - which every call takes, even long after the
+ * initialization is done.
  *
  * This program creates multiple threads to execute the same function that has
  * an initialization step within it. By default, the number of threads created
  * is 10. This number can be overwritten by defining NUM_THREADS on compilation
  * time.
  *
+ * With -b, it benchmarks both instead: the given number of threads call each
+ * function, after the initialization, many times in a row, and the time per
+ * call is reported, for one thread up to that number. On several CPUs, the
+ * mutex makes every call of every thread write the same cache line, while the
+ * state word is only read - and stays in the cache of every CPU.
+ *
  * Usage
  *
- *    $ ./one_time_init
+ *    $ ./one_time_init [-b] [-t threads] [-n calls]
+ *
+ *    -b: benchmark one_time_init and one_time_init_locked.
+ *    -t: the maximum number of threads of the benchmark (default: 4).
+ *    -n: the number of calls of each thread (default: 10000000).
  *
  * Author: Renato Mascarenhas Costa
  */
 
+#define _GNU_SOURCE /* syscall */
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <limits.h>
 #include <errno.h>
+#include <time.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,15 +66,25 @@
 
 #define ONE_TIME_INIT_VALUE (42)
 
-#define INIT_CONTROL_INITIALIZER { FALSE, PTHREAD_MUTEX_INITIALIZER }
+#define BENCH_THREADS (4)
+#define BENCH_CALLS (10000000)
+
+#define INIT_CONTROL_INITIALIZER { INIT_NONE, FALSE, PTHREAD_MUTEX_INITIALIZER }
 
 enum Boolean { FALSE, TRUE };
 
+/* the values of the state word */
+enum { INIT_NONE, INIT_RUNNING, INIT_WAITED, INIT_DONE };
+
 struct init_control {
+	unsigned int state;
+
+	/* for one_time_init_locked */
 	enum Boolean initialized;
 	pthread_mutex_t lock;
 };
-static int one_time_init(struct init_control *control, void (*init_routine)(void));
+static inline int one_time_init(struct init_control *control, void (*init_routine)(void));
+static int one_time_init_locked(struct init_control *control, void (*init_routine)(void));
 
 
 /* this value should never be read as -10 in the threads since it will be
@@ -54,17 +94,40 @@ static struct init_control control = INIT_CONTROL_INITIALIZER;
 
 static void init_function();
 static void *thread_function(void *arg);
+static void benchmark(int maxThreads, long calls);
 
 static void pexit(const char *fCall);
 static void pthread_pexit(int err, const char *fCall);
 
 int
-main() {
-	int s, i;
+main(int argc, char *argv[]) {
+	int s, i, opt, bench = FALSE, maxThreads = BENCH_THREADS;
+	long calls = BENCH_CALLS;
 	void *res;
 	int tids[NUM_THREADS];
 	pthread_t threads[NUM_THREADS];
 
+	while ((opt = getopt(argc, argv, "bt:n:")) != -1) {
+		switch (opt) {
+		case 'b': bench = TRUE; break;
+		case 't': maxThreads = atoi(optarg); break;
+		case 'n': calls = atol(optarg); break;
+		default:
+			fprintf(stderr, "Usage: %s [-b] [-t threads] [-n calls]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (bench) {
+		if (maxThreads < 1 || calls < 1) {
+			fprintf(stderr, "Invalid number of threads or calls\n");
+			exit(EXIT_FAILURE);
+		}
+
+		benchmark(maxThreads, calls);
+		exit(EXIT_SUCCESS);
+	}
+
 	printf("Main thread: creating %d threads\n", NUM_THREADS);
 	for (i = 0; i < NUM_THREADS; ++i) {
 		tids[i] = i + 1;
@@ -100,12 +163,65 @@ init_function(void) {
 }
 
 static int
+futex(unsigned int *word, int op, unsigned int val) {
+	return syscall(SYS_futex, word, op, val, NULL, NULL, 0);
+}
+
+/* the way of the calls arriving before the initialization is done */
+__attribute__((noinline))
+static int
+one_time_init_slow(struct init_control *control, void (*init_function)(void)) {
+	unsigned int state = INIT_NONE;
+
+	if (__atomic_compare_exchange_n(&control->state, &state, INIT_RUNNING, FALSE,
+				__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+		(*init_function)();
+
+		/* only wake up threads if some went to sleep */
+		if (__atomic_exchange_n(&control->state, INIT_DONE, __ATOMIC_RELEASE) == INIT_WAITED)
+			futex(&control->state, FUTEX_WAKE_PRIVATE, INT_MAX);
+
+		return 0;
+	}
+
+	while (state != INIT_DONE) {
+		/* tell the initializing thread there are waiters, then sleep - unless the
+		 * state changed meanwhile, in which case FUTEX_WAIT fails with EAGAIN */
+		if (state == INIT_WAITED || (state == INIT_RUNNING &&
+				__atomic_compare_exchange_n(&control->state, &state, INIT_WAITED, FALSE,
+					__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))) {
+			if (futex(&control->state, FUTEX_WAIT_PRIVATE, INIT_WAITED) == -1 &&
+					errno != EAGAIN && errno != EINTR)
+				return -1;
+		}
+
+		state = __atomic_load_n(&control->state, __ATOMIC_ACQUIRE);
+	}
+
+	return 0;
+}
+
+static inline int
 one_time_init(struct init_control *control, void (*init_function)(void)) {
 	if (!control) {
 		errno = EINVAL;
 		return -1;
 	}
 
+	/* the fast path: once initialized, a load is all it takes */
+	if (__atomic_load_n(&control->state, __ATOMIC_ACQUIRE) == INIT_DONE)
+		return 0;
+
+	return one_time_init_slow(control, init_function);
+}
+
+static int
+one_time_init_locked(struct init_control *control, void (*init_function)(void)) {
+	if (!control) {
+		errno = EINVAL;
+		return -1;
+	}
+
 	int s;
 
 	/* reading the value of the boolean value requires mutex protection */
@@ -125,6 +241,98 @@ one_time_init(struct init_control *control, void (*init_function)(void)) {
 	return 0;
 }
 
+/* what each thread of the benchmark does */
+struct bench_arg {
+	int locked;
+	long calls;
+	pthread_barrier_t *barrier;
+	struct timespec start, end;
+};
+
+static struct init_control bench_control = INIT_CONTROL_INITIALIZER;
+
+static void
+bench_init(void) {
+}
+
+static void *
+bench_thread(void *arg) {
+	struct bench_arg *ba = arg;
+	long i;
+
+	pthread_barrier_wait(ba->barrier);
+	clock_gettime(CLOCK_MONOTONIC, &ba->start);
+
+	if (ba->locked) {
+		for (i = 0; i < ba->calls; ++i)
+			one_time_init_locked(&bench_control, bench_init);
+	} else {
+		for (i = 0; i < ba->calls; ++i)
+			one_time_init(&bench_control, bench_init);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ba->end);
+	return NULL;
+}
+
+static double
+ns(const struct timespec *ts) {
+	return ts->tv_sec * 1e9 + ts->tv_nsec;
+}
+
+/* the time per call of `threads` threads calling the function `calls` times each:
+ * from the first thread starting to the last one finishing, over all their calls -
+ * so that threads sharing a CPU do not count the time others ran */
+static double
+bench_run(int locked, int threads, long calls) {
+	pthread_barrier_t barrier;
+	pthread_t tids[threads];
+	struct bench_arg args[threads];
+	double first = 0, last = 0;
+	int i, s;
+
+	pthread_barrier_init(&barrier, NULL, threads);
+
+	for (i = 0; i < threads; ++i) {
+		args[i].locked = locked;
+		args[i].calls = calls;
+		args[i].barrier = &barrier;
+
+		s = pthread_create(&tids[i], NULL, bench_thread, &args[i]);
+		if (s != 0)
+			pthread_pexit(s, "pthread_create");
+	}
+
+	for (i = 0; i < threads; ++i) {
+		s = pthread_join(tids[i], NULL);
+		if (s != 0)
+			pthread_pexit(s, "pthread_join");
+
+		if (i == 0 || ns(&args[i].start) < first)
+			first = ns(&args[i].start);
+		if (ns(&args[i].end) > last)
+			last = ns(&args[i].end);
+	}
+
+	pthread_barrier_destroy(&barrier);
+	return (last - first) / ((double) threads * calls);
+}
+
+static void
+benchmark(int maxThreads, long calls) {
+	int threads;
+
+	/* initialized beforehand: the benchmark is of the calls after that */
+	one_time_init(&bench_control, bench_init);
+	one_time_init_locked(&bench_control, bench_init);
+
+	printf("%-8s %18s %18s\n", "threads", "one_time_init", "locked");
+	for (threads = 1; threads <= maxThreads; ++threads) {
+		printf("%-8d %15.2fns %15.2fns\n", threads,
+				bench_run(FALSE, threads, calls), bench_run(TRUE, threads, calls));
+	}
+}
+
 static void
 pexit(const char *fCall) {
 	perror(fCall);
@@ -0,0 +1,179 @@
+/* path_split.c - splits lots of paths into directory and file names.
+ *
+ * The paths, one per line, are read from the given file (or the standard
+ * input) and split with pathSplitBatch (see pathspan.h), a batch at a time:
+ * each name is a span of the input itself, which is read into memory once.
+ * Splitting allocates nothing and copies nothing, no matter how many paths
+ * there are.
+ *
+ * The directory and file names of each path are printed, separated by a tab.
+ * With -q, they are not: only how long splitting took is reported, to measure
+ * it on its own. The paths can be split a number of times (-r), so that it
+ * takes long enough to be measured.
+ *
+ * Usage
+ *
+ *    $ ./path_split [-q] [-r rounds] [file]
+ *
+ *    -q: do not print the names, report the time splitting took.
+ *    -r: the number of times to split the paths, with -q (default: 1).
+ *
+ * Built along with pathspan.c:
+ *
+ *    $ gcc -O2 -o path_split path_split.c pathspan.c
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pathspan.h"
+
+#define BATCH (1024)
+#define READ_CHUNK (1 << 20)
+
+static void helpAndLeave(const char *progname, int status);
+static void pexit(const char *fCall);
+
+/* reads all of `fd`, returning a buffer with what was read, and its size */
+static char *
+readAll(int fd, size_t *size) {
+	size_t capacity = READ_CHUNK, len = 0;
+	ssize_t numRead;
+	char *buf, *p;
+
+	if ((buf = malloc(capacity)) == NULL)
+		pexit("malloc");
+
+	for (;;) {
+		if (len == capacity) {
+			capacity *= 2;
+			if ((p = realloc(buf, capacity)) == NULL)
+				pexit("realloc");
+			buf = p;
+		}
+
+		numRead = read(fd, buf + len, capacity - len);
+		if (numRead == -1) {
+			if (errno == EINTR)
+				continue;
+			pexit("read");
+		}
+
+		if (numRead == 0)
+			break;
+
+		len += numRead;
+	}
+
+	*size = len;
+	return buf;
+}
+
+static void
+printSpan(const char *path, const struct pathSpan *span) {
+	if (span->length == 0)
+		fputc('.', stdout);
+	else
+		fwrite(path + span->offset, 1, span->length, stdout);
+}
+
+int
+main(int argc, char *argv[]) {
+	const char *paths[BATCH];
+	size_t lens[BATCH], size, n, total = 0, i;
+	struct pathSpan dirs[BATCH], bases[BATCH];
+	struct timespec start, end;
+	double elapsed = 0;
+	long rounds = 1, r;
+	int opt, fd = STDIN_FILENO, quiet = 0;
+	char *input, *p, *eol, *inputEnd;
+
+	while ((opt = getopt(argc, argv, "qr:h")) != -1) {
+		switch (opt) {
+		case 'q': quiet = 1; break;
+		case 'r': rounds = atol(optarg); break;
+		case 'h': helpAndLeave(argv[0], EXIT_SUCCESS); break;
+		default: helpAndLeave(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	if (optind < argc - 1 || rounds < 1)
+		helpAndLeave(argv[0], EXIT_FAILURE);
+
+	if (optind == argc - 1 && (fd = open(argv[optind], O_RDONLY)) == -1)
+		pexit("open");
+
+	input = readAll(fd, &size);
+	inputEnd = input + size;
+
+	if (!quiet)
+		rounds = 1;
+
+	for (r = 0; r < rounds; ++r) {
+		p = input;
+
+		while (p < inputEnd) {
+			/* a batch of lines: the paths are not null terminated */
+			for (n = 0; n < BATCH && p < inputEnd; ++n) {
+				eol = memchr(p, '\n', inputEnd - p);
+				if (eol == NULL)
+					eol = inputEnd;
+
+				paths[n] = p;
+				lens[n] = eol - p;
+				p = eol + 1;
+			}
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			pathSplitBatch(paths, lens, n, dirs, bases);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+
+			elapsed += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+			total += n;
+
+			if (quiet)
+				continue;
+
+			for (i = 0; i < n; ++i) {
+				printSpan(paths[i], &dirs[i]);
+				fputc('\t', stdout);
+				printSpan(paths[i], &bases[i]);
+				fputc('\n', stdout);
+			}
+		}
+	}
+
+	if (quiet)
+		printf("%zu paths split in %.3fs: %.1f ns per path, %.1f million paths per second\n",
+				total, elapsed, total ? elapsed * 1e9 / total : 0, total / elapsed / 1e6);
+
+	free(input);
+	exit(EXIT_SUCCESS);
+}
+
+static void
+helpAndLeave(const char *progname, int status) {
+	FILE *stream = stderr;
+
+	if (status == EXIT_SUCCESS)
+		stream = stdout;
+
+	fprintf(stream, "Usage: %s [-q] [-r rounds] [file]\n", progname);
+	exit(status);
+}
+
+static void
+pexit(const char *fCall) {
+	perror(fCall);
+	exit(EXIT_FAILURE);
+}
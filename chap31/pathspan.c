@@ -0,0 +1,108 @@
+/* pathspan.c - splitting paths into directory and file names, without copies.
+ * See pathspan.h.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _GNU_SOURCE /* memrchr */
+
+#include <string.h>
+#include <sys/types.h>
+
+#include "pathspan.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+/* the index of the last slash in the first `n` bytes of `s`, or -1. SSE2 is
+ * always available on x86-64: 16 bytes are compared at a time, from the end */
+static ssize_t
+lastSlash(const char *s, size_t n) {
+	const __m128i slash = _mm_set1_epi8('/');
+	unsigned int mask;
+
+	while (n >= 16) {
+		n -= 16;
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (s + n)), slash));
+		if (mask != 0)
+			return n + 31 - __builtin_clz(mask);
+	}
+
+	while (n > 0) {
+		if (s[--n] == '/')
+			return n;
+	}
+
+	return -1;
+}
+#else
+static ssize_t
+lastSlash(const char *s, size_t n) {
+	const char *p = memrchr(s, '/', n);
+
+	return p ? p - s : -1;
+}
+#endif
+
+static inline void
+setSpan(struct pathSpan *span, size_t offset, size_t length) {
+	if (span != NULL) {
+		span->offset = offset;
+		span->length = length;
+	}
+}
+
+void
+pathSplit(const char *path, size_t len, struct pathSpan *dir, struct pathSpan *base) {
+	size_t end = len, dirEnd;
+	ssize_t slash;
+
+	if (len == 0) {
+		setSpan(dir, 0, 0);
+		setSpan(base, 0, 0);
+		return;
+	}
+
+	/* trailing slashes are not part of the file name */
+	while (end > 1 && path[end - 1] == '/')
+		--end;
+
+	if (end == 1 && path[0] == '/') {
+		setSpan(dir, 0, 1);
+		setSpan(base, 0, 1);
+		return;
+	}
+
+	slash = lastSlash(path, end);
+	setSpan(base, slash + 1, end - (slash + 1));
+
+	if (dir == NULL)
+		return;
+
+	if (slash == -1) {
+		setSpan(dir, 0, 0);
+		return;
+	}
+
+	/* nor are the slashes between the directory and the file */
+	dirEnd = slash;
+	while (dirEnd > 0 && path[dirEnd - 1] == '/')
+		--dirEnd;
+
+	setSpan(dir, 0, (dirEnd == 0) ? 1 : dirEnd);
+}
+
+void
+pathSplitBatch(const char *const paths[], const size_t lens[], size_t n,
+		struct pathSpan dirs[], struct pathSpan bases[]) {
+	size_t i;
+
+	for (i = 0; i < n; ++i) {
+		/* the next path is likely elsewhere in memory: have it loaded meanwhile */
+		if (i + 1 < n)
+			__builtin_prefetch(paths[i + 1]);
+
+		pathSplit(paths[i], lens ? lens[i] : strlen(paths[i]),
+				dirs ? &dirs[i] : NULL, bases ? &bases[i] : NULL);
+	}
+}
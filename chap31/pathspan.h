@@ -0,0 +1,53 @@
+/* pathspan.h - splitting paths into directory and file names, without copies.
+ *
+ * basename_r.c and dirname_r.c return copies of the names in a buffer of each
+ * thread, one path at a time. Programs splitting lots of paths (log processors,
+ * say) pay for a copy of each name, and usually only want to look at it.
+ *
+ * The functions here return the names as spans instead: the offset and length
+ * of the name in the path given, which is left untouched - splitting allocates
+ * nothing, copies nothing, and is reentrant. The names are those basename(3)
+ * and dirname(3) return:
+ *
+ *    path         dirname    basename
+ *    "/usr/lib"   "/usr"     "lib"
+ *    "/usr/"      "/"        "usr"
+ *    "usr"        "."        "usr"
+ *    "/"          "/"        "/"
+ *    ""           "."        "."
+ *
+ * "." is not in the path, when it is the answer: it is returned as a span of
+ * length zero (no other name is empty). Leading slashes are one: the dirname of
+ * "//a" is "/" (glibc makes it "//", which POSIX leaves up to implementations).
+ *
+ * Looking for the last slash, the costliest part, is vectorized on x86-64.
+ *
+ * Programs using it are built along with pathspan.c:
+ *
+ *    $ gcc -O2 -o path_split path_split.c pathspan.c
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#ifndef PATHSPAN_H
+#define PATHSPAN_H
+
+#include <stddef.h>
+
+/* a name in a path: path[offset] to path[offset + length - 1]. "." if empty */
+struct pathSpan {
+	size_t offset;
+	size_t length;
+};
+
+/* the directory and file names of the `len` bytes of `path`. Either span can
+ * be NULL, if not wanted */
+void pathSplit(const char *path, size_t len, struct pathSpan *dir, struct pathSpan *base);
+
+/* splits `n` paths, as pathSplit would, into `dirs[i]` and `bases[i]` (either
+ * array can be NULL). `lens` are the lengths of the paths, or NULL if they are
+ * null terminated */
+void pathSplitBatch(const char *const paths[], const size_t lens[], size_t n,
+		struct pathSpan dirs[], struct pathSpan bases[]);
+
+#endif
@@ -19,21 +19,51 @@
  * defined, then cancelation test is not performed, and the Fibonacci thread
  * will not be canceled even if a request is sent.
  *
+ * With -p, the number is calculated in parallel instead - the naive recursive
+ * way, so that there is plenty to parallelize - on a pool of worker threads
+ * (see taskpool.h). Each call spawns the calculation of fib(n - 1) as a task,
+ * calculates fib(n - 2) itself and joins the task; below the cutoff (-c), the
+ * calculation is sequential. The same recursion is run on a single thread first,
+ * and the time of both, the speedup and how many tasks were stolen are reported.
+ *
+ * Cancelling a thread would not do there: the calculation is a tree of tasks
+ * run by all the workers. With -t, the whole tree is cancelled after the given
+ * number of milliseconds instead, cooperatively: tasks not yet started are
+ * dropped, and sequential calculations check for cancellation every now and
+ * then. The time between the cancellation and the pool returning is reported.
+ *
  * Usage
  *
- *    $ ./fib_cancel <n>
+ *    $ ./fib_cancel [-p workers] [-c cutoff] [-t cancel_after_ms] <n>
  *
  *    n - makes the program create a thread that calculates the nth Fibonacci number.
+ *    -p: calculate it in parallel, on this number of worker threads.
+ *    -c: with -p, the n below which calculations are sequential (default: 25).
+ *    -t: with -p, cancel the calculation after this many milliseconds.
+ *
+ * Built along with the task pool:
+ *
+ *    $ gcc -O2 -o fib_cancel fib_cancel.c taskpool.c -pthread
  *
  * Author: Renato Mascarenhas Costa
  */
 
 #include <pthread.h>
+#include <unistd.h>
 #include <errno.h>
+#include <time.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "taskpool.h"
+
+#define DEFAULT_CUTOFF (25)
+
+/* sequential calculations check for cancellation for n from this up: often
+ * enough, as fib(CANCEL_CHECK_N) takes microseconds */
+#define CANCEL_CHECK_N (16)
+
 static void helpAndLeave(const char *progname, int status);
 static void pexit(const char *fCall);
 static void pthread_pexit(int err, const char *fCall);
@@ -44,18 +74,37 @@ static pthread_t worker, ui;
 
 static void *calculate_fib(void *arg);
 static void *ask_cancelation(void *arg);
+static void calculate_fib_parallel(long n, int workers, long cutoff, long cancelAfter);
 
 int
 main(int argc, char *argv[]) {
-	if (argc != 2)
+	int opt, workers = 0;
+	long cutoff = DEFAULT_CUTOFF, cancelAfter = -1;
+
+	while ((opt = getopt(argc, argv, "p:c:t:h")) != -1) {
+		switch (opt) {
+		case 'p': workers = atoi(optarg); break;
+		case 'c': cutoff = atol(optarg); break;
+		case 't': cancelAfter = atol(optarg); break;
+		case 'h': helpAndLeave(argv[0], EXIT_SUCCESS); break;
+		default: helpAndLeave(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	if (optind != argc - 1 || workers < 0 || cutoff < 2)
 		helpAndLeave(argv[0], EXIT_FAILURE);
 
 	long n;
-	n = strtol(argv[1], NULL, 10);
+	n = strtol(argv[optind], NULL, 10);
 
 	if (n < 0)
 		helpAndLeave(argv[0], EXIT_FAILURE);
 
+	if (workers > 0) {
+		calculate_fib_parallel(n, workers, cutoff, cancelAfter);
+		exit(EXIT_SUCCESS);
+	}
+
 	int s;
 	void *res;
 
@@ -138,6 +187,138 @@ calculate_fib(void *arg) {
 	return res;
 }
 
+struct fibTask {
+	struct task task;
+	long n;
+	unsigned long long result;
+};
+
+static long cutoff;
+
+static struct taskPool pool;
+static double cancelledAt;
+
+static double
+now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the sequential recursion. Returns 0 once cancelled: nobody reads the result */
+static unsigned long long
+fib(long n) {
+	if (n < 2)
+		return n;
+
+	if (n >= CANCEL_CHECK_N && taskCancelled())
+		return 0;
+
+	return fib(n - 1) + fib(n - 2);
+}
+
+static void
+fib_task(__attribute__((unused)) struct task *task, void *arg) {
+	struct fibTask *ft = arg, left, right;
+
+	if (ft->n < cutoff) {
+		ft->result = fib(ft->n);
+		return;
+	}
+
+	if (taskCancelled())
+		return;
+
+	left.n = ft->n - 1;
+	taskInit(&left.task, fib_task, &left);
+	taskSpawn(&left.task);
+
+	right.n = ft->n - 2;
+	fib_task(&right.task, &right);
+
+	taskJoin(&left.task);
+	ft->result = left.result + right.result;
+}
+
+static void *
+cancel_after(void *arg) {
+	long ms = *((long *) arg);
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+
+	nanosleep(&ts, NULL);
+
+	cancelledAt = now();
+	taskPoolCancel(&pool);
+
+	return NULL;
+}
+
+static void
+calculate_fib_parallel(long n, int workers, long c, long cancelAfter) {
+	struct fibTask root;
+	pthread_t canceller;
+	unsigned long long res;
+	double start, seqTime = 0, parTime, end;
+	long steals = 0, inlined = 0;
+	int i, s;
+
+	cutoff = c;
+
+	/* no task pool here: taskCancelled() is always false */
+	if (cancelAfter < 0) {
+		start = now();
+		res = fib(n);
+		seqTime = now() - start;
+		printf("sequential: fib(%ld) = %llu in %.3fs\n", n, res, seqTime);
+	}
+
+	if (taskPoolInit(&pool, workers) == -1)
+		pexit("taskPoolInit");
+
+	if (cancelAfter >= 0) {
+		s = pthread_create(&canceller, NULL, cancel_after, &cancelAfter);
+		if (s != 0)
+			pthread_pexit(s, "pthread_create");
+	}
+
+	root.n = n;
+	taskInit(&root.task, fib_task, &root);
+
+	start = now();
+	s = taskPoolRun(&pool, &root.task);
+	end = now();
+	parTime = end - start;
+
+	if (s == -1 && errno != ECANCELED)
+		pexit("taskPoolRun");
+
+	if (cancelAfter >= 0) {
+		s = pthread_join(canceller, NULL);
+		if (s != 0)
+			pthread_pexit(s, "pthread_join");
+	}
+
+	for (i = 0; i < pool.nworkers; ++i) {
+		steals += pool.workers[i].steals;
+		inlined += pool.workers[i].inlined;
+	}
+
+	if (cancelAfter >= 0 && cancelledAt < end)
+		printf("parallel (%d workers, cutoff %ld): cancelled after %.3fs, stopped %.3fms after the request\n",
+				workers, cutoff, parTime, (end - cancelledAt) * 1e3);
+	else
+		printf("parallel (%d workers, cutoff %ld): fib(%ld) = %llu in %.3fs\n",
+				workers, cutoff, n, root.result, parTime);
+
+	if (cancelAfter < 0)
+		printf("speedup: %.2fx\n", seqTime / parTime);
+
+	printf("tasks stolen: %ld, run when spawned (deque full): %ld\n", steals, inlined);
+
+	taskPoolDestroy(&pool);
+}
+
 static void
 helpAndLeave(const char *progname, int status) {
 	FILE *stream = stderr;
@@ -145,7 +326,7 @@ helpAndLeave(const char *progname, int status) {
 	if (status == EXIT_SUCCESS)
 		stream = stdout;
 
-	fprintf(stream, "Usage: %s <n>\n", progname);
+	fprintf(stream, "Usage: %s [-p workers] [-c cutoff] [-t cancel_after_ms] <n>\n", progname);
 	exit(status);
 }
 
@@ -0,0 +1,317 @@
+/* taskpool.c - A fork/join pool of worker threads, with work stealing.
+ * See taskpool.h.
+ *
+ * The deques follow "Correct and Efficient Work-Stealing for Weak Memory
+ * Models" (Lê, Pop, Cohen and Zappa Nardelli, 2013), with a fixed size.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _GNU_SOURCE /* sched_yield */
+
+#include <sched.h>
+#include <errno.h>
+#include <time.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "taskpool.h"
+
+/* failed attempts to find a task before a worker starts sleeping between them */
+#define SPINS (64)
+#define IDLE_SLEEP_NS (50000)
+
+/* the worker the calling thread is, if any */
+static __thread struct taskWorker *self;
+
+/* pushes a task at the bottom of the deque. Returns -1 if it is full */
+static int
+push(struct taskDeque *deque, struct task *task) {
+	long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED),
+	     top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+
+	if (bottom - top >= TASKPOOL_DEQUE_SIZE)
+		return -1;
+
+	__atomic_store_n(&deque->tasks[bottom % TASKPOOL_DEQUE_SIZE], task, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/* pops the task at the bottom of the deque, racing thieves for the last one */
+static struct task *
+pop(struct taskDeque *deque) {
+	long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1, top;
+	struct task *task = NULL;
+
+	__atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+	if (top <= bottom) {
+		task = __atomic_load_n(&deque->tasks[bottom % TASKPOOL_DEQUE_SIZE], __ATOMIC_RELAXED);
+
+		if (top == bottom) {
+			if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+						__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+				task = NULL; /* a thief got it */
+
+			__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+		}
+	} else {
+		__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+	}
+
+	return task;
+}
+
+/* steals the task at the top of the deque. NULL if it is empty, or another
+ * thief (or the owner) took the task first */
+static struct task *
+steal(struct taskDeque *deque) {
+	long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE), bottom;
+	struct task *task;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+	if (top >= bottom)
+		return NULL;
+
+	task = __atomic_load_n(&deque->tasks[top % TASKPOOL_DEQUE_SIZE], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+
+	return task;
+}
+
+/* tasks of a cancelled computation are not run, just marked as done, so that
+ * whoever joins them carries on */
+static void
+run(struct taskWorker *worker, struct task *task) {
+	if (!__atomic_load_n(&worker->pool->cancelled, __ATOMIC_RELAXED))
+		task->fn(task, task->arg);
+
+	__atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+}
+
+/* a task from the deque of another worker, starting from a random one */
+static struct task *
+stealAny(struct taskWorker *worker) {
+	struct taskPool *pool = worker->pool;
+	struct task *task;
+	int i, victim;
+
+	if (pool->nworkers == 1)
+		return NULL;
+
+	victim = rand_r(&worker->seed) % pool->nworkers;
+	for (i = 0; i < pool->nworkers; ++i, victim = (victim + 1) % pool->nworkers) {
+		if (&pool->workers[victim] == worker)
+			continue;
+
+		if ((task = steal(&pool->workers[victim].deque)) != NULL) {
+			++worker->steals;
+			return task;
+		}
+	}
+
+	return NULL;
+}
+
+static void
+idle(int *spins) {
+	struct timespec ts = { 0, IDLE_SLEEP_NS };
+
+	if (++*spins < SPINS)
+		sched_yield();
+	else
+		nanosleep(&ts, NULL);
+}
+
+static void *
+work(void *arg) {
+	struct taskWorker *worker = arg;
+	struct taskPool *pool = worker->pool;
+	struct task *task, *root;
+	int spins;
+
+	self = worker;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->active && !pool->shutdown)
+			pthread_cond_wait(&pool->wake, &pool->lock);
+
+		if (pool->shutdown)
+			break;
+
+		pthread_mutex_unlock(&pool->lock);
+
+		spins = 0;
+		while (__atomic_load_n(&pool->active, __ATOMIC_ACQUIRE)) {
+			/* the first worker to take the root runs the computation */
+			root = __atomic_exchange_n(&pool->root, NULL, __ATOMIC_ACQ_REL);
+			if (root != NULL) {
+				run(worker, root);
+
+				pthread_mutex_lock(&pool->lock);
+				__atomic_store_n(&pool->active, 0, __ATOMIC_RELEASE);
+				pthread_cond_broadcast(&pool->finished);
+				pthread_mutex_unlock(&pool->lock);
+				break;
+			}
+
+			task = stealAny(worker);
+			if (task != NULL) {
+				run(worker, task);
+				spins = 0;
+			} else {
+				idle(&spins);
+			}
+		}
+
+		pthread_mutex_lock(&pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+int
+taskPoolInit(struct taskPool *pool, int workers) {
+	int i, s;
+
+	if (workers < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* aligned, so that the tops and bottoms of deques are in lines of their own */
+	s = posix_memalign((void **) &pool->workers, TASKPOOL_CACHE_LINE, workers * sizeof(struct taskWorker));
+	if (s != 0) {
+		errno = s;
+		return -1;
+	}
+
+	memset(pool->workers, 0, workers * sizeof(struct taskWorker));
+	pool->nworkers = workers;
+	pool->root = NULL;
+	pool->active = pool->cancelled = pool->shutdown = 0;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pthread_cond_init(&pool->finished, NULL);
+
+	for (i = 0; i < workers; ++i) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].seed = i + 1;
+
+		s = pthread_create(&pool->workers[i].thread, NULL, work, &pool->workers[i]);
+		if (s != 0) {
+			pool->nworkers = i;
+			taskPoolDestroy(pool);
+			errno = s;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void
+taskPoolDestroy(struct taskPool *pool) {
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nworkers; ++i)
+		pthread_join(pool->workers[i].thread, NULL);
+
+	pthread_cond_destroy(&pool->finished);
+	pthread_cond_destroy(&pool->wake);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->workers);
+}
+
+int
+taskPoolRun(struct taskPool *pool, struct task *root) {
+	int cancelled;
+
+	pthread_mutex_lock(&pool->lock);
+
+	root->done = 0;
+	__atomic_store_n(&pool->cancelled, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&pool->root, root, __ATOMIC_RELEASE);
+	__atomic_store_n(&pool->active, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&pool->wake);
+
+	while (__atomic_load_n(&pool->active, __ATOMIC_ACQUIRE))
+		pthread_cond_wait(&pool->finished, &pool->lock);
+
+	cancelled = pool->cancelled;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (cancelled) {
+		errno = ECANCELED;
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+taskPoolCancel(struct taskPool *pool) {
+	__atomic_store_n(&pool->cancelled, 1, __ATOMIC_RELAXED);
+}
+
+void
+taskInit(struct task *task, taskFn fn, void *arg) {
+	task->fn = fn;
+	task->arg = arg;
+	task->done = 0;
+}
+
+void
+taskSpawn(struct task *task) {
+	task->done = 0;
+
+	/* no room: run it now, which is what joining it would do anyway */
+	if (push(&self->deque, task) == -1) {
+		++self->inlined;
+		run(self, task);
+	}
+}
+
+void
+taskJoin(struct task *task) {
+	struct taskWorker *worker = self;
+	struct task *other;
+	int spins = 0;
+
+	/* the task is at the bottom of our deque, unless it was stolen: everything
+	 * spawned after it was joined already */
+	while (!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE)) {
+		other = pop(&worker->deque);
+		if (other == NULL)
+			other = stealAny(worker);
+
+		if (other != NULL) {
+			run(worker, other);
+			spins = 0;
+		} else {
+			idle(&spins);
+		}
+	}
+}
+
+int
+taskCancelled(void) {
+	return self != NULL && __atomic_load_n(&self->pool->cancelled, __ATOMIC_RELAXED);
+}
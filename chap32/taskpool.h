@@ -0,0 +1,118 @@
+/* taskpool.h - A fork/join pool of worker threads, with work stealing.
+ *
+ * CPU bound computations that split into independent parts - recursive ones
+ * especially - can use all the CPUs by running the parts as tasks on a fixed
+ * number of worker threads. A task spawns the parts it is made of as tasks of
+ * their own, carries on with some work, and joins them: waits until they are
+ * done, to combine their results.
+ *
+ * Each worker keeps the tasks it spawns in a double-ended queue of its own (a
+ * Chase-Lev deque): it pushes and pops them at the bottom, with no lock, while
+ * workers with nothing to do steal from the top of the deques of others. A task
+ * stolen is therefore one of the oldest - usually a large part of the work -
+ * and stealing, the only time workers contend, is rare. A worker waiting in
+ * `taskJoin` does not sleep: it runs the tasks of its own deque, or steals some,
+ * until the one it waits for is done.
+ *
+ * Spawning a task costs a few stores, but that is still more than small enough
+ * tasks are worth: computations should stop spawning below a certain size (a
+ * sequential cutoff), and compute the rest in the task itself.
+ *
+ * A computation (the tree of all the tasks spawned from the root task given to
+ * `taskPoolRun`) can be cancelled from any thread with `taskPoolCancel`. It is
+ * cooperative: tasks not started yet are never run, and long running ones
+ * should check `taskCancelled` every now and then, and return early if it is
+ * set - without their result, which nobody will read.
+ *
+ * Tasks must join every task they spawn before returning. `taskSpawn`,
+ * `taskJoin` and `taskCancelled` may only be called by tasks.
+ *
+ * Programs using it are built along with taskpool.c, and linked with -pthread:
+ *
+ *    $ gcc -O2 -o fib_cancel fib_cancel.c taskpool.c -pthread
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#ifndef TASKPOOL_H
+#define TASKPOOL_H
+
+#include <pthread.h>
+
+/* tasks each worker can have spawned and not yet joined: more are run as
+ * soon as they are spawned */
+#define TASKPOOL_DEQUE_SIZE (4096)
+
+#define TASKPOOL_CACHE_LINE (64)
+
+struct task;
+typedef void (*taskFn)(struct task *task, void *arg);
+
+/* a task, usually embedded in the structure with its arguments and result */
+struct task {
+	taskFn fn;
+	void *arg;
+	int done;
+};
+
+/* the deque of a worker. The top is only moved by thieves (and by the owner,
+ * taking the last task), and the bottom only by the owner: they are kept in
+ * separate cache lines */
+struct taskDeque {
+	long top __attribute__((aligned(TASKPOOL_CACHE_LINE)));
+	long bottom __attribute__((aligned(TASKPOOL_CACHE_LINE)));
+	struct task *tasks[TASKPOOL_DEQUE_SIZE];
+};
+
+struct taskWorker {
+	struct taskPool *pool;
+	pthread_t thread;
+	unsigned int seed;      /* to choose whom to steal from */
+	long steals;            /* tasks stolen from others */
+	long inlined;           /* tasks run when spawned, with the deque full */
+
+	struct taskDeque deque;
+};
+
+struct taskPool {
+	struct taskWorker *workers;
+	int nworkers;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wake;     /* a computation started, or the pool is destroyed */
+	pthread_cond_t finished; /* the computation is over */
+
+	struct task *root;       /* until a worker takes it */
+	int active;              /* a computation is running */
+	int cancelled;
+	int shutdown;
+};
+
+/* starts a pool of `workers` threads. Returns -1 on errors, with `errno` set */
+int taskPoolInit(struct taskPool *pool, int workers);
+
+/* stops the workers of a pool, which must not be running a computation */
+void taskPoolDestroy(struct taskPool *pool);
+
+/* runs `root`, and all the tasks it spawns, on the pool, returning once they
+ * are done. Returns -1 with `errno` set to ECANCELED if the computation was
+ * cancelled. One computation runs at a time */
+int taskPoolRun(struct taskPool *pool, struct task *root);
+
+/* cancels the computation running, if any. Safe to call from any thread */
+void taskPoolCancel(struct taskPool *pool);
+
+/* initializes a task that calls `fn` with `arg` */
+void taskInit(struct task *task, taskFn fn, void *arg);
+
+/* makes `task` available to run - by this worker, or by another one */
+void taskSpawn(struct task *task);
+
+/* returns once `task`, spawned by the caller, is done - running other tasks
+ * meanwhile */
+void taskJoin(struct task *task);
+
+/* whether the computation of the calling task was cancelled */
+int taskCancelled(void);
+
+#endif
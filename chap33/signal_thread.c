@@ -0,0 +1,263 @@
+/* signal_thread.c - compares signal handlers with a signal handling thread.
+ *
+ * A number of worker threads sleep for a millisecond at a time, over and over,
+ * as threads waiting for work in a system call would, while another thread
+ * sends the process a storm of real-time signals (SIGRTMIN, which are queued
+ * rather than merged: every one is delivered) and creates children that
+ * terminate right away - each one sending a SIGCHLD.
+ *
+ * By default, the signals are read by a dedicated thread (see sigthread.h),
+ * which reaps the children and counts the signals, with all signals blocked in
+ * the workers. With -H, they are delivered to handlers instead, the way
+ * fork_sigchld.c does: each interrupts an arbitrary thread - often a worker,
+ * whose nanosleep(2) then fails with EINTR.
+ *
+ * The number of times workers were interrupted is reported, along with the
+ * signals handled and, with the signal handling thread, how many of them it
+ * read per wakeup.
+ *
+ * Usage
+ *
+ *    $ ./signal_thread [-H] [-w workers] [-s signals] [-c children]
+ *
+ *    -H: handle signals with signal handlers.
+ *    -w: the number of worker threads (default: 4).
+ *    -s: the number of SIGRTMIN sent (default: 100000).
+ *    -c: the number of children created (default: 100).
+ *
+ * Built along with sigthread.c:
+ *
+ *    $ gcc -o signal_thread signal_thread.c sigthread.c -pthread
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/wait.h>
+#include <signal.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sigthread.h"
+
+#define DEFAULT_WORKERS (4)
+#define DEFAULT_SIGNALS (100000)
+#define DEFAULT_CHILDREN (100)
+
+static void helpAndLeave(const char *progname, int status);
+static void pexit(const char *fCall);
+static void pthread_pexit(int err, const char *fCall);
+
+/* with -H, handlers may run in several threads at once: the counts are only
+ * updated and read with (lock free, so async-signal-safe) atomic builtins */
+static int rtCount, chldCount, reaped;
+static int running = 1;
+
+static long numSignals = DEFAULT_SIGNALS, numChildren = DEFAULT_CHILDREN;
+
+/* reaps every child terminated */
+static void
+reap(void) {
+	int savedErrno = errno;
+
+	while (waitpid(-1, NULL, WNOHANG) > 0)
+		__atomic_fetch_add(&reaped, 1, __ATOMIC_RELAXED);
+
+	errno = savedErrno;
+}
+
+static void
+rt_handler(__attribute__((unused)) int sig) {
+	__atomic_fetch_add(&rtCount, 1, __ATOMIC_RELAXED);
+}
+
+static void
+chld_handler(__attribute__((unused)) int sig) {
+	__atomic_fetch_add(&chldCount, 1, __ATOMIC_RELAXED);
+	reap();
+}
+
+/* called by the signal handling thread: no restriction on what they do */
+static void
+on_rt(__attribute__((unused)) const struct signalfd_siginfo *info, __attribute__((unused)) void *arg) {
+	__atomic_fetch_add(&rtCount, 1, __ATOMIC_RELAXED);
+}
+
+static void
+on_chld(__attribute__((unused)) const struct signalfd_siginfo *info, __attribute__((unused)) void *arg) {
+	__atomic_fetch_add(&chldCount, 1, __ATOMIC_RELAXED);
+	reap();
+}
+
+static void *
+work(void *arg) {
+	long *interrupted = arg;
+	struct timespec ms = { 0, 1000000 };
+
+	while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+		if (nanosleep(&ms, NULL) == -1 && errno == EINTR)
+			++*interrupted;
+	}
+
+	return NULL;
+}
+
+static void *
+send_signals(__attribute__((unused)) void *arg) {
+	union sigval sv;
+	long i, every;
+
+	every = numChildren ? numSignals / numChildren : 0;
+
+	for (i = 0; i < numSignals; ++i) {
+		/* the queue is limited by RLIMIT_SIGPENDING: wait for it to drain */
+		sv.sival_int = i;
+		while (sigqueue(getpid(), SIGRTMIN, sv) == -1) {
+			if (errno != EAGAIN)
+				pexit("sigqueue");
+			sched_yield();
+		}
+
+		if (every && i % every == 0) {
+			switch (fork()) {
+				case -1:
+					pexit("fork");
+					break;
+
+				case 0:
+					_exit(EXIT_SUCCESS);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+int
+main(int argc, char *argv[]) {
+	struct sigThread st;
+	struct sigaction act;
+	pthread_t *workers, sender;
+	long *interrupted, totalInterrupted = 0;
+	int opt, handlers = 0, numWorkers = DEFAULT_WORKERS, i, s;
+
+	while ((opt = getopt(argc, argv, "Hw:s:c:h")) != -1) {
+		switch (opt) {
+			case 'H': handlers = 1; break;
+			case 'w': numWorkers = atoi(optarg); break;
+			case 's': numSignals = atol(optarg); break;
+			case 'c': numChildren = atol(optarg); break;
+			case 'h': helpAndLeave(argv[0], EXIT_SUCCESS); break;
+			default: helpAndLeave(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	if (optind != argc || numWorkers < 1 || numSignals < 1 || numChildren < 0 || numChildren > numSignals)
+		helpAndLeave(argv[0], EXIT_FAILURE);
+
+	if (handlers) {
+		/* no SA_RESTART: system calls interrupted fail with EINTR */
+		memset(&act, 0, sizeof(struct sigaction));
+		sigemptyset(&act.sa_mask);
+
+		act.sa_handler = rt_handler;
+		if (sigaction(SIGRTMIN, &act, NULL) == -1)
+			pexit("sigaction");
+
+		act.sa_handler = chld_handler;
+		if (sigaction(SIGCHLD, &act, NULL) == -1)
+			pexit("sigaction");
+	} else {
+		/* before any thread is created, so that all of them block signals */
+		if (sigThreadBlockAll(NULL) == -1)
+			pexit("sigThreadBlockAll");
+
+		if (sigThreadStart(&st) == -1)
+			pexit("sigThreadStart");
+
+		if (sigThreadRegister(&st, SIGRTMIN, on_rt, NULL) == -1 ||
+		    sigThreadRegister(&st, SIGCHLD, on_chld, NULL) == -1)
+			pexit("sigThreadRegister");
+	}
+
+	workers = malloc(numWorkers * sizeof(pthread_t));
+	interrupted = calloc(numWorkers, sizeof(long));
+	if (!workers || !interrupted)
+		pexit("malloc");
+
+	for (i = 0; i < numWorkers; ++i) {
+		s = pthread_create(&workers[i], NULL, work, &interrupted[i]);
+		if (s != 0)
+			pthread_pexit(s, "pthread_create");
+	}
+
+	s = pthread_create(&sender, NULL, send_signals, NULL);
+	if (s != 0)
+		pthread_pexit(s, "pthread_create");
+
+	s = pthread_join(sender, NULL);
+	if (s != 0)
+		pthread_pexit(s, "pthread_join");
+
+	/* wait for the last signals, and children, to arrive */
+	while (__atomic_load_n(&rtCount, __ATOMIC_RELAXED) < numSignals ||
+			__atomic_load_n(&reaped, __ATOMIC_RELAXED) < numChildren)
+		usleep(1000);
+
+	__atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+	for (i = 0; i < numWorkers; ++i) {
+		s = pthread_join(workers[i], NULL);
+		if (s != 0)
+			pthread_pexit(s, "pthread_join");
+
+		totalInterrupted += interrupted[i];
+	}
+
+	if (!handlers)
+		sigThreadStop(&st);
+
+	printf("%s: %ld SIGRTMIN sent, %d handled; %ld children, %d SIGCHLD handled\n",
+			handlers ? "signal handlers" : "signal thread",
+			numSignals, __atomic_load_n(&rtCount, __ATOMIC_RELAXED),
+			numChildren, __atomic_load_n(&chldCount, __ATOMIC_RELAXED));
+	printf("workers interrupted: %ld\n", totalInterrupted);
+
+	if (!handlers)
+		printf("signal thread: %ld signals in %ld reads (%.1f per read)\n",
+				st.signals, st.reads, st.reads ? (double) st.signals / st.reads : 0);
+
+	free(workers);
+	free(interrupted);
+	exit(EXIT_SUCCESS);
+}
+
+static void
+helpAndLeave(const char *progname, int status) {
+	FILE *stream = stderr;
+
+	if (status == EXIT_SUCCESS)
+		stream = stdout;
+
+	fprintf(stream, "Usage: %s [-H] [-w workers] [-s signals] [-c children]\n", progname);
+	exit(status);
+}
+
+static void
+pexit(const char *fCall) {
+	perror(fCall);
+	exit(EXIT_FAILURE);
+}
+
+static void
+pthread_pexit(int err, const char *fCall) {
+	errno = err;
+	pexit(fCall);
+}
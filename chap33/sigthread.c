@@ -0,0 +1,199 @@
+/* sigthread.c - A thread dedicated to handling the signals of a process.
+ * See sigthread.h.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "sigthread.h"
+
+static int
+synchronous(int sig) {
+	return sig == SIGSEGV || sig == SIGBUS || sig == SIGFPE ||
+	       sig == SIGILL || sig == SIGTRAP || sig == SIGSYS;
+}
+
+/* reads pending signals in batches, calling the function registered for each,
+ * until the eventfd is written */
+static void *
+dispatch(void *arg) {
+	struct sigThread *st = arg;
+	struct signalfd_siginfo infos[SIGTHREAD_BATCH];
+	sigThreadFn fns[SIGTHREAD_BATCH];
+	void *args[SIGTHREAD_BATCH];
+	struct pollfd fds[2];
+	ssize_t numRead;
+	int i, n;
+
+	fds[0].fd = st->sfd;
+	fds[0].events = POLLIN;
+	fds[1].fd = st->efd;
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(fds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (fds[1].revents & POLLIN)
+			break;
+
+		if (!(fds[0].revents & POLLIN))
+			continue;
+
+		/* the signalfd is non-blocking: the signal may have been taken by
+		 * sigwait(3) elsewhere, or its registration removed meanwhile */
+		numRead = read(st->sfd, infos, sizeof(infos));
+		if (numRead == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			break;
+		}
+
+		n = numRead / sizeof(struct signalfd_siginfo);
+
+		/* handlers are called with the lock released, so that they can
+		 * register signals too */
+		pthread_mutex_lock(&st->lock);
+		for (i = 0; i < n; ++i) {
+			fns[i] = st->handlers[infos[i].ssi_signo].fn;
+			args[i] = st->handlers[infos[i].ssi_signo].arg;
+		}
+		++st->reads;
+		st->signals += n;
+		pthread_mutex_unlock(&st->lock);
+
+		for (i = 0; i < n; ++i) {
+			if (fns[i] != NULL)
+				fns[i](&infos[i], args[i]);
+		}
+	}
+
+	return NULL;
+}
+
+int
+sigThreadBlockAll(sigset_t *old) {
+	sigset_t mask;
+	int s, sig;
+
+	sigfillset(&mask);
+	for (sig = 1; sig < NSIG; ++sig) {
+		if (synchronous(sig))
+			sigdelset(&mask, sig);
+	}
+
+	s = pthread_sigmask(SIG_BLOCK, &mask, old);
+	if (s != 0) {
+		errno = s;
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+sigThreadStart(struct sigThread *st) {
+	int s;
+
+	memset(st->handlers, 0, sizeof(st->handlers));
+	st->reads = st->signals = 0;
+	sigemptyset(&st->mask);
+
+	st->sfd = signalfd(-1, &st->mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (st->sfd == -1)
+		return -1;
+
+	st->efd = eventfd(0, EFD_CLOEXEC);
+	if (st->efd == -1) {
+		close(st->sfd);
+		return -1;
+	}
+
+	pthread_mutex_init(&st->lock, NULL);
+
+	s = pthread_create(&st->thread, NULL, dispatch, st);
+	if (s != 0) {
+		pthread_mutex_destroy(&st->lock);
+		close(st->efd);
+		close(st->sfd);
+		errno = s;
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+sigThreadStop(struct sigThread *st) {
+	uint64_t one = 1;
+
+	if (write(st->efd, &one, sizeof(one)) == sizeof(one))
+		pthread_join(st->thread, NULL);
+
+	pthread_mutex_destroy(&st->lock);
+	close(st->efd);
+	close(st->sfd);
+}
+
+int
+sigThreadRegister(struct sigThread *st, int sig, sigThreadFn fn, void *arg) {
+	int ret = 0;
+
+	/* signalfd(2) cannot read these */
+	if (sig < 1 || sig >= NSIG || sig == SIGKILL || sig == SIGSTOP || fn == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&st->lock);
+
+	st->handlers[sig].fn = fn;
+	st->handlers[sig].arg = arg;
+
+	if (!sigismember(&st->mask, sig)) {
+		sigaddset(&st->mask, sig);
+		if (signalfd(st->sfd, &st->mask, 0) == -1) {
+			sigdelset(&st->mask, sig);
+			st->handlers[sig].fn = NULL;
+			ret = -1;
+		}
+	}
+
+	pthread_mutex_unlock(&st->lock);
+	return ret;
+}
+
+int
+sigThreadUnregister(struct sigThread *st, int sig) {
+	int ret = 0;
+
+	if (sig < 1 || sig >= NSIG) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&st->lock);
+
+	st->handlers[sig].fn = NULL;
+	st->handlers[sig].arg = NULL;
+
+	sigdelset(&st->mask, sig);
+	if (signalfd(st->sfd, &st->mask, 0) == -1)
+		ret = -1;
+
+	pthread_mutex_unlock(&st->lock);
+	return ret;
+}
@@ -0,0 +1,82 @@
+/* sigthread.h - A thread dedicated to handling the signals of a process.
+ *
+ * thread_pending_signals.c and fork_sigchld.c show that a signal sent to a
+ * process is handled by whichever of its threads does not block it - any of
+ * them. In a program whose threads are busy serving requests, that means a
+ * handler can interrupt any of them, at any time: in the middle of its hot loop,
+ * or in a system call, which then fails with EINTR and has to be restarted.
+ * Handlers are also limited to async-signal-safe functions.
+ *
+ * Here, asynchronous signals are blocked in every thread instead, and read by a
+ * single dispatcher thread from a signalfd(2). The dispatcher calls the function
+ * registered for each signal it reads, as a regular function: it may take locks,
+ * allocate memory or print. Workers are never interrupted. The dispatcher reads
+ * as many signals as are pending at every wakeup, up to SIGTHREAD_BATCH, so a
+ * burst of signals costs a few reads.
+ *
+ * `sigThreadBlockAll` must be called before any thread is created, as threads
+ * inherit the signal mask of their creator: a thread that does not block a
+ * signal would still have it delivered to a handler (or its default action)
+ * instead. Synchronous signals (SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGTRAP and
+ * SIGSYS), raised by the thread that caused them, are not blocked.
+ *
+ * As with signals delivered to handlers, standard signals sent while one of the
+ * same number is pending are merged: each read tells about one of them.
+ *
+ * Programs using it are built along with sigthread.c, and linked with -pthread:
+ *
+ *    $ gcc -o signal_thread signal_thread.c sigthread.c -pthread
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#ifndef SIGTHREAD_H
+#define SIGTHREAD_H
+
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <pthread.h>
+
+/* signals read from the signalfd at a time */
+#define SIGTHREAD_BATCH (64)
+
+typedef void (*sigThreadFn)(const struct signalfd_siginfo *info, void *arg);
+
+struct sigThread {
+	pthread_t thread;
+	int sfd;                /* the signalfd, for the signals registered */
+	int efd;                /* an eventfd, to stop the dispatcher */
+	sigset_t mask;          /* the signals registered */
+
+	pthread_mutex_t lock;
+	struct {
+		sigThreadFn fn;
+		void *arg;
+	} handlers[NSIG];
+
+	long reads;             /* wakeups of the dispatcher */
+	long signals;           /* signals read */
+};
+
+/* blocks all asynchronous signals in the calling thread - and in the threads it
+ * creates afterwards. The previous mask is stored in `old`, if not NULL.
+ * Returns -1 on errors, with `errno` set */
+int sigThreadBlockAll(sigset_t *old);
+
+/* starts the dispatcher thread, with no signals registered. Returns -1 on
+ * errors, with `errno` set */
+int sigThreadStart(struct sigThread *st);
+
+/* stops the dispatcher thread. Signals registered stay blocked, and pending */
+void sigThreadStop(struct sigThread *st);
+
+/* has `fn` called with `arg` by the dispatcher for every `sig` read, instead of
+ * the function registered before, if any. Returns -1 on errors, with `errno`
+ * set */
+int sigThreadRegister(struct sigThread *st, int sig, sigThreadFn fn, void *arg);
+
+/* stops reading `sig`, which stays blocked. Returns -1 on errors, with `errno`
+ * set */
+int sigThreadUnregister(struct sigThread *st, int sig);
+
+#endif
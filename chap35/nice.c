@@ -14,6 +14,9 @@
  *    -n - the niceness adjustment. By default, it is equal to -10 (increased
  *    priority).
  *
+ * To also choose the CPUs, NUMA node or scheduling policy of the command, see
+ * place.c.
+ *
  * Author: Renato Mascarenhas Costa
  */
 
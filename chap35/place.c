@@ -0,0 +1,347 @@
+/* place.c - runs a command placed for predictable latency.
+ *
+ * nice.c and rtsched.c change how much CPU time a command gets. A process whose
+ * latency matters also needs to be kept apart from others: on CPUs of its own
+ * (ideally isolated from the scheduler with the isolcpus= boot parameter, so
+ * nothing else runs there), with its memory on the NUMA node of those CPUs,
+ * and with a scheduling policy that keeps it running when it has work to do.
+ * This launcher sets all of that, then executes the command - all of it is
+ * inherited through execve(2):
+ *
+ *    - the CPU affinity, with sched_setaffinity(2);
+ *    - the NUMA memory policy, with set_mempolicy(2): memory is taken from the
+ *      node given while it has any free. mbind(2) would apply to ranges of the
+ *      address space, which execve(2) replaces;
+ *    - the niceness, as nice.c does;
+ *    - a realtime policy (SCHED_FIFO or SCHED_RR), as rtsched.c does, or
+ *      SCHED_DEADLINE, with sched_setattr(2): the command is guaranteed
+ *      `runtime` microseconds of CPU time every `period`, by `deadline`;
+ *    - the limit on locked memory (RLIMIT_MEMLOCK), lifted.
+ *
+ * Memory locks are not inherited: execve(2) drops those of mlockall(2), and the
+ * command has to lock its memory itself. With -l, mlockall is checked to be
+ * allowed - the limit lifted - so that it can; the command is told to lock its
+ * memory by the PLACE_MLOCKALL environment variable.
+ *
+ * The kernel refuses to restrict the affinity of a SCHED_DEADLINE process (its
+ * guarantees are computed for all the CPUs of its root domain): -d and -c can
+ * only be used together in an exclusive cpuset.
+ *
+ * Usage
+ *
+ *    $ ./place [-c cpus] [-m node] [-n nice] [-p policy:priority]
+ *              [-d runtime,deadline,period] [-l] [-v] command [args...]
+ *
+ *    -c: the CPUs to run on, as a list ("2-3,6"), or "isolated" for those
+ *        isolated by isolcpus=.
+ *    -m: the NUMA node to take memory from, preferably.
+ *    -n: the niceness.
+ *    -p: a realtime policy - f for SCHED_FIFO, r for SCHED_RR - and priority.
+ *    -d: SCHED_DEADLINE, with the runtime, deadline and period in microseconds.
+ *    -l: allow the command to lock all its memory.
+ *    -v: tell where the command was placed.
+ *
+ *    Realtime policies, negative niceness and lifting the locked memory limit
+ *    need privileges: like rtsched.c, this program can be setuid-root, and drops
+ *    them before executing the command.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _GNU_SOURCE /* sched_setaffinity and CPU_* macros */
+
+#include <limits.h>
+#ifndef LONG_MIN
+#  include <linux/limits.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#ifndef SCHED_DEADLINE
+#  define SCHED_DEADLINE (6)
+#endif
+
+#define ISOLATED_CPUS "/sys/devices/system/cpu/isolated"
+#define MAX_NODES (1024)
+
+/* the argument of sched_setattr(2), which glibc has no wrapper for */
+struct schedAttr {
+	uint32_t size;
+	uint32_t sched_policy;
+	uint64_t sched_flags;
+	int32_t sched_nice;
+	uint32_t sched_priority;
+	uint64_t sched_runtime;  /* nanoseconds */
+	uint64_t sched_deadline;
+	uint64_t sched_period;
+};
+
+static void helpAndLeave(const char *progname, int status);
+static void pexit(const char *fCall);
+static void fatal(const char *msg);
+
+/* parses a CPU list, such as "0-3,8,10-11". Returns false if invalid */
+static bool
+parseCpus(const char *list, cpu_set_t *set) {
+	long first, last, cpu;
+	char *end;
+
+	CPU_ZERO(set);
+
+	while (*list != '\0' && *list != '\n') {
+		first = strtol(list, &end, 10);
+		if (end == list || first < 0)
+			return false;
+
+		last = first;
+		if (*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
+			if (end == list || last < first)
+				return false;
+		}
+
+		if (last >= CPU_SETSIZE)
+			return false;
+
+		for (cpu = first; cpu <= last; ++cpu)
+			CPU_SET(cpu, set);
+
+		list = end;
+		if (*list == ',')
+			++list;
+		else if (*list != '\0' && *list != '\n')
+			return false;
+	}
+
+	return CPU_COUNT(set) > 0;
+}
+
+/* the CPUs isolated from the scheduler by isolcpus= */
+static void
+isolatedCpus(cpu_set_t *set) {
+	char buf[BUFSIZ];
+	FILE *fp;
+
+	if ((fp = fopen(ISOLATED_CPUS, "r")) == NULL)
+		pexit("fopen");
+
+	if (fgets(buf, BUFSIZ, fp) == NULL)
+		buf[0] = '\0';
+	fclose(fp);
+
+	if (!parseCpus(buf, set))
+		fatal("No CPUs are isolated (see isolcpus= in kernel-parameters)\n");
+}
+
+static long
+parseNumber(const char *str) {
+	char *endptr;
+	long n;
+
+	n = strtol(str, &endptr, 10);
+	if (n == LONG_MIN || n == LONG_MAX || *endptr != '\0' || endptr == str)
+		fatal("Invalid number\n");
+
+	return n;
+}
+
+int
+main(int argc, char *argv[]) {
+	cpu_set_t cpus;
+	struct sched_param schedp;
+	struct schedAttr attr;
+	struct rlimit unlimited = { RLIM_INFINITY, RLIM_INFINITY }, limit;
+	unsigned long nodemask[MAX_NODES / (8 * sizeof(unsigned long))];
+	bool setCpus = false, lock = false, verbose = false, deadline = false, setNice = false;
+	long node = -1, niceness = 0, priority = 0;
+	unsigned long runtime, dl, period;
+	int opt, policy = SCHED_OTHER, cpu;
+
+	while ((opt = getopt(argc, argv, "+c:m:n:p:d:lvh")) != -1) {
+		switch (opt) {
+			case 'c':
+				if (!strcmp(optarg, "isolated"))
+					isolatedCpus(&cpus);
+				else if (!parseCpus(optarg, &cpus))
+					fatal("Invalid CPU list\n");
+				setCpus = true;
+				break;
+
+			case 'm':
+				node = parseNumber(optarg);
+				if (node < 0 || node >= MAX_NODES)
+					fatal("Invalid NUMA node\n");
+				break;
+
+			case 'n':
+				niceness = parseNumber(optarg);
+				setNice = true;
+				break;
+
+			case 'p':
+				if (optarg[0] == 'f' && optarg[1] == ':')
+					policy = SCHED_FIFO;
+				else if (optarg[0] == 'r' && optarg[1] == ':')
+					policy = SCHED_RR;
+				else
+					fatal("Unknown scheduling policy\n");
+				priority = parseNumber(optarg + 2);
+				break;
+
+			case 'd':
+				if (sscanf(optarg, "%lu,%lu,%lu", &runtime, &dl, &period) != 3 ||
+				    runtime == 0 || runtime > dl || dl > period)
+					fatal("Invalid deadline parameters: runtime <= deadline <= period\n");
+				deadline = true;
+				break;
+
+			case 'l': lock = true; break;
+			case 'v': verbose = true; break;
+			case 'h': helpAndLeave(argv[0], EXIT_SUCCESS); break;
+			default: helpAndLeave(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	if (optind >= argc)
+		helpAndLeave(argv[0], EXIT_FAILURE);
+
+	if (deadline && policy != SCHED_OTHER)
+		fatal("Only one of -p and -d can be given\n");
+
+	/* memory first: the policy applies to the allocations of this process
+	 * from now on, and those of the command */
+	if (node != -1) {
+		memset(nodemask, 0, sizeof(nodemask));
+		nodemask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+
+		if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodemask, MAX_NODES) == -1)
+			pexit("set_mempolicy");
+	}
+
+	if (setCpus && sched_setaffinity(0, sizeof(cpu_set_t), &cpus) == -1)
+		pexit("sched_setaffinity");
+
+	if (setNice && setpriority(PRIO_PROCESS, 0, niceness) == -1)
+		pexit("setpriority");
+
+	if (policy != SCHED_OTHER) {
+		if (priority < sched_get_priority_min(policy) || priority > sched_get_priority_max(policy))
+			fatal("priority out of bounds\n");
+
+		schedp.sched_priority = priority;
+		if (sched_setscheduler(0, policy, &schedp) == -1)
+			pexit("sched_setscheduler");
+	}
+
+	if (deadline) {
+		memset(&attr, 0, sizeof(struct schedAttr));
+		attr.size = sizeof(struct schedAttr);
+		attr.sched_policy = SCHED_DEADLINE;
+		attr.sched_runtime = runtime * 1000;
+		attr.sched_deadline = dl * 1000;
+		attr.sched_period = period * 1000;
+
+		if (syscall(SYS_sched_setattr, 0, &attr, 0) == -1) {
+			if (errno == EBUSY)
+				fatal("sched_setattr: not enough CPU bandwidth left for these parameters\n");
+			if (errno == EPERM && setCpus)
+				fatal("sched_setattr: SCHED_DEADLINE needs an exclusive cpuset to restrict CPUs\n");
+			pexit("sched_setattr");
+		}
+	}
+
+	if (lock) {
+		/* unprivileged, the limit can only go up to its hard limit */
+		if (setrlimit(RLIMIT_MEMLOCK, &unlimited) == -1) {
+			if (errno != EPERM || getrlimit(RLIMIT_MEMLOCK, &limit) == -1)
+				pexit("setrlimit");
+
+			limit.rlim_cur = limit.rlim_max;
+			if (setrlimit(RLIMIT_MEMLOCK, &limit) == -1)
+				pexit("setrlimit");
+		}
+
+		/* execve(2) drops the locks: make sure the command will be able to
+		 * take them, and undo */
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+			pexit("mlockall");
+		munlockall();
+
+		if (setenv("PLACE_MLOCKALL", "1", 1) == -1)
+			pexit("setenv");
+	}
+
+	if (verbose) {
+		fprintf(stderr, "CPUs:");
+		if (sched_getaffinity(0, sizeof(cpu_set_t), &cpus) == -1)
+			pexit("sched_getaffinity");
+		for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			if (CPU_ISSET(cpu, &cpus))
+				fprintf(stderr, " %d", cpu);
+		}
+
+		fprintf(stderr, "; memory: %s", (node == -1) ? "any node" : "preferred node ");
+		if (node != -1)
+			fprintf(stderr, "%ld", node);
+
+		fprintf(stderr, "; niceness: %d; policy: ", getpriority(PRIO_PROCESS, 0));
+		if (deadline)
+			fprintf(stderr, "SCHED_DEADLINE %lu/%lu/%lu us", runtime, dl, period);
+		else if (policy != SCHED_OTHER)
+			fprintf(stderr, "%s %ld", (policy == SCHED_FIFO) ? "SCHED_FIFO" : "SCHED_RR", priority);
+		else
+			fprintf(stderr, "SCHED_OTHER");
+
+		fprintf(stderr, "%s\n", lock ? "; memory lockable" : "");
+	}
+
+	/* placed - drop privileges, if setuid-root, and run the command */
+	if (seteuid(getuid()) == -1)
+		pexit("seteuid");
+
+	execvp(argv[optind], &argv[optind]);
+
+	/* if we get to this point, the exec call failed */
+	pexit("exec");
+
+	exit(EXIT_SUCCESS); /* unreachable */
+}
+
+static void
+helpAndLeave(const char *progname, int status) {
+	FILE *stream = stderr;
+
+	if (status == EXIT_SUCCESS)
+		stream = stdout;
+
+	fprintf(stream, "Usage: %s [-c cpus|isolated] [-m node] [-n nice] [-p f|r:priority] "
+			"[-d runtime,deadline,period] [-l] [-v] command [args...]\n", progname);
+	exit(status);
+}
+
+static void
+pexit(const char *fCall) {
+	perror(fCall);
+	exit(EXIT_FAILURE);
+}
+
+static void
+fatal(const char *msg) {
+	fprintf(stderr, "%s", msg);
+	exit(EXIT_FAILURE);
+}
@@ -17,6 +17,9 @@
  * 	assign the desired privilege to the command. However, the privileges are
  * 	dropped before executing the command.
  *
+ * 	To also choose the CPUs, NUMA node or a SCHED_DEADLINE reservation of the
+ * 	command, see place.c.
+ *
  * Author: Renato Mascarenhas Costa
  */
 
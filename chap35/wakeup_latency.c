@@ -0,0 +1,359 @@
+/* wakeup_latency.c - measures how late threads are woken up, as cyclictest does.
+ *
+ * sched_fifo_demo.c shows how SCHED_FIFO orders processes competing for a CPU.
+ * What realtime work cares about, though, is how soon a thread runs once it has
+ * something to do: a thread waiting for a timer (or an interrupt) is only useful
+ * if it is woken up on time. How late it is depends on the whole host - other
+ * threads and their priorities, interrupts, power saving states of the CPU,
+ * the kernel itself - and is what tuning a host for realtime work reduces.
+ *
+ * This program runs a number of threads with the scheduling policy, priority and
+ * CPUs given. Each sleeps until an absolute time with clock_nanosleep(2)
+ * (TIMER_ABSTIME, so that the period does not drift), every `interval`
+ * microseconds, and records how late it was woken up in a histogram of
+ * microsecond buckets. The minimum, average, maximum, 99th and 99.99th
+ * percentiles of the latencies of each thread are reported - the maximum is the
+ * figure of interest for realtime work.
+ *
+ * While measuring, /dev/cpu_dma_latency is held at 0 (if there are privileges
+ * to), so that CPUs do not go into deep idle states, which take long to leave.
+ *
+ * Usage
+ *
+ *    $ ./wakeup_latency [-t threads] [-c cpus] [-p f|r:priority] [-i interval]
+ *                       [-l loops] [-m] [-H]
+ *
+ *    -t: the number of threads (default: 1).
+ *    -c: the CPUs to run them on, as a list ("2-3,6"): thread i runs on the
+ *        i-th CPU of the list, wrapping around (default: any CPU).
+ *    -p: the realtime policy - f for SCHED_FIFO, r for SCHED_RR - and priority
+ *        of the threads (default: SCHED_OTHER).
+ *    -i: the interval between wakeups, in microseconds (default: 1000).
+ *    -l: the number of wakeups of each thread (default: 10000).
+ *    -m: lock all memory with mlockall(2), so that no page faults happen.
+ *    -H: print the histograms too: the number of wakeups of each latency.
+ *
+ *    Realtime policies need privileges (or RLIMIT_RTPRIO).
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _GNU_SOURCE /* pthread_attr_setaffinity_np and CPU_* macros */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#define DEFAULT_INTERVAL (1000)
+#define DEFAULT_LOOPS (10000)
+
+/* latency histogram: buckets of a microsecond, the last one for anything later */
+#define HISTOGRAM_BUCKETS (10000)
+
+#define CPU_DMA_LATENCY "/dev/cpu_dma_latency"
+
+struct threadinfo {
+	int index;
+	int cpu;                     /* -1 for any */
+	pthread_t thread;
+
+	long histogram[HISTOGRAM_BUCKETS];
+	long long min, max, sum;     /* nanoseconds */
+	long overruns;               /* wakeups later than a whole interval */
+};
+
+static void helpAndLeave(const char *progname, int status);
+static void pexit(const char *fCall);
+static void pthread_pexit(int err, const char *fCall);
+static void fatal(const char *msg);
+
+static long long interval = DEFAULT_INTERVAL * 1000LL;
+static long loops = DEFAULT_LOOPS;
+
+static long long
+ns(const struct timespec *ts) {
+	return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+/* parses a CPU list, such as "0-3,8,10-11", into `cpus`. Returns how many
+ * there are, or -1 if the list is invalid */
+static int
+parseCpus(const char *list, int *cpus, int max) {
+	long first, last, cpu;
+	int n = 0;
+	char *end;
+
+	while (*list != '\0') {
+		first = strtol(list, &end, 10);
+		if (end == list || first < 0)
+			return -1;
+
+		last = first;
+		if (*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
+			if (end == list || last < first)
+				return -1;
+		}
+
+		for (cpu = first; cpu <= last; ++cpu) {
+			if (n == max || cpu >= CPU_SETSIZE)
+				return -1;
+			cpus[n++] = cpu;
+		}
+
+		list = end;
+		if (*list == ',')
+			++list;
+		else if (*list != '\0')
+			return -1;
+	}
+
+	return n;
+}
+
+static void *
+measure(void *arg) {
+	struct threadinfo *info = arg;
+	struct timespec next, now;
+	long long latency;
+	long i, bucket;
+	int s;
+
+	info->min = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	for (i = 0; i < loops; ++i) {
+		next.tv_nsec += interval;
+		while (next.tv_nsec >= 1000000000L) {
+			next.tv_nsec -= 1000000000L;
+			++next.tv_sec;
+		}
+
+		while ((s = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL)) == EINTR)
+			;
+		if (s != 0)
+			pthread_pexit(s, "clock_nanosleep");
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		latency = ns(&now) - ns(&next);
+
+		bucket = latency / 1000;
+		if (bucket >= HISTOGRAM_BUCKETS)
+			bucket = HISTOGRAM_BUCKETS - 1;
+
+		++info->histogram[bucket];
+		info->sum += latency;
+		if (info->min == -1 || latency < info->min)
+			info->min = latency;
+		if (latency > info->max)
+			info->max = latency;
+
+		/* the next wakeups are due already: they will be late too, not missed */
+		if (latency > interval)
+			++info->overruns;
+	}
+
+	return NULL;
+}
+
+/* the latency under which `fraction` of the wakeups of a thread were, in
+ * microseconds */
+static long
+percentile(const struct threadinfo *info, double fraction) {
+	long i, seen = 0, target = (long) (fraction * loops);
+
+	for (i = 0; i < HISTOGRAM_BUCKETS - 1; ++i) {
+		seen += info->histogram[i];
+		if (seen > target)
+			break;
+	}
+
+	return i;
+}
+
+/* keeps CPUs out of deep idle states while the returned descriptor is open.
+ * Returns -1 if not allowed to */
+static int
+holdDmaLatency(void) {
+	int32_t zero = 0;
+	int fd;
+
+	if ((fd = open(CPU_DMA_LATENCY, O_WRONLY | O_CLOEXEC)) == -1)
+		return -1;
+
+	if (write(fd, &zero, sizeof(zero)) != sizeof(zero)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int
+main(int argc, char *argv[]) {
+	struct threadinfo *infos;
+	struct sched_param param;
+	pthread_attr_t attr;
+	cpu_set_t set;
+	int cpus[CPU_SETSIZE], ncpus = 0, nthreads = 1, policy = SCHED_OTHER, priority = 0;
+	int opt, i, s, dmaFd;
+	bool lock = false, histograms = false;
+	char cpu[12];
+	long b;
+
+	while ((opt = getopt(argc, argv, "t:c:p:i:l:mHh")) != -1) {
+		switch (opt) {
+			case 't': nthreads = atoi(optarg); break;
+			case 'c':
+				if ((ncpus = parseCpus(optarg, cpus, CPU_SETSIZE)) <= 0)
+					fatal("Invalid CPU list\n");
+				break;
+			case 'p':
+				if (optarg[0] == 'f' && optarg[1] == ':')
+					policy = SCHED_FIFO;
+				else if (optarg[0] == 'r' && optarg[1] == ':')
+					policy = SCHED_RR;
+				else
+					fatal("Unknown scheduling policy\n");
+				priority = atoi(optarg + 2);
+				break;
+			case 'i': interval = atol(optarg) * 1000LL; break;
+			case 'l': loops = atol(optarg); break;
+			case 'm': lock = true; break;
+			case 'H': histograms = true; break;
+			case 'h': helpAndLeave(argv[0], EXIT_SUCCESS); break;
+			default: helpAndLeave(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	if (optind != argc || nthreads < 1 || interval < 1000 || loops < 1)
+		helpAndLeave(argv[0], EXIT_FAILURE);
+
+	if (policy != SCHED_OTHER &&
+	    (priority < sched_get_priority_min(policy) || priority > sched_get_priority_max(policy)))
+		fatal("priority out of bounds\n");
+
+	if (lock && mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+		pexit("mlockall");
+
+	if ((infos = calloc(nthreads, sizeof(struct threadinfo))) == NULL)
+		pexit("calloc");
+
+	dmaFd = holdDmaLatency();
+
+	for (i = 0; i < nthreads; ++i) {
+		infos[i].index = i;
+		infos[i].cpu = ncpus ? cpus[i % ncpus] : -1;
+
+		pthread_attr_init(&attr);
+
+		/* the policy of the attributes, rather than that of this thread */
+		if (policy != SCHED_OTHER) {
+			param.sched_priority = priority;
+			pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+			pthread_attr_setschedpolicy(&attr, policy);
+			pthread_attr_setschedparam(&attr, &param);
+		}
+
+		if (infos[i].cpu != -1) {
+			CPU_ZERO(&set);
+			CPU_SET(infos[i].cpu, &set);
+			pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &set);
+		}
+
+		s = pthread_create(&infos[i].thread, &attr, measure, &infos[i]);
+		if (s != 0)
+			pthread_pexit(s, "pthread_create");
+
+		pthread_attr_destroy(&attr);
+	}
+
+	for (i = 0; i < nthreads; ++i) {
+		s = pthread_join(infos[i].thread, NULL);
+		if (s != 0)
+			pthread_pexit(s, "pthread_join");
+	}
+
+	if (dmaFd != -1)
+		close(dmaFd);
+
+	printf("%d thread%s, %s", nthreads, (nthreads > 1) ? "s" : "",
+			(policy == SCHED_FIFO) ? "SCHED_FIFO" : (policy == SCHED_RR) ? "SCHED_RR" : "SCHED_OTHER");
+	if (policy != SCHED_OTHER)
+		printf(" %d", priority);
+	printf(", %lld us interval, %ld wakeups each%s%s\n", interval / 1000, loops,
+			lock ? ", memory locked" : "", (dmaFd != -1) ? ", cpu_dma_latency 0" : "");
+
+	printf("%-8s %6s %10s %10s %10s %10s %10s %9s   (microseconds)\n",
+			"thread", "cpu", "min", "avg", "p99", "p99.99", "max", "overruns");
+
+	for (i = 0; i < nthreads; ++i) {
+		if (infos[i].cpu == -1)
+			strcpy(cpu, "any");
+		else
+			snprintf(cpu, sizeof(cpu), "%d", infos[i].cpu);
+
+		printf("%-8d %6s %10.1f %10.1f %10ld %10ld %10.1f %9ld\n", i, cpu,
+				infos[i].min / 1e3, (double) infos[i].sum / loops / 1e3,
+				percentile(&infos[i], 0.99), percentile(&infos[i], 0.9999),
+				infos[i].max / 1e3, infos[i].overruns);
+	}
+
+	if (histograms) {
+		for (i = 0; i < nthreads; ++i) {
+			printf("\nthread %d\n", i);
+			for (b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+				if (infos[i].histogram[b] > 0)
+					printf("%s%6ld us: %ld\n", (b == HISTOGRAM_BUCKETS - 1) ? ">=" : "  ",
+							b, infos[i].histogram[b]);
+			}
+		}
+	}
+
+	free(infos);
+	exit(EXIT_SUCCESS);
+}
+
+static void
+helpAndLeave(const char *progname, int status) {
+	FILE *stream = stderr;
+
+	if (status == EXIT_SUCCESS)
+		stream = stdout;
+
+	fprintf(stream, "Usage: %s [-t threads] [-c cpus] [-p f|r:priority] [-i interval] [-l loops] [-m] [-H]\n",
+			progname);
+	exit(status);
+}
+
+static void
+pexit(const char *fCall) {
+	perror(fCall);
+	exit(EXIT_FAILURE);
+}
+
+static void
+pthread_pexit(int err, const char *fCall) {
+	errno = err;
+	pexit(fCall);
+}
+
+static void
+fatal(const char *msg) {
+	fprintf(stderr, "%s", msg);
+	exit(EXIT_FAILURE);
+}
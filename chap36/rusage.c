@@ -5,47 +5,154 @@
  * it also produces other kinds of resource usage by the command
  * passed.
  *
+ * The command can be run a number of times (-n), in which case the mean,
+ * median, standard deviation, minimum and maximum of every figure are given -
+ * which makes it a small tool to spot performance regressions of command line
+ * programs. The usage of each run is that of the command alone, as returned by
+ * wait4(2).
+ *
+ * With -e, hardware and software counters of the command (and any processes
+ * it creates) are read as well, with perf_event_open(2), without the need of
+ * perf(1): CPU cycles, instructions, cache misses, context switches and page
+ * faults. Counters are opened for the child before it executes the command,
+ * and only enabled when it does (enable_on_exec), so they count the command
+ * alone. If perf_event_paranoid does not allow counting the kernel, only user
+ * space is counted; counters the machine lacks (virtual machines often have
+ * no hardware counters) are left out.
+ *
  * Usage:
  *
- *   $ ./rusage command arg ...
+ *   $ ./rusage [-n runs] [-e] [-q] command arg ...
+ *
+ *   -n: the number of times to run the command (default: 1).
+ *   -e: read the perf_event counters of the command too.
+ *   -q: discard the standard output of the command.
  *
  * Author: Renato Mascarenhas Costa
  */
 
+#define _GNU_SOURCE /* wait4 */
+
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/resource.h>
-#include <signal.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 
-static void exec_start_handler(int signal);
+/* figures taken from every run */
+enum metric {
+	WALL, USER, SYSTEM, MAXRSS, MINFLT, MAJFLT, NVCSW, NIVCSW,
+	CYCLES, INSTRUCTIONS, CACHE_MISSES, CONTEXT_SWITCHES, PAGE_FAULTS, IPC,
+	METRICS
+};
+
+/* the first of them read from perf_event counters, and how many there are */
+#define FIRST_COUNTER (CYCLES)
+#define COUNTERS (PAGE_FAULTS - CYCLES + 1)
+
+static const char *names[METRICS] = {
+	"wall (ms)", "user (ms)", "system (ms)", "max RSS (KB)",
+	"page reclaims", "page faults", "voluntary cs", "involuntary cs",
+	"cycles", "instructions", "cache misses", "context switches", "page faults (pe)", "insn per cycle"
+};
+
+static const struct {
+	uint32_t type;
+	uint64_t config;
+} counters[COUNTERS] = {
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS }
+};
+
+/* what perf_event counters are read as, with PERF_FORMAT_TOTAL_TIME_* */
+struct counterValue {
+	uint64_t value;
+	uint64_t enabled;
+	uint64_t running;
+};
 
 static void helpAndLeave(const char *progname, int status);
 static void pexit(const char *fCall);
 
-static volatile sig_atomic_t exec_start = false;
+/* whether the kernel may be counted: cleared once perf_event_paranoid says no */
+static bool countKernel = true;
 
-int
-main(int argc, char *argv[]) {
-	struct sigaction sa;
-	pid_t child_pid;
+/* counters that could not be opened, told about once */
+static bool unavailable[COUNTERS];
 
-	if (argc < 2)
-		helpAndLeave(argv[0], EXIT_FAILURE);
+static int
+openCounter(int i, pid_t pid) {
+	struct perf_event_attr attr;
+	int fd;
+
+	memset(&attr, 0, sizeof(struct perf_event_attr));
+	attr.size = sizeof(struct perf_event_attr);
+	attr.type = counters[i].type;
+	attr.config = counters[i].config;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	attr.disabled = 1;
+	attr.enable_on_exec = 1;
+	attr.inherit = 1;
+	attr.exclude_kernel = !countKernel;
+	attr.exclude_hv = !countKernel;
+
+	fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+	if (fd == -1 && (errno == EACCES || errno == EPERM) && countKernel) {
+		countKernel = false;
+		fprintf(stderr, "perf_event_paranoid does not allow counting the kernel: counting user space only\n");
+		return openCounter(i, pid);
+	}
 
-	/* wait for parent indicate that it is waiting for the child */
-	sigemptyset(&sa.sa_mask);
-	sa.sa_flags = 0;
-	sa.sa_handler = exec_start_handler;
+	return fd;
+}
+
+/* the value of a counter, scaled up if it was multiplexed with others - or NAN
+ * if it could not be read */
+static double
+readCounter(int fd) {
+	struct counterValue cv;
+
+	if (read(fd, &cv, sizeof(struct counterValue)) != sizeof(struct counterValue))
+		return NAN;
+
+	if (cv.running == 0)
+		return 0;
 
-	if (sigaction(SIGCONT, &sa, NULL) == -1)
-		pexit("sigaction");
+	return (double) cv.value * cv.enabled / cv.running;
+}
 
-	/* fork a child and execute the command */
+static double
+ms(struct timeval tv) {
+	return tv.tv_sec * 1e3 + tv.tv_usec / 1e3;
+}
+
+/* runs the command once, storing what it used in `values` */
+static void
+run(char *argv[], bool events, bool quiet, double values[METRICS]) {
+	struct timespec start, end;
+	struct rusage ru;
+	int pfd[2], fds[COUNTERS], i, status, devnull;
+	pid_t child_pid;
+	char c;
+
+	/* the child waits for the parent to open its counters before executing the
+	 * command: it reads a pipe, which the parent closes once ready */
+	if (pipe(pfd) == -1)
+		pexit("pipe");
 
 	switch (child_pid = fork()) {
 		case -1:
@@ -54,47 +161,138 @@ main(int argc, char *argv[]) {
 
 		case 0:
 			/* child: execute the command */
-			while (!exec_start)
-				pause();
+			close(pfd[1]);
+			if (read(pfd[0], &c, 1) == -1)
+				pexit("read");
+			close(pfd[0]);
+
+			if (quiet) {
+				if ((devnull = open("/dev/null", O_WRONLY)) == -1)
+					pexit("open");
+				if (dup2(devnull, STDOUT_FILENO) == -1)
+					pexit("dup2");
+			}
 
 			/* parent is ready, execute the command */
-			if (execvp(argv[1], &argv[1]) == -1)
-				pexit("exec");
+			execvp(argv[0], argv);
+			pexit("exec");
+	}
 
-			break;
+	close(pfd[0]);
+
+	for (i = 0; i < COUNTERS; ++i) {
+		fds[i] = events ? openCounter(i, child_pid) : -1;
 
-		default:
-			/* parent: wait for command to finish and then print
-			 * resource usage information */
+		if (events && fds[i] == -1 && !unavailable[i]) {
+			fprintf(stderr, "%s: %s\n", names[FIRST_COUNTER + i], strerror(errno));
+			unavailable[i] = true;
+		}
+	}
 
-			/* tell child that we are ready to wait. This still is not guaranteed
-			 * to work, but is a safer approach to just running the child as soon
-			 * as it is ready. */
-			kill(child_pid, SIGCONT);
-			int status;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	close(pfd[1]);
 
-			if (wait(&status) == -1)
-				pexit("wait");
+	if (wait4(child_pid, &status, 0, &ru) == -1)
+		pexit("wait4");
 
-			/* print resource usage */
-			struct rusage ru;
+	clock_gettime(CLOCK_MONOTONIC, &end);
 
-			if (getrusage(RUSAGE_CHILDREN, &ru) == -1)
-				pexit("getrusage");
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		fprintf(stderr, "warning: %s did not exit successfully (status %d)\n", argv[0], status);
 
-			printf("\n");
-			printf("CPU (user): %lds %ldms\n", (long) ru.ru_utime.tv_sec, ru.ru_utime.tv_usec);
-			printf("CPU (system): %lds %ldms\n", (long) ru.ru_stime.tv_sec, ru.ru_stime.tv_usec);
-			printf("Page reclaims: %ld\n", ru.ru_minflt);
-			printf("Page faults: %ld\n", ru.ru_majflt);
+	values[WALL] = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+	values[USER] = ms(ru.ru_utime);
+	values[SYSTEM] = ms(ru.ru_stime);
+	values[MAXRSS] = ru.ru_maxrss;
+	values[MINFLT] = ru.ru_minflt;
+	values[MAJFLT] = ru.ru_majflt;
+	values[NVCSW] = ru.ru_nvcsw;
+	values[NIVCSW] = ru.ru_nivcsw;
+
+	for (i = 0; i < COUNTERS; ++i) {
+		values[FIRST_COUNTER + i] = (fds[i] == -1) ? NAN : readCounter(fds[i]);
+		if (fds[i] != -1)
+			close(fds[i]);
 	}
 
-	exit(EXIT_SUCCESS);
+	values[IPC] = values[INSTRUCTIONS] / values[CYCLES];
+}
+
+static int
+compareDoubles(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
 }
 
+/* prints the statistics of the `n` values of a metric, sorting them */
 static void
-exec_start_handler(__attribute__ ((unused)) int signal) {
-	exec_start = true;
+report(const char *name, double *values, long n) {
+	double sum = 0, squares = 0, mean, median;
+	long i;
+
+	/* counters not available on this machine */
+	if (isnan(values[0]))
+		return;
+
+	qsort(values, n, sizeof(double), compareDoubles);
+
+	for (i = 0; i < n; ++i)
+		sum += values[i];
+	mean = sum / n;
+
+	for (i = 0; i < n; ++i)
+		squares += (values[i] - mean) * (values[i] - mean);
+
+	median = (n % 2) ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+
+	printf("%-18s %14.2f %14.2f %12.2f %14.2f %14.2f\n", name, mean, median,
+	       (n > 1) ? sqrt(squares / (n - 1)) : 0, values[0], values[n - 1]);
+}
+
+int
+main(int argc, char *argv[]) {
+	bool events = false, quiet = false;
+	double *samples[METRICS], values[METRICS];
+	long runs = 1, i;
+	int opt, m;
+
+	/* options up to the command: those after it are the command's */
+	while ((opt = getopt(argc, argv, "+n:eqh")) != -1) {
+		switch (opt) {
+			case 'n': runs = atol(optarg); break;
+			case 'e': events = true; break;
+			case 'q': quiet = true; break;
+			case 'h': helpAndLeave(argv[0], EXIT_SUCCESS); break;
+			default: helpAndLeave(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	if (optind >= argc || runs < 1)
+		helpAndLeave(argv[0], EXIT_FAILURE);
+
+	for (m = 0; m < METRICS; ++m) {
+		if ((samples[m] = malloc(runs * sizeof(double))) == NULL)
+			pexit("malloc");
+	}
+
+	for (i = 0; i < runs; ++i) {
+		run(&argv[optind], events, quiet, values);
+
+		for (m = 0; m < METRICS; ++m)
+			samples[m][i] = values[m];
+	}
+
+	printf("\n%ld run%s of %s%s\n", runs, (runs > 1) ? "s" : "", argv[optind],
+	       (events && !countKernel) ? " (counters: user space only)" : "");
+	printf("%-18s %14s %14s %12s %14s %14s\n", "", "mean", "median", "stddev", "min", "max");
+
+	for (m = 0; m < METRICS; ++m) {
+		report(names[m], samples[m], runs);
+		free(samples[m]);
+	}
+
+	exit(EXIT_SUCCESS);
 }
 
 static void
@@ -104,7 +302,7 @@ helpAndLeave(const char *progname, int status) {
 	if (status == EXIT_FAILURE)
 		stream = stderr;
 
-	fprintf(stream, "Usage: %s [command] [args]\n", progname);
+	fprintf(stream, "Usage: %s [-n runs] [-e] [-q] [command] [args]\n", progname);
 	exit(status);
 }
 
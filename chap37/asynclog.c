@@ -0,0 +1,556 @@
+/* asynclog.c - logging to syslog without blocking the threads that log.
+ * See asynclog.h.
+ *
+ * The ring is Vyukov's bounded queue: every slot has a sequence number, which
+ * tells whether it is free for the position a producer claimed (equal to it),
+ * or holds the message of the position the consumer is at (one past it).
+ *
+ * The arguments of deferred messages are stored one after the other in the
+ * message of the slot: 8 bytes for numbers and pointers, and strings with their
+ * terminating null byte.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _GNU_SOURCE /* sendmmsg */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "asynclog.h"
+
+#define DEFAULT_SOCKET ("/dev/log")
+
+/* messages sent at a time */
+#define BATCH (64)
+#define HEADER_SIZE (320)
+
+/* how long the drainer sleeps at most with the ring empty, in nanoseconds:
+ * messages logged meanwhile wait that long to be sent, unless they fill half
+ * the ring - then producers wake it up. Waking it up for every message would
+ * take a system call per message */
+#define IDLE_SLEEP_NS (10000000L)
+
+/* seconds between attempts to reconnect to the syslog socket */
+#define RECONNECT_INTERVAL (1)
+
+#define CACHE_LINE (64)
+
+struct slot {
+	unsigned long seq;
+	int level;
+	unsigned int len;           /* of the message, or of its arguments if deferred */
+	struct timespec ts;
+	const char *format;         /* if deferred */
+	char msg[ASYNCLOG_MESSAGE_SIZE];
+};
+
+_Static_assert(sizeof(struct slot) == ASYNCLOG_SLOT_SIZE, "slots must be ASYNCLOG_SLOT_SIZE bytes");
+
+/* the arguments a conversion takes */
+enum argKind { ARG_NONE, ARG_PERCENT, ARG_INT, ARG_LONG, ARG_LLONG, ARG_DOUBLE, ARG_POINTER, ARG_STRING };
+
+/* the longest conversion specification handled, such as "%-+08.3lld" */
+#define SPEC_SIZE (32)
+
+/* the ends of the ring, written by different threads, in cache lines of their
+ * own */
+static struct {
+	unsigned long tail __attribute__((aligned(CACHE_LINE)));   /* next position to claim */
+	unsigned long head __attribute__((aligned(CACHE_LINE)));   /* next position to drain */
+	int sleeping __attribute__((aligned(CACHE_LINE)));         /* the futex of the drainer */
+	unsigned long dropped;
+} ring;
+
+static struct slot *slots;
+static unsigned long mask;
+
+static pthread_t drainer;
+static int stopping;
+
+static int sfd = -1;
+static time_t lastConnect;
+static struct sockaddr_un addr;
+static char hostname[256];
+static char appName[48];
+
+static int
+connectLog(void) {
+	struct timespec ts;
+
+	if (sfd != -1)
+		close(sfd);
+	sfd = -1;
+
+	/* not too often, while the daemon is down */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (lastConnect != 0 && ts.tv_sec - lastConnect < RECONNECT_INTERVAL) {
+		errno = ECONNREFUSED;
+		return -1;
+	}
+	lastConnect = ts.tv_sec;
+
+	if ((sfd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1)
+		return -1;
+
+	if (connect(sfd, (struct sockaddr *) &addr, sizeof(struct sockaddr_un)) == -1) {
+		close(sfd);
+		sfd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+futexWait(int *addr, int value, const struct timespec *timeout) {
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, timeout, NULL, 0);
+}
+
+static void
+futexWake(int *addr) {
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* the RFC 5424 header of a message, up to the message itself */
+static int
+formatHeader(char *header, const struct slot *slot) {
+	struct tm tm;
+	char timestamp[32];
+
+	gmtime_r(&slot->ts.tv_sec, &tm);
+	strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &tm);
+
+	return snprintf(header, HEADER_SIZE, "<%d>1 %s.%06ldZ %s %s %ld - - ",
+			LOG_USER | slot->level, timestamp, slot->ts.tv_nsec / 1000, hostname, appName, (long) getpid());
+}
+
+/* finds the next conversion of a format, from `p`: returns where it starts (or
+ * NULL if there is none), storing what it takes in `kind` and where it ends in
+ * `end`. Conversions not handled take ARG_NONE */
+static const char *
+nextConversion(const char *p, const char **end, enum argKind *kind) {
+	const char *start;
+	int longs = 0;
+
+	if ((start = strchr(p, '%')) == NULL)
+		return NULL;
+
+	p = start + 1;
+	if (*p == '%') {
+		*kind = ARG_PERCENT;
+		*end = p + 1;
+		return start;
+	}
+
+	/* by hand: strspn(3) would build a table of the characters every call */
+	while (*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0' || *p == '\'')
+		++p;
+	while (*p >= '0' && *p <= '9')
+		++p;
+	if (*p == '.') {
+		++p;
+		while (*p >= '0' && *p <= '9')
+			++p;
+	}
+
+	for (; *p == 'h' || *p == 'l' || *p == 'z' || *p == 'j' || *p == 't'; ++p)
+		longs += (*p != 'h');
+
+	switch (*p) {
+	case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+		*kind = (longs == 0) ? ARG_INT : (longs == 1) ? ARG_LONG : ARG_LLONG;
+		break;
+	case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+		*kind = ARG_DOUBLE;
+		break;
+	case 'p': *kind = ARG_POINTER; break;
+	case 's': *kind = ARG_STRING; break;
+	default: *kind = ARG_NONE;
+	}
+
+	if (p - start >= SPEC_SIZE)
+		*kind = ARG_NONE;
+
+	*end = (*p == '\0') ? p : p + 1;
+	return start;
+}
+
+/* formats a deferred message into `out`, returning its length */
+static int
+formatDeferred(const struct slot *slot, char *out) {
+	const char *p = slot->format, *start, *end;
+	const char *arg = slot->msg, *args = slot->msg + slot->len;
+	char spec[SPEC_SIZE];
+	enum argKind kind;
+	long long value;
+	double d;
+	void *pointer;
+	int len = 0, room = ASYNCLOG_MESSAGE_SIZE, n;
+
+	while (len < room - 1) {
+		start = nextConversion(p, &end, &kind);
+
+		/* the text up to the conversion */
+		n = (start ? start : p + strlen(p)) - p;
+		if (n > room - 1 - len)
+			n = room - 1 - len;
+		memcpy(out + len, p, n);
+		len += n;
+
+		if (start == NULL || kind == ARG_NONE)
+			break;
+
+		p = end;
+		if (kind == ARG_PERCENT) {
+			out[len++] = '%';
+			continue;
+		}
+
+		/* arguments that did not fit cut the message */
+		if (arg >= args)
+			break;
+
+		memcpy(spec, start, end - start);
+		spec[end - start] = '\0';
+
+		switch (kind) {
+		case ARG_STRING:
+			n = snprintf(out + len, room - len, spec, arg);
+			arg += strlen(arg) + 1;
+			break;
+		case ARG_DOUBLE:
+			memcpy(&d, arg, sizeof(double));
+			n = snprintf(out + len, room - len, spec, d);
+			arg += 8;
+			break;
+		case ARG_POINTER:
+			memcpy(&pointer, arg, sizeof(void *));
+			n = snprintf(out + len, room - len, spec, pointer);
+			arg += 8;
+			break;
+		default:
+			memcpy(&value, arg, sizeof(long long));
+			if (kind == ARG_INT)
+				n = snprintf(out + len, room - len, spec, (int) value);
+			else if (kind == ARG_LONG)
+				n = snprintf(out + len, room - len, spec, (long) value);
+			else
+				n = snprintf(out + len, room - len, spec, value);
+			arg += 8;
+		}
+
+		if (n < 0)
+			break;
+		len += (n < room - len) ? n : room - 1 - len;
+	}
+
+	return len;
+}
+
+/* sends `n` messages. Those that cannot be delivered, even after reconnecting
+ * once, are dropped: waiting for the daemon would fill the ring anyway */
+static void
+sendBatch(struct mmsghdr *msgs, int n) {
+	int sent, reconnected = 0;
+
+	while (n > 0) {
+		sent = (sfd == -1) ? -1 : sendmmsg(sfd, msgs, n, 0);
+
+		if (sent > 0) {
+			msgs += sent;
+			n -= sent;
+			continue;
+		}
+
+		if (sent == -1 && errno == EINTR)
+			continue;
+
+		if (!reconnected && (sfd == -1 || errno == ECONNREFUSED || errno == ENOTCONN || errno == ENOENT)) {
+			reconnected = 1;
+			if (connectLog() == 0)
+				continue;
+		}
+
+		/* the message that failed, and the rest of them */
+		__atomic_add_fetch(&ring.dropped, n, __ATOMIC_RELAXED);
+		return;
+	}
+}
+
+/* takes the messages published, a batch at a time, and sends them. Slots are
+ * freed once their batch is sent */
+static void *
+drain(__attribute__((unused)) void *arg) {
+	static char headers[BATCH][HEADER_SIZE], bodies[BATCH][ASYNCLOG_MESSAGE_SIZE];
+	struct mmsghdr msgs[BATCH];
+	struct iovec iovs[BATCH][2];
+	struct timespec timeout = { 0, IDLE_SLEEP_NS };
+	struct slot *slot;
+	unsigned long head = ring.head, pos;
+	int n;
+
+	memset(msgs, 0, sizeof(msgs));
+
+	for (;;) {
+		for (n = 0; n < BATCH; ++n) {
+			slot = &slots[(head + n) & mask];
+			if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != head + n + 1)
+				break;
+
+			iovs[n][0].iov_base = headers[n];
+			iovs[n][0].iov_len = formatHeader(headers[n], slot);
+			if (slot->format != NULL) {
+				iovs[n][1].iov_base = bodies[n];
+				iovs[n][1].iov_len = formatDeferred(slot, bodies[n]);
+			} else {
+				iovs[n][1].iov_base = slot->msg;
+				iovs[n][1].iov_len = slot->len;
+			}
+			msgs[n].msg_hdr.msg_iov = iovs[n];
+			msgs[n].msg_hdr.msg_iovlen = 2;
+		}
+
+		if (n > 0) {
+			sendBatch(msgs, n);
+
+			/* the slots are free for the positions a lap ahead */
+			for (pos = head; pos < head + n; ++pos)
+				__atomic_store_n(&slots[pos & mask].seq, pos + mask + 1, __ATOMIC_RELEASE);
+
+			head += n;
+			__atomic_store_n(&ring.head, head, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+			break;
+
+		/* nothing to send: sleep, unless something was published meanwhile */
+		__atomic_store_n(&ring.sleeping, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&slots[head & mask].seq, __ATOMIC_SEQ_CST) != head + 1)
+			futexWait(&ring.sleeping, 1, &timeout);
+		__atomic_store_n(&ring.sleeping, 0, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+int
+asyncLogInit(const char *ident, const char *path, size_t n) {
+	unsigned long i;
+	int s;
+
+	if (n == 0)
+		n = ASYNCLOG_DEFAULT_SLOTS;
+
+	if ((n & (n - 1)) != 0 || ident == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	s = posix_memalign((void **) &slots, CACHE_LINE, n * sizeof(struct slot));
+	if (s != 0) {
+		errno = s;
+		return -1;
+	}
+
+	for (i = 0; i < n; ++i)
+		slots[i].seq = i;
+
+	mask = n - 1;
+	lastConnect = 0;
+	ring.head = ring.tail = ring.dropped = 0;
+	ring.sleeping = 0;
+	stopping = 0;
+
+	if (gethostname(hostname, sizeof(hostname)) == -1)
+		strcpy(hostname, "-");
+	hostname[sizeof(hostname) - 1] = '\0';
+	snprintf(appName, sizeof(appName), "%s", ident);
+
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path ? path : DEFAULT_SOCKET, sizeof(addr.sun_path) - 1);
+
+	/* the daemon may not be up yet: the drainer connects again if needed */
+	connectLog();
+
+	s = pthread_create(&drainer, NULL, drain, NULL);
+	if (s != 0) {
+		free(slots);
+		errno = s;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* claims the slot of the next position, storing it in `pos`. NULL if the ring
+ * is full */
+static struct slot *
+claim(unsigned long *pos) {
+	struct slot *slot;
+	unsigned long seq;
+
+	*pos = __atomic_load_n(&ring.tail, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &slots[*pos & mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+		if (seq == *pos) {
+			/* free for this position: claim it. On failure, `pos` is
+			 * updated to the position claimed by someone else */
+			if (__atomic_compare_exchange_n(&ring.tail, pos, *pos + 1, 1,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				return slot;
+		} else if ((long) (seq - *pos) < 0) {
+			/* still holds the message of the previous lap: full */
+			__atomic_add_fetch(&ring.dropped, 1, __ATOMIC_RELAXED);
+			return NULL;
+		} else {
+			*pos = __atomic_load_n(&ring.tail, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static void
+publish(struct slot *slot, unsigned long pos) {
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* every half a ring, if the drainer is sleeping. Without a fence between
+	 * the publishing store and this load, a wakeup can be missed when the
+	 * drainer goes to sleep at the same time: it then sleeps IDLE_SLEEP_NS */
+	if ((pos & (mask >> 1)) == 0 && __atomic_load_n(&ring.sleeping, __ATOMIC_SEQ_CST) &&
+	    __atomic_exchange_n(&ring.sleeping, 0, __ATOMIC_SEQ_CST))
+		futexWake(&ring.sleeping);
+}
+
+void
+asyncLog(int level, const char *format, ...) {
+	struct slot *slot;
+	unsigned long pos;
+	va_list ap;
+	int len;
+
+	if ((slot = claim(&pos)) == NULL)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &slot->ts);
+	slot->level = level;
+	slot->format = NULL;
+
+	va_start(ap, format);
+	len = vsnprintf(slot->msg, ASYNCLOG_MESSAGE_SIZE, format, ap);
+	va_end(ap);
+
+	if (len < 0)
+		len = 0;
+	else if (len >= (int) ASYNCLOG_MESSAGE_SIZE)
+		len = ASYNCLOG_MESSAGE_SIZE - 1;
+	slot->len = len;
+
+	publish(slot, pos);
+}
+
+void
+asyncLogDeferred(int level, const char *format, ...) {
+	const char *p = format, *end, *str;
+	struct slot *slot;
+	unsigned long pos;
+	enum argKind kind;
+	long long value;
+	double d;
+	void *pointer;
+	size_t len = 0, n;
+	va_list ap;
+
+	if ((slot = claim(&pos)) == NULL)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &slot->ts);
+	slot->level = level;
+	slot->format = format;
+
+	va_start(ap, format);
+	while (nextConversion(p, &end, &kind) != NULL && kind != ARG_NONE) {
+		p = end;
+		if (kind == ARG_PERCENT)
+			continue;
+
+		if (kind == ARG_STRING) {
+			str = va_arg(ap, const char *);
+			if (str == NULL)
+				str = "(null)";
+
+			/* as much of it as fits */
+			n = strnlen(str, ASYNCLOG_MESSAGE_SIZE - len);
+			if (n == ASYNCLOG_MESSAGE_SIZE - len) {
+				if (n == 0)
+					break;
+				--n;
+			}
+
+			memcpy(slot->msg + len, str, n);
+			slot->msg[len + n] = '\0';
+			len += n + 1;
+			continue;
+		}
+
+		if (len + 8 > ASYNCLOG_MESSAGE_SIZE)
+			break;
+
+		switch (kind) {
+		case ARG_DOUBLE:
+			d = va_arg(ap, double);
+			memcpy(slot->msg + len, &d, sizeof(double));
+			break;
+		case ARG_POINTER:
+			pointer = va_arg(ap, void *);
+			memcpy(slot->msg + len, &pointer, sizeof(void *));
+			break;
+		default:
+			value = (kind == ARG_INT) ? va_arg(ap, int) :
+				(kind == ARG_LONG) ? va_arg(ap, long) : va_arg(ap, long long);
+			memcpy(slot->msg + len, &value, sizeof(long long));
+		}
+		len += 8;
+	}
+	va_end(ap);
+
+	slot->len = len;
+	publish(slot, pos);
+}
+
+void
+asyncLogShutdown(void) {
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring.sleeping, 0, __ATOMIC_SEQ_CST);
+	futexWake(&ring.sleeping);
+
+	pthread_join(drainer, NULL);
+
+	if (sfd != -1)
+		close(sfd);
+	sfd = -1;
+
+	free(slots);
+	slots = NULL;
+}
+
+unsigned long
+asyncLogDropped(void) {
+	return __atomic_load_n(&ring.dropped, __ATOMIC_RELAXED);
+}
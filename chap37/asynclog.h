@@ -0,0 +1,73 @@
+/* asynclog.h - logging to syslog without blocking the threads that log.
+ *
+ * syslog(3) writes every message to the syslog socket before returning: when
+ * the syslog daemon falls behind (a slow disk, a stalled rsyslog), the socket
+ * fills up, and every thread logging blocks until it catches up - hot paths
+ * included.
+ *
+ * Here, threads only format their messages into a ring buffer in memory, and a
+ * background thread drains it to the syslog socket, in batches of datagrams
+ * sent with a single sendmmsg(2) call, as RFC 5424 messages (see logger.c).
+ * The ring has a fixed number of fixed-size slots, and is lock-free: a thread
+ * logging claims a slot with a compare-and-swap, formats its message there,
+ * and publishes it - there is no lock to wait for, nor a system call, in the
+ * common case. Logging costs about as much as formatting the message.
+ *
+ * Formatting with printf(3) conversions takes longer than all the rest, though.
+ * `asyncLogDeferred` leaves it to the background thread: the thread logging
+ * only copies the arguments to the slot (strings included), and a pointer to
+ * the format - which must therefore outlive the logger, as string literals do.
+ * A call then costs tens of nanoseconds.
+ *
+ * Messages are never waited for: if the ring is full, the message is dropped,
+ * and counted. Messages longer than a slot are truncated. Messages of threads
+ * logging at the same time may be sent in a different order than they were
+ * logged in; each carries the time it was logged at. Messages are sent within
+ * milliseconds of being logged, unless the syslog daemon is behind.
+ *
+ * There is a single logger per process, as with syslog(3).
+ *
+ * Programs using it are built along with asynclog.c, and linked with -pthread:
+ *
+ *    $ gcc -O2 -o asynclog_bench asynclog_bench.c asynclog.c -pthread
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#ifndef ASYNCLOG_H
+#define ASYNCLOG_H
+
+#include <stddef.h>
+#include <time.h>
+
+#define ASYNCLOG_SLOT_SIZE (256)
+#define ASYNCLOG_DEFAULT_SLOTS (16384)
+
+/* the longest message, including its terminating null byte - or the room for
+ * the arguments of a deferred one */
+#define ASYNCLOG_MESSAGE_SIZE (ASYNCLOG_SLOT_SIZE - 40)
+
+/* starts the logger: messages are sent to the syslog socket at `path` (NULL for
+ * /dev/log) as coming from `ident`, with the LOG_USER facility. `slots` is the
+ * size of the ring, a power of two (0 for ASYNCLOG_DEFAULT_SLOTS). Returns -1
+ * on errors, with `errno` set */
+int asyncLogInit(const char *ident, const char *path, size_t slots);
+
+/* logs a message with the `level` (LOG_ERR, LOG_INFO...) given, formatted as
+ * printf(3) would. Safe to call from any thread, once the logger is started */
+void asyncLog(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/* as asyncLog, but formatting the message later, in the background thread.
+ * `format` must not change or be freed while the logger runs. Conversions can
+ * be those of integers, floating point numbers, characters, strings and
+ * pointers, with flags, width and precision - but no `*`. If the arguments
+ * do not fit in a slot, the message is cut at the first one that did not */
+void asyncLogDeferred(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/* sends the messages still in the ring, and stops the logger */
+void asyncLogShutdown(void);
+
+/* the messages dropped so far: logged with the ring full, or not delivered */
+unsigned long asyncLogDropped(void);
+
+#endif
@@ -0,0 +1,176 @@
+/* asynclog_bench.c - measures what logging costs the threads that log.
+ *
+ * A number of threads log messages as fast as they can, with asyncLog (see
+ * asynclog.h) or, with -d, asyncLogDeferred - and, with -S, with syslog(3) too -
+ * and the average time each call took is reported, along with the messages
+ * dropped because the ring was full. Messages are formatted from a few arguments, as usual log messages
+ * are. The time is the CPU time of the threads logging, so that it does not
+ * count the time they wait for a CPU - with more threads than CPUs, say.
+ *
+ * Usage
+ *
+ *    $ ./asynclog_bench [-t threads] [-n messages] [-r slots] [-u socket] [-d] [-S]
+ *
+ *    -t: the number of threads logging (default: 4).
+ *    -n: the messages each thread logs (default: 100000).
+ *    -r: the slots of the ring (default: ASYNCLOG_DEFAULT_SLOTS).
+ *    -u: the syslog socket asyncLog sends to (default: /dev/log).
+ *    -d: log with asyncLogDeferred, which formats in the background thread.
+ *    -S: measure syslog(3) as well, which always sends to /dev/log.
+ *
+ * Built along with asynclog.c:
+ *
+ *    $ gcc -O2 -o asynclog_bench asynclog_bench.c asynclog.c -pthread
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _GNU_SOURCE
+
+#include <syslog.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "asynclog.h"
+
+#define DEFAULT_THREADS (4)
+#define DEFAULT_MESSAGES (100000)
+
+static void helpAndLeave(const char *progname, int status);
+static void pexit(const char *fCall);
+static void pthread_pexit(int err, const char *fCall);
+
+static long messages = DEFAULT_MESSAGES;
+static int useSyslog, deferred;
+
+static pthread_barrier_t barrier;
+
+static double
+threadTime() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* logs the messages, returning how long it took in `arg` */
+static void *
+logMessages(void *arg) {
+	double *elapsed = arg, start;
+	long i;
+
+	pthread_barrier_wait(&barrier);
+	start = threadTime();
+
+	for (i = 0; i < messages; ++i) {
+		if (useSyslog)
+			syslog(LOG_INFO, "request %ld from thread %lx took %d us", i, (unsigned long) pthread_self(), 42);
+		else if (deferred)
+			asyncLogDeferred(LOG_INFO, "request %ld from thread %lx took %d us", i, (unsigned long) pthread_self(), 42);
+		else
+			asyncLog(LOG_INFO, "request %ld from thread %lx took %d us", i, (unsigned long) pthread_self(), 42);
+	}
+
+	*elapsed = threadTime() - start;
+	return NULL;
+}
+
+/* runs the threads, returning the average time of a call, in nanoseconds */
+static double
+run(int threads) {
+	pthread_t tids[threads];
+	double elapsed[threads], total = 0;
+	int i, s;
+
+	s = pthread_barrier_init(&barrier, NULL, threads);
+	if (s != 0)
+		pthread_pexit(s, "pthread_barrier_init");
+
+	for (i = 0; i < threads; ++i) {
+		s = pthread_create(&tids[i], NULL, logMessages, &elapsed[i]);
+		if (s != 0)
+			pthread_pexit(s, "pthread_create");
+	}
+
+	for (i = 0; i < threads; ++i) {
+		s = pthread_join(tids[i], NULL);
+		if (s != 0)
+			pthread_pexit(s, "pthread_join");
+
+		total += elapsed[i];
+	}
+
+	pthread_barrier_destroy(&barrier);
+	return total / (threads * messages) * 1e9;
+}
+
+int
+main(int argc, char *argv[]) {
+	int opt, threads = DEFAULT_THREADS, compare = 0;
+	long slots = 0;
+	char *path = NULL;
+	double ns;
+
+	while ((opt = getopt(argc, argv, "t:n:r:u:dSh")) != -1) {
+		switch (opt) {
+			case 't': threads = atoi(optarg); break;
+			case 'n': messages = atol(optarg); break;
+			case 'r': slots = atol(optarg); break;
+			case 'u': path = optarg; break;
+			case 'd': deferred = 1; break;
+			case 'S': compare = 1; break;
+			case 'h': helpAndLeave(argv[0], EXIT_SUCCESS); break;
+			default: helpAndLeave(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	if (optind != argc || threads < 1 || messages < 1 || slots < 0)
+		helpAndLeave(argv[0], EXIT_FAILURE);
+
+	if (asyncLogInit("asynclog_bench", path, slots) == -1)
+		pexit("asyncLogInit");
+
+	ns = run(threads);
+	asyncLogShutdown();
+
+	printf("%-16s %.1f ns per call, %lu of %ld messages dropped\n",
+			deferred ? "asyncLogDeferred:" : "asyncLog:", ns, asyncLogDropped(), threads * messages);
+
+	if (compare) {
+		openlog("asynclog_bench", LOG_PID, LOG_USER);
+		useSyslog = 1;
+		printf("%-16s %.1f ns per call\n", "syslog:", run(threads));
+		closelog();
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+static void
+helpAndLeave(const char *progname, int status) {
+	FILE *stream = stderr;
+
+	if (status == EXIT_SUCCESS)
+		stream = stdout;
+
+	fprintf(stream, "Usage: %s [-t threads] [-n messages] [-r slots] [-u socket] [-d] [-S]\n", progname);
+	exit(status);
+}
+
+static void
+pexit(const char *fCall) {
+	perror(fCall);
+	exit(EXIT_FAILURE);
+}
+
+static void
+pthread_pexit(int err, const char *fCall) {
+	errno = err;
+	pexit(fCall);
+}
@@ -11,23 +11,40 @@
  * `LOG_PERROR` is used when logging so that the logged message can
  * be checked on standard error.
  *
+ * Logging a stream a line at a time that way takes a process per line. With
+ * -s, the lines of the standard input are logged instead, each as a message,
+ * by this process alone: they are read in bulk and written straight to the
+ * syslog socket (/dev/log), as RFC 5424 messages, in batches of datagrams
+ * sent with a single sendmmsg(2) call. All the messages of a batch share the
+ * same header (and timestamp). If the socket fails - the syslog daemon was
+ * restarted, say - it is reconnected to, and the batch sent again from the
+ * first message not delivered. Messages are not written to standard error.
+ *
  * Usage:
  *
  *   $ ./logger -i logger_test -l info "my log message"
+ *   $ tail -f app.log | ./logger -i app -s
  *   Options:
  *
  *   	-i: sets the program ident. Defaults to `_LOGGER`.
  *   	-l: sets the log level. Defaults to `info`. Accepted
  *   	values are: `emerg`, `alert`, `crit`, `err`, `warning`,
  *   	`notice`, `info` and `debug`.
+ *   	-s: log the lines of the standard input.
+ *   	-u: with -s, the socket to write to. Defaults to `/dev/log`.
+ *   	-b: with -s, the messages sent at a time. Defaults to 256.
  *
  * Author: Renato Mascarenhas Costa
  */
 
-#define _XOPEN_SOURCE /* getopt function */
+#define _GNU_SOURCE /* sendmmsg */
 
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <syslog.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,13 +52,26 @@
 
 #define DEFAULT_IDENT     ("_LOGGER")
 #define DEFAULT_LOG_LEVEL (LOG_INFO)
+#define DEFAULT_SOCKET    ("/dev/log")
+#define DEFAULT_BATCH     (256)
+#define MAX_BATCH         (1024)
+
+/* bytes of the standard input read at a time: also the longest message - longer
+ * lines are split */
+#define READ_SIZE   (64 * 1024)
+#define HEADER_SIZE (512)
+
+/* attempts to reconnect to the socket before giving up, a second apart */
+#define RECONNECTS  (30)
 
 #ifndef BUF_SIZ
 #  define BUF_SIZ (1024)
 #endif
 
 static void helpAndLeave(const char *progname, int status);
+static void pexit(const char *fCall);
 static int parse_level(const char *level, int *out);
+static void log_stream(const char *ident, int level, const char *path, int batch);
 
 int
 main(int argc, char *argv[]) {
@@ -50,12 +80,15 @@ main(int argc, char *argv[]) {
 
 	int opt;
 	int level   = DEFAULT_LOG_LEVEL;
+	int stream  = 0;
+	int batch   = DEFAULT_BATCH;
 	char *ident = DEFAULT_IDENT;
+	char *path  = DEFAULT_SOCKET;
 	char *message;
 
 	/* command-line parsing */
 	opterr = 0;
-	while ((opt = getopt(argc, argv, "+i:l:")) != -1) {
+	while ((opt = getopt(argc, argv, "+i:l:su:b:")) != -1) {
 		switch(opt) {
 			case '?': helpAndLeave(argv[0], EXIT_FAILURE); break;
 			case 'i': ident = optarg; break;
@@ -63,9 +96,20 @@ main(int argc, char *argv[]) {
 					  if ((parse_level(optarg, &level)) == -1)
 						  helpAndLeave(argv[0], EXIT_FAILURE);
 					  break;
+			case 's': stream = 1; break;
+			case 'u': path = optarg; break;
+			case 'b': batch = atoi(optarg); break;
 		}
 	}
 
+	if (stream) {
+		if (batch < 1 || batch > MAX_BATCH)
+			helpAndLeave(argv[0], EXIT_FAILURE);
+
+		log_stream(ident, level, path, batch);
+		return EXIT_SUCCESS;
+	}
+
 	message = argv[optind];
 	if (message == NULL)
 		helpAndLeave(argv[0], EXIT_FAILURE);
@@ -79,6 +123,153 @@ main(int argc, char *argv[]) {
 	return EXIT_SUCCESS;
 }
 
+/* Connects a datagram socket to the syslog socket at `path`, retrying for a while
+ * if it is not there (while the syslog daemon restarts). Returns the socket, or
+ * -1 on errors */
+static int
+connect_log(const char *path) {
+	struct sockaddr_un addr;
+	int sfd, attempt;
+
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	for (attempt = 0; attempt < RECONNECTS; ++attempt) {
+		if (attempt > 0)
+			sleep(1);
+
+		if ((sfd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1)
+			return -1;
+
+		if (connect(sfd, (struct sockaddr *) &addr, sizeof(struct sockaddr_un)) == 0)
+			return sfd;
+
+		close(sfd);
+		if (errno != ECONNREFUSED && errno != ENOENT)
+			return -1;
+	}
+
+	return -1;
+}
+
+/* Formats the RFC 5424 header of the messages sent now, up to the message
+ * itself: priority, version, timestamp, hostname, app name, process id, and
+ * no message id nor structured data.
+ */
+static int
+format_header(char *header, int level, const char *hostname, const char *ident) {
+	struct timespec ts;
+	struct tm tm;
+	char timestamp[32];
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	gmtime_r(&ts.tv_sec, &tm);
+	strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &tm);
+
+	return snprintf(header, HEADER_SIZE, "<%d>1 %s.%06ldZ %s %s %ld - - ",
+			LOG_USER | level, timestamp, ts.tv_nsec / 1000, hostname, ident, (long) getpid());
+}
+
+/* Sends the `n` messages of `msgs`, reconnecting if the socket fails. */
+static void
+send_batch(int *sfd, const char *path, struct mmsghdr *msgs, int n) {
+	int sent;
+
+	while (n > 0) {
+		sent = sendmmsg(*sfd, msgs, n, 0);
+
+		if (sent == -1) {
+			if (errno == EINTR)
+				continue;
+
+			/* the daemon went away: those not sent are sent again */
+			if (errno != ECONNREFUSED && errno != ENOTCONN && errno != ENOENT)
+				pexit("sendmmsg");
+
+			close(*sfd);
+			if ((*sfd = connect_log(path)) == -1)
+				pexit(path);
+			continue;
+		}
+
+		msgs += sent;
+		n -= sent;
+	}
+}
+
+/* Logs every line of the standard input, in batches of `batch` messages. */
+static void
+log_stream(const char *ident, int level, const char *path, int batch) {
+	static char buf[READ_SIZE];
+	struct mmsghdr msgs[MAX_BATCH];
+	struct iovec iovs[MAX_BATCH][2];
+	char header[HEADER_SIZE], hostname[256];
+	size_t len = 0, start, i;
+	ssize_t numRead;
+	int sfd, n, headerLen, eof = 0;
+
+	if (gethostname(hostname, sizeof(hostname)) == -1)
+		strcpy(hostname, "-");
+	hostname[sizeof(hostname) - 1] = '\0';
+
+	if ((sfd = connect_log(path)) == -1)
+		pexit(path);
+
+	memset(msgs, 0, sizeof(msgs));
+
+	while (!eof) {
+		numRead = read(STDIN_FILENO, buf + len, READ_SIZE - len);
+		if (numRead == -1) {
+			if (errno == EINTR)
+				continue;
+			pexit("read");
+		}
+
+		if (numRead == 0)
+			eof = 1;
+		len += numRead;
+
+		headerLen = format_header(header, level, hostname, ident);
+		start = 0;
+		n = 0;
+
+		/* every complete line - and the rest too at the end of the input, or
+		 * if a single line fills the buffer */
+		for (i = 0; i < len; ++i) {
+			if (buf[i] != '\n' && !(i == len - 1 && (eof || (len == READ_SIZE && start == 0))))
+				continue;
+
+			/* empty lines are not logged */
+			if (i == start && buf[i] == '\n') {
+				start = i + 1;
+				continue;
+			}
+
+			iovs[n][0].iov_base = header;
+			iovs[n][0].iov_len = headerLen;
+			iovs[n][1].iov_base = buf + start;
+			iovs[n][1].iov_len = i - start + (buf[i] != '\n');
+			msgs[n].msg_hdr.msg_iov = iovs[n];
+			msgs[n].msg_hdr.msg_iovlen = 2;
+			start = i + 1;
+
+			if (++n == batch) {
+				send_batch(&sfd, path, msgs, n);
+				n = 0;
+			}
+		}
+
+		send_batch(&sfd, path, msgs, n);
+
+		/* the beginning of a line yet to be read */
+		memmove(buf, buf + start, len - start);
+		len -= start;
+	}
+
+	close(sfd);
+}
+
 /* Parses a string indicating a log level and assigns the corresponding log level
  * constant to the `out` parameter.
  *
@@ -126,5 +317,12 @@ helpAndLeave(const char *progname, int status) {
 		stream = stdout;
 
 	fprintf(stream, "Usage: %s [-i ident] [-l level] message\n", progname);
+	fprintf(stream, "       %s [-i ident] [-l level] -s [-u socket] [-b batch]\n", progname);
 	exit(status);
 }
+
+static void
+pexit(const char *fCall) {
+	perror(fCall);
+	exit(EXIT_FAILURE);
+}
@@ -14,6 +14,14 @@
  *
  *    -u - the username of the user to run the given command as. Defaults to root.
  *
+ * The command is only given the standard streams: every other descriptor is
+ * closed before exec, with a single close_range(2) however high RLIMIT_NOFILE is
+ * (see lib/closefds.h).
+ *
+ * Built along with closefds.c:
+ *
+ *    $ gcc -o douser douser.c ../lib/closefds.c -lcrypt
+ *
  * Note: as this program requires access to the password and shadow files, it must
  * either be run as root or as set-user-ID-root (common approach for `sudo` on many
  * platforms.)
@@ -40,6 +48,8 @@
 #include <string.h>
 #include <stdbool.h>
 
+#include "../lib/closefds.h"
+
 #define MAX_PWD_LEN (1024)
 #define DEFAULT_USERNAME ("root")
 
@@ -104,7 +114,12 @@ main(int argc, char *argv[]) {
 	if (setregid(gid, gid) == -1)
 		pexit("setregid");
 
-	/* step 5. exec the given command */
+	/* step 5. do not leak descriptors of the invoker to the command */
+	int keep[] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	if (closeFdsExcept(keep, 3) == -1)
+		pexit("closeFdsExcept");
+
+	/* step 6. exec the given command */
 	file = argv[optind];
 	if (execvp(file, &argv[optind]) == -1)
 		pexit("execvp");
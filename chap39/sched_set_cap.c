@@ -14,18 +14,40 @@
  * super user privileges or being set-user-ID-root. However, the `CAP_SYS_NICE`
  * capability must be in the permitted capabilities set of this program.
  *
+ * Many processes can be changed at once - all the threads of a service, or of
+ * a cgroup, during an incident, say. The capability is raised once, and each
+ * of them takes a single sched_setscheduler(2) call. On Linux, the scheduling
+ * policy is a property of each thread: a pid is its main thread alone, and the
+ * targets can be:
+ *
+ * 	* pids (or tids) given as arguments, or read from a file (-f), one per
+ * 	  line;
+ * 	* with -t, all the threads of those pids, as listed in /proc/<pid>/task;
+ * 	* with -c, all the threads of a cgroup, as listed in its cgroup.threads
+ * 	  (cgroup v2) or tasks (v1) file.
+ *
+ * Threads that exit meanwhile are skipped. The others are all changed, even if
+ * some fail: the number of successes and failures is reported.
+ *
  * Usage:
  *
  * 	 # Setting the capabilities correctly
  * 	 $ sudo setcap "cap_sys_nice=p" ./sched_set_cap
  * 	 root's password:
  * 	 $ ./sched_set_cap f 10 <pid>
+ * 	 $ ./sched_set_cap -t f 10 <pid>...
+ * 	 $ ./sched_set_cap -f pids.txt r 5
+ * 	 $ ./sched_set_cap -c /sys/fs/cgroup/system.slice/db.service f 20
  *
  * 	 Options are:
  * 	 	* policy:   r (round-robin), f (FIFO), b (BATCH), i (IDLE), o (OTHER).
  * 	 	            Subject to support on the running platform.
  * 	 	* priority: the numerical value of the process' priority.
- * 	 	* pid:      the identifier of the process to be affected.
+ * 	 	* pid:      the identifiers of the processes to be affected.
+ * 	 	* -f file:  read pids from `file` ("-" for the standard input).
+ * 	 	* -t:       affect all the threads of each pid.
+ * 	 	* -c dir:   affect all the threads of the cgroup at `dir`.
+ * 	 	* -v:       tell about every target changed.
  *
  * Source code is heavily based on listing 35-2 of the Linux Programming Interface
  * book, with modifications to support capabilities.
@@ -35,11 +57,26 @@
 
 #include <sched.h>
 #include <sys/capability.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
 
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+
+#define PROC_TASKS "/proc/%ld/task"
+#define PATH_LEN (4096)
+
+/* the processes or threads to be affected */
+struct targets {
+	pid_t *ids;
+	size_t len;
+	size_t capacity;
+};
 
 static void helpAndLeave(const char *progname, int status);
 static void pexit(const char *fname);
@@ -48,41 +85,171 @@ static long readLong(const char *str);
 static int requireCapability(int capability);
 static int dropAllCapabilities(void);
 
+static void
+addTarget(struct targets *t, pid_t id) {
+	pid_t *ids;
+
+	if (t->len == t->capacity) {
+		t->capacity = t->capacity ? t->capacity * 2 : 64;
+		ids = realloc(t->ids, t->capacity * sizeof(pid_t));
+		if (ids == NULL)
+			pexit("realloc");
+		t->ids = ids;
+	}
+
+	t->ids[t->len++] = id;
+}
+
+/* adds the ids listed in `fp`, one per line */
+static void
+addFromStream(struct targets *t, FILE *fp, const char *name) {
+	long id;
+	int n;
+
+	while ((n = fscanf(fp, "%ld", &id)) == 1)
+		addTarget(t, id);
+
+	if (n != EOF || ferror(fp)) {
+		fprintf(stderr, "%s: not a list of ids\n", name);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void
+addFromFile(struct targets *t, const char *path) {
+	FILE *fp;
+
+	if (!strcmp(path, "-")) {
+		addFromStream(t, stdin, "stdin");
+		return;
+	}
+
+	if ((fp = fopen(path, "r")) == NULL)
+		pexit(path);
+
+	addFromStream(t, fp, path);
+	fclose(fp);
+}
+
+/* adds all the threads of `pid`. Returns -1 if it does not exist (anymore) */
+static int
+addThreads(struct targets *t, long pid) {
+	char path[PATH_LEN];
+	struct dirent *entry;
+	DIR *dir;
+
+	snprintf(path, PATH_LEN, PROC_TASKS, pid);
+	if ((dir = opendir(path)) == NULL)
+		return -1;
+
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] != '.')
+			addTarget(t, atol(entry->d_name));
+	}
+
+	closedir(dir);
+	return 0;
+}
+
+/* adds all the threads of the cgroup at `dir`: cgroup.threads lists them in
+ * cgroup v2, and tasks in v1 */
+static void
+addCgroup(struct targets *t, const char *dir) {
+	char path[PATH_LEN];
+	FILE *fp;
+
+	snprintf(path, PATH_LEN, "%s/cgroup.threads", dir);
+	if ((fp = fopen(path, "r")) == NULL && errno == ENOENT) {
+		snprintf(path, PATH_LEN, "%s/tasks", dir);
+		fp = fopen(path, "r");
+	}
+
+	if (fp == NULL)
+		pexit(path);
+
+	addFromStream(t, fp, path);
+	fclose(fp);
+}
+
 int
 main(int argc, char *argv[]) {
-	int pol;
+	int pol, opt;
 	struct sched_param sp;
-	long prio, pid;
-
-	if (argc < 3 || strchr("rfobi", argv[1][0]) == NULL)
+	struct targets given = { NULL, 0, 0 }, targets = { NULL, 0, 0 };
+	long prio, changed = 0, gone = 0, failed = 0;
+	bool threads = false, verbose = false;
+	size_t i;
+
+	while ((opt = getopt(argc, argv, "+f:tc:vh")) != -1) {
+		switch (opt) {
+			case 'f': addFromFile(&given, optarg); break;
+			case 't': threads = true; break;
+			case 'c': addCgroup(&targets, optarg); break;
+			case 'v': verbose = true; break;
+			case 'h': helpAndLeave(argv[0], EXIT_SUCCESS); break;
+			default: helpAndLeave(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	if (argc - optind < 2 || strchr("rfobi", argv[optind][0]) == NULL)
 		helpAndLeave(argv[0], EXIT_FAILURE);
 
-	pol = (argv[1][0] == 'r') ? SCHED_RR :
-		(argv[1][0] == 'f') ? SCHED_FIFO :
+	pol = (argv[optind][0] == 'r') ? SCHED_RR :
+		(argv[optind][0] == 'f') ? SCHED_FIFO :
 #ifdef SCHED_BATCH
-		(argv[1][0] == 'b') ? SCHED_BATCH :
+		(argv[optind][0] == 'b') ? SCHED_BATCH :
 #endif
 #ifdef SCHED_IDLE
-		(argv[1][0] == 'i') ? SCHED_IDLE :
+		(argv[optind][0] == 'i') ? SCHED_IDLE :
 #endif
 		SCHED_OTHER;
 
-	prio = readLong(argv[2]);
-	pid  = readLong(argv[3]);
+	prio = readLong(argv[optind + 1]);
+
+	for (i = optind + 2; i < (size_t) argc; ++i)
+		addTarget(&given, readLong(argv[i]));
+
+	/* the threads of each pid given, or the pid itself */
+	for (i = 0; i < given.len; ++i) {
+		if (!threads)
+			addTarget(&targets, given.ids[i]);
+		else if (addThreads(&targets, given.ids[i]) == -1)
+			++gone;
+	}
+
+	if (targets.len == 0 && gone == 0)
+		helpAndLeave(argv[0], EXIT_FAILURE);
 
 	sp.sched_priority = prio;
 
+	/* once, for all the targets */
 	if (requireCapability(CAP_SYS_NICE) == -1)
 		pexit("requireCapability");
 
-	if (sched_setscheduler(pid, pol, &sp) == -1)
-		pexit("sched_setscheduler");
+	for (i = 0; i < targets.len; ++i) {
+		if (sched_setscheduler(targets.ids[i], pol, &sp) == 0) {
+			++changed;
+			if (verbose)
+				printf("%ld\n", (long) targets.ids[i]);
+		} else if (errno == ESRCH) {
+			++gone;
+		} else {
+			++failed;
+			fprintf(stderr, "sched_setscheduler %ld: %s\n", (long) targets.ids[i], strerror(errno));
+		}
+	}
 
 	if (dropAllCapabilities() == -1)
 		pexit("dropAllCapabilities");
 
-	printf("Successfully updated process %ld.\n", pid);
-	exit(EXIT_SUCCESS);
+	if (targets.len == 1 && changed == 1)
+		printf("Successfully updated process %ld.\n", (long) targets.ids[0]);
+	else
+		printf("Updated %ld, gone %ld, failed %ld.\n", changed, gone, failed);
+
+	free(given.ids);
+	free(targets.ids);
+	exit((failed || changed == 0) ? EXIT_FAILURE : EXIT_SUCCESS);
 }
 
 static int
@@ -134,7 +301,7 @@ helpAndLeave(const char *progname, int status) {
 	if (status == EXIT_SUCCESS)
 		stream = stdout;
 
-	fprintf(stream, "Usage: %s <policy> <priority> <pid>\n", progname);
+	fprintf(stream, "Usage: %s [-f file] [-t] [-c cgroup] [-v] <policy> <priority> [pid...]\n", progname);
 	fprintf(stream, "policy is:\n\t'r' (Round-Robin)\n\t'f' (FIFO)"
 #ifdef SCHED_BATCH
 			"\n\t'b' (BATCH)"
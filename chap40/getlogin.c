@@ -7,6 +7,9 @@
  * This is accomplished by checking the name of the terminal controlling
  * the calling process and then reading the `utmp` file for login information.
  *
+ * The utmp file is read through a memory mapping (see utmpmap.c), from the newest
+ * record back, rather than a record at a time with `getutxline(3)`.
+ *
  * This function might not work as expected for some terminal emulators.
  * Using a virtual console should be enough to test its functionality.
  *
@@ -14,6 +17,10 @@
  *
  *    $ ./getlogin
  *
+ * Built along with the reader:
+ *
+ *    $ gcc -o getlogin getlogin.c utmpmap.c
+ *
  * Author: Renato Mascarenhas Costa
  */
 
@@ -27,6 +34,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "utmpmap.h"
+
 #ifndef GETLOGIN_LOGIN_MAX
 #  define GETLOGIN_LOGIN_MAX (256)
 #endif
@@ -62,17 +71,10 @@ _getlogin() {
 	/* the static data structure used for all calls to this function */
 	static char login[GETLOGIN_LOGIN_MAX];
 
-	utmpname(GETLOGIN_UTMP_FILE);
-
-	/* search for an entry in the utmp file where the ut_line field matches
-	 * that of the controlling terminal name */
-	errno = 0;
-	setutxent();
-	if (errno != 0)
-		return NULL;
-
-	struct utmpx *entry, criteria;
+	struct utmpMap map;
+	const struct utmpx *entry;
 	char *line;
+	size_t cursor;
 
 	/* drop the leading slash, if any */
 	if (tty[0] == '/')
@@ -85,18 +87,29 @@ _getlogin() {
 		/* dev/pts/0 becomes pts/0 */
 		++line;
 
-	strncpy(criteria.ut_line, line, __UT_LINESIZE);
-	if ((entry = getutxline(&criteria)) == NULL)
+	if (utmpMapOpen(&map, GETLOGIN_UTMP_FILE) == -1)
 		return NULL;
 
-	strncpy(login, entry->ut_user, GETLOGIN_LOGIN_MAX);
-
-	/* finish the reading of the utmp file */
-	errno = 0;
-	endutxent();
-	if (errno != 0)
+	/* search for an entry in the utmp file where the ut_line field matches
+	 * that of the controlling terminal name - the latest, if there are more
+	 * than one, as the file is searched from its end */
+	cursor = map.count;
+	while ((entry = utmpMapPrev(&map, &cursor)) != NULL) {
+		if ((entry->ut_type == LOGIN_PROCESS || entry->ut_type == USER_PROCESS) &&
+		    strncmp(entry->ut_line, line, __UT_LINESIZE) == 0)
+			break;
+	}
+
+	if (entry == NULL) {
+		utmpMapClose(&map);
+		errno = ENOENT;
 		return NULL;
+	}
+
+	/* the field is not null terminated if it fills the whole array */
+	snprintf(login, GETLOGIN_LOGIN_MAX, "%.*s", (int) sizeof(entry->ut_user), entry->ut_user);
 
+	utmpMapClose(&map);
 	return login;
 }
 
@@ -14,14 +14,22 @@
  *    utmp_file - the path for the utmp file to be used. Default: _PATH_UTMP
  *    wtmp_file - the path for the wtmp file to be used. Default: _PATH_WTMP
  *
+ * The files are updated through the session manager of session.c, which finds
+ * the record of the terminal line in the utmp file through an index, rather than
+ * by searching the file.
+ *
  * After program execution, the user identified by the given username will be
  * have an entry on the utmp file. The `last(1)` command can be used to verify
  * its effect.
  *
+ * Built along with the session manager:
+ *
+ *    $ gcc -o login login.c session.c
+ *
  * Author: Renato Mascarenhas Costa
  */
 
-#define _GNU_SOURCE /* updwtmpx */
+#define _GNU_SOURCE /* struct utmpx fields, as used by session.h */
 
 #include <sys/types.h>
 #include <unistd.h>
@@ -33,10 +41,12 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "session.h"
+
 static void helpAndLeave(const char *progname, int status);
 static void pexit(const char *fname);
 
-static void _login(const struct utmpx *ut);
+static void _login(struct sessionManager *sm, const struct utmpx *ut);
 
 char *utmp_file = _PATH_UTMP,
 	 *wtmp_file = _PATH_WTMP;
@@ -54,19 +64,27 @@ main(int argc, char *argv[]) {
 	if (argc > 3)
 		wtmp_file = argv[3];
 
-	utmpname(utmp_file);
+	struct sessionManager sm;
+	if (sessionOpen(&sm, utmp_file, wtmp_file, 1, 0) == -1)
+		pexit("sessionOpen");
+
 	struct utmpx ut;
+	memset(&ut, 0, sizeof(struct utmpx));
 	strncpy(ut.ut_user, username, __UT_NAMESIZE);
 
-	_login(&ut);
+	_login(&sm, &ut);
+
+	if (sessionClose(&sm) == -1)
+		pexit("sessionClose");
 
 	printf("Username %s has been logged in.\n", username);
 	exit(EXIT_SUCCESS);
 }
 
 static void
-_login(const struct utmpx *ut) {
+_login(struct sessionManager *sm, const struct utmpx *ut) {
 	struct utmpx record;
+	memset(&record, 0, sizeof(struct utmpx));
 	strncpy(record.ut_user, ut->ut_user, __UT_NAMESIZE);
 
 	/* fill in basic information */
@@ -97,12 +115,9 @@ _login(const struct utmpx *ut) {
 		strncpy(record.ut_line, tty, __UT_LINESIZE);
 	}
 
-	/* commit the record to the utmp file */
-	if (pututxline(&record) == NULL)
-		pexit("pututxline");
-
-	/* commit the record to the wtmp file */
-	updwtmpx(wtmp_file, &record);
+	/* commit the record to the utmp and wtmp files */
+	if (sessionLogin(sm, &record) == -1)
+		pexit("sessionLogin");
 }
 
 static void
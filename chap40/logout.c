@@ -8,6 +8,10 @@
  * added entry on the utmp file, indicating that a user is no longer
  * logged in the system.
  *
+ * The files are updated through the session manager of session.c, which finds
+ * the record of the terminal line in the utmp file through an index, rather than
+ * by searching the file.
+ *
  * Usage
  *
  *    $ ./logout <ut_line> [utmp_file] [wtmp_file]
@@ -22,27 +26,32 @@
  * After program execution, the `last(1)` command can be used to verify
  * its effect.
  *
+ * Built along with the session manager:
+ *
+ * 	  $ gcc -o logout logout.c session.c
+ *
  * Author: Renato Mascarenhas Costa
  */
 
-#define _GNU_SOURCE /* updwtmpx */
+#define _GNU_SOURCE /* struct utmpx fields, as used by session.h */
 
 #include <sys/types.h>
 #include <unistd.h>
 #include <utmpx.h>
 #include <utmp.h>
 #include <paths.h>
-#include <errno.h>
 #include <time.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "session.h"
+
 static void helpAndLeave(const char *progname, int status);
 static void pexit(const char *fname);
 
-static int _logout(const char *ut_line);
+static int _logout(struct sessionManager *sm, const char *ut_line);
 
 static char *utmp_file = _PATH_UTMP,
 			*wtmp_file = _PATH_WTMP;
@@ -60,59 +69,26 @@ main(int argc, char *argv[]) {
 	if (argc > 3)
 		wtmp_file = argv[3];
 
-	utmpname(utmp_file);
-	if (_logout(ut_line) == 0)
+	struct sessionManager sm;
+	if (sessionOpen(&sm, utmp_file, wtmp_file, 1, 0) == -1)
+		pexit("sessionOpen");
+
+	if (_logout(&sm, ut_line) == 0)
 		pexit("_logout");
 
+	if (sessionClose(&sm) == -1)
+		pexit("sessionClose");
+
 	printf("%s has been logged out.\n", ut_line);
 	exit(EXIT_SUCCESS);
 }
 
 static int
-_logout(const char *ut_line) {
-	struct utmpx ut,
-				*entry;
-
-	strncpy(ut.ut_line, ut_line, __UT_LINESIZE);
-
-	errno = 0;
-	setutxent();
-	if (errno != 0)
-		return 0;
-
-	/* if an entry for the given line is found, erase it.
-	 * Otherwise, just return successfully. */
-	if ((entry = getutxline(&ut)) == NULL)
-		return 1;
-
-	/* erase ut_user and ut_host fields. */
-	memset(&entry->ut_user, 0, sizeof(entry->ut_user));
-	memset(&entry->ut_host, 0, sizeof(entry->ut_host));
-
-	/* update timestamp */
-	time((time_t *) &entry->ut_tv.tv_sec);
-
-	/* indicates that a logout is happening */
-	entry->ut_type = DEAD_PROCESS;
-
-	errno = 0;
-	setutxent();
-	if (errno != 0)
-		return 0;
-
-	/* commit the change to the utmp file */
-	if (pututxline(entry) == NULL)
-		return 0;
-
-	errno = 0;
-	endutxent();
-	if (errno != 0)
-		return 0;
-
-	/* commit the change to the wtmp file */
-	updwtmpx(wtmp_file, entry);
-
-	return 1;
+_logout(struct sessionManager *sm, const char *ut_line) {
+	/* if an entry for the given line is found, erase it, setting its type to
+	 * DEAD_PROCESS, and record the logout in the wtmp file. Otherwise, just
+	 * return successfully. */
+	return sessionLogout(sm, ut_line) != -1;
 }
 
 static void
@@ -8,23 +8,37 @@
  *
  * Usage
  *
- *    $ ./logout <line> <name> <host> [wtmp_file]
+ *    $ ./logwtmp [-b batch] [-s sync_ms] <line> <name> <host> [wtmp_file]
+ *    $ ./logwtmp [-b batch] [-s sync_ms] - [wtmp_file]
  *    line 		- the name of the controlling terminal of the running shell.
  *    name 		- the username to be recorded. Not validated to exist.
  *    host 		- the name of the host.
  *    wtmp_file - The path for th wtmp log to be updated. Default: _PATH_WTMP
+ *    -         - read the records from stdin instead, one per line, as
+ *                `<line> <name> <host>` (with `-` for an empty name).
+ *    -b        - the number of records written to the file at once (default: 256).
+ *    -s        - how often the file is synced to disk, in milliseconds (default:
+ *                1000; 0 syncs on every write, -1 never).
+ *
+ * Records are appended through the session manager of session.c, which keeps the
+ * file open, and writes records in batches: that makes a difference if there are
+ * many of them (read from stdin).
  *
  * Example
  *
  * 	  $ ./logwtmp pts/2 jake localhost /var/log/wtmp
  *
+ * Built along with the session manager:
+ *
+ * 	  $ gcc -o logwtmp logwtmp.c session.c
+ *
  * After program execution, the `last(1)` command can be used to verify
  * its effect.
  *
  * Author: Renato Mascarenhas Costa
  */
 
-#define _GNU_SOURCE /* updwtmpx */
+#define _GNU_SOURCE /* struct utmpx fields, as used by session.h */
 
 #include <sys/types.h>
 #include <unistd.h>
@@ -37,51 +51,82 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "session.h"
+
+#define LOGWTMP_BATCH (256)
+#define LOGWTMP_SYNC_MS (1000)
+
 static void helpAndLeave(const char *progname, int status);
 
 static char *wtmp_file = _PATH_WTMP;
 
-static void _logwtmp(const char *line, const char *name, const char *host);
+static void pexit(const char *fname);
+
+static void _logwtmp(struct sessionManager *sm, const char *line, const char *name, const char *host);
 
 int
 main(int argc, char *argv[]) {
-	if (argc < 4)
+	struct sessionManager sm;
+	char buf[__UT_LINESIZE + __UT_NAMESIZE + __UT_HOSTSIZE + 8];
+	char line[__UT_LINESIZE + 1], name[__UT_NAMESIZE + 1], host[__UT_HOSTSIZE + 1];
+	long batch = LOGWTMP_BATCH, syncInterval = LOGWTMP_SYNC_MS, count = 0;
+	int opt, fromStdin;
+
+	while ((opt = getopt(argc, argv, "b:s:h")) != -1) {
+		switch (opt) {
+			case 'b': batch = atol(optarg); break;
+			case 's': syncInterval = atol(optarg); break;
+			case 'h': helpAndLeave(argv[0], EXIT_SUCCESS); break;
+			default: helpAndLeave(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	fromStdin = argc > optind && strcmp(argv[optind], "-") == 0;
+	if (batch < 1 || (!fromStdin && argc < optind + 3))
 		helpAndLeave(argv[0], EXIT_FAILURE);
 
-	if (argc > 4)
-		wtmp_file = argv[4];
+	if (argc > optind + (fromStdin ? 1 : 3))
+		wtmp_file = argv[optind + (fromStdin ? 1 : 3)];
 
-	_logwtmp(argv[1], argv[2], argv[3]);
-	printf("Information successfully updated.\n");
+	/* the utmp file is not used, but it is opened (and indexed) by the session
+	 * manager still */
+	if (sessionOpen(&sm, _PATH_UTMP, wtmp_file, batch, syncInterval) == -1)
+		pexit("sessionOpen");
 
-	exit(EXIT_SUCCESS);
-}
+	if (!fromStdin) {
+		_logwtmp(&sm, argv[optind], argv[optind + 1], argv[optind + 2]);
+		count = 1;
+	} else {
+		while (fgets(buf, sizeof(buf), stdin) != NULL) {
+			if (sscanf(buf, "%32s %32s %256s", line, name, host) != 3) {
+				fprintf(stderr, "Ignoring invalid record: %s", buf);
+				continue;
+			}
 
-static void
-_logwtmp(const char *line, const char *name, const char *host) {
-	struct utmpx ut;
+			_logwtmp(&sm, line, strcmp(name, "-") == 0 ? "" : name, host);
+			++count;
+		}
+	}
 
-	/* copy given data to the record */
-	strncpy(ut.ut_line, line, __UT_LINESIZE);
-	strncpy(ut.ut_name, name, __UT_NAMESIZE);
-	strncpy(ut.ut_host, host, __UT_HOSTSIZE);
+	if (sessionClose(&sm) == -1)
+		pexit("sessionClose");
 
-	/* use current time */
-	time((time_t *) &ut.ut_tv.tv_sec);
+	printf("Information successfully updated (%ld records).\n", count);
 
-	/* use current process ID */
-	ut.ut_pid = getpid();
+	exit(EXIT_SUCCESS);
+}
 
+static void
+_logwtmp(struct sessionManager *sm, const char *line, const char *name, const char *host) {
 	/* according to the specs, if the `name` parameter is not an empty string,
 	 * the record should have type `USER_PROCESS`; otherwise it should be
 	 * `DEAD_PROCESS`.
 	 *
 	 * https://refspecs.linuxbase.org/LSB_3.0.0/LSB-PDA/LSB-PDA/baselib-logwtmp-3.html
-	 */
-	ut.ut_type = strlen(name) == 0 ? DEAD_PROCESS : USER_PROCESS;
-
-	/* use `updwtmp` to update the `wtmp` log file */
-	updwtmpx(wtmp_file, &ut);
+	 *
+	 * The record gets the current time and the current process ID */
+	if (sessionLogwtmp(sm, line, name, host) == -1)
+		pexit("sessionLogwtmp");
 }
 
 static void
@@ -91,6 +136,12 @@ helpAndLeave(const char *progname, int status) {
 	if (status == EXIT_SUCCESS)
 		stream = stdout;
 
-	fprintf(stream, "Usage: %s <line> <name> <host> [wtmp_file]\n", progname);
+	fprintf(stream, "Usage: %s [-b batch] [-s sync_ms] <line> <name> <host> | - [wtmp_file]\n", progname);
 	exit(status);
 }
+
+static void
+pexit(const char *fname) {
+	perror(fname);
+	exit(EXIT_FAILURE);
+}
@@ -0,0 +1,408 @@
+/* session.c - Keeps the login accounting records of many sessions. See session.h.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _GNU_SOURCE /* fdatasync */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utmpx.h>
+#include <errno.h>
+#include <time.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "session.h"
+
+#define READ_RECORDS (1024) /* utmp records read at a time when indexing */
+
+static long long
+now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static size_t
+hashLine(const char *line) {
+	size_t h = 2166136261u;
+	int i;
+
+	/* FNV-1a; lines are not null terminated if they fill the whole field */
+	for (i = 0; i < __UT_LINESIZE && line[i] != '\0'; ++i)
+		h = (h ^ (unsigned char) line[i]) * 16777619u;
+
+	return h;
+}
+
+/* the slot of `line` in the index, or the free one where it would go */
+static size_t *
+findSlot(struct sessionManager *sm, const char *line) {
+	size_t i = hashLine(line) & (sm->indexCapacity - 1);
+
+	while (sm->index[i] != 0 && strncmp(sm->lines[sm->index[i] - 1], line, __UT_LINESIZE) != 0)
+		i = (i + 1) & (sm->indexCapacity - 1);
+
+	return &sm->index[i];
+}
+
+/* adds record `n`, of `line`, to the index - unless the line has a record
+ * already: as with getutxline(3), the first one is that of the line */
+static int
+indexRecord(struct sessionManager *sm, size_t n, const char *line) {
+	size_t *index, *slot, i, capacity;
+	char (*lines)[__UT_LINESIZE];
+
+	if (n >= sm->linesCapacity) {
+		capacity = (sm->linesCapacity == 0) ? 64 : 2 * sm->linesCapacity;
+		while (capacity <= n)
+			capacity *= 2;
+
+		lines = realloc(sm->lines, capacity * __UT_LINESIZE);
+		if (lines == NULL)
+			return -1;
+
+		sm->lines = lines;
+		sm->linesCapacity = capacity;
+	}
+
+	memcpy(sm->lines[n], line, __UT_LINESIZE);
+	if (n >= sm->records)
+		sm->records = n + 1;
+
+	if (line[0] == '\0')
+		return 0;
+
+	/* keep the index at most half full */
+	if (2 * sm->records > sm->indexCapacity) {
+		index = sm->index;
+		capacity = sm->indexCapacity;
+
+		sm->indexCapacity = 2 * capacity;
+		while (sm->indexCapacity < 2 * sm->records)
+			sm->indexCapacity *= 2;
+
+		sm->index = calloc(sm->indexCapacity, sizeof(size_t));
+		if (sm->index == NULL) {
+			sm->index = index;
+			sm->indexCapacity = capacity;
+			return -1;
+		}
+
+		for (i = 0; i < capacity; ++i)
+			if (index[i] != 0)
+				*findSlot(sm, sm->lines[index[i] - 1]) = index[i];
+
+		free(index);
+	}
+
+	slot = findSlot(sm, line);
+	if (*slot == 0)
+		*slot = n + 1;
+
+	return 0;
+}
+
+/* (re)builds the index from the contents of the utmp file */
+static int
+buildIndex(struct sessionManager *sm) {
+	struct utmpx records[READ_RECORDS];
+	ssize_t numRead;
+	size_t i, n;
+
+	if (sm->index != NULL)
+		memset(sm->index, 0, sm->indexCapacity * sizeof(size_t));
+	sm->records = 0;
+
+	for (n = 0; ; n += numRead / sizeof(struct utmpx)) {
+		numRead = pread(sm->utmpFd, records, sizeof(records), n * sizeof(struct utmpx));
+		if (numRead == -1)
+			return -1;
+
+		if ((size_t) numRead < sizeof(struct utmpx))
+			return 0;
+
+		for (i = 0; i < numRead / sizeof(struct utmpx); ++i)
+			if (indexRecord(sm, n + i, records[i].ut_line) == -1)
+				return -1;
+	}
+}
+
+/* reads record `n` of the utmp file, if it is still that of `line`. Returns 0
+ * if it is not, -1 on errors */
+static int
+readRecord(struct sessionManager *sm, size_t n, const char *line, struct utmpx *ut) {
+	ssize_t numRead;
+
+	numRead = pread(sm->utmpFd, ut, sizeof(struct utmpx), n * sizeof(struct utmpx));
+	if (numRead == -1)
+		return -1;
+
+	return (size_t) numRead == sizeof(struct utmpx) && strncmp(ut->ut_line, line, __UT_LINESIZE) == 0;
+}
+
+/* the record of `line` in the utmp file, read into `ut`, if any. Returns its
+ * number, or -1 if there is none (and on errors, with `errno` set) */
+static long
+findRecord(struct sessionManager *sm, const char *line, struct utmpx *ut) {
+	size_t *slot;
+	int s, rebuilt = 0;
+
+	for (;;) {
+		errno = 0;
+		slot = findSlot(sm, line);
+
+		if (*slot != 0) {
+			s = readRecord(sm, *slot - 1, line, ut);
+			if (s == -1)
+				return -1;
+			if (s == 1)
+				return (long) *slot - 1;
+		}
+
+		/* not where it used to be, or not known: someone else may have changed
+		 * the file, so look again before giving up */
+		if (rebuilt || (*slot == 0 && sm->records * sizeof(struct utmpx) == (size_t) lseek(sm->utmpFd, 0, SEEK_END)))
+			return -1;
+
+		if (buildIndex(sm) == -1)
+			return -1;
+		rebuilt = 1;
+	}
+}
+
+/* writes record `n` of the utmp file, with the record locked */
+static int
+writeRecord(struct sessionManager *sm, size_t n, const struct utmpx *ut) {
+	struct flock lock;
+	ssize_t numWritten;
+	int savedErrno;
+
+	memset(&lock, 0, sizeof(struct flock));
+	lock.l_type = F_WRLCK;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = n * sizeof(struct utmpx);
+	lock.l_len = sizeof(struct utmpx);
+
+	if (fcntl(sm->utmpFd, F_SETLKW, &lock) == -1)
+		return -1;
+
+	numWritten = pwrite(sm->utmpFd, ut, sizeof(struct utmpx), n * sizeof(struct utmpx));
+	savedErrno = errno;
+
+	lock.l_type = F_UNLCK;
+	fcntl(sm->utmpFd, F_SETLK, &lock);
+
+	if (numWritten != sizeof(struct utmpx)) {
+		errno = (numWritten == -1) ? savedErrno : EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* queues a record to be appended to wtmp */
+static int
+appendWtmp(struct sessionManager *sm, const struct utmpx *ut) {
+	if (sm->pendingCount == sm->batch && sessionFlush(sm) == -1)
+		return -1;
+
+	sm->pending[sm->pendingCount++] = *ut;
+
+	return (sm->pendingCount == sm->batch) ? sessionFlush(sm) : 0;
+}
+
+int
+sessionOpen(struct sessionManager *sm, const char *utmpFile, const char *wtmpFile,
+            size_t batch, long syncInterval) {
+	memset(sm, 0, sizeof(struct sessionManager));
+	sm->utmpFd = sm->wtmpFd = -1;
+	sm->batch = (batch == 0) ? 1 : batch;
+	sm->syncInterval = syncInterval;
+	sm->lastSync = now();
+
+	sm->pending = malloc(sm->batch * sizeof(struct utmpx));
+	if (sm->pending == NULL)
+		return -1;
+
+	/* never empty, so that lookups always have somewhere to look */
+	sm->indexCapacity = 128;
+	sm->index = calloc(sm->indexCapacity, sizeof(size_t));
+	if (sm->index == NULL)
+		goto fail;
+
+	sm->utmpFd = open(utmpFile, O_RDWR | O_CREAT | O_CLOEXEC, 0664);
+	if (sm->utmpFd == -1)
+		goto fail;
+
+	sm->wtmpFd = open(wtmpFile, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0664);
+	if (sm->wtmpFd == -1)
+		goto fail;
+
+	if (buildIndex(sm) == -1)
+		goto fail;
+
+	return 0;
+
+fail:
+	sessionClose(sm);
+	return -1;
+}
+
+int
+sessionLogin(struct sessionManager *sm, const struct utmpx *ut) {
+	struct utmpx record, old;
+	struct timeval tv;
+	long n;
+
+	memset(&record, 0, sizeof(struct utmpx));
+	strncpy(record.ut_line, ut->ut_line, __UT_LINESIZE);
+	strncpy(record.ut_user, ut->ut_user, __UT_NAMESIZE);
+	strncpy(record.ut_host, ut->ut_host, __UT_HOSTSIZE);
+	memcpy(record.ut_id, ut->ut_id, sizeof(record.ut_id));
+
+	record.ut_type = USER_PROCESS;
+	record.ut_pid = (ut->ut_pid != 0) ? ut->ut_pid : getpid();
+
+	gettimeofday(&tv, NULL);
+	record.ut_tv.tv_sec = tv.tv_sec;
+	record.ut_tv.tv_usec = tv.tv_usec;
+
+	/* the line takes its record, or a new one at the end of the file */
+	n = findRecord(sm, record.ut_line, &old);
+	if (n == -1) {
+		if (errno != 0)
+			return -1;
+
+		n = (long) sm->records;
+		if (indexRecord(sm, n, record.ut_line) == -1)
+			return -1;
+	}
+
+	if (writeRecord(sm, n, &record) == -1)
+		return -1;
+
+	return appendWtmp(sm, &record);
+}
+
+int
+sessionLogout(struct sessionManager *sm, const char *line) {
+	struct utmpx entry;
+	struct timeval tv;
+	char key[__UT_LINESIZE];
+	long n;
+
+	memset(key, 0, __UT_LINESIZE);
+	memcpy(key, line, strnlen(line, __UT_LINESIZE));
+
+	n = findRecord(sm, key, &entry);
+	if (n == -1)
+		return (errno == 0) ? 0 : -1;
+
+	/* only sessions are logged out */
+	if (entry.ut_type != USER_PROCESS && entry.ut_type != LOGIN_PROCESS)
+		return 0;
+
+	/* erase ut_user and ut_host fields */
+	memset(&entry.ut_user, 0, sizeof(entry.ut_user));
+	memset(&entry.ut_host, 0, sizeof(entry.ut_host));
+
+	/* update timestamp */
+	gettimeofday(&tv, NULL);
+	entry.ut_tv.tv_sec = tv.tv_sec;
+	entry.ut_tv.tv_usec = tv.tv_usec;
+
+	/* indicates that a logout is happening */
+	entry.ut_type = DEAD_PROCESS;
+
+	if (writeRecord(sm, n, &entry) == -1 || appendWtmp(sm, &entry) == -1)
+		return -1;
+
+	return 1;
+}
+
+int
+sessionLogwtmp(struct sessionManager *sm, const char *line, const char *name, const char *host) {
+	struct utmpx ut;
+	struct timeval tv;
+
+	memset(&ut, 0, sizeof(struct utmpx));
+	strncpy(ut.ut_line, line, __UT_LINESIZE);
+	strncpy(ut.ut_user, name, __UT_NAMESIZE);
+	strncpy(ut.ut_host, host, __UT_HOSTSIZE);
+
+	gettimeofday(&tv, NULL);
+	ut.ut_tv.tv_sec = tv.tv_sec;
+	ut.ut_tv.tv_usec = tv.tv_usec;
+	ut.ut_pid = getpid();
+	ut.ut_type = (name[0] == '\0') ? DEAD_PROCESS : USER_PROCESS;
+
+	return appendWtmp(sm, &ut);
+}
+
+int
+sessionFlush(struct sessionManager *sm) {
+	const char *p = (const char *) sm->pending;
+	size_t left = sm->pendingCount * sizeof(struct utmpx);
+	ssize_t numWritten;
+
+	/* all the records at once: with O_APPEND, they end up together, even with
+	 * other processes appending to the file as well */
+	while (left > 0) {
+		numWritten = write(sm->wtmpFd, p, left);
+		if (numWritten == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		p += numWritten;
+		left -= numWritten;
+	}
+
+	if (sm->pendingCount > 0)
+		sm->unsynced = 1;
+	sm->pendingCount = 0;
+
+	if (sm->unsynced && sm->syncInterval >= 0 && now() - sm->lastSync >= sm->syncInterval) {
+		if (fdatasync(sm->wtmpFd) == -1)
+			return -1;
+
+		sm->lastSync = now();
+		sm->unsynced = 0;
+	}
+
+	return 0;
+}
+
+int
+sessionClose(struct sessionManager *sm) {
+	int status = 0;
+
+	if (sm->wtmpFd != -1) {
+		/* whatever the policy, the records are synced when done */
+		sm->syncInterval = 0;
+		if (sessionFlush(sm) == -1)
+			status = -1;
+
+		if (close(sm->wtmpFd) == -1)
+			status = -1;
+	}
+
+	if (sm->utmpFd != -1 && close(sm->utmpFd) == -1)
+		status = -1;
+
+	free(sm->pending);
+	free(sm->index);
+	free(sm->lines);
+	memset(sm, 0, sizeof(struct sessionManager));
+	sm->utmpFd = sm->wtmpFd = -1;
+
+	return status;
+}
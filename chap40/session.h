@@ -0,0 +1,81 @@
+/* session.h - Keeps the login accounting records of many sessions.
+ *
+ * The `login(3)`, `logout(3)` and `logwtmp(3)` functions (see login.c, logout.c
+ * and logwtmp.c) are made for a program handling one session: each call searches
+ * the utmp file from its start for the record of the terminal line, and opens the
+ * wtmp file, appends a record to it, and closes it again. A program handling many
+ * sessions at once - such as a server accepting thousands of logins a minute -
+ * does much better with a session manager, which:
+ *
+ * - keeps both files open;
+ * - knows where the record of every line is in the utmp file (from an index
+ *   built on opening it, and kept up to date), so that a login or logout writes
+ *   that record - one pwrite(2) - with no search. The record is read back before
+ *   being written: if someone else changed the file in the meantime, so that it
+ *   is no longer that of the line, the index is built again;
+ * - buffers the records to be appended to wtmp, writing them out together - with
+ *   one write(2), in order, as `batch` records accumulate, or on `sessionFlush`
+ *   - and calls fsync(2) on it at most every `syncInterval` milliseconds (on
+ *   every flush, if 0; never, if negative).
+ *
+ * Writes to utmp take a lock of the record being written (with fcntl(2)), as
+ * those of glibc do. A record appended to wtmp is in the file only after it is
+ * flushed, which `sessionClose` does too.
+ *
+ * Programs using it are built along with session.c.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stddef.h>
+#include <utmpx.h>
+
+struct sessionManager {
+	int utmpFd;
+	int wtmpFd;
+
+	/* index of the utmp records, by line: open addressing hash table of the
+	 * record numbers plus one (0 marks a free slot) */
+	size_t *index;
+	size_t indexCapacity;
+	size_t records;       /* in the utmp file */
+	char (*lines)[__UT_LINESIZE]; /* of each record, as indexed */
+	size_t linesCapacity;
+
+	/* records to be appended to wtmp */
+	struct utmpx *pending;
+	size_t pendingCount;
+	size_t batch;
+
+	long syncInterval;    /* in milliseconds */
+	long long lastSync;
+	int unsynced;         /* whether records were written since the last fsync */
+};
+
+/* opens the utmp and wtmp files, and indexes the utmp records. Returns -1 on
+ * errors */
+int sessionOpen(struct sessionManager *sm, const char *utmpFile, const char *wtmpFile,
+                size_t batch, long syncInterval);
+
+/* records the login of `ut` (a USER_PROCESS record, with at least ut_line and
+ * ut_user filled in), in both files. Returns -1 on errors */
+int sessionLogin(struct sessionManager *sm, const struct utmpx *ut);
+
+/* records the logout of the session in `line`, in both files. Returns 1 if there
+ * was one, 0 if not, -1 on errors */
+int sessionLogout(struct sessionManager *sm, const char *line);
+
+/* appends a record to wtmp only, as `logwtmp(3)`. Returns -1 on errors */
+int sessionLogwtmp(struct sessionManager *sm, const char *line, const char *name, const char *host);
+
+/* writes out the records pending in wtmp, syncing the file if it is time to.
+ * Returns -1 on errors */
+int sessionFlush(struct sessionManager *sm);
+
+/* flushes the records pending, and closes the files. Returns -1 on errors */
+int sessionClose(struct sessionManager *sm);
+
+#endif
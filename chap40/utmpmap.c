@@ -0,0 +1,108 @@
+/* utmpmap.c - Reads utmp and wtmp files through a memory mapping. See utmpmap.h.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _DEFAULT_SOURCE /* madvise */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "utmpmap.h"
+
+/* read ahead when going backwards, in records */
+#define PREFETCH_RECORDS (4096)
+
+int
+utmpMapOpen(struct utmpMap *map, const char *path) {
+	struct stat st;
+	int fd, savedErrno;
+	void *p;
+
+	memset(map, 0, sizeof(struct utmpMap));
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+
+	if (fstat(fd, &st) == -1)
+		goto fail;
+
+	map->count = st.st_size / sizeof(struct utmpx);
+	map->prefetched = map->count;
+
+	/* an empty file cannot be mapped: there are just no records */
+	if (map->count == 0) {
+		close(fd);
+		return 0;
+	}
+
+	map->length = map->count * sizeof(struct utmpx);
+	p = mmap(NULL, map->length, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+		goto fail;
+
+	/* the mapping stays valid once the descriptor is closed */
+	close(fd);
+
+	/* forward scans are the most common: make the kernel read ahead */
+	madvise(p, map->length, MADV_SEQUENTIAL);
+
+	map->records = p;
+	return 0;
+
+fail:
+	savedErrno = errno;
+	close(fd);
+	errno = savedErrno;
+	return -1;
+}
+
+void
+utmpMapClose(struct utmpMap *map) {
+	if (map->records != NULL)
+		munmap((void *) map->records, map->length);
+
+	memset(map, 0, sizeof(struct utmpMap));
+}
+
+const struct utmpx *
+utmpMapNext(struct utmpMap *map, size_t *cursor) {
+	if (*cursor >= map->count)
+		return NULL;
+
+	return &map->records[(*cursor)++];
+}
+
+const struct utmpx *
+utmpMapPrev(struct utmpMap *map, size_t *cursor) {
+	size_t first;
+	uintptr_t start, end;
+	long pageSize;
+
+	if (*cursor == 0 || *cursor > map->count)
+		return NULL;
+
+	--*cursor;
+
+	/* the kernel only reads ahead going forwards: ask for the records before
+	 * the cursor to be read in, a batch at a time, before they are needed */
+	if (*cursor < map->prefetched) {
+		first = (*cursor >= PREFETCH_RECORDS) ? *cursor - PREFETCH_RECORDS : 0;
+		pageSize = sysconf(_SC_PAGESIZE);
+
+		start = (uintptr_t) &map->records[first] & ~((uintptr_t) pageSize - 1);
+		end = (uintptr_t) &map->records[map->prefetched];
+		madvise((void *) start, end - start, MADV_WILLNEED);
+
+		map->prefetched = first;
+	}
+
+	return &map->records[*cursor];
+}
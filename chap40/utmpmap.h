@@ -0,0 +1,46 @@
+/* utmpmap.h - Reads utmp and wtmp files through a memory mapping.
+ *
+ * Reading the login accounting files with getutxent(3) takes a read(2) for
+ * every record. This maps the whole file in memory instead, and iterates over
+ * the `struct utmpx` records right in there - forwards, or backwards, newest
+ * first, as for `last(1)`-like queries over wtmp, where the latest records are
+ * usually what is wanted.
+ *
+ * The records are those in the file when it was opened: that of records
+ * appended later (wtmp only ever grows) are not seen, and a record being written
+ * at the end of a file is left out if incomplete.
+ *
+ * Programs using it are built along with utmpmap.c.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#ifndef UTMPMAP_H
+#define UTMPMAP_H
+
+#include <stddef.h>
+#include <utmpx.h>
+
+struct utmpMap {
+	const struct utmpx *records;
+	size_t count;
+	size_t length;      /* of the mapping, in bytes */
+	size_t prefetched;  /* index of the first record advised to be read ahead when going backwards */
+};
+
+/* maps the utmp-format file at `path`. Returns -1 on errors */
+int utmpMapOpen(struct utmpMap *map, const char *path);
+
+/* unmaps the file: the records are no longer valid */
+void utmpMapClose(struct utmpMap *map);
+
+/* iterates over the records, from the oldest: `cursor` is to be set to 0 for
+ * the first call. Returns NULL after the last record */
+const struct utmpx *utmpMapNext(struct utmpMap *map, size_t *cursor);
+
+/* iterates over the records, from the newest: `cursor` is to be set to the
+ * number of records (`count`) for the first call. Returns NULL after the first
+ * record */
+const struct utmpx *utmpMapPrev(struct utmpMap *map, size_t *cursor);
+
+#endif
@@ -8,10 +8,21 @@
  * `LOGIN_PROCESS`. Username and other associated information is
  * also displayed.
  *
+ * The file is read through a memory mapping (see utmpmap.c), rather than a
+ * record at a time by `getutxent(3)` - which makes a difference for large files,
+ * such as a wtmp file listed with this program.
+ *
  * Example
  *
- * 	  $ ./who [utmp_file]
+ * 	  $ ./who [-r] [-g] [utmp_file]
  * 	  utmp_file - the path to the system utmp file. Default: _PATH_UTMP.
+ * 	  -r        - list the newest records first.
+ * 	  -g        - read the file with `getutxent(3)` instead (records are then
+ * 	              listed oldest first).
+ *
+ * Built along with the reader:
+ *
+ * 	  $ gcc -o who who.c utmpmap.c
  *
  * Author: Renato Mascarenhas Costa
  */
@@ -26,41 +37,104 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "utmpmap.h"
+
+static void helpAndLeave(const char *progname, int status);
 static void pexit(const char *fname);
 
+static void printRecord(const struct utmpx *ut);
+
 int
 main(int argc, char *argv[]) {
-	if (argc > 1)
-		utmpname(argv[1]);
+	struct utmpMap map;
+	const struct utmpx *ut;
+	const char *file = _PATH_UTMP;
+	size_t cursor;
+	int opt, reverse = 0, useGetutxent = 0;
 
-	struct utmpx *ut;
+	while ((opt = getopt(argc, argv, "rgh")) != -1) {
+		switch (opt) {
+			case 'r': reverse = 1; break;
+			case 'g': useGetutxent = 1; break;
+			case 'h': helpAndLeave(argv[0], EXIT_SUCCESS); break;
+			default: helpAndLeave(argv[0], EXIT_FAILURE);
+		}
+	}
 
-	/* set the file cursor to the start of the file */
-	errno = 0;
-	setutxent();
-	if (errno != 0)
-		pexit("setutxent");
+	if (argc > optind + 1)
+		helpAndLeave(argv[0], EXIT_FAILURE);
 
-	/* iterate over the entries and filter the ones we are interested in */
-	while ((ut = getutxent()) != NULL) {
-		if (ut->ut_type == INIT_PROCESS || ut->ut_type == LOGIN_PROCESS || ut->ut_type == USER_PROCESS) {
-			struct tm *t = localtime((time_t *) &ut->ut_tv.tv_sec);
-			char s[32];
-			strftime(s, 32, "%F %T", t);
+	if (argc > optind)
+		file = argv[optind];
 
-			printf("%12s %10s %20s\n", ut->ut_user, ut->ut_line, s);
-		}
+	if (useGetutxent) {
+		utmpname(file);
+
+		/* set the file cursor to the start of the file */
+		errno = 0;
+		setutxent();
+		if (errno != 0)
+			pexit("setutxent");
+
+		/* iterate over the entries and filter the ones we are interested in */
+		while ((ut = getutxent()) != NULL)
+			printRecord(ut);
+
+		/* finish reading the `utmp` file */
+		errno = 0;
+		endutxent();
+		if (errno != 0)
+			pexit("endutxent");
+
+		exit(EXIT_SUCCESS);
+	}
+
+	if (utmpMapOpen(&map, file) == -1)
+		pexit("utmpMapOpen");
+
+	if (reverse) {
+		cursor = map.count;
+		while ((ut = utmpMapPrev(&map, &cursor)) != NULL)
+			printRecord(ut);
+	} else {
+		cursor = 0;
+		while ((ut = utmpMapNext(&map, &cursor)) != NULL)
+			printRecord(ut);
 	}
 
-	/* finish reading the `utmp` file */
-	errno = 0;
-	endutxent();
-	if (errno != 0)
-		pexit("endutxent");
+	utmpMapClose(&map);
 
 	exit(EXIT_SUCCESS);
 }
 
+/* prints the record, if it is one we are interested in */
+static void
+printRecord(const struct utmpx *ut) {
+	struct tm *t;
+	time_t sec;
+	char s[32];
+
+	if (ut->ut_type == INIT_PROCESS || ut->ut_type == LOGIN_PROCESS || ut->ut_type == USER_PROCESS) {
+		sec = ut->ut_tv.tv_sec;
+		t = localtime(&sec);
+		strftime(s, 32, "%F %T", t);
+
+		printf("%12.*s %10.*s %20s\n", (int) sizeof(ut->ut_user), ut->ut_user,
+		       (int) sizeof(ut->ut_line), ut->ut_line, s);
+	}
+}
+
+static void
+helpAndLeave(const char *progname, int status) {
+	FILE *stream = stderr;
+
+	if (status == EXIT_SUCCESS)
+		stream = stdout;
+
+	fprintf(stream, "Usage: %s [-r] [-g] [utmp_file]\n", progname);
+	exit(status);
+}
+
 static void
 pexit(const char *fname) {
 	perror(fname);
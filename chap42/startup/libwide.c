@@ -0,0 +1,21 @@
+/* libwide.c - a library exporting many functions, to time dynamic linking.
+ *
+ * See wide.h. Each wide_fNN calls wide_helperNN: exported by default, a call
+ * to it goes through the PLT of the library (as it could be interposed by
+ * another object); with -fvisibility=hidden or -Bsymbolic, it is bound when
+ * the library is linked, and called directly.
+ *
+ * Compilation: see the Makefile.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#include "wide.h"
+
+#define WIDE_HELPER(n) \
+	int __attribute__((noinline)) wide_helper##n(int x) { return x * 3 + 0x##n; }
+WIDE_ALL(WIDE_HELPER)
+
+#define WIDE_DEFINE(n) \
+	int wide_f##n(int x) { return wide_helper##n(x) ^ 0x##n; }
+WIDE_ALL(WIDE_DEFINE)
@@ -0,0 +1,129 @@
+/* load_bench.c - times loading libraries at runtime, and looking symbols up.
+ *
+ * main.c loads libx1 and libx2 with dlopen(3). Loading a library costs mapping
+ * it, and relocating it: with RTLD_LAZY, only what cannot wait (data, and the
+ * functions whose addresses are taken); with RTLD_NOW, every symbol it uses as
+ * well - unless it was linked with -z now, which makes RTLD_LAZY bind all of
+ * them too. Each dlsym(3) then looks a name up in the hash table of symbols of
+ * the library.
+ *
+ * For each of the builds of libwide given (see the Makefile), this program
+ * times dlopen(3) with RTLD_LAZY and with RTLD_NOW, and dlsym(3) on every
+ * function of the library. This program is not linked against libwide, so that
+ * each dlopen(3) loads it anew; each library is loaded (and unloaded) once
+ * before, so that it is read from the page cache.
+ *
+ * Usage
+ *
+ *    $ ./load_bench [-n rounds] library...
+ *
+ *    -n: the times each library is loaded in each mode (default: 100).
+ *
+ * Compilation: see the Makefile.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <dlfcn.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "wide.h"
+
+#define DEFAULT_ROUNDS (100)
+
+static void helpAndExit(const char *progname, int status);
+static void fatal(const char *message);
+
+#define WIDE_NAME(n) "wide_f" #n,
+static const char *names[] = { WIDE_ALL(WIDE_NAME) };
+
+static double
+now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* loads `path` with `mode`, adding how long opening it and looking up its
+ * functions took to `opened` and `lookedUp` */
+static void
+load(const char *path, int mode, double *opened, double *lookedUp) {
+	double start;
+	void *handle;
+	int i;
+
+	start = now();
+	if ((handle = dlopen(path, mode)) == NULL)
+		fatal(dlerror());
+	*opened += now() - start;
+
+	start = now();
+	for (i = 0; i < WIDE_FUNCTIONS; ++i) {
+		if (dlsym(handle, names[i]) == NULL)
+			fatal(dlerror());
+	}
+	*lookedUp += now() - start;
+
+	/* unloaded, so that it is loaded again next time */
+	if (dlclose(handle) != 0)
+		fatal(dlerror());
+}
+
+int
+main(int argc, char *argv[]) {
+	double lazy, now_, lookedUp, unused;
+	int opt, rounds = DEFAULT_ROUNDS, r;
+
+	while ((opt = getopt(argc, argv, "n:h")) != -1) {
+		switch (opt) {
+			case 'n': rounds = atoi(optarg); break;
+			case 'h': helpAndExit(argv[0], EXIT_SUCCESS); break;
+			default: helpAndExit(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	if (optind == argc || rounds < 1)
+		helpAndExit(argv[0], EXIT_FAILURE);
+
+	printf("%-28s %14s %14s %14s   (microseconds, %d rounds)\n", "library", "RTLD_LAZY", "RTLD_NOW",
+			"dlsym (each)", rounds);
+
+	for (; optind < argc; ++optind) {
+		lazy = now_ = lookedUp = unused = 0;
+		load(argv[optind], RTLD_LAZY, &unused, &unused);
+
+		for (r = 0; r < rounds; ++r) {
+			load(argv[optind], RTLD_LAZY, &lazy, &lookedUp);
+			load(argv[optind], RTLD_NOW, &now_, &lookedUp);
+		}
+
+		printf("%-28s %14.1f %14.1f %14.3f\n", argv[optind], lazy / rounds * 1e6, now_ / rounds * 1e6,
+				lookedUp / (2 * rounds * WIDE_FUNCTIONS) * 1e6);
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+static void
+helpAndExit(const char *progname, int status) {
+	FILE *stream = stderr;
+
+	if (status == EXIT_SUCCESS)
+		stream = stdout;
+
+	fprintf(stream, "Usage: %s [-n rounds] library...\n", progname);
+	exit(status);
+}
+
+static void
+fatal(const char *message) {
+	fprintf(stderr, "%s\n", message);
+	exit(EXIT_FAILURE);
+}
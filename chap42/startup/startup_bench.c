@@ -0,0 +1,159 @@
+/* startup_bench.c - times how long commands take to start (and finish).
+ *
+ * For a short-lived command-line tool, most of the time it runs is spent before
+ * main: execve(2) mapping it, the dynamic linker loading its libraries and
+ * relocating them, constructors running. This program runs each command given
+ * a number of times, waiting for each run to finish, and reports the minimum,
+ * median and mean times a run took.
+ *
+ * Commands are given as single arguments, split at spaces: "./tool_lazy -c".
+ * Their output is discarded.
+ *
+ * Usage
+ *
+ *    $ ./startup_bench [-n runs] command...
+ *
+ *    -n: the runs of each command (default: 200).
+ *
+ * Compilation: see the Makefile.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_RUNS (200)
+#define MAX_ARGS (32)
+
+extern char **environ;
+
+static void helpAndExit(const char *progname, int status);
+static void pexit(const char *fCall);
+static void fatal(const char *message);
+
+static double
+now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+byTime(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* runs `args` once, returning how long it took */
+static double
+run(char *args[], posix_spawn_file_actions_t *actions) {
+	double start;
+	int status, s;
+	pid_t pid;
+
+	start = now();
+	if ((s = posix_spawn(&pid, args[0], actions, NULL, args, environ)) != 0) {
+		errno = s;
+		pexit("posix_spawn");
+	}
+
+	if (waitpid(pid, &status, 0) == -1)
+		pexit("waitpid");
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s failed\n", args[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	return now() - start;
+}
+
+int
+main(int argc, char *argv[]) {
+	posix_spawn_file_actions_t actions;
+	char *args[MAX_ARGS + 1], *command;
+	double *times, sum;
+	int opt, runs = DEFAULT_RUNS, i, n;
+
+	while ((opt = getopt(argc, argv, "+n:h")) != -1) {
+		switch (opt) {
+			case 'n': runs = atoi(optarg); break;
+			case 'h': helpAndExit(argv[0], EXIT_SUCCESS); break;
+			default: helpAndExit(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	if (optind == argc || runs < 1)
+		helpAndExit(argv[0], EXIT_FAILURE);
+
+	if ((times = malloc(runs * sizeof(double))) == NULL)
+		pexit("malloc");
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+
+	printf("%-40s %10s %10s %10s   (microseconds, %d runs)\n", "command", "min", "median", "mean", runs);
+
+	for (; optind < argc; ++optind) {
+		if ((command = strdup(argv[optind])) == NULL)
+			pexit("strdup");
+
+		for (n = 0, args[0] = strtok(command, " "); args[n] != NULL; args[++n] = strtok(NULL, " ")) {
+			if (n == MAX_ARGS)
+				fatal("Too many arguments");
+		}
+		if (n == 0)
+			fatal("Empty command");
+
+		/* once, so that it is in the page cache */
+		run(args, &actions);
+
+		for (i = 0, sum = 0; i < runs; ++i)
+			sum += times[i] = run(args, &actions);
+		qsort(times, runs, sizeof(double), byTime);
+
+		printf("%-40s %10.1f %10.1f %10.1f\n", argv[optind], times[0] * 1e6,
+				times[runs / 2] * 1e6, sum / runs * 1e6);
+		free(command);
+	}
+
+	posix_spawn_file_actions_destroy(&actions);
+	exit(EXIT_SUCCESS);
+}
+
+static void
+helpAndExit(const char *progname, int status) {
+	FILE *stream = stderr;
+
+	if (status == EXIT_SUCCESS)
+		stream = stdout;
+
+	fprintf(stream, "Usage: %s [-n runs] command...\n", progname);
+	exit(status);
+}
+
+static void
+pexit(const char *fCall) {
+	perror(fCall);
+	exit(EXIT_FAILURE);
+}
+
+static void
+fatal(const char *message) {
+	fprintf(stderr, "%s\n", message);
+	exit(EXIT_FAILURE);
+}
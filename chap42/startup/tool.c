@@ -0,0 +1,105 @@
+/* tool.c - a command-line tool linked against libwide, timing its linking.
+ *
+ * Run with no options, it does what a short-lived tool does: calls every
+ * function of libwide (see wide.h) once, and exits - the time it takes to run is
+ * what startup_bench.c measures. It is built in several configurations (see
+ * the Makefile), which differ only in how it and the library are linked.
+ *
+ * With -c, it times the calls itself: the first call of each function and a
+ * second one. Bound lazily, a first call goes through the dynamic linker, which
+ * looks the symbol up (and that of the helper it calls, when calls within the
+ * library go through its PLT too); bound at startup, it costs what the second
+ * one does.
+ *
+ * Usage
+ *
+ *    $ ./tool_lazy [-c]
+ *
+ *    -c: time the first and second calls of the functions of libwide.
+ *
+ * Compilation: see the Makefile.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "wide.h"
+
+static void helpAndExit(const char *progname, int status);
+
+static double
+now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* direct calls, each through an entry of the PLT (or not, if linked statically).
+ * Taking their addresses instead would have them bound at startup regardless */
+static int
+callAll(int x) {
+#define WIDE_CALL(n) x = wide_f##n(x);
+	WIDE_ALL(WIDE_CALL)
+
+	return x;
+}
+
+static void
+timeCalls(void) {
+	double start, first, second;
+	int x;
+
+	start = now();
+	x = callAll(1);
+	first = now() - start;
+
+	start = now();
+	x = callAll(x);
+	second = now() - start;
+
+	printf("%d calls: first %.1f us (%.0f ns each), second %.1f us (%.0f ns each) [%x]\n",
+			WIDE_FUNCTIONS, first * 1e6, first / WIDE_FUNCTIONS * 1e9,
+			second * 1e6, second / WIDE_FUNCTIONS * 1e9, x);
+}
+
+int
+main(int argc, char *argv[]) {
+	int opt, calls = 0;
+
+	while ((opt = getopt(argc, argv, "ch")) != -1) {
+		switch (opt) {
+			case 'c': calls = 1; break;
+			case 'h': helpAndExit(argv[0], EXIT_SUCCESS); break;
+			default: helpAndExit(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	if (optind != argc)
+		helpAndExit(argv[0], EXIT_FAILURE);
+
+	if (calls)
+		timeCalls();
+	else
+		callAll(1); /* the work of the tool */
+
+	exit(EXIT_SUCCESS);
+}
+
+static void
+helpAndExit(const char *progname, int status) {
+	FILE *stream = stderr;
+
+	if (status == EXIT_SUCCESS)
+		stream = stdout;
+
+	fprintf(stream, "Usage: %s [-c]\n", progname);
+	exit(status);
+}
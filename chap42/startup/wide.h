@@ -0,0 +1,36 @@
+/* wide.h - the interface of libwide, a library wide enough to time linking.
+ *
+ * libx1.c and libx2.c export a couple of functions each: too few for the cost
+ * of resolving symbols to show. libwide exports WIDE_FUNCTIONS functions, each
+ * calling a helper of its own - so that calls within the library can go
+ * through its PLT too, unless built not to (see the Makefile).
+ *
+ * The functions are wide_f00 to wide_fff, declared (and defined) by expanding
+ * WIDE_ALL with a macro taking the two hexadecimal digits of each.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#ifndef WIDE_H
+#define WIDE_H
+
+#define WIDE_FUNCTIONS (256)
+
+#define WIDE_ROW(M, h) \
+	M(h##0) M(h##1) M(h##2) M(h##3) M(h##4) M(h##5) M(h##6) M(h##7) \
+	M(h##8) M(h##9) M(h##a) M(h##b) M(h##c) M(h##d) M(h##e) M(h##f)
+
+#define WIDE_ALL(M) \
+	WIDE_ROW(M, 0) WIDE_ROW(M, 1) WIDE_ROW(M, 2) WIDE_ROW(M, 3) \
+	WIDE_ROW(M, 4) WIDE_ROW(M, 5) WIDE_ROW(M, 6) WIDE_ROW(M, 7) \
+	WIDE_ROW(M, 8) WIDE_ROW(M, 9) WIDE_ROW(M, a) WIDE_ROW(M, b) \
+	WIDE_ROW(M, c) WIDE_ROW(M, d) WIDE_ROW(M, e) WIDE_ROW(M, f)
+
+/* the library is built with -fvisibility=hidden in some configurations: its
+ * interface is exported regardless */
+#define WIDE_API __attribute__((visibility("default")))
+
+#define WIDE_DECLARE(n) WIDE_API int wide_f##n(int x);
+WIDE_ALL(WIDE_DECLARE)
+
+#endif
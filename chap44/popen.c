@@ -11,9 +11,32 @@
  * This program provides a simple implementation of both of these functions, as well
  * as allows the user to test its functionality
  *
+ * The shell is started with posix_spawn(3) rather than fork(2): glibc creates the
+ * child with vfork semantics (clone(2) with CLONE_VM | CLONE_VFORK), so it does
+ * not copy the page tables of the caller, which for processes with large heaps
+ * costs much more than running the command. The ends of the pipes kept by the
+ * caller are close-on-exec, so that commands do not inherit the streams of other
+ * calls to _popen. Descriptors the caller opened without O_CLOEXEC are not passed
+ * on either: the child closes every descriptor above the standard streams before
+ * exec, which glibc (2.34 and later) does with a single close_range(2), the way
+ * lib/closefds.c does for children created with fork(2). The child PID of each
+ * stream is kept in a table indexed by file descriptor, grown as needed - there
+ * is no limit to the number of streams other than RLIMIT_NOFILE.
+ *
+ * When reading, the output of the command is copied to the standard output with a
+ * read(2) and a write(2) for every BUFLEN bytes. With -s, the pipe from the child
+ * (and the standard output, if it is a pipe too) is enlarged with F_SETPIPE_SZ,
+ * and the output moved with splice(2) instead: a call per pipe-full, without
+ * copying it through user space. splice(2) needs one of its ends to be a pipe,
+ * and the other to support it - if the standard output does not (a terminal, for
+ * instance), it falls back to read(2) and write(2).
+ *
  * Usage:
  *
- *   $ ./popen [type] [command]
+ *   $ ./popen [-s] [-p pipe_size] [type] [command]
+ *   -s: move the output of the command with splice(2).
+ *   -p: the size of the pipes with -s (default: 1 MB, the limit for unprivileged
+ *       processes in /proc/sys/fs/pipe-max-size).
  *   type: whether we are interested in reading (r) or writing (w).
  *   command: the command to be run
  *
@@ -32,7 +55,9 @@
 #define _GNU_SOURCE
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <spawn.h>
 #include <sys/wait.h>
 
 #include <stdio.h>
@@ -40,39 +65,65 @@
 #include <string.h>
 
 #define BUFLEN (1024)
+#define PIPE_SIZE (1024 * 1024)
 
 #define SHELL ("/bin/sh")
 
 #define READ ('r')
 #define WRITE ('w')
 
-/* allow up to MAXFD for file descriptor identifiers */
-#define MAXFD (1024)
-/* maps file descriptors to child PID, allowing multiple calls to _popen */
-static int fdPidMap[MAXFD];
+/* initial number of entries of fdPidMap */
+#define MINFDS (64)
+
+/* maps file descriptors to child PID, allowing multiple calls to _popen. Entries
+ * of file descriptors without a child are zero */
+static pid_t *fdPidMap;
+static int fdPidMapSize;
+
+extern char **environ;
 
-static void init(void);
 static FILE *_popen(const char *command, const char *type);
 static int _pclose(FILE *f);
 
 static void readAndPrint(FILE *f);
+static void spliceAndPrint(FILE *f, int pipeSize);
 static void writeStdinTo(FILE *f);
 
 static void helpAndLeave(const char *progname, int status);
 static void pexit(const char *fCall);
 
 int
-main(int argc, const char *argv[]) {
-	const char *command = argv[2],
-		  *type = argv[1];
+main(int argc, char *argv[]) {
+	const char *command, *type;
+	int opt, useSplice = 0, pipeSize = PIPE_SIZE;
+
+	while ((opt = getopt(argc, argv, "sp:h")) != -1) {
+		switch (opt) {
+		case 's':
+			useSplice = 1;
+			break;
+
+		case 'p':
+			pipeSize = atoi(optarg);
+			break;
+
+		case 'h':
+			helpAndLeave(argv[0], EXIT_SUCCESS);
+			break;
+
+		default:
+			helpAndLeave(argv[0], EXIT_FAILURE);
+		}
+	}
 
 	/* this program accepts exactly two arguments (type and command to be run.)
 	 * The type is a single character string (either r or w)
 	 */
-	if (argc != 3 || strlen(type) != 1)
+	if (argc != optind + 2 || strlen(argv[optind]) != 1 || pipeSize <= 0)
 		helpAndLeave(argv[0], EXIT_FAILURE);
 
-	init();
+	type = argv[optind];
+	command = argv[optind + 1];
 
 	FILE *f = _popen(command, type);
 	if (f == NULL)
@@ -80,7 +131,10 @@ main(int argc, const char *argv[]) {
 
 	switch (type[0]) {
 	case 'r':
-		readAndPrint(f);
+		if (useSplice)
+			spliceAndPrint(f, pipeSize);
+		else
+			readAndPrint(f);
 		break;
 
 	case 'w':
@@ -98,29 +152,39 @@ main(int argc, const char *argv[]) {
 
 }
 
-/* initialize all elements of the fdPidMap data structure to zero, so as to properly
- * identify when a given field has not been filled yet. Since, for simplicity sake,
- * all the code is in a single source file, this function needs to be called
- * explicitly, from the main function.
- *
- * In practice, an implementation of popen/pclose could be distributed as a
- * shared library, and this function could be loaded when the library is loaded
- * by the C environment.
- */
-static void
-init() {
-	int i;
+/* makes room in fdPidMap for file descriptor `fd`, doubling its size as many
+ * times as needed. Returns -1 if no memory could be allocated */
+static int
+growMap(int fd) {
+	pid_t *map;
+	int size;
 
-	for (i = 0; i < MAXFD; ++i) {
-		fdPidMap[i] = 0;
-	}
+	if (fd < fdPidMapSize)
+		return 0;
+
+	size = (fdPidMapSize == 0) ? MINFDS : fdPidMapSize;
+	while (size <= fd)
+		size *= 2;
+
+	map = realloc(fdPidMap, size * sizeof(pid_t));
+	if (map == NULL)
+		return -1;
+
+	memset(map + fdPidMapSize, 0, (size - fdPidMapSize) * sizeof(pid_t));
+	fdPidMap = map;
+	fdPidMapSize = size;
+
+	return 0;
 }
 
 static FILE *
 _popen(const char *command, const char *type) {
-	long childPid; /* the PID of the child shell to be forked */
-	int pfd[2];    /* read/write file descriptors of the pipe */
-	int closeFd, keepFd;
+	pid_t childPid;  /* the PID of the child shell to be spawned */
+	int pfd[2];      /* read/write file descriptors of the pipe */
+	int childFd, keepFd, targetFd, s;
+	posix_spawn_file_actions_t actions;
+	char *argv[] = { "sh", "-c", (char *) command, NULL };
+	FILE *f;
 
 	/* if the type specified is not 1-character long or is not equal to r or w,
 	 * it is invald - set errno appropriately */
@@ -129,78 +193,58 @@ _popen(const char *command, const char *type) {
 		return NULL;
 	}
 
-	if (pipe(pfd) == -1)
-		return NULL;
-
-	switch (childPid = fork()) {
-	case -1:
+	/* both ends are close-on-exec: the child gets its end as a copy, made by
+	 * dup2(2), which does not keep the flag */
+	if (pipe2(pfd, O_CLOEXEC) == -1)
 		return NULL;
 
-	case 0:
-		break;
-
-	default:
-		/* parent process:
-		 *
-		 * - closes the unused end of the pipe: the read side when writing, or the write
-		 *   side when reading.
-		 * - returns the other, open side of the pipe to the caller
-		 *
-		 * The parent always returns in this block of the switch statement.
-		 */
-		closeFd = (type[0] == WRITE) ? pfd[0] : pfd[1];
-		keepFd = (type[0] == WRITE) ? pfd[1] : pfd[0];
-
-		if (close(closeFd) == -1)
-			return NULL;
-
-		/* keep the FD => PID association stored in a shared data structure to be used
-		 * subsequently by _pclose */
-		if (keepFd >= MAXFD) {
-			errno = ENOMEM;
-			return NULL;
-		}
-		fdPidMap[keepFd] = childPid;
+	/* if the caller wants to read data, the write end of the pipe becomes the
+	 * standard output of the child; if it wants to write data, the read end
+	 * becomes its standard input */
+	childFd = (type[0] == WRITE) ? pfd[0] : pfd[1];
+	keepFd = (type[0] == WRITE) ? pfd[1] : pfd[0];
+	targetFd = (type[0] == WRITE) ? STDIN_FILENO : STDOUT_FILENO;
 
-		return fdopen(keepFd, type);
+	if (growMap(keepFd) == -1) {
+		s = ENOMEM;
+		goto fail;
 	}
 
-	/* child process */
-	switch (type[0]) {
-	case READ:
-		/* if the caller wants to read data, then the read end of the pipe must be closed,
-		 * and its write end associated with the child process standard output */
-		if (close(pfd[0]) == -1)
-			return NULL;
-
-		if (pfd[1] != STDOUT_FILENO) {
-			if (dup2(pfd[1], STDOUT_FILENO) == -1)
-				return NULL;
-
-			if (close(pfd[1]) == -1)
-				return NULL;
-		}
-
-		break;
-
-	case WRITE:
-		/* if the caller wants to write data, then the write end of the pipe must be closed,
-		 * and its read end associated with the child process standard input */
-		if (close(pfd[1]) == -1)
-			return NULL;
-
-		if (pfd[0] != STDIN_FILENO) {
-			if (dup2(pfd[0], STDIN_FILENO) == -1)
-				return NULL;
-
-			if (close(pfd[0]) == -1)
-				return NULL;
-		}
+	if ((s = posix_spawn_file_actions_init(&actions)) != 0)
+		goto fail;
+
+	s = posix_spawn_file_actions_adddup2(&actions, childFd, targetFd);
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 34)
+	if (s == 0)
+		s = posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+#endif
+	if (s == 0)
+		s = posix_spawn(&childPid, SHELL, &actions, NULL, argv, environ);
+
+	posix_spawn_file_actions_destroy(&actions);
+	if (s != 0)
+		goto fail;
+
+	/* the parent closes the end of the pipe the child uses, and returns the other,
+	 * keeping the FD => PID association to be used subsequently by _pclose */
+	close(childFd);
+	fdPidMap[keepFd] = childPid;
+
+	f = fdopen(keepFd, type);
+	if (f == NULL) {
+		s = errno;
+		fdPidMap[keepFd] = 0;
+		close(keepFd);
+		waitpid(childPid, NULL, 0);
+		errno = s;
 	}
 
-	execlp(SHELL, SHELL, "-c", command, (char *) 0);
+	return f;
 
-	/* if we get to this point, the exec call failed, and errno was set. Return NULL */
+fail:
+	close(pfd[0]);
+	close(pfd[1]);
+	errno = s;
 	return NULL;
 }
 
@@ -213,15 +257,23 @@ _pclose(FILE *f) {
 		return -1;
 
 	/* invalid request - no PID can be found for the file descriptor given */
-	if ((childPid = fdPidMap[fd]) == 0) {
+	if (fd >= fdPidMapSize || (childPid = fdPidMap[fd]) == 0) {
 		errno = EINVAL;
 		return -1;
 	}
 
+	fdPidMap[fd] = 0;
+
+	/* closes the stream first: a child reading from it only finishes on end of file */
+	if (fclose(f) == EOF)
+		return -1;
+
 	/* waits for the child status */
 	int stat_loc;
-	if (waitpid(childPid, &stat_loc, 0) == -1)
-		return -1;
+	while (waitpid(childPid, &stat_loc, 0) == -1) {
+		if (errno != EINTR)
+			return -1;
+	}
 
 	return WEXITSTATUS(stat_loc);
 }
@@ -244,6 +296,52 @@ readAndPrint(FILE *f) {
 		pexit("read");
 }
 
+/* sets the size of pipe `fd` to `size`, if it is a pipe and the size is allowed.
+ * Returns the size of the pipe, or -1 if it is not one */
+static int
+growPipe(int fd, int size) {
+	int current;
+
+	if ((current = fcntl(fd, F_GETPIPE_SZ)) == -1)
+		return -1;
+
+	/* EPERM if above the limit for unprivileged processes: keep what there is */
+	if (current < size && fcntl(fd, F_SETPIPE_SZ, size) != -1)
+		current = fcntl(fd, F_GETPIPE_SZ);
+
+	return current;
+}
+
+static void
+spliceAndPrint(FILE *f, int pipeSize) {
+	ssize_t numSpliced;
+	int size;
+
+	int fd = fileno(f);
+	if (fd == -1)
+		pexit("fileno");
+
+	if ((size = growPipe(fd, pipeSize)) == -1)
+		pexit("fcntl");
+
+	/* a larger pipe on the other side lets more move at a time, too */
+	growPipe(STDOUT_FILENO, pipeSize);
+
+	while ((numSpliced = splice(fd, NULL, STDOUT_FILENO, NULL, size, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0)
+		;
+
+	if (numSpliced == -1) {
+		/* the standard output does not support splice(2): nothing was moved
+		 * yet, so the usual way does it all */
+		if (errno == EINVAL) {
+			readAndPrint(f);
+			return;
+		}
+
+		pexit("splice");
+	}
+}
+
 static void
 writeStdinTo(FILE *f) {
 	char buf[BUFLEN];
@@ -271,7 +369,7 @@ helpAndLeave(const char *progname, int status) {
 	if (status == EXIT_SUCCESS)
 		stream = stdout;
 
-	fprintf(stream, "Usage: %s [type: r|w] [command]\n", progname);
+	fprintf(stream, "Usage: %s [-s] [-p pipe_size] [type: r|w] [command]\n", progname);
 	exit(status);
 }
 
@@ -3,9 +3,14 @@
  * Author: Renato Mascarenhas Costa
  */
 
+#ifndef SEQNUM_COMMON_H
+#define SEQNUM_COMMON_H
+
 #include <sys/types.h>
 #include <sys/ipc.h>
 #include <sys/msg.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 
 #include <stddef.h>
@@ -16,6 +21,12 @@
  * will happen */
 #define MSGQ_KEY (0x1aaaaaa1)
 
+/* when the server runs with `-n`, it serves requests on that many queues ("shards"),
+ * each with a thread of its own. Shard 0 is the queue above; the others are keyed
+ * after it. A client uses the shard of its process ID (see SEQ_SHARDS) */
+#define SEQ_MAX_SHARDS (64)
+#define SEQ_SHARD_KEY(shard) (MSGQ_KEY + (shard))
+
 /* server only reads messages of this type written to the queue. */
 #define SERVER_MSG_TYPE (1) /* use PID of init, which will never be a client process */
 
@@ -34,8 +45,33 @@ struct responseMsg {
 };
 #define RESP_MSG_LEN (sizeof(int)) /* we are only sending the seqNum field on our responses */
 
-static void
+/* a request with this length asks the server for the identifier of the shared memory
+ * segment holding the sequence, which is sent back in the seqNum field of the response
+ * (or -1 if the server does not share it.) Regular requests never have negative lengths */
+#define SEQ_DISCOVER (-1)
+
+/* a request with this length asks the server for its number of shards, which is sent
+ * back in the seqNum field (1 if it is not sharded.) Shard `i` of `n` hands out the
+ * numbers `i`, `i + n`, `i + 2n`, and so on: a request for `seqLen` numbers served by
+ * it is answered with the first of them, and the others follow `n` apart. Shards thus
+ * never hand out the same number, without ever synchronizing with each other */
+#define SEQ_SHARDS (-2)
+
+#define SEQ_SHM_MAGIC (0x73657173) /* "seqs" */
+
+/* when the server runs with `-s`, the sequence lives in a shared memory segment, and
+ * clients allocate from it with an atomic fetch-and-add, bypassing the server. Requests
+ * that still come through the message queue are served from the same counter */
+struct seqShared {
+	int magic;  /* SEQ_SHM_MAGIC */
+	int seqNum; /* the next sequence number to be allocated */
+};
+
+/* inline, so that files not calling it (such as seqlib.c) do not warn */
+static inline void
 pexit(const char *fCall) {
 	perror(fCall);
 	exit(EXIT_FAILURE);
 }
+
+#endif /* SEQNUM_COMMON_H */
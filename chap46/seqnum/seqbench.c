@@ -0,0 +1,291 @@
+/* seqbench.c - A load generator for the sequence server (see seqser.c).
+ *
+ * This program measures how many allocations per second the sequence server sustains,
+ * and how long each of them takes. For each mode and process count requested, that
+ * many processes are forked and allocate numbers from a running server for a fixed
+ * duration, in one of the ways a client can:
+ *
+ *   queue: one request and response through the message queue per allocation, as
+ *          seqcli.c does by default (on the queue of its shard, if the server was
+ *          started with `-n`.)
+ *   shm:   an atomic fetch-and-add on the shared memory segment of the server, as
+ *          `seqcli -s` does. The server must have been started with `-s`.
+ *   lease: numbers are taken one at a time from blocks leased by the client library
+ *          (see seqlib.h), as `seqcli -n` does.
+ *
+ * The aggregate throughput, both in calls and in numbers allocated per second, and the
+ * latency percentiles of each call, in nanoseconds, are reported.
+ *
+ * Start the server with `-q`, so that it does not print a line for every request, and
+ * with `-n` to see how the queue and lease modes scale with a thread per shard.
+ *
+ * Usage:
+ *
+ *   $ ./seqser -s -q &
+ *   $ ./seqbench [-m modes] [-p procs] [-l seqLen] [-w window] [-s seconds]
+ *
+ *   -m: comma separated list of modes: queue, shm, lease (default: all of them)
+ *   -p: comma separated list of process counts to run with (default: 1,2,4)
+ *   -l: numbers allocated by each request, or leased in each block (default: 1 for
+ *       queue and shm, 1000 for lease)
+ *   -w: blocks requested ahead of time in lease mode (default: 2)
+ *   -s: duration of each run, in seconds (default: 3)
+ *
+ * Compile with:
+ *
+ *   $ cc -O2 -o seqbench seqbench.c seqlib.c ../../lib/bench.c -lm
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#include "common.h"
+#include "seqlib.h"
+#include "../../lib/bench.h"
+
+#include <sys/wait.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define MAX_RUNS (16)
+#define MAX_PROCS (256)
+
+#define MODE_QUEUE (0)
+#define MODE_SHM (1)
+#define MODE_LEASE (2)
+#define NMODES (3)
+
+static const char *modeNames[NMODES] = { "queue", "shm", "lease" };
+
+struct config {
+	int modes[NMODES];
+	int procs[MAX_RUNS];
+	int nruns;
+	int seqLen;
+	int window;
+	int seconds;
+};
+
+/* results of each process, written to memory shared with the parent */
+struct procResult {
+	long calls;
+	long numbers;
+	uint64_t hist[BENCH_HIST_BUCKETS];
+};
+
+/* shared among the parent and every process of a run */
+struct control {
+	struct benchControl gate;
+	struct procResult results[MAX_PROCS];
+};
+
+static struct config config;
+
+static void
+usage(const char *progName) {
+	fprintf(stderr, "Usage: %s [-m modes] [-p procs] [-l seqLen] [-w window] [-s seconds]\n", progName);
+	exit(EXIT_FAILURE);
+}
+
+static long
+parseLong(const char *arg, long min, long max, const char *progName) {
+	long n;
+
+	if (benchParseLong(arg, min, max, &n) == -1)
+		usage(progName);
+
+	return n;
+}
+
+/* the number of numbers each call allocates in the mode given */
+static int
+seqLenOf(int mode) {
+	if (config.seqLen != 0)
+		return config.seqLen;
+
+	return (mode == MODE_LEASE) ? 1000 : 1;
+}
+
+/* one request and response through the queue per call, like seqcli.c */
+static void
+queueWorker(struct procResult *result, struct control *control) {
+	struct requestMsg req;
+	struct responseMsg res;
+	uint64_t start;
+	int msgqid, nshards;
+
+	msgqid = seqShardQueue(getpid(), &nshards);
+	if (msgqid == -1)
+		pexit("seqShardQueue");
+
+	req.mtype = SERVER_MSG_TYPE;
+	req.pid = getpid();
+	req.seqLen = seqLenOf(MODE_QUEUE);
+
+	benchWaitStart(&control->gate);
+
+	while (!benchStopped(&control->gate)) {
+		start = benchNowNs();
+		if (msgsnd(msgqid, &req, REQ_MSG_LEN, 0) == -1)
+			pexit("msgsnd");
+
+		if (msgrcv(msgqid, &res, RESP_MSG_LEN, req.pid, 0) == -1)
+			pexit("msgrcv");
+		result->hist[benchHistIndex(benchNowNs() - start)]++;
+
+		result->calls++;
+		result->numbers += req.seqLen;
+	}
+}
+
+/* blocks are leased from the shared counter in shm mode, so a client library with
+ * blocks of the requested length is the same as a fetch-and-add per call */
+static void
+libWorker(struct procResult *result, struct control *control, int mode) {
+	struct seqClient client;
+	uint64_t start;
+	int seqNum, len;
+
+	len = (mode == MODE_SHM) ? seqLenOf(mode) : 1;
+	if (seqOpen(&client, seqLenOf(mode), config.window, mode == MODE_SHM) == -1)
+		pexit("seqOpen");
+
+	benchWaitStart(&control->gate);
+
+	while (!benchStopped(&control->gate)) {
+		start = benchNowNs();
+		if (seqNext(&client, &seqNum) == -1)
+			pexit("seqNext");
+
+		/* in shm mode, a call allocates the whole block: skip the rest of it */
+		if (mode == MODE_SHM)
+			client.next = client.end;
+		result->hist[benchHistIndex(benchNowNs() - start)]++;
+
+		result->calls++;
+		result->numbers += len;
+	}
+
+	if (seqClose(&client) == -1)
+		pexit("seqClose");
+}
+
+static void
+run(struct control *control, int mode, int nprocs) {
+	uint64_t hist[BENCH_HIST_BUCKETS], start, elapsed;
+	long calls, numbers;
+	pid_t pid;
+	int i;
+
+	memset(control, 0, sizeof(*control));
+	for (i = 0; i < nprocs; i++) {
+		pid = fork();
+		if (pid == -1)
+			pexit("fork");
+
+		if (pid == 0) {
+			if (mode == MODE_QUEUE)
+				queueWorker(&control->results[i], control);
+			else
+				libWorker(&control->results[i], control, mode);
+			_exit(EXIT_SUCCESS);
+		}
+	}
+
+	/* every process is forked before any of them starts */
+	start = benchStart(&control->gate);
+
+	sleep(config.seconds);
+	benchStop(&control->gate);
+
+	for (i = 0; i < nprocs; i++) {
+		if (wait(NULL) == -1)
+			pexit("wait");
+	}
+	elapsed = benchNowNs() - start;
+
+	memset(hist, 0, sizeof(hist));
+	calls = numbers = 0;
+	for (i = 0; i < nprocs; i++) {
+		calls += control->results[i].calls;
+		numbers += control->results[i].numbers;
+		benchHistAdd(hist, control->results[i].hist);
+	}
+
+	printf("%-6s %6d %7d %14.0f %14.0f %10llu %10llu %10llu\n", modeNames[mode], nprocs,
+			seqLenOf(mode), calls / (elapsed / 1e9), numbers / (elapsed / 1e9),
+			(unsigned long long) benchHistPercentile(hist, calls, 0.50),
+			(unsigned long long) benchHistPercentile(hist, calls, 0.99),
+			(unsigned long long) benchHistPercentile(hist, calls, 0.999));
+	fflush(stdout);
+}
+
+int
+main(int argc, char *argv[]) {
+	char defaultList[] = "1,2,4";
+	struct control *control;
+	char *list, *tok;
+	int opt, i, m, anyMode = 0;
+
+	config.nruns = 0;
+	config.seqLen = 0;
+	config.window = 2;
+	config.seconds = 3;
+	list = defaultList;
+
+	while ((opt = getopt(argc, argv, "m:p:l:w:s:")) != -1) {
+		switch (opt) {
+			case 'm':
+				for (tok = strtok(optarg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+					for (m = 0; m < NMODES; m++) {
+						if (strcmp(tok, modeNames[m]) == 0)
+							break;
+					}
+
+					if (m == NMODES)
+						usage(argv[0]);
+
+					config.modes[m] = 1;
+					anyMode = 1;
+				}
+				break;
+			case 'p': list = optarg; break;
+			case 'l': config.seqLen = parseLong(optarg, 1, 1000000, argv[0]); break;
+			case 'w': config.window = parseLong(optarg, 1, SEQ_MAX_WINDOW, argv[0]); break;
+			case 's': config.seconds = parseLong(optarg, 1, 3600, argv[0]); break;
+			default: usage(argv[0]);
+		}
+	}
+
+	if (!anyMode) {
+		for (m = 0; m < NMODES; m++)
+			config.modes[m] = 1;
+	}
+
+	for (tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		if (config.nruns == MAX_RUNS)
+			usage(argv[0]);
+
+		config.procs[config.nruns++] = parseLong(tok, 1, MAX_PROCS, argv[0]);
+	}
+
+	if (config.nruns == 0)
+		usage(argv[0]);
+
+	control = benchShared(sizeof(*control));
+	if (control == NULL)
+		pexit("benchShared");
+
+	printf("%-6s %6s %7s %14s %14s %10s %10s %10s\n", "mode", "procs", "seqLen", "calls/s",
+			"numbers/s", "p50(ns)", "p99", "p99.9");
+
+	for (m = 0; m < NMODES; m++) {
+		if (!config.modes[m])
+			continue;
+
+		for (i = 0; i < config.nruns; i++)
+			run(control, m, config.procs[i]);
+	}
+
+	exit(EXIT_SUCCESS);
+}
@@ -5,47 +5,154 @@
  * to be "allocated"), builds the corresponding message to the server, writes it to
  * message queue, reads the response back, and prints it on the standard output.
  *
+ * With `-s`, the client asks the server for the shared memory segment holding the
+ * sequence instead, and allocates from it directly (see seqser.c.) This only works if
+ * the server was started with `-s` as well.
+ *
+ * With `-n`, the client gets that many numbers through the client library instead
+ * (see seqlib.h), which leases them from the server in blocks of `seqLen` numbers,
+ * and prints them one per line.
+ *
+ * If the server is sharded, requests are sent to the queue of the shard of the client
+ * process, and the numbers allocated are as far apart as there are shards (see
+ * SEQ_SHARDS on common.h.)
+ *
  * Based on similar program included in The Linux Programming Interface book.
  *
  * Usage:
  *
- *   $ ./seqcli seqLen
+ *   $ ./seqcli [-s] [-n count [-w window]] seqLen
+ *   -s: allocate from the shared memory segment of the server
+ *   -n: get `count` numbers, leasing blocks of `seqLen` of them
+ *   -w: blocks to request ahead of time with -n (default: 2)
  *   seqLen: an integer, number of resources to be allocated from the server's sequence.
  *
+ * Compile with:
+ *
+ *   $ cc -o seqcli seqcli.c seqlib.c
+ *
  * Author: Renato Mascarenhas Costa
  */
 
 #include "common.h"
+#include "seqlib.h"
 #include <unistd.h>
 #include <limits.h>
 
 static void helpAndExit(const char *progname, int status);
 
+/* asks the server for the segment holding the sequence, and attaches it */
+static struct seqShared *
+attachShared(int msgqid) {
+	struct requestMsg req;
+	struct responseMsg res;
+	struct seqShared *shared;
+
+	req.mtype = SERVER_MSG_TYPE;
+	req.pid = getpid();
+	req.seqLen = SEQ_DISCOVER;
+
+	if (msgsnd(msgqid, &req, REQ_MSG_LEN, 0) == -1)
+		pexit("msgsnd");
+
+	if (msgrcv(msgqid, &res, RESP_MSG_LEN, req.pid, 0) == -1)
+		pexit("msgrcv");
+
+	if (res.seqNum == -1) {
+		fprintf(stderr, "The server does not share its sequence (start it with -s)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	shared = shmat(res.seqNum, NULL, 0);
+	if (shared == (void *) -1)
+		pexit("shmat");
+
+	if (__atomic_load_n(&shared->magic, __ATOMIC_ACQUIRE) != SEQ_SHM_MAGIC) {
+		fprintf(stderr, "Segment %d does not hold a sequence\n", res.seqNum);
+		exit(EXIT_FAILURE);
+	}
+
+	return shared;
+}
+
 int
 main(int argc, char *argv[]) {
-	if (argc != 2)
-		helpAndExit(argv[0], EXIT_FAILURE);
-
 	char *endptr;
 	long length;
-	int msgqid;
+	int msgqid, opt, nshards;
 	pid_t pid;
+	int useShm = 0;
+	long count = 0, window = 2, i;
+	struct seqClient client;
+	int seqNum;
 
 	struct requestMsg req;
 	struct responseMsg res;
+	struct seqShared *shared;
+
+	while ((opt = getopt(argc, argv, "sn:w:")) != -1) {
+		switch (opt) {
+			case 's': useShm = 1; break;
+			case 'n':
+				count = strtol(optarg, &endptr, 10);
+				if (count < 1 || *endptr != '\0')
+					helpAndExit(argv[0], EXIT_FAILURE);
+				break;
+			case 'w':
+				window = strtol(optarg, &endptr, 10);
+				if (window < 1 || window > SEQ_MAX_WINDOW || *endptr != '\0')
+					helpAndExit(argv[0], EXIT_FAILURE);
+				break;
+			default: helpAndExit(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	if (argc != optind + 1)
+		helpAndExit(argv[0], EXIT_FAILURE);
 
 	/* if given length is not valid, print help message and terminate */
-	length = strtol(argv[1], &endptr, 10);
+	length = strtol(argv[optind], &endptr, 10);
 	if (length == LONG_MIN || length == LONG_MAX || length < 0 || length > INT_MAX || *endptr != '\0')
 		helpAndExit(argv[0], EXIT_FAILURE);
 
-	/* get server's message queue */
-	msgqid = msgget(MSGQ_KEY, S_IRUSR | S_IWUSR); /* client needs to read and write to the queue */
-	if (msgqid == -1)
-		pexit("msgget");
+	if (count > 0) {
+		if (length < 1)
+			helpAndExit(argv[0], EXIT_FAILURE);
+
+		if (seqOpen(&client, (int) length, (int) window, useShm) == -1)
+			pexit("seqOpen");
+
+		for (i = 0; i < count; i++) {
+			if (seqNext(&client, &seqNum) == -1)
+				pexit("seqNext");
+			printf("%d\n", seqNum);
+		}
+
+		if (seqClose(&client) == -1)
+			pexit("seqClose");
+
+		exit(EXIT_SUCCESS);
+	}
+
+	if (useShm) {
+		/* get server's message queue */
+		msgqid = msgget(MSGQ_KEY, S_IRUSR | S_IWUSR); /* client needs to read and write to the queue */
+		if (msgqid == -1)
+			pexit("msgget");
+
+		shared = attachShared(msgqid);
+		printf("Sequence Number: %d\n", __atomic_fetch_add(&shared->seqNum, (int) length, __ATOMIC_RELAXED));
+		exit(EXIT_SUCCESS);
+	}
 
 	pid = getpid();
 
+	/* the queue of the shard serving this process, which is the server's message
+	 * queue unless it is sharded */
+	msgqid = seqShardQueue(pid, &nshards);
+	if (msgqid == -1)
+		pexit("seqShardQueue");
+
 	req.mtype = SERVER_MSG_TYPE;
 	req.pid = pid;
 	req.seqLen = length;
@@ -58,7 +165,10 @@ main(int argc, char *argv[]) {
 	if (msgrcv(msgqid, &res, RESP_MSG_LEN, pid, 0) == -1) /* message type is the client PID */
 		pexit("msgrcv");
 
-	printf("Sequence Number: %d\n", res.seqNum);
+	if (nshards > 1)
+		printf("Sequence Number: %d (numbers %d apart)\n", res.seqNum, nshards);
+	else
+		printf("Sequence Number: %d\n", res.seqNum);
 
 	exit(EXIT_SUCCESS);
 }
@@ -70,6 +180,6 @@ helpAndExit(const char *progname, int status) {
 	if (status == EXIT_SUCCESS)
 		stream = stdout;
 
-	fprintf(stream, "Usage: %s [seqLen]\n", progname);
+	fprintf(stream, "Usage: %s [-s] [-n count [-w window]] [seqLen]\n", progname);
 	exit(status);
 }
@@ -0,0 +1,218 @@
+/* seqlib.c - Client library for the sequence server, leasing blocks of the sequence.
+ *
+ * See seqlib.h for more information.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#include "seqlib.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+/* sends a request without waiting for a response. Returns 1 if sent, 0 if the queue
+ * is full (the request will be retried later), or -1 on error */
+static int
+sendRequest(struct seqClient *client, int seqLen, int flags) {
+	struct requestMsg req;
+
+	req.mtype = SERVER_MSG_TYPE;
+	req.pid = client->pid;
+	req.seqLen = seqLen;
+
+	if (msgsnd(client->msgqid, &req, REQ_MSG_LEN, flags) == -1)
+		return (errno == EAGAIN) ? 0 : -1;
+
+	return 1;
+}
+
+/* reads responses to requests in flight: at least one if `block` is given, and
+ * then any others already on the queue */
+static int
+readResponses(struct seqClient *client, bool block) {
+	struct responseMsg res;
+	int flags = block ? 0 : IPC_NOWAIT;
+
+	while (client->inFlight > 0) {
+		if (msgrcv(client->msgqid, &res, RESP_MSG_LEN, client->pid, flags) == -1) {
+			if (errno == ENOMSG)
+				break;
+			if (errno == EINTR && flags == 0)
+				continue;
+			return -1;
+		}
+
+		client->ready[client->nready++] = res.seqNum;
+		client->inFlight--;
+		flags = IPC_NOWAIT;
+	}
+
+	return 0;
+}
+
+/* keeps `window` blocks requested or held, besides the one in use, so the next
+ * one is requested as soon as a block starts being used */
+static int
+refill(struct seqClient *client) {
+	int s;
+
+	while (client->inFlight + client->nready < client->window) {
+		s = sendRequest(client, client->leaseLen, IPC_NOWAIT);
+		if (s == -1)
+			return -1;
+
+		if (s == 0) {
+			/* full queue: make do with the requests already sent, unless there
+			 * are none, and this one has to wait for room */
+			if (client->inFlight + client->nready > 0)
+				break;
+
+			if (sendRequest(client, client->leaseLen, 0) == -1)
+				return -1;
+		}
+
+		client->inFlight++;
+	}
+
+	return 0;
+}
+
+static int
+discover(struct seqClient *client) {
+	struct responseMsg res;
+
+	if (sendRequest(client, SEQ_DISCOVER, 0) == -1)
+		return -1;
+
+	if (msgrcv(client->msgqid, &res, RESP_MSG_LEN, client->pid, 0) == -1)
+		return -1;
+
+	if (res.seqNum == -1) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	client->shared = shmat(res.seqNum, NULL, 0);
+	if (client->shared == (void *) -1) {
+		client->shared = NULL;
+		return -1;
+	}
+
+	if (__atomic_load_n(&client->shared->magic, __ATOMIC_ACQUIRE) != SEQ_SHM_MAGIC) {
+		shmdt(client->shared);
+		client->shared = NULL;
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+seqShardQueue(pid_t pid, int *nshards) {
+	struct requestMsg req;
+	struct responseMsg res;
+	int msgqid;
+
+	msgqid = msgget(MSGQ_KEY, S_IRUSR | S_IWUSR);
+	if (msgqid == -1)
+		return -1;
+
+	req.mtype = SERVER_MSG_TYPE;
+	req.pid = pid;
+	req.seqLen = SEQ_SHARDS;
+
+	if (msgsnd(msgqid, &req, REQ_MSG_LEN, 0) == -1)
+		return -1;
+
+	if (msgrcv(msgqid, &res, RESP_MSG_LEN, pid, 0) == -1)
+		return -1;
+
+	if (res.seqNum < 1 || res.seqNum > SEQ_MAX_SHARDS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	*nshards = res.seqNum;
+	if (*nshards == 1)
+		return msgqid;
+
+	return msgget(SEQ_SHARD_KEY(pid % *nshards), S_IRUSR | S_IWUSR);
+}
+
+int
+seqOpen(struct seqClient *client, int leaseLen, int window, bool useShm) {
+	if (leaseLen < 1 || window < 1 || window > SEQ_MAX_WINDOW) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	client->pid = getpid();
+	client->stride = 1;
+
+	/* the shared counter is found through the first queue, and needs no shards */
+	if (useShm)
+		client->msgqid = msgget(MSGQ_KEY, S_IRUSR | S_IWUSR);
+	else
+		client->msgqid = seqShardQueue(client->pid, &client->stride);
+
+	if (client->msgqid == -1)
+		return -1;
+
+	client->shared = NULL;
+	client->leaseLen = leaseLen;
+	client->window = window;
+	client->inFlight = 0;
+	client->next = client->end = 0;
+	client->nready = 0;
+
+	if (useShm)
+		return discover(client);
+
+	/* the first blocks are requested right away */
+	return refill(client);
+}
+
+int
+seqNext(struct seqClient *client, int *seqNum) {
+	int i;
+
+	if (client->next == client->end) {
+		if (client->shared != NULL) {
+			client->next = __atomic_fetch_add(&client->shared->seqNum, client->leaseLen, __ATOMIC_RELAXED);
+		} else {
+			/* responses come in the order requests were sent, so blocks are used
+			 * in the order they were leased */
+			if (readResponses(client, client->nready == 0) == -1)
+				return -1;
+
+			client->next = client->ready[0];
+			client->nready--;
+			for (i = 0; i < client->nready; i++)
+				client->ready[i] = client->ready[i + 1];
+
+			if (refill(client) == -1)
+				return -1;
+		}
+
+		client->end = client->next + client->leaseLen * client->stride;
+	}
+
+	*seqNum = client->next;
+	client->next += client->stride;
+	return 0;
+}
+
+int
+seqClose(struct seqClient *client) {
+	while (client->inFlight > 0) {
+		if (readResponses(client, true) == -1)
+			return -1;
+		client->nready = 0;
+	}
+
+	if (client->shared != NULL && shmdt(client->shared) == -1)
+		return -1;
+
+	return 0;
+}
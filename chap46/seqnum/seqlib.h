@@ -0,0 +1,76 @@
+/* seqlib.h - Client library for the sequence server, leasing blocks of the sequence.
+ *
+ * Making one request to the server for every number needed costs a message queue
+ * round trip each time. This library leases blocks of `leaseLen` numbers instead,
+ * and hands them out locally, one at a time. Requests for the next blocks are sent
+ * ahead of time, as soon as a block starts being used, so that by the time it runs
+ * out the response is usually waiting on the queue already. Besides the block in
+ * use, `window` blocks are kept requested or held, so several requests can be in
+ * flight and their responses read back in one go.
+ *
+ * If the server shares the sequence (see seqser.c), blocks are leased from the shared
+ * counter directly instead, and nothing is requested ahead of time. If the server is
+ * sharded, blocks are requested on the queue of the shard of the client's process
+ * ID, and the numbers of a block are as far apart as there are shards.
+ *
+ * Numbers leased and not handed out when the client is closed are lost: the sequence
+ * has gaps, but numbers are never handed out twice. Responses are addressed to the
+ * process ID of the client, so a process must use a single client at a time.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#ifndef SEQLIB_H
+#define SEQLIB_H
+
+#include "common.h"
+
+#include <stdbool.h>
+
+/* maximum number of blocks requested or held ahead of time */
+#define SEQ_MAX_WINDOW (64)
+
+struct seqClient {
+	int msgqid;
+	pid_t pid;
+	struct seqShared *shared; /* the server's segment, or NULL to use the queue */
+	int leaseLen;             /* numbers in each block */
+	int stride;               /* distance between the numbers of a block */
+	int window;               /* blocks requested or held ahead of time */
+	int inFlight;             /* requests sent, whose responses were not read yet */
+	int next, end;            /* numbers left in the block in use: [next, end) */
+	int ready[SEQ_MAX_WINDOW];/* first numbers of blocks received, not in use yet */
+	int nready;
+};
+
+/* connects to the server, to lease blocks of `leaseLen` numbers keeping `window`
+ * of them requested or held ahead of time. If `useShm` is given, blocks come
+ * from the server's shared memory segment instead.
+ *
+ * Returns 0 on success, or -1 on error (with `errno` properly set.)
+ */
+int seqOpen(struct seqClient *client, int leaseLen, int window, bool useShm);
+
+/* asks the server for its number of shards, storing it on `nshards`, and returns the
+ * identifier of the queue of the shard requests from `pid` should be sent to. This
+ * is also the distance between the numbers allocated by each request.
+ *
+ * Returns -1 on error (with `errno` properly set.)
+ */
+int seqShardQueue(pid_t pid, int *nshards);
+
+/* stores the next number of the sequence on `seqNum`, blocking only if no leased
+ * block has any number left.
+ *
+ * Returns 0 on success, or -1 on error (with `errno` properly set.)
+ */
+int seqNext(struct seqClient *client, int *seqNum);
+
+/* waits for the responses of any requests still in flight, so that they are not
+ * left on the queue, and detaches from the server's segment.
+ *
+ * Returns 0 on success, or -1 on error (with `errno` properly set.)
+ */
+int seqClose(struct seqClient *client);
+
+#endif /* SEQLIB_H */
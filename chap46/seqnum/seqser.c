@@ -25,46 +25,232 @@
  *   experiment with System V Message Queues. For a more robust implementation using the same
  *   IPC mechanism, see the talk(1) that is included in the solutions for this chapter.
  *
+ * When started with `-s`, the sequence number is kept in a System V shared memory
+ * segment instead, and clients can allocate ranges with an atomic fetch-and-add on it,
+ * without a round trip to the server. The message queue remains for clients to find
+ * the segment (see SEQ_DISCOVER on common.h) and for clients that do not use it; their
+ * requests are served from the same counter, so both kinds of clients can be mixed.
+ *
+ * With `-n`, requests are served on several queues instead, each drained by a thread
+ * of its own, so that the server is no longer bound to a single core. Each shard hands
+ * out an interleaved part of the sequence (see SEQ_SHARDS on common.h), so no number
+ * is handed out twice while shards share nothing. Clients ask for the number of shards
+ * on the first queue, and then use the shard of their process ID; every client in
+ * this directory does so. `-n` cannot be combined with `-s`.
+ *
  * Based on similar program included in The Linux Programming Interface book.
  *
  * Usage:
  *
- *   $ ./seqser
+ *   $ ./seqser [-s] [-n shards] [-q]
+ *   -s: share the sequence number with clients through shared memory
+ *   -n: serve requests on this many queues, with a thread each (default: 1)
+ *   -q: do not print a line for every request served
+ *
+ * Compile with:
+ *
+ *   $ cc -o seqser seqser.c -pthread
  *
  * Author: Renato Mascarenhas Costa
  */
 
 #include "common.h"
+#include <unistd.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
 
-int
-main() {
-	struct requestMsg req;
-	struct responseMsg res;
+/* a queue, and the part of the sequence handed out on it */
+struct shard {
+	int index;
 	int msgqid;
-	ssize_t msgLen;
-	int seqNum = 0; /* current sequence number, incremented on every client request */
+	int seqNum; /* next number of the shard: its index, then `nshards` apart */
+	pthread_t thread;
+};
+
+static struct shard shards[SEQ_MAX_SHARDS];
+static int nshards = 1;
+static int shmid = -1;
+static struct seqShared *shared = NULL;
+static bool quiet = false;
+
+/* the queues and the segment would outlive the server otherwise (and the queue key
+ * would prevent a new server from starting.) */
+static void
+removeQueues(void) {
+	int i;
+
+	for (i = 0; i < nshards; i++) {
+		if (shards[i].msgqid != -1)
+			msgctl(shards[i].msgqid, IPC_RMID, NULL);
+	}
+
+	if (shmid != -1)
+		shmctl(shmid, IPC_RMID, NULL);
+}
+
+static void
+removeIpc(int sig) {
+	removeQueues();
+
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
 
-	msgqid = msgget(MSGQ_KEY, IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR | S_IWGRP); /* rw--w---- */
-	if (msgqid == -1)
-		pexit("msgget");
+/* like `pexit`, for failures while the queues are being set up */
+static void
+setupFailed(const char *fCall) {
+	perror(fCall);
+	removeQueues();
+	exit(EXIT_FAILURE);
+}
+
+static void
+reply(struct shard *shard, pid_t pid, int seqNum) {
+	struct responseMsg res;
 
-	printf("Server started. Message Queue ID: %d\n", msgqid);
+	res.mtype = pid;
+	res.seqNum = seqNum;
+
+	if (msgsnd(shard->msgqid, &res, RESP_MSG_LEN, 0) == -1)
+		pexit("msgsnd");
+}
+
+/* loop reading client requests on the queue of a shard, and process them one at a
+ * time. Only the thread of the shard touches its sequence number */
+static void *
+serveShard(void *arg) {
+	struct shard *shard = arg;
+	struct requestMsg req;
+	ssize_t msgLen;
+	int seqNum;
 
-	/* Loop reading client requests, and process them one at a time */
 	for (;;) {
-		msgLen = msgrcv(msgqid, &req, REQ_MSG_LEN, SERVER_MSG_TYPE, 0); /* read messages of directed to the server */
-		if (msgLen == -1)
+		msgLen = msgrcv(shard->msgqid, &req, REQ_MSG_LEN, SERVER_MSG_TYPE, 0); /* read messages of directed to the server */
+		if (msgLen == -1) {
+			if (errno == EINTR)
+				continue;
+
+			/* the main thread removed the queues, and is about to terminate */
+			if (errno == EIDRM && shard->index != 0)
+				return NULL;
 			pexit("msgrcv");
+		}
 
-		res.mtype = req.pid;
-		res.seqNum = seqNum;
+		if (req.seqLen == SEQ_DISCOVER) {
+			reply(shard, req.pid, shmid);
 
-		if (msgsnd(msgqid, &res, RESP_MSG_LEN, 0) == -1)
-			pexit("msgsnd");
+			if (!quiet)
+				printf(">> Client discovery completed (pid=%ld shmid=%d)\n", (long) req.pid, shmid);
+			continue;
+		}
 
-		printf(">> Client request completed (pid=%ld seqLen=%d seqNum=%d)\n", (long) req.pid, req.seqLen, seqNum);
-		seqNum += req.seqLen;
+		if (req.seqLen == SEQ_SHARDS) {
+			reply(shard, req.pid, nshards);
+			continue;
+		}
+
+		/* clients allocate from the shared counter concurrently */
+		if (shared != NULL) {
+			seqNum = __atomic_fetch_add(&shared->seqNum, req.seqLen, __ATOMIC_RELAXED);
+		} else {
+			seqNum = shard->seqNum;
+			shard->seqNum += req.seqLen * nshards;
+		}
+
+		reply(shard, req.pid, seqNum);
+
+		if (!quiet)
+			printf(">> Client request completed (shard=%d pid=%ld seqLen=%d seqNum=%d)\n",
+					shard->index, (long) req.pid, req.seqLen, seqNum);
+	}
+
+	return NULL;
+}
+
+int
+main(int argc, char *argv[]) {
+	sigset_t signals, saved;
+	char *endptr;
+	int opt, i, s;
+	bool useShm = false;
+
+	while ((opt = getopt(argc, argv, "sn:q")) != -1) {
+		switch (opt) {
+			case 's': useShm = true; break;
+			case 'n':
+				nshards = (int) strtol(optarg, &endptr, 10);
+				if (*endptr != '\0' || nshards < 1 || nshards > SEQ_MAX_SHARDS) {
+					fprintf(stderr, "%s: invalid number of shards: %s\n", argv[0], optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'q': quiet = true; break;
+			default:
+				fprintf(stderr, "Usage: %s [-s] [-n shards] [-q]\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if (useShm && nshards > 1) {
+		fprintf(stderr, "%s: -s and -n cannot be used together\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < nshards; i++) {
+		shards[i].index = i;
+		shards[i].msgqid = -1;
+		shards[i].seqNum = i;
 	}
 
+	for (i = 0; i < nshards; i++) {
+		shards[i].msgqid = msgget(SEQ_SHARD_KEY(i), IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR | S_IWGRP); /* rw--w---- */
+		if (shards[i].msgqid == -1)
+			setupFailed("msgget");
+	}
+
+	signal(SIGINT, removeIpc);
+	signal(SIGTERM, removeIpc);
+
+	if (useShm) {
+		/* same permissions as the queue: clients need to update the counter */
+		shmid = shmget(IPC_PRIVATE, sizeof(struct seqShared), IPC_CREAT | S_IRUSR | S_IWUSR | S_IWGRP);
+		if (shmid == -1)
+			setupFailed("shmget");
+
+		shared = shmat(shmid, NULL, 0);
+		if (shared == (void *) -1)
+			setupFailed("shmat");
+
+		shared->seqNum = 0;
+		__atomic_store_n(&shared->magic, SEQ_SHM_MAGIC, __ATOMIC_RELEASE);
+	}
+
+	printf("Server started. Message Queue ID: %d\n", shards[0].msgqid);
+	for (i = 1; i < nshards; i++)
+		printf("Shard %d served on Message Queue ID: %d\n", i, shards[i].msgqid);
+	if (useShm)
+		printf("Sequence shared in segment ID: %d\n", shmid);
+
+	/* the first shard is served by the main thread, which is also the one handling
+	 * signals: the others are created with them blocked */
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, &saved);
+
+	for (i = 1; i < nshards; i++) {
+		s = pthread_create(&shards[i].thread, NULL, serveShard, &shards[i]);
+		if (s != 0) {
+			errno = s;
+			setupFailed("pthread_create");
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+	serveShard(&shards[0]);
 	exit(EXIT_SUCCESS);
 }
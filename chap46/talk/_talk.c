@@ -6,15 +6,36 @@
  * connection request carried out. Once the two sides of the communication have
  * agreed to talk, chatting can commence.
  *
+ * Chat lines are sent as framed messages (see struct talkMsg on common.h), which
+ * carry the session ID given by the daemon and only the bytes of the line. With
+ * `-l`, the fixed size messages carrying both usernames are used instead.
+ *
+ * With `-u`, the client talks to a daemon serving a Unix domain socket (see _talkd.c)
+ * and needs no message queue. A single process then waits for both the lines typed
+ * by the user and the messages from the daemon with poll(2), instead of forking a
+ * listener for the latter.
+ *
+ * With `-s`, the client keeps talking over message queues, but in a single process
+ * as well: it creates a FIFO (at TALK_NOTIFY_PATH_FMT) that the daemon writes a
+ * byte to for every message it puts on the client's queue, and waits for the FIFO
+ * and the terminal with poll(2), reading the queue when the FIFO is readable. With
+ * no listener process, there are no signals to coordinate the two, and no context
+ * switches between them. If the FIFO cannot be created, a listener is forked as
+ * usual.
+ *
  * Usage:
  *
- *   $ ./_talk [username]
+ *   $ ./_talk [-l] [-u] [-s] [username]
+ *   -l - do not use framed messages.
+ *   -u - connect to the daemon over its socket.
+ *   -s - do not fork a listener process when using message queues.
  *   username - the username of a currently logged in user.
  *
  * Author: Renato Mascarenhas Costa
  */
 
 #include "common.h"
+#include <poll.h>
 
 /* By default, wait for at most a number of seconds before giving up chatting with
  * the requested user */
@@ -23,19 +44,39 @@
 static void cleanup(void);
 static void logout(void);
 static void readServerId(void);
+static void connectServer(void);
+static int sendRequest(const void *msg, size_t len);
 static void helpAndExit(const char *progname, int status);
 static void childHandler(int sig);
 static void alarmHandler(int sig);
 
 static void spawnListener(void);
 static void chatLoop(void);
+static void eventLoop(void);
+static int createNotify(void);
+
+/* any message the server may send to a client */
+union talkIncoming {
+	long mtype;
+	struct requestMsg req;
+	struct talkMsg msg;
+	struct responseMsg res;
+};
+
+static ssize_t receiveMsg(union talkIncoming *in, size_t len);
 
 /* make them accessible througout the client code so that the cleanup funciton
  * can delete the message queue on termination */
 static int serverId;
-static int clientId;
+static int clientId = -1;
+static int serverFd = -1; /* socket connected to the server, with `-u` */
+static int notifyFd = -1; /* FIFO the server tells about messages on, with `-s` */
+static char notifyPath[PATH_MAX];
 static pid_t childPid = 1;
 
+static int framed = 1; /* send framed messages */
+static int sessionId;  /* given by the server on connection, when framed */
+
 /* pointer to the recipient of the chat. This is assigned to argv[1] once
  * execution starts */
 static char *recipient;
@@ -43,24 +84,42 @@ static char *recipient;
 int
 main(int argc, char *argv[]) {
 	struct requestMsg req;
-	struct responseMsg res;
+	union talkIncoming in;
 	struct sigaction sa;
 	ssize_t msgLen;
-	int savedErrno;
+	int savedErrno, opt, useSocket = 0, singleProcess = 0;
+
+	while ((opt = getopt(argc, argv, "lus")) != -1) {
+		switch (opt) {
+			case 'l': framed = 0; break;
+			case 'u': useSocket = 1; break;
+			case 's': singleProcess = 1; break;
+			default: helpAndExit(argv[0], EXIT_FAILURE);
+		}
+	}
 
-	if (argc != 2) {
+	if (argc != optind + 1) {
 		helpAndExit(argv[0], EXIT_FAILURE);
 	}
 
-	readServerId();
+	if (useSocket) {
+		connectServer();
+	} else {
+		readServerId();
 
-	clientId = msgget(IPC_PRIVATE, S_IRUSR | S_IWUSR | S_IWGRP);
-	if (clientId == -1)
-		pexit("msgget");
+		clientId = msgget(IPC_PRIVATE, S_IRUSR | S_IWUSR | S_IWGRP);
+		if (clientId == -1)
+			pexit("msgget");
+	}
 
 	if (atexit(cleanup) != 0)
 		pexit("atexit");
 
+	/* the FIFO must exist by the time the server handles the connection request.
+	 * A socket needs none: the process waits on it directly */
+	if (singleProcess && !useSocket && createNotify() == -1)
+		fprintf(stderr, "Warning: could not create %s (%s), forking a listener\n", notifyPath, strerror(errno));
+
 	sigemptyset(&sa.sa_mask);
 	sa.sa_flags = SA_RESTART;
 	sa.sa_handler = childHandler;
@@ -75,22 +134,22 @@ main(int argc, char *argv[]) {
 	if (sigaction(SIGALRM, &sa, NULL) == -1)
 		pexit("sigaction");
 
-	recipient = argv[1];
+	recipient = argv[optind];
 
-	/* Request connection to talk with username on argv[1] */
-	req.mtype = TALK_MT_REQ_CONNECT;
+	/* Request connection to talk with the username given */
+	req.mtype = framed ? TALK_MT_REQ_CONNECT_FRAMED : TALK_MT_REQ_CONNECT;
 	req.clientId = clientId;
 	strncpy(req.fromUsername, getlogin(), LOGIN_NAME_MAX);
 	strncpy(req.toUsername, recipient, LOGIN_NAME_MAX);
 
 	printf("Requesting connection...\n");
-	if (msgsnd(serverId, &req, TALK_REQ_MSG_SIZE, 0) == -1)
-		pexit("msgsnd");
+	if (sendRequest(&req, TALK_REQ_MSG_SIZE) == -1)
+		pexit("sendRequest");
 
 	/* set an alarm so that we do not wait indefinitely for the recipient to accept
 	 * the connection request */
 	alarm(WAIT_CONNECTION_TIMEOUT);
-	msgLen = msgrcv(clientId, &res, TALK_RES_MSG_SIZE, 0, 0);
+	msgLen = receiveMsg(&in, TALK_RES_MSG_SIZE);
 
 	/* make sure the call to `alarm` will not change the value of errno from msgsnd */
 	savedErrno = errno;
@@ -102,7 +161,7 @@ main(int argc, char *argv[]) {
 		if (errno == EINTR)
 			fprintf(stderr, "Timeout: %s did not reply back in %ds\n", recipient, WAIT_CONNECTION_TIMEOUT);
 		else /* other error */
-			perror("msgrcv");
+			perror("receiveMsg");
 
 		/* timeout or error reading from the queue: indicate to the server that we
 		 * are no longer connected */
@@ -111,23 +170,82 @@ main(int argc, char *argv[]) {
 		exit(EXIT_FAILURE);
 	}
 
-	switch (res.mtype) {
+	switch (in.mtype) {
 		case TALK_MT_RES_CONNECT_ACCEPT:
+			in.res.data[DATA_SIZE - 1] = '\0';
+			sessionId = (int) strtol(in.res.data, NULL, 10);
 			printf("Connected.\n");
-			spawnListener();
-			chatLoop();
+			if (useSocket || notifyFd != -1) {
+				eventLoop();
+			} else {
+				spawnListener();
+				chatLoop();
+			}
 			break;
 		case TALK_MT_RES_CONNECT_FAILURE:
-			printf("Error: %s\n", res.data);
+			in.res.data[DATA_SIZE - 1] = '\0';
+			printf("Error: %s\n", in.res.data);
 			break;
 		default:
-			fprintf(stderr, "Unexpected response from the server: %ld\n", res.mtype);
+			fprintf(stderr, "Unexpected response from the server: %ld\n", in.mtype);
 			exit(EXIT_FAILURE);
 	}
 
 	exit(EXIT_SUCCESS);
 }
 
+/* sends a message to the server, on whichever transport is in use. As for `msgsnd`,
+ * `len` does not include the message type */
+static int
+sendRequest(const void *msg, size_t len) {
+	if (serverFd != -1)
+		return (send(serverFd, msg, TALK_PACKET_SIZE(len), MSG_NOSIGNAL) == -1) ? -1 : 0;
+
+	return msgsnd(serverId, msg, len, 0);
+}
+
+/* receives a message of at most `len` bytes (not counting the message type) from
+ * the server, and returns its length like `msgrcv` does */
+static ssize_t
+receiveMsg(union talkIncoming *in, size_t len) {
+	ssize_t n;
+
+	if (serverFd == -1)
+		return msgrcv(clientId, in, len, 0, 0);
+
+	n = recv(serverFd, in, TALK_PACKET_SIZE(len), 0);
+	if (n == 0 || (n > 0 && n < (ssize_t) sizeof(long))) {
+		/* the server closed the socket */
+		errno = ECONNRESET;
+		return -1;
+	}
+
+	return (n == -1) ? -1 : n - (ssize_t) sizeof(long);
+}
+
+static void
+connectServer() {
+	struct sockaddr_un addr;
+
+	serverFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (serverFd == -1)
+		pexit("socket");
+
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, TALK_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+
+	if (connect(serverFd, (struct sockaddr *) &addr, sizeof(struct sockaddr_un)) == -1) {
+		/* as with the key file, tell that the server might not be running */
+		if (errno == ENOENT || errno == ECONNREFUSED) {
+			fprintf(stderr, "Error: server socket not found. Is the server running with -u?\n");
+			exit(EXIT_FAILURE);
+		}
+
+		pexit("connect");
+	}
+}
+
 static void
 logout() {
 	struct requestMsg req;
@@ -136,7 +254,8 @@ logout() {
 	strncpy(req.fromUsername, getlogin(), LOGIN_NAME_MAX);
 	strncpy(req.toUsername, recipient, LOGIN_NAME_MAX);
 
-	msgsnd(serverId, &req, TALK_RES_MSG_SIZE, 0);
+	/* no data is needed */
+	sendRequest(&req, TALK_REQ_MSG_SIZE - DATA_SIZE);
 
 	/* terminate the child listening for incoming messages */
 	if (childPid != 1) {
@@ -145,6 +264,28 @@ logout() {
 	}
 }
 
+/* creates and opens the FIFO the server notifies this client on. Returns -1 on
+ * error, leaving nothing behind */
+static int
+createNotify() {
+	int savedErrno;
+
+	snprintf(notifyPath, PATH_MAX, TALK_NOTIFY_PATH_FMT, clientId);
+	if (mkfifo(notifyPath, S_IRUSR | S_IWUSR | S_IWGRP) == -1)
+		return -1;
+
+	/* opened for writing as well, so that it never reads as end of file */
+	notifyFd = open(notifyPath, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (notifyFd == -1) {
+		savedErrno = errno;
+		unlink(notifyPath);
+		errno = savedErrno;
+		return -1;
+	}
+
+	return 0;
+}
+
 static void
 readServerId() {
 	int fd;
@@ -184,19 +325,29 @@ readServerId() {
 		pexit("close");
 }
 
+static char *prompt = ">> ";
+
+/* sends a line typed by the user to the other end of the conversation */
 static void
-chatLoop() {
-	char *me = getlogin();
-	char buf[BUFSIZ];
-	char *prompt = ">> ";
+sendLine(const char *me, char *buf) {
 	struct requestMsg req;
+	struct talkMsg msg;
 
-	printf(prompt);
-	while (fgets(buf, BUFSIZ, stdin) != NULL) {
-		/* drop newline character if present */
-		if (buf[strlen(buf) - 1] == '\n')
-			buf[strlen(buf) - 1] = '\0';
+	/* drop newline character if present */
+	if (buf[0] != '\0' && buf[strlen(buf) - 1] == '\n')
+		buf[strlen(buf) - 1] = '\0';
+
+	if (framed) {
+		/* only the session and the line itself are sent */
+		msg.mtype = TALK_MT_REQ_TALK_FMSG;
+		msg.sessionId = sessionId;
 
+		strncpy(msg.data, buf, DATA_SIZE);
+		msg.data[DATA_SIZE - 1] = '\0';
+
+		if (sendRequest(&msg, TALK_FMSG_SIZE(strlen(msg.data) + 1)) == -1)
+			pexit("sendRequest");
+	} else {
 		req.mtype = TALK_MT_REQ_TALK_MSG;
 		strncpy(req.fromUsername, me, LOGIN_NAME_MAX);
 		strncpy(req.toUsername, recipient, LOGIN_NAME_MAX);
@@ -204,11 +355,159 @@ chatLoop() {
 		strncpy(req.data, buf, DATA_SIZE);
 		req.data[DATA_SIZE - 1] = '\0';
 
-		if (msgsnd(serverId, &req, TALK_REQ_MSG_SIZE, 0) == -1)
-			pexit("msgsnd");
+		if (sendRequest(&req, TALK_REQ_MSG_SIZE) == -1)
+			pexit("sendRequest");
+	}
+
+	printf("[%s] %s\n", me, buf);
+	printf(prompt);
+}
+
+static void
+chatLoop() {
+	char *me = getlogin();
+	char buf[BUFSIZ];
+
+	printf(prompt);
+	while (fgets(buf, BUFSIZ, stdin) != NULL)
+		sendLine(me, buf);
+
+	/* user wants to disconnect - logout from the server */
+	logout();
+}
+
+/* shows a message from the other end of the conversation. Returns 1 if the
+ * connection was dropped, and -1 if the message is unknown */
+static int
+showMessage(union talkIncoming *in, ssize_t msgLen) {
+	switch (in->mtype) {
+		case TALK_MT_REQ_TALK_MSG:
+			in->req.data[DATA_SIZE - 1] = '\0';
+			printf("\n[%s] %s\n", recipient, in->req.data);
+			return 0;
+		case TALK_MT_REQ_TALK_FMSG:
+			/* only the bytes in use were sent */
+			if (msgLen > (ssize_t) TALK_FMSG_SIZE(0)) {
+				in->msg.data[msgLen - TALK_FMSG_SIZE(0) - 1] = '\0';
+				printf("\n[%s] %s\n", recipient, in->msg.data);
+			}
+			return 0;
+		case TALK_MT_REQ_TALK_CONN_DROP:
+			return 1;
+		default:
+			fprintf(stderr, "Error: Received unknown message type from the server: %ld.\n", in->mtype);
+			return -1;
+	}
+}
+
+/* shows a message received in the event loop, terminating if the conversation is
+ * over. A message of -1 bytes means that it could not be received at all */
+static void
+handleIncoming(union talkIncoming *in, ssize_t msgLen) {
+	if (msgLen == -1) {
+		printf("\nLost connection to the server. Terminating.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	switch (showMessage(in, msgLen)) {
+		case 1:
+			printf("\nConnection dropped by remote user. Terminating.\n");
+			exit(EXIT_SUCCESS);
+		case -1:
+			printf("\nError processing incoming message. Terminating.\n");
+			exit(EXIT_FAILURE);
+	}
+}
+
+/* handles what the server sent: a single message from the socket or, with `-s`,
+ * every message waiting on the queue */
+static void
+receivePending() {
+	union talkIncoming in;
+	char drain[64];
+	ssize_t n;
+
+	if (serverFd != -1) {
+		handleIncoming(&in, receiveMsg(&in, TALK_REQ_MSG_SIZE));
+		return;
+	}
+
+	/* the FIFO is emptied before the queue is read: a message sent after that comes
+	 * with a byte of its own, so none is left waiting unnoticed */
+	while (read(notifyFd, drain, sizeof(drain)) > 0)
+		;
 
-		printf("[%s] %s\n", me, req.data);
-		printf(prompt);
+	for (;;) {
+		n = msgrcv(clientId, &in, TALK_REQ_MSG_SIZE, 0, IPC_NOWAIT);
+		if (n == -1 && errno == ENOMSG)
+			return;
+
+		handleIncoming(&in, n);
+	}
+}
+
+/* the chat loop of a single process: the lines typed and the messages received
+ * (on the socket, or told about on the FIFO) are both handled as they come. Input
+ * is read in chunks and split into lines here, as data buffered by stdio would not
+ * be seen by `poll` */
+static void
+eventLoop() {
+	char *me = getlogin();
+	char buf[BUFSIZ], *nl;
+	size_t used = 0;
+	struct pollfd fds[2];
+	ssize_t n;
+
+	fds[0].fd = STDIN_FILENO;
+	fds[0].events = POLLIN;
+	fds[1].fd = (serverFd != -1) ? serverFd : notifyFd;
+	fds[1].events = POLLIN;
+
+	printf(prompt);
+	for (;;) {
+		if (poll(fds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			pexit("poll");
+		}
+
+		if (fds[1].revents != 0)
+			receivePending();
+
+		if (fds[0].revents == 0)
+			continue;
+
+		n = read(STDIN_FILENO, buf + used, sizeof(buf) - 1 - used);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			pexit("read");
+		}
+
+		if (n == 0) {
+			/* end of input: send what is left of the last line */
+			if (used > 0) {
+				buf[used] = '\0';
+				sendLine(me, buf);
+			}
+			break;
+		}
+
+		used += n;
+		while ((nl = memchr(buf, '\n', used)) != NULL) {
+			*nl = '\0';
+			sendLine(me, buf);
+
+			used -= nl + 1 - buf;
+			memmove(buf, nl + 1, used);
+		}
+
+		/* a line too long for the buffer is sent in pieces, as `fgets` would */
+		if (used == sizeof(buf) - 1) {
+			buf[used] = '\0';
+			sendLine(me, buf);
+			used = 0;
+		}
 	}
 
 	/* user wants to disconnect - logout from the server */
@@ -218,7 +517,7 @@ chatLoop() {
 static void
 spawnListener() {
 	ssize_t msgLen;
-	struct requestMsg req;
+	union talkIncoming in;
 
 	switch (childPid = fork()) {
 		case -1:
@@ -236,23 +535,19 @@ spawnListener() {
 	/* child: listen the client message queue for incoming messages from the
 	 * other end of the conversation */
 	for (;;) {
-		msgLen = msgrcv(clientId, &req, TALK_REQ_MSG_SIZE, 0, 0);
+		msgLen = msgrcv(clientId, &in, TALK_REQ_MSG_SIZE, 0, 0);
 
 		/* if reading from the queue fails, terminate with a failure status, to be picked
 		 * by the the parent process */
 		if (msgLen == -1)
 			_exit(EXIT_FAILURE);
 
-		switch (req.mtype) {
-			case TALK_MT_REQ_TALK_MSG:
-				printf("\n[%s] %s\n", recipient, req.data);
-				break;
-			case TALK_MT_REQ_TALK_CONN_DROP:
+		switch (showMessage(&in, msgLen)) {
+			case 1:
 				/* in case the connection was dropped from the other side of the connection,
 				 * terminate, since there is no one listening */
 				_exit(EXIT_SUCCESS);
-			default:
-				fprintf(stderr, "Error: Received unknown message type from the server: %ld.\n", req.mtype);
+			case -1:
 				_exit(EXIT_FAILURE);
 		}
 	}
@@ -286,7 +581,11 @@ alarmHandler(__attribute__((unused)) int sig) {}
 
 static void
 cleanup() {
-	if (msgctl(clientId, IPC_RMID, NULL) == -1)
+	if (notifyFd != -1)
+		unlink(notifyPath);
+
+	/* there is no queue to remove when talking over a socket */
+	if (clientId != -1 && msgctl(clientId, IPC_RMID, NULL) == -1)
 		pexit("msgctl");
 }
 
@@ -297,6 +596,6 @@ helpAndExit(const char *progname, int status) {
 	if (status == EXIT_SUCCESS)
 		stream = stdout;
 
-	fprintf(stream, "Usage: %s [username]\n", progname);
+	fprintf(stream, "Usage: %s [-l] [-u] [-s] [username]\n", progname);
 	exit(status);
 }
@@ -19,26 +19,52 @@
  * know only how to send messages to the daemon requesting things to be done on
  * their behalf.
  *
- * This daemon serves requests coming from clients using a fork mechanism: this means
- * that each incoming request will cause a new process to be created to serve it. A
- * maximum of MAX_CHILDREN child processes must exist at one given time - if the limit
- * is reached, incoming requests will be rejected.
+ * This daemon serves requests one at a time, in a single process: serving a request
+ * takes no more than a few system calls, far less than creating a process to serve
+ * it would. Therefore, no call made while serving a request may block: messages are
+ * sent to clients with IPC_NOWAIT, and a message for a client whose queue is full is
+ * dropped (and logged) rather than stalling every other conversation.
  *
- * Connections are managed using a series of files in a temporary directory used by
- * this program (located at TALK_CONN_DIR.) If user u1 wants to talk to user u2,
- * the server creates the a file named `u1:u2` in the temporary directory. The content
- * of this file is the message queue ID where `u1`'s client is waiting for messages.
- * If `u2` accepts the invitation to talk, and issue a command to talk to `u1`, another
- * file, `u2:u1` is created containing the message queue ID of `u2`. Since the counterpart
- * connection was previously established, both clients are sent a connection accept message,
- * and can start talking.
+ * Connections are kept in a hash table in the memory of the daemon, so that routing
+ * a message takes no system call besides sending it. If user u1 wants to talk to
+ * user u2, the server registers the connection `u1 -> u2`, along with the message
+ * queue ID where `u1`'s client is waiting for messages. If `u2` accepts the invitation
+ * to talk, and issue a command to talk to `u1`, the connection `u2 -> u1` is registered
+ * with the message queue ID of `u2`. Since the counterpart connection was previously
+ * established, both clients are sent a connection accept message, and can start talking.
  *
- * When a client is disconnects, both files `u1:u2` and `u2:u1` are removed. In order
- * to communicate again, a new connection request needs to be sent.
+ * When a client is disconnects, both connections `u1 -> u2` and `u2 -> u1` are removed.
+ * In order to communicate again, a new connection request needs to be sent.
+ *
+ * Clients that connect with TALK_MT_REQ_CONNECT_FRAMED are given the session ID of
+ * their connection, and send chat lines with it instead of the usernames, with only
+ * the bytes in use (see struct talkMsg.) Messages to every client are sent with no
+ * more bytes than necessary as well, so clients of both kinds can talk to each other.
+ *
+ * The temporary directory used by this program (located at TALK_CONN_DIR) only holds
+ * the file with the ID of the daemon's message queue, for clients to find it.
+ *
+ * With `-u`, clients talk to the daemon over a SOCK_SEQPACKET Unix domain socket
+ * (at TALK_SOCKET_PATH) instead, with the very same messages, one per packet. The
+ * daemon then waits for requests on every connected socket at once with epoll(7),
+ * still in a single process, and a message for a client is written straight to its
+ * socket, so clients need no message queue of their own. A client closing its socket
+ * is disconnected from whoever it was talking to.
+ *
+ * A client using a message queue can do without a process blocked on it, too: if it
+ * created a FIFO at TALK_NOTIFY_PATH_FMT (for its queue ID) before connecting, the
+ * daemon keeps it open for as long as the connection lasts, and writes a byte to it
+ * after every message sent to the queue. The client then waits for the FIFO and its
+ * terminal at once, and reads its queue when the FIFO is readable (see _talk.c.)
  *
  * Usage:
  *
- *   $ ./_talkd
+ *   $ ./_talkd [-u]
+ *   -u - serve clients over a Unix domain socket instead of a message queue.
+ *
+ * Built along with closefds.c:
+ *
+ *   $ gcc -o _talkd _talkd.c ../../lib/closefds.c
  *
  * Author: Renato Mascarenhas Costa
  */
@@ -53,46 +79,94 @@
 #include <ftw.h>
 #include <syslog.h>
 #include <stdbool.h>
+#include <sys/epoll.h>
 
-#define MAX_CHILDREN       (128)                    /* do not fork more than MAX_CHILDREN processes */
-#define CONN_FILE_TEMPLATE (TALK_CONN_DIR "/%s:%s") /* template for full path of connection files */
+#include "../../lib/closefds.h"
 
-#define T_VERIFY (1) /* if the connection already exists, do not error out */
+#define CONN_BUCKETS (1024) /* buckets of the connection table; chains grow past that */
+#define TTY_BUCKETS  (256)  /* buckets of the index of logged in users */
+#define MIN_SESSIONS (64)   /* initial size of the session table, doubled when full */
+#define MAX_EVENTS   (64)   /* events taken from epoll at a time, with `-u` */
 
 #define TALK_PATH_UTMP ("/run/utmp") /* this varies according to Linux distribution. Edit accordingly */
 
 #define BUFSIZE (1024)
 #define PROGNAME ("_talk")
 
-/* if system does not define the maximum number of open file descriptors,
- * make a guess */
-#define MAX_FD_GUESS (8192)
-
 static void init(void);
 static void cleanup(void);
 static void cleanupHandler(int sig);
-static void childHandler(int sig);
-static void serveRequest(const struct requestMsg *req);
+/* any message a client may send to the server */
+union talkRequest {
+	long mtype;
+	struct requestMsg req;
+	struct talkMsg fmsg;
+};
+
+static void serveRequest(union talkRequest *req, ssize_t msgLen, int fd);
+static int serveSockets(void);
 
 static key_t serverId;
+static int listenFd = -1;
+static bool useSocket = false; /* serve clients over TALK_SOCKET_PATH */
+
+/* where a client waits for messages: its message queue or, with `-u`, the socket it
+ * is connected on (the other field is then -1). Clients on a queue may also be
+ * notified of messages on a FIFO, which is otherwise -1 */
+struct endpoint {
+	int queueId;
+	int fd;
+	int notifyFd;
+};
+
+/* a connection from one user to another, and the endpoint of the first user's client */
+struct conn {
+	char from[LOGIN_NAME_MAX + 1];
+	char to[LOGIN_NAME_MAX + 1];
+	struct endpoint ep;
+	int sessionId; /* index on the session table, plus one */
+	bool framed;   /* whether the client uses framed messages */
+	struct conn *next;
+};
+
+static struct conn *conns[CONN_BUCKETS];
+
+/* connections by session ID. Free slots are NULL */
+static struct conn **sessions;
+static int nsessions;
+
+/* the terminal a user is logged in on, as found on the utmp file. The index of
+ * these is rebuilt only when the file changes (see `refreshTtyIndex`) */
+struct ttyEntry {
+	char user[UT_NAMESIZE + 1];
+	char line[UT_LINESIZE + 1];
+	struct ttyEntry *next;
+};
+
+static struct ttyEntry *ttys[TTY_BUCKETS];
+static struct stat utmpStat; /* state of the utmp file when the index was built */
+static bool ttysLoaded = false;
 
 int
-main() {
-	struct requestMsg req;
-	pid_t pid;
+main(int argc, char *argv[]) {
+	union talkRequest req;
 	ssize_t msgLen;
 	struct sigaction sa;
-
-	/* SIGCHLD to reap terminated children (serving requests) */
-	sigemptyset(&sa.sa_mask);
-	sa.sa_flags = SA_RESTART;
-	sa.sa_handler = childHandler;
-	if (sigaction(SIGCHLD, &sa, NULL) == -1)
-		pexit("sigaction");
+	int opt;
+
+	while ((opt = getopt(argc, argv, "u")) != -1) {
+		switch (opt) {
+			case 'u': useSocket = true; break;
+			default:
+				fprintf(stderr, "Usage: %s [-u]\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
 
 	/* cleanup when a deadly signal is received */
 	/* SIGINT */
 	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;
 	sa.sa_handler = cleanupHandler;
 	if (sigaction(SIGINT, &sa, NULL) == -1)
 		pexit("sigaction");
@@ -107,31 +181,26 @@ main() {
 
 	init();
 
-	/* loop reading requests, handle each in a separate child process */
+	if (useSocket) {
+		serveSockets();
+		syslog(LOG_ERR, "Failure serving sockets: %s, terminating", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	/* loop reading requests, serving each before reading the next */
 	for (;;) {
 		msgLen = msgrcv(serverId, &req, TALK_REQ_MSG_SIZE, 0, 0);
 		if (msgLen == -1) {
 			if (errno == EINTR)
-				continue; /* Interrupted by the SIGCHLD handler - continue work */
+				continue; /* Interrupted by a signal - continue work */
 
 			break; /* other error - break out of the loop */
 		}
 
-		pid = fork();
-		if (pid == -1) {
-			perror("fork");
-			break;
-		}
-
-		if (pid == 0) {
-			serveRequest(&req);  /* child process - serve the request */
-			_exit(EXIT_SUCCESS); /* reached this point - request was served successfully */
-		}
-
-		/* parent loops to wait for the next message */
+		serveRequest(&req, msgLen, -1);
 	}
 
-	/* error on `msgrcv` or `fork` - remove the message queue and terminate */
+	/* error on `msgrcv` - remove the message queue and terminate */
 	if (msgctl(serverId, IPC_RMID, NULL) == -1)
 		pexit("msgctl");
 
@@ -142,7 +211,7 @@ main() {
  * section 37.2 of The Linux Programming Interface, by Michael Kerrisk */
 static void
 becomeDaemon() {
-	int fd, maxfd;
+	int fd;
 
 	/* 1. become a background process */
 	switch (fork()) {
@@ -170,16 +239,12 @@ becomeDaemon() {
 	/* 5. Change to the root directory */
 	chdir("/");
 
-	/* 6. Close all open files */
-	maxfd = sysconf(_SC_OPEN_MAX);
-	if (maxfd == -1) /* if not available, guess */
-		maxfd = MAX_FD_GUESS;
-
-	for (fd = 0; fd < maxfd; ++fd)
-		close(fd);
+	/* 6. Close all open files: a close_range(2) rather than a close(2) for every
+	 * descriptor up to RLIMIT_NOFILE */
+	if (closeFdsExcept(NULL, 0) == -1)
+		pexit("closeFdsExcept");
 
 	/* 7. Reopen standard file descriptors to /dev/null */
-	close(STDIN_FILENO);
 	fd = open("/dev/null", O_RDWR);
 
 	if (fd != STDIN_FILENO) {
@@ -198,6 +263,29 @@ becomeDaemon() {
 	}
 }
 
+/* creates the socket clients connect to with `-u`. Like the message queue, it can
+ * be written to by the group */
+static int
+listenSocket() {
+	struct sockaddr_un addr;
+
+	listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listenFd == -1)
+		return -1;
+
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, TALK_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+
+	if (bind(listenFd, (struct sockaddr *) &addr, sizeof(struct sockaddr_un)) == -1)
+		return -1;
+
+	if (chmod(TALK_SOCKET_PATH, S_IRUSR | S_IWUSR | S_IWGRP) == -1)
+		return -1;
+
+	return listen(listenFd, SOMAXCONN);
+}
+
 static void
 init() {
 	int fd;
@@ -216,6 +304,25 @@ init() {
 		pexit("mkdir");
 	}
 
+	/* configure syslog */
+	openlog(PROGNAME, LOG_CONS | LOG_PID | LOG_PERROR, LOG_USER);
+
+	/* writing to the FIFO of a client that is gone must not kill the daemon:
+	 * the write fails with EPIPE instead (see `sendToClient`) */
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+		pexit("signal");
+
+	if (useSocket) {
+		/* move to the background first, since every file is closed when doing so */
+		becomeDaemon();
+		if (listenSocket() == -1) {
+			syslog(LOG_ERR, "Could not listen on %s: %s", TALK_SOCKET_PATH, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		return;
+	}
+
 	fd = open(SERVER_QID_PATH, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IRGRP);
 	if (fd == -1) {
 		/* server queue ID file already exists - same situation as temporary directory
@@ -241,9 +348,6 @@ init() {
 	if (close(fd) == -1)
 		pexit("close");
 
-	/* configure syslog */
-	openlog(PROGNAME, LOG_CONS | LOG_PID | LOG_PERROR, LOG_USER);
-
 	/* move to the background */
 	becomeDaemon();
 }
@@ -260,13 +364,14 @@ removalFn(const char *fpath, __attribute__((unused)) const struct stat *sb, int
 
 static void
 cleanup() {
-	/* remove the temporary directory where connection files are kept */
+	/* remove the temporary directory where the server queue ID file (or the
+	 * socket) is kept */
 	ftw(TALK_CONN_DIR, removalFn, 2);
 	if (rmdir(TALK_CONN_DIR) == -1)
 		pexit("rmdir");
 
 	/* remove the message queue */
-	if (msgctl(serverId, IPC_RMID, NULL) == -1)
+	if (!useSocket && msgctl(serverId, IPC_RMID, NULL) == -1)
 		pexit("msgctl");
 
 	/* close syslog */
@@ -284,26 +389,74 @@ cleanupHandler(int sig) {
 	raise(sig);
 }
 
-static void
-childHandler(__attribute__((unused)) int sig) {
-	int savedErrno;
+/* sends a message to a client without blocking: a client that does not read its
+ * queue (or socket) only loses its own messages. Like for `msgsnd`, `len` does not
+ * include the message type, which sockets carry in the packet nonetheless */
+static int
+sendToClient(struct endpoint *ep, const void *msg, size_t len) {
+	if (ep->fd != -1) {
+		if (send(ep->fd, msg, TALK_PACKET_SIZE(len), MSG_DONTWAIT | MSG_NOSIGNAL) == -1) {
+			if (errno == EAGAIN)
+				syslog(LOG_WARNING, "Socket %d is full, dropping message", ep->fd);
+			return -1;
+		}
 
-	savedErrno = errno;
-	while (waitpid(-1, NULL, WNOHANG) > 0)
-		continue; /* wait for every terminated children */
+		return 0;
+	}
+
+	if (msgsnd(ep->queueId, msg, len, IPC_NOWAIT) == -1) {
+		if (errno == EAGAIN)
+			syslog(LOG_WARNING, "Queue %d is full, dropping message", ep->queueId);
+		return -1;
+	}
 
-	/* waipid() call above might have changed `errno` */
-	errno = savedErrno;
+	/* a full FIFO already has the client read its queue: nothing is lost. A FIFO
+	 * nobody reads belongs to a client that died without cleaning up; it is
+	 * closed, and its queue is left to be read by whoever finds it */
+	if (ep->notifyFd != -1 && write(ep->notifyFd, "", 1) == -1 && errno != EAGAIN) {
+		syslog(LOG_WARNING, "Could not notify queue %d: %s", ep->queueId, strerror(errno));
+		close(ep->notifyFd);
+		ep->notifyFd = -1;
+	}
+
+	return 0;
+}
+
+/* opens the FIFO the client with the given queue may have created to be notified
+ * of messages. Only a FIFO owned by the owner of the queue is used, so that no
+ * client makes the daemon write anywhere else. Returns -1 if there is none */
+static int
+openNotify(int queueId) {
+	struct msqid_ds ds;
+	struct stat st;
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, PATH_MAX, TALK_NOTIFY_PATH_FMT, queueId);
+
+	/* opening for writing does not block, nor succeed, unless the client has the
+	 * FIFO open for reading */
+	fd = open(path, O_WRONLY | O_NONBLOCK | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	if (fstat(fd, &st) == -1 || !S_ISFIFO(st.st_mode) ||
+			msgctl(queueId, IPC_STAT, &ds) == -1 || ds.msg_perm.uid != st.st_uid) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
 }
 
 static void
-connReply(int msgqid, struct responseMsg *res) {
-	/* msgsnd errors are not diagnosed since the error cannot be sent back to the client */
-	msgsnd(msgqid, res, strlen(res->data) + 1, 0);
+connReply(struct endpoint *ep, struct responseMsg *res) {
+	/* send errors are not diagnosed since the error cannot be sent back to the client */
+	sendToClient(ep, res, strlen(res->data) + 1);
 }
 
 static void
-connFailure(const struct requestMsg *req, const char *reason) {
+connFailure(struct endpoint *ep, const char *reason) {
 	struct responseMsg res;
 
 	res.mtype = TALK_MT_RES_CONNECT_FAILURE;
@@ -311,121 +464,236 @@ connFailure(const struct requestMsg *req, const char *reason) {
 
 	/* make sure the string is null terminated */
 	res.data[strlen(reason)] = '\0';
-	connReply(req->clientId, &res);
+	connReply(ep, &res);
+}
+
+/* usernames in requests are not necessarily terminated: they are compared and
+ * hashed up to LOGIN_NAME_MAX characters */
+#define FNV_BASIS (2166136261u)
+
+/* FNV-1a over at most `max` characters of `s`, continuing from `h` */
+static unsigned int
+fnv(unsigned int h, const char *s, size_t max) {
+	size_t i;
+
+	for (i = 0; i < max && s[i] != '\0'; i++)
+		h = (h ^ (unsigned char) s[i]) * 16777619u;
+
+	return h;
 }
 
+static unsigned int
+connHash(const char *from, const char *to) {
+	unsigned int h;
+
+	h = fnv(FNV_BASIS, from, LOGIN_NAME_MAX);
+	h = (h ^ ':') * 16777619u;
+	h = fnv(h, to, LOGIN_NAME_MAX);
+
+	return h % CONN_BUCKETS;
+}
+
+static struct conn **
+connFind(const char *from, const char *to) {
+	struct conn **c;
+
+	for (c = &conns[connHash(from, to)]; *c != NULL; c = &(*c)->next) {
+		if (!strncmp((*c)->from, from, LOGIN_NAME_MAX) && !strncmp((*c)->to, to, LOGIN_NAME_MAX))
+			break;
+	}
+
+	return c;
+}
+
+/* returns the `from -> to` connection, or NULL if there is none */
+static struct conn *
+connLookup(const char *from, const char *to) {
+	return *connFind(from, to);
+}
+
+static struct conn *
+sessionLookup(int sessionId) {
+	if (sessionId < 1 || sessionId > nsessions)
+		return NULL;
+
+	return sessions[sessionId - 1];
+}
+
+/* assigns a free session ID to the connection, growing the table if needed */
 static int
-connectionFile(const char *from, const char *to, char *buf, int len) {
-	int numWritten;
+sessionAdd(struct conn *c) {
+	struct conn **s;
+	int i, n;
 
-	numWritten = snprintf(buf, len, CONN_FILE_TEMPLATE, from, to);
+	for (i = 0; i < nsessions; i++) {
+		if (sessions[i] == NULL)
+			break;
+	}
 
-	/* error, or file name was truncated */
-	if (numWritten < 0 || numWritten == len)
-		return -1;
+	if (i == nsessions) {
+		n = (nsessions == 0) ? MIN_SESSIONS : nsessions * 2;
+		s = realloc(sessions, n * sizeof(struct conn *));
+		if (s == NULL)
+			return -1;
 
+		memset(s + nsessions, 0, (n - nsessions) * sizeof(struct conn *));
+		sessions = s;
+		nsessions = n;
+	}
+
+	sessions[i] = c;
+	c->sessionId = i + 1;
 	return 0;
 }
 
 static int
-writeConnFile(const char *from, const char *to, int queueId) {
-	char path[PATH_MAX];
-	char id[MAX_SV_QUEUE_ID_LEN];
-	int fd;
+connAdd(const char *from, const char *to, const struct endpoint *ep, bool framed) {
+	struct conn **slot, *c;
 
-	if (connectionFile(from, to, path, PATH_MAX) == -1)
+	slot = connFind(from, to);
+	if (*slot != NULL) {
+		errno = EEXIST;
 		return -1;
+	}
 
-	fd = open(path, O_CREAT | O_EXCL | O_WRONLY, S_IRUSR | S_IWUSR);
-	if (fd == -1)
+	c = malloc(sizeof(struct conn));
+	if (c == NULL)
 		return -1;
 
-	snprintf(id, MAX_SV_QUEUE_ID_LEN, "%d", queueId);
-	write(fd, id, strlen(id));
+	strncpy(c->from, from, LOGIN_NAME_MAX);
+	c->from[LOGIN_NAME_MAX] = '\0';
+	strncpy(c->to, to, LOGIN_NAME_MAX);
+	c->to[LOGIN_NAME_MAX] = '\0';
+	c->ep = *ep;
+	c->framed = framed;
+	c->next = NULL;
 
-	close(fd);
+	if (sessionAdd(c) == -1) {
+		free(c);
+		return -1;
+	}
 
+	*slot = c;
 	return 0;
 }
 
 static int
-removeConnFile(const char *from, const char *to) {
-	char path[PATH_MAX];
+connRemove(const char *from, const char *to) {
+	struct conn **slot, *c;
 
-	if (connectionFile(from, to, path, PATH_MAX) == -1)
+	slot = connFind(from, to);
+	if (*slot == NULL) {
+		errno = ENOENT;
 		return -1;
+	}
 
-	if (unlink(path) == -1)
-		return -1;
+	c = *slot;
+	*slot = c->next;
+	sessions[c->sessionId - 1] = NULL;
+
+	if (c->ep.notifyFd != -1)
+		close(c->ep.notifyFd);
+	free(c);
 
 	return 0;
 }
 
+static struct ttyEntry **
+ttyFind(const char *user) {
+	struct ttyEntry **t;
+
+	t = &ttys[fnv(FNV_BASIS, user, UT_NAMESIZE) % TTY_BUCKETS];
+	for (; *t != NULL; t = &(*t)->next) {
+		if (!strncmp((*t)->user, user, UT_NAMESIZE))
+			break;
+	}
+
+	return t;
+}
+
+/* rebuilds the index of logged in users if the utmp file changed since it was
+ * last built, which takes a single `stat(2)` call when it did not. The file is
+ * checked before it is read, so changes made while it is being read cause it to
+ * be read again next time */
 static int
-readConnFile(const char *from, const char *to, int *dst) {
-	int fd;
-	char path[PATH_MAX];
-	char buf[MAX_SV_QUEUE_ID_LEN];
+refreshTtyIndex() {
+	struct stat st;
+	struct utmpx *ut;
+	struct ttyEntry **slot, *t, *next;
+	int i;
 
-	if (connectionFile(from, to, path, PATH_MAX) == -1)
+	if (stat(TALK_PATH_UTMP, &st) == -1)
 		return -1;
 
-	fd = open(path, O_RDONLY);
-	if (fd == -1) {
-		if (errno == ENOENT) {
-			*dst = 0;
-			return 0;
-		}
+	if (ttysLoaded && st.st_ino == utmpStat.st_ino && st.st_size == utmpStat.st_size &&
+			st.st_mtim.tv_sec == utmpStat.st_mtim.tv_sec && st.st_mtim.tv_nsec == utmpStat.st_mtim.tv_nsec)
+		return 0;
 
-		return -1;
+	for (i = 0; i < TTY_BUCKETS; i++) {
+		for (t = ttys[i]; t != NULL; t = next) {
+			next = t->next;
+			free(t);
+		}
+		ttys[i] = NULL;
 	}
+	ttysLoaded = false;
 
-	if (read(fd, buf, MAX_SV_QUEUE_ID_LEN) == -1)
-		return -1;
+	utmpname(TALK_PATH_UTMP);
 
-	if (close(fd) == -1)
+	errno = 0;
+	setutxent();
+	if (errno != 0)
 		return -1;
 
-	close(fd);
+	while ((ut = getutxent()) != NULL) {
+		if (ut->ut_type != INIT_PROCESS && ut->ut_type != LOGIN_PROCESS && ut->ut_type != USER_PROCESS)
+			continue;
+
+		/* like a scan of the file would, keep the last entry of each user */
+		slot = ttyFind(ut->ut_user);
+		if (*slot == NULL) {
+			*slot = calloc(1, sizeof(struct ttyEntry));
+			if (*slot == NULL) {
+				endutxent();
+				return -1;
+			}
+
+			memcpy((*slot)->user, ut->ut_user, UT_NAMESIZE);
+		}
 
-	*dst = (int) strtol(buf, NULL, 10);
+		/* make sure the TTY name is properly terminated */
+		memcpy((*slot)->line, ut->ut_line, UT_LINESIZE);
+		(*slot)->line[UT_LINESIZE] = '\0';
+	}
+
+	endutxent();
+
+	utmpStat = st;
+	ttysLoaded = true;
 	return 0;
 }
 
 static int
 requestConnection(const char *from, const char *to) {
-	struct utmpx *ut;
-	char tty[UT_LINESIZE + 1],
-		 ttyPath[PATH_MAX],
+	struct ttyEntry *t;
+	char ttyPath[PATH_MAX],
 		 message[BUFSIZE];
-	bool loggedIn = false;
 	int fd;
 
 	/* 1. find TTY where user is logged in (if any) */
-	utmpname(TALK_PATH_UTMP);
-
-	errno = 0;
-	setutxent();
-	if (errno != 0) {
-		syslog(LOG_WARNING, "Could not open utpm file");
+	if (refreshTtyIndex() == -1) {
+		syslog(LOG_WARNING, "Could not read utmp file");
 		return 0;
 	}
 
-	while ((ut = getutxent()) != NULL) {
-		/* find a login entry for the recipient username */
-		if ((ut->ut_type == INIT_PROCESS || ut->ut_type == LOGIN_PROCESS || ut->ut_type == USER_PROCESS) && !strncmp(ut->ut_user, to, UT_NAMESIZE)) {
-			memcpy(tty, ut->ut_line, UT_LINESIZE);
-			tty[strlen(ut->ut_line) + 1] = '\0'; /* make sure the TTY name is properly terminated */
-			loggedIn = true;
-		}
-	}
-
-	if (!loggedIn)
+	t = *ttyFind(to);
+	if (t == NULL)
 		return -1;
 
-	snprintf(ttyPath, PATH_MAX, "/dev/%s", tty);
+	snprintf(ttyPath, PATH_MAX, "/dev/%s", t->line);
 
-	fd = open(ttyPath, O_WRONLY | S_IWUSR);
+	/* a terminal that is not being read must not block the daemon */
+	fd = open(ttyPath, O_WRONLY | O_NOCTTY | O_NONBLOCK);
 	if (fd == -1) {
 		syslog(LOG_WARNING, "Failed to open TTY device: %s", ttyPath);
 		return 0;
@@ -446,110 +714,291 @@ requestConnection(const char *from, const char *to) {
 	return 0;
 }
 
+/* the data of the response is the session ID of the connection, which clients
+ * that do not use framed messages ignore */
 static int
-connectionAccepted(int msgqid) {
-	struct requestMsg res;
+connectionAccepted(struct conn *c) {
+	struct responseMsg res;
 
 	res.mtype = TALK_MT_RES_CONNECT_ACCEPT;
-	return msgsnd(msgqid, &res, TALK_RES_MSG_SIZE, 0);
+	snprintf(res.data, DATA_SIZE, "%d", c->sessionId);
+	return sendToClient(&c->ep, &res, strlen(res.data) + 1);
+}
+
+/* whether the connection may be used by a request read from `fd`: on the socket
+ * transport, only the client that made a connection can talk or hang up on it */
+static bool
+ownedBy(const struct conn *c, int fd) {
+	return fd == -1 || c->ep.fd == fd;
 }
 
+/* requests read from a socket are answered on that socket; others carry the queue
+ * of the client */
 static void
-connect(const struct requestMsg *req) {
-	int fromQ, toQ;
+connectUsers(const struct requestMsg *req, int fd) {
+	struct conn *to, *from;
+	struct endpoint ep;
 
-	if (readConnFile(req->fromUsername, req->toUsername, &fromQ) == -1) {
-		/* error reading the file, request cannot be processed */
-		syslog(LOG_ERR, "Could not read connection file (%s -> %s)", req->fromUsername, req->toUsername);
-		connFailure(req, "Connection Failure");
-		return;
-	}
+	ep.fd = fd;
+	ep.queueId = (fd == -1) ? req->clientId : -1;
+	ep.notifyFd = -1;
 
-	if (fromQ != 0) {
+	if (connLookup(req->fromUsername, req->toUsername) != NULL) {
 		/* connection already in place between the two users: no need to reconnect */
-		connFailure(req, "Already connected");
+		connFailure(&ep, "Already connected");
 		return;
 	}
 
-	if (readConnFile(req->toUsername, req->fromUsername, &toQ) == -1) {
-		syslog(LOG_ERR, "Could not read connection file (%s -> %s)", req->toUsername, req->fromUsername);
-		connFailure(req, "Connection Failure");
+	/* opposite connection does not exist yet - send a request to the recipient's TTY */
+	to = connLookup(req->toUsername, req->fromUsername);
+	if (to == NULL && requestConnection(req->fromUsername, req->toUsername) == -1) {
+		connFailure(&ep, "User not logged in");
 		return;
 	}
 
-	if (toQ == 0) {
-		/* opposite connection does not exist yet - send a request to the recipient's TTY */
-		if (requestConnection(req->fromUsername, req->toUsername) == -1) {
-			connFailure(req, "User not logged in");
-			return;
-		}
-	} else {
-		/* opposite connection already exists - confirm connection on both ends */
-		if (connectionAccepted(toQ) == -1 || connectionAccepted(req->clientId) == -1) {
-			syslog(LOG_WARNING, "Could not send connection acceptance");
-			connFailure(req, "Connection Failure");
-			return;
-		}
+	/* the FIFO is kept along with the connection, and closed when it is removed */
+	if (fd == -1)
+		ep.notifyFd = openNotify(ep.queueId);
+
+	if (connAdd(req->fromUsername, req->toUsername, &ep, req->mtype == TALK_MT_REQ_CONNECT_FRAMED) == -1) {
+		syslog(LOG_ERR, "Could not register connection (%s -> %s)", req->fromUsername, req->toUsername);
+		connFailure(&ep, "Connection Failure");
+		if (ep.notifyFd != -1)
+			close(ep.notifyFd);
+		return;
 	}
 
-	if (writeConnFile(req->fromUsername, req->toUsername, req->clientId) == -1) {
-		syslog(LOG_ERR, "Could not write connection file (%s -> %s)", req->fromUsername, req->toUsername);
-		connFailure(req, "Connection Failure");
+	if (to == NULL)
 		return;
+
+	/* opposite connection already exists - confirm connection on both ends */
+	from = connLookup(req->fromUsername, req->toUsername);
+	if (connectionAccepted(to) == -1 || connectionAccepted(from) == -1) {
+		syslog(LOG_WARNING, "Could not send connection acceptance");
+		connRemove(req->fromUsername, req->toUsername);
+
+		ep.notifyFd = -1; /* closed along with the connection */
+		connFailure(&ep, "Connection Failure");
 	}
 }
 
+/* delivers `len` bytes of a chat line to the recipient connection, in the format
+ * its client expects. Only the bytes used are sent either way */
 static void
-sendMsg(const struct requestMsg *req) {
-	int toQ; /* queue ID of the recipient */
+deliver(struct conn *to, const char *data, size_t len) {
 	struct requestMsg fwdReq;
+	struct talkMsg fwdMsg;
 
-	/* client does not listen to errors from this message. If there is an error,
+	if (to->framed) {
+		fwdMsg.mtype = TALK_MT_REQ_TALK_FMSG;
+		fwdMsg.sessionId = to->sessionId;
+		memcpy(fwdMsg.data, data, len);
+
+		sendToClient(&to->ep, &fwdMsg, TALK_FMSG_SIZE(len));
+		return;
+	}
+
+	fwdReq.mtype = TALK_MT_REQ_TALK_MSG;
+	memcpy(fwdReq.data, data, len);
+
+	/* the data field comes last, so it can be cut short */
+	sendToClient(&to->ep, &fwdReq, TALK_REQ_MSG_SIZE - DATA_SIZE + len);
+}
+
+/* the length of a line in `data`, including its terminator, which is added if the
+ * client did not send it */
+static size_t
+lineLength(char *data, ssize_t len) {
+	if (len <= 0)
+		return 0;
+
+	data[len - 1] = '\0';
+	return strlen(data) + 1;
+}
+
+static void
+sendMsg(struct requestMsg *req, ssize_t msgLen, int fd) {
+	struct conn *from, *to; /* connections of the sender and of the recipient */
+
+	/* client does not listen to errors from this message. If there is no connection,
 	 * terminate the processing early */
-	if (readConnFile(req->toUsername, req->fromUsername, &toQ) == -1)
+	to = connLookup(req->toUsername, req->fromUsername);
+	if (to == NULL)
 		return;
 
-	/* forward the message back to the recipient's message queue */
-	fwdReq.mtype = req->mtype;
-	memcpy(fwdReq.data, req->data, DATA_SIZE);
+	if (fd != -1) {
+		from = connLookup(req->fromUsername, req->toUsername);
+		if (from == NULL || !ownedBy(from, fd))
+			return;
+	}
 
-	msgsnd(toQ, &fwdReq, TALK_REQ_MSG_SIZE, 0);
+	/* forward the message to the recipient's message queue */
+	deliver(to, req->data, lineLength(req->data, msgLen - (TALK_REQ_MSG_SIZE - DATA_SIZE)));
 }
 
 static void
-disconnect(const struct requestMsg *req) {
-	/* disconnection - remove both connection files (from->to and to->from) and
-	 * send a connection drop message to the recipient so that its client can
-	 * inform the target user accordingly */
-	int toQ;
-	struct requestMsg dropReq;
+sendFramedMsg(struct talkMsg *msg, ssize_t msgLen, int fd) {
+	struct conn *from, *to;
 
-	if (readConnFile(req->toUsername, req->fromUsername, &toQ) == -1)
+	from = sessionLookup(msg->sessionId);
+	if (from == NULL || !ownedBy(from, fd))
 		return;
 
-	/* since `fromUsername` is disconnecting, the from -> to connection must exist */
-	if (removeConnFile(req->fromUsername, req->toUsername) == -1)
+	to = connLookup(from->to, from->from);
+	if (to == NULL)
 		return;
 
+	deliver(to, msg->data, lineLength(msg->data, msgLen - TALK_FMSG_SIZE(0)));
+}
+
+/* disconnection - remove both connections (from->to and to->from) and send a
+ * connection drop message to the recipient so that its client can inform the
+ * target user accordingly */
+static void
+dropConn(struct conn *from) {
+	struct conn *to;
+	struct requestMsg dropReq;
+
+	to = connLookup(from->to, from->from);
+	connRemove(from->from, from->to);
+
 	/* the opposite connection, to -> from, might not exist (i.e., if the requester
 	 * timeout waiting for a reply from the recipient, for example) */
-	removeConnFile(req->toUsername, req->fromUsername);
+	if (to == NULL)
+		return;
 
+	/* clients only look at the type of this message. It is sent before the
+	 * connection is removed, which closes the FIFO of the client, if any */
 	dropReq.mtype = TALK_MT_REQ_TALK_CONN_DROP;
-	msgsnd(toQ, &dropReq, TALK_REQ_MSG_SIZE, 0);
+	sendToClient(&to->ep, &dropReq, 0);
+	connRemove(to->from, to->to);
+}
+
+static void
+disconnect(const struct requestMsg *req, int fd) {
+	struct conn *from;
+
+	/* since `fromUsername` is disconnecting, the from -> to connection must exist */
+	from = connLookup(req->fromUsername, req->toUsername);
+	if (from == NULL || !ownedBy(from, fd))
+		return;
+
+	dropConn(from);
+}
+
+/* a client closed its socket: drop every connection it made */
+static void
+dropClient(int fd) {
+	int i;
+
+	for (i = 0; i < nsessions; i++) {
+		if (sessions[i] != NULL && sessions[i]->ep.fd == fd)
+			dropConn(sessions[i]);
+	}
 }
 
+/* requests may be modified in place, to terminate the lines they carry. `fd` is
+ * the socket the request was read from, or -1 if it came from the message queue */
 static void
-serveRequest(const struct requestMsg *req) {
+serveRequest(union talkRequest *req, ssize_t msgLen, int fd) {
 	switch (req->mtype) {
 		case TALK_MT_REQ_CONNECT:
-			connect(req);
+		case TALK_MT_REQ_CONNECT_FRAMED:
+			connectUsers(&req->req, fd);
 			break;
 		case TALK_MT_REQ_TALK_MSG:
-			sendMsg(req);
+			sendMsg(&req->req, msgLen, fd);
+			break;
+		case TALK_MT_REQ_TALK_FMSG:
+			sendFramedMsg(&req->fmsg, msgLen, fd);
 			break;
 		case TALK_MT_REQ_TALK_CONN_DROP:
-			disconnect(req);
+			disconnect(&req->req, fd);
 			break;
 	}
 }
+
+/* accepts every pending client on the listening socket */
+static int
+acceptClients(int epfd) {
+	struct epoll_event ev;
+	int fd;
+
+	for (;;) {
+		fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return 0;
+
+			/* the client may have given up already, or no more files can be opened
+			 * for now: neither is a reason to stop serving everybody else */
+			syslog(LOG_WARNING, "Could not accept client: %s", strerror(errno));
+			return 0;
+		}
+
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			close(fd);
+			return -1;
+		}
+	}
+}
+
+/* reads a single request from a client, so that a busy client does not starve the
+ * others. A closed (or failed) socket drops the client's connections */
+static void
+serveClient(int fd) {
+	union talkRequest req;
+	ssize_t n;
+
+	n = recv(fd, &req, sizeof(union talkRequest), 0);
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+
+	if (n <= 0) {
+		dropClient(fd);
+		close(fd); /* also removes it from the epoll instance */
+		return;
+	}
+
+	/* a packet too short to hold a message type is ignored */
+	if (n >= (ssize_t) sizeof(long))
+		serveRequest(&req, n - sizeof(long), fd);
+}
+
+/* the loop of the socket transport: waits for requests on every client at once, and
+ * serves them one at a time. Returns only on failure */
+static int
+serveSockets() {
+	struct epoll_event ev, events[MAX_EVENTS];
+	int epfd, i, n;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1)
+		return -1;
+
+	ev.events = EPOLLIN;
+	ev.data.fd = listenFd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenFd, &ev) == -1)
+		return -1;
+
+	for (;;) {
+		n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.fd == listenFd) {
+				if (acceptClients(epfd) == -1)
+					return -1;
+			} else {
+				serveClient(events[i].data.fd);
+			}
+		}
+	}
+}
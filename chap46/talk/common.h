@@ -7,6 +7,8 @@
 #include <sys/stat.h>
 #include <sys/msg.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <stddef.h>
@@ -20,6 +22,12 @@
 
 #define TALK_CONN_DIR   "/tmp/.talkd"          /* manage connections under this path */
 #define SERVER_QID_PATH (TALK_CONN_DIR "/key") /* path to the file containing the server's queue identifier */
+#define TALK_SOCKET_PATH (TALK_CONN_DIR "/socket") /* the server's socket, when serving over sockets (`-u`) */
+
+/* FIFO a client waiting on its message queue without a listener process (`-s`) is
+ * told about new messages on: after sending a message to the queue with the ID in
+ * the name, the server writes a byte to it */
+#define TALK_NOTIFY_PATH_FMT (TALK_CONN_DIR "/%d.notify")
 
 #define DATA_SIZE (1024) /* use a static sized buffer when transmitting messages */
 #define MAX_SV_QUEUE_ID_LEN (32) /* System V message queue ID should not be longer than 32 characters */
@@ -43,11 +51,32 @@ struct responseMsg {    /* connection responses: from the server to clients */
 /* only the data field is included */
 #define TALK_RES_MSG_SIZE (DATA_SIZE)
 
+/* framed messages: once connected, clients that asked for framing (by connecting
+ * with TALK_MT_REQ_CONNECT_FRAMED) are given a session ID in the data field of the
+ * connection accept response, and exchange chat lines with this message instead.
+ * The session ID identifies both users, and only the part of the data field in use
+ * is sent, so a short line takes a few bytes of the queue instead of kilobytes */
+struct talkMsg {
+	long mtype;           /* TALK_MT_REQ_TALK_FMSG */
+	int sessionId;        /* session of the sender (or, when delivered, of the recipient) */
+	char data[DATA_SIZE]; /* null terminated message content - only `len` bytes are sent */
+};
+
+/* size of a framed message carrying `len` bytes of data */
+#define TALK_FMSG_SIZE(len) (offsetof(struct talkMsg, data) - offsetof(struct talkMsg, sessionId) + (len))
+
+/* over sockets, every message is sent as a single packet which, unlike on message
+ * queues, includes the message type. This is the size of the packet of a message
+ * whose size on a queue would be `len` */
+#define TALK_PACKET_SIZE(len) (sizeof(long) + (len))
+
 #define TALK_MT_REQ_CONNECT         (1)  /* client requests connection */
 #define TALK_MT_RES_CONNECT_ACCEPT  (2)  /* client accepts connection */
 #define TALK_MT_RES_CONNECT_FAILURE (3)  /* connection failed */
 #define TALK_MT_REQ_TALK_MSG        (4)  /* client sends a message to another client */
 #define TALK_MT_REQ_TALK_CONN_DROP  (6)  /* one client over a communication has disconnected */
+#define TALK_MT_REQ_CONNECT_FRAMED  (7)  /* client requests connection, using framed messages */
+#define TALK_MT_REQ_TALK_FMSG       (8)  /* framed message between clients (see struct talkMsg) */
 
 static void
 pexit(const char *fCall) {
@@ -14,6 +14,100 @@
  * calls in a row will succeed in this case. Therefore, users of this library must
  * ensure that semaphores are released correctly, only once after use. */
 
+/* the futex word lives in a shared mapping of a regular file, so processes that
+ * map the same file wait on the same futex. Process-private futex operations
+ * cannot be used. */
+static int
+futex(unsigned int *word, int op, unsigned int val, const struct timespec *timeout,
+		unsigned int val3) {
+	return syscall(SYS_futex, word, op, val, timeout, NULL, val3);
+}
+
+static unsigned int
+futexCas(unsigned int *word, unsigned int expected, unsigned int desired) {
+	__atomic_compare_exchange_n(word, &expected, desired, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+	return expected;
+}
+
+static struct bpsem_t *
+futexInit(char *path, struct bpsem_t *sem) {
+	void *word;
+	int fd;
+
+	fd = open(path, O_RDWR);
+	if (fd == -1) {
+		return NULL;
+	}
+
+	word = mmap(NULL, sizeof(unsigned int), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (word == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+
+	sem->path = path;
+	sem->backend = BP_BACKEND_FUTEX;
+	sem->readFd = fd;
+	sem->writeFd = -1;
+	sem->word = word;
+
+	return sem;
+}
+
+/* a reservation takes the word from released to reserved. If that fails, the
+ * process marks it as waited and sleeps until it changes; in that case, it is
+ * then reserved as waited, as other processes may still be sleeping on it. See
+ * "Futexes Are Tricky", by Ulrich Drepper.
+ *
+ * FUTEX_WAIT_BITSET is used rather than FUTEX_WAIT as it takes an absolute
+ * CLOCK_MONOTONIC timeout, so the deadline holds across spurious wakeups. A
+ * timed out process leaves the word as waited, which only costs the next
+ * release an unneeded wake up call. */
+static int
+futexReserve(struct bpsem_t *sem, const struct timespec *deadline) {
+	unsigned int c;
+
+	c = futexCas(sem->word, BP_FUTEX_RELEASED, BP_FUTEX_RESERVED);
+	while (c != BP_FUTEX_RELEASED) {
+		if (c == BP_FUTEX_WAITED ||
+				futexCas(sem->word, BP_FUTEX_RESERVED, BP_FUTEX_WAITED) != BP_FUTEX_RELEASED) {
+			/* EAGAIN: the word changed before the process could sleep */
+			if (futex(sem->word, FUTEX_WAIT_BITSET, BP_FUTEX_WAITED, deadline,
+						FUTEX_BITSET_MATCH_ANY) == -1 && errno != EAGAIN) {
+				if (errno != EINTR || !bpRetryOnEintr) {
+					return -1;
+				}
+			}
+		}
+
+		c = futexCas(sem->word, BP_FUTEX_RELEASED, BP_FUTEX_WAITED);
+	}
+
+	return 0;
+}
+
+/* only a semaphore that may have waiters needs a system call to be released */
+static int
+futexRelease(struct bpsem_t *sem) {
+	if (__atomic_exchange_n(sem->word, BP_FUTEX_RELEASED, __ATOMIC_RELEASE) == BP_FUTEX_WAITED) {
+		if (futex(sem->word, FUTEX_WAKE, 1, NULL, 0) == -1) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int
+futexCondReserve(struct bpsem_t *sem) {
+	if (futexCas(sem->word, BP_FUTEX_RELEASED, BP_FUTEX_RESERVED) != BP_FUTEX_RELEASED) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	return 0;
+}
+
 struct bpsem_t *
 bpInit(char *path) {
 	struct bpsem_t *sem = malloc(sizeof(struct bpsem_t));
@@ -21,7 +115,17 @@ bpInit(char *path) {
 		return NULL;
 	}
 
-	int rfd, wfd, flags;
+	int rfd, wfd;
+	struct stat st;
+
+	if (stat(path, &st) == -1) {
+		return NULL;
+	}
+
+	/* semaphores that are not FIFOs are backed by a futex */
+	if (S_ISREG(st.st_mode)) {
+		return futexInit(path, sem);
+	}
 
 	/* since there might be no other process with a write file descriptor
 	 * for this FIFO, the `open(2)` call needs to be made non-blocking, so that
@@ -36,16 +140,15 @@ bpInit(char *path) {
 		return NULL;
 	}
 
-	/* revert the read file descriptor back to being blocking, so that reserve
-	 * operations on the semaphore will properly wait */
-	flags = O_RDONLY;
-	if (fcntl(rfd, F_SETFL, flags) == -1) {
-		return NULL;
-	}
+	/* the read file descriptor is left non-blocking: reserve operations wait for
+	 * it to become readable with `poll(2)`, which allows them to time out, and
+	 * conditional reserves simply read from it */
 
 	sem->path = path;
+	sem->backend = BP_BACKEND_FIFO;
 	sem->readFd = rfd;
 	sem->writeFd = wfd;
+	sem->word = NULL;
 
 	return sem;
 }
@@ -80,37 +183,166 @@ bpCreate() {
 	return sem;
 }
 
-int
-bpReserve(struct bpsem_t *sem) {
-	char buf[1];
-	ssize_t numRead;
+struct bpsem_t *
+bpCreateFutex() {
+	unsigned int word = BP_FUTEX_RELEASED;
+	char *fname;
+	int fd;
 
-	/* if the pipe is empty, `read(2)` will block until another process releases
-	 * this semaphore (i.e., something is written to the pipe.) */
-	while (true) {
-		numRead = read(sem->readFd, buf, 1);
+	fname = malloc(PATH_MAX);
+	if (fname == NULL) {
+		return NULL;
+	}
 
-		/* if interrupted by a signal, behaviour depends on the definition of the
-		 * `bpRetryOnEintr` variable, defined by the program using this library */
-		if (numRead == -1 && errno == EINTR && bpRetryOnEintr) {
-			continue;
+	strcpy(fname, BP_FUTEX_TEMPLATE);
+	fd = mkstemp(fname);
+	if (fd == -1) {
+		return NULL;
+	}
+
+	/* the file holds nothing but the word, which starts released */
+	if (write(fd, &word, sizeof(word)) != sizeof(word)) {
+		close(fd);
+		unlink(fname);
+		return NULL;
+	}
+
+	close(fd);
+	return bpInit(fname);
+}
+
+struct bpsem_t *
+bpCreateEventfd() {
+	struct bpsem_t *sem;
+	int fd;
+
+	sem = malloc(sizeof(struct bpsem_t));
+	if (sem == NULL) {
+		return NULL;
+	}
+
+	/* in semaphore mode, each read decrements the counter by one, and fails with
+	 * EAGAIN while it is zero; the counter starting at one means released */
+	fd = eventfd(1, EFD_SEMAPHORE | EFD_NONBLOCK);
+	if (fd == -1) {
+		free(sem);
+		return NULL;
+	}
+
+	sem->path = NULL;
+	sem->backend = BP_BACKEND_EVENTFD;
+	sem->readFd = fd;
+	sem->writeFd = -1;
+	sem->word = NULL;
+
+	return sem;
+}
+
+/* takes the token of a FIFO or eventfd semaphore: a byte from the pipe, or one
+ * from the eventfd counter. Fails with EAGAIN if the semaphore is reserved. */
+static int
+fdTake(struct bpsem_t *sem) {
+	char buf[sizeof(uint64_t)];
+	size_t len;
+
+	len = (sem->backend == BP_BACKEND_EVENTFD) ? sizeof(uint64_t) : 1;
+	if (read(sem->readFd, buf, len) != (ssize_t) len) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* milliseconds left until `deadline`, rounded up so that a process never wakes
+ * up just before it, or -1 (no timeout) for a NULL deadline */
+static int
+pollTimeout(const struct timespec *deadline) {
+	struct timespec now;
+	long long ms;
+
+	if (deadline == NULL) {
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (deadline->tv_sec - now.tv_sec) * 1000LL +
+		(deadline->tv_nsec - now.tv_nsec + 999999) / 1000000;
+
+	if (ms < 0) {
+		return 0;
+	}
+
+	return (ms > INT_MAX) ? INT_MAX : (int) ms;
+}
+
+/* the descriptor becoming readable only means the semaphore was released; other
+ * processes may race for the token, so losing the `read(2)` sends the process
+ * back to waiting */
+static int
+fdReserve(struct bpsem_t *sem, const struct timespec *deadline) {
+	struct pollfd pfd;
+	int timeout, ready;
+
+	pfd.fd = sem->readFd;
+	pfd.events = POLLIN;
+
+	while (fdTake(sem) == -1) {
+		if (errno != EAGAIN) {
+			return -1;
 		}
 
-		if (numRead < 1) {
+		timeout = pollTimeout(deadline);
+		if (timeout == 0) {
+			errno = ETIMEDOUT;
 			return -1;
 		}
 
-		/* successfully read from the pipe */
-		break;
+		ready = poll(&pfd, 1, timeout);
+
+		/* if interrupted by a signal, behaviour depends on the definition of the
+		 * `bpRetryOnEintr` variable, defined by the program using this library */
+		if (ready == -1 && (errno != EINTR || !bpRetryOnEintr)) {
+			return -1;
+		}
 	}
 
 	return 0;
 }
 
+int
+bpReserve(struct bpsem_t *sem) {
+	return bpTimedReserve(sem, NULL);
+}
+
+int
+bpTimedReserve(struct bpsem_t *sem, const struct timespec *deadline) {
+	if (sem->backend == BP_BACKEND_FUTEX) {
+		return futexReserve(sem, deadline);
+	}
+
+	/* if the pipe is empty (or the eventfd counter zero), wait until another
+	 * process releases this semaphore or the deadline passes */
+	return fdReserve(sem, deadline);
+}
+
 int
 bpRelease(struct bpsem_t *sem) {
 	char buf[1];
 
+	uint64_t one = 1;
+
+	if (sem->backend == BP_BACKEND_FUTEX) {
+		return futexRelease(sem);
+	}
+
+	if (sem->backend == BP_BACKEND_EVENTFD) {
+		if (write(sem->readFd, &one, sizeof(one)) != sizeof(one)) {
+			return -1;
+		}
+
+		return 0;
+	}
+
 	buf[0] = BP_RELEASED_BYTE;
 
 	if (write(sem->writeFd, buf, 1) < 1) {
@@ -122,32 +354,41 @@ bpRelease(struct bpsem_t *sem) {
 
 int
 bpCondReserve(struct bpsem_t *sem) {
+	if (sem->backend == BP_BACKEND_FUTEX) {
+		return futexCondReserve(sem);
+	}
+
 	/* non-blocking read on the read end of the pipe - a successful read means
 	 * the semaphore was successfully reserved; an error means the call would block,
-	 * meaning the semaphore is already reserved by another process */
-	int nbfd;
-	char buf[1];
-
-	nbfd = open(sem->path, O_RDONLY | O_NONBLOCK);
-	if (nbfd == -1) {
-		return -1;
-	}
+	 * meaning the semaphore is already reserved by another process. If errno is
+	 * EAGAIN, that will be propagated to the caller, which must interpret that to
+	 * mean that the conditional reserve failed. */
+	return fdTake(sem);
+}
 
-	if (read(nbfd, buf, 1) == -1) {
-		/* if errno is EAGAIN, that will be propagated to the caller, which must
-		 * interpret that to mean that the conditional reserve failed. If the errno
-		 * is anything else, than it must also be handled by the caller. */
+int
+bpFd(struct bpsem_t *sem) {
+	if (sem->backend == BP_BACKEND_FUTEX) {
+		errno = EINVAL;
 		return -1;
 	}
 
-	close(nbfd);
-	return 0;
+	return sem->readFd;
 }
 
 void
 bpDestroy(struct bpsem_t *sem) {
-	unlink(sem->path);
+	if (sem->path != NULL) {
+		unlink(sem->path);
+	}
+
 	close(sem->readFd);
-	close(sem->writeFd);
+
+	if (sem->backend == BP_BACKEND_FUTEX) {
+		munmap(sem->word, sizeof(unsigned int));
+	} else if (sem->backend == BP_BACKEND_FIFO) {
+		close(sem->writeFd);
+	}
+
 	free(sem);
 }
@@ -10,6 +10,19 @@
  * or, alternatively `reserved` or `released`.) using named pipes (FIFOs) as the
  * underlying synchronization mechanism.
  *
+ * Semaphores may also be backed by a futex word kept in a small shared file
+ * instead (see `bpCreateFutex`.) Reserving and releasing such a semaphore is done
+ * with atomic operations in user space, and only enters the kernel when a process
+ * has to wait for it, or when a waiting process has to be woken up. Both kinds of
+ * semaphores are identified by a path, and used through the same functions.
+ *
+ * Finally, semaphores may be backed by an eventfd (see `bpCreateEventfd`.) These
+ * have no path: they are shared with child processes across `fork(2)`, or passed
+ * to other processes over UNIX domain sockets. Their file descriptor, like that of
+ * FIFO semaphores, is readable whenever the semaphore is released, and can be
+ * registered with `poll(2)` or `epoll(7)` along with other file descriptors (see
+ * `bpFd`.)
+ *
  * See implementation file binpipe.c for implementation details.
  *
  * Author: Renato Mascarenhas Costa
@@ -20,7 +33,13 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/futex.h>
 #include <unistd.h>
+#include <poll.h>
+#include <time.h>
 
 #include <errno.h>
 #include <fcntl.h>
@@ -29,6 +48,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 /* when the semaphore is reserved, an attempt to write a byte to the pipe is made -
  * the byte defined on BP_RELEASED_BYTE. Therefore, when a process wishes to
@@ -40,17 +60,38 @@
  * for use as named pipes */
 #define BP_FIFO_TEMPLATE ("/tmp/bpf.XXXXXX")
 
+/* template used in calls to `mkstemp(3)` to create the files holding the futex
+ * words of futex backed semaphores. A memory backed file system avoids any disk
+ * I/O for them */
+#define BP_FUTEX_TEMPLATE ("/dev/shm/bpx.XXXXXX")
+
+/* underlying synchronization mechanism of a semaphore */
+#define BP_BACKEND_FIFO  (0)
+#define BP_BACKEND_FUTEX (1)
+#define BP_BACKEND_EVENTFD (2)
+
+/* values of the futex word: released, reserved, or reserved while some process
+ * may be waiting for it to be released */
+#define BP_FUTEX_RELEASED (0)
+#define BP_FUTEX_RESERVED (1)
+#define BP_FUTEX_WAITED   (2)
+
 extern bool bpRetryOnEintr; /* retry if a blocked system call is interrupted by a signal */
 
 struct bpsem_t {
-	char *path;  /* path to the named FIFO */
-	int readFd;  /* read end of the pipe */
-	int writeFd; /* write end of the pipe */
+	char *path;  /* path to the named FIFO, or to the file holding the futex word.
+	                NULL for eventfd semaphores */
+	int backend; /* BP_BACKEND_FIFO, BP_BACKEND_FUTEX or BP_BACKEND_EVENTFD */
+	int readFd;  /* read end of the pipe (non-blocking.) For futexes, the file
+	                holding the word; for eventfds, the eventfd itself */
+	int writeFd; /* write end of the pipe. Not used for futexes nor eventfds */
+	unsigned int *word; /* the futex word, mapped from the file */
 };
 
 /* builds a `bpsem_t` data structure for a binary semaphore on top of a FIFO
  * on the `path` given. The file on that path must exist and be a valid, previously
- * created FIFO.
+ * created FIFO, or a file created by `bpCreateFutex` - the backend used is chosen
+ * by the file's type.
  *
  * Returns a pointer to a `bpsem_t` struct on success, or NULL on error.
  */
@@ -64,6 +105,22 @@ struct bpsem_t *bpInit(char *path);
  */
 struct bpsem_t *bpCreate();
 
+/* creates a new binary semaphore backed by a futex word. Like those created by
+ * `bpCreate`, it is released; unlike them, it does not need any process to keep
+ * it open in order to retain its state.
+ *
+ * Returns a semaphore, or NULL on failure.
+ */
+struct bpsem_t *bpCreateFutex();
+
+/* creates a new binary semaphore backed by an eventfd, released. The eventfd is
+ * inherited by child processes created afterwards, which may use the same
+ * semaphore; it cannot be opened through a path.
+ *
+ * Returns a semaphore, or NULL on failure.
+ */
+struct bpsem_t *bpCreateEventfd();
+
 /* reserves a semaphore. If it is already reserved, this call will block. Whether
  * the operation will retry if the process receives a signal is controlled by
  * the bpRetryOnEintr variable.
@@ -72,7 +129,18 @@ struct bpsem_t *bpCreate();
  */
 int bpReserve(struct bpsem_t *sem);
 
-/* releases a semaphore on the `path` given
+/* reserves a semaphore, blocking at most until `deadline`, an absolute time
+ * measured against CLOCK_MONOTONIC. A NULL deadline blocks forever, just like
+ * `bpReserve`. Signals are handled as in `bpReserve`.
+ *
+ * Returns 0 on success, or -1 on error (with `errno` properly set.) When the
+ * deadline passes before the semaphore could be reserved, `errno` is set to
+ * `ETIMEDOUT`.
+ */
+int bpTimedReserve(struct bpsem_t *sem, const struct timespec *deadline);
+
+/* releases a semaphore on the `path` given. Releasing a futex backed semaphore
+ * that is not reserved has no effect.
  *
  * Returns 0 on success, or -1 on error (with `errno` properly set.)
  */
@@ -86,6 +154,17 @@ int bpRelease(struct bpsem_t *sem);
  */
 int bpCondReserve(struct bpsem_t *sem);
 
+/* returns a file descriptor that becomes readable (POLLIN/EPOLLIN) whenever the
+ * semaphore is released, for use with `poll(2)`, `select(2)` or `epoll(7)`.
+ * A readable descriptor does not reserve the semaphore - other processes may be
+ * waiting for it as well - so once it becomes readable, `bpCondReserve` must be
+ * used, and the wait resumed if that fails with `EAGAIN`.
+ *
+ * Returns the file descriptor, or -1 with `errno` set to `EINVAL` for futex
+ * backed semaphores, which cannot be polled.
+ */
+int bpFd(struct bpsem_t *sem);
+
 /* destroys a previously created semaphore.
  *
  * Returns 0 on success, or -1 on error (with `errno` properly set.)
@@ -19,6 +19,8 @@
  */
 
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <time.h>
 
@@ -28,18 +30,25 @@
 #include "binpipe.h"
 
 #define BUF_SIZE (1024)
+#define MAX_EVENT_SEMS (64)
 
 static void helpAndExit(const char *progname, int status);
 
 static void createSemaphore(void);
+static void createFutexSemaphore(void);
 static void reserveSemaphore(char *path);
 static void releaseSemaphore(char *path);
 static void condReserveSemaphore(char *path);
 static void destroySemaphore(char *path);
+static void setTimeout(char *seconds);
+static void epollSemaphores(char *count);
 
 /* defaults for the binary semaphore library */
 bool bpRetryOnEintr = true;
 
+/* how long `-r` waits for a semaphore, in milliseconds; -1 waits forever */
+static long reserveTimeout = -1;
+
 int
 main(int argc, char *argv[]) {
 	char opt;
@@ -48,11 +57,14 @@ main(int argc, char *argv[]) {
 		helpAndExit(argv[0], EXIT_SUCCESS);
 	}
 
-	while ((opt = getopt(argc, argv, "+cr:x:q:d:h")) != -1) {
+	while ((opt = getopt(argc, argv, "+cfr:x:q:d:t:e:h")) != -1) {
 		switch (opt) {
 			case 'c':
 				createSemaphore();
 				break;
+			case 'f':
+				createFutexSemaphore();
+				break;
 			case 'r':
 				reserveSemaphore(optarg);
 				break;
@@ -65,6 +77,12 @@ main(int argc, char *argv[]) {
 			case 'd':
 				destroySemaphore(optarg);
 				break;
+			case 't':
+				setTimeout(optarg);
+				break;
+			case 'e':
+				epollSemaphores(optarg);
+				break;
 			case 'h':
 				helpAndExit(argv[0], EXIT_SUCCESS);
 				break;
@@ -130,13 +148,59 @@ createSemaphore() {
 	pause();
 }
 
+static void
+createFutexSemaphore() {
+	struct bpsem_t *sem;
+	sem = bpCreateFutex();
+
+	if (sem == NULL) {
+		perror("bpCreateFutex");
+		fatal("Error creating semaphore");
+	}
+
+	/* the futex word is kept in a file, so there is no need to keep the process
+	 * alive: the semaphore lasts until it is deleted with `-d` */
+	printf("[%ld][%s] %s\n", (long) getpid(), currTime(), sem->path);
+}
+
+static void
+setTimeout(char *seconds) {
+	char *end;
+	double s;
+
+	s = strtod(seconds, &end);
+	if (*end != '\0' || s < 0) {
+		fatal("Invalid timeout");
+	}
+
+	reserveTimeout = (long) (s * 1000);
+}
+
 static void
 reserveSemaphore(char *path) {
 	struct bpsem_t *sem;
+	struct timespec deadline, *dp = NULL;
 	sem = semBuild(path);
 	int read;
 
-	if ((read = bpReserve(sem)) == -1) {
+	if (reserveTimeout != -1) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += reserveTimeout / 1000;
+		deadline.tv_nsec += (reserveTimeout % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		dp = &deadline;
+	}
+
+	if ((read = bpTimedReserve(sem, dp)) == -1) {
+		if (errno == ETIMEDOUT) {
+			printf("[%ld][%s] %s: timed out\n", (long) getpid(), currTime(), sem->path);
+			exit(EXIT_FAILURE);
+		}
+
 		perror("bpReserve");
 		fatal("Error reserving semaphore");
 	}
@@ -184,6 +248,113 @@ destroySemaphore(char *path) {
 	printf("[%ld][%s] %s: destroyed\n", (long) getpid(), currTime(), path);
 }
 
+/* creates `count` eventfd semaphores, all reserved, and forks a child that
+ * releases them one at a time in random order. The parent waits for all of them
+ * with a single epoll instance, reserving each one as it is released. */
+static void
+epollSemaphores(char *count) {
+	struct bpsem_t *sems[MAX_EVENT_SEMS];
+	struct epoll_event ev, events[MAX_EVENT_SEMS];
+	int order[MAX_EVENT_SEMS];
+	int n, i, j, epfd, ready, pending;
+	pid_t pid;
+
+	n = atoi(count);
+	if (n < 1 || n > MAX_EVENT_SEMS) {
+		fatal("Invalid number of semaphores");
+	}
+
+	epfd = epoll_create1(0);
+	if (epfd == -1) {
+		perror("epoll_create1");
+		fatal("Error creating epoll instance");
+	}
+
+	for (i = 0; i < n; i++) {
+		sems[i] = bpCreateEventfd();
+		if (sems[i] == NULL) {
+			perror("bpCreateEventfd");
+			fatal("Error creating semaphore");
+		}
+
+		if (bpReserve(sems[i]) == -1) {
+			perror("bpReserve");
+			fatal("Error reserving semaphore");
+		}
+
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, bpFd(sems[i]), &ev) == -1) {
+			perror("epoll_ctl");
+			fatal("Error registering semaphore");
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		order[i] = i;
+	}
+
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		fatal("Error creating child process");
+	}
+
+	if (pid == 0) {
+		srand(getpid());
+		for (i = n - 1; i >= 0; i--) {
+			j = rand() % (i + 1);
+			usleep(100000);
+
+			if (bpRelease(sems[order[j]]) == -1) {
+				perror("bpRelease");
+				_exit(EXIT_FAILURE);
+			}
+
+			printf("[%ld][%s] semaphore %d: released\n", (long) getpid(), currTime(), order[j]);
+			fflush(stdout);
+			order[j] = order[i];
+		}
+
+		_exit(EXIT_SUCCESS);
+	}
+
+	for (pending = n; pending > 0; ) {
+		ready = epoll_wait(epfd, events, MAX_EVENT_SEMS, -1);
+		if (ready == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			perror("epoll_wait");
+			fatal("Error waiting for semaphores");
+		}
+
+		for (i = 0; i < ready; i++) {
+			j = events[i].data.u32;
+			if (bpCondReserve(sems[j]) == -1) {
+				if (errno == EAGAIN) {
+					continue;
+				}
+
+				perror("bpCondReserve");
+				fatal("Error reserving semaphore");
+			}
+
+			printf("[%ld][%s] semaphore %d: reserved\n", (long) getpid(), currTime(), j);
+			epoll_ctl(epfd, EPOLL_CTL_DEL, bpFd(sems[j]), NULL);
+			pending--;
+		}
+	}
+
+	wait(NULL);
+	for (i = 0; i < n; i++) {
+		bpDestroy(sems[i]);
+	}
+
+	close(epfd);
+}
+
 static void
 helpAndExit(const char *progname, int status) {
 	FILE *stream = stderr;
@@ -191,12 +362,15 @@ helpAndExit(const char *progname, int status) {
 	if (status == EXIT_SUCCESS)
 		stream = stdout;
 
-	fprintf(stream, "Usage: %s [-c] [-r [path]] [-x [path]] [-q [path]] [-d [path]]\n", progname);
+	fprintf(stream, "Usage: %s [-c] [-f] [-r [path]] [-x [path]] [-q [path]] [-d [path]] [-t secs] [-e n]\n", progname);
 	fprintf(stream, "\t%-10s%-50s\n", "-c", "Creates a new semaphore");
+	fprintf(stream, "\t%-10s%-50s\n", "-f", "Creates a new semaphore backed by a futex");
 	fprintf(stream, "\t%-10s%-50s\n", "-r", "Reserves an existing semaphore");
 	fprintf(stream, "\t%-10s%-50s\n", "-x", "Releases a semaphore");
 	fprintf(stream, "\t%-10s%-50s\n", "-q", "Conditionally reserves a semaphore");
 	fprintf(stream, "\t%-10s%-50s\n", "-d", "Deletes a semaphore");
+	fprintf(stream, "\t%-10s%-50s\n", "-t", "Gives up reserving with -r after the given seconds");
+	fprintf(stream, "\t%-10s%-50s\n", "-e", "Waits for n eventfd semaphores with epoll");
 
 	exit(status);
 }
@@ -87,3 +87,259 @@ efDestroy(int id) {
 	union semun dummy;
 	return semctl(id, 0, IPC_RMID, dummy);
 }
+
+/* besides its flags, a group holds two semaphores used by `efWaitAny`: the number of
+ * processes waiting for any of its flags to be set, and the number of wakeups handed
+ * out to them by processes setting flags */
+#define EF_WAITERS(nflags) (nflags)
+#define EF_WAKEUPS(nflags) ((nflags) + 1)
+
+/* number of flags in the group: the size of the set, minus the two semaphores above */
+static int
+groupSize(int id) {
+	struct semid_ds ds;
+	union semun arg;
+
+	arg.buf = &ds;
+	if (semctl(id, 0, IPC_STAT, arg) == -1) {
+		return -1;
+	}
+
+	return ds.sem_nsems - 2;
+}
+
+static int
+validFlags(int nflags, const int *flags, int n) {
+	int i;
+
+	if (nflags == -1) {
+		return 0;
+	}
+
+	if (n < 1 || n > EF_GROUP_MAX) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (flags[i] < 0 || flags[i] >= nflags) {
+			errno = EINVAL;
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+int
+efGroupCreate(int nflags, int state) {
+	unsigned short values[EF_GROUP_MAX + 2];
+	union semun arg;
+	int i, semId;
+
+	if ((state != EF_SET && state != EF_CLEAR) || nflags < 1 || nflags > EF_GROUP_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	semId = semget(IPC_PRIVATE, nflags + 2, IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
+	if (semId == -1) {
+		return -1;
+	}
+
+	for (i = 0; i < nflags; i++) {
+		values[i] = state;
+	}
+
+	values[EF_WAITERS(nflags)] = 0;
+	values[EF_WAKEUPS(nflags)] = 0;
+
+	arg.array = values;
+	if (semctl(semId, 0, SETALL, arg) == -1) {
+		return -1;
+	}
+
+	return semId;
+}
+
+/* hands out a wakeup to every process registered as waiting for any flag. The
+ * number of waiters may change between reading it and handing the wakeups out, in
+ * which case it is read again */
+static int
+wakeAnyWaiters(int id, int nflags) {
+	struct sembuf sops[2];
+	union semun dummy;
+	int waiters;
+
+	for (;;) {
+		waiters = semctl(id, EF_WAITERS(nflags), GETVAL, dummy);
+		if (waiters <= 0) {
+			return waiters;
+		}
+
+		sops[0].sem_num = EF_WAITERS(nflags);
+		sops[0].sem_op = -waiters;
+		sops[0].sem_flg = IPC_NOWAIT;
+		sops[1].sem_num = EF_WAKEUPS(nflags);
+		sops[1].sem_op = waiters;
+		sops[1].sem_flg = 0;
+
+		if (semop(id, sops, 2) == 0) {
+			return 0;
+		}
+
+		if (errno != EAGAIN) {
+			return -1;
+		}
+	}
+}
+
+int
+efGroupSet(int id, const int *flags, int n) {
+	struct sembuf sops[EF_GROUP_MAX + 1];
+	int i, nflags;
+
+	nflags = groupSize(id);
+	if (!validFlags(nflags, flags, n)) {
+		return -1;
+	}
+
+	/* the first operation fails right away if some process waits for any flag to be
+	 * set, and has to be woken up. Otherwise, the flags are set with no further calls */
+	sops[0].sem_num = EF_WAITERS(nflags);
+	sops[0].sem_op = 0;
+	sops[0].sem_flg = IPC_NOWAIT;
+
+	for (i = 0; i < n; i++) {
+		sops[i + 1].sem_num = flags[i];
+		sops[i + 1].sem_op = -1;
+		sops[i + 1].sem_flg = efUseSemUndo ? SEM_UNDO : 0;
+	}
+
+	while (semop(id, sops, n + 1) == -1) {
+		if (errno == EAGAIN) {
+			/* set the flags regardless, then wake up those waiting */
+			while (semop(id, sops + 1, n) == -1)
+				if (errno != EINTR || !efRetryOnEintr)
+					return -1;
+
+			return wakeAnyWaiters(id, nflags);
+		}
+
+		if (errno != EINTR || !efRetryOnEintr)
+			return -1;
+	}
+
+	return 0;
+}
+
+int
+efGroupClear(int id, const int *flags, int n) {
+	struct sembuf sops[EF_GROUP_MAX];
+	int i;
+
+	if (!validFlags(groupSize(id), flags, n)) {
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		sops[i].sem_num = flags[i];
+		sops[i].sem_op = 1;
+		sops[i].sem_flg = efUseSemUndo ? SEM_UNDO : 0;
+	}
+
+	return semop(id, sops, n); /* does not block - incrementing the semaphores' values */
+}
+
+int
+efGroupGet(int id, int flag) {
+	union semun dummy;
+
+	if (!validFlags(groupSize(id), &flag, 1)) {
+		return -1;
+	}
+
+	return semctl(id, flag, GETVAL, dummy);
+}
+
+int
+efWaitAll(int id, const int *flags, int n) {
+	struct sembuf sops[EF_GROUP_MAX];
+	int i;
+
+	if (!validFlags(groupSize(id), flags, n)) {
+		return -1;
+	}
+
+	/* wait for every semaphore's value to become 0 (set) at once */
+	for (i = 0; i < n; i++) {
+		sops[i].sem_num = flags[i];
+		sops[i].sem_op = 0;
+		sops[i].sem_flg = 0;
+	}
+
+	while (semop(id, sops, n) == -1)
+		if (errno != EINTR || !efRetryOnEintr)
+			return -1;
+
+	return 0;
+}
+
+int
+efWaitAny(int id, const int *flags, int n) {
+	struct sembuf sops[2 * EF_GROUP_MAX + 1], wakeup;
+	union semun dummy;
+	int i, nflags, state;
+
+	nflags = groupSize(id);
+	if (!validFlags(nflags, flags, n)) {
+		return -1;
+	}
+
+	/* registering as a waiter only succeeds if every flag is clear at that moment:
+	 * each one is decremented without waiting and incremented back right away. Any
+	 * flag set afterwards is followed by a wakeup for this process (see `efGroupSet`) */
+	for (i = 0; i < n; i++) {
+		sops[2 * i].sem_num = flags[i];
+		sops[2 * i].sem_op = -1;
+		sops[2 * i].sem_flg = IPC_NOWAIT;
+		sops[2 * i + 1].sem_num = flags[i];
+		sops[2 * i + 1].sem_op = 1;
+		sops[2 * i + 1].sem_flg = 0;
+	}
+
+	sops[2 * n].sem_num = EF_WAITERS(nflags);
+	sops[2 * n].sem_op = 1;
+	sops[2 * n].sem_flg = 0;
+
+	wakeup.sem_num = EF_WAKEUPS(nflags);
+	wakeup.sem_op = -1;
+	wakeup.sem_flg = 0;
+
+	for (;;) {
+		if (semop(id, sops, 2 * n + 1) == 0) {
+			while (semop(id, &wakeup, 1) == -1)
+				if (errno != EINTR || !efRetryOnEintr)
+					return -1;
+
+			/* a flag was set - though maybe not one of these, or cleared since */
+			continue;
+		}
+
+		if (errno != EAGAIN) {
+			return -1;
+		}
+
+		/* some flag is set: find out which */
+		for (i = 0; i < n; i++) {
+			state = semctl(id, flags[i], GETVAL, dummy);
+			if (state == -1) {
+				return -1;
+			}
+
+			if (state == EF_SET) {
+				return flags[i];
+			}
+		}
+	}
+}
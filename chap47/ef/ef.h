@@ -10,6 +10,11 @@
  * semaphores. Event flags binary semaphores and are either *clear* or *set*. Process can set
  * event flags; clear event flags; and conditionally set event flags.
  *
+ * Event flags can also be created in groups, all kept in a single semaphore set. Any
+ * number of flags in a group can then be set, cleared or waited for at once, with a
+ * single `semop(2)` call that is atomic with respect to every flag involved, and a
+ * process can wait for any flag out of many to be set (see `efWaitAny`.)
+ *
  * Author: Renato Mascarenhas Costa
  */
 
@@ -33,6 +38,10 @@
 extern bool efUseSemUndo;   /* use SEM_UNDO when creating the underlying SV semaphore    */
 extern bool efRetryOnEintr; /* retry if a blocked system call is interrupted by a signal */
 
+/* maximum number of flags in a group. Operations on a group take at most two
+ * semaphore operations per flag, which must stay within SEMOPM */
+#define EF_GROUP_MAX (128)
+
 /* define mandatory union as defined by SUSv3 */
 union semun {
 	int val;
@@ -66,7 +75,32 @@ int efGet(int id);
  * block until it is */
 int efWait(int id);
 
-/* removes an event flag, destroying the underlying System V semaphore associated with it */
+/* removes an event flag, destroying the underlying System V semaphore associated with it.
+ * Groups of flags are removed the same way */
 int efDestroy(int id);
 
+/* creates a group of `nflags` event flags, numbered from 0, all in the given `state`.
+ * Returns an identifier for the group, to be passed to the functions below along with
+ * the numbers of the flags to operate on. */
+int efGroupCreate(int nflags, int state);
+
+/* sets the `n` flags of the group listed in `flags` as a single atomic operation. If
+ * any of them is already set, this call blocks until all of them can be set. */
+int efGroupSet(int id, const int *flags, int n);
+
+/* clears the `n` flags of the group listed in `flags` as a single atomic operation */
+int efGroupClear(int id, const int *flags, int n);
+
+/* returns the state of a flag in a group: either EF_SET or EF_CLEAR */
+int efGroupGet(int id, int flag);
+
+/* waits for all of the `n` flags of the group listed in `flags` to be set at the same
+ * time. Behaviour when interrupted by a signal is controlled by `efRetryOnEintr` */
+int efWaitAll(int id, const int *flags, int n);
+
+/* waits for any of the `n` flags of the group listed in `flags` to be set, and returns
+ * the number of one that is. Returns -1 on error. Behaviour when interrupted by a
+ * signal is controlled by `efRetryOnEintr` */
+int efWaitAny(int id, const int *flags, int n);
+
 #endif /* EF_H */
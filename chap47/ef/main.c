@@ -13,6 +13,11 @@
  * 		$ ./main -g 237637
  * 		set
  *
+ * 		$ ./main -C 4
+ * 		237638 # id of a new group of 4 clear event flags
+ *
+ * 		$ ./main -Y 237638:0,2 # waits for flag 0 or flag 2 of the group to be set
+ *
  * Run with the `-h` flag for a list of options.
  *
  * Author: Renato Mascarenhas Costa
@@ -40,6 +45,11 @@ static void clearEventFlag(char *id);
 static void getEventFlag(char *id);
 static void waitForEventFlag(char *id);
 static void deleteEventFlag(char *id);
+static void createGroup(char *nflags);
+static void setGroupFlags(char *spec);
+static void clearGroupFlags(char *spec);
+static void waitForAllFlags(char *spec);
+static void waitForAnyFlag(char *spec);
 
 /* defaults for the event flags library */
 bool efUseSemUndo = false;
@@ -53,7 +63,7 @@ main(int argc, char *argv[]) {
 		helpAndExit(argv[0], EXIT_SUCCESS);
 	}
 
-	while ((opt = getopt(argc, argv, "+c:s:x:g:w:d:h")) != -1) {
+	while ((opt = getopt(argc, argv, "+c:s:x:g:w:d:C:S:X:A:Y:h")) != -1) {
 		switch (opt) {
 			case 'c':
 				createEventFlag(optarg);
@@ -73,6 +83,21 @@ main(int argc, char *argv[]) {
 			case 'd':
 				deleteEventFlag(optarg);
 				break;
+			case 'C':
+				createGroup(optarg);
+				break;
+			case 'S':
+				setGroupFlags(optarg);
+				break;
+			case 'X':
+				clearGroupFlags(optarg);
+				break;
+			case 'A':
+				waitForAllFlags(optarg);
+				break;
+			case 'Y':
+				waitForAnyFlag(optarg);
+				break;
 			case 'h':
 				helpAndExit(argv[0], EXIT_SUCCESS);
 				break;
@@ -215,6 +240,119 @@ deleteEventFlag(char *id) {
 	printf("[%ld][%s] %d: destroyed\n", (long) getpid(), currTime(), semId);
 }
 
+/* parses a specification of flags in a group, in the form `id:flag[,flag...]`.
+ * Returns the number of flags, or -1 if the specification is not valid */
+static int
+parseGroupSpec(char *spec, int *id, int *flags) {
+	char *sep, *tok, *endptr;
+	long flag;
+	int n;
+
+	sep = strchr(spec, ':');
+	if (sep == NULL)
+		return -1;
+
+	*sep = '\0';
+	*id = parseId(spec);
+	if (*id == -1)
+		return -1;
+
+	n = 0;
+	for (tok = strtok(sep + 1, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		flag = strtol(tok, &endptr, 10);
+		if (*endptr != '\0' || flag < 0 || flag >= EF_GROUP_MAX || n == EF_GROUP_MAX)
+			return -1;
+
+		flags[n++] = flag;
+	}
+
+	return (n == 0) ? -1 : n;
+}
+
+static void
+createGroup(char *nflags) {
+	int n, id;
+
+	n = parseId(nflags);
+	if (n == -1 || n > EF_GROUP_MAX)
+		fatal("Invalid number of flags requested");
+
+	id = efGroupCreate(n, EF_CLEAR);
+	if (id == -1)
+		pexit("efGroupCreate");
+
+	printf("[%ld][%s] %d\n", (long) getpid(), currTime(), id);
+}
+
+static void
+setGroupFlags(char *spec) {
+	int id, n, flags[EF_GROUP_MAX];
+
+	n = parseGroupSpec(spec, &id, flags);
+	if (n == -1) {
+		fprintf(stderr, "Invalid flags specification: %s\n", spec);
+		return;
+	}
+
+	if (efGroupSet(id, flags, n) == -1)
+		pexit("efGroupSet");
+
+	printf("[%ld][%s] %d: %d flag(s) set\n", (long) getpid(), currTime(), id, n);
+}
+
+static void
+clearGroupFlags(char *spec) {
+	int id, n, flags[EF_GROUP_MAX];
+
+	n = parseGroupSpec(spec, &id, flags);
+	if (n == -1) {
+		fprintf(stderr, "Invalid flags specification: %s\n", spec);
+		return;
+	}
+
+	if (efGroupClear(id, flags, n) == -1)
+		pexit("efGroupClear");
+
+	printf("[%ld][%s] %d: %d flag(s) clear\n", (long) getpid(), currTime(), id, n);
+}
+
+static void
+waitForAllFlags(char *spec) {
+	int id, n, flags[EF_GROUP_MAX];
+
+	n = parseGroupSpec(spec, &id, flags);
+	if (n == -1) {
+		fprintf(stderr, "Invalid flags specification: %s\n", spec);
+		return;
+	}
+
+	printf("[%ld][%s] %d: Waiting for all flags to be set\n", (long) getpid(), currTime(), id);
+
+	if (efWaitAll(id, flags, n) == -1)
+		pexit("efWaitAll");
+
+	printf("[%ld][%s] %d: Flags are now set\n", (long) getpid(), currTime(), id);
+}
+
+static void
+waitForAnyFlag(char *spec) {
+	int id, n, flag, flags[EF_GROUP_MAX];
+
+	n = parseGroupSpec(spec, &id, flags);
+	if (n == -1) {
+		fprintf(stderr, "Invalid flags specification: %s\n", spec);
+		return;
+	}
+
+	printf("[%ld][%s] %d: Waiting for any flag to be set\n", (long) getpid(), currTime(), id);
+
+	flag = efWaitAny(id, flags, n);
+	if (flag == -1)
+		pexit("efWaitAny");
+
+	printf("[%ld][%s] %d: Flag %d is now set\n", (long) getpid(), currTime(), id, flag);
+}
+
 static void
 helpAndExit(const char *progname, int status) {
 	FILE *stream = stderr;
@@ -222,13 +360,18 @@ helpAndExit(const char *progname, int status) {
 	if (status == EXIT_SUCCESS)
 		stream = stdout;
 
-	fprintf(stream, "Usage: %s [-c [state]] [-s [id]] [-x [id]] [-g [id]] [-w [id]] [-d [id]]\n", progname);
+	fprintf(stream, "Usage: %s [-c [state]] [-s [id]] [-x [id]] [-g [id]] [-w [id]] [-d [id]]\n\t[-C [n]] [-S [spec]] [-X [spec]] [-A [spec]] [-Y [spec]]\n", progname);
 	fprintf(stream, "\t%-10s%-50s\n", "-c", "Creates a new event flag");
 	fprintf(stream, "\t%-10s%-50s\n", "-s", "Sets an event flag");
 	fprintf(stream, "\t%-10s%-50s\n", "-x", "Clears an event flag");
 	fprintf(stream, "\t%-10s%-50s\n", "-g", "Gets the current value of an event flag");
 	fprintf(stream, "\t%-10s%-50s\n", "-w", "Waits for an event flag to be set");
-	fprintf(stream, "\t%-10s%-50s\n", "-d", "Deletes an event flag");
+	fprintf(stream, "\t%-10s%-50s\n", "-d", "Deletes an event flag (or group of flags)");
+	fprintf(stream, "\t%-10s%-50s\n", "-C", "Creates a group of the given number of clear event flags");
+	fprintf(stream, "\t%-10s%-50s\n", "-S", "Sets flags of a group at once (id:flag,flag,...)");
+	fprintf(stream, "\t%-10s%-50s\n", "-X", "Clears flags of a group at once (id:flag,flag,...)");
+	fprintf(stream, "\t%-10s%-50s\n", "-A", "Waits for all the flags given to be set (id:flag,flag,...)");
+	fprintf(stream, "\t%-10s%-50s\n", "-Y", "Waits for any of the flags given to be set (id:flag,flag,...)");
 
 	exit(status);
 }
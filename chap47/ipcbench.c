@@ -0,0 +1,583 @@
+/* ipcbench.c - measures the latency of the synchronization primitives in chap47.
+ *
+ * This program compares the binary semaphores of `binpipe` (with each of its
+ * FIFO, futex and eventfd backends), the event flags of `ef` (on top of System V
+ * semaphores), process-shared pthread mutexes and condition variables, and a bare
+ * futex, all used between processes. Each primitive is run in two modes:
+ *
+ * 	pingpong:   two processes hand a token back and forth through a pair of
+ * 	            semaphores. The latency reported is half of each round trip:
+ * 	            the time it takes for a release in one process to wake up the
+ * 	            other one.
+ * 	contention: a number of processes repeatedly reserve the same semaphore,
+ * 	            update a shared counter, and release it. The latency reported is
+ * 	            that of each reserve/release pair, including the time spent
+ * 	            waiting for other processes.
+ *
+ * For every primitive and mode, the throughput (round trips or critical sections
+ * per second) and latency percentiles, in nanoseconds, are printed. In contention
+ * mode, lost updates to the shared counter are reported as errors.
+ *
+ * Usage:
+ *
+ * 	$ ./ipcbench [-b primitives] [-m modes] [-p procs] [-n iterations] [-c cpus]
+ *
+ * 	-b: comma separated list of primitives to run: fifo, futex, eventfd, ef,
+ * 	    mutex, condvar, rawfutex (default: all of them)
+ * 	-m: comma separated list of modes: pingpong, contention (default: both)
+ * 	-p: number of processes in contention mode (default: 4)
+ * 	-n: iterations per process (default: 100000)
+ * 	-c: comma separated list of CPUs; process `i` is pinned to the `i`th CPU of
+ * 	    the list, wrapping around (default: no pinning)
+ *
+ * Mutexes can only be unlocked by their owner, so `mutex` only runs in contention
+ * mode; `condvar` builds a binary semaphore out of a mutex and a condition variable.
+ *
+ * Compile with:
+ *
+ * 	$ cc -O2 -o ipcbench ipcbench.c binpipe/binpipe.c ef/ef.c ../lib/bench.c -lpthread -lm
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _GNU_SOURCE
+
+#include "binpipe/binpipe.h"
+#include "ef/ef.h"
+#include "../lib/bench.h"
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define MAX_PROCS (256)
+#define MAX_CPUS (256)
+#define NSEMS (2)
+
+#define MODE_PINGPONG (1)
+#define MODE_CONTENTION (2)
+
+/* defaults for the binary semaphore and event flag libraries */
+bool bpRetryOnEintr = true;
+bool efRetryOnEintr = true;
+bool efUseSemUndo = false;
+
+struct procResult {
+	long ops;
+	uint64_t hist[BENCH_HIST_BUCKETS];
+};
+
+/* shared among the parent and every process of a run. The state of the primitives
+ * that live in memory is kept here as well */
+struct control {
+	struct benchControl gate;
+	long counter;
+
+	pthread_mutex_t mutex;
+	pthread_mutex_t condLock;
+	pthread_cond_t cond[NSEMS];
+	int avail[NSEMS];
+
+	unsigned int words[NSEMS];
+	unsigned int waiters[NSEMS];
+
+	struct procResult results[MAX_PROCS];
+};
+
+/* a primitive provides a pair of semaphores, created reserved. Processes reserve
+ * a semaphore with `wait` and release it with `post` */
+struct primitive {
+	const char *name;
+	int modes;
+	void (*setup)(void);
+	int (*wait)(int i);
+	int (*post)(int i);
+	void (*teardown)(void);
+};
+
+static struct config {
+	int prims;
+	int modes;
+	int nprocs;
+	long iters;
+	int cpus[MAX_CPUS];
+	int ncpus;
+} config;
+
+static struct control *control;
+static struct bpsem_t *bpsems[NSEMS];
+static int efIds[NSEMS];
+
+static void pexit(const char *fCall);
+
+static void
+usage(const char *progName) {
+	fprintf(stderr, "Usage: %s [-b primitives] [-m modes] [-p procs] [-n iterations] "
+			"[-c cpus]\n", progName);
+	exit(EXIT_FAILURE);
+}
+
+static long
+parseLong(const char *arg, long min, long max, const char *progName) {
+	long n;
+
+	if (benchParseLong(arg, min, max, &n) == -1)
+		usage(progName);
+
+	return n;
+}
+
+/* binpipe: the same functions serve every backend, only creation differs */
+static void
+bpSetup(struct bpsem_t *(*create)(void)) {
+	int i;
+
+	for (i = 0; i < NSEMS; i++) {
+		bpsems[i] = create();
+		if (bpsems[i] == NULL)
+			pexit("bpCreate");
+
+		/* binpipe semaphores are created released */
+		if (bpReserve(bpsems[i]) == -1)
+			pexit("bpReserve");
+	}
+}
+
+static void fifoSetup(void) { bpSetup(bpCreate); }
+static void futexSetup(void) { bpSetup(bpCreateFutex); }
+static void eventfdSetup(void) { bpSetup(bpCreateEventfd); }
+
+static int bpWait(int i) { return bpReserve(bpsems[i]); }
+static int bpPost(int i) { return bpRelease(bpsems[i]); }
+
+static void
+bpTeardown(void) {
+	int i;
+
+	for (i = 0; i < NSEMS; i++)
+		bpDestroy(bpsems[i]);
+}
+
+/* event flags: setting a flag decrements its semaphore, blocking while it is
+ * already set, so a set flag is a reserved semaphore */
+static void
+efSetup(void) {
+	int i;
+
+	for (i = 0; i < NSEMS; i++) {
+		efIds[i] = efCreate(EF_SET);
+		if (efIds[i] == -1)
+			pexit("efCreate");
+	}
+}
+
+static int efWaitFlag(int i) { return efSet(efIds[i]); }
+static int efPostFlag(int i) { return efClear(efIds[i]); }
+
+static void
+efTeardown(void) {
+	int i;
+
+	for (i = 0; i < NSEMS; i++) {
+		if (efDestroy(efIds[i]) == -1)
+			pexit("efDestroy");
+	}
+}
+
+/* pthread mutexes and condition variables, in the shared control block */
+static void
+mutexSetup(void) {
+	pthread_mutexattr_t attr;
+
+	if (pthread_mutexattr_init(&attr) != 0 ||
+			pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) != 0 ||
+			pthread_mutex_init(&control->mutex, &attr) != 0)
+		pexit("pthread_mutex_init");
+
+	pthread_mutexattr_destroy(&attr);
+
+	/* the mutex is the semaphore itself, so it starts reserved as well */
+	if (pthread_mutex_lock(&control->mutex) != 0)
+		pexit("pthread_mutex_lock");
+}
+
+static void
+condSetup(void) {
+	pthread_mutexattr_t mattr;
+	pthread_condattr_t cattr;
+	int i;
+
+	if (pthread_mutexattr_init(&mattr) != 0 ||
+			pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED) != 0 ||
+			pthread_mutex_init(&control->condLock, &mattr) != 0)
+		pexit("pthread_mutex_init");
+
+	if (pthread_condattr_init(&cattr) != 0 ||
+			pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED) != 0)
+		pexit("pthread_condattr");
+
+	for (i = 0; i < NSEMS; i++) {
+		if (pthread_cond_init(&control->cond[i], &cattr) != 0)
+			pexit("pthread_cond_init");
+		control->avail[i] = 0;
+	}
+
+	pthread_mutexattr_destroy(&mattr);
+	pthread_condattr_destroy(&cattr);
+}
+
+static int
+mutexWait(int i) {
+	(void) i;
+	return pthread_mutex_lock(&control->mutex) == 0 ? 0 : -1;
+}
+
+static int
+mutexPost(int i) {
+	(void) i;
+	return pthread_mutex_unlock(&control->mutex) == 0 ? 0 : -1;
+}
+
+static int
+condWait(int i) {
+	if (pthread_mutex_lock(&control->condLock) != 0)
+		return -1;
+
+	while (!control->avail[i]) {
+		if (pthread_cond_wait(&control->cond[i], &control->condLock) != 0)
+			return -1;
+	}
+	control->avail[i] = 0;
+
+	return pthread_mutex_unlock(&control->condLock) == 0 ? 0 : -1;
+}
+
+static int
+condPost(int i) {
+	if (pthread_mutex_lock(&control->condLock) != 0)
+		return -1;
+
+	control->avail[i] = 1;
+	if (pthread_cond_signal(&control->cond[i]) != 0)
+		return -1;
+
+	return pthread_mutex_unlock(&control->condLock) == 0 ? 0 : -1;
+}
+
+static void
+mutexTeardown(void) {
+	pthread_mutex_destroy(&control->mutex);
+}
+
+static void
+condTeardown(void) {
+	int i;
+
+	for (i = 0; i < NSEMS; i++)
+		pthread_cond_destroy(&control->cond[i]);
+
+	pthread_mutex_destroy(&control->condLock);
+}
+
+/* a bare futex: the word is 1 when released. Processes count themselves in
+ * `waiters` before sleeping, so a release only enters the kernel when someone
+ * may be sleeping */
+static void
+rawSetup(void) {
+	int i;
+
+	for (i = 0; i < NSEMS; i++)
+		control->words[i] = control->waiters[i] = 0;
+}
+
+static int
+rawWait(int i) {
+	unsigned int one;
+
+	for (;;) {
+		one = 1;
+		if (__atomic_compare_exchange_n(&control->words[i], &one, 0, false,
+					__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			return 0;
+
+		__atomic_add_fetch(&control->waiters[i], 1, __ATOMIC_SEQ_CST);
+		if (syscall(SYS_futex, &control->words[i], FUTEX_WAIT, 0, NULL, NULL, 0) == -1 &&
+				errno != EAGAIN && errno != EINTR)
+			return -1;
+		__atomic_sub_fetch(&control->waiters[i], 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+static int
+rawPost(int i) {
+	__atomic_store_n(&control->words[i], 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&control->waiters[i], __ATOMIC_SEQ_CST) != 0 &&
+			syscall(SYS_futex, &control->words[i], FUTEX_WAKE, 1, NULL, NULL, 0) == -1)
+		return -1;
+
+	return 0;
+}
+
+static void rawTeardown(void) { }
+
+static const struct primitive primitives[] = {
+	{ "fifo",     MODE_PINGPONG | MODE_CONTENTION, fifoSetup,    bpWait,     bpPost,     bpTeardown },
+	{ "futex",    MODE_PINGPONG | MODE_CONTENTION, futexSetup,   bpWait,     bpPost,     bpTeardown },
+	{ "eventfd",  MODE_PINGPONG | MODE_CONTENTION, eventfdSetup, bpWait,     bpPost,     bpTeardown },
+	{ "ef",       MODE_PINGPONG | MODE_CONTENTION, efSetup,      efWaitFlag, efPostFlag, efTeardown },
+	{ "mutex",    MODE_CONTENTION,                 mutexSetup,   mutexWait,  mutexPost,  mutexTeardown },
+	{ "condvar",  MODE_PINGPONG | MODE_CONTENTION, condSetup,    condWait,   condPost,   condTeardown },
+	{ "rawfutex", MODE_PINGPONG | MODE_CONTENTION, rawSetup,     rawWait,    rawPost,    rawTeardown },
+};
+
+#define NPRIMITIVES ((int) (sizeof(primitives) / sizeof(primitives[0])))
+
+static void
+pin(int id) {
+	cpu_set_t set;
+
+	if (config.ncpus == 0)
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(config.cpus[id % config.ncpus], &set);
+
+	if (sched_setaffinity(0, sizeof(set), &set) == -1)
+		pexit("sched_setaffinity");
+}
+
+/* process 0 measures round trips: it releases the first semaphore and waits for
+ * process 1 to release the second one in response */
+static void
+pingpong(const struct primitive *p, int id) {
+	struct procResult *result = &control->results[id];
+	uint64_t start;
+	long i;
+
+	for (i = 0; i < config.iters; i++) {
+		if (id == 0) {
+			start = benchNowNs();
+			if (p->post(0) == -1 || p->wait(1) == -1)
+				pexit(p->name);
+
+			result->hist[benchHistIndex((benchNowNs() - start) / 2)]++;
+			result->ops++;
+		} else {
+			if (p->wait(0) == -1 || p->post(1) == -1)
+				pexit(p->name);
+		}
+	}
+}
+
+static void
+contention(const struct primitive *p, int id) {
+	struct procResult *result = &control->results[id];
+	uint64_t start;
+	long i;
+
+	for (i = 0; i < config.iters; i++) {
+		start = benchNowNs();
+		if (p->wait(0) == -1)
+			pexit(p->name);
+
+		/* deliberately not atomic: any update lost shows a broken primitive */
+		control->counter = control->counter + 1;
+
+		if (p->post(0) == -1)
+			pexit(p->name);
+
+		result->hist[benchHistIndex(benchNowNs() - start)]++;
+		result->ops++;
+	}
+}
+
+static void
+run(const struct primitive *p, int mode) {
+	uint64_t hist[BENCH_HIST_BUCKETS], elapsed, start;
+	pid_t pids[MAX_PROCS];
+	long ops, errors;
+	int nprocs, status, i, j;
+
+	nprocs = (mode == MODE_PINGPONG) ? 2 : config.nprocs;
+
+	memset(control, 0, sizeof(*control));
+	p->setup();
+
+	/* in contention mode, the first semaphore is the lock everyone competes for */
+	if (mode == MODE_CONTENTION && p->post(0) == -1)
+		pexit(p->name);
+
+	for (i = 0; i < nprocs; i++) {
+		pids[i] = fork();
+		if (pids[i] == -1)
+			pexit("fork");
+
+		if (pids[i] == 0) {
+			pin(i);
+			benchWaitStart(&control->gate);
+
+			if (mode == MODE_PINGPONG)
+				pingpong(p, i);
+			else
+				contention(p, i);
+
+			_exit(EXIT_SUCCESS);
+		}
+	}
+
+	/* every process is forked before any of them starts */
+	start = benchStart(&control->gate);
+
+	/* the other processes would wait forever for one that failed */
+	for (i = 0; i < nprocs; i++) {
+		if (wait(&status) == -1)
+			pexit("wait");
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+			for (j = 0; j < nprocs; j++)
+				kill(pids[j], SIGKILL);
+			while (wait(NULL) != -1)
+				;
+
+			p->teardown();
+			fprintf(stderr, "%s: a process failed\n", p->name);
+			exit(EXIT_FAILURE);
+		}
+	}
+	elapsed = benchNowNs() - start;
+
+	memset(hist, 0, sizeof(hist));
+	ops = 0;
+	for (i = 0; i < nprocs; i++) {
+		ops += control->results[i].ops;
+		benchHistAdd(hist, control->results[i].hist);
+	}
+
+	errors = (mode == MODE_CONTENTION) ? nprocs * config.iters - control->counter : 0;
+
+	printf("%-10s %-10s %5d %12.0f %8llu %8llu %8llu %8llu %10llu %7ld\n", p->name,
+			(mode == MODE_PINGPONG) ? "pingpong" : "contention", nprocs, ops / (elapsed / 1e9),
+			(unsigned long long) benchHistPercentile(hist, ops, 0.50),
+			(unsigned long long) benchHistPercentile(hist, ops, 0.90),
+			(unsigned long long) benchHistPercentile(hist, ops, 0.99),
+			(unsigned long long) benchHistPercentile(hist, ops, 0.999),
+			(unsigned long long) benchHistMax(hist), errors);
+	fflush(stdout);
+
+	p->teardown();
+}
+
+static void
+parsePrimitives(char *list, const char *progName) {
+	char *tok;
+	int i;
+
+	config.prims = 0;
+	for (tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		for (i = 0; i < NPRIMITIVES; i++) {
+			if (strcmp(tok, primitives[i].name) == 0)
+				break;
+		}
+
+		if (i == NPRIMITIVES)
+			usage(progName);
+
+		config.prims |= 1 << i;
+	}
+}
+
+static void
+parseModes(char *list, const char *progName) {
+	char *tok;
+
+	config.modes = 0;
+	for (tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		if (strcmp(tok, "pingpong") == 0)
+			config.modes |= MODE_PINGPONG;
+		else if (strcmp(tok, "contention") == 0)
+			config.modes |= MODE_CONTENTION;
+		else
+			usage(progName);
+	}
+}
+
+static void
+parseCpus(char *list, const char *progName) {
+	cpu_set_t allowed;
+	char *tok;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+		pexit("sched_getaffinity");
+
+	config.ncpus = 0;
+	for (tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		if (config.ncpus == MAX_CPUS)
+			usage(progName);
+
+		config.cpus[config.ncpus] = parseLong(tok, 0, CPU_SETSIZE - 1, progName);
+		if (!CPU_ISSET(config.cpus[config.ncpus], &allowed)) {
+			fprintf(stderr, "CPU %d is not available\n", config.cpus[config.ncpus]);
+			exit(EXIT_FAILURE);
+		}
+
+		config.ncpus++;
+	}
+}
+
+int
+main(int argc, char *argv[]) {
+	int opt, i;
+
+	config.prims = (1 << NPRIMITIVES) - 1;
+	config.modes = MODE_PINGPONG | MODE_CONTENTION;
+	config.nprocs = 4;
+	config.iters = 100000;
+	config.ncpus = 0;
+
+	while ((opt = getopt(argc, argv, "b:m:p:n:c:")) != -1) {
+		switch (opt) {
+			case 'b': parsePrimitives(optarg, argv[0]); break;
+			case 'm': parseModes(optarg, argv[0]); break;
+			case 'p': config.nprocs = parseLong(optarg, 1, MAX_PROCS, argv[0]); break;
+			case 'n': config.iters = parseLong(optarg, 1, 1000000000, argv[0]); break;
+			case 'c': parseCpus(optarg, argv[0]); break;
+			default: usage(argv[0]);
+		}
+	}
+
+	if (config.prims == 0 || config.modes == 0)
+		usage(argv[0]);
+
+	control = benchShared(sizeof(*control));
+	if (control == NULL)
+		pexit("benchShared");
+
+	printf("%-10s %-10s %5s %12s %8s %8s %8s %8s %10s %7s\n", "primitive", "mode", "procs",
+			"ops/s", "p50(ns)", "p90", "p99", "p99.9", "max", "errors");
+
+	for (i = 0; i < NPRIMITIVES; i++) {
+		if (!(config.prims & (1 << i)))
+			continue;
+
+		if ((config.modes & MODE_PINGPONG) && (primitives[i].modes & MODE_PINGPONG))
+			run(&primitives[i], MODE_PINGPONG);
+
+		if ((config.modes & MODE_CONTENTION) && (primitives[i].modes & MODE_CONTENTION))
+			run(&primitives[i], MODE_CONTENTION);
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+static void
+pexit(const char *fCall) {
+	perror(fCall);
+	exit(EXIT_FAILURE);
+}
@@ -8,9 +8,20 @@
  * This Linux-specific program lists all System V semaphore sets active on the
  * running system.
  *
+ * By default, every index of the kernel's array of semaphore sets is queried with
+ * `semctl(2)`, which takes one system call per index. With `-p`, the list is read
+ * from `/proc/sysvipc/sem` in a single pass instead, which is much cheaper when
+ * there are many sets.
+ *
  * Usage
  *
- *    $ ./lssvsem
+ *    $ ./lssvsem [-p] [-k key] [-u uid] [-t]
+ *
+ *    -p: read the list from /proc/sysvipc/sem
+ *    -k: only list sets with the given key (decimal, or hexadecimal with 0x)
+ *    -u: only list sets owned by the given user ID
+ *    -t: machine-readable output: a header line and one tab separated line per
+ *        set, with no summary
  *
  * Author: Renato Mascarenhas Costa
  */
@@ -22,9 +33,16 @@
 #include <sys/ipc.h>
 #include <sys/sem.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#define PROC_SEM ("/proc/sysvipc/sem")
+#define PROC_BUF_SIZE (64 * 1024)
 
 /* define this union as required by the standards */
 union semun {
@@ -36,24 +54,181 @@ union semun {
 #endif
 };
 
+/* what is listed of each semaphore set */
+struct semEntry {
+	int index; /* -1 when unknown, as in /proc */
+	int id;
+	key_t key;
+	long nsems;
+	uid_t uid;
+	mode_t perms;
+};
+
+static struct {
+	bool useProc;
+	bool filterKey;
+	key_t key;
+	bool filterUid;
+	uid_t uid;
+	bool terse;
+} opts;
+
+static long totalSets, totalSems;
+
 static void pexit(const char *fCall);
 
+static void
+usage(const char *progName) {
+	fprintf(stderr, "Usage: %s [-p] [-k key] [-u uid] [-t]\n", progName);
+	exit(EXIT_FAILURE);
+}
+
+static void
+listEntry(const struct semEntry *e) {
+	if ((opts.filterKey && e->key != opts.key) || (opts.filterUid && e->uid != opts.uid))
+		return;
+
+	totalSets++;
+	totalSems += e->nsems;
+
+	if (opts.terse) {
+		printf("%d\t0x%08x\t%ld\t%ld\t%03o\n", e->id, (unsigned int) e->key, e->nsems,
+				(long) e->uid, (unsigned int) e->perms);
+	} else if (e->index == -1) {
+		printf("%10s\t%8d\t0x%08x\t%7ld\n", "-", e->id, (unsigned int) e->key, e->nsems);
+	} else {
+		printf("%10d\t%8d\t0x%08x\t%7ld\n", e->index, e->id, (unsigned int) e->key, e->nsems);
+	}
+}
+
+static void
+printHeader(void) {
+	if (opts.terse)
+		printf("id\tkey\tnsems\tuid\tperms\n");
+	else
+		printf("\n%10s\t%10s\t%10s\t%10s\n", "index", "ID", "key", "semaphores");
+}
+
+/* reads the whole of the file into a buffer, which is NUL terminated */
+static char *
+readFile(const char *path) {
+	size_t size = PROC_BUF_SIZE, len = 0;
+	ssize_t numRead;
+	char *buf, *p;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		pexit("open");
+
+	buf = malloc(size);
+	if (buf == NULL)
+		pexit("malloc");
+
+	while ((numRead = read(fd, buf + len, size - len - 1)) > 0) {
+		len += numRead;
+		if (len == size - 1) {
+			size *= 2;
+			p = realloc(buf, size);
+			if (p == NULL)
+				pexit("realloc");
+			buf = p;
+		}
+	}
+
+	if (numRead == -1)
+		pexit("read");
+
+	close(fd);
+	buf[len] = '\0';
+	return buf;
+}
+
+/* each line of the file, after a header, describes a set. The key is printed as
+ * a signed number, and the permissions in octal */
+static void
+listFromProc(void) {
+	struct semEntry e;
+	char *buf, *line, *save;
+	unsigned int perms;
+	long uid;
+	int key;
+
+	buf = readFile(PROC_SEM);
+	printHeader();
+
+	line = strtok_r(buf, "\n", &save);
+	for (line = strtok_r(NULL, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+		if (sscanf(line, "%d %d %o %ld %ld", &key, &e.id, &perms, &e.nsems, &uid) != 5) {
+			fprintf(stderr, "%s: unexpected line: %s\n", PROC_SEM, line);
+			exit(EXIT_FAILURE);
+		}
+
+		e.index = -1;
+		e.key = (key_t) key;
+		e.perms = perms;
+		e.uid = (uid_t) uid;
+		listEntry(&e);
+	}
+
+	free(buf);
+
+	if (!opts.terse) {
+		printf("\nTotal semaphore sets: %ld\n", totalSets);
+		printf("Total semaphores: %ld\n", totalSems);
+	}
+}
+
 int
-main() {
-	int i, maxind, semid;
+main(int argc, char *argv[]) {
+	int i, maxind, semid, opt;
 	struct semid_ds ds;
 	struct seminfo info;
+	struct semEntry e;
+	char *end;
+
+	while ((opt = getopt(argc, argv, "pk:u:t")) != -1) {
+		switch (opt) {
+			case 'p':
+				opts.useProc = true;
+				break;
+			case 'k':
+				opts.filterKey = true;
+				opts.key = (key_t) strtoul(optarg, &end, 0);
+				if (*end != '\0')
+					usage(argv[0]);
+				break;
+			case 'u':
+				opts.filterUid = true;
+				opts.uid = (uid_t) strtoul(optarg, &end, 10);
+				if (*end != '\0')
+					usage(argv[0]);
+				break;
+			case 't':
+				opts.terse = true;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if (opts.useProc) {
+		listFromProc();
+		exit(EXIT_SUCCESS);
+	}
 
 	maxind = semctl(0, 0, SEM_INFO, (struct semid_ds *) &info);
 	if (maxind == -1) {
 		pexit("semctl");
 	}
 
-	printf("Maximum index in the kernel's array: %d\n", maxind);
-	printf("Total semaphore sets: %d\n", info.semusz);
-	printf("Total semaphores: %d\n", info.semaem);
+	if (!opts.terse) {
+		printf("Maximum index in the kernel's array: %d\n", maxind);
+		printf("Total semaphore sets: %d\n", info.semusz);
+		printf("Total semaphores: %d\n", info.semaem);
+	}
 
-	printf("\n%10s\t%10s\t%10s\t%10s\n", "index", "ID", "key", "semaphores");
+	printHeader();
 
 	for (i = 0; i <= maxind; i++) {
 		semid = semctl(i, 0, SEM_STAT, &ds);
@@ -66,7 +241,13 @@ main() {
 			continue;
 		}
 
-		printf("%10d\t%8d\t0x%08lx\t%7ld\n", i, semid, (unsigned long) ds.sem_perm.__key, (long) ds.sem_nsems);
+		e.index = i;
+		e.id = semid;
+		e.key = ds.sem_perm.__key;
+		e.nsems = (long) ds.sem_nsems;
+		e.uid = ds.sem_perm.uid;
+		e.perms = ds.sem_perm.mode & 0777;
+		listEntry(&e);
 	}
 
 	exit(EXIT_SUCCESS);
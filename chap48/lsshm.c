@@ -9,9 +9,20 @@
  * This Linux-specific program lists all System V shared memory segments on the
  * running system.
  *
+ * By default, every index of the kernel's array of segments is queried with
+ * `shmctl(2)`, which takes one system call per index. With `-p`, the list is read
+ * from `/proc/sysvipc/shm` in a single pass instead, which is much cheaper when
+ * there are many segments.
+ *
  * Usage
  *
- *    $ ./lsshm
+ *    $ ./lsshm [-p] [-k key] [-u uid] [-t]
+ *
+ *    -p: read the list from /proc/sysvipc/shm
+ *    -k: only list segments with the given key (decimal, or hexadecimal with 0x)
+ *    -u: only list segments owned by the given user ID
+ *    -t: machine-readable output: a header line and one tab separated line per
+ *        segment, with no summary
  *
  * Author: Renato Mascarenhas Costa
  */
@@ -24,25 +35,195 @@
 #include <sys/shm.h>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#define PROC_SHM ("/proc/sysvipc/shm")
+#define PROC_BUF_SIZE (64 * 1024)
+
+/* what is listed of each segment */
+struct shmEntry {
+	int id;
+	key_t key;
+	unsigned long size;
+	long nattch;
+	uid_t uid;
+	mode_t perms;
+};
+
+static struct {
+	bool useProc;
+	bool filterKey;
+	key_t key;
+	bool filterUid;
+	uid_t uid;
+	bool terse;
+} opts;
+
+static long totalSegments;
 
 static void pexit(const char *fCall);
 
+static void
+usage(const char *progName) {
+	fprintf(stderr, "Usage: %s [-p] [-k key] [-u uid] [-t]\n", progName);
+	exit(EXIT_FAILURE);
+}
+
+/* returns whether the segment passed the filters, and was listed */
+static bool
+listEntry(const struct shmEntry *e) {
+	if ((opts.filterKey && e->key != opts.key) || (opts.filterUid && e->uid != opts.uid))
+		return false;
+
+	totalSegments++;
+
+	if (opts.terse)
+		printf("%d\t0x%08x\t%lu\t%ld\t%ld\t%03o\n", e->id, (unsigned int) e->key, e->size,
+				e->nattch, (long) e->uid, (unsigned int) e->perms);
+	else
+		printf("%10d\t%10ld\t%10lu\t%10ld\n", e->id, (long) e->key, e->size, e->nattch);
+
+	return true;
+}
+
+static void
+printHeader(void) {
+	if (opts.terse)
+		printf("id\tkey\tsize\tnattch\tuid\tperms\n");
+	else
+		printf("\n%10s\t%10s\t%10s\t%10s\n", "ID", "key", "size (b)", "processes");
+}
+
+/* reads the whole of the file into a buffer, which is NUL terminated */
+static char *
+readFile(const char *path) {
+	size_t size = PROC_BUF_SIZE, len = 0;
+	ssize_t numRead;
+	char *buf, *p;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		pexit("open");
+
+	buf = malloc(size);
+	if (buf == NULL)
+		pexit("malloc");
+
+	while ((numRead = read(fd, buf + len, size - len - 1)) > 0) {
+		len += numRead;
+		if (len == size - 1) {
+			size *= 2;
+			p = realloc(buf, size);
+			if (p == NULL)
+				pexit("realloc");
+			buf = p;
+		}
+	}
+
+	if (numRead == -1)
+		pexit("read");
+
+	close(fd);
+	buf[len] = '\0';
+	return buf;
+}
+
+/* each line of the file, after a header, describes a segment. The key is printed
+ * as a signed number, and the permissions in octal. Like SHM_INFO, pages are
+ * counted from the size of each segment, whether resident or not */
+static void
+listFromProc(void) {
+	struct shmEntry e;
+	char *buf, *line, *save;
+	unsigned long pages = 0;
+	unsigned int perms;
+	long uid, pageSize;
+	int key, n;
+
+	pageSize = sysconf(_SC_PAGESIZE);
+	buf = readFile(PROC_SHM);
+
+	printHeader();
+
+	line = strtok_r(buf, "\n", &save);
+	for (line = strtok_r(NULL, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+		n = sscanf(line, "%d %d %o %lu %*d %*d %ld %ld",
+				&key, &e.id, &perms, &e.size, &e.nattch, &uid);
+		if (n != 6) {
+			fprintf(stderr, "%s: unexpected line: %s\n", PROC_SHM, line);
+			exit(EXIT_FAILURE);
+		}
+
+		e.key = (key_t) key;
+		e.perms = perms;
+		e.uid = (uid_t) uid;
+		if (listEntry(&e))
+			pages += (e.size + pageSize - 1) / pageSize;
+	}
+
+	free(buf);
+
+	if (!opts.terse) {
+		printf("\nTotal shared memory segments: %ld\n", totalSegments);
+		printf("Number of memory pages these occupy: %lu\n", pages);
+		printf("\n");
+	}
+}
+
 int
-main() {
-	int i, maxind, shmid;
+main(int argc, char *argv[]) {
+	int i, maxind, shmid, opt;
 	struct shmid_ds ds;
 	struct shm_info info;
+	struct shmEntry e;
+	char *end;
+
+	while ((opt = getopt(argc, argv, "pk:u:t")) != -1) {
+		switch (opt) {
+			case 'p':
+				opts.useProc = true;
+				break;
+			case 'k':
+				opts.filterKey = true;
+				opts.key = (key_t) strtoul(optarg, &end, 0);
+				if (*end != '\0')
+					usage(argv[0]);
+				break;
+			case 'u':
+				opts.filterUid = true;
+				opts.uid = (uid_t) strtoul(optarg, &end, 10);
+				if (*end != '\0')
+					usage(argv[0]);
+				break;
+			case 't':
+				opts.terse = true;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if (opts.useProc) {
+		listFromProc();
+		exit(EXIT_SUCCESS);
+	}
 
 	maxind = shmctl(0, SHM_INFO, (struct shmid_ds *) &info);
 	if (maxind == -1)
 		pexit("shmctl");
 
-	printf("Total shared memory segments: %d\n", info.used_ids);
-	printf("Number of memory pages these occupy: %ld\n", info.shm_tot);
+	if (!opts.terse) {
+		printf("Total shared memory segments: %d\n", info.used_ids);
+		printf("Number of memory pages these occupy: %ld\n", info.shm_tot);
+	}
 
-	printf("\n%10s\t%10s\t%10s\t%10s\n", "ID", "key", "size (b)", "processes");
+	printHeader();
 
 	for (i = 0; i <= maxind; i++) {
 		/* first argument is an array index when using SHM_STAT */
@@ -57,10 +238,17 @@ main() {
 			continue;
 		}
 
-		printf("%10d\t%10ld\t%10ld\t%10ld\n", shmid, (long) ds.shm_perm.__key, (long) ds.shm_segsz, (long) ds.shm_nattch);
+		e.id = shmid;
+		e.key = ds.shm_perm.__key;
+		e.size = (unsigned long) ds.shm_segsz;
+		e.nattch = (long) ds.shm_nattch;
+		e.uid = ds.shm_perm.uid;
+		e.perms = ds.shm_perm.mode & 0777;
+		listEntry(&e);
 	}
 
-	printf("\n");
+	if (!opts.terse)
+		printf("\n");
 
 	exit(EXIT_SUCCESS);
 }
@@ -1,17 +1,24 @@
 /* ds.c - implementation of a simple key/value data structure.
 *
 * This implements the functions defined on the `ds.h` file. It provides an API
-* like that of a hashtable or dictionary. The underlying implementation, however,
-* uses a naive array with linear lookup and insertion time for simplicity.
+* like that of a hashtable or dictionary. Entries live in an array, found through
+* a hash index with linear probing that is kept in the same block of memory. Their
+* strings are allocated from a heap at the end of the block.
 *
 * Author: Renato Mascarenhas Costa
 */
 
+#define _GNU_SOURCE /* writer preference for the reader-writer lock, when available */
+
 #include "ds.h"
 
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
 /* NOTE: concurrent access to the block of memory managed by this library is
- * not thread safe. However, read and write locks are kept in its metadata,
- * and an API to lock and unlock them is provided (see `dsLock` and `dsUnlock`.)
+ * not thread safe. However, a reader-writer lock is kept in its metadata, and
+ * an API to lock and unlock it is provided (see `dsLock` and `dsUnlock`.)
  *
  * Therefore, it is a responsibility of the caller to appropriately lock the
  * data structure according to the needs to the application. */
@@ -41,71 +48,485 @@ getCap(void *mem) {
 }
 
 static void
-setReadLock(void *mem, int semid) {
+setMagic(void *mem, int magic) {
+	int *p = mem;
+	p[DS_MAGIC_OFFSET] = magic;
+}
+
+static int
+getMagic(void *mem) {
+	int *p = mem;
+	return p[DS_MAGIC_OFFSET];
+}
+
+static void
+setUsed(void *mem, int used) {
 	int *p = mem;
-	p[DS_RLOCK_OFFSET] = semid;
+	p[DS_USED_OFFSET] = used;
 }
 
 static int
-getReadLock(void *mem) {
+getUsed(void *mem) {
 	int *p = mem;
-	return p[DS_RLOCK_OFFSET];
+	return p[DS_USED_OFFSET];
 }
 
 static void
-setWriteLock(void *mem, int semid) {
+setFree(void *mem, int entry) {
 	int *p = mem;
-	p[DS_WLOCK_OFFSET] = semid;
+	p[DS_FREE_OFFSET] = entry;
 }
 
 static int
-getWriteLock(void *mem) {
+getFree(void *mem) {
 	int *p = mem;
-	return p[DS_WLOCK_OFFSET];
+	return p[DS_FREE_OFFSET];
+}
+
+static void
+setBuckets(void *mem, int buckets) {
+	int *p = mem;
+	p[DS_BUCKETS_OFFSET] = buckets;
+}
+
+static int
+getBuckets(void *mem) {
+	int *p = mem;
+	return p[DS_BUCKETS_OFFSET];
+}
+
+static void
+setHeapSize(void *mem, int bytes) {
+	int *p = mem;
+	p[DS_HEAP_SIZE_OFFSET] = bytes;
+}
+
+static int
+getHeapSize(void *mem) {
+	int *p = mem;
+	return p[DS_HEAP_SIZE_OFFSET];
+}
+
+static void
+setHeapUsed(void *mem, int bytes) {
+	int *p = mem;
+	p[DS_HEAP_USED_OFFSET] = bytes;
+}
+
+static int
+getHeapUsed(void *mem) {
+	int *p = mem;
+	return p[DS_HEAP_USED_OFFSET];
+}
+
+static void
+setHeapGarbage(void *mem, int bytes) {
+	int *p = mem;
+	p[DS_HEAP_GARBAGE_OFFSET] = bytes;
+}
+
+static int
+getHeapGarbage(void *mem) {
+	int *p = mem;
+	return p[DS_HEAP_GARBAGE_OFFSET];
+}
+
+static unsigned int *
+seqAddr(void *mem) {
+	int *p = mem;
+	return (unsigned int *) (p + DS_SEQ_OFFSET);
+}
+
+static void
+setWriter(void *mem, pid_t pid) {
+	int *p = mem;
+	__atomic_store_n(&p[DS_WRITER_OFFSET], (int) pid, __ATOMIC_RELAXED);
+}
+
+static pid_t
+getWriter(void *mem) {
+	int *p = mem;
+	return (pid_t) __atomic_load_n(&p[DS_WRITER_OFFSET], __ATOMIC_RELAXED);
+}
+
+static pthread_rwlock_t *
+lockAddr(void *mem) {
+	int *p = mem;
+	return (pthread_rwlock_t *) (p + DS_LOCK_OFFSET);
+}
+
+static struct nvds_stats *
+statsAddr(void *mem) {
+	return (struct nvds_stats *) ((char *) mem + DS_STATS_OFFSET);
+}
+
+static int *
+indexAddr(void *mem) {
+	return (int *) (statsAddr(mem) + 1);
 }
 
 static void *
 arrayAddr(void *mem) {
-	int *p = mem;
-	return p + 4;
+	return indexAddr(mem) + getBuckets(mem);
+}
+
+static char *
+heapAddr(void *mem) {
+	struct nvds_entry *array = arrayAddr(mem);
+	return (char *) (array + getCap(mem));
+}
+
+static struct nvds_string *
+stringAt(void *mem, int offset) {
+	return (struct nvds_string *) (heapAddr(mem) + offset);
+}
+
+static char *
+entryName(void *mem, struct nvds_entry *entry) {
+	return stringAt(mem, entry->str)->data;
+}
+
+static char *
+entryVal(void *mem, struct nvds_entry *entry) {
+	return entryName(mem, entry) + entry->namelen + 1;
+}
+
+/* counters are updated by processes that do not hold the lock, or hold it for
+ * reading only, so every update is atomic */
+static void
+statsAdd(unsigned long long *counter, unsigned long long n) {
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static void
+statsMax(unsigned long long *counter, unsigned long long n) {
+	unsigned long long curr = __atomic_load_n(counter, __ATOMIC_RELAXED);
+
+	while (n > curr && !__atomic_compare_exchange_n(counter, &curr, n, true,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static void
+statsCount(void *mem, enum nvds_stats_op op) {
+	statsAdd(&statsAddr(mem)->ops[op], 1);
+}
+
+/* room needed in a string record for the given name and value lengths, rounded
+ * so that the next record in the heap is properly aligned */
+static int
+stringSize(int namelen, int vallen) {
+	int size = namelen + 1 + vallen + 1;
+	return (size + sizeof(int) - 1) / sizeof(int) * sizeof(int);
+}
+
+/* the size of the string heap used for a given capacity */
+static int
+capToHeap(int cap) {
+	int heap, min;
+
+	heap = cap * NVDS_HEAP_PER_ENTRY;
+	min = sizeof(struct nvds_string) + stringSize(NVDS_NAME_LEN, NVDS_VAL_LEN);
+
+	return (heap < min) ? min : heap;
+}
+
+/* heap bytes that can be handed out, possibly after compacting the heap */
+static int
+heapAvailable(void *mem) {
+	return getHeapSize(mem) - getHeapUsed(mem) + getHeapGarbage(mem);
+}
+
+/* marks the string record at the given offset as unused */
+static void
+stringFree(void *mem, int offset) {
+	struct nvds_string *str = stringAt(mem, offset);
+
+	str->entry = DS_DEAD_STRING;
+	setHeapGarbage(mem, getHeapGarbage(mem) + sizeof(*str) + str->size);
+}
+
+/* moves live string records down over unused ones. Returns the number of bytes
+ * reclaimed */
+static int
+compactHeap(void *mem) {
+	int offset, dest, used, entry, total;
+	struct nvds_entry *array;
+	struct nvds_string *str;
+	char *heap;
+
+	array = arrayAddr(mem);
+	heap = heapAddr(mem);
+	used = getHeapUsed(mem);
+
+	/* records are visited in heap order, so a live record only ever moves down
+	 * over space that has already been visited */
+	dest = 0;
+	for (offset = 0; offset < used; offset += total) {
+		str = (struct nvds_string *) (heap + offset);
+		entry = str->entry;
+		total = sizeof(*str) + str->size;
+
+		if (entry == DS_DEAD_STRING)
+			continue;
+
+		if (dest != offset)
+			memmove(heap + dest, heap + offset, total);
+
+		array[entry].str = dest;
+		dest += total;
+	}
+
+	setHeapUsed(mem, dest);
+	setHeapGarbage(mem, 0);
+
+	return used - dest;
+}
+
+/* allocates and fills a string record for the entry at position `entry` of the
+ * array, returning its offset. The caller must have made sure that there is room
+ * for it (see `heapAvailable`.) */
+static int
+stringAlloc(void *mem, int entry, const char *name, int namelen, const char *val, int vallen) {
+	struct nvds_string *str;
+	int offset, size;
+
+	size = stringSize(namelen, vallen);
+	if (getHeapSize(mem) - getHeapUsed(mem) < (int) sizeof(*str) + size)
+		compactHeap(mem);
+
+	offset = getHeapUsed(mem);
+	str = stringAt(mem, offset);
+	str->entry = entry;
+	str->size = size;
+	memcpy(str->data, name, namelen);
+	str->data[namelen] = '\0';
+	memcpy(str->data + namelen + 1, val, vallen);
+	str->data[namelen + 1 + vallen] = '\0';
+
+	setHeapUsed(mem, offset + sizeof(*str) + size);
+	return offset;
+}
+
+/* the number of buckets used for a given capacity: the smallest power of two
+ * that is at least twice the capacity */
+static int
+capToBuckets(int cap) {
+	int buckets = 1;
+
+	while (buckets < 2 * cap)
+		buckets <<= 1;
+
+	return buckets;
+}
+
+/* FNV-1a hash of a name, considering at most NVDS_NAME_LEN characters */
+static unsigned int
+hashName(const char *name) {
+	unsigned int h = 2166136261u;
+	int i;
+
+	for (i = 0; i < NVDS_NAME_LEN && name[i] != '\0'; i++) {
+		h ^= (unsigned char) name[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/* looks for `name` in the hash index. Returns the position of its entry in the
+ * array, or -1 if it does not exist. In both cases, `bucket` is set to where the
+ * probe sequence stopped: the bucket holding the entry, or the empty bucket where
+ * it should be inserted */
+static int
+indexFind(void *mem, const char *name, int namelen, unsigned int hash, int *bucket) {
+	int i, mask, *index;
+	struct nvds_entry *entry, *array;
+
+	index = indexAddr(mem);
+	array = arrayAddr(mem);
+	mask = getBuckets(mem) - 1;
+
+	/* the index is never full (see `capToBuckets`), so the probe ends. Comparing
+	 * the cached hashes first avoids touching the heap for most other entries */
+	for (i = hash & mask; index[i] != DS_EMPTY_BUCKET; i = (i + 1) & mask) {
+		entry = &array[index[i]];
+		if (entry->hash == hash && entry->namelen == namelen &&
+				memcmp(entryName(mem, entry), name, namelen) == 0) {
+			*bucket = i;
+			return index[i];
+		}
+	}
+
+	*bucket = i;
+	return -1;
+}
+
+/* empties the given bucket. Instead of leaving a tombstone behind, later entries
+ * of the same probe sequence are moved back so that no lookup misses them */
+static void
+indexRemove(void *mem, int bucket) {
+	int i, home, mask, *index;
+	struct nvds_entry *array;
+
+	index = indexAddr(mem);
+	array = arrayAddr(mem);
+	mask = getBuckets(mem) - 1;
+
+	for (i = (bucket + 1) & mask; index[i] != DS_EMPTY_BUCKET; i = (i + 1) & mask) {
+		home = array[index[i]].hash & mask;
+
+		/* the entry can only move back if its home bucket is not within the
+		 * (circular) range between the hole and its current bucket */
+		if (((i - home) & mask) >= ((i - bucket) & mask)) {
+			index[bucket] = index[i];
+			bucket = i;
+		}
+	}
+
+	index[bucket] = DS_EMPTY_BUCKET;
+}
+
+/* takes a position of the array for a new entry: a free one if there is any, or
+ * the first one never used otherwise. The caller checks the capacity */
+static int
+entryAlloc(void *mem) {
+	struct nvds_entry *array;
+	int entry;
+
+	array = arrayAddr(mem);
+	entry = getFree(mem);
+
+	if (entry != DS_NO_ENTRY) {
+		setFree(mem, array[entry].vallen);
+		return entry;
+	}
+
+	entry = getUsed(mem);
+	setUsed(mem, entry + 1);
+	return entry;
+}
+
+static void
+entryFree(void *mem, int entry) {
+	struct nvds_entry *array = arrayAddr(mem);
+
+	array[entry].str = DS_FREE_ENTRY;
+	array[entry].vallen = getFree(mem);
+	setFree(mem, entry);
+}
+
+/* moves the entries at the end of the array to the free positions before them,
+ * so that the first `size` positions hold every entry */
+static void
+compactArray(void *mem) {
+	int lo, hi, bucket, *index;
+	struct nvds_entry *array;
+
+	array = arrayAddr(mem);
+	index = indexAddr(mem);
+
+	lo = 0;
+	hi = getUsed(mem) - 1;
+	for (;;) {
+		while (lo < hi && array[lo].str != DS_FREE_ENTRY)
+			lo++;
+
+		while (hi > lo && array[hi].str == DS_FREE_ENTRY)
+			hi--;
+
+		if (lo >= hi)
+			break;
+
+		/* the entry is found again in order to know which bucket refers to it */
+		indexFind(mem, entryName(mem, &array[hi]), array[hi].namelen, array[hi].hash, &bucket);
+		index[bucket] = lo;
+
+		array[lo] = array[hi];
+		stringAt(mem, array[lo].str)->entry = lo;
+		array[hi].str = DS_FREE_ENTRY;
+	}
+
+	setUsed(mem, getSize(mem));
+	setFree(mem, DS_NO_ENTRY);
+}
+
+/* the lock must work across processes. Writers are preferred where possible, or
+ * a steady stream of `get` commands could keep every `set` waiting forever */
+static int
+lockInit(pthread_rwlock_t *lock) {
+	pthread_rwlockattr_t attr;
+	int s;
+
+	s = pthread_rwlockattr_init(&attr);
+	if (s != 0)
+		return s;
+
+	s = pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+	if (s == 0)
+		s = pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+	if (s == 0)
+		s = pthread_rwlock_init(lock, &attr);
+
+	pthread_rwlockattr_destroy(&attr);
+	return s;
 }
 
 int
 dsInit(void *mem, int cap) {
-	int rsemid, wsemid;
+	int i, s, buckets, *index;
 
-	rsemid = semaphoreInit(SEM_AVAILBLE);
-	if (rsemid == -1)
+	s = lockInit(lockAddr(mem));
+	if (s != 0) {
+		errno = s;
 		return -1;
+	}
 
-	wsemid = semaphoreInit(SEM_AVAILBLE);
-	if (wsemid == -1)
-		return -1;
+	buckets = capToBuckets(cap);
 
 	setSize(mem, 0);
 	setCap(mem, cap);
-	setReadLock(mem, rsemid);
-	setWriteLock(mem, wsemid);
+	setMagic(mem, DS_MAGIC);
+	setBuckets(mem, buckets);
+	setHeapSize(mem, capToHeap(cap));
+	setHeapUsed(mem, 0);
+	setHeapGarbage(mem, 0);
+	setUsed(mem, 0);
+	setFree(mem, DS_NO_ENTRY);
+	*seqAddr(mem) = 0;
+	setWriter(mem, 0);
+	memset(statsAddr(mem), 0, sizeof(struct nvds_stats));
+
+	index = indexAddr(mem);
+	for (i = 0; i < buckets; i++)
+		index[i] = DS_EMPTY_BUCKET;
 
 	return 0;
 }
 
 int
 dsValidate(void *mem) {
-	int size, cap, rsemid, wsemid;
-	bool validReadLock, validWriteLock;
+	int size, cap, used, buckets, heapSize, heapUsed, heapGarbage;
+	bool validHeap;
+
+	/* not a block of memory initialized by `dsInit` */
+	if (getMagic(mem) != DS_MAGIC)
+		return -1;
 
 	size = getSize(mem);
 	cap = getCap(mem);
-	rsemid = getReadLock(mem);
-	wsemid = getWriteLock(mem);
+	used = getUsed(mem);
+	buckets = getBuckets(mem);
+	heapSize = getHeapSize(mem);
+	heapUsed = getHeapUsed(mem);
+	heapGarbage = getHeapGarbage(mem);
 
-	/* checks if the semaphore IDs on the metadata are valid System V semaphores:
-	 * they might have been wiped out since they were created */
-	validReadLock = (semaphoreGetState(rsemid) != -1);
-	validWriteLock = (semaphoreGetState(wsemid) != -1);
+	validHeap = (heapSize == capToHeap(cap) && heapUsed >= 0 && heapUsed <= heapSize &&
+			heapGarbage >= 0 && heapGarbage <= heapUsed);
 
-	if (size >= 0 && size <= cap && validReadLock && validWriteLock)
+	if (size >= 0 && size <= used && used <= cap && buckets == capToBuckets(cap) && validHeap)
 		return 0;
 
 	/* corrupted or invalid block of memory */
@@ -114,16 +535,124 @@ dsValidate(void *mem) {
 
 int
 dsCapToBytes(int cap) {
-	return (4 * sizeof(int)) + (cap * sizeof(struct nvds_entry));
+	return DS_HEADER_BYTES + (capToBuckets(cap) * sizeof(int)) +
+		(cap * sizeof(struct nvds_entry)) + capToHeap(cap);
+}
+
+/* the finalizer of MurmurHash3: every bit of `h` changes about half of the bits
+ * of the result. The top bits of FNV-1a alone are far from uniform for names
+ * like `key1`, `key2`, ..., which differ in their last bytes */
+static unsigned int
+mixHash(unsigned int h) {
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+
+	return h;
 }
 
 int
-dsSet(void *mem, char *name, char *val) {
-	int i, size, cap;
+dsShard(const char *name, int nblocks) {
+	return ((unsigned long long) mixHash(hashName(name)) * nblocks) >> 32;
+}
+
+int
+dsCapacity(void *mem) {
+	return getCap(mem);
+}
+
+int
+dsUsedBytes(void *mem) {
+	return heapAddr(mem) - (char *) mem + getHeapUsed(mem);
+}
+
+int
+dsRestore(void *mem) {
+	int s;
+
+	if (dsValidate(mem) == -1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	s = lockInit(lockAddr(mem));
+	if (s != 0) {
+		errno = s;
+		return -1;
+	}
+
+	*seqAddr(mem) = 0;
+	setWriter(mem, 0);
+	memset(statsAddr(mem), 0, sizeof(struct nvds_stats));
+
+	return 0;
+}
+
+int
+dsGrow(void *mem, int cap) {
+	int i, j, size, buckets, mask, *index;
 	struct nvds_entry *array;
+	char *heap;
+
+	statsCount(mem, DS_STATS_GROW);
+
+	if (cap < getCap(mem)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (cap == getCap(mem))
+		return 0;
+
+	/* with every entry at the beginning of the array, only those have to move */
+	compactArray(mem);
+	size = getSize(mem);
+
+	buckets = capToBuckets(cap);
+	index = indexAddr(mem);
+	array = (struct nvds_entry *) (index + buckets);
+	heap = (char *) (array + cap);
+
+	/* both regions move up, the heap by more than the array. Moving the heap first
+	 * makes room for the array without overwriting anything still to be moved */
+	memmove(heap, heapAddr(mem), getHeapUsed(mem));
+	memmove(array, arrayAddr(mem), size * sizeof(struct nvds_entry));
+
+	setHeapSize(mem, capToHeap(cap));
+	setCap(mem, cap);
+	setBuckets(mem, buckets);
+
+	/* the index is built again for the new number of buckets */
+	mask = buckets - 1;
+	for (i = 0; i < buckets; i++)
+		index[i] = DS_EMPTY_BUCKET;
+
+	for (j = 0; j < size; j++) {
+		for (i = array[j].hash & mask; index[i] != DS_EMPTY_BUCKET; i = (i + 1) & mask)
+			;
+
+		index[i] = j;
+	}
+
+	return 0;
+}
+
+int
+dsSet(void *mem, char *name, char *val) {
+	int i, bucket, size, cap, namelen, vallen, needed;
+	struct nvds_entry *entry, *array;
+	struct nvds_string *str;
+	unsigned int hash;
+
+	statsCount(mem, DS_STATS_SET);
+
+	namelen = strlen(name);
+	vallen = strlen(val);
 
 	/* make sure parameters given are within accepted limits */
-	if (strlen(name) > NVDS_NAME_LEN || strlen(val) > NVDS_VAL_LEN) {
+	if (namelen > NVDS_NAME_LEN || vallen > NVDS_VAL_LEN) {
 		errno = EINVAL;
 		return -1;
 	}
@@ -131,124 +660,281 @@ dsSet(void *mem, char *name, char *val) {
 	size = getSize(mem);
 	cap = getCap(mem);
 	array = arrayAddr(mem);
-
-	for (i = 0; i < size; i++) {
-		/* check for an existing entry with the given name: if it exists, update it
-		 * and return successfully */
-		if (strncmp(array[i].name, name, NVDS_NAME_LEN) == 0) {
-			strncpy(array[i].val, val, NVDS_VAL_LEN);
+	hash = hashName(name);
+	needed = sizeof(struct nvds_string) + stringSize(namelen, vallen);
+
+	/* check for an existing entry with the given name: if it exists, update it
+	 * and return successfully */
+	i = indexFind(mem, name, namelen, hash, &bucket);
+	if (i != -1) {
+		entry = &array[i];
+		str = stringAt(mem, entry->str);
+
+		/* the new value fits where the old one was */
+		if (stringSize(namelen, vallen) <= str->size) {
+			memcpy(entryVal(mem, entry), val, vallen + 1);
+			entry->vallen = vallen;
 			return 0;
 		}
+
+		/* otherwise a new record is needed; the current one is only released
+		 * once it is known that the update can succeed */
+		if (heapAvailable(mem) + (int) sizeof(*str) + str->size < needed) {
+			errno = ENOMEM;
+			return -1;
+		}
+
+		stringFree(mem, entry->str);
+		entry->str = stringAlloc(mem, i, name, namelen, val, vallen);
+		entry->vallen = vallen;
+		return 0;
 	}
 
 	/* the name requested does not exist - insert it */
 
 	/* if there is no more capacity for insertion, end with ENOMEM */
-	if (size >= cap) {
+	if (size >= cap || heapAvailable(mem) < needed) {
 		errno = ENOMEM;
 		return -1;
 	}
 
-	/* copy the value given to the end of the list and increase the size metadata */
-	strncpy(array[size].name, name, NVDS_NAME_LEN);
-	strncpy(array[size].val, val, NVDS_VAL_LEN);
+	/* add the entry to a free position and increase the size metadata */
+	i = entryAlloc(mem);
+	entry = &array[i];
+	entry->str = stringAlloc(mem, i, name, namelen, val, vallen);
+	entry->namelen = namelen;
+	entry->vallen = vallen;
+	entry->hash = hash;
+
+	indexAddr(mem)[bucket] = i;
 	setSize(mem, size + 1);
 
 	return 0;
 }
 
+/* looks up `name` and copies its value to `buf`, like `strncpy` would. This may
+ * run while another process is writing to the block, so nothing read from it is
+ * trusted: every position and offset is checked against the bounds of the block
+ * before being followed, and the probe sequence is bounded. Whatever is found is
+ * only valid if no write happened meanwhile (see `dsGet`.)
+ *
+ * Returns 0 if the name is found, or -1 otherwise */
+static int
+readValue(void *mem, const char *name, int namelen, unsigned int hash, char *buf, int bufsiz) {
+	int i, n, probes, pos, cap, mask, heapSize, *index;
+	struct nvds_entry entry, *array;
+	char *heap, *data;
+
+	index = indexAddr(mem);
+	array = arrayAddr(mem);
+	heap = heapAddr(mem);
+	cap = getCap(mem);
+	mask = getBuckets(mem) - 1;
+	heapSize = getHeapSize(mem);
+
+	for (i = hash & mask, probes = 0; probes <= mask; i = (i + 1) & mask, probes++) {
+		pos = index[i];
+		if (pos < 0 || pos >= cap)
+			return -1;
+
+		entry = array[pos];
+		if (entry.hash != hash || entry.namelen != namelen)
+			continue;
+
+		if (entry.str < 0 || entry.vallen < 0 || entry.vallen > NVDS_VAL_LEN ||
+				entry.str > heapSize - (int) sizeof(struct nvds_string) - stringSize(namelen, entry.vallen))
+			continue;
+
+		data = ((struct nvds_string *) (heap + entry.str))->data;
+		if (memcmp(data, name, namelen) != 0)
+			continue;
+
+		/* name found - copy value to the provided buffer */
+		n = (entry.vallen + 1 < bufsiz) ? entry.vallen + 1 : bufsiz;
+		memcpy(buf, data + namelen + 1, n);
+		return 0;
+	}
+
+	return -1;
+}
+
 int
 dsGet(void *mem, char *name, char *buf, int bufsiz) {
-	int i, size, namelen;
-	struct nvds_entry *array;
+	int namelen, found;
+	unsigned int hash, seq, *seqp;
+
+	statsCount(mem, DS_STATS_GET);
 
-	if (strlen(name) > NVDS_NAME_LEN) {
+	namelen = strlen(name);
+	if (namelen > NVDS_NAME_LEN) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	size = getSize(mem);
-	array = arrayAddr(mem);
-	namelen = strlen(name);
+	hash = hashName(name);
+	seqp = seqAddr(mem);
 
-	for (i = 0; i < size; i++) {
-		if (strncmp(array[i].name, name, namelen) == 0) {
-			/* name found - copy value to the provided buffer */
-			strncpy(buf, array[i].val, bufsiz);
-			return 0;
+	for (;;) {
+		seq = __atomic_load_n(seqp, __ATOMIC_ACQUIRE);
+
+		if (seq & 1) {
+			/* a write is in progress. If it is this process's own, nothing can
+			 * change under it; otherwise, wait for the writer to finish */
+			if (getWriter(mem) == getpid()) {
+				found = readValue(mem, name, namelen, hash, buf, bufsiz);
+				break;
+			}
+
+			statsAdd(&statsAddr(mem)->getRetries, 1);
+			sched_yield();
+			continue;
 		}
+
+		found = readValue(mem, name, namelen, hash, buf, bufsiz);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(seqp, __ATOMIC_RELAXED) == seq)
+			break;
+
+		statsAdd(&statsAddr(mem)->getRetries, 1);
 	}
 
+	if (found == 0)
+		return 0;
+
 	/* name not found: return EINVAL to the caller */
 	errno = EINVAL;
 	return -1;
 }
 
+/* brackets a write section, while holding the lock for writing. Lock-free readers
+ * see the sequence counter odd in between */
+static void
+writeBegin(void *mem) {
+	unsigned int *seqp = seqAddr(mem);
+
+	setWriter(mem, getpid());
+	__atomic_store_n(seqp, *seqp + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+writeEnd(void *mem) {
+	unsigned int *seqp = seqAddr(mem);
+
+	__atomic_store_n(seqp, *seqp + 1, __ATOMIC_RELEASE);
+}
+
+/* takes the lock for reading or for writing, counting it in the statistics. The
+ * lock is tried first, so that the clock is only read when there is a wait to time */
+static int
+lockTimed(void *mem, enum nvds_stats_lock kind) {
+	pthread_rwlock_t *lock = lockAddr(mem);
+	struct nvds_lock_stats *stats = &statsAddr(mem)->locks[kind];
+	struct timespec start, end;
+	unsigned long long ns;
+	int s;
+
+	if (kind == DS_STATS_WRITE)
+		s = pthread_rwlock_trywrlock(lock);
+	else
+		s = pthread_rwlock_tryrdlock(lock);
+
+	if (s == EBUSY) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		if (kind == DS_STATS_WRITE)
+			s = pthread_rwlock_wrlock(lock);
+		else
+			s = pthread_rwlock_rdlock(lock);
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		if (s == 0) {
+			ns = (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+
+			statsAdd(&stats->waits, 1);
+			statsAdd(&stats->waitNs, ns);
+			statsMax(&stats->maxWaitNs, ns);
+		}
+	}
+
+	if (s == 0)
+		statsAdd(&stats->taken, 1);
+
+	return s;
+}
+
 int
 dsLock(void *mem, unsigned char operations) {
-	int rsemid, wsemid;
+	int s;
 
-	rsemid = getReadLock(mem);
-	wsemid = getWriteLock(mem);
+	if (operations & DS_WRITE)
+		s = lockTimed(mem, DS_STATS_WRITE);
+	else if (operations & DS_READ)
+		s = lockTimed(mem, DS_STATS_READ);
+	else
+		s = EINVAL;
 
-	if (operations & DS_READ) {
-		if (semaphoreReserve(rsemid) == -1)
-			return -1;
+	if (s != 0) {
+		errno = s;
+		return -1;
 	}
 
-	if (operations & DS_WRITE) {
-		if (semaphoreReserve(wsemid) == -1)
-			return -1;
-	}
+	if (operations & DS_WRITE)
+		writeBegin(mem);
 
-	/* requested locks acquired successfully */
+	/* requested lock acquired successfully */
 	return 0;
 }
 
 int dsUnlock(void *mem, unsigned char operations) {
-	int rsemid, wsemid;
-
-	rsemid = getReadLock(mem);
-	wsemid = getWriteLock(mem);
+	int s;
 
-	if (operations & DS_WRITE) {
-		if (semaphoreRelease(wsemid) == -1)
-			return -1;
+	if (!(operations & DS_READ_WRITE)) {
+		errno = EINVAL;
+		return -1;
 	}
 
-	if (operations & DS_READ) {
-		if (semaphoreRelease(rsemid) == -1)
-			return -1;
+	if (operations & DS_WRITE)
+		writeEnd(mem);
+
+	/* the same call releases shared and exclusive ownership */
+	s = pthread_rwlock_unlock(lockAddr(mem));
+	if (s != 0) {
+		errno = s;
+		return -1;
 	}
 
-	/* requested locks released successfully */
+	/* requested lock released successfully */
 	return 0;
 }
 
 int
 dsDelete(void *mem, char *name) {
-	int i, j, size;
+	int i, bucket, namelen;
 	struct nvds_entry *array;
 
-	if (strlen(name) > NVDS_NAME_LEN) {
+	statsCount(mem, DS_STATS_DELETE);
+
+	namelen = strlen(name);
+	if (namelen > NVDS_NAME_LEN) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	size = getSize(mem);
 	array = arrayAddr(mem);
 
-	for (i = 0; i < size; i++) {
-		if (strncmp(array[i].name, name, NVDS_NAME_LEN) == 0) {
-			/* requested name found - shift other elements left */
-			for (j = i; j < size - 1; j++) {
-				array[j] = array[j + 1];
-			}
+	i = indexFind(mem, name, namelen, hashName(name), &bucket);
+	if (i != -1) {
+		/* requested name found - release its bucket, strings and position */
+		indexRemove(mem, bucket);
+		stringFree(mem, array[i].str);
+		entryFree(mem, i);
 
-			/* update size metadata */
-			setSize(mem, size - 1);
-			return 0;
-		}
+		/* update size metadata */
+		setSize(mem, getSize(mem) - 1);
+		return 0;
 	}
 
 	/* element not found: return error to the caller */
@@ -256,13 +942,39 @@ dsDelete(void *mem, char *name) {
 	return -1;
 }
 
+int
+dsCompact(void *mem) {
+	statsCount(mem, DS_STATS_COMPACT);
+
+	compactArray(mem);
+	return compactHeap(mem);
+}
+
 void
-dsDestroy(void *mem) {
-	int rsemid, wsemid;
+dsStats(void *mem, struct nvds_stats *stats) {
+	struct nvds_stats *shared = statsAddr(mem);
+	int i;
+
+	for (i = 0; i < DS_STATS_OPS; i++)
+		stats->ops[i] = __atomic_load_n(&shared->ops[i], __ATOMIC_RELAXED);
+
+	stats->getRetries = __atomic_load_n(&shared->getRetries, __ATOMIC_RELAXED);
 
-	rsemid = getReadLock(mem);
-	wsemid = getWriteLock(mem);
+	for (i = 0; i < DS_STATS_LOCKS; i++) {
+		stats->locks[i].taken = __atomic_load_n(&shared->locks[i].taken, __ATOMIC_RELAXED);
+		stats->locks[i].waits = __atomic_load_n(&shared->locks[i].waits, __ATOMIC_RELAXED);
+		stats->locks[i].waitNs = __atomic_load_n(&shared->locks[i].waitNs, __ATOMIC_RELAXED);
+		stats->locks[i].maxWaitNs = __atomic_load_n(&shared->locks[i].maxWaitNs, __ATOMIC_RELAXED);
+	}
+}
 
-	semaphoreDestroy(rsemid);
-	semaphoreDestroy(wsemid);
+pid_t
+dsLastWriter(void *mem) {
+	return getWriter(mem);
+}
+
+void
+dsDestroy(void *mem) {
+	pthread_rwlock_destroy(lockAddr(mem));
+	setMagic(mem, 0);
 }
@@ -4,9 +4,11 @@
 * mechanism * of the `nv` tool. It provides functionalities similar to those of
 * a hash table or dictionary. Only strings are supported as name and value.
 *
-* The underlying implementation uses a simple array based solution. Therefore,
-* every lookup is O(n). The goal is just to simulate a hash table API - implementing
-* an efficient hashing algorithm is outside of the scope of this project.
+* Entries are kept in a simple array, indexed by an open addressing hash table
+* (linear probing) stored in the same block of memory. Therefore, lookups take
+* constant time on average for every process that attaches to the block. Names
+* and values are stored in a string heap at the end of the block, so each entry
+* only takes as much room as its strings need.
 *
 * Author: Renato Mascarenhas Costa
 */
@@ -15,11 +17,11 @@
 #define DS_H
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
-
-#include "sems.h"
+#include <sys/types.h>
 
 /* allow the compiler to override these constants */
 #ifndef NVDS_NAME_LEN
@@ -30,38 +32,147 @@
 #	define NVDS_VAL_LEN (4098)
 #endif
 
+/* bytes of string heap reserved per entry of capacity. The heap is never smaller
+ * than what a single entry of maximum length needs */
+#ifndef NVDS_HEAP_PER_ENTRY
+#	define NVDS_HEAP_PER_ENTRY (128)
+#endif
+
 /* memory layout of the data structure:
  *
- * first (sizeof int) bytes: the size of the array
+ * first (sizeof int) bytes: the number of entries in the array
  * next (sizeof int) bytes: the array's capacity
- * next (sizeof int) bytes: the semaphore id used to synchronize read operations
- * next (sizeof int) bytes: the semaphore id used to synchronize write operations
- * remaining bytes: the actual array of `struct nvds_entry` elements
+ * next (sizeof int) bytes: DS_MAGIC, telling initialized blocks apart
+ * next (sizeof int) bytes: the number of buckets in the hash index
+ * next (sizeof int) bytes: the size of the string heap
+ * next (sizeof int) bytes: how much of the string heap has been handed out
+ * next (sizeof int) bytes: how much of that belongs to strings no longer in use
+ * next (sizeof int) bytes: how many positions of the array have ever been taken
+ * next (sizeof int) bytes: the first free position of the array, or DS_NO_ENTRY
+ * next (sizeof int) bytes: the sequence counter of write operations (see below)
+ * next (sizeof int) bytes: the process id of the last writer
+ * next (sizeof int) bytes: padding, so that the lock below is properly aligned
+ * next (sizeof pthread_rwlock_t) bytes: the lock used to synchronize operations
+ * next (sizeof(struct nvds_stats)) bytes: operation and lock statistics, starting
+ *     on a cache line of their own (DS_STATS_OFFSET bytes into the block)
+ * next (buckets * sizeof int) bytes: the hash index. Each bucket holds the position
+ *     of an entry in the array, or DS_EMPTY_BUCKET
+ * next (cap * sizeof(struct nvds_entry)) bytes: the actual array of entries
+ * remaining bytes: the string heap, a sequence of `struct nvds_string` records
+ *
+ * Strings are allocated from the heap in order. When an entry is deleted or its
+ * value outgrows its record, the old record is just marked as unused; once the
+ * heap runs out of room, live records are moved down over the unused ones (see
+ * `dsCompact`.) Likewise, a deleted entry leaves a hole in the array, which is
+ * linked to a list of free positions to be reused by later insertions.
  *
  * This ensures that such blocks of memory can be used with shared memory segments.
  * Using `dsInit`, the first metadata bytes are set up so that they can
  * later be manipulated in subsequent calls (using the stored `base` address.)
  *
- * The semaphore IDs stored in the memory block is the identifiers of System V
- * semaphores, managed via the binary semaphore API provided by `sems.h`. The semaphores
- * ensures that reads may happen concurrently, but that no reads or writes can happen
- * while a write operation is halfway.
+ * The lock stored in the memory block is a POSIX reader-writer lock shared among
+ * processes. It ensures that reads may happen concurrently, but that no reads or
+ * writes can happen while a write operation is halfway. Taking or releasing it does
+ * not involve the kernel unless processes actually have to wait for each other.
+ *
+ * Reads do not even need the lock: the sequence counter is odd for as long as some
+ * process holds the lock for writing, and is incremented again when it is released.
+ * `dsGet` reads optimistically and only trusts what it read if the counter was even
+ * and did not change meanwhile; otherwise, it tries again.
+ *
+ * Every process using the block counts the operations it performs, and how long it
+ * waited for the lock, in the statistics area (see `dsStats`.) The counters are
+ * updated with atomic instructions and without the lock, so they can be read at
+ * any time, including while the block is in use.
  */
 
 #define DS_SIZE_OFFSET  (0)
 #define DS_CAP_OFFSET   (1)
-#define DS_RLOCK_OFFSET (2)
-#define DS_WLOCK_OFFSET (3)
+#define DS_MAGIC_OFFSET (2)
+#define DS_BUCKETS_OFFSET (3)
+#define DS_HEAP_SIZE_OFFSET (4)
+#define DS_HEAP_USED_OFFSET (5)
+#define DS_HEAP_GARBAGE_OFFSET (6)
+#define DS_USED_OFFSET (7)
+#define DS_FREE_OFFSET (8)
+#define DS_SEQ_OFFSET (9)
+#define DS_WRITER_OFFSET (10)
+
+/* in ints, from the beginning of the block */
+#define DS_LOCK_OFFSET (12)
+
+/* in bytes, from the beginning of the block. The counters are written to by every
+ * operation, so they are kept apart from the lock and the sequence counter */
+#define DS_STATS_OFFSET ((DS_LOCK_OFFSET * sizeof(int) + sizeof(pthread_rwlock_t) + 63) / 64 * 64)
+
+/* size of the metadata, up to the hash index */
+#define DS_HEADER_BYTES (DS_STATS_OFFSET + sizeof(struct nvds_stats))
+
+/* "nvd2": blocks laid out before the statistics area existed ("nvds") are not
+ * recognized, rather than having their index read from the wrong place */
+#define DS_MAGIC (0x6e766432)
+
+/* the hash index has at least twice as many buckets as the array capacity, so
+ * that probe sequences stay short even when the data structure is full */
+#define DS_EMPTY_BUCKET (-1)
+
+/* owner of a string record that no longer belongs to any entry */
+#define DS_DEAD_STRING (-1)
+
+/* `str` of an array position that holds no entry, and end of the free list */
+#define DS_FREE_ENTRY (-1)
+#define DS_NO_ENTRY (-1)
 
 /* flags to be used on `dsLock` and `dsUnlock` functions to indicate which operations
- * should be locked */
+ * the caller is about to perform. Any number of processes may hold the lock for
+ * DS_READ at the same time; DS_WRITE (and DS_READ_WRITE) grants exclusive access */
 #define DS_READ       (1 << 0)
 #define DS_WRITE      (1 << 1)
 #define DS_READ_WRITE (DS_READ | DS_WRITE)
 
+/* on free positions of the array, `str` is DS_FREE_ENTRY and `vallen` is the
+ * position of the next free one */
 struct nvds_entry {
-	char name[NVDS_NAME_LEN]; /* name */
-	char val[NVDS_VAL_LEN];   /* value */
+	int str;           /* offset of the entry's `struct nvds_string` in the heap */
+	int namelen;       /* length of the name */
+	int vallen;        /* length of the value */
+	unsigned int hash; /* hash of the name */
+};
+
+/* operations counted in the statistics of a block */
+enum nvds_stats_op {
+	DS_STATS_GET,
+	DS_STATS_SET,
+	DS_STATS_DELETE,
+	DS_STATS_COMPACT,
+	DS_STATS_GROW,
+	DS_STATS_OPS
+};
+
+/* the ways a block can be locked: for reading alone, or for writing */
+enum nvds_stats_lock {
+	DS_STATS_READ,
+	DS_STATS_WRITE,
+	DS_STATS_LOCKS
+};
+
+struct nvds_lock_stats {
+	unsigned long long taken;     /* times the lock was acquired */
+	unsigned long long waits;     /* times it was held by another process, and waited for */
+	unsigned long long waitNs;    /* time spent waiting, in nanoseconds */
+	unsigned long long maxWaitNs; /* longest single wait */
+};
+
+struct nvds_stats {
+	unsigned long long ops[DS_STATS_OPS];         /* calls, successful or not */
+	unsigned long long getRetries;                /* reads repeated because of a write */
+	struct nvds_lock_stats locks[DS_STATS_LOCKS];
+} __attribute__((aligned(64)));
+
+struct nvds_string {
+	int entry;   /* position of the owner in the array, or DS_DEAD_STRING */
+	int size;    /* bytes available in `data`, a multiple of sizeof(int) */
+	char data[]; /* the name followed by the value, both NUL terminated */
 };
 
 /* receives a block of memory at the given address and initializes internal
@@ -78,9 +189,44 @@ int dsInit(void *mem, int cap);
  * of the requested number of name/value pairs, plus any required metadata */
 int dsCapToBytes(int cap);
 
+/* the block, out of `nblocks`, a name belongs in, for callers spreading names
+ * across several blocks. The hash of the index is mixed first, so that names
+ * differing only in their last characters spread as evenly as any others */
+int dsShard(const char *name, int nblocks);
+
+/* returns the capacity of an initialized block of memory */
+int dsCapacity(void *mem);
+
+/* returns the number of bytes, from the beginning of the block, that hold data:
+ * everything up to the end of the part of the heap handed out. After `dsCompact`,
+ * these bytes are all a copy of the block needs (see `dsRestore`.) */
+int dsUsedBytes(void *mem);
+
+/* prepares a block of `dsCapToBytes(cap)` bytes for use, after the first
+ * `dsUsedBytes` bytes of another block of capacity `cap` were copied to it (for
+ * instance, from a snapshot saved to a file.) The other block must not have been
+ * written to while it was copied. The lock, the sequence counter and the
+ * statistics are set up again, as they only make sense for the processes that
+ * used the original block.
+ *
+ * Returns -1 on error. If the metadata copied is not valid, errno is set to EINVAL */
+int dsRestore(void *mem);
+
+/* lays out an initialized block of memory for a larger capacity `cap`, keeping
+ * every entry. The block must already span `dsCapToBytes(cap)` bytes, and the
+ * caller must hold the lock for writing.
+ *
+ * Header fields are only updated once the memory they describe exists, so a
+ * lock-free reader working on either layout never reaches past the end of the
+ * larger block.
+ *
+ * Returns -1 on error. If `cap` is smaller than the current capacity, errno is
+ * set to EINVAL. */
+int dsGrow(void *mem, int cap);
+
 /* Receives a previously created block of memory `mem` and validates whether its
- * metadata is valid (i.e., the internal data structures are consistent and the
- * lock identifiers still exist in the system.)
+ * metadata is valid (i.e., it was initialized by `dsInit` and the internal data
+ * structures are consistent.)
  *
  * Returns 0 on success or -1 on error. */
 int dsValidate(void *mem);
@@ -95,12 +241,17 @@ int dsSet(void *mem, char *name, char *val);
 /* gets the value associated wit the `name` given. Copies the result
  * on the `buf` given, up to `size` bytes.
  *
+ * This never takes the lock, and may be called whether or not the caller holds it.
+ * When it runs concurrently with a write, it waits for the write to finish and
+ * retries, so the value copied is always one that was current at some point.
+ *
  * Returns -1 on error. When the name is not found, errno is set to EINVAL. */
 int dsGet(void *mem, char *name, char *buf, int size);
 
 /* allows the caller to explicitly lock the given operations. Blocks until the
- * locks are acquired. The caller needs to make sure `dsUnlock` for the same
- * operations in order to avoid rendering the data structure unusable.
+ * lock is acquired. The caller needs to make sure `dsUnlock` for the same
+ * operations in order to avoid rendering the data structure unusable. The lock
+ * is not recursive: a process must not lock a block it already holds.
  *
  * Returns -1 on error. */
 int dsLock(void *mem, unsigned char operations);
@@ -111,11 +262,30 @@ int dsLock(void *mem, unsigned char operations);
  * Returns -1 on error */
 int dsUnlock(void *mem, unsigned char operations);
 
-/* deletes the entry associated with the given name.
+/* moves the strings in use to the beginning of the heap, making the room taken
+ * by deleted entries and outdated values available again, and fills the holes
+ * left in the array by deleted entries. The heap is compacted on its own when it
+ * is full, but everything can also be compacted explicitly.
+ *
+ * Returns the number of heap bytes reclaimed. */
+int dsCompact(void *mem);
+
+/* deletes the entry associated with the given name. This takes constant time:
+ * the entry's position and strings are only released, not reclaimed.
  *
  * Returns -1 on error. When the name is not found, errno is set to EINVAL */
 int dsDelete(void *mem, char *name);
 
+/* copies the statistics of the block to `stats`. Counters start at zero when the
+ * block is initialized or restored, and are never reset otherwise; callers watching
+ * them should compare successive copies. Each counter is read atomically, but the
+ * copy as a whole is not taken at a single point in time */
+void dsStats(void *mem, struct nvds_stats *stats);
+
+/* returns the process id of the last process to take the lock of the block for
+ * writing, or 0 if none did */
+pid_t dsLastWriter(void *mem);
+
 /* destroys the data structure and associated resources
  *
  * This method needs to be called *before* the `mem` block is released back to
@@ -26,6 +26,29 @@
 * 	Cleaning up a previously created shared memory segment
 * 		$ ./nv -d 12345
 *
+* 	Using a store that grows on demand, kept in a file or a POSIX shared
+* 	memory object and created on first use
+* 		$ ./nv -f store.nv example_script.txt
+* 		$ ./nv -s /nvstore example_script.txt
+* 		$ ./nv -d /nvstore
+*
+* 	Splitting the store into 8 shards, each with a lock of its own
+* 		$ ./nv -p -n 8
+* 		12345
+*
+* 	Saving a store to a snapshot file, and creating a new persistent segment
+* 	(or a store, with `-f` or `-s`) out of it later
+* 		$ ./nv -m 12345 -S store.snap
+* 		$ ./nv -R store.snap
+* 		67890
+*
+* 	Printing the operations performed on a store and the time spent waiting
+* 	for its lock, every second
+* 		$ ./nv -m 12345 -i 1
+*
+* 	Keeping compiled scripts in a directory, for scripts run over and over
+* 		$ ./nv -C ~/.cache/nv -m 12345 example_script.txt
+*
 * By default, `nv` creates a new, temporary shared memory segment to be used
 * as memory space for the execution of the given script, which is deleted at
 * the end of execution. However, the `-p` parameter instructs `nv` to create
@@ -35,10 +58,29 @@
 * parameters allow concurrent access of the same shared memory segment by
 * multiple `nv` processes.
 *
+* The capacity of a System V shared memory segment is fixed once it is created.
+* Stores given with `-f` or `-s` are not: when one fills up, the process writing
+* to it doubles its capacity while holding the lock. Every process maps the
+* largest store allowed (NV_MAX_STORE_BYTES) upfront, so the new room becomes
+* visible to processes already attached without them having to map it again.
+*
+* With `-n`, the store is made of several blocks ("shards"), each a segment (or
+* store) with its own lock, and names are spread across them by their hash. Writes
+* to names in different shards do not wait for each other. A sharded store is
+* found through a directory: a small segment (or file, or object) listing them.
+*
+* Every process using a store counts, in the store itself, the operations it
+* performs and how long it waits for the lock (see `dsStats`.) With `-i`, `nv`
+* prints these counters, so contention can be watched while other processes run.
+*
+* With `-C`, a script is compiled once, and the compiled program is kept in the
+* directory given (see `loadCompiled`.) Later runs of the same script map it and
+* execute it right away, until the script changes.
+*
 * Author: Renato Mascarenhas Costa
 */
 
-#define _XOPEN_SOURCE /* getopt(3) definition. Mandatory for requiring sys/ipc.h */
+#define _XOPEN_SOURCE 700 /* getopt(3) definition. Mandatory for requiring sys/ipc.h */
 
 #include "parser.h"
 #include "ds.h"
@@ -47,6 +89,7 @@
 #include <sys/stat.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -70,43 +113,115 @@
 #	define NV_GET_VAR ("_")
 #endif
 
+/* the largest store kept in a file or POSIX shared memory object may grow to.
+ * This much address space is reserved by every process using such a store */
+#ifndef NV_MAX_STORE_BYTES
+#	define NV_MAX_STORE_BYTES (1 << 30)
+#endif
+
+/* maximum number of shards a store can be split into (`-n` argument) */
+#ifndef NV_MAX_SHARDS
+#	define NV_MAX_SHARDS (64)
+#endif
+
+/* names are placed with dsShard: stores sharded by the plain hash of earlier
+ * versions ("nvsh") are not taken for these */
+#define NV_SHARDS_MAGIC (0x6e767332) /* "nvs2" */
+
 #define SHM_PERMS (S_IRUSR | S_IWUSR)
 
+/* contents of the directory of a sharded store. Shards kept in System V shared
+ * memory segments are listed by identifier; those kept in files (or POSIX shared
+ * memory objects) are named after the directory, followed by `.0`, `.1`, and so on */
+struct shardDirectory {
+	int magic;   /* NV_SHARDS_MAGIC */
+	int nshards; /* number of shards */
+	int ids[NV_MAX_SHARDS];
+};
+
 #define NOP               (0)
 #define ACTION_CREATE_SHM (1)
+#define ACTION_SNAPSHOT   (2)
+#define ACTION_RESTORE    (3)
+#define ACTION_STATS      (4)
 
 static void fatal(char *msg);
 static long stringToLong(char *str);
 static void helpAndExit(const char *progname, int status);
 static void pexit(const char *fCall);
+static void releaseStore(void);
 
 static int createSharedMem(int cap);
 static int initializeSharedMem(int cap);
+static int createStore(int cap);
 static void initializeVarTable(void);
-static void detachFromMem(void);
-static void attachToMem(int id);
+static void detachFromMem(void *mem);
+static void *attachToMem(int id);
+static void attachToStore(int id);
 static void deleteSharedMem(int id);
+static void deleteStore(int id);
+static void openStore(const char *name, bool posixShm, int cap);
+static void deletePosixStore(const char *name);
+static int storeSet(char *name, char *val);
+static void writeAll(int fd, const char *buf, size_t len);
+static void snapshotStore(const char *path);
+static void restoreStore(const char *path);
+static void showStats(int interval);
 static void execute(struct program *program);
 static void compilationError(struct compilationError *error);
 static void cleanupTempMem(void);
 
 int shmid = -1;   /* shared memory identifier used in this execution */
 
+/* file or POSIX shared memory object backing the store, when one is used
+ * (`-f` and `-s` arguments) instead of a System V shared memory segment */
+char *storeName = NULL;
+bool posixStore = false;
+
+/* name/value pairs, split across `nshards` blocks. Each is a System V shared
+ * memory segment (`shardIds`), or a file or POSIX shared memory object kept
+ * open to make it larger when it grows (`shardFds`) */
+int nshards = 1;
+void *shards[NV_MAX_SHARDS];
+int shardIds[NV_MAX_SHARDS];
+int shardFds[NV_MAX_SHARDS];
+
 void *vt = NULL; /* variables table */
-void *nv = NULL; /* name/value pairs - always uses a System V shared memory segment */
 bool persistent = false; /* whether we are using a pre-created memory segment (`-m` argument) */
+bool transactional = false; /* whether the whole script runs as a transaction (`-t` argument) */
+char *cacheDir = NULL; /* where compiled scripts are kept (`-C` argument), if anywhere */
+
+/* lock of the shared memory segment held by this process for a single command, if
+ * any: the operations it was taken for, and the shard it belongs to. Transactions
+ * hold the locks of every shard, `heldShards` being how many were taken so far */
+unsigned char heldLock = 0;
+int heldShard = 0;
+int heldShards = 0;
+bool inTransaction = false;
+
+/* changes made by the transaction in progress, undone in reverse order if it
+ * fails. A NULL `val` means that the name did not exist before */
+struct undoRecord {
+	char *name;
+	char *val;
+};
+
+struct undoRecord *undoLog = NULL;
+int undoLen = 0, undoCap = 0;
 
 int
 main(int argc, char *argv[]) {
-	int opt, fd, i, cap, action;
+	int opt, fd, i, cap, slack, action;
+	char *snapshot;
 	struct program program;
 	struct compilationError cerror;
 
 	cap = -1; /* capacity */
 	action = NOP;
+	snapshot = NULL;
 
 	opterr = 0;
-	while ((opt = getopt(argc, argv, "+pm:c:dh")) != -1) {
+	while ((opt = getopt(argc, argv, "+pm:f:s:c:n:S:R:C:itdh")) != -1) {
 		switch (opt) {
 			case 'p':
 				/* wrong options usage */
@@ -116,19 +231,69 @@ main(int argc, char *argv[]) {
 				action = ACTION_CREATE_SHM;
 				break;
 
+			case 'S':
+			case 'R':
+				if (action != NOP)
+					helpAndExit(argv[0], EXIT_FAILURE);
+
+				action = (opt == 'S') ? ACTION_SNAPSHOT : ACTION_RESTORE;
+				snapshot = optarg;
+				break;
+
+			case 'i':
+				if (action != NOP)
+					helpAndExit(argv[0], EXIT_FAILURE);
+
+				action = ACTION_STATS;
+				break;
+
 			case 'm':
+				if (storeName != NULL)
+					helpAndExit(argv[0], EXIT_FAILURE);
+
 				shmid = (int) stringToLong(optarg);
 				persistent = true;
 				break;
 
+			case 'f':
+			case 's':
+				if (shmid != -1 || storeName != NULL)
+					helpAndExit(argv[0], EXIT_FAILURE);
+
+				storeName = optarg;
+				posixStore = (opt == 's');
+				persistent = true;
+				break;
+
 			case 'c':
 				cap = (int) stringToLong(optarg);
 				break;
 
+			case 'n':
+				nshards = (int) stringToLong(optarg);
+				if (nshards < 1 || nshards > NV_MAX_SHARDS)
+					helpAndExit(argv[0], EXIT_FAILURE);
+				break;
+
+			case 't':
+				transactional = true;
+				break;
+
+			case 'C':
+				cacheDir = optarg;
+				break;
+
 			case 'd':
 				for (i = optind; i < argc; i++) {
+					/* names of POSIX shared memory objects start with a slash */
+					if (argv[i][0] == '/') {
+						deletePosixStore(argv[i]);
+						printf("%s: deleted\n", argv[i]);
+						continue;
+					}
+
 					shmid = (int) stringToLong(argv[i]);
-					deleteSharedMem(shmid);
+					deleteStore(shmid);
 					printf("%d: deleted\n", shmid);
 				}
 
@@ -146,18 +311,47 @@ main(int argc, char *argv[]) {
 	if (cap == -1)
 		cap = MAX_NV_PAIRS;
 
+	/* the capacity is that of the whole store, shared among shards. Names do not
+	 * spread exactly evenly: the names in a shard vary by about the square root of
+	 * its share, and each shard gets room for four times that on top of it */
+	cap = (cap + nshards - 1) / nshards;
+	if (nshards > 1) {
+		for (slack = 1; slack * slack < cap; slack++)
+			;
+		cap += 4 * slack;
+	}
+
 	/* if we are to just create a shared memory segment for later execution,
 	 * create it with the capacity requested (or the default), and terminate */
 	if (action == ACTION_CREATE_SHM) {
-		shmid = initializeSharedMem(cap);
+		shmid = createStore(cap);
 		printf("%d\n", shmid);
 
 		exit(EXIT_SUCCESS);
 	}
 
+	/* restoring creates a new segment (or store) out of a snapshot, with the
+	 * capacity the snapshot was taken with */
+	if (action == ACTION_RESTORE) {
+		restoreStore(snapshot);
+		exit(EXIT_SUCCESS);
+	}
+
+	/* snapshots and statistics are taken of an existing segment or store */
+	if ((action == ACTION_SNAPSHOT || action == ACTION_STATS) && !persistent)
+		helpAndExit(argv[0], EXIT_FAILURE);
+
 	/* if arrived at this point, script execution is to occur */
-	if (!persistent) {
-		shmid = initializeSharedMem(cap);
+	if (storeName != NULL) {
+		openStore(storeName, posixStore, cap);
+	} else if (persistent) {
+		attachToStore(shmid);
+	} else {
+		/* no directory is needed for segments that only this process uses */
+		for (i = 0; i < nshards; i++) {
+			shardIds[i] = initializeSharedMem(cap);
+			shards[i] = attachToMem(shardIds[i]);
+		}
 
 		/* registers an `atexit(3)` handler to make sure the shared memory segment
 		 * created on this execution (if the `-m` parameter was not passed) is
@@ -165,10 +359,15 @@ main(int argc, char *argv[]) {
 		atexit(cleanupTempMem);
 	}
 
-	attachToMem(shmid);
-	if (persistent) {
-		if (dsValidate(nv) == -1)
-			pexit("dsValidate");
+	if (action == ACTION_SNAPSHOT) {
+		snapshotStore(snapshot);
+		exit(EXIT_SUCCESS);
+	}
+
+	/* the argument, if any, is the interval between reports */
+	if (action == ACTION_STATS) {
+		showStats((optind < argc) ? (int) stringToLong(argv[optind]) : 0);
+		exit(EXIT_SUCCESS);
 	}
 
 	initializeVarTable();
@@ -181,17 +380,24 @@ main(int argc, char *argv[]) {
 			pexit("open");
 	}
 
-	if (initScript(fd, &program) == -1)
-		pexit("initScript");
+	/* a script compiled before, and unchanged since, is neither read nor
+	 * compiled again */
+	if (cacheDir == NULL || loadCompiled(fd, cacheDir, &program) == -1) {
+		if (initScript(fd, &program) == -1)
+			pexit("initScript");
+
+		if (compileScript(&program, &cerror) == -1)
+			compilationError(&cerror);
 
+		/* not being able to cache the program does not keep it from running */
+		if (cacheDir != NULL && saveCompiled(fd, cacheDir, &program) == -1)
+			fprintf(stderr, "Warning: could not cache the compiled script: %s\n", strerror(errno));
+	}
 
 	/* original file descriptor no longer needed after program initialization */
 	if (close(fd) == -1)
 		pexit("close");
 
-	if (compileScript(&program, &cerror) == -1)
-		compilationError(&cerror);
-
 	execute(&program);
 	destroyScript(&program);
 
@@ -227,39 +433,188 @@ resolve(char *name, char *buf, int bufsize) {
 	}
 }
 
+/* the shard holding the given name */
+static int
+shardOf(const char *name) {
+	return dsShard(name, nshards);
+}
+
+/* locks a shard of the shared memory segment for a single command. Within a
+ * transaction, the lock is already held for writing until the transaction ends */
+static void
+lockStore(int shard, unsigned char operations) {
+	if (inTransaction)
+		return;
+
+	if (dsLock(shards[shard], operations) == -1)
+		pexit("dsLock");
+
+	heldLock = operations;
+	heldShard = shard;
+}
+
+static void
+unlockStore(void) {
+	unsigned char operations = heldLock;
+
+	if (inTransaction)
+		return;
+
+	heldLock = 0;
+	if (dsUnlock(shards[heldShard], operations) == -1)
+		pexit("dsUnlock");
+}
+
+static char *
+copyString(const char *str) {
+	size_t len = strlen(str) + 1;
+	char *copy;
+
+	copy = malloc(len);
+	if (copy == NULL)
+		pexit("malloc");
+
+	return memcpy(copy, str, len);
+}
+
+/* records the current value of `name`, if a transaction is in progress, so that
+ * the change about to be made to it can be undone */
+static void
+logUndo(char *name) {
+	char buf[NVDS_VAL_LEN + 1];
+	struct undoRecord *record;
+	void *p;
+
+	if (!inTransaction)
+		return;
+
+	if (undoLen == undoCap) {
+		undoCap = (undoCap == 0) ? 64 : 2 * undoCap;
+		p = realloc(undoLog, undoCap * sizeof(struct undoRecord));
+		if (p == NULL)
+			pexit("realloc");
+
+		undoLog = p;
+	}
+
+	record = &undoLog[undoLen];
+	record->val = NULL;
+
+	if (dsGet(shards[shardOf(name)], name, buf, NVDS_VAL_LEN + 1) == 0)
+		record->val = copyString(buf);
+	else if (errno != EINVAL)
+		pexit("dsGet");
+
+	record->name = copyString(name);
+	undoLen++;
+}
+
+static void
+discardUndoLog(void) {
+	int i;
+
+	for (i = 0; i < undoLen; i++) {
+		free(undoLog[i].name);
+		free(undoLog[i].val);
+	}
+
+	undoLen = 0;
+}
+
+/* starts a transaction: the lock is taken for writing once and kept until the
+ * transaction ends. Lock-free readers wait for it to end as well, so they either
+ * see all of its changes or none of them. The names a transaction touches are not
+ * known in advance, so the lock of every shard is taken, always in the same order */
+static void
+begin(void) {
+	int i;
+
+	for (i = 0; i < nshards; i++) {
+		if (dsLock(shards[i], DS_WRITE) == -1)
+			pexit("dsLock");
+
+		heldShards = i + 1;
+	}
+
+	inTransaction = true;
+}
+
+static void
+unlockShards(void) {
+	while (heldShards > 0) {
+		heldShards--;
+		if (dsUnlock(shards[heldShards], DS_WRITE) == -1)
+			pexit("dsUnlock");
+	}
+}
+
+static void
+end(void) {
+	inTransaction = false;
+	discardUndoLog();
+	unlockShards();
+}
+
+/* called before terminating because of an error: undoes the changes of the
+ * transaction in progress, if any, and releases the lock on the shared memory
+ * segment. The lock is not released by the system when a process ends, so
+ * leaving it behind would block every other process using the segment */
+static void
+releaseStore(void) {
+	unsigned char operations;
+	int i;
+
+	if (inTransaction) {
+		/* errors while rolling back must not start over */
+		inTransaction = false;
+
+		for (i = undoLen - 1; i >= 0; i--) {
+			if (undoLog[i].val == NULL)
+				dsDelete(shards[shardOf(undoLog[i].name)], undoLog[i].name);
+			else if (storeSet(undoLog[i].name, undoLog[i].val) == -1)
+				fprintf(stderr, "Could not restore %s\n", undoLog[i].name);
+		}
+	}
+
+	if (heldLock != 0) {
+		operations = heldLock;
+		heldLock = 0;
+		dsUnlock(shards[heldShard], operations);
+	}
+
+	while (heldShards > 0) {
+		heldShards--;
+		dsUnlock(shards[heldShards], DS_WRITE);
+	}
+}
+
 static void
 set(char *name, char *value) {
 	/* write operation: lock reads and writes to the data structure */
-	if (dsLock(nv, DS_READ_WRITE) == -1)
-		pexit("dsLock");
+	lockStore(shardOf(name), DS_READ_WRITE);
 
-	if (dsSet(nv, name, value) == -1)
+	logUndo(name);
+	if (storeSet(name, value) == -1)
 		pexit("dsSet");
 
-	if (dsUnlock(nv, DS_READ_WRITE) == -1)
-		pexit("dsUnlock");
+	unlockStore();
 }
 
 static void
 setifnone(char *name, char *value) {
 	char currValue[NVDS_VAL_LEN];
+	int shard = shardOf(name);
 
-	/* make sure no write operations happen while we check if the name given
-	 * has any value associated to it */
-	if (dsLock(nv, DS_WRITE) == -1)
-		pexit("dsLock");
+	/* the check and the insertion must happen atomically: lock for writing
+	 * upfront, since the lock cannot be upgraded later */
+	lockStore(shard, DS_WRITE);
 
-	if (dsGet(nv, name, currValue, NVDS_VAL_LEN) == -1) {
+	if (dsGet(shards[shard], name, currValue, NVDS_VAL_LEN) == -1) {
 		if (errno == EINVAL) {
 			/* requested `name` does not exist - insert with the given `value` */
-			if (dsLock(nv, DS_READ) == -1) /* do not allow read operations while updating */
-				pexit("dsLock");
-
-			if (dsSet(nv, name, value) == -1)
+			logUndo(name);
+			if (storeSet(name, value) == -1)
 				pexit("dsSet");
-
-			if (dsUnlock(nv, DS_READ) == -1)
-				pexit("dsUnlock");
 		} else {
 			/* some other error happened - report */
 			pexit("dsGet");
@@ -267,8 +622,7 @@ setifnone(char *name, char *value) {
 	}
 
 	/* name does not exist, or was already updated - release write lock */
-	if (dsUnlock(nv, DS_WRITE) == -1)
-		pexit("dsUnlock");
+	unlockStore();
 }
 
 static void
@@ -282,11 +636,8 @@ static void
 get(char *name) {
 	char buf[NVDS_VAL_LEN];
 
-	/* lock write operations while checking if the name exists */
-	if (dsLock(nv, DS_WRITE) == -1)
-		pexit("dsLock");
-
-	if (dsGet(nv, name, buf, NVDS_VAL_LEN) == -1) {
+	/* no lock needed: `dsGet` detects concurrent writes on its own and retries */
+	if (dsGet(shards[shardOf(name)], name, buf, NVDS_VAL_LEN) == -1) {
 		if (errno == EINVAL) {
 			/* name requested not found - assign an emptry string to the "$_" variable */
 			assign(NV_GET_VAR, "");
@@ -298,23 +649,34 @@ get(char *name) {
 		/* value of name requested on 'buf' - copy it to "$_" */
 		assign(NV_GET_VAR, buf);
 	}
-
-	/* write operations may resume */
-	if (dsUnlock(nv, DS_WRITE) == -1)
-		pexit("dsUnlock");
 }
 
 static void
 delete(char *name) {
+	int shard = shardOf(name);
+
 	/* no writes or reads while deleting data */
-	if (dsLock(nv, DS_READ_WRITE) == -1)
-		pexit("dsLock");
+	lockStore(shard, DS_READ_WRITE);
 
-	if (dsDelete(nv, name) == -1)
+	/* deleting a name that does not exist has no effect */
+	logUndo(name);
+	if (dsDelete(shards[shard], name) == -1 && errno != EINVAL)
 		pexit("dsDelete");
 
-	if (dsUnlock(nv, DS_READ_WRITE) == -1)
-		pexit("dsDelete");
+	unlockStore();
+}
+
+static void
+compact(void) {
+	int i;
+
+	/* entries and strings are moved around: no reads or writes meanwhile. One
+	 * shard is compacted at a time, so the others remain available */
+	for (i = 0; i < nshards; i++) {
+		lockStore(i, DS_READ_WRITE);
+		dsCompact(shards[i]);
+		unlockStore();
+	}
 }
 
 static void
@@ -342,9 +704,14 @@ print(char *messages[], int size) {
 static void
 execute(struct program *program) {
 	int i, j, len;
-	char buf[MAX_ARG_LEN], str[NVDS_VAL_LEN], arg[NVDS_VAL_LEN], *format, *p;
+	char expanded[MAX_ARGS][MAX_ARG_LEN], str[NVDS_VAL_LEN], arg[NVDS_VAL_LEN], *format, *p;
+
+	printf("Shared memory segment: %p\n\n", shards[0]);
 
-	printf("Shared memory segment: %p\n\n", nv);
+	/* with `-t`, the whole script is one transaction; blocks within it have no
+	 * further effect */
+	if (transactional)
+		begin();
 
 	for (i = 0; i < program->nops; i++) {
 		struct command cmd;
@@ -353,11 +720,13 @@ execute(struct program *program) {
 		/* resolve all arguments to expand variables, if any */
 		for (j = 0; j < cmd.nargs; j++) {
 			if (cmd.args[j][0] == '$') {
-				/* if argument is $name, get entry "name" on the var table */
-				resolve(&cmd.args[j][1], buf, MAX_ARG_LEN);
+				/* if argument is $name, get entry "name" on the var table. The
+				 * arguments point into the script itself, so the result replaces
+				 * the argument in this copy of the command only */
+				resolve(&cmd.args[j][1], expanded[j], MAX_ARG_LEN);
+				expanded[j][MAX_ARG_LEN - 1] = '\0';
 
-				/* copy the result back to the argument list */
-				strncpy(cmd.args[j], buf, MAX_ARG_LEN);
+				cmd.args[j] = expanded[j];
 			}
 		}
 
@@ -401,34 +770,602 @@ execute(struct program *program) {
 			case CMD_PRINT:
 				print(cmd.args, cmd.nargs);
 				break;
+			case CMD_COMPACT:
+				compact();
+				break;
+			case CMD_BEGIN:
+				if (!transactional)
+					begin();
+				break;
+			case CMD_END:
+				if (!transactional)
+					end();
+				break;
 		}
 	}
+
+	if (transactional)
+		end();
 }
 
-static void
+static void *
 attachToMem(int id) {
-	nv = shmat(id, NULL, 0);
+	void *mem;
 
-	if (nv == (void *) -1)
+	mem = shmat(id, NULL, 0);
+	if (mem == (void *) -1)
 		pexit("shmat");
+
+	return mem;
 }
 
 static void
-detachFromMem() {
+detachFromMem(void *mem) {
 	/* detach from the shared memory segment, if previously attached */
-	if (nv != NULL) {
-		if (shmdt(nv) == -1)
+	if (mem != NULL) {
+		if (shmdt(mem) == -1)
 			pexit("shmdt");
 	}
 }
 
+/* reads the directory of a sharded store from the segment with the given
+ * identifier. Returns false if it is not a directory, but a segment holding
+ * the whole store */
+static bool
+readDirectory(int id, struct shardDirectory *dir) {
+	struct shmid_ds info;
+	void *mem;
+
+	if (shmctl(id, IPC_STAT, &info) == -1)
+		pexit("shmctl");
+
+	/* no segment holding a store is this small */
+	if (info.shm_segsz != sizeof(*dir))
+		return false;
+
+	mem = attachToMem(id);
+	memcpy(dir, mem, sizeof(*dir));
+	detachFromMem(mem);
+
+	if (dir->magic != NV_SHARDS_MAGIC || dir->nshards < 1 || dir->nshards > NV_MAX_SHARDS) {
+		errno = EINVAL;
+		pexit("readDirectory");
+	}
+
+	return true;
+}
+
+/* attaches to the store with the given identifier: a single segment, or every
+ * shard listed in a directory */
+static void
+attachToStore(int id) {
+	struct shardDirectory dir;
+	int i;
+
+	if (readDirectory(id, &dir)) {
+		nshards = dir.nshards;
+		memcpy(shardIds, dir.ids, nshards * sizeof(int));
+	} else {
+		nshards = 1;
+		shardIds[0] = id;
+	}
+
+	for (i = 0; i < nshards; i++) {
+		shards[i] = attachToMem(shardIds[i]);
+		if (dsValidate(shards[i]) == -1)
+			pexit("dsValidate");
+	}
+}
+
+/* creates a persistent store made of `nshards` segments of capacity `cap`.
+ * Returns the identifier to use it by: that of the segment, or of a directory
+ * listing every shard */
+static int
+createStore(int cap) {
+	struct shardDirectory *dir;
+	int i, id;
+
+	for (i = 0; i < nshards; i++)
+		shardIds[i] = initializeSharedMem(cap);
+
+	if (nshards == 1)
+		return shardIds[0];
+
+	id = shmget(IPC_PRIVATE, sizeof(*dir), IPC_CREAT | IPC_EXCL | SHM_PERMS);
+	if (id == -1)
+		pexit("shmget");
+
+	dir = attachToMem(id);
+	dir->magic = NV_SHARDS_MAGIC;
+	dir->nshards = nshards;
+	memcpy(dir->ids, shardIds, nshards * sizeof(int));
+	detachFromMem(dir);
+
+	return id;
+}
+
+/* deletes the store with the given identifier, along with its shards */
+static void
+deleteStore(int id) {
+	struct shardDirectory dir;
+	int i;
+
+	if (readDirectory(id, &dir)) {
+		for (i = 0; i < dir.nshards; i++)
+			deleteSharedMem(dir.ids[i]);
+	}
+
+	deleteSharedMem(id);
+}
+
+/* takes or releases an advisory lock on the whole store file, so that only one
+ * process initializes a store that was just created */
+static void
+lockStoreFile(int fd, short type) {
+	struct flock fl;
+
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = 0;
+	fl.l_len = 0;
+
+	while (fcntl(fd, F_SETLKW, &fl) == -1) {
+		if (errno != EINTR)
+			pexit("fcntl");
+	}
+}
+
+static int
+openStoreFile(const char *name, bool posixShm, int flags) {
+	int fd;
+
+	if (posixShm)
+		fd = shm_open(name, O_RDWR | flags, SHM_PERMS);
+	else
+		fd = open(name, O_RDWR | flags, SHM_PERMS);
+
+	if (fd == -1)
+		pexit(posixShm ? "shm_open" : "open");
+
+	return fd;
+}
+
+/* the name of a shard of the store with the given name */
+static void
+shardName(char *buf, const char *name, int shard) {
+	if (snprintf(buf, PATH_MAX, "%s.%d", name, shard) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		pexit("shardName");
+	}
+}
+
+/* reads the directory of a sharded store from the given file. Returns false if
+ * the file holds a store itself */
+static bool
+readDirectoryFile(int fd, struct shardDirectory *dir) {
+	struct stat st;
+
+	if (fstat(fd, &st) == -1)
+		pexit("fstat");
+
+	/* no file holding a store is this small */
+	if (st.st_size != sizeof(*dir))
+		return false;
+
+	if (pread(fd, dir, sizeof(*dir), 0) != sizeof(*dir) || dir->magic != NV_SHARDS_MAGIC ||
+			dir->nshards < 1 || dir->nshards > NV_MAX_SHARDS) {
+		errno = EINVAL;
+		pexit("readDirectory");
+	}
+
+	return true;
+}
+
+/* maps the store kept in the given file, initializing it with capacity `cap` if
+ * it is empty. The caller holds the lock on the file */
+static void *
+mapStore(int fd, int cap) {
+	struct stat st;
+	void *mem;
+
+	if (fstat(fd, &st) == -1)
+		pexit("fstat");
+
+	if (st.st_size == 0) {
+		if (dsCapToBytes(cap) > NV_MAX_STORE_BYTES) {
+			errno = EFBIG;
+			pexit("openStore");
+		}
+
+		if (ftruncate(fd, dsCapToBytes(cap)) == -1)
+			pexit("ftruncate");
+	} else if (st.st_size < dsCapToBytes(1) || st.st_size > NV_MAX_STORE_BYTES) {
+		/* too small to hold the metadata, or too large to be mapped whole */
+		errno = EINVAL;
+		pexit("openStore");
+	}
+
+	/* pages past the end of the file cannot be touched, but they are there to
+	 * be used once the store grows */
+	mem = mmap(NULL, NV_MAX_STORE_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mem == MAP_FAILED)
+		pexit("mmap");
+
+	if (st.st_size == 0) {
+		if (dsInit(mem, cap) == -1)
+			pexit("dsInit");
+	} else if (dsValidate(mem) == -1 || st.st_size < dsCapToBytes(dsCapacity(mem))) {
+		errno = EINVAL;
+		pexit("dsValidate");
+	}
+
+	return mem;
+}
+
+/* opens the store with the given name, creating it with capacity `cap` (per
+ * shard) if it does not exist (or is empty), and maps it. File descriptors are
+ * kept open in `shardFds`, to make the files larger when shards grow */
+static void
+openStore(const char *name, bool posixShm, int cap) {
+	struct shardDirectory dir;
+	char shard[PATH_MAX];
+	struct stat st;
+	int i, fd, flags;
+
+	fd = openStoreFile(name, posixShm, O_CREAT);
+	lockStoreFile(fd, F_WRLCK);
+
+	if (fstat(fd, &st) == -1)
+		pexit("fstat");
+
+	/* a new store with several shards starts with its directory. Its shards are
+	 * created while the directory is locked, so no one finds them uninitialized */
+	flags = O_CREAT;
+	if (st.st_size == 0 && nshards > 1) {
+		memset(&dir, 0, sizeof(dir));
+		dir.magic = NV_SHARDS_MAGIC;
+		dir.nshards = nshards;
+
+		writeAll(fd, (char *) &dir, sizeof(dir));
+		flags |= O_TRUNC;
+	}
+
+	if (!readDirectoryFile(fd, &dir)) {
+		nshards = 1;
+		shards[0] = mapStore(fd, cap);
+		shardFds[0] = fd;
+
+		lockStoreFile(fd, F_UNLCK);
+		return;
+	}
+
+	nshards = dir.nshards;
+	for (i = 0; i < nshards; i++) {
+		shardName(shard, name, i);
+
+		shardFds[i] = openStoreFile(shard, posixShm, flags);
+		lockStoreFile(shardFds[i], F_WRLCK);
+		shards[i] = mapStore(shardFds[i], cap);
+		lockStoreFile(shardFds[i], F_UNLCK);
+	}
+
+	lockStoreFile(fd, F_UNLCK);
+	if (close(fd) == -1)
+		pexit("close");
+}
+
+/* removes a POSIX shared memory object holding a store, along with its shards
+ * if it is the directory of a sharded one */
+static void
+deletePosixStore(const char *name) {
+	struct shardDirectory dir;
+	char shard[PATH_MAX];
+	int i, fd;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd == -1)
+		pexit("shm_open");
+
+	if (readDirectoryFile(fd, &dir)) {
+		for (i = 0; i < dir.nshards; i++) {
+			shardName(shard, name, i);
+			if (shm_unlink(shard) == -1 && errno != ENOENT)
+				pexit("shm_unlink");
+		}
+	}
+
+	close(fd);
+	if (shm_unlink(name) == -1)
+		pexit("shm_unlink");
+}
+
+/* doubles the capacity of a shard kept in a file or POSIX shared memory object.
+ * Its lock is held for writing, so no other process can be growing it as well.
+ *
+ * Returns -1 on error. System V shared memory segments cannot grow, and fail
+ * with ENOMEM */
+static int
+growStore(int shard) {
+	int cap;
+
+	cap = dsCapacity(shards[shard]);
+
+	/* the number of bytes needed at most doubles as well */
+	if (storeName == NULL || dsCapToBytes(cap) > NV_MAX_STORE_BYTES / 2) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (ftruncate(shardFds[shard], dsCapToBytes(2 * cap)) == -1)
+		return -1;
+
+	return dsGrow(shards[shard], 2 * cap);
+}
+
+/* writes all of `buf` to the given file descriptor */
+static void
+writeAll(int fd, const char *buf, size_t len) {
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+
+			pexit("write");
+		}
+
+		buf += n;
+		len -= n;
+	}
+}
+
+/* saves the segment (or store) in use to a file. Only the lock for reading is
+ * needed, and only while the data is copied: the copy is then compacted, so that
+ * the snapshot holds nothing but the entries and their strings. The file is
+ * written under a temporary name and renamed, so that a snapshot that already
+ * exists is replaced only by a complete one */
+static void
+snapshotStore(const char *path) {
+	char tmp[PATH_MAX];
+	void *copy;
+	int fd, len;
+
+	if (snprintf(tmp, PATH_MAX, "%s.tmp", path) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		pexit("snapshot");
+	}
+
+	if (nshards > 1)
+		fatal("Snapshots of sharded stores are not supported");
+
+	lockStore(0, DS_READ);
+
+	len = dsUsedBytes(shards[0]);
+	copy = malloc(len);
+	if (copy == NULL)
+		pexit("malloc");
+
+	memcpy(copy, shards[0], len);
+	unlockStore();
+
+	dsCompact(copy);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, SHM_PERMS);
+	if (fd == -1)
+		pexit("open");
+
+	writeAll(fd, copy, dsUsedBytes(copy));
+	if (fsync(fd) == -1)
+		pexit("fsync");
+
+	if (close(fd) == -1)
+		pexit("close");
+
+	if (rename(tmp, path) == -1)
+		pexit("rename");
+
+	free(copy);
+}
+
+/* prints a row of statistics: operations, and acquisitions of and waits for the
+ * lock, for reading and for writing combined, counted since the previous report.
+ * The longest wait is the longest ever, and the last writer is that of the shard,
+ * or blank for all shards together */
+static void
+printStats(const char *label, struct nvds_stats *curr, struct nvds_stats *prev, pid_t writer) {
+	unsigned long long taken, waits, waitNs, maxWaitNs;
+	int i;
+
+	printf("%6s", label);
+	for (i = 0; i < DS_STATS_OPS; i++)
+		printf(" %10llu", curr->ops[i] - prev->ops[i]);
+
+	taken = waits = waitNs = maxWaitNs = 0;
+	for (i = 0; i < DS_STATS_LOCKS; i++) {
+		taken += curr->locks[i].taken - prev->locks[i].taken;
+		waits += curr->locks[i].waits - prev->locks[i].waits;
+		waitNs += curr->locks[i].waitNs - prev->locks[i].waitNs;
+		if (curr->locks[i].maxWaitNs > maxWaitNs)
+			maxWaitNs = curr->locks[i].maxWaitNs;
+	}
+
+	printf(" %8llu %10llu %8llu %12.3f %12.1f %12.1f", curr->getRetries - prev->getRetries,
+			taken, waits, waitNs / 1e6, (waits > 0) ? waitNs / 1e3 / waits : 0.0, maxWaitNs / 1e3);
+
+	if (writer > 0)
+		printf(" %8ld", (long) writer);
+
+	printf("\n");
+}
+
+static void
+addStats(struct nvds_stats *total, struct nvds_stats *stats) {
+	int i;
+
+	for (i = 0; i < DS_STATS_OPS; i++)
+		total->ops[i] += stats->ops[i];
+
+	total->getRetries += stats->getRetries;
+
+	for (i = 0; i < DS_STATS_LOCKS; i++) {
+		total->locks[i].taken += stats->locks[i].taken;
+		total->locks[i].waits += stats->locks[i].waits;
+		total->locks[i].waitNs += stats->locks[i].waitNs;
+		if (stats->locks[i].maxWaitNs > total->locks[i].maxWaitNs)
+			total->locks[i].maxWaitNs = stats->locks[i].maxWaitNs;
+	}
+}
+
+/* prints the statistics of every shard, and of the store as a whole when it is
+ * sharded. The first report counts everything since the store was created (or
+ * restored); with an `interval`, a report follows every `interval` seconds with
+ * what was counted meanwhile, until `nv` is interrupted */
+static void
+showStats(int interval) {
+	static struct nvds_stats prev[NV_MAX_SHARDS + 1], curr[NV_MAX_SHARDS + 1];
+	char label[16];
+	int i;
+
+	for (;;) {
+		printf("%6s %10s %10s %10s %10s %10s %8s %10s %8s %12s %12s %12s %8s\n", "shard",
+				"gets", "sets", "deletes", "compacts", "grows", "retries", "locks", "waits",
+				"wait (ms)", "avg (us)", "max (us)", "writer");
+
+		memset(&curr[nshards], 0, sizeof(struct nvds_stats));
+		for (i = 0; i < nshards; i++) {
+			dsStats(shards[i], &curr[i]);
+			addStats(&curr[nshards], &curr[i]);
+
+			snprintf(label, sizeof(label), "%d", i);
+			printStats(label, &curr[i], &prev[i], dsLastWriter(shards[i]));
+		}
+
+		if (nshards > 1)
+			printStats("all", &curr[nshards], &prev[nshards], 0);
+
+		if (interval == 0)
+			break;
+
+		if (fflush(stdout) == EOF)
+			pexit("fflush");
+
+		memcpy(prev, curr, sizeof(curr));
+		sleep(interval);
+		printf("\n");
+	}
+}
+
+/* creates a new persistent segment out of a snapshot, printing its identifier,
+ * or the store given with `-f` or `-s`, which must not exist yet. The snapshot
+ * is mapped and copied in a single pass, with no entry inserted again */
+static void
+restoreStore(const char *path) {
+	struct stat st;
+	void *snap, *mem;
+	int fd, cap, used;
+
+	if (nshards > 1)
+		fatal("Snapshots of sharded stores are not supported");
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		pexit("open");
+
+	if (fstat(fd, &st) == -1)
+		pexit("fstat");
+
+	if (st.st_size < (off_t) DS_HEADER_BYTES) {
+		errno = EINVAL;
+		pexit("restore");
+	}
+
+	snap = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (snap == MAP_FAILED)
+		pexit("mmap");
+
+	if (close(fd) == -1)
+		pexit("close");
+
+	/* the snapshot must describe a valid block, and hold all of its data */
+	if (dsValidate(snap) == -1 || dsUsedBytes(snap) > st.st_size) {
+		errno = EINVAL;
+		pexit("restore");
+	}
+
+	cap = dsCapacity(snap);
+	used = dsUsedBytes(snap);
+
+	if (storeName != NULL) {
+		if (dsCapToBytes(cap) > NV_MAX_STORE_BYTES) {
+			errno = EFBIG;
+			pexit("restore");
+		}
+
+		if (posixStore)
+			fd = shm_open(storeName, O_RDWR | O_CREAT | O_EXCL, SHM_PERMS);
+		else
+			fd = open(storeName, O_RDWR | O_CREAT | O_EXCL, SHM_PERMS);
+
+		if (fd == -1)
+			pexit(posixStore ? "shm_open" : "open");
+
+		if (ftruncate(fd, dsCapToBytes(cap)) == -1)
+			pexit("ftruncate");
+
+		mem = mmap(NULL, dsCapToBytes(cap), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (mem == MAP_FAILED)
+			pexit("mmap");
+
+		memcpy(mem, snap, used);
+		if (dsRestore(mem) == -1)
+			pexit("dsRestore");
+
+		if (munmap(mem, dsCapToBytes(cap)) == -1 || close(fd) == -1)
+			pexit("restore");
+	} else {
+		shmid = createSharedMem(cap);
+		mem = attachToMem(shmid);
+
+		memcpy(mem, snap, used);
+		if (dsRestore(mem) == -1)
+			pexit("dsRestore");
+
+		detachFromMem(mem);
+		printf("%d\n", shmid);
+	}
+
+	munmap(snap, st.st_size);
+}
+
+/* like `dsSet` on the shard of the name, growing it when it is full */
+static int
+storeSet(char *name, char *val) {
+	int shard = shardOf(name);
+
+	while (dsSet(shards[shard], name, val) == -1) {
+		if (errno != ENOMEM || growStore(shard) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
 static void
 cleanupTempMem() {
-	if (!persistent)
-		dsDestroy(nv);
+	int i;
 
-	detachFromMem();
-	deleteSharedMem(shmid);
+	for (i = 0; i < nshards; i++) {
+		if (shards[i] == NULL)
+			continue;
+
+		if (!persistent)
+			dsDestroy(shards[i]);
+
+		detachFromMem(shards[i]);
+		deleteSharedMem(shardIds[i]);
+	}
 
 	if (vt != NULL) {
 		dsDestroy(vt);
@@ -438,15 +1375,16 @@ cleanupTempMem() {
 
 static int
 initializeSharedMem(int cap) {
+	void *mem;
 	int id;
 
 	id = createSharedMem(cap);
-	attachToMem(id);
+	mem = attachToMem(id);
 
-	if (dsInit(nv, cap) == -1)
+	if (dsInit(mem, cap) == -1)
 		pexit("dsInit");
 
-	detachFromMem();
+	detachFromMem(mem);
 
 	return id;
 }
@@ -499,6 +1437,7 @@ stringToLong(char *str) {
 
 static void
 fatal(char *msg) {
+	releaseStore();
 	fprintf(stderr, "%s\n", msg);
 	exit(EXIT_FAILURE);
 }
@@ -515,8 +1454,16 @@ helpAndExit(const char *progname, int status) {
 	fprintf(stream, "Options:\n");
 	fprintf(stream, "\t%10s\t%s\n", "-p", "creates a persistent shared memory segment");
 	fprintf(stream, "\t%10s\t%s\n", "-m [id]", "uses a shared memory with the given id");
+	fprintf(stream, "\t%10s\t%s\n", "-f [file]", "uses a growable store kept in the given file");
+	fprintf(stream, "\t%10s\t%s\n", "-s [/name]", "uses a growable store kept in a POSIX shared memory object");
 	fprintf(stream, "\t%10s\t%s. Default: %d\n", "-c [max-nv]", "capacity: maximum number of name/value pairs allowed", MAX_NV_PAIRS);
-	fprintf(stream, "\t%10s\t%s\n", "-d [id1]+", "deletes the shared memory with the given ids");
+	fprintf(stream, "\t%10s\t%s\n", "-n [shards]", "splits a new store into shards, each with its own lock");
+	fprintf(stream, "\t%10s\t%s\n", "-S [file]", "saves a snapshot of the segment (or store) in use to a file");
+	fprintf(stream, "\t%10s\t%s\n", "-R [file]", "creates a persistent segment (or store) out of a snapshot");
+	fprintf(stream, "\t%10s\t%s\n", "-i [secs]", "prints operation and lock statistics of the segment (or store)");
+	fprintf(stream, "\t%10s\t%s\n", "-t", "runs the whole script as a single transaction");
+	fprintf(stream, "\t%10s\t%s\n", "-C [dir]", "keeps compiled scripts in the given directory");
+	fprintf(stream, "\t%10s\t%s\n", "-d [id1]+", "deletes the shared memory with the given ids (or /names)");
 	fprintf(stream, "\t%10s\t%s\n", "-h", "prints this message and exits");
 
 	exit(status);
@@ -524,6 +1471,11 @@ helpAndExit(const char *progname, int status) {
 
 static void
 pexit(const char *fCall) {
+	int savedErrno = errno;
+
+	releaseStore();
+
+	errno = savedErrno;
 	perror(fCall);
 	exit(EXIT_FAILURE);
 }
@@ -0,0 +1,355 @@
+/* nvbench.c - a load generator for the data structure used by `nv(1)`.
+*
+* `nvbench` measures how the name/value store behaves when many processes use
+* it at once. For each process count requested, a new store is created in System
+* V shared memory and loaded with every key of the key space; then that many
+* processes are forked and run a mix of `get`, `set` and `delete` operations on
+* random keys for a fixed duration. The aggregate throughput and latency
+* percentiles of the run are reported.
+*
+* Operations are performed the way `nv` does: `get` reads without the lock,
+* while `set` and `delete` take it for writing.
+*
+* Usage:
+*
+* 	$ ./nvbench [-p procs] [-g gets] [-d deletes] [-k keys] [-l vallen]
+* 	            [-s seconds] [-n shards]
+*
+* 	-p: comma separated list of process counts to run with (default: 1,2,4,8)
+* 	-g: percentage of operations that are `get`s (default: 90)
+* 	-d: percentage of operations that are `delete`s (default: 5). The remaining
+* 	    ones are `set`s
+* 	-k: number of distinct keys (default: 100000)
+* 	-l: length of the values written (default: 16)
+* 	-s: duration of each run, in seconds (default: 5)
+* 	-n: number of shards the store is split into, like `nv -n` (default: 1)
+*
+* Latencies are measured for each operation, including the time spent waiting
+* for the lock, and given in nanoseconds.
+*
+* Author: Renato Mascarenhas Costa
+*/
+
+#define _GNU_SOURCE
+
+#include "ds.h"
+#include "../../lib/bench.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define MAX_RUNS (16)
+#define MAX_PROCS (256)
+#define MAX_SHARDS (64)
+#define KEY_LEN (24)
+
+#define SHM_PERMS (S_IRUSR | S_IWUSR)
+
+struct config {
+	int procs[MAX_RUNS];
+	int nruns;
+	int gets;
+	int deletes;
+	long nkeys;
+	int vallen;
+	int seconds;
+	int nshards;
+};
+
+/* results of each process, written to memory shared with the parent */
+struct procResult {
+	long ops;
+	long errors;
+	uint64_t hist[BENCH_HIST_BUCKETS];
+};
+
+/* shared among the parent and every process of a run */
+struct control {
+	struct benchControl gate;
+	struct procResult results[MAX_PROCS];
+};
+
+static void pexit(const char *fCall);
+
+static struct config config;
+static char (*keys)[KEY_LEN];
+static char *value;
+
+static void *shards[MAX_SHARDS];
+static int shardIds[MAX_SHARDS];
+
+static void
+usage(const char *progName) {
+	fprintf(stderr, "Usage: %s [-p procs] [-g gets] [-d deletes] [-k keys] [-l vallen] "
+			"[-s seconds] [-n shards]\n", progName);
+	exit(EXIT_FAILURE);
+}
+
+static long
+parseLong(const char *arg, long min, long max, const char *progName) {
+	long n;
+
+	if (benchParseLong(arg, min, max, &n) == -1)
+		usage(progName);
+
+	return n;
+}
+
+static uint64_t
+xorshift(uint64_t *state) {
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+/* the shard holding the given name, chosen like `nv` does */
+static void *
+shardOf(const char *name) {
+	return shards[dsShard(name, config.nshards)];
+}
+
+/* the capacity each shard is created with: room for its share of the key space,
+ * with enough heap for values of the length requested, and some slack for keys
+ * that do not spread evenly */
+static int
+shardCap(void) {
+	long perEntry, cap;
+
+	perEntry = 1 + (KEY_LEN + config.vallen + 2 * sizeof(int)) / NVDS_HEAP_PER_ENTRY;
+	cap = (config.nkeys / config.nshards) * perEntry;
+
+	return (int) (cap + cap / 4 + 16);
+}
+
+/* creates a store with every key set, one segment per shard */
+static void
+createStore(void) {
+	long k;
+	int i, cap;
+
+	cap = shardCap();
+	for (i = 0; i < config.nshards; i++) {
+		shardIds[i] = shmget(IPC_PRIVATE, dsCapToBytes(cap), IPC_CREAT | IPC_EXCL | SHM_PERMS);
+		if (shardIds[i] == -1)
+			pexit("shmget");
+
+		shards[i] = shmat(shardIds[i], NULL, 0);
+		if (shards[i] == (void *) -1)
+			pexit("shmat");
+
+		if (dsInit(shards[i], cap) == -1)
+			pexit("dsInit");
+	}
+
+	for (k = 0; k < config.nkeys; k++) {
+		if (dsSet(shardOf(keys[k]), keys[k], value) == -1)
+			pexit("dsSet");
+	}
+}
+
+static void
+destroyStore(void) {
+	int i;
+
+	for (i = 0; i < config.nshards; i++) {
+		dsDestroy(shards[i]);
+
+		if (shmdt(shards[i]) == -1)
+			pexit("shmdt");
+
+		if (shmctl(shardIds[i], IPC_RMID, NULL) == -1)
+			pexit("shmctl");
+	}
+}
+
+/* runs operations until the parent says otherwise */
+static void
+worker(struct control *control, int id) {
+	struct procResult *result = &control->results[id];
+	char buf[NVDS_VAL_LEN + 1];
+	uint64_t rng, start;
+	void *mem;
+	int op, s;
+	long k;
+
+	rng = 0x9E3779B97F4A7C15ULL * (id + 1);
+
+	benchWaitStart(&control->gate);
+
+	while (!benchStopped(&control->gate)) {
+		k = (long) (xorshift(&rng) % (uint64_t) config.nkeys);
+		op = (int) (xorshift(&rng) % 100);
+		mem = shardOf(keys[k]);
+
+		start = benchNowNs();
+		if (op < config.gets) {
+			/* a key that was deleted is not an error */
+			s = dsGet(mem, keys[k], buf, sizeof(buf));
+			if (s == -1 && errno == EINVAL)
+				s = 0;
+		} else {
+			if (dsLock(mem, DS_READ_WRITE) == -1)
+				pexit("dsLock");
+
+			if (op < config.gets + config.deletes) {
+				s = dsDelete(mem, keys[k]);
+				if (s == -1 && errno == EINVAL)
+					s = 0;
+			} else {
+				s = dsSet(mem, keys[k], value);
+			}
+
+			if (dsUnlock(mem, DS_READ_WRITE) == -1)
+				pexit("dsUnlock");
+		}
+		result->hist[benchHistIndex(benchNowNs() - start)]++;
+
+		result->ops++;
+		if (s == -1)
+			result->errors++;
+	}
+}
+
+static void
+run(struct control *control, int nprocs) {
+	uint64_t hist[BENCH_HIST_BUCKETS], start, elapsed;
+	long ops, errors;
+	pid_t pid;
+	int i;
+
+	createStore();
+
+	memset(control, 0, sizeof(*control));
+	for (i = 0; i < nprocs; i++) {
+		pid = fork();
+		if (pid == -1)
+			pexit("fork");
+
+		if (pid == 0) {
+			worker(control, i);
+			_exit(EXIT_SUCCESS);
+		}
+	}
+
+	/* every process is forked before any of them starts */
+	start = benchStart(&control->gate);
+
+	sleep(config.seconds);
+	benchStop(&control->gate);
+
+	for (i = 0; i < nprocs; i++) {
+		if (wait(NULL) == -1)
+			pexit("wait");
+	}
+	elapsed = benchNowNs() - start;
+
+	memset(hist, 0, sizeof(hist));
+	ops = errors = 0;
+	for (i = 0; i < nprocs; i++) {
+		ops += control->results[i].ops;
+		errors += control->results[i].errors;
+		benchHistAdd(hist, control->results[i].hist);
+	}
+
+	printf("%8d %14.0f %10llu %10llu %10llu %10llu %12llu %8ld\n", nprocs, ops / (elapsed / 1e9),
+			(unsigned long long) benchHistPercentile(hist, ops, 0.50),
+			(unsigned long long) benchHistPercentile(hist, ops, 0.90),
+			(unsigned long long) benchHistPercentile(hist, ops, 0.99),
+			(unsigned long long) benchHistPercentile(hist, ops, 0.999),
+			(unsigned long long) benchHistMax(hist), errors);
+
+	destroyStore();
+}
+
+int
+main(int argc, char *argv[]) {
+	char defaultList[] = "1,2,4,8";
+	struct control *control;
+	char *list, *tok;
+	int opt, i;
+	long k;
+
+	config.nruns = 0;
+	config.gets = 90;
+	config.deletes = 5;
+	config.nkeys = 100000;
+	config.vallen = 16;
+	config.seconds = 5;
+	config.nshards = 1;
+	list = defaultList;
+
+	while ((opt = getopt(argc, argv, "p:g:d:k:l:s:n:")) != -1) {
+		switch (opt) {
+			case 'p': list = optarg; break;
+			case 'g': config.gets = parseLong(optarg, 0, 100, argv[0]); break;
+			case 'd': config.deletes = parseLong(optarg, 0, 100, argv[0]); break;
+			case 'k': config.nkeys = parseLong(optarg, 1, 10000000, argv[0]); break;
+			case 'l': config.vallen = parseLong(optarg, 0, NVDS_VAL_LEN, argv[0]); break;
+			case 's': config.seconds = parseLong(optarg, 1, 3600, argv[0]); break;
+			case 'n': config.nshards = parseLong(optarg, 1, MAX_SHARDS, argv[0]); break;
+			default: usage(argv[0]);
+		}
+	}
+
+	if (config.gets + config.deletes > 100)
+		usage(argv[0]);
+
+	for (tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		if (config.nruns == MAX_RUNS)
+			usage(argv[0]);
+
+		config.procs[config.nruns++] = parseLong(tok, 1, MAX_PROCS, argv[0]);
+	}
+
+	if (config.nruns == 0)
+		usage(argv[0]);
+
+	keys = malloc(config.nkeys * KEY_LEN);
+	value = malloc(config.vallen + 1);
+	if (keys == NULL || value == NULL)
+		pexit("malloc");
+
+	for (k = 0; k < config.nkeys; k++)
+		snprintf(keys[k], KEY_LEN, "key%012ld", k);
+
+	memset(value, 'v', config.vallen);
+	value[config.vallen] = '\0';
+
+	control = benchShared(sizeof(*control));
+	if (control == NULL)
+		pexit("benchShared");
+
+	printf(">>> nv benchmark: %ld keys, %d%% gets, %d%% deletes, %d%% sets, %d-byte values, "
+			"%d shard(s), %ds per run\n", config.nkeys, config.gets, config.deletes,
+			100 - config.gets - config.deletes, config.vallen, config.nshards, config.seconds);
+	printf("%8s %14s %10s %10s %10s %10s %12s %8s\n", "procs", "ops/s", "p50 (ns)",
+			"p90 (ns)", "p99 (ns)", "p99.9 (ns)", "max (ns)", "errors");
+
+	for (i = 0; i < config.nruns; i++)
+		run(control, config.procs[i]);
+
+	munmap(control, sizeof(*control));
+	free(keys);
+	free(value);
+
+	exit(EXIT_SUCCESS);
+}
+
+static void
+pexit(const char *fCall) {
+	perror(fCall);
+	exit(EXIT_FAILURE);
+}
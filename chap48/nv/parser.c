@@ -9,34 +9,130 @@
 
 #include "parser.h"
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+
+#define COMPILED_MAGIC (0x6e766331) /* "nvc1" */
+
+/* the start of a compiled program, followed by `nops` commands and `stringsLen`
+ * bytes of strings. The arguments of the commands are stored as offsets into the
+ * strings; the layout is that of `struct command` on the system that compiled
+ * them, so a compiled program is only used on the same kind of system */
+struct compiledHeader {
+	uint32_t magic;       /* COMPILED_MAGIC */
+	uint32_t commandSize; /* sizeof(struct command) */
+	uint64_t dev;         /* the script compiled */
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtimeSec;
+	int64_t mtimeNsec;
+	uint32_t nops;
+	uint32_t stringsLen;
+};
+
+/* strings of arguments, each stored once, and a hash table to find them. Slots
+ * hold the offset of a string plus one, or 0 if empty */
+struct internTable {
+	char *strings;
+	size_t len, size;
+	uint32_t *slots;
+	size_t nslots;
+};
+
+/* reads everything from the file descriptor given into a single buffer, NUL
+ * terminated, for resources that cannot be mapped into memory */
+static int
+readScript(int fd, struct program *ds) {
+	size_t size;
+	ssize_t n;
+	char *p;
+
+	size = BUF_SIZE;
+	ds->text = malloc(size);
+	if (ds->text == NULL)
+		return -1;
+
+	ds->len = 0;
+	for (;;) {
+		/* always leave room for the terminating NUL */
+		if (ds->len + 1 == size) {
+			size *= 2;
+			p = realloc(ds->text, size);
+			if (p == NULL) {
+				free(ds->text);
+				return -1;
+			}
+
+			ds->text = p;
+		}
+
+		n = read(fd, ds->text + ds->len, size - ds->len - 1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+
+			free(ds->text);
+			return -1;
+		}
+
+		if (n == 0)
+			break;
+
+		ds->len += n;
+	}
+
+	ds->text[ds->len] = '\0';
+	ds->mapped = false;
+	ds->cached = false;
+
+	return 0;
+}
+
 int
 initScript(int fd, struct program *ds) {
-	int nfd;
+	struct stat st;
+	void *p;
 
-	/* duplicate the given file descriptor for later use - this allows the caller to
-	 * manipulate the original file descriptor at will, even closing it, without
-	 * affecting later calls to parser functions */
-	nfd = dup(fd);
-	if (nfd == -1)
+	ds->ops = NULL;
+	ds->nops = 0;
+
+	if (fstat(fd, &st) == -1)
 		return -1;
 
-	ds->fd = nfd;
+	/* the parser relies on the text being followed by a NUL byte. A mapping
+	 * provides one for free, past the end of the file within its last page,
+	 * unless the file happens to fill that page entirely; then the text must
+	 * end with a newline, which the parser replaces */
+	if (!S_ISREG(st.st_mode) || st.st_size == 0)
+		return readScript(fd, ds);
+
+	p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+		return readScript(fd, ds);
+
+	if (st.st_size % sysconf(_SC_PAGESIZE) == 0 && ((char *) p)[st.st_size - 1] != '\n') {
+		munmap(p, st.st_size);
+		return readScript(fd, ds);
+	}
+
+	ds->text = p;
+	ds->len = st.st_size;
+	ds->mapped = true;
+	ds->cached = false;
 
 	return 0;
 }
 
 static void
 cleanupLine(char *s) {
-	int i, slashIdx;
+	int i, len, slashIdx;
 	bool commentFound;
 
-	/* remove trailing newline, if any */
-	if (s[strlen(s) - 1] == '\n')
-		s[strlen(s) - 1] = '\0';
-
-	/* remove leading spaces, if any */
-	while (isspace(*s))
-		s++;
+	len = strlen(s);
 
 	/* simple inline comment implementation: if two consecutive slashes (`/`) are
 	 * found, everything after is removed and not considered on execution.
@@ -54,7 +150,7 @@ cleanupLine(char *s) {
 	 */
 	slashIdx = -1;
 	commentFound = false;
-	for (i = 0; i < (int) strlen(s) && !commentFound; i++) {
+	for (i = 0; i < len && !commentFound; i++) {
 		if (s[i] == '/') {
 			/* if this is not the first slash found and they are one character apart,
 			 * an inline comment is found */
@@ -68,11 +164,13 @@ cleanupLine(char *s) {
 	}
 
 	/* if there is an inline comment, remove it */
-	if (commentFound)
+	if (commentFound) {
 		s[slashIdx] = '\0';
+		len = slashIdx;
+	}
 
 	/* remove any trailing spaces remaining */
-	i = strlen(s) - 1;
+	i = len - 1;
 	while (i >= 0 && isspace(s[i]))
 		i--;
 
@@ -123,6 +221,17 @@ verifyCommand(struct command *cmd, const char *cmdName, int lineno, struct compi
 			}
 			break;
 
+		case CMD_COMPACT:
+		case CMD_BEGIN:
+		case CMD_END:
+			if (cmd->nargs != 0) {
+				error->lineno = lineno;
+				strncpy(error->cmd, cmdName, MAX_CMD_LEN);
+				snprintf(error->message, BUF_SIZE, "Expected no arguments, got %d", cmd->nargs);
+				return -1;
+			}
+			break;
+
 		case CMD_PRINT:
 			if (cmd->nargs < 1) {
 				error->lineno = lineno;
@@ -139,11 +248,10 @@ verifyCommand(struct command *cmd, const char *cmdName, int lineno, struct compi
 int
 compileScript(struct program *ds, struct compilationError *error) {
 	int ncommands;
-	char buf[BUF_SIZE], *saveptr, *token;
+	char *line, *next, *end, *saveptr, *token;
 	const char *currCmd;
-	int ntokens, nargs, nops, lineno;
+	int ntokens, nargs, nops, lineno, blockStart;
 	struct command *cmd;
-	FILE *stream;
 	void *p;
 
 	/* start with a default buffer of 64 commands. This is expanded as necessary,
@@ -155,26 +263,31 @@ compileScript(struct program *ds, struct compilationError *error) {
 		return -1;
 	}
 
-	stream = fdopen(ds->fd, "r");
-	if (stream == NULL) {
-		internalError(error, 0);
-		return -1;
-	}
-
 	nops = 0;
 	lineno = 0;
-	while (fgets(buf, BUF_SIZE, stream) != NULL) {
+	blockStart = 0; /* line of the `begin` of the current transaction, if any */
+	end = ds->text + ds->len;
+	for (line = ds->text; line < end; line = next) {
+		/* lines and tokens are NUL terminated where they are. The last line
+		 * is followed by a NUL byte already (see `initScript`) */
+		next = memchr(line, '\n', end - line);
+		if (next != NULL)
+			*next++ = '\0';
+		else
+			next = end;
+
 		lineno++;
 		cmd = &ds->ops[nops];
-		cleanupLine(buf);
+		cleanupLine(line);
 
 		/* blank line or comment */
-		if (strlen(buf) == 0)
+		if (line[strspn(line, " \t")] == '\0')
 			continue;
 
 		/* parse line to find tokens, which are separated by spaces or tabs */
 		ntokens = 0;
-		token = strtok_r(buf, " \t", &saveptr);
+		cmd->nargs = 0;
+		token = strtok_r(line, " \t", &saveptr);
 		while (token != NULL) {
 			ntokens++;
 
@@ -198,19 +311,32 @@ compileScript(struct program *ds, struct compilationError *error) {
 				} else if (strcmp(token, "print") == 0) {
 					currCmd = "print";
 					cmd->code = CMD_PRINT;
+				} else if (strcmp(token, "compact") == 0) {
+					currCmd = "compact";
+					cmd->code = CMD_COMPACT;
+				} else if (strcmp(token, "begin") == 0) {
+					currCmd = "begin";
+					cmd->code = CMD_BEGIN;
+				} else if (strcmp(token, "end") == 0) {
+					currCmd = "end";
+					cmd->code = CMD_END;
 				} else {
 					/* command was not recognized */
+					error->lineno = lineno;
 					strncpy(error->cmd, token, MAX_CMD_LEN);
 					strncpy(error->message, "invalid command", BUF_SIZE);
 					return -1;
 				}
 			} else {
 				nargs = ntokens - 1;
-				cmd->args[nargs - 1] = malloc(MAX_ARG_LEN);
-				if (cmd->args[nargs - 1] == NULL)
-					internalError(error, lineno);
+				if (nargs > MAX_ARGS) {
+					error->lineno = lineno;
+					strncpy(error->cmd, currCmd, MAX_CMD_LEN);
+					snprintf(error->message, BUF_SIZE, "At most %d arguments are allowed", MAX_ARGS);
+					return -1;
+				}
 
-				strncpy(cmd->args[nargs - 1], token, MAX_ARG_LEN);
+				cmd->args[nargs - 1] = token;
 				cmd->nargs = nargs;
 			}
 
@@ -221,10 +347,23 @@ compileScript(struct program *ds, struct compilationError *error) {
 		if (verifyCommand(cmd, currCmd, lineno, error) == -1)
 			return -1;
 
+		/* transactions must be properly delimited, and cannot be nested */
+		if (cmd->code == CMD_BEGIN || cmd->code == CMD_END) {
+			if ((cmd->code == CMD_BEGIN) == (blockStart != 0)) {
+				error->lineno = lineno;
+				strncpy(error->cmd, currCmd, MAX_CMD_LEN);
+				snprintf(error->message, BUF_SIZE, (cmd->code == CMD_BEGIN) ?
+						"Transactions cannot be nested" : "No transaction to end");
+				return -1;
+			}
+
+			blockStart = (cmd->code == CMD_BEGIN) ? lineno : 0;
+		}
+
 		nops++;
 		/* increase buffer for command structs if the number of lines in the script
 		 * exceeds it */
-		if (nops > ncommands) {
+		if (nops >= ncommands) {
 			ncommands *= 2;
 			p = realloc(ds->ops, (ncommands * sizeof(struct command)));
 
@@ -237,25 +376,285 @@ compileScript(struct program *ds, struct compilationError *error) {
 		}
 	}
 
-	/* no longer needed - close the FILE stream */
-	fclose(stream);
+	if (blockStart != 0) {
+		error->lineno = blockStart;
+		strncpy(error->cmd, "begin", MAX_CMD_LEN);
+		snprintf(error->message, BUF_SIZE, "Transaction is never ended");
+		return -1;
+	}
 
 	ds->nops = nops;
 	return nops;
 }
 
-void
-destroyScript(struct program *ds) {
-	int i, j;
-	struct command cmd;
+/* the file a program compiled from the script described by `st` is cached in */
+static int
+compiledPath(char *path, const char *cacheDir, const struct stat *st) {
+	int n;
+
+	n = snprintf(path, PATH_MAX, "%s/%llx-%llx.nvc", cacheDir,
+			(unsigned long long) st->st_dev, (unsigned long long) st->st_ino);
+	if (n >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* whether a compiled program was compiled from the script as it is now, and is
+ * laid out as this system expects */
+static bool
+compiledMatches(const struct compiledHeader *h, size_t len, const struct stat *st) {
+	return len >= sizeof(struct compiledHeader) &&
+		h->magic == COMPILED_MAGIC &&
+		h->commandSize == sizeof(struct command) &&
+		h->dev == (uint64_t) st->st_dev &&
+		h->ino == (uint64_t) st->st_ino &&
+		h->size == (uint64_t) st->st_size &&
+		h->mtimeSec == (int64_t) st->st_mtim.tv_sec &&
+		h->mtimeNsec == (int64_t) st->st_mtim.tv_nsec &&
+		len == sizeof(struct compiledHeader) + (size_t) h->nops * sizeof(struct command) +
+			h->stringsLen;
+}
+
+int
+loadCompiled(int fd, const char *cacheDir, struct program *ds) {
+	char path[PATH_MAX], *strings;
+	struct stat script, st;
+	struct compiledHeader *h;
+	struct compilationError error;
+	struct command *cmd;
+	uintptr_t offset;
+	int cfd, i, j;
+	void *p;
+
+	if (fstat(fd, &script) == -1)
+		return -1;
+
+	if (!S_ISREG(script.st_mode)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (compiledPath(path, cacheDir, &script) == -1)
+		return -1;
+
+	cfd = open(path, O_RDONLY);
+	if (cfd == -1)
+		return -1;
+
+	/* only compiled programs written by this user are trusted */
+	if (fstat(cfd, &st) == -1 || st.st_uid != geteuid() ||
+			(size_t) st.st_size < sizeof(struct compiledHeader)) {
+		close(cfd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* arguments are turned from offsets to pointers where they are, in pages
+	 * private to this process */
+	p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, cfd, 0);
+	close(cfd);
+	if (p == MAP_FAILED)
+		return -1;
+
+	h = p;
+	if (!compiledMatches(h, st.st_size, &script))
+		goto stale;
+
+	ds->ops = (struct command *) (h + 1);
+	strings = (char *) (ds->ops + h->nops);
+	if (h->stringsLen > 0 && strings[h->stringsLen - 1] != '\0')
+		goto stale;
+
+	for (i = 0; i < (int) h->nops; i++) {
+		cmd = &ds->ops[i];
+		if (cmd->code < CMD_SET || cmd->code > CMD_END || cmd->nargs < 0 ||
+				cmd->nargs > MAX_ARGS || verifyCommand(cmd, "", 0, &error) == -1)
+			goto stale;
+
+		for (j = 0; j < cmd->nargs; j++) {
+			offset = (uintptr_t) cmd->args[j];
+			if (offset >= h->stringsLen)
+				goto stale;
+
+			cmd->args[j] = strings + offset;
+		}
+	}
+
+	ds->text = p;
+	ds->len = st.st_size;
+	ds->mapped = false;
+	ds->cached = true;
+	ds->nops = h->nops;
+
+	return 0;
+
+stale:
+	munmap(p, st.st_size);
+	ds->ops = NULL;
+	errno = ESTALE;
+	return -1;
+}
+
+/* the offset of a copy of `s` in the table, added if not there yet. Returns -1 if
+ * the system is out of memory */
+static long
+intern(struct internTable *t, const char *s) {
+	uint32_t hash = 2166136261u;
+	size_t i, len;
+	char *p;
+	const char *c;
+
+	for (c = s; *c != '\0'; c++)
+		hash = (hash ^ (unsigned char) *c) * 16777619u;
+
+	for (i = hash & (t->nslots - 1); t->slots[i] != 0; i = (i + 1) & (t->nslots - 1)) {
+		if (strcmp(t->strings + t->slots[i] - 1, s) == 0)
+			return t->slots[i] - 1;
+	}
+
+	len = strlen(s) + 1;
+	if (t->len + len > t->size) {
+		while (t->len + len > t->size)
+			t->size *= 2;
+
+		p = realloc(t->strings, t->size);
+		if (p == NULL)
+			return -1;
+
+		t->strings = p;
+	}
+
+	memcpy(t->strings + t->len, s, len);
+	t->slots[i] = t->len + 1;
+	t->len += len;
+
+	return t->slots[i] - 1;
+}
+
+/* writes the whole buffer to the file descriptor, retrying partial writes */
+static int
+writeBuffer(int fd, const void *buf, size_t len) {
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+int
+saveCompiled(int fd, const char *cacheDir, const struct program *ds) {
+	char path[PATH_MAX], tmp[PATH_MAX + 32];
+	struct compiledHeader h;
+	struct internTable t;
+	struct command *ops;
+	struct stat script;
+	struct timespec now;
+	long offset;
+	int cfd, i, j, status;
+
+	if (fstat(fd, &script) == -1)
+		return -1;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (!S_ISREG(script.st_mode) || now.tv_sec - script.st_mtim.tv_sec < 1)
+		return 0;
+
+	if (compiledPath(path, cacheDir, &script) == -1)
+		return -1;
+
+	/* the commands, with arguments replaced by their offsets in the strings */
+	t.len = 0;
+	t.size = BUF_SIZE;
+	for (t.nslots = 64; t.nslots < 2 * (size_t) ds->nops * MAX_ARGS; t.nslots *= 2)
+		;
+
+	ops = calloc(ds->nops + 1, sizeof(struct command));
+	t.strings = malloc(t.size);
+	t.slots = calloc(t.nslots, sizeof(uint32_t));
+
+	status = -1;
+	if (ops == NULL || t.strings == NULL || t.slots == NULL)
+		goto out;
 
 	for (i = 0; i < ds->nops; i++) {
-		cmd = ds->ops[i];
+		ops[i].code = ds->ops[i].code;
+		ops[i].nargs = ds->ops[i].nargs;
+
+		for (j = 0; j < ds->ops[i].nargs; j++) {
+			offset = intern(&t, ds->ops[i].args[j]);
+			if (offset == -1 || offset > UINT32_MAX)
+				goto out;
+
+			ops[i].args[j] = (char *) (uintptr_t) offset;
+		}
+	}
+
+	memset(&h, 0, sizeof(h));
+	h.magic = COMPILED_MAGIC;
+	h.commandSize = sizeof(struct command);
+	h.dev = script.st_dev;
+	h.ino = script.st_ino;
+	h.size = script.st_size;
+	h.mtimeSec = script.st_mtim.tv_sec;
+	h.mtimeNsec = script.st_mtim.tv_nsec;
+	h.nops = ds->nops;
+	h.stringsLen = t.len;
+
+	/* written under a temporary name and renamed, so that processes loading the
+	 * compiled program never see it incomplete */
+	snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long) getpid());
+	cfd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (cfd == -1)
+		goto out;
+
+	if (writeBuffer(cfd, &h, sizeof(h)) == -1 ||
+			writeBuffer(cfd, ops, ds->nops * sizeof(struct command)) == -1 ||
+			writeBuffer(cfd, t.strings, t.len) == -1) {
+		close(cfd);
+		unlink(tmp);
+		goto out;
+	}
 
-		for (j = 0; j < cmd.nargs; j++)
-			free(cmd.args[j]);
+	if (close(cfd) == -1 || rename(tmp, path) == -1) {
+		unlink(tmp);
+		goto out;
+	}
+
+	status = 0;
+
+out:
+	free(ops);
+	free(t.strings);
+	free(t.slots);
+	return status;
+}
+
+void
+destroyScript(struct program *ds) {
+	if (ds->cached) {
+		munmap(ds->text, ds->len);
+		return;
 	}
 
 	free(ds->ops);
-	close(ds->fd);
+
+	if (ds->mapped)
+		munmap(ds->text, ds->len);
+	else
+		free(ds->text);
 }
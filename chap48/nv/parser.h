@@ -13,8 +13,8 @@
 #ifndef PARSER_H
 #define PARSER_H
 
-/* get XSI-compliant version of `strerror_r(3)` */
-#define _POSIX_C_SOURCE (200112L)
+/* get XSI-compliant version of `strerror_r(3)`, and nanosecond file timestamps */
+#define _POSIX_C_SOURCE (200809L)
 
 #define MAX_CMD_LEN (64)
 #define MAX_ARGS (8)
@@ -22,6 +22,7 @@
 
 #define BUF_SIZE (2048)
 
+#include <sys/types.h>
 #include <unistd.h>
 
 #include <ctype.h>
@@ -39,6 +40,9 @@
 #define CMD_GET         (3)
 #define CMD_DELETE      (4)
 #define CMD_PRINT       (5)
+#define CMD_COMPACT     (6)
+#define CMD_BEGIN       (7)
+#define CMD_END         (8)
 
 struct compilationError {
 	int lineno;             /* line number containing the error */
@@ -46,6 +50,8 @@ struct compilationError {
 	char message[BUF_SIZE]; /* a descriptive error message */
 };
 
+/* arguments point into the text of the script itself, which the parser splits
+ * in place: they are not copied, and are valid until `destroyScript` is called */
 struct command {
 	int code;             /* code of the command to be run. See definitions */
 	char *args[MAX_ARGS]; /* an array of arguments */
@@ -53,14 +59,20 @@ struct command {
 };
 
 struct program {
-	int fd;              /* file descriptor pointing to the resource containing the script */
+	char *text;          /* the content of the script, tokenized in place */
+	size_t len;          /* length of `text` */
+	bool mapped;         /* whether `text` is a private mapping of the script file */
+	bool cached;         /* whether `text` is a mapping of a compiled program instead,
+	                        which `ops` and the arguments point into */
 	struct command *ops; /* list of commands in the program */
 	int nops;            /* number of operations (i.e., length of `ops` array) */
 };
 
 /* creates a new program data structure. Receives as argument a file descriptor
  * which should be pointing to a resource containing the actual content of the
- * script to be run.
+ * script to be run. Regular files are mapped into memory (privately, so that
+ * changes made while parsing are not written back); other resources, such as
+ * pipes, are read in full. The file descriptor is no longer needed afterwards.
  *
  * Returns -1 on error. */
 int initScript(int fd, struct program *ds);
@@ -74,6 +86,28 @@ int initScript(int fd, struct program *ds);
  * struct is filled accordingly */
 int compileScript(struct program *ds, struct compilationError *error);
 
+/* Compiled programs can be cached in a directory, so that scripts run over and
+ * over again are not read and compiled every time. A compiled program is a file
+ * holding the list of commands, followed by the strings of their arguments, each
+ * stored once however many commands use it. It is named after the device and
+ * inode of the script, and only used while the script has the modification time
+ * and size it had when it was compiled.
+ *
+ * Loading a compiled program for the script open in `fd`, from `cacheDir`, maps
+ * it into memory; the commands are then ready to run, and the script does not
+ * need to be read. The program is destroyed with `destroyScript`, as usual.
+ *
+ * Returns -1 when there is no usable compiled program for the script (it was never
+ * compiled, it changed since, or `fd` does not refer to a regular file) */
+int loadCompiled(int fd, const char *cacheDir, struct program *ds);
+
+/* Saves a program compiled from the script open in `fd` to `cacheDir`, for
+ * `loadCompiled` to find. Scripts modified within the last second are not cached,
+ * since they could change again without their modification time telling so.
+ *
+ * Returns -1 on error */
+int saveCompiled(int fd, const char *cacheDir, const struct program *ds);
+
 /* destroys associated data structures of a `program` struct. */
 void destroyScript(struct program *ds);
 
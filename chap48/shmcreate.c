@@ -5,9 +5,32 @@
  * If successful, this program prints the numerical identifier associated with
  * the new shared memory segment.
  *
+ * A plain segment gets its memory on first touch: every process attaching to it
+ * takes a page fault the first time it accesses each page, and a TLB entry per
+ * 4 KB page afterwards. For segments used under latency-sensitive load (the nv
+ * stores in nv/, say), the segment can instead be:
+ *
+ *    - backed by huge pages (SHM_HUGETLB), of 2 MB or 1 GB: one TLB entry
+ *      covers 512 (or 262144) times as much memory. Huge pages must have been
+ *      reserved beforehand (/proc/sys/vm/nr_hugepages, or the hugepages= boot
+ *      parameter for 1 GB pages), and the size is rounded up to a multiple of
+ *      the huge page size;
+ *    - bound to a NUMA node, with mbind(2): its pages are taken from that node
+ *      only, which should be that of the CPUs of the processes using it;
+ *    - prefaulted: every page is touched once here, so that it is allocated
+ *      (on the node given) before anyone else attaches;
+ *    - locked in memory, with shmctl(SHM_LOCK), so that its pages are never
+ *      swapped out. Locking does not allocate pages, so it implies prefaulting.
+ *
  * Usage
  *
- *    $ ./shmcreate [size]
+ *    $ ./shmcreate [-H 2M|1G] [-n node] [-p] [-l] size
+ *
+ *    -H: back the segment with huge pages of the size given.
+ *    -n: bind the memory of the segment to a NUMA node (implies -p).
+ *    -p: prefault the segment.
+ *    -l: lock the segment in memory (implies -p). Needs CAP_IPC_LOCK, or a
+ *        RLIMIT_MEMLOCK as large as the segment.
  *
  * Author: Renato Mascarenhas Costa
  */
@@ -15,33 +38,145 @@
 #include <sys/types.h>
 #include <sys/shm.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <unistd.h>
 #include <limits.h>
+#include <string.h>
+#include <stdbool.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 
 #define SHM_PERMS (S_IRUSR | S_IWUSR)
 
+/* the huge page size is encoded in the flags of shmget(2), from bit 26 on, as
+ * its log2 - see <linux/shm.h> */
+#ifndef SHM_HUGE_SHIFT
+#  define SHM_HUGE_SHIFT (26)
+#endif
+#ifndef SHM_HUGE_2MB
+#  define SHM_HUGE_2MB (21 << SHM_HUGE_SHIFT)
+#endif
+#ifndef SHM_HUGE_1GB
+#  define SHM_HUGE_1GB (30 << SHM_HUGE_SHIFT)
+#endif
+
+#define MAX_NODES (1024)
+
 static void fatal(const char *msg);
 static void helpAndExit(const char *progname, int status);
 static void pexit(const char *fCall);
 
+/* the segment created, removed if it cannot be set up as asked */
+static int shmid = -1;
+
+static long
+parseNumber(const char *str) {
+	char *endptr;
+	long n;
+
+	n = strtol(str, &endptr, 10);
+	if (n < 0 || n == LONG_MAX || *endptr != '\0' || endptr == str)
+		fatal("Invalid number.");
+
+	return n;
+}
+
+/* binds the memory of the segment attached at `addr` to `node`. The policy of
+ * a shared memory segment belongs to the segment: processes attaching to it
+ * later are bound as well */
+static void
+bindToNode(void *addr, size_t size, long node) {
+	unsigned long nodemask[MAX_NODES / (8 * sizeof(unsigned long))];
+
+	memset(nodemask, 0, sizeof(nodemask));
+	nodemask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+
+	if (syscall(SYS_mbind, addr, size, MPOL_BIND, nodemask, MAX_NODES, 0) == -1)
+		pexit("mbind");
+}
+
+/* touches every page of the segment, writing to it - so that each is allocated,
+ * and not just mapped to the zero page. The contents are left as they are */
+static void
+prefault(volatile char *addr, size_t size, size_t pageSize) {
+	size_t off;
+
+	for (off = 0; off < size; off += pageSize)
+		addr[off] = addr[off];
+}
+
 int
 main(int argc, char *argv[]) {
-	int shmid;
-	long size;
-	char *endptr;
+	int opt, flags = 0;
+	bool touch = false, lock = false;
+	long size, node = -1;
+	size_t pageSize;
+	void *addr;
+
+	pageSize = sysconf(_SC_PAGESIZE);
+
+	while ((opt = getopt(argc, argv, "H:n:plh")) != -1) {
+		switch (opt) {
+			case 'H':
+				if (!strcmp(optarg, "2M")) {
+					flags = SHM_HUGETLB | SHM_HUGE_2MB;
+					pageSize = 2UL << 20;
+				} else if (!strcmp(optarg, "1G")) {
+					flags = SHM_HUGETLB | SHM_HUGE_1GB;
+					pageSize = 1UL << 30;
+				} else {
+					fatal("Invalid huge page size: 2M or 1G.");
+				}
+				break;
+
+			case 'n':
+				node = parseNumber(optarg);
+				if (node >= MAX_NODES)
+					fatal("Invalid NUMA node.");
+				touch = true;
+				break;
 
-	if (argc != 2)
+			case 'p': touch = true; break;
+			case 'l': lock = touch = true; break;
+			case 'h': helpAndExit(argv[0], EXIT_SUCCESS); break;
+			default: helpAndExit(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	if (optind != argc - 1)
 		helpAndExit(argv[0], EXIT_FAILURE);
 
-	size = strtol(argv[1], &endptr, 10);
-	if (size <= 0 || size == LONG_MAX || *endptr != '\0')
+	size = parseNumber(argv[optind]);
+	if (size == 0)
 		fatal("Invalid size argument.");
 
-	shmid = shmget(IPC_PRIVATE, (size_t) size, IPC_CREAT | IPC_EXCL | SHM_PERMS);
-	if (shmid == -1)
+	/* huge page segments must be a multiple of the huge page size */
+	if (flags & SHM_HUGETLB)
+		size = (size + pageSize - 1) / pageSize * pageSize;
+
+	if ((shmid = shmget(IPC_PRIVATE, (size_t) size, IPC_CREAT | IPC_EXCL | SHM_PERMS | flags)) == -1) {
+		if (flags & SHM_HUGETLB)
+			fprintf(stderr, "Are there enough huge pages reserved? See /proc/meminfo.\n");
 		pexit("shmget");
+	}
+
+	if (touch) {
+		if ((addr = shmat(shmid, NULL, 0)) == (void *) -1)
+			pexit("shmat");
+
+		if (node != -1)
+			bindToNode(addr, size, node);
+
+		if (lock && shmctl(shmid, SHM_LOCK, NULL) == -1)
+			pexit("shmctl");
+
+		prefault(addr, size, pageSize);
+
+		if (shmdt(addr) == -1)
+			pexit("shmdt");
+	}
 
 	printf("%d\n", shmid);
 	exit(EXIT_SUCCESS);
@@ -60,12 +195,15 @@ helpAndExit(const char *progname, int status) {
 	if (status == EXIT_FAILURE)
 		stream = stderr;
 
-	fprintf(stream, "Usage: %s [size]\n", progname);
+	fprintf(stream, "Usage: %s [-H 2M|1G] [-n node] [-p] [-l] size\n", progname);
 	exit(status);
 }
 
 static void
 pexit(const char *fCall) {
 	perror(fCall);
+
+	if (shmid != -1)
+		shmctl(shmid, IPC_RMID, NULL);
 	exit(EXIT_FAILURE);
 }
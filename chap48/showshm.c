@@ -8,34 +8,184 @@
  * This program displays all the available information kept by the kernel about
  * a System V shared memory segment, given its numerical identifier.
  *
+ * With -r, it also tells where the memory of the segment is: it attaches to the
+ * segment (read-only), and reports how many of its pages are resident in memory
+ * (with mincore(2)), and on which NUMA nodes those are (querying move_pages(2)
+ * without moving anything). A segment with few of its pages resident while in
+ * use is being swapped out and in again; one used from CPUs of a node while its
+ * pages are on another pays for remote memory on every access.
+ *
+ * With -m, a map of the segment is printed as well: a character per page (or
+ * per group of pages, for large segments), '.' if none is resident, ':' if only
+ * some are, the node they are on if all are resident on a single node, '*' if
+ * they are on several, and '?' if their node could not be told.
+ *
+ * Only resident pages are touched (to map them, as move_pages(2) only knows of
+ * pages mapped in the calling process): the report does not fault in the cold
+ * pages it is looking for.
+ *
  * Usage
  *
- *    $ ./showshm [id]
+ *    $ ./showshm [-r] [-m] [id]
  *
  * Author: Renato Mascarenhas Costa
  */
 
 #include <sys/types.h>
 #include <sys/shm.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include <limits.h>
+#include <stdbool.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 
+#define MAP_COLUMNS (64)
+#define MAP_LINES (64)
+#define MAX_NODES (64)
+
+/* nodes of pages in the map other than real ones */
+#define NOT_RESIDENT (-1)
+#define UNKNOWN_NODE (-2)
+
 static void fatal(const char *msg);
 static void helpAndExit(const char *progname, int status);
 static void pexit(const char *fCall);
 
+/* the character of a group of pages in the map */
+static char
+mapChar(const int *nodes, size_t n) {
+	size_t i, resident = 0;
+	int node = NOT_RESIDENT;
+	bool mixed = false;
+
+	for (i = 0; i < n; ++i) {
+		if (nodes[i] == NOT_RESIDENT)
+			continue;
+
+		if (resident++ > 0 && nodes[i] != node)
+			mixed = true;
+		node = nodes[i];
+	}
+
+	if (resident == 0)
+		return '.';
+	if (resident < n)
+		return ':';
+	if (mixed)
+		return '*';
+	if (node == UNKNOWN_NODE)
+		return '?';
+	return (node < 10) ? '0' + node : '+';
+}
+
+/* reports the residency of the pages of segment `shmid`, and their nodes */
+static void
+residency(int shmid, size_t size, bool map) {
+	long pageSize = sysconf(_SC_PAGESIZE);
+	size_t npages = (size + pageSize - 1) / pageSize, i, n, perChar, resident = 0;
+	long perNode[MAX_NODES] = { 0 }, unknown = 0;
+	volatile char *addr;
+	unsigned char *vec;
+	void **pages;
+	int *nodes, *status, node;
+
+	if ((addr = shmat(shmid, NULL, SHM_RDONLY)) == (void *) -1)
+		pexit("shmat");
+
+	if ((vec = malloc(npages)) == NULL || (pages = malloc(npages * sizeof(void *))) == NULL ||
+	    (nodes = malloc(npages * sizeof(int))) == NULL || (status = malloc(npages * sizeof(int))) == NULL)
+		pexit("malloc");
+
+	if (mincore((void *) addr, size, vec) == -1)
+		pexit("mincore");
+
+	/* map the resident pages, and ask for their nodes */
+	for (i = 0, n = 0; i < npages; ++i) {
+		nodes[i] = NOT_RESIDENT;
+		if (vec[i] & 1) {
+			(void) addr[i * pageSize];
+			pages[n++] = (void *) (addr + i * pageSize);
+		}
+	}
+
+	if (n > 0 && syscall(SYS_move_pages, 0, n, pages, NULL, status, 0) == -1) {
+		/* no NUMA support: residency can still be told */
+		for (i = 0; i < n; ++i)
+			status[i] = -1;
+	}
+
+	for (i = 0, n = 0; i < npages; ++i) {
+		if (!(vec[i] & 1))
+			continue;
+
+		++resident;
+		node = status[n++];
+		if (node >= 0 && node < MAX_NODES) {
+			++perNode[node];
+			nodes[i] = node;
+		} else {
+			/* resident, but not known where: swapped in since mincore(2),
+			 * or without NUMA */
+			++unknown;
+			nodes[i] = UNKNOWN_NODE;
+		}
+	}
+
+	printf("Resident pages: %zu of %zu (%.1f%%)\n", resident, npages, 100.0 * resident / npages);
+	for (node = 0; node < MAX_NODES; ++node) {
+		if (perNode[node] > 0)
+			printf("  node %d: %ld pages (%.1f%%)\n", node, perNode[node], 100.0 * perNode[node] / npages);
+	}
+	if (unknown > 0)
+		printf("  unknown node: %ld pages\n", unknown);
+
+	if (map) {
+		perChar = (npages + MAP_COLUMNS * MAP_LINES - 1) / (MAP_COLUMNS * MAP_LINES);
+		printf("Map (%zu page%s per character):\n", perChar, (perChar > 1) ? "s" : "");
+
+		for (i = 0; i < npages; i += perChar) {
+			if ((i / perChar) % MAP_COLUMNS == 0)
+				printf("%s%10zx ", (i > 0) ? "\n" : "", i * pageSize);
+
+			n = (npages - i < perChar) ? npages - i : perChar;
+			putchar(mapChar(&nodes[i], n));
+		}
+		putchar('\n');
+	}
+
+	free(vec);
+	free(pages);
+	free(nodes);
+	free(status);
+
+	if (shmdt((void *) addr) == -1)
+		pexit("shmdt");
+}
+
 int
 main(int argc, char *argv[]) {
-	if (argc != 2)
-		helpAndExit(argv[0], EXIT_FAILURE);
-
 	struct shmid_ds data;
+	bool report = false, map = false;
 	char *endptr;
 	long shmid;
+	int opt;
 
-	shmid = strtol(argv[1], &endptr, 10);
+	while ((opt = getopt(argc, argv, "rmh")) != -1) {
+		switch (opt) {
+			case 'r': report = true; break;
+			case 'm': report = map = true; break;
+			case 'h': helpAndExit(argv[0], EXIT_SUCCESS); break;
+			default: helpAndExit(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	if (optind != argc - 1)
+		helpAndExit(argv[0], EXIT_FAILURE);
+
+	shmid = strtol(argv[optind], &endptr, 10);
 	if (shmid < 0 || shmid == LONG_MAX || *endptr != '\0')
 		fatal("id must be a number");
 
@@ -48,6 +198,9 @@ main(int argc, char *argv[]) {
 	printf("PID of creator: %ld\n", (long) data.shm_cpid);
 	printf("Processes attached: %ld\n", (long) data.shm_nattch);
 
+	if (report)
+		residency(shmid, data.shm_segsz, map);
+
 	exit(EXIT_SUCCESS);
 }
 
@@ -64,7 +217,7 @@ helpAndExit(const char *progname, int status) {
 	if (status == EXIT_FAILURE)
 		stream = stderr;
 
-	fprintf(stream, "Usage: %s [shared-memory-id]\n", progname);
+	fprintf(stream, "Usage: %s [-r] [-m] [shared-memory-id]\n", progname);
 	exit(status);
 }
 
@@ -7,9 +7,35 @@
  * order to do the copying, thus completely obviating the need for read(2)
  * and write(2).
  *
+ * Files are copied through a window that slides over both of them: a chunk of
+ * each is mapped at a time, and unmapped once copied, so that copying files larger
+ * than the address space (or than what the kernel is willing to overcommit) works,
+ * and no more memory than the window takes is used. The kernel is told the source
+ * is read sequentially, and to start reading each chunk right away; the pages of
+ * the destination are faulted in when it is mapped (MAP_POPULATE), rather than one
+ * by one as they are written to.
+ *
+ * The input file is read through safemap.h: if it is truncated while being copied,
+ * the copy fails with an error, instead of the program being killed by SIGBUS.
+ *
+ * For comparison, `-q depth` copies without mappings, through io_uring (see
+ * lib/uringcopy.h): each thread keeps up to `depth` reads and writes of its range
+ * in flight, rather than faulting pages in one at a time.
+ *
  * Usage
  *
- *    $ ./mmcp [src] [dst]
+ *    $ ./mmcp [-w MiB] [-j threads] [-q depth] [src] [dst]
+ *
+ *    -w: the size of the window, in MiB (default 64). With 0, both files are
+ *        mapped whole.
+ *    -j: the number of threads copying (default 1). The file is split into as
+ *        many ranges, each copied through windows of its own.
+ *    -q: copy with io_uring instead, with up to `depth` chunks in flight per
+ *        thread.
+ *
+ * Built along with safemap.c and uringcopy.c:
+ *
+ *    $ gcc -O2 -o mmcp mmcp.c safemap.c ../lib/uringcopy.c -pthread
  *
  * Author: Renato Mascarenhas Costa
  */
@@ -27,20 +53,51 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <errno.h>
+
+#include "safemap.h"
+#include "../lib/uringcopy.h"
+
+/* default size of the window the files are copied through */
+#ifndef MMCP_WINDOW
+#define MMCP_WINDOW (64 * 1024 * 1024)
+#endif
 
 static void helpAndExit(const char *progname, int status);
 static void pexit(const char *fCall);
+static void copyWindow(int srcfd, int dstfd, off_t offset, size_t len);
+static void *copyRange(void *arg);
+
+/* the part of the files a thread copies */
+struct range {
+	int srcfd, dstfd;
+	off_t start, end, window;
+	int depth;	/* of the io_uring each thread copies with, 0 for mappings */
+	pthread_t thread;
+};
 
 int
 main(int argc, char *argv[]) {
-	int srcfd, dstfd;
+	int srcfd, dstfd, opt, i, s, nthreads = 1, depth = 0;
 	struct stat st;
-	void *srcmem, *dstmem;
-
-	if (argc != 3)
+	struct range *ranges;
+	off_t rangeSize, window = MMCP_WINDOW;
+	long pageSize;
+
+	while ((opt = getopt(argc, argv, "w:j:q:")) != -1) {
+		switch (opt) {
+			case 'w': window = (off_t) strtol(optarg, NULL, 10) * 1024 * 1024; break;
+			case 'j': nthreads = (int) strtol(optarg, NULL, 10); break;
+			case 'q': depth = (int) strtol(optarg, NULL, 10); break;
+			default: helpAndExit(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	if (argc != optind + 2 || window < 0 || nthreads < 1 || depth < 0)
 		helpAndExit(argv[0], EXIT_FAILURE);
 
-	srcfd = open(argv[1], O_RDONLY);
+	srcfd = open(argv[optind], O_RDONLY);
 	if (srcfd == -1)
 		pexit("open");
 
@@ -48,28 +105,57 @@ main(int argc, char *argv[]) {
 	if (fstat(srcfd, &st) == -1)
 		pexit("fstat");
 
-	/* create memory mapping on the input file */
-	srcmem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, srcfd, 0);
-	if (srcmem == MAP_FAILED)
-		pexit("mmap");
-
 	/* open the output file and truncate it to the size of the input file */
-	dstfd = open(argv[2], O_CREAT | O_RDWR, st.st_mode); /* maintain permissions */
+	dstfd = open(argv[optind + 1], O_CREAT | O_RDWR, st.st_mode); /* maintain permissions */
 	if (dstfd == -1)
 		pexit("open");
 
 	if (ftruncate(dstfd, st.st_size) == -1)
 		pexit("ftruncate");
 
-	/* create a memory mapping for the output file - the mapping must be shared so
-	 * that changes in the block of memory are carried through the underlying file */
-	dstmem = mmap(NULL, st.st_size, PROT_WRITE, MAP_SHARED, dstfd, 0);
-	if (dstmem == MAP_FAILED)
-		pexit("mmap");
-
-	/* copies memory from the input file mapped memory to the output file
-	 * mapped memory */
-	memcpy(dstmem, srcmem, st.st_size);
+	/* mapping offsets must be multiples of the page size */
+	pageSize = sysconf(_SC_PAGESIZE);
+	if (window == 0 || window > st.st_size)
+		window = st.st_size;
+	else
+		window = (window + pageSize - 1) / pageSize * pageSize;
+
+	/* each thread copies a range of whole pages, the last one up to the end */
+	rangeSize = (st.st_size / nthreads + pageSize - 1) / pageSize * pageSize;
+	ranges = calloc(nthreads, sizeof(struct range));
+	if (ranges == NULL)
+		pexit("calloc");
+
+	for (i = 0; i < nthreads; i++) {
+		ranges[i].srcfd = srcfd;
+		ranges[i].dstfd = dstfd;
+		ranges[i].window = window;
+		ranges[i].depth = depth;
+		ranges[i].start = (i * rangeSize < st.st_size) ? i * rangeSize : st.st_size;
+		ranges[i].end = (i == nthreads - 1 || (i + 1) * rangeSize > st.st_size) ? st.st_size : (i + 1) * rangeSize;
+
+		if (nthreads == 1) {
+			copyRange(&ranges[i]);
+		} else if ((s = pthread_create(&ranges[i].thread, NULL, copyRange, &ranges[i])) != 0) {
+			errno = s;
+			pexit("pthread_create");
+		}
+	}
+
+	for (i = 0; nthreads > 1 && i < nthreads; i++) {
+		if ((s = pthread_join(ranges[i].thread, NULL)) != 0) {
+			errno = s;
+			pexit("pthread_join");
+		}
+	}
+
+	free(ranges);
+
+	/* makes sure the data is flushed to the output file before terminating. The
+	 * chunks already unmapped may not have been written out yet, but they are in
+	 * the page cache of the file */
+	if (fsync(dstfd) == -1)
+		pexit("fsync");
 
 	if (close(srcfd) == -1)
 		pexit("close");
@@ -77,17 +163,70 @@ main(int argc, char *argv[]) {
 	if (close(dstfd) == -1)
 		pexit("close");
 
-	if (munmap(srcmem, st.st_size) == -1)
-		pexit("munmap");
+	exit(EXIT_SUCCESS);
+}
+
+/* copies a range of the files, a window at a time (or through io_uring, with -q).
+ * Errors terminate the program */
+static void *
+copyRange(void *arg) {
+	struct range *r = arg;
+	struct uringCopy ring;
+	off_t offset;
+	size_t len;
+
+	if (r->depth > 0) {
+		if (uringCopyInit(&ring, r->depth, 0) == -1)
+			pexit("uringCopyInit");
+
+		if (uringCopyRange(&ring, r->srcfd, r->dstfd, r->start, r->end - r->start) == -1)
+			pexit("uringCopyRange");
+
+		uringCopyDestroy(&ring);
+		return NULL;
+	}
+
+	for (offset = r->start; offset < r->end; offset += len) {
+		len = (r->end - offset < r->window) ? (size_t) (r->end - offset) : (size_t) r->window;
+		copyWindow(r->srcfd, r->dstfd, offset, len);
+	}
+
+	return NULL;
+}
+
+/* copies `len` bytes at `offset` of the input file to the same place in the output
+ * file, mapping that part of each */
+static void
+copyWindow(int srcfd, int dstfd, off_t offset, size_t len) {
+	struct safeMap src;
+	void *dstmem;
+
+	/* create memory mapping on the input file, to be read from start to end */
+	if (safeMapOpen(&src, srcfd, offset, len) == -1)
+		pexit("mmap");
+
+	madvise(src.base, src.mapLength, MADV_SEQUENTIAL);
+	madvise(src.base, src.mapLength, MADV_WILLNEED);
 
-	/* makes sure the memory is flushed to the output file before terminating */
-	if (msync(dstmem, st.st_size, MS_SYNC) == -1)
-		pexit("msync");
+	/* create a memory mapping for the output file - the mapping must be shared so
+	 * that changes in the block of memory are carried through the underlying file */
+	dstmem = mmap(NULL, len, PROT_WRITE, MAP_SHARED | MAP_POPULATE, dstfd, offset);
+	if (dstmem == MAP_FAILED)
+		pexit("mmap");
 
-	if (munmap(dstmem, st.st_size) == -1)
+	/* copies memory from the input file mapped memory to the output file
+	 * mapped memory */
+	if (safeMapCopy(&src, 0, dstmem, len) == -1) {
+		fprintf(stderr, "mmcp: input file truncated at %lld while being copied\n",
+				(long long) (offset + src.valid));
+		exit(EXIT_FAILURE);
+	}
+
+	if (safeMapClose(&src) == -1)
 		pexit("munmap");
 
-	exit(EXIT_SUCCESS);
+	if (munmap(dstmem, len) == -1)
+		pexit("munmap");
 }
 
 static void
@@ -97,7 +236,7 @@ helpAndExit(const char *progname, int status) {
 	if (status == EXIT_SUCCESS)
 		stream = stdout;
 
-	fprintf(stream, "Usage: %s [src] [dst]\n", progname);
+	fprintf(stream, "Usage: %s [-w MiB] [-j threads] [-q depth] [src] [dst]\n", progname);
 	exit(status);
 }
 
@@ -16,10 +16,17 @@
  * (in the same way as depicted in Figure 49-5 of the Linux Programming
  * Interface book.)
  *
+ * The mapping is built with the functions of nlmap.h, which map any list of
+ * pages - coalescing them into as few mmap(2) calls as they can.
+ *
  * Usage
  *
  *    $ ./nlm [file]
  *
+ * Built along with nlmap.c:
+ *
+ *    $ gcc -o nlm nlm.c nlmap.c
+ *
  * Author: Renato Mascarenhas Costa
  */
 
@@ -32,6 +39,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "nlmap.h"
+
 /* number of bytes on each page to print. Should be sufficient to differentiate
  * one page from each other */
 #define NLM_PEEK_BYTES (10)
@@ -45,38 +54,29 @@ main(int argc, char *argv[]) {
 		helpAndExit(argv[0], EXIT_FAILURE);
 
 	int fd, i, j;
-	long pagesize;
-	char *mem, *p, buf[NLM_PEEK_BYTES + 1]; /* peek bytes + nul character */
+	long pagesize, calls;
+	char *p, buf[NLM_PEEK_BYTES + 1]; /* peek bytes + nul character */
+	struct nlMap map;
+
+	/* the 3rd page of the file first, then the 2nd, then the 1st */
+	struct nlPage pages[] = { { 2, 0 }, { 1, 1 }, { 0, 2 } };
 
 	fd = open(argv[1], O_RDONLY);
 	if (fd == -1)
 		pexit("open");
 
-	pagesize = sysconf(_SC_PAGESIZE);
-	if (pagesize == -1)
-		pexit("sysconf");
-
-	/* create an anonymous memory mapping, 3 pages long */
-	mem = mmap(NULL, 3*pagesize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
-	if (mem == MAP_FAILED)
-		pexit("mmap");
-
-	/* first memory mapping: maps the 3rd page of the underlying file */
-	if (mmap(mem, pagesize, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 2*pagesize) == MAP_FAILED)
-		pexit("mmap");
-
-	/* second memory mapping: map 2nd page of the underlying file */
-	if (mmap(mem + pagesize, pagesize, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, pagesize) == MAP_FAILED)
-		pexit("mmap");
+	/* reserve 3 pages of memory, and map the pages of the file there */
+	if (nlMapReserve(&map, fd, 3, PROT_READ, MAP_PRIVATE) == -1)
+		pexit("nlMapReserve");
+	pagesize = map.pageSize;
 
-	/* third memory mapping: map 1st page of the underlying file */
-	if (mmap(mem + (2*pagesize), pagesize, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
-		pexit("mmap");
+	if ((calls = nlMapPages(&map, pages, 3)) == -1)
+		pexit("nlMapPages");
 
 	/* Read first 3 pages on the mapped memory */
-	printf("On memory mapping:\n");
+	printf("On memory mapping (%ld mmap calls):\n", calls);
 	for (i = 0; i < 3; i++) {
-		p = mem + (i*pagesize);
+		p = nlMapSlot(&map, i);
 		printf("Page %d: ", i+1);
 
 		for (j = 0; j < NLM_PEEK_BYTES; j++)
@@ -0,0 +1,230 @@
+/* nlm_bench.c - reads scattered records of a file with pread(2) and in place.
+ *
+ * A large file indexed by record (a page each, here) is read at random: a
+ * number of records is picked, and each is read, by either
+ *
+ *    - pread(2), into a buffer of its own: a system call per record, and a copy
+ *      of each from the page cache; or
+ *    - mapping the records into consecutive slots of a non-linear mapping
+ *      (nlmap.h), and reading them where they are: a mmap(2) call per run of
+ *      consecutive records, and no copies - page faults instead, one per page,
+ *      unless the mapping is populated (-P).
+ *
+ * For reference, the records are also read from a mapping of the whole file,
+ * made once beforehand: what reading in place costs without building mappings.
+ *
+ * Reading a record sums the bytes read of it (`-b`, all of them by default): a
+ * lookup in a record usually only looks at a part of it, which is where not
+ * copying the rest matters. Records are picked with a fixed seed, so runs are
+ * comparable; with -s, the records picked are sorted, and runs of consecutive
+ * ones are mapped with a single call each. The file is read once before
+ * measuring, so that all read from the page cache.
+ *
+ * Usage
+ *
+ *    $ ./nlm_bench [-n records] [-r rounds] [-b bytes] [-s] [-P] file
+ *
+ *    -n: the records read each round (default: 4096).
+ *    -r: the rounds, each picking other records (default: 20).
+ *    -b: the bytes read of each record (default: a page).
+ *    -s: read the records picked in file order.
+ *    -P: populate the mapping (MAP_POPULATE) rather than faulting it in.
+ *
+ * Built along with nlmap.c:
+ *
+ *    $ gcc -O2 -o nlm_bench nlm_bench.c nlmap.c
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _DEFAULT_SOURCE /* MAP_POPULATE */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "nlmap.h"
+
+#define DEFAULT_RECORDS (4096)
+#define DEFAULT_ROUNDS (20)
+#define SEED (42)
+
+static void helpAndExit(const char *progname, int status);
+static void pexit(const char *fCall);
+static void fatal(const char *msg);
+
+static double
+now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+byFilePage(const void *a, const void *b) {
+	const struct nlPage *p = a, *q = b;
+
+	return (p->filePage > q->filePage) - (p->filePage < q->filePage);
+}
+
+/* what reading a record amounts to: summing the bytes looked at */
+static unsigned long
+consume(const unsigned char *record, long bytes) {
+	unsigned long sum = 0;
+	long i;
+
+	for (i = 0; i < bytes; ++i)
+		sum += record[i];
+
+	return sum;
+}
+
+/* picks the records of a round, in the slots they are read from */
+static void
+pick(struct nlPage *pages, long n, off_t filePages, bool sorted, unsigned int *seed) {
+	long i;
+
+	for (i = 0; i < n; ++i)
+		pages[i].filePage = ((off_t) rand_r(seed) * RAND_MAX + rand_r(seed)) % filePages;
+
+	if (sorted)
+		qsort(pages, n, sizeof(struct nlPage), byFilePage);
+
+	for (i = 0; i < n; ++i)
+		pages[i].slot = i;
+}
+
+int
+main(int argc, char *argv[]) {
+	long records = DEFAULT_RECORDS, rounds = DEFAULT_ROUNDS, bytes = 0, pageSize, i, r, calls = 0;
+	bool sorted = false, populate = false;
+	unsigned long preadSum = 0, mapSum = 0, fileSum = 0;
+	double preadTime = 0, mapTime = 0, fileTime = 0, start;
+	struct nlPage *pages, *wanted;
+	unsigned int seed = SEED;
+	unsigned char *buf, *file;
+	struct nlMap map;
+	off_t filePages;
+	struct stat sb;
+	int fd, opt;
+	long c;
+
+	while ((opt = getopt(argc, argv, "n:r:b:sPh")) != -1) {
+		switch (opt) {
+			case 'n': records = atol(optarg); break;
+			case 'r': rounds = atol(optarg); break;
+			case 'b': bytes = atol(optarg); break;
+			case 's': sorted = true; break;
+			case 'P': populate = true; break;
+			case 'h': helpAndExit(argv[0], EXIT_SUCCESS); break;
+			default: helpAndExit(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	if (optind != argc - 1 || records < 1 || rounds < 1 || bytes < 0)
+		helpAndExit(argv[0], EXIT_FAILURE);
+
+	if ((fd = open(argv[optind], O_RDONLY)) == -1)
+		pexit("open");
+	if (fstat(fd, &sb) == -1)
+		pexit("fstat");
+
+	pageSize = sysconf(_SC_PAGESIZE);
+	if (bytes == 0 || bytes > pageSize)
+		bytes = pageSize;
+
+	if ((filePages = sb.st_size / pageSize) == 0)
+		fatal("The file must be at least a page long");
+
+	if ((buf = malloc(records * pageSize)) == NULL || (pages = malloc(records * sizeof(struct nlPage))) == NULL ||
+	    (wanted = malloc(records * sizeof(struct nlPage))) == NULL)
+		pexit("malloc");
+
+	if (nlMapReserve(&map, fd, records, PROT_READ, MAP_SHARED | (populate ? MAP_POPULATE : 0)) == -1)
+		pexit("nlMapReserve");
+
+	file = mmap(NULL, filePages * pageSize, PROT_READ, MAP_SHARED | (populate ? MAP_POPULATE : 0), fd, 0);
+	if (file == MAP_FAILED)
+		pexit("mmap");
+
+	/* into the page cache */
+	for (i = 0; i < filePages; i += records)
+		if (pread(fd, buf, ((filePages - i < records) ? filePages - i : records) * pageSize, i * pageSize) == -1)
+			pexit("pread");
+
+	for (r = 0; r < rounds; ++r) {
+		pick(wanted, records, filePages, sorted, &seed);
+
+		start = now();
+		for (i = 0; i < records; ++i)
+			fileSum += consume(file + wanted[i].filePage * pageSize, bytes);
+		fileTime += now() - start;
+
+		start = now();
+		for (i = 0; i < records; ++i) {
+			if (pread(fd, buf + i * pageSize, pageSize, wanted[i].filePage * pageSize) != pageSize)
+				pexit("pread");
+			preadSum += consume(buf + i * pageSize, bytes);
+		}
+		preadTime += now() - start;
+
+		/* nlMapPages sorts the list it is given */
+		for (i = 0; i < records; ++i)
+			pages[i] = wanted[i];
+
+		start = now();
+		if ((c = nlMapPages(&map, pages, records)) == -1)
+			pexit("nlMapPages");
+		for (i = 0; i < records; ++i)
+			mapSum += consume(nlMapSlot(&map, i), bytes);
+		mapTime += now() - start;
+
+		calls += c;
+	}
+
+	if (preadSum != mapSum || preadSum != fileSum)
+		fatal("The records read differ");
+
+	printf("%ld rounds of %ld records (%ld of %ld bytes read of each), %s\n", rounds, records,
+			bytes, pageSize, sorted ? "in file order" : "at random");
+	printf("pread:   %8.1f ns per record\n", preadTime / (rounds * records) * 1e9);
+	printf("mapped:  %8.1f ns per record, %.1f mmap calls per round%s\n",
+			mapTime / (rounds * records) * 1e9, (double) calls / rounds, populate ? ", populated" : "");
+	printf("file:    %8.1f ns per record, the whole file mapped beforehand\n", fileTime / (rounds * records) * 1e9);
+
+	if (nlMapRelease(&map) == -1)
+		pexit("nlMapRelease");
+
+	exit(EXIT_SUCCESS);
+}
+
+static void
+helpAndExit(const char *progname, int status) {
+	FILE *stream = stderr;
+
+	if (status == EXIT_SUCCESS)
+		stream = stdout;
+
+	fprintf(stream, "Usage: %s [-n records] [-r rounds] [-b bytes] [-s] [-P] file\n", progname);
+	exit(status);
+}
+
+static void
+pexit(const char *fCall) {
+	perror(fCall);
+	exit(EXIT_FAILURE);
+}
+
+static void
+fatal(const char *msg) {
+	fprintf(stderr, "%s\n", msg);
+	exit(EXIT_FAILURE);
+}
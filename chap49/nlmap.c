@@ -0,0 +1,108 @@
+/* nlmap.c - non-linear mappings of files, built from any permutation of pages.
+ *
+ * See nlmap.h.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _DEFAULT_SOURCE /* MAP_ANONYMOUS, MAP_NORESERVE */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <stdlib.h>
+
+#include "nlmap.h"
+
+/* reserved slots: no access, and no memory accounted for them */
+#define RESERVE_PROT (PROT_NONE)
+#define RESERVE_FLAGS (MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE)
+
+static int
+bySlot(const void *a, const void *b) {
+	const struct nlPage *p = a, *q = b;
+
+	return (p->slot > q->slot) - (p->slot < q->slot);
+}
+
+int
+nlMapReserve(struct nlMap *map, int fd, size_t slots, int prot, int flags) {
+	if (slots == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((map->pageSize = sysconf(_SC_PAGESIZE)) == -1)
+		return -1;
+
+	map->base = mmap(NULL, slots * map->pageSize, RESERVE_PROT, RESERVE_FLAGS, -1, 0);
+	if (map->base == MAP_FAILED)
+		return -1;
+
+	map->slots = slots;
+	map->fd = fd;
+	map->prot = prot;
+	map->flags = flags;
+	return 0;
+}
+
+long
+nlMapPages(struct nlMap *map, struct nlPage *pages, size_t n) {
+	size_t i, start;
+	long calls = 0;
+
+	qsort(pages, n, sizeof(struct nlPage), bySlot);
+
+	for (i = 0; i < n; ++i) {
+		if (pages[i].slot >= map->slots || pages[i].filePage < 0 ||
+		    (i > 0 && pages[i].slot == pages[i - 1].slot)) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	for (start = 0; start < n; start = i) {
+		/* the longest run of slots and file pages, both consecutive */
+		for (i = start + 1; i < n; ++i) {
+			if (pages[i].slot != pages[i - 1].slot + 1 ||
+			    pages[i].filePage != pages[i - 1].filePage + 1)
+				break;
+		}
+
+		if (mmap(nlMapSlot(map, pages[start].slot), (i - start) * map->pageSize, map->prot,
+					map->flags | MAP_FIXED, map->fd, pages[start].filePage * map->pageSize) == MAP_FAILED)
+			return -1;
+		++calls;
+	}
+
+	return calls;
+}
+
+int
+nlMapClear(struct nlMap *map, size_t slot, size_t n) {
+	if (slot + n > map->slots || slot + n < slot) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (n == 0)
+		return 0;
+
+	if (mmap(nlMapSlot(map, slot), n * map->pageSize, RESERVE_PROT, RESERVE_FLAGS | MAP_FIXED,
+				-1, 0) == MAP_FAILED)
+		return -1;
+
+	return 0;
+}
+
+int
+nlMapRelease(struct nlMap *map) {
+	if (munmap(map->base, map->slots * map->pageSize) == -1)
+		return -1;
+
+	map->base = NULL;
+	map->slots = 0;
+	return 0;
+}
@@ -0,0 +1,76 @@
+/* nlmap.h - non-linear mappings of files, built from any permutation of pages.
+ *
+ * nlm.c builds a non-linear mapping by hand: an anonymous mapping reserves a
+ * range of the address space, and each page of the file is then mapped on top
+ * of it with MAP_FIXED. The functions here do the same for any number of pages:
+ * a range of `slots` pages is reserved once, and a list of (file page, slot)
+ * pairs is then mapped into it.
+ *
+ * Every mmap(2) call costs a system call and a VMA in the kernel, so pages are
+ * not mapped one by one: pairs are sorted by slot, and runs of consecutive
+ * slots mapping consecutive file pages are coalesced into a single call. A list
+ * of scattered records thus costs a call per record, while reading the pages
+ * of a file in order costs one.
+ *
+ * Mapped, records can be read in place - without being copied into a buffer
+ * first, as pread(2) would. Slots not mapped are left inaccessible: touching
+ * them raises SIGSEGV.
+ *
+ * Building a mapping is not cheap, though: a mmap(2) call and a page fault per
+ * run, and a TLB shootdown when a slot is mapped again. It pays off when the
+ * records stay mapped for many reads, or when they have to be seen as a single
+ * contiguous buffer; to read scattered records once, a mapping of the whole
+ * file is cheaper still (see nlm_bench.c).
+ *
+ * Programs using it are built along with nlmap.c:
+ *
+ *    $ gcc -O2 -o nlm_bench nlm_bench.c nlmap.c
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#ifndef NLMAP_H
+#define NLMAP_H
+
+#include <sys/types.h>
+#include <stddef.h>
+
+/* a range of the address space, `slots` pages long, mapping pages of `fd` */
+struct nlMap {
+	char *base;
+	size_t slots;
+	long pageSize;
+	int fd;
+	int prot;     /* PROT_READ, PROT_WRITE, as for mmap(2) */
+	int flags;    /* MAP_SHARED or MAP_PRIVATE, and MAP_POPULATE if wanted */
+};
+
+/* page `filePage` of the file (its offset over the page size), at `slot` */
+struct nlPage {
+	off_t filePage;
+	size_t slot;
+};
+
+/* reserves `slots` pages of the address space for pages of `fd`, mapped with
+ * `prot` and `flags`. Returns -1 on errors, with `errno` set */
+int nlMapReserve(struct nlMap *map, int fd, size_t slots, int prot, int flags);
+
+/* maps the `n` pages given, replacing whatever their slots mapped. `pages` is
+ * sorted by slot in place, and each slot must be given at most once. Returns
+ * the number of mmap(2) calls it took, or -1 on errors, with `errno` set (the
+ * pages mapped before the error stay so) */
+long nlMapPages(struct nlMap *map, struct nlPage *pages, size_t n);
+
+/* unmaps `n` slots, from `slot` on, leaving them reserved */
+int nlMapClear(struct nlMap *map, size_t slot, size_t n);
+
+/* releases the whole range */
+int nlMapRelease(struct nlMap *map);
+
+/* the address of a slot */
+static inline void *
+nlMapSlot(const struct nlMap *map, size_t slot) {
+	return map->base + slot * map->pageSize;
+}
+
+#endif
@@ -0,0 +1,157 @@
+/* safemap.c - reading mapped files that may be truncated while mapped.
+ *
+ * See safemap.h.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <errno.h>
+
+#include <string.h>
+
+#include "safemap.h"
+
+/* where a thread reading a mapping jumps back to, if the range it reads faults */
+struct recovery {
+	sigjmp_buf env;
+	const char *start, *end;
+	const char *fault;
+};
+
+static __thread struct recovery *volatile current;
+
+static pthread_once_t installOnce = PTHREAD_ONCE_INIT;
+static int installError;
+static struct sigaction previous;
+
+static void
+sigbusHandler(int sig, siginfo_t *info, void *ucontext) {
+	struct recovery *r = current;
+	const char *addr = info->si_addr;
+
+	if (r != NULL && addr >= r->start && addr < r->end) {
+		r->fault = addr;
+		siglongjmp(r->env, 1);
+	}
+
+	/* not a read of ours: as if this handler was not there */
+	if (previous.sa_flags & SA_SIGINFO) {
+		previous.sa_sigaction(sig, info, ucontext);
+	} else if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) {
+		previous.sa_handler(sig);
+	} else {
+		/* returning faults again, and the default action kills the process */
+		signal(SIGBUS, SIG_DFL);
+	}
+}
+
+static void
+install(void) {
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_sigaction = sigbusHandler;
+	sa.sa_flags = SA_SIGINFO;
+
+	if (sigaction(SIGBUS, &sa, &previous) == -1)
+		installError = errno;
+}
+
+int
+safeMapOpen(struct safeMap *map, int fd, off_t offset, size_t length) {
+	long pageSize = sysconf(_SC_PAGESIZE);
+	off_t start = offset / pageSize * pageSize;
+	struct stat st;
+
+	if (length == 0) {
+		if (fstat(fd, &st) == -1)
+			return -1;
+
+		if (st.st_size <= offset) {
+			errno = EINVAL;
+			return -1;
+		}
+		length = st.st_size - offset;
+	}
+
+	map->mapLength = length + (offset - start);
+	map->base = mmap(NULL, map->mapLength, PROT_READ, MAP_SHARED, fd, start);
+	if (map->base == MAP_FAILED)
+		return -1;
+
+	map->data = map->base + (offset - start);
+	map->length = map->valid = length;
+	return 0;
+}
+
+int
+safeMapClose(struct safeMap *map) {
+	return munmap(map->base, map->mapLength);
+}
+
+int
+safeMapRead(struct safeMap *map, size_t offset, size_t len, safeMapFn fn, void *arg) {
+	struct recovery r, *outer;
+	long pageSize;
+	int result;
+
+	if (offset > map->length || len > map->length - offset) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((errno = pthread_once(&installOnce, install)) != 0)
+		return -1;
+	if (installError != 0) {
+		errno = installError;
+		return -1;
+	}
+
+	outer = current;
+	r.start = map->data + offset;
+	r.end = r.start + len;
+
+	if (sigsetjmp(r.env, 1) != 0) {
+		current = outer;
+
+		/* the data ends where the page which faulted starts */
+		pageSize = sysconf(_SC_PAGESIZE);
+		map->valid = (r.fault - map->base) / pageSize * pageSize;
+		map->valid = (map->valid > (size_t) (map->data - map->base)) ? map->valid - (map->data - map->base) : 0;
+
+		errno = ENODATA;
+		return -1;
+	}
+
+	/* the reads of the mapping must not be moved out of the recovery point */
+	current = &r;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+	result = fn(r.start, len, arg);
+
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	current = outer;
+
+	return result;
+}
+
+static int
+copyTo(const char *data, size_t len, void *buf) {
+	memcpy(buf, data, len);
+	return 0;
+}
+
+int
+safeMapCopy(struct safeMap *map, size_t offset, void *buf, size_t len) {
+	return safeMapRead(map, offset, len, copyTo, buf);
+}
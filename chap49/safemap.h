@@ -0,0 +1,68 @@
+/* safemap.h - reading mapped files that may be truncated while mapped.
+ *
+ * As mmsignals.c shows, touching a page of a mapping past the end of the file
+ * raises SIGBUS. A file another process truncates (a log rotated, a file being
+ * rewritten) turns pages that were fine when mapped into such pages, and reading
+ * them kills the process - which is why mmap(2) is usually avoided for such
+ * files, and read(2) used instead.
+ *
+ * The functions here map a file, and read it under a recovery point: a SIGBUS
+ * handler, installed once for the process, checks whether the faulting address
+ * is in the range a thread is reading (each thread has its own recovery point),
+ * and if so, jumps back out of the read with siglongjmp(3), which then fails
+ * with ENODATA - truncation is an error, rather than a crash. SIGBUS raised
+ * elsewhere is passed on to the handler installed before, or kills the process
+ * as it would have.
+ *
+ * Reading in place is left to a function given: it is abandoned midway if the
+ * file turns out to be truncated, so it must not take locks, allocate memory, or
+ * otherwise leave state behind that a jump out of it would break. Copying is
+ * provided (safeMapCopy); so is any function only reading the data, or writing
+ * it out with write(2) - which fails with EFAULT on pages past the end instead.
+ *
+ * Programs using it are built along with safemap.c, and linked with -pthread:
+ *
+ *    $ gcc -O2 -o mmcp mmcp.c safemap.c -pthread
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#ifndef SAFEMAP_H
+#define SAFEMAP_H
+
+#include <sys/types.h>
+#include <stddef.h>
+
+/* `length` bytes of a file, at `data`, read-only */
+struct safeMap {
+	const char *data;
+	size_t length;
+	size_t valid;   /* bytes of `data` found to still be in the file by the last
+	                   read which failed with ENODATA; `length` until then */
+	char *base;     /* the mapping, from the page `data` is in */
+	size_t mapLength;
+};
+
+/* reads a range of a mapping in place: returns what the read returns */
+typedef int (*safeMapFn)(const char *data, size_t len, void *arg);
+
+/* maps `length` bytes of `fd` from `offset` (which need not be a multiple of the
+ * page size) - or up to the end of the file, if `length` is 0. Returns 0 on
+ * success, -1 on error, with `errno` set */
+int safeMapOpen(struct safeMap *map, int fd, off_t offset, size_t length);
+
+/* unmaps a file. Returns -1 on error, with `errno` set */
+int safeMapClose(struct safeMap *map);
+
+/* calls `fn` with `len` bytes of the mapping from `offset`, and `arg`, and returns
+ * what it returns. If the file is found to be truncated (a page in the range is
+ * past its end), `fn` is abandoned, and -1 returned with `errno` set to ENODATA.
+ * Returns -1 with EINVAL if the range is not in the mapping */
+int safeMapRead(struct safeMap *map, size_t offset, size_t len, safeMapFn fn, void *arg);
+
+/* copies `len` bytes of the mapping from `offset` to `buf`. Returns 0 on success,
+ * or -1 with `errno` set to ENODATA if the file is found to be truncated - the
+ * contents of `buf` are then unspecified, and map->valid says where it ends */
+int safeMapCopy(struct safeMap *map, size_t offset, void *buf, size_t len);
+
+#endif
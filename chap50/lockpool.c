@@ -0,0 +1,251 @@
+/* lockpool.c - buffers that never page-fault, from a pool locked at startup.
+ *
+ * See lockpool.h.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _DEFAULT_SOURCE /* MAP_ANONYMOUS */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lockpool.h"
+
+/* the pool lives at the start of its own region, so that all of it is locked */
+struct lockPool {
+	char *base;
+	size_t size, limit;
+	size_t carved;              /* from base on */
+	size_t allocated;           /* by lockPoolAlloc */
+	struct lockSlab *slabs;
+	pthread_mutex_t lock;       /* of the fields above */
+};
+
+struct lockSlab {
+	pthread_spinlock_t lock;
+	void *free;                 /* the first buffer given back: each holds the next */
+	size_t size, count, taken;
+	struct lockSlab *next;
+};
+
+static size_t
+alignUp(size_t n, size_t alignment) {
+	return (n + alignment - 1) / alignment * alignment;
+}
+
+/* the bytes the process has locked already, from /proc/self/status */
+static size_t
+lockedAlready(void) {
+	char line[BUFSIZ];
+	size_t kb = 0;
+	FILE *fp;
+
+	if ((fp = fopen("/proc/self/status", "r")) == NULL)
+		return 0;
+
+	while (fgets(line, BUFSIZ, fp) != NULL) {
+		if (sscanf(line, "VmLck: %zu kB", &kb) == 1)
+			break;
+	}
+
+	fclose(fp);
+	return kb * 1024;
+}
+
+/* carves `size` bytes from the pool. Called with the lock of the pool held */
+static void *
+carve(struct lockPool *pool, size_t size) {
+	size_t start = alignUp(pool->carved, LOCKPOOL_ALIGN);
+
+	if (start > pool->size || size > pool->size - start)
+		return NULL;
+
+	pool->carved = start + size;
+	return pool->base + start;
+}
+
+struct lockPool *
+lockPoolCreate(size_t size) {
+	long pageSize = sysconf(_SC_PAGESIZE);
+	struct lockPool *pool;
+	size_t limit = 0, budget;
+	struct rlimit rl;
+	char *base;
+	int s;
+
+	if (getrlimit(RLIMIT_MEMLOCK, &rl) == -1)
+		return NULL;
+
+	if (rl.rlim_cur != RLIM_INFINITY)
+		limit = rl.rlim_cur;
+
+	if (size == 0) {
+		if (limit == 0) {
+			size = LOCKPOOL_DEFAULT_SIZE;
+		} else {
+			budget = lockedAlready();
+			size = (budget < limit) ? (limit - budget) / pageSize * pageSize : 0;
+		}
+	}
+
+	size = alignUp(size, pageSize);
+	if (size < alignUp(sizeof(struct lockPool), LOCKPOOL_ALIGN)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	/* locking a writable private mapping faults in all of its pages, for
+	 * writing: none is left to fault later */
+	if (mlock(base, size) == -1) {
+		s = errno;
+		munmap(base, size);
+		errno = s;
+		return NULL;
+	}
+
+	pool = (struct lockPool *) base;
+	pool->base = base;
+	pool->size = size;
+	pool->limit = limit;
+	pool->carved = sizeof(struct lockPool);
+	pool->allocated = 0;
+	pool->slabs = NULL;
+
+	if ((s = pthread_mutex_init(&pool->lock, NULL)) != 0) {
+		munmap(base, size);
+		errno = s;
+		return NULL;
+	}
+
+	return pool;
+}
+
+void
+lockPoolDestroy(struct lockPool *pool) {
+	struct lockSlab *slab;
+
+	for (slab = pool->slabs; slab != NULL; slab = slab->next)
+		pthread_spin_destroy(&slab->lock);
+	pthread_mutex_destroy(&pool->lock);
+
+	/* unmapping unlocks too */
+	munmap(pool->base, pool->size);
+}
+
+void *
+lockPoolAlloc(struct lockPool *pool, size_t size) {
+	void *buf;
+
+	pthread_mutex_lock(&pool->lock);
+	if ((buf = carve(pool, size)) != NULL)
+		pool->allocated += size;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (buf == NULL)
+		errno = ENOMEM;
+	return buf;
+}
+
+struct lockSlab *
+lockSlabCreate(struct lockPool *pool, size_t size, size_t count) {
+	struct lockSlab *slab;
+	char *buffers;
+	size_t i, stride;
+
+	if (size == 0 || count == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* each buffer given back holds a pointer to the next */
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+	stride = alignUp(size, LOCKPOOL_ALIGN);
+
+	if (count > (SIZE_MAX - sizeof(struct lockSlab)) / stride - 1) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	slab = carve(pool, alignUp(sizeof(struct lockSlab), LOCKPOOL_ALIGN) + count * stride);
+	if (slab != NULL) {
+		slab->next = pool->slabs;
+		pool->slabs = slab;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (slab == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	pthread_spin_init(&slab->lock, PTHREAD_PROCESS_PRIVATE);
+	slab->size = stride;
+	slab->count = count;
+	slab->taken = 0;
+
+	/* the free list, in address order */
+	buffers = (char *) slab + alignUp(sizeof(struct lockSlab), LOCKPOOL_ALIGN);
+	for (i = 0; i < count; ++i)
+		*(void **) (buffers + i * stride) = (i + 1 < count) ? buffers + (i + 1) * stride : NULL;
+	slab->free = buffers;
+
+	return slab;
+}
+
+void *
+lockSlabGet(struct lockSlab *slab) {
+	void *buf;
+
+	pthread_spin_lock(&slab->lock);
+	if ((buf = slab->free) != NULL) {
+		slab->free = *(void **) buf;
+		++slab->taken;
+	}
+	pthread_spin_unlock(&slab->lock);
+
+	return buf;
+}
+
+void
+lockSlabPut(struct lockSlab *slab, void *buf) {
+	pthread_spin_lock(&slab->lock);
+	*(void **) buf = slab->free;
+	slab->free = buf;
+	--slab->taken;
+	pthread_spin_unlock(&slab->lock);
+}
+
+void
+lockPoolUsage(struct lockPool *pool, struct lockPoolUsage *usage) {
+	struct lockSlab *slab;
+
+	pthread_mutex_lock(&pool->lock);
+	usage->limit = pool->limit;
+	usage->locked = pool->size;
+	usage->carved = pool->carved;
+	usage->inUse = pool->allocated;
+
+	for (slab = pool->slabs; slab != NULL; slab = slab->next) {
+		pthread_spin_lock(&slab->lock);
+		usage->inUse += slab->taken * slab->size;
+		pthread_spin_unlock(&slab->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,76 @@
+/* lockpool.h - buffers that never page-fault, from a pool locked at startup.
+ *
+ * rlimit_memlock_demo.c shows that unprivileged processes can only lock so
+ * much memory. Locking buffers one by one, as they are allocated, also costs a
+ * mlock(2) call each (and the page faults it takes to bring them in), on
+ * whatever path allocates them - and fails as soon as the limit is reached.
+ *
+ * A pool instead locks a single region at startup, as large as the limit lets
+ * it (RLIMIT_MEMLOCK, less what the process has locked already). Locking a
+ * private mapping faults all its pages in, writable: from then on, buffers
+ * handed out from it are backed by memory, and touching them never takes a page
+ * fault - nor can they be swapped out.
+ *
+ * Buffers are handed out in two ways:
+ *
+ *    - lockPoolAlloc carves buffers for good, for memory set up once and kept
+ *      for the life of the process;
+ *    - slabs are carved from the pool with a number of buffers of a fixed
+ *      size, which can then be taken and given back in constant time, from any
+ *      thread (a spin lock per slab guards its free list).
+ *
+ * How much of the locked budget is used is told by lockPoolUsage.
+ *
+ * Programs using it are built along with lockpool.c, and linked with -pthread:
+ *
+ *    $ gcc -O2 -o lockpool_demo lockpool_demo.c lockpool.c -pthread
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#ifndef LOCKPOOL_H
+#define LOCKPOOL_H
+
+#include <stddef.h>
+
+/* the size of a pool when locked memory is not limited, and none is given */
+#define LOCKPOOL_DEFAULT_SIZE (64 * 1024 * 1024)
+
+/* buffers are aligned to cache lines, so that those of different threads do not
+ * share one */
+#define LOCKPOOL_ALIGN (64)
+
+struct lockPool;
+struct lockSlab;
+
+struct lockPoolUsage {
+	size_t limit;      /* RLIMIT_MEMLOCK; 0 if unlimited */
+	size_t locked;     /* the size of the pool */
+	size_t carved;     /* carved into buffers and slabs */
+	size_t inUse;      /* of that, buffers handed out and not given back */
+};
+
+/* locks a pool of `size` bytes (rounded up to pages), or as large as the limit
+ * lets it if 0. Returns NULL on errors (if the limit is too low, say), with
+ * `errno` set */
+struct lockPool *lockPoolCreate(size_t size);
+
+/* unlocks and releases a pool, and everything carved from it */
+void lockPoolDestroy(struct lockPool *pool);
+
+/* a buffer of `size` bytes, for good. NULL if the pool is exhausted */
+void *lockPoolAlloc(struct lockPool *pool, size_t size);
+
+/* a slab of `count` buffers of `size` bytes. NULL if the pool is exhausted */
+struct lockSlab *lockSlabCreate(struct lockPool *pool, size_t size, size_t count);
+
+/* a buffer of the slab, or NULL if all are taken */
+void *lockSlabGet(struct lockSlab *slab);
+
+/* gives back a buffer taken from the slab */
+void lockSlabPut(struct lockSlab *slab, void *buf);
+
+/* how much of the locked budget is used */
+void lockPoolUsage(struct lockPool *pool, struct lockPoolUsage *usage);
+
+#endif
@@ -0,0 +1,178 @@
+/* lockpool_demo.c - Demonstrates buffers handed out from a locked pool.
+ *
+ * A pool is locked as large as RLIMIT_MEMLOCK lets it (see lockpool.h), and a
+ * slab of fixed-size buffers is carved from half of it. Buffers are then taken,
+ * written to in full and given back, a number of times, at random: the page
+ * faults this takes are counted - none, as the pool was faulted in when locked
+ * - and the time each round trip took is reported.
+ *
+ * For comparison, once the pool is released, as many buffers as the slab had
+ * are allocated with malloc(3) and locked one by one with mlock(2): each costs
+ * a system call, and the page faults bringing its pages in. Buffers allocated
+ * once the limit is reached cannot be locked at all.
+ *
+ * Usage
+ *
+ *    $ ./lockpool_demo [-s KiB] [-b size] [-n rounds]
+ *
+ *    -s: the size of the pool, in KiB (default: as large as RLIMIT_MEMLOCK
+ *        lets it).
+ *    -b: the size of the buffers (default: 1024).
+ *    -n: the buffers taken and given back (default: 1000000).
+ *
+ * Built along with lockpool.c:
+ *
+ *    $ gcc -O2 -o lockpool_demo lockpool_demo.c lockpool.c -pthread
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lockpool.h"
+
+#define DEFAULT_BUFFER (1024)
+#define DEFAULT_ROUNDS (1000000)
+
+/* buffers held at a time */
+#define HELD (64)
+
+static void helpAndExit(const char *progname, int status);
+static void pexit(const char *fCall);
+
+static double
+now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long
+faultCount(void) {
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) == -1)
+		pexit("getrusage");
+
+	return usage.ru_minflt + usage.ru_majflt;
+}
+
+static void
+report(struct lockPool *pool) {
+	struct lockPoolUsage usage;
+
+	lockPoolUsage(pool, &usage);
+
+	if (usage.limit == 0)
+		printf("RLIMIT_MEMLOCK: unlimited");
+	else
+		printf("RLIMIT_MEMLOCK: %zu KiB", usage.limit / 1024);
+
+	printf("; locked: %zu KiB, carved: %zu KiB (%.1f%%), in use: %zu KiB (%.1f%%)\n",
+			usage.locked / 1024, usage.carved / 1024, 100.0 * usage.carved / usage.locked,
+			usage.inUse / 1024, 100.0 * usage.inUse / usage.locked);
+}
+
+int
+main(int argc, char *argv[]) {
+	long size = 0, bufSize = DEFAULT_BUFFER, rounds = DEFAULT_ROUNDS, faults, i, n;
+	void *held[HELD], *buf;
+	struct lockPoolUsage usage;
+	struct lockPool *pool;
+	struct lockSlab *slab;
+	unsigned int seed = 1;
+	double start;
+	int opt, slot;
+
+	while ((opt = getopt(argc, argv, "s:b:n:h")) != -1) {
+		switch (opt) {
+			case 's': size = atol(optarg) * 1024; break;
+			case 'b': bufSize = atol(optarg); break;
+			case 'n': rounds = atol(optarg); break;
+			case 'h': helpAndExit(argv[0], EXIT_SUCCESS); break;
+			default: helpAndExit(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	if (optind != argc || size < 0 || bufSize < 1 || rounds < 1)
+		helpAndExit(argv[0], EXIT_FAILURE);
+
+	if ((pool = lockPoolCreate(size)) == NULL)
+		pexit("lockPoolCreate");
+	report(pool);
+
+	lockPoolUsage(pool, &usage);
+	n = usage.locked / 2 / ((bufSize + LOCKPOOL_ALIGN - 1) / LOCKPOOL_ALIGN * LOCKPOOL_ALIGN);
+	if (n < HELD || (slab = lockSlabCreate(pool, bufSize, n)) == NULL) {
+		fprintf(stderr, "The pool is too small for %d buffers of %ld bytes\n", HELD, bufSize);
+		exit(EXIT_FAILURE);
+	}
+	printf("Slab of %ld buffers of %ld bytes\n", n, bufSize);
+
+	/* hold a few, and take and give back at random */
+	for (slot = 0; slot < HELD; ++slot)
+		held[slot] = lockSlabGet(slab);
+	report(pool);
+
+	faults = faultCount();
+	start = now();
+	for (i = 0; i < rounds; ++i) {
+		slot = rand_r(&seed) % HELD;
+		lockSlabPut(slab, held[slot]);
+
+		if ((held[slot] = lockSlabGet(slab)) == NULL) {
+			fprintf(stderr, "Out of buffers\n");
+			exit(EXIT_FAILURE);
+		}
+		memset(held[slot], (int) i, bufSize);
+	}
+	printf("%ld buffers taken, written and given back: %.1f ns each, %ld page faults\n",
+			rounds, (now() - start) / rounds * 1e9, faultCount() - faults);
+
+	/* and with malloc(3) and mlock(2), with the budget of the pool back */
+	lockPoolDestroy(pool);
+
+	faults = faultCount();
+	start = now();
+	for (i = 0; i < n; ++i) {
+		/* leaked on purpose: the process is about to exit */
+		if ((buf = malloc(bufSize)) == NULL)
+			pexit("malloc");
+
+		if (mlock(buf, bufSize) == -1)
+			break;
+	}
+
+	printf("malloc and mlock: %ld of %ld buffers locked%s%s, %.1f ns and %.2f page faults each\n",
+			i, n, (i < n) ? " before " : "", (i < n) ? strerror(errno) : "",
+			(i > 0) ? (now() - start) / i * 1e9 : 0.0, (i > 0) ? (double) (faultCount() - faults) / i : 0.0);
+
+	exit(EXIT_SUCCESS);
+}
+
+static void
+helpAndExit(const char *progname, int status) {
+	FILE *stream = stderr;
+
+	if (status == EXIT_SUCCESS)
+		stream = stdout;
+
+	fprintf(stream, "Usage: %s [-s KiB] [-b size] [-n rounds]\n", progname);
+	exit(status);
+}
+
+static void
+pexit(const char *fCall) {
+	perror(fCall);
+	exit(EXIT_FAILURE);
+}
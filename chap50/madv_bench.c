@@ -0,0 +1,298 @@
+/* madv_bench.c - compares the ways of giving memory back to the kernel.
+ *
+ * madv_dontneed.c shows what MADV_DONTNEED does to a private mapping of a file.
+ * Caches and memory allocators have several ways of returning memory they no
+ * longer need (but may need again), which differ in what the call costs, what
+ * touching the memory again costs, and when the memory actually stops counting
+ * towards the resident set of the process:
+ *
+ *    dontneed: madvise(MADV_DONTNEED). Pages are dropped right away: anonymous
+ *              ones are freed, and come back zero-filled on the next touch (a
+ *              page fault each); those of a shared file mapping are unmapped,
+ *              and faulted back in from the page cache.
+ *    free:     madvise(MADV_FREE), anonymous private memory only. Pages are
+ *              only freed if the kernel comes to need memory; until then they
+ *              stay resident, and writing to them again takes them back, with
+ *              no page faults.
+ *    cold:     madvise(MADV_COLD). Pages are only moved to the inactive lists,
+ *              to be reclaimed first under memory pressure. They stay mapped.
+ *    pageout:  madvise(MADV_PAGEOUT). Pages are reclaimed right away: written to
+ *              swap (or, if dirty, back to the file) - anonymous memory stays
+ *              resident when there is no swap.
+ *    remap:    munmap(2) and mmap(2) again: the pages and the mapping are gone,
+ *              and the memory comes back zero-filled (or from the page cache).
+ *
+ * Each strategy is measured on anonymous memory and on a shared mapping of a
+ * file, `size` MiB long: the memory is written to in full, the strategy applied,
+ * and written to in full again, over a number of rounds. The time the call took
+ * and the time writing the memory again took (with the page faults it caused)
+ * are reported, along with how much of the memory was still resident right
+ * after the call, and some time later (-w): pages given back lazily leave the
+ * resident set later, or only under memory pressure.
+ *
+ * The file is created (and removed) in the directory given, /tmp by default:
+ * where /tmp is a tmpfs, its pages are shared memory, and need swap to be paged
+ * out, as anonymous ones do.
+ *
+ * Usage
+ *
+ *    $ ./madv_bench [-s MiB] [-r rounds] [-w ms] [-d directory]
+ *
+ *    -s: the size of the memory, in MiB (default: 64).
+ *    -r: the rounds of each strategy (default: 5).
+ *    -w: how long to watch the resident set for after the call, in
+ *        milliseconds (default: 1000), in the first round.
+ *    -d: the directory to create the file in (default: /tmp).
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+/* get definition of madvise(2) */
+#define _BSD_SOURCE
+#define _DEFAULT_SOURCE /* newer versions of glibc */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+/* the advice of newer kernels, which older headers lack */
+#ifndef MADV_FREE
+#	define MADV_FREE (8)
+#endif
+#ifndef MADV_COLD
+#	define MADV_COLD (20)
+#endif
+#ifndef MADV_PAGEOUT
+#	define MADV_PAGEOUT (21)
+#endif
+
+#define DEFAULT_SIZE (64)
+#define DEFAULT_ROUNDS (5)
+#define DEFAULT_WATCH (1000)
+
+/* the resident set is sampled right after the call, and at these fractions of
+ * the time it is watched for */
+#define RSS_SAMPLES (3)
+static const int rssDivisors[RSS_SAMPLES] = { 100, 10, 1 };
+
+/* the advice for remapping, which is no advice */
+#define REMAP (-1)
+
+struct strategy {
+	const char *name;
+	int advice;
+};
+
+static const struct strategy strategies[] = {
+	{ "dontneed", MADV_DONTNEED },
+	{ "free",     MADV_FREE },
+	{ "cold",     MADV_COLD },
+	{ "pageout",  MADV_PAGEOUT },
+	{ "remap",    REMAP },
+};
+
+#define NSTRATEGIES (sizeof(strategies) / sizeof(strategies[0]))
+
+static void helpAndExit(const char *progname, int status);
+static void pexit(const char *fCall);
+
+static long pagesize;
+
+static double
+now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the resident set size of the process, in bytes */
+static long
+rss(void) {
+	long size, resident;
+	FILE *fp;
+
+	if ((fp = fopen("/proc/self/statm", "r")) == NULL)
+		pexit("fopen");
+
+	if (fscanf(fp, "%ld %ld", &size, &resident) != 2)
+		resident = 0;
+	fclose(fp);
+
+	return resident * pagesize;
+}
+
+/* the page faults taken so far, minor and major */
+static long
+faultCount(void) {
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) == -1)
+		pexit("getrusage");
+
+	return usage.ru_minflt + usage.ru_majflt;
+}
+
+/* maps the memory: anonymous if `fd` is -1 */
+static char *
+map(size_t len, int fd) {
+	char *mem;
+
+	if (fd == -1)
+		mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	else
+		mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (mem == MAP_FAILED)
+		pexit("mmap");
+
+	return mem;
+}
+
+/* writes to every page of the memory */
+static void
+touch(volatile char *mem, size_t len, int round) {
+	size_t off;
+
+	for (off = 0; off < len; off += pagesize)
+		mem[off] = (char) round;
+}
+
+/* measures a strategy on anonymous memory (`fd` is -1) or on a file. Returns
+ * false if the kernel does not support it */
+static bool
+measure(const struct strategy *strategy, size_t len, int fd, int rounds, long watch) {
+	double start, callTime = 0, refaultTime = 0;
+	long base, faults = 0, samples[RSS_SAMPLES + 1], f;
+	char *mem;
+	int r, i;
+
+	base = rss();
+	mem = map(len, fd);
+	touch(mem, len, 0);
+
+	for (r = 1; r <= rounds; ++r) {
+		start = now();
+		if (strategy->advice == REMAP) {
+			if (munmap(mem, len) == -1)
+				pexit("munmap");
+			mem = map(len, fd);
+		} else if (madvise(mem, len, strategy->advice) == -1) {
+			if (errno != EINVAL)
+				pexit("madvise");
+
+			munmap(mem, len);
+			return false;
+		}
+		callTime += now() - start;
+
+		if (r == 1) {
+			samples[0] = rss() - base;
+			for (i = 0; i < RSS_SAMPLES; ++i) {
+				usleep((watch * 1000 / rssDivisors[i]) - (i > 0 ? watch * 1000 / rssDivisors[i - 1] : 0));
+				samples[i + 1] = rss() - base;
+			}
+		}
+
+		f = faultCount();
+		start = now();
+		touch(mem, len, r);
+		refaultTime += now() - start;
+		faults += faultCount() - f;
+	}
+
+	printf("%-6s %-9s %10.1f %12.1f %10ld", (fd == -1) ? "anon" : "file", strategy->name,
+			callTime / rounds * 1e6, refaultTime / rounds * 1e6, faults / rounds);
+	for (i = 0; i <= RSS_SAMPLES; ++i)
+		printf(" %8.1f", samples[i] / (1024.0 * 1024));
+	printf("\n");
+
+	if (munmap(mem, len) == -1)
+		pexit("munmap");
+
+	return true;
+}
+
+int
+main(int argc, char *argv[]) {
+	long size = DEFAULT_SIZE, watch = DEFAULT_WATCH;
+	int rounds = DEFAULT_ROUNDS, opt, fd, kind;
+	char path[PATH_MAX], *dir = "/tmp", label[32];
+	size_t len, s;
+	int i;
+
+	while ((opt = getopt(argc, argv, "s:r:w:d:h")) != -1) {
+		switch (opt) {
+			case 's': size = atol(optarg); break;
+			case 'r': rounds = atoi(optarg); break;
+			case 'w': watch = atol(optarg); break;
+			case 'd': dir = optarg; break;
+			case 'h': helpAndExit(argv[0], EXIT_SUCCESS); break;
+			default: helpAndExit(argv[0], EXIT_FAILURE);
+		}
+	}
+
+	if (optind != argc || size < 1 || rounds < 1 || watch < 0)
+		helpAndExit(argv[0], EXIT_FAILURE);
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	if (pagesize == -1)
+		pexit("sysconf");
+
+	len = size * 1024 * 1024;
+
+	snprintf(path, PATH_MAX, "%s/madv_bench.XXXXXX", dir);
+	if ((fd = mkstemp(path)) == -1)
+		pexit("mkstemp");
+	unlink(path);
+
+	if (ftruncate(fd, len) == -1)
+		pexit("ftruncate");
+
+	printf("%ld MiB, %d rounds; MiB resident after the call, and some ms later\n", size, rounds);
+	printf("%-6s %-9s %10s %12s %10s %8s", "memory", "strategy", "call (us)", "refault (us)", "faults", "RSS");
+	for (i = 0; i < RSS_SAMPLES; ++i) {
+		snprintf(label, sizeof(label), "+%ldms", watch / rssDivisors[i]);
+		printf(" %8s", label);
+	}
+	printf("\n");
+
+	for (kind = 0; kind < 2; ++kind) {
+		for (s = 0; s < NSTRATEGIES; ++s) {
+			if (!measure(&strategies[s], len, kind ? fd : -1, rounds, watch))
+				printf("%-6s %-9s %10s\n", kind ? "file" : "anon", strategies[s].name, "unsupported");
+		}
+	}
+
+	close(fd);
+	exit(EXIT_SUCCESS);
+}
+
+static void
+helpAndExit(const char *progname, int status) {
+	FILE *stream = stderr;
+
+	if (status == EXIT_SUCCESS)
+		stream = stdout;
+
+	fprintf(stream, "Usage: %s [-s MiB] [-r rounds] [-w ms] [-d directory]\n", progname);
+	exit(status);
+}
+
+static void
+pexit(const char *fCall) {
+	perror(fCall);
+	exit(EXIT_FAILURE);
+}
@@ -0,0 +1,346 @@
+/* bench.c - A small harness for benchmarks of system calls. See bench.h.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _GNU_SOURCE /* sched_setaffinity and CPU_* macros */
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <errno.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "bench.h"
+
+#define CLOCK_SAMPLES (1000) /* runs timing the clock itself */
+
+static double
+elapsed(const struct timespec *start, const struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+static int
+compareSamples(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return (x > y) - (x < y);
+}
+
+/* the `q` quantile of sorted samples, interpolating between the closest two */
+static double
+quantile(const double *samples, long n, double q) {
+  double pos = q * (n - 1);
+  long i = (long) pos;
+
+  if (i + 1 >= n) {
+    return samples[n - 1];
+  }
+
+  return samples[i] + (pos - i) * (samples[i + 1] - samples[i]);
+}
+
+/* the median time between two consecutive clock readings */
+static double
+clockOverhead(void) {
+  double samples[CLOCK_SAMPLES];
+  struct timespec start, end;
+  int i;
+
+  for (i = 0; i < CLOCK_SAMPLES; ++i) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    samples[i] = elapsed(&start, &end);
+  }
+
+  qsort(samples, CLOCK_SAMPLES, sizeof(double), compareSamples);
+  return quantile(samples, CLOCK_SAMPLES, 0.5);
+}
+
+/* works out the statistics of the sorted samples of a benchmark */
+static void
+summarize(struct benchResult *result, const double *samples, long n) {
+  double q1, q3, low, high, sum = 0, squares = 0;
+  long i, kept = 0;
+
+  result->iterations = n;
+  result->min = samples[0];
+  result->max = samples[n - 1];
+  result->median = quantile(samples, n, 0.5);
+  result->p99 = quantile(samples, n, 0.99);
+
+  /* Tukey's fences, far out */
+  q1 = quantile(samples, n, 0.25);
+  q3 = quantile(samples, n, 0.75);
+  low = q1 - 3 * (q3 - q1);
+  high = q3 + 3 * (q3 - q1);
+
+  for (i = 0; i < n; ++i) {
+    if (samples[i] >= low && samples[i] <= high) {
+      sum += samples[i];
+      ++kept;
+    }
+  }
+
+  result->outliers = n - kept;
+  result->mean = sum / kept;
+
+  for (i = 0; i < n; ++i) {
+    if (samples[i] >= low && samples[i] <= high) {
+      squares += (samples[i] - result->mean) * (samples[i] - result->mean);
+    }
+  }
+
+  result->stddev = (kept > 1) ? sqrt(squares / (kept - 1)) : 0;
+}
+
+void
+benchInit(struct bench *bench, long iterations) {
+  memset(bench, 0, sizeof(struct bench));
+  bench->iterations = iterations;
+  bench->warmup = -1;
+  bench->cpu = -1;
+  bench->format = BENCH_TEXT;
+  bench->clockOverhead = -1;
+}
+
+int
+benchOption(struct bench *bench, int opt, const char *arg) {
+  switch (opt) {
+    case 'i':
+      bench->iterations = atol(arg);
+      return (bench->iterations > 0) ? 0 : -1;
+
+    case 'w':
+      bench->warmup = atol(arg);
+      return (bench->warmup >= 0) ? 0 : -1;
+
+    case 'c':
+      bench->cpu = atoi(arg);
+      return (bench->cpu >= 0 && bench->cpu < CPU_SETSIZE) ? 0 : -1;
+
+    case 'o':
+      if (!strcmp(arg, "text")) {
+        bench->format = BENCH_TEXT;
+      } else if (!strcmp(arg, "csv")) {
+        bench->format = BENCH_CSV;
+      } else if (!strcmp(arg, "json")) {
+        bench->format = BENCH_JSON;
+      } else {
+        return -1;
+      }
+      return 0;
+
+    default:
+      return -1;
+  }
+}
+
+int
+benchRun(struct bench *bench, const char *name, benchFn fn, void *arg) {
+  struct benchResult *result;
+  struct timespec start, end;
+  cpu_set_t cpus;
+  double *samples;
+  long i, warmup;
+
+  if (bench->count == BENCH_RESULTS_MAX) {
+    errno = ENOSPC;
+    return -1;
+  }
+
+  /* done once, before the first benchmark */
+  if (bench->clockOverhead < 0) {
+    if (bench->cpu >= 0) {
+      CPU_ZERO(&cpus);
+      CPU_SET(bench->cpu, &cpus);
+
+      if (sched_setaffinity(0, sizeof(cpu_set_t), &cpus) == -1) {
+        return -1;
+      }
+    }
+
+    bench->clockOverhead = clockOverhead();
+  }
+
+  samples = malloc(bench->iterations * sizeof(double));
+  if (samples == NULL) {
+    return -1;
+  }
+
+  warmup = (bench->warmup < 0) ? bench->iterations / 10 : bench->warmup;
+  for (i = 0; i < warmup; ++i) {
+    fn(arg);
+  }
+
+  for (i = 0; i < bench->iterations; ++i) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fn(arg);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    samples[i] = elapsed(&start, &end);
+  }
+
+  qsort(samples, bench->iterations, sizeof(double), compareSamples);
+
+  result = &bench->results[bench->count++];
+  result->name = name;
+  summarize(result, samples, bench->iterations);
+
+  free(samples);
+  return 0;
+}
+
+void
+benchReport(const struct bench *bench) {
+  const struct benchResult *r;
+  size_t i;
+
+  switch (bench->format) {
+    case BENCH_TEXT:
+      printf("%-24s %10s %10s %10s %10s %10s %10s %10s %8s\n", "benchmark", "iterations",
+             "min", "median", "p99", "max", "mean", "stddev", "outliers");
+
+      for (i = 0; i < bench->count; ++i) {
+        r = &bench->results[i];
+        printf("%-24s %10ld %10.0f %10.0f %10.0f %10.0f %10.0f %10.0f %8ld\n", r->name, r->iterations,
+               r->min, r->median, r->p99, r->max, r->mean, r->stddev, r->outliers);
+      }
+
+      printf("\n(times in ns, including %.0fns of clock overhead)\n", bench->clockOverhead);
+      break;
+
+    case BENCH_CSV:
+      printf("benchmark,iterations,min_ns,median_ns,p99_ns,max_ns,mean_ns,stddev_ns,outliers,clock_overhead_ns\n");
+
+      for (i = 0; i < bench->count; ++i) {
+        r = &bench->results[i];
+        printf("%s,%ld,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%ld,%.1f\n", r->name, r->iterations,
+               r->min, r->median, r->p99, r->max, r->mean, r->stddev, r->outliers,
+               bench->clockOverhead);
+      }
+      break;
+
+    case BENCH_JSON:
+      printf("{\"cpu\": %d, \"clock_overhead_ns\": %.1f, \"results\": [", bench->cpu, bench->clockOverhead);
+
+      for (i = 0; i < bench->count; ++i) {
+        r = &bench->results[i];
+        printf("%s\n  {\"benchmark\": \"%s\", \"iterations\": %ld, \"min_ns\": %.1f, \"median_ns\": %.1f, "
+               "\"p99_ns\": %.1f, \"max_ns\": %.1f, \"mean_ns\": %.1f, \"stddev_ns\": %.1f, \"outliers\": %ld}",
+               (i == 0) ? "" : ",", r->name, r->iterations, r->min, r->median, r->p99, r->max,
+               r->mean, r->stddev, r->outliers);
+      }
+
+      printf("\n]}\n");
+      break;
+  }
+}
+
+/* the smallest value of a bucket of a histogram */
+static uint64_t
+histValue(int index) {
+  int block = index >> BENCH_HIST_SUB_BITS;
+
+  if (block == 0) {
+    return (uint64_t) index;
+  }
+
+  return (uint64_t) (BENCH_HIST_SUB + (index & (BENCH_HIST_SUB - 1))) << (block - 1);
+}
+
+void
+benchHistAdd(uint64_t *hist, const uint64_t *from) {
+  int i;
+
+  for (i = 0; i < BENCH_HIST_BUCKETS; ++i) {
+    hist[i] += from[i];
+  }
+}
+
+uint64_t
+benchHistPercentile(const uint64_t *hist, uint64_t total, double p) {
+  uint64_t seen = 0, target;
+  int i;
+
+  target = (uint64_t) (total * p);
+  for (i = 0; i < BENCH_HIST_BUCKETS; ++i) {
+    seen += hist[i];
+    if (seen > target) {
+      return histValue(i);
+    }
+  }
+
+  return histValue(BENCH_HIST_BUCKETS - 1);
+}
+
+uint64_t
+benchHistMax(const uint64_t *hist) {
+  int i;
+
+  for (i = BENCH_HIST_BUCKETS - 1; i > 0; --i) {
+    if (hist[i] != 0) {
+      break;
+    }
+  }
+
+  return histValue(i);
+}
+
+uint64_t
+benchNowNs(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+int
+benchParseLong(const char *arg, long min, long max, long *n) {
+  char *end;
+
+  errno = 0;
+  *n = strtol(arg, &end, 10);
+  if (errno != 0 || end == arg || *end != '\0' || *n < min || *n > max) {
+    return -1;
+  }
+
+  return 0;
+}
+
+void *
+benchShared(size_t size) {
+  void *mem;
+
+  mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  return (mem == MAP_FAILED) ? NULL : mem;
+}
+
+void
+benchWaitStart(struct benchControl *control) {
+  while (!__atomic_load_n(&control->start, __ATOMIC_ACQUIRE)) {
+    ;
+  }
+}
+
+uint64_t
+benchStart(struct benchControl *control) {
+  uint64_t now = benchNowNs();
+
+  __atomic_store_n(&control->start, 1, __ATOMIC_RELEASE);
+  return now;
+}
+
+int
+benchStopped(struct benchControl *control) {
+  return __atomic_load_n(&control->stop, __ATOMIC_RELAXED);
+}
+
+void
+benchStop(struct benchControl *control) {
+  __atomic_store_n(&control->stop, 1, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,154 @@
+/* bench.h - A small harness for benchmarks of system calls.
+ *
+ * Benchmarks hand it a function performing the operation measured once, and it
+ * runs it a number of times - after some warm-up runs, which are not measured -
+ * timing every run with clock_gettime(CLOCK_MONOTONIC). The process can be pinned
+ * to a CPU, so that runs do not migrate between CPUs (and their caches).
+ *
+ * Timings of system calls have long tails - an interrupt, page faults, being
+ * scheduled out - so separate runs are best compared by their median and p99,
+ * which a few outliers hardly move. The mean and standard deviation given leave
+ * out the outliers: runs beyond three interquartile ranges of the middle half.
+ *
+ * The results of all the benchmarks of a program are printed together, as a
+ * table, CSV or JSON.
+ *
+ * Load generators - a number of processes (or threads) running operations for a
+ * while, rather than a single operation run a number of times - share the rest:
+ * each process records the latency of its operations in a log-linear histogram,
+ * added up with those of the others once the run is over, and the processes are
+ * started and stopped together through a struct benchControl, kept in memory
+ * shared with them.
+ *
+ * Programs using it are built along with bench.c, and linked with -lm:
+ *
+ *    $ gcc -o fchdir_bench fchdir_bench.c ../lib/bench.c -lm
+ *
+ * and take the options in BENCH_OPTIONS, handed to `benchOption` by getopt(3):
+ *
+ *    -i: the number of runs measured.
+ *    -w: the number of warm-up runs (default: a tenth of that).
+ *    -c: the CPU to pin the process to (default: none).
+ *    -o: the output format: text (the default), csv or json.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BENCH_OPTIONS "i:w:c:o:"
+#define BENCH_USAGE "[-i iterations] [-w warmup] [-c cpu] [-o text|csv|json]"
+
+#define BENCH_RESULTS_MAX (64)
+
+enum benchFormat { BENCH_TEXT, BENCH_CSV, BENCH_JSON };
+
+struct benchResult {
+  const char *name;
+  long iterations;
+  long outliers; /* runs left out of the mean and standard deviation */
+
+  /* in nanoseconds */
+  double min;
+  double median;
+  double p99;
+  double max;
+  double mean;
+  double stddev;
+};
+
+struct bench {
+  long iterations;
+  long warmup;            /* negative for the default */
+  int cpu;                /* negative for no pinning */
+  enum benchFormat format;
+
+  double clockOverhead;   /* of a clock_gettime(2) call, in nanoseconds; included in the timings */
+
+  struct benchResult results[BENCH_RESULTS_MAX];
+  size_t count;
+};
+
+/* the operation measured, run once per call */
+typedef void (*benchFn)(void *arg);
+
+/* initializes a harness, running `iterations` times by default */
+void benchInit(struct bench *bench, long iterations);
+
+/* handles an option of BENCH_OPTIONS, returned by getopt(3) along with `arg`.
+ * Returns -1 if the option is not one of them, or has an invalid argument */
+int benchOption(struct bench *bench, int opt, const char *arg);
+
+/* runs the benchmark `name` of `fn`, keeping its results. Returns -1 on errors,
+ * with `errno` set */
+int benchRun(struct bench *bench, const char *name, benchFn fn, void *arg);
+
+/* prints the results of all the benchmarks run, in the format chosen */
+void benchReport(const struct bench *bench);
+
+/* latency histograms: values below BENCH_HIST_SUB are exact, larger ones fall
+ * into one of BENCH_HIST_SUB buckets per power of two, so a value is off by less
+ * than 1/BENCH_HIST_SUB of itself */
+#define BENCH_HIST_SUB_BITS (4)
+#define BENCH_HIST_SUB (1 << BENCH_HIST_SUB_BITS)
+#define BENCH_HIST_BUCKETS (64 * BENCH_HIST_SUB)
+
+/* the bucket of a value. Defined here, since it is called for every operation
+ * timed */
+static inline int
+benchHistIndex(uint64_t v) {
+  int msb;
+
+  if (v < BENCH_HIST_SUB) {
+    return (int) v;
+  }
+
+  msb = 63 - __builtin_clzll(v);
+  return ((msb - BENCH_HIST_SUB_BITS + 1) << BENCH_HIST_SUB_BITS) +
+         (int) ((v >> (msb - BENCH_HIST_SUB_BITS)) & (BENCH_HIST_SUB - 1));
+}
+
+/* adds the counts of the histogram `from` to those of `hist` */
+void benchHistAdd(uint64_t *hist, const uint64_t *from);
+
+/* the value below which a fraction `p` of the `total` values of a histogram fall
+ * (the smallest one of its bucket) */
+uint64_t benchHistPercentile(const uint64_t *hist, uint64_t total, double p);
+
+/* the largest value of a histogram (the smallest one of its bucket) */
+uint64_t benchHistMax(const uint64_t *hist);
+
+/* CLOCK_MONOTONIC, in nanoseconds */
+uint64_t benchNowNs(void);
+
+/* parses `arg` as a number from `min` to `max` into `n`. Returns -1 if it is not
+ * one, or is out of range */
+int benchParseLong(const char *arg, long min, long max, long *n);
+
+/* the start and stop flags of a run. Processes forked before the run starts are
+ * to find it in a mapping shared with the parent, see benchShared */
+struct benchControl {
+  int start;
+  int stop;
+};
+
+/* `size` bytes of zeroed memory, shared with the children forked afterwards.
+ * Returns NULL on errors, with `errno` set */
+void *benchShared(size_t size);
+
+/* waits for the run to be started, spinning: processes have their CPU to
+ * themselves by then, or the run would not be worth measuring */
+void benchWaitStart(struct benchControl *control);
+
+/* starts the run, returning the time it started at */
+uint64_t benchStart(struct benchControl *control);
+
+/* whether the run was stopped, and stops it */
+int benchStopped(struct benchControl *control);
+void benchStop(struct benchControl *control);
+
+#endif
@@ -0,0 +1,153 @@
+/* closefds.c - Closes every file descriptor but a few, before exec. See
+ * closefds.h.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <errno.h>
+
+#include <stdint.h>
+
+#include "closefds.h"
+
+#ifndef SYS_close_range
+#  define SYS_close_range (436)
+#endif
+
+/* as returned by getdents64(2), which glibc has no wrapper for before 2.30 */
+struct dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+static int
+isKept(int fd, const int *keep, int nkeep) {
+  int i;
+
+  for (i = 0; i < nkeep; ++i) {
+    if (keep[i] == fd) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* closes the descriptors listed in CLOSEFDS_PROC_FD. Returns -1 if they could not
+ * be listed */
+static int
+closeListed(const int *keep, int nkeep) {
+  char buf[4096] __attribute__((aligned(8)));
+  struct dirent64 *d;
+  long numRead, pos;
+  int dirfd, fd;
+  char *p;
+
+  dirfd = open(CLOSEFDS_PROC_FD, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dirfd == -1) {
+    return -1;
+  }
+
+  /* the directory lists descriptors in order, carrying on from the number last
+   * listed: closing them as they come does not make it skip any */
+  while ((numRead = syscall(SYS_getdents64, dirfd, buf, sizeof(buf))) > 0) {
+    for (pos = 0; pos < numRead; pos += d->d_reclen) {
+      d = (struct dirent64 *) (buf + pos);
+
+      if (d->d_name[0] < '0' || d->d_name[0] > '9') {
+        continue; /* . and .. */
+      }
+
+      for (fd = 0, p = d->d_name; *p != '\0'; ++p) {
+        fd = fd * 10 + (*p - '0');
+      }
+
+      if (fd != dirfd && !isKept(fd, keep, nkeep)) {
+        close(fd);
+      }
+    }
+  }
+
+  close(dirfd);
+  return (numRead == -1) ? -1 : 0;
+}
+
+/* closes every descriptor below the soft RLIMIT_NOFILE, one at a time */
+static int
+closeAll(const int *keep, int nkeep) {
+  struct rlimit rl;
+  rlim_t fd;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+    return -1;
+  }
+
+  for (fd = 0; fd < rl.rlim_cur; ++fd) {
+    if (!isKept((int) fd, keep, nkeep)) {
+      close((int) fd);
+    }
+  }
+
+  return 0;
+}
+
+int
+closeFdsExcept(const int *keep, int nkeep) {
+  int sorted[CLOSEFDS_MAX_KEEP];
+  int i, j, n, fd;
+  unsigned int first, last;
+
+  if (nkeep < 0 || nkeep > CLOSEFDS_MAX_KEEP) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* the descriptors kept in ascending order, without duplicates or negative ones:
+   * the ranges to close are those between them */
+  n = 0;
+  for (i = 0; i < nkeep; ++i) {
+    fd = keep[i];
+    if (fd < 0 || isKept(fd, sorted, n)) {
+      continue;
+    }
+
+    for (j = n; j > 0 && sorted[j - 1] > fd; --j) {
+      sorted[j] = sorted[j - 1];
+    }
+    sorted[j] = fd;
+    ++n;
+  }
+
+  first = 0;
+  for (i = 0; i <= n; ++i) {
+    if (i < n && (unsigned int) sorted[i] == first) {
+      ++first;
+      continue;
+    }
+
+    last = (i < n) ? (unsigned int) sorted[i] - 1 : ~0U;
+    if (syscall(SYS_close_range, first, last, 0) == -1) {
+      /* ENOSYS before Linux 5.9; anything else, seccomp filters included, is
+       * handled the same way */
+      if (closeListed(sorted, n) == -1) {
+        return closeAll(sorted, n);
+      }
+      return 0;
+    }
+
+    if (i < n) {
+      first = sorted[i] + 1;
+    }
+  }
+
+  return 0;
+}
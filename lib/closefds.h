@@ -0,0 +1,42 @@
+/* closefds.h - Closes every file descriptor but a few, before exec.
+ *
+ * A process about to exec a program (or to become a daemon) should not pass it
+ * the descriptors it happens to have open: they leak files, sockets and pipes
+ * the program knows nothing about, and keep pipes from ever reaching end of file.
+ * The usual way of closing them, calling close(2) on every number up to the limit
+ * of open files, takes as many system calls as the limit: with RLIMIT_NOFILE
+ * raised to a million, as container runtimes and servers often do, that is a
+ * million system calls, however few descriptors are actually open.
+ *
+ * This closes every descriptor not in a list of those to keep with close_range(2),
+ * a system call per range between the descriptors kept: keeping the standard
+ * streams takes a single one. On kernels without close_range(2) (before Linux
+ * 5.9), the open descriptors are listed from CLOSEFDS_PROC_FD, and only those are
+ * closed. Only when neither works is close(2) called up to the soft RLIMIT_NOFILE.
+ *
+ * Nothing here allocates memory or takes a lock, so it can be called in the child
+ * of a multithreaded process, between fork(2) and exec.
+ *
+ * Programs using it are built along with closefds.c:
+ *
+ *    $ gcc -o douser douser.c ../lib/closefds.c -lcrypt
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#ifndef CLOSEFDS_H
+#define CLOSEFDS_H
+
+#ifndef CLOSEFDS_PROC_FD
+#  define CLOSEFDS_PROC_FD ("/proc/self/fd")
+#endif
+
+/* the most descriptors that can be kept */
+#define CLOSEFDS_MAX_KEEP (64)
+
+/* closes every open descriptor except the `nkeep` ones in `keep` (in any order).
+ * Returns -1 on error, with `errno` set (EINVAL if more than CLOSEFDS_MAX_KEEP
+ * are to be kept); descriptors may have been closed nonetheless */
+int closeFdsExcept(const int *keep, int nkeep);
+
+#endif
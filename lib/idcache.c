@@ -0,0 +1,501 @@
+/* idcache.c - A cache of the user and group databases. See idcache.h.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _DEFAULT_SOURCE /* getpwent and getgrent families of functions */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pwd.h>
+#include <grp.h>
+#include <errno.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "idcache.h"
+
+/* open addressing hash table of the indices of entries, plus one (0 marks a
+ * free slot). The capacity is a power of two, at least twice the entries */
+struct index {
+  size_t *slots;
+  size_t capacity;
+};
+
+/* a user, and the groups it is listed as a member of */
+struct member {
+  char *name;
+  gid_t *gids;
+  size_t count;
+  size_t capacity;
+};
+
+/* the stat(2) of the file a database was read from, to tell when it changes */
+struct source {
+  const char *file;
+  int loaded;
+  int exists;
+  struct stat st;
+};
+
+static struct {
+  struct source source;
+  struct passwd *entries;
+  size_t count;
+  struct index byName, byId;
+} users = { { IDCACHE_PASSWD_FILE, 0, 0, { 0 } }, NULL, 0, { NULL, 0 }, { NULL, 0 } };
+
+static struct {
+  struct source source;
+  struct group *entries;
+  size_t count;
+  struct index byName, byId;
+
+  struct member *members;
+  size_t membersCount;
+  struct index byMember;
+} groups = { { IDCACHE_GROUP_FILE, 0, 0, { 0 } }, NULL, 0, { NULL, 0 }, { NULL, 0 }, NULL, 0, { NULL, 0 } };
+
+/* whether entry `i` of a table has the key looked up */
+typedef int (*matchFn)(size_t i, const void *key);
+
+static size_t
+hashName(const char *name) {
+  size_t h = 2166136261u;
+
+  /* FNV-1a */
+  for (; *name != '\0'; ++name) {
+    h = (h ^ (unsigned char) *name) * 16777619u;
+  }
+
+  return h;
+}
+
+static size_t
+hashId(unsigned long id) {
+  return id * 2654435761u;
+}
+
+static int
+initIndex(struct index *index, size_t count) {
+  index->capacity = 16;
+  while (index->capacity < 2 * count) {
+    index->capacity *= 2;
+  }
+
+  index->slots = calloc(index->capacity, sizeof(size_t));
+  return (index->slots == NULL) ? -1 : 0;
+}
+
+/* the slot of the entry with `key` in the index, or the free one where it would go */
+static size_t *
+findSlot(const struct index *index, size_t hash, matchFn match, const void *key) {
+  size_t i = hash & (index->capacity - 1);
+
+  while (index->slots[i] != 0 && !match(index->slots[i] - 1, key)) {
+    i = (i + 1) & (index->capacity - 1);
+  }
+
+  return &index->slots[i];
+}
+
+/* adds entry `i` to the index, unless one with the same key is there already:
+ * the first entry of a database takes precedence, as when scanning it */
+static void
+addToIndex(struct index *index, size_t hash, matchFn match, const void *key, size_t i) {
+  size_t *slot = findSlot(index, hash, match, key);
+
+  if (*slot == 0) {
+    *slot = i + 1;
+  }
+}
+
+static int userNameMatches(size_t i, const void *key) { return strcmp(users.entries[i].pw_name, key) == 0; }
+static int userIdMatches(size_t i, const void *key) { return users.entries[i].pw_uid == *(const uid_t *) key; }
+static int groupNameMatches(size_t i, const void *key) { return strcmp(groups.entries[i].gr_name, key) == 0; }
+static int groupIdMatches(size_t i, const void *key) { return groups.entries[i].gr_gid == *(const gid_t *) key; }
+static int memberMatches(size_t i, const void *key) { return strcmp(groups.members[i].name, key) == 0; }
+
+/* whether the database needs to be read (again). Returns -1 on errors */
+static int
+isStale(struct source *source) {
+  struct stat st;
+  int stale;
+
+  if (stat(source->file, &st) == -1) {
+    if (errno != ENOENT) {
+      return -1;
+    }
+
+    /* the database comes from somewhere else: read it once */
+    stale = !source->loaded || source->exists;
+    source->exists = 0;
+    return stale;
+  }
+
+  if (source->loaded && source->exists && st.st_ino == source->st.st_ino && st.st_size == source->st.st_size &&
+      st.st_mtim.tv_sec == source->st.st_mtim.tv_sec && st.st_mtim.tv_nsec == source->st.st_mtim.tv_nsec) {
+    return 0;
+  }
+
+  source->st = st;
+  source->exists = 1;
+  return 1;
+}
+
+static void
+freeUsers() {
+  size_t i;
+
+  for (i = 0; i < users.count; ++i) {
+    free(users.entries[i].pw_name);
+    free(users.entries[i].pw_passwd);
+    free(users.entries[i].pw_gecos);
+    free(users.entries[i].pw_dir);
+    free(users.entries[i].pw_shell);
+  }
+
+  free(users.entries);
+  free(users.byName.slots);
+  free(users.byId.slots);
+
+  users.entries = NULL;
+  users.count = 0;
+  users.byName.slots = users.byId.slots = NULL;
+  users.source.loaded = 0;
+}
+
+static void
+freeGroups() {
+  size_t i;
+  char **m;
+
+  for (i = 0; i < groups.count; ++i) {
+    free(groups.entries[i].gr_name);
+    free(groups.entries[i].gr_passwd);
+
+    /* NULL if the group could not be read in full */
+    if (groups.entries[i].gr_mem != NULL) {
+      for (m = groups.entries[i].gr_mem; *m != NULL; ++m) {
+        free(*m);
+      }
+      free(groups.entries[i].gr_mem);
+    }
+  }
+
+  for (i = 0; i < groups.membersCount; ++i) {
+    free(groups.members[i].name);
+    free(groups.members[i].gids);
+  }
+
+  free(groups.entries);
+  free(groups.members);
+  free(groups.byName.slots);
+  free(groups.byId.slots);
+  free(groups.byMember.slots);
+
+  groups.entries = NULL;
+  groups.members = NULL;
+  groups.count = groups.membersCount = 0;
+  groups.byName.slots = groups.byId.slots = groups.byMember.slots = NULL;
+  groups.source.loaded = 0;
+}
+
+static int
+loadUsers() {
+  struct passwd *p, *entries;
+  size_t i, capacity = 0;
+  int savedErrno;
+
+  freeUsers();
+
+  setpwent();
+  for (errno = 0; (p = getpwent()) != NULL; errno = 0) {
+    if (users.count == capacity) {
+      capacity = (capacity == 0) ? 64 : 2 * capacity;
+      entries = realloc(users.entries, capacity * sizeof(struct passwd));
+      if (entries == NULL) {
+        goto fail;
+      }
+      users.entries = entries;
+    }
+
+    users.entries[users.count] = *p;
+    users.entries[users.count].pw_name = strdup(p->pw_name);
+    users.entries[users.count].pw_passwd = strdup(p->pw_passwd);
+    users.entries[users.count].pw_gecos = strdup(p->pw_gecos);
+    users.entries[users.count].pw_dir = strdup(p->pw_dir);
+    users.entries[users.count].pw_shell = strdup(p->pw_shell);
+    ++users.count;
+
+    p = &users.entries[users.count - 1];
+    if (p->pw_name == NULL || p->pw_passwd == NULL || p->pw_gecos == NULL || p->pw_dir == NULL || p->pw_shell == NULL) {
+      goto fail;
+    }
+  }
+
+  /* the end of the database, rather than an error */
+  if (errno == ENOENT) {
+    errno = 0;
+  }
+  if (errno != 0) {
+    goto fail;
+  }
+  endpwent();
+
+  if (initIndex(&users.byName, users.count) == -1 || initIndex(&users.byId, users.count) == -1) {
+    freeUsers();
+    return -1;
+  }
+
+  for (i = 0; i < users.count; ++i) {
+    p = &users.entries[i];
+    addToIndex(&users.byName, hashName(p->pw_name), userNameMatches, p->pw_name, i);
+    addToIndex(&users.byId, hashId(p->pw_uid), userIdMatches, &p->pw_uid, i);
+  }
+
+  users.source.loaded = 1;
+  return 0;
+
+fail:
+  savedErrno = errno;
+  endpwent();
+  freeUsers();
+  errno = savedErrno;
+  return -1;
+}
+
+/* adds `gid` to the groups of `name` */
+static int
+addMembership(const char *name, gid_t gid, size_t *membersCapacity) {
+  struct member *member, *members;
+  size_t *slot;
+  gid_t *gids;
+
+  /* the index is sized for every membership, being one user per group at worst */
+  slot = findSlot(&groups.byMember, hashName(name), memberMatches, name);
+  if (*slot == 0) {
+    if (groups.membersCount == *membersCapacity) {
+      *membersCapacity = (*membersCapacity == 0) ? 64 : 2 * *membersCapacity;
+      members = realloc(groups.members, *membersCapacity * sizeof(struct member));
+      if (members == NULL) {
+        return -1;
+      }
+      groups.members = members;
+    }
+
+    member = &groups.members[groups.membersCount];
+    memset(member, 0, sizeof(struct member));
+    member->name = strdup(name);
+    if (member->name == NULL) {
+      return -1;
+    }
+
+    *slot = ++groups.membersCount;
+  }
+
+  member = &groups.members[*slot - 1];
+
+  /* listed twice in the same group */
+  if (member->count > 0 && member->gids[member->count - 1] == gid) {
+    return 0;
+  }
+
+  if (member->count == member->capacity) {
+    member->capacity = (member->capacity == 0) ? 4 : 2 * member->capacity;
+    gids = realloc(member->gids, member->capacity * sizeof(gid_t));
+    if (gids == NULL) {
+      return -1;
+    }
+    member->gids = gids;
+  }
+
+  member->gids[member->count++] = gid;
+  return 0;
+}
+
+static int
+loadGroups() {
+  struct group *g, *entries, *copy;
+  size_t i, n, memberships = 0, capacity = 0, membersCapacity = 0;
+  char **m;
+  int savedErrno;
+
+  freeGroups();
+
+  setgrent();
+  for (errno = 0; (g = getgrent()) != NULL; errno = 0) {
+    if (groups.count == capacity) {
+      capacity = (capacity == 0) ? 64 : 2 * capacity;
+      entries = realloc(groups.entries, capacity * sizeof(struct group));
+      if (entries == NULL) {
+        goto fail;
+      }
+      groups.entries = entries;
+    }
+
+    for (n = 0; g->gr_mem[n] != NULL; ++n)
+      ;
+
+    copy = &groups.entries[groups.count++];
+    copy->gr_gid = g->gr_gid;
+    copy->gr_name = strdup(g->gr_name);
+    copy->gr_passwd = strdup(g->gr_passwd);
+    copy->gr_mem = calloc(n + 1, sizeof(char *));
+    if (copy->gr_name == NULL || copy->gr_passwd == NULL || copy->gr_mem == NULL) {
+      goto fail;
+    }
+
+    for (i = 0; i < n; ++i) {
+      copy->gr_mem[i] = strdup(g->gr_mem[i]);
+      if (copy->gr_mem[i] == NULL) {
+        goto fail;
+      }
+    }
+
+    memberships += n;
+  }
+
+  if (errno == ENOENT) {
+    errno = 0;
+  }
+  if (errno != 0) {
+    goto fail;
+  }
+  endgrent();
+
+  if (initIndex(&groups.byName, groups.count) == -1 || initIndex(&groups.byId, groups.count) == -1 ||
+      initIndex(&groups.byMember, memberships) == -1) {
+    freeGroups();
+    return -1;
+  }
+
+  for (i = 0; i < groups.count; ++i) {
+    g = &groups.entries[i];
+    addToIndex(&groups.byName, hashName(g->gr_name), groupNameMatches, g->gr_name, i);
+    addToIndex(&groups.byId, hashId(g->gr_gid), groupIdMatches, &g->gr_gid, i);
+
+    for (m = g->gr_mem; *m != NULL; ++m) {
+      if (addMembership(*m, g->gr_gid, &membersCapacity) == -1) {
+        freeGroups();
+        return -1;
+      }
+    }
+  }
+
+  groups.source.loaded = 1;
+  return 0;
+
+fail:
+  savedErrno = errno;
+  endgrent();
+  freeGroups();
+  errno = savedErrno;
+  return -1;
+}
+
+/* makes sure the users are read, and up to date. Returns -1 on errors */
+static int
+checkUsers() {
+  int stale = isStale(&users.source);
+
+  if (stale == -1) {
+    return -1;
+  }
+
+  return stale ? loadUsers() : 0;
+}
+
+static int
+checkGroups() {
+  int stale = isStale(&groups.source);
+
+  if (stale == -1) {
+    return -1;
+  }
+
+  return stale ? loadGroups() : 0;
+}
+
+struct passwd *
+idcacheUserByName(const char *name) {
+  size_t *slot;
+
+  if (checkUsers() == -1) {
+    return NULL;
+  }
+
+  slot = findSlot(&users.byName, hashName(name), userNameMatches, name);
+  errno = 0;
+  return (*slot == 0) ? NULL : &users.entries[*slot - 1];
+}
+
+struct passwd *
+idcacheUserById(uid_t uid) {
+  size_t *slot;
+
+  if (checkUsers() == -1) {
+    return NULL;
+  }
+
+  slot = findSlot(&users.byId, hashId(uid), userIdMatches, &uid);
+  errno = 0;
+  return (*slot == 0) ? NULL : &users.entries[*slot - 1];
+}
+
+struct group *
+idcacheGroupByName(const char *name) {
+  size_t *slot;
+
+  if (checkGroups() == -1) {
+    return NULL;
+  }
+
+  slot = findSlot(&groups.byName, hashName(name), groupNameMatches, name);
+  errno = 0;
+  return (*slot == 0) ? NULL : &groups.entries[*slot - 1];
+}
+
+struct group *
+idcacheGroupById(gid_t gid) {
+  size_t *slot;
+
+  if (checkGroups() == -1) {
+    return NULL;
+  }
+
+  slot = findSlot(&groups.byId, hashId(gid), groupIdMatches, &gid);
+  errno = 0;
+  return (*slot == 0) ? NULL : &groups.entries[*slot - 1];
+}
+
+int
+idcacheUserGroups(const char *user, gid_t *groupsList, int size) {
+  struct member *member;
+  size_t *slot;
+
+  if (checkGroups() == -1) {
+    return -1;
+  }
+
+  slot = findSlot(&groups.byMember, hashName(user), memberMatches, user);
+  if (*slot == 0) {
+    return 0;
+  }
+
+  member = &groups.members[*slot - 1];
+  if (member->count > (size_t) size) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  memcpy(groupsList, member->gids, member->count * sizeof(gid_t));
+  return (int) member->count;
+}
+
+void
+idcacheFlush(void) {
+  freeUsers();
+  freeGroups();
+}
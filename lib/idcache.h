@@ -0,0 +1,64 @@
+/* idcache.h - A cache of the user and group databases.
+ *
+ * Looking up a user or a group with the getpwent(3) and getgrent(3) families
+ * of functions means scanning the whole database, and so does finding all the
+ * groups a user is a member of: resolving many users this way takes time
+ * proportional to the number of users times the size of the database.
+ *
+ * This reads each database once - still with getpwent(3) and getgrent(3), so
+ * that it works whatever the source of the databases is - into hash tables:
+ * users by name and by ID, groups by name and by ID, and the groups of each user
+ * (an inverted index of the members of every group). Lookups are then constant
+ * time.
+ *
+ * The cache is kept up to date with the files the databases usually come from
+ * (IDCACHE_PASSWD_FILE and IDCACHE_GROUP_FILE): every lookup stat(2)s the file,
+ * and reads the database again if it changed since it was read. If the file does
+ * not exist, the database is read once.
+ *
+ * As with getpwnam(3) and friends, the entries returned are not to be modified,
+ * and are only valid until the next lookup, which may read the database again.
+ * Lookups return NULL, with `errno` set to zero, for entries that do not exist;
+ * if the database could not be read, `errno` tells the error.
+ *
+ * Programs using it are built along with idcache.c:
+ *
+ *    $ gcc -o getpwnam getpwnam.c ../lib/idcache.c
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#ifndef IDCACHE_H
+#define IDCACHE_H
+
+#include <sys/types.h>
+#include <pwd.h>
+#include <grp.h>
+
+#ifndef IDCACHE_PASSWD_FILE
+#  define IDCACHE_PASSWD_FILE ("/etc/passwd")
+#endif
+
+#ifndef IDCACHE_GROUP_FILE
+#  define IDCACHE_GROUP_FILE ("/etc/group")
+#endif
+
+/* looks up a user by name, or by user ID */
+struct passwd *idcacheUserByName(const char *name);
+struct passwd *idcacheUserById(uid_t uid);
+
+/* looks up a group by name, or by group ID */
+struct group *idcacheGroupByName(const char *name);
+struct group *idcacheGroupById(gid_t gid);
+
+/* stores in `groups` (of `size` elements) the IDs of the groups `user` is listed
+ * as a member of, in the order of the group database.
+ *
+ * Returns the number of groups stored on success, or -1 on error - with ENOMEM if
+ * the user is a member of more than `size` groups. */
+int idcacheUserGroups(const char *user, gid_t *groups, int size);
+
+/* drops the cache, which is read again on the next lookup */
+void idcacheFlush(void);
+
+#endif
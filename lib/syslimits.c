@@ -0,0 +1,145 @@
+/* syslimits.c - A snapshot of the system limits tools size their data by. See
+ * syslimits.h.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <errno.h>
+
+#include <stdlib.h>
+
+#include "syslimits.h"
+
+/* the _PC_* names cached: glibc numbers them from 0 */
+#define PC_NAMES (32)
+
+/* the limits of a descriptor: `known` has bit n set if `values[n]` is cached */
+struct fdLimits {
+  unsigned int known;
+  long values[PC_NAMES];
+};
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sysLimits limits;
+
+static struct fdLimits *fdLimits[SYSLIMITS_MAX_FD];
+
+static long
+readPidMax(void) {
+  char buf[32];
+  ssize_t numRead;
+  long pidMax;
+  int fd;
+
+  fd = open(SYSLIMITS_PID_MAX_FILE, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return 32768; /* the kernel's default */
+  }
+
+  numRead = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+
+  if (numRead <= 0) {
+    return 32768;
+  }
+
+  buf[numRead] = '\0';
+  pidMax = strtol(buf, NULL, 10);
+  return (pidMax > 0) ? pidMax : 32768;
+}
+
+/* sysconf(3), or `fallback` if the limit is indeterminate or unknown */
+static long
+sysconfOr(int name, long fallback) {
+  long value = sysconf(name);
+
+  return (value > 0) ? value : fallback;
+}
+
+static void
+take(void) {
+  struct sysLimits l;
+
+  l.pageSize = sysconfOr(_SC_PAGESIZE, 4096);
+  l.pidMax = readPidMax();
+  l.openMax = sysconfOr(_SC_OPEN_MAX, 1024);
+  l.pathMax = PATH_MAX;
+  l.clockTicks = sysconfOr(_SC_CLK_TCK, 100);
+  l.cpus = sysconfOr(_SC_NPROCESSORS_ONLN, 1);
+  l.argMax = sysconfOr(_SC_ARG_MAX, 128 * 1024);
+
+  pthread_mutex_lock(&lock);
+  limits = l;
+  pthread_mutex_unlock(&lock);
+}
+
+const struct sysLimits *
+sysLimits(void) {
+  pthread_once(&once, take);
+  return &limits;
+}
+
+const struct sysLimits *
+sysLimitsRefresh(void) {
+  pthread_once(&once, take);
+  take();
+  return &limits;
+}
+
+long
+sysLimitsPathconf(int fd, int name) {
+  struct fdLimits *f;
+  long value;
+  int cacheable = (fd >= 0 && fd < SYSLIMITS_MAX_FD && name >= 0 && name < PC_NAMES);
+
+  if (cacheable) {
+    pthread_mutex_lock(&lock);
+    f = fdLimits[fd];
+    if (f != NULL && (f->known & (1u << name))) {
+      value = f->values[name];
+      pthread_mutex_unlock(&lock);
+      return value;
+    }
+    pthread_mutex_unlock(&lock);
+  }
+
+  /* indeterminate limits (-1 with errno unchanged) are cached as well */
+  errno = 0;
+  value = fpathconf(fd, name);
+  if (!cacheable || (value == -1 && errno != 0)) {
+    return value;
+  }
+
+  pthread_mutex_lock(&lock);
+  if (fdLimits[fd] == NULL) {
+    fdLimits[fd] = calloc(1, sizeof(struct fdLimits));
+  }
+
+  if ((f = fdLimits[fd]) != NULL) {
+    f->values[name] = value;
+    f->known |= 1u << name;
+  }
+  pthread_mutex_unlock(&lock);
+
+  return value;
+}
+
+void
+sysLimitsForget(int fd) {
+  if (fd < 0 || fd >= SYSLIMITS_MAX_FD) {
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+  if (fdLimits[fd] != NULL) {
+    fdLimits[fd]->known = 0;
+  }
+  pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,62 @@
+/* syslimits.h - A snapshot of the system limits tools size their data by.
+ *
+ * Tools ask for the same handful of limits on startup - the page size, the
+ * largest PID, how many files they can open, how many CPUs there are - each
+ * with its own sysconf(3) call or read of a /proc file (sysconf(3) itself reads
+ * /proc or /sys for some of them, _SC_NPROCESSORS_ONLN for one).
+ *
+ * This takes them all once per process, the first time they are asked for, and
+ * hands out the same snapshot afterwards. Limits which can change while the
+ * process runs (RLIMIT_NOFILE behind _SC_OPEN_MAX, CPUs brought online) are as
+ * they were then: sysLimitsRefresh takes them anew.
+ *
+ * Limits of files - fpathconf(3) - depend on the file system of the file. They
+ * are cached by file descriptor, each the first time it is asked for: the cache
+ * of a descriptor must be dropped with sysLimitsForget when the descriptor is
+ * closed, or it would be taken for the file next opened with that number.
+ *
+ * Programs using it are built along with syslimits.c, and linked with -pthread:
+ *
+ *    $ gcc -o sysconf_demo sysconf_demo.c ../lib/syslimits.c -pthread
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#ifndef SYSLIMITS_H
+#define SYSLIMITS_H
+
+#ifndef SYSLIMITS_PID_MAX_FILE
+#  define SYSLIMITS_PID_MAX_FILE ("/proc/sys/kernel/pid_max")
+#endif
+
+/* the largest file descriptor whose fpathconf(3) limits are cached; larger ones
+ * are asked for every time */
+#ifndef SYSLIMITS_MAX_FD
+#  define SYSLIMITS_MAX_FD (1024)
+#endif
+
+struct sysLimits {
+  long pageSize;    /* _SC_PAGESIZE */
+  long pidMax;      /* the largest PID plus one, from SYSLIMITS_PID_MAX_FILE */
+  long openMax;     /* _SC_OPEN_MAX: the soft RLIMIT_NOFILE */
+  long pathMax;     /* PATH_MAX, including the terminating null byte */
+  long clockTicks;  /* _SC_CLK_TCK */
+  long cpus;        /* _SC_NPROCESSORS_ONLN */
+  long argMax;      /* _SC_ARG_MAX */
+};
+
+/* the limits, taken the first time this is called. Never fails: limits which
+ * could not be found have common defaults */
+const struct sysLimits *sysLimits(void);
+
+/* takes the limits again, for those that could have changed */
+const struct sysLimits *sysLimitsRefresh(void);
+
+/* fpathconf(3), cached by descriptor (for `fd` up to SYSLIMITS_MAX_FD). Returns
+ * what fpathconf(3) does; errors are not cached */
+long sysLimitsPathconf(int fd, int name);
+
+/* drops the cached limits of `fd`, which is about to be closed */
+void sysLimitsForget(int fd);
+
+#endif
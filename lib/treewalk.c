@@ -0,0 +1,309 @@
+/* treewalk.c - Walks directory trees with a number of threads. See treewalk.h.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <limits.h>
+#include <errno.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "treewalk.h"
+
+#define DENTS_BUF_SIZ (32 * 1024) /* bytes of directory entries read at a time */
+
+/* as returned by getdents64(2), which glibc has no wrapper for before 2.30 */
+struct dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/* directories waiting to be read by a thread: the thread itself takes them from
+ * the bottom (`tail`), others steal from the top (`head`) */
+struct deque {
+  pthread_mutex_t lock;
+  int *fds;
+  size_t size, head, tail;
+};
+
+struct worker {
+  pthread_t thread;
+  int id;
+  struct treeWalk *tw;
+  struct deque queue;
+  long unread;              /* directories which could not be read */
+};
+
+struct treeWalk {
+  struct worker *workers;
+  int nworkers;
+  long outstanding;         /* directories queued or being read, by all threads */
+  int fdBudget;             /* directories that can still be queued open */
+  int error;                /* errno of the first error, stopping the walk */
+  const char *progname;
+  treeWalkFn fn;
+  void *arg;
+};
+
+static int
+pushDir(struct deque *q, int fd) {
+  int *fds;
+
+  pthread_mutex_lock(&q->lock);
+
+  if (q->tail == q->size) {
+    if (q->head > 0) {
+      memmove(q->fds, q->fds + q->head, (q->tail - q->head) * sizeof(int));
+      q->tail -= q->head;
+      q->head = 0;
+    } else {
+      fds = realloc(q->fds, 2 * q->size * sizeof(int));
+      if (fds == NULL) {
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+      }
+      q->fds = fds;
+      q->size *= 2;
+    }
+  }
+
+  q->fds[q->tail++] = fd;
+  pthread_mutex_unlock(&q->lock);
+  return 0;
+}
+
+/* takes a directory from the bottom (or top, when stealing) of a deque. Returns -1
+ * if it is empty */
+static int
+popDir(struct deque *q, int steal) {
+  int fd = -1;
+
+  pthread_mutex_lock(&q->lock);
+
+  if (q->head < q->tail) {
+    fd = steal ? q->fds[q->head++] : q->fds[--q->tail];
+    if (q->head == q->tail) {
+      q->head = q->tail = 0;
+    }
+  }
+
+  pthread_mutex_unlock(&q->lock);
+  return fd;
+}
+
+/* records the first error stopping the walk */
+static void
+stopWalk(struct treeWalk *tw, int error) {
+  int none = 0;
+
+  __atomic_compare_exchange_n(&tw->error, &none, error, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/* hands the entries of a directory to the callback, and closes it */
+static int
+readDir(struct worker *w, int fd) {
+  struct treeWalk *tw = w->tw;
+  struct dirent64 *e;
+  char *buf, *p;
+  long numRead;
+  int status = 0;
+
+  buf = malloc(DENTS_BUF_SIZ);
+  if (buf == NULL) {
+    close(fd);
+    return -1;
+  }
+
+  while (status == 0 && (numRead = syscall(SYS_getdents64, fd, buf, DENTS_BUF_SIZ)) > 0) {
+    for (p = buf; status == 0 && p < buf + numRead; p += e->d_reclen) {
+      e = (struct dirent64 *) p;
+
+      /* do not handle . and .. entries */
+      if (e->d_name[0] == '.' && (e->d_name[1] == '\0' || (e->d_name[1] == '.' && e->d_name[2] == '\0'))) {
+        continue;
+      }
+
+      status = tw->fn(tw, w->id, fd, e->d_name, e->d_type, tw->arg);
+    }
+  }
+
+  if (numRead == -1) {
+    treeWalkError(tw, fd, NULL, "getdents64");
+    ++w->unread;
+  }
+
+  free(buf);
+  close(fd);
+  return status;
+}
+
+int
+treeWalkDir(struct treeWalk *tw, int worker, int fd) {
+  struct worker *w = &tw->workers[worker];
+
+  if (__atomic_sub_fetch(&tw->fdBudget, 1, __ATOMIC_RELAXED) >= 0) {
+    __atomic_add_fetch(&tw->outstanding, 1, __ATOMIC_RELAXED);
+    return pushDir(&w->queue, fd);
+  }
+
+  __atomic_add_fetch(&tw->fdBudget, 1, __ATOMIC_RELAXED);
+  return readDir(w, fd);
+}
+
+static void *
+walker(void *arg) {
+  struct worker *w = arg;
+  struct treeWalk *tw = w->tw;
+  int fd, i;
+
+  while (__atomic_load_n(&tw->error, __ATOMIC_RELAXED) == 0) {
+    /* own work first, then the oldest directories of the others */
+    fd = popDir(&w->queue, 0);
+    for (i = 1; fd == -1 && i < tw->nworkers; ++i) {
+      fd = popDir(&tw->workers[(w->id + i) % tw->nworkers].queue, 1);
+    }
+
+    if (fd != -1) {
+      __atomic_add_fetch(&tw->fdBudget, 1, __ATOMIC_RELAXED);
+      if (readDir(w, fd) == -1) {
+        stopWalk(tw, errno);
+      }
+      __atomic_sub_fetch(&tw->outstanding, 1, __ATOMIC_RELEASE);
+      continue;
+    }
+
+    /* nothing to be stolen: done once no thread has directories left to read
+     * (which could bring more) */
+    if (__atomic_load_n(&tw->outstanding, __ATOMIC_ACQUIRE) == 0) {
+      break;
+    }
+
+    sched_yield();
+  }
+
+  return NULL;
+}
+
+struct treeWalk *
+treeWalkNew(int nthreads, int nopenfd, const char *progname, treeWalkFn fn, void *arg) {
+  struct treeWalk *tw;
+  int i;
+
+  if (nthreads < 1) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  tw = calloc(1, sizeof(struct treeWalk));
+  if (tw == NULL) {
+    return NULL;
+  }
+
+  tw->workers = calloc(nthreads, sizeof(struct worker));
+  if (tw->workers == NULL) {
+    free(tw);
+    return NULL;
+  }
+
+  tw->fdBudget = nopenfd;
+  tw->progname = progname;
+  tw->fn = fn;
+  tw->arg = arg;
+
+  for (i = 0; i < nthreads; ++i) {
+    tw->workers[i].id = i;
+    tw->workers[i].tw = tw;
+    tw->workers[i].queue.size = 64;
+    tw->workers[i].queue.fds = malloc(tw->workers[i].queue.size * sizeof(int));
+    if (tw->workers[i].queue.fds == NULL) {
+      treeWalkFree(tw);
+      return NULL;
+    }
+    pthread_mutex_init(&tw->workers[i].queue.lock, NULL);
+    tw->nworkers = i + 1;
+  }
+
+  return tw;
+}
+
+long
+treeWalkRun(struct treeWalk *tw) {
+  long unread = 0;
+  int i, s, started;
+
+  for (started = 1; started < tw->nworkers; ++started) {
+    s = pthread_create(&tw->workers[started].thread, NULL, walker, &tw->workers[started]);
+    if (s != 0) {
+      stopWalk(tw, s);
+      break;
+    }
+  }
+
+  walker(&tw->workers[0]);
+
+  for (i = 0; i < tw->nworkers; ++i) {
+    if (i > 0 && i < started) {
+      pthread_join(tw->workers[i].thread, NULL);
+    }
+    unread += tw->workers[i].unread;
+  }
+
+  if (tw->error != 0) {
+    errno = tw->error;
+    return -1;
+  }
+
+  return unread;
+}
+
+void
+treeWalkFree(struct treeWalk *tw) {
+  struct deque *q;
+  int i;
+
+  for (i = 0; i < tw->nworkers; ++i) {
+    q = &tw->workers[i].queue;
+    while (q->head < q->tail) {
+      close(q->fds[q->head++]);
+    }
+
+    free(q->fds);
+    pthread_mutex_destroy(&q->lock);
+  }
+
+  free(tw->workers);
+  free(tw);
+}
+
+void
+treeWalkError(const struct treeWalk *tw, int dirfd, const char *name, const char *fCall) {
+  char link[64], path[PATH_MAX];
+  int error = errno;
+  ssize_t len;
+
+  if (dirfd == AT_FDCWD) {
+    fprintf(stderr, "%s: %s: %s: %s\n", tw->progname, fCall, name, strerror(error));
+    return;
+  }
+
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", dirfd);
+  len = readlink(link, path, sizeof(path) - 1);
+  path[(len == -1) ? 0 : len] = '\0';
+
+  fprintf(stderr, "%s: %s: %s%s%s: %s\n", tw->progname, fCall, (len == -1) ? "?" : path,
+      (name != NULL) ? "/" : "", (name != NULL) ? name : "", strerror(error));
+}
@@ -0,0 +1,61 @@
+/* treewalk.h - Walks directory trees with a number of threads.
+ *
+ * Tools changing (or looking at) everything under a directory spend most of
+ * their time waiting on the file system, one entry at a time. This walks trees
+ * with a number of threads instead, the way `dirstats -j` does (see
+ * chap18/dirstats.c): each thread has a deque of open directories waiting to be
+ * read, takes directories from the bottom of its own, and once it runs out of
+ * work, steals from the top of the deques of the others - the oldest ones, which
+ * tend to be the roots of the largest subtrees left.
+ *
+ * Entries are read with getdents64(2), and handed to a callback along with the
+ * descriptor of their directory, so that they can be looked up and opened
+ * relative to it: no path is resolved past the ones given. The callback has a
+ * directory read by passing its descriptor to treeWalkDir. At most `nopenfd`
+ * directories are kept open waiting to be read: past that, a thread reads
+ * subdirectories right away, instead of queueing them.
+ *
+ * Programs using it are built along with treewalk.c, and linked with -pthread:
+ *
+ *    $ gcc -o chattr chattr.c ../lib/treewalk.c -pthread
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#ifndef TREEWALK_H
+#define TREEWALK_H
+
+struct treeWalk;
+
+/* called for the entry `name` of the directory open as `dirfd` (never . or ..),
+ * by the thread numbered `worker` (from 0, for callbacks keeping counts of their
+ * own by thread). `type` is the d_type of the entry, DT_UNKNOWN if the file
+ * system does not tell. Returns 0, or -1 to stop the walk, with errno set */
+typedef int (*treeWalkFn)(struct treeWalk *tw, int worker, int dirfd,
+                          const char *name, unsigned char type, void *arg);
+
+/* a walk by `nthreads` threads, calling `fn` with `arg` for every entry found.
+ * `progname` prefixes the errors reported. Returns NULL on errors, with errno set */
+struct treeWalk *treeWalkNew(int nthreads, int nopenfd, const char *progname,
+                             treeWalkFn fn, void *arg);
+
+/* has the directory open as `fd` read, by the thread `worker`, which is calling
+ * the callback, or 0 before the walk is run (for the directories to start from).
+ * The descriptor is closed once read. Returns 0, or -1 on errors */
+int treeWalkDir(struct treeWalk *tw, int worker, int fd);
+
+/* walks the trees under the directories given to treeWalkDir. Returns the number
+ * of directories which could not be read (reported to stderr), or -1 if the walk
+ * was stopped by an error, with errno set */
+long treeWalkRun(struct treeWalk *tw);
+
+/* closes the directories left to read, and releases the walk */
+void treeWalkFree(struct treeWalk *tw);
+
+/* reports an error on the entry `name` of the directory open as `dirfd` (the
+ * directory itself if `name` is NULL; a path relative to the working directory
+ * if `dirfd` is AT_FDCWD), with the current errno. Paths are not kept while
+ * walking: the one of the directory is asked to the kernel, only then */
+void treeWalkError(const struct treeWalk *tw, int dirfd, const char *name, const char *fCall);
+
+#endif
@@ -0,0 +1,367 @@
+/* uringcopy.c - Copies files with many reads and writes in flight, with io_uring.
+ * See uringcopy.h.
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uringcopy.h"
+
+/* buffers are aligned, and sized in multiples of this, for O_DIRECT */
+#define ALIGN (4096)
+
+/* the largest buffer: reads and writes return their result in an int */
+#define MAX_BUFSIZ (1024 * 1024 * 1024)
+
+/* a chunk of the range being copied, and the buffer it goes through. The read and
+ * the write of a chunk are both identified by the index of the slot, with the
+ * lowest bit of their user data telling which is which */
+struct uringCopySlot {
+  off_t offset;     /* of the chunk, in both files */
+  size_t len;       /* of the chunk */
+  size_t have;      /* bytes of it read into the buffer */
+  size_t written;   /* bytes of those written */
+  int readRes, writeRes;
+  int pending;      /* requests in flight */
+  int pair;         /* whether a read was submitted along with the write */
+};
+
+static int
+ringSetup(unsigned entries, struct io_uring_params *p) {
+  return (int) syscall(SYS_io_uring_setup, entries, p);
+}
+
+static int
+ringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+  return (int) syscall(SYS_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int
+ringRegister(int fd, unsigned opcode, const void *arg, unsigned nargs) {
+  return (int) syscall(SYS_io_uring_register, fd, opcode, arg, nargs);
+}
+
+int
+uringCopyInit(struct uringCopy *uc, unsigned depth, size_t bufSize) {
+  struct io_uring_params p;
+  struct iovec *iov;
+  unsigned i;
+  int savedErrno;
+
+  if (depth == 0 || depth > URINGCOPY_MAX_DEPTH) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (bufSize == 0) {
+    bufSize = URINGCOPY_BUFSIZ;
+  }
+
+  memset(uc, 0, sizeof(*uc));
+  uc->depth = depth;
+  uc->bufSize = (bufSize < MAX_BUFSIZ) ? (bufSize + ALIGN - 1) / ALIGN * ALIGN : MAX_BUFSIZ;
+  uc->ringFd = -1;
+  uc->sqRing = uc->cqRing = MAP_FAILED;
+  uc->sqes = MAP_FAILED;
+
+  /* every chunk takes two submission entries, a read and a write; the completion
+   * queue is twice as large, so it never overflows */
+  memset(&p, 0, sizeof(p));
+  uc->ringFd = ringSetup(2 * depth, &p);
+  if (uc->ringFd == -1) {
+    goto fail;
+  }
+
+  uc->sqEntries = p.sq_entries;
+  uc->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  uc->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+  /* since Linux 5.4, both rings are in a single mapping */
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (uc->cqRingSize > uc->sqRingSize) {
+      uc->sqRingSize = uc->cqRingSize;
+    }
+    uc->cqRingSize = uc->sqRingSize;
+  }
+
+  uc->sqRing = mmap(NULL, uc->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    uc->ringFd, IORING_OFF_SQ_RING);
+  if (uc->sqRing == MAP_FAILED) {
+    goto fail;
+  }
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    uc->cqRing = uc->sqRing;
+  } else {
+    uc->cqRing = mmap(NULL, uc->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      uc->ringFd, IORING_OFF_CQ_RING);
+    if (uc->cqRing == MAP_FAILED) {
+      goto fail;
+    }
+  }
+
+  uc->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, uc->ringFd, IORING_OFF_SQES);
+  if (uc->sqes == MAP_FAILED) {
+    goto fail;
+  }
+
+  uc->sqHead = (unsigned *) ((char *) uc->sqRing + p.sq_off.head);
+  uc->sqTail = (unsigned *) ((char *) uc->sqRing + p.sq_off.tail);
+  uc->sqMask = (unsigned *) ((char *) uc->sqRing + p.sq_off.ring_mask);
+  uc->sqArray = (unsigned *) ((char *) uc->sqRing + p.sq_off.array);
+  uc->cqHead = (unsigned *) ((char *) uc->cqRing + p.cq_off.head);
+  uc->cqTail = (unsigned *) ((char *) uc->cqRing + p.cq_off.tail);
+  uc->cqMask = (unsigned *) ((char *) uc->cqRing + p.cq_off.ring_mask);
+  uc->cqes = (struct io_uring_cqe *) ((char *) uc->cqRing + p.cq_off.cqes);
+
+  uc->slots = calloc(depth, sizeof(struct uringCopySlot));
+  if (uc->slots == NULL) {
+    goto fail;
+  }
+
+  if ((errno = posix_memalign((void **) &uc->bufs, ALIGN, depth * uc->bufSize)) != 0) {
+    uc->bufs = NULL;
+    goto fail;
+  }
+
+  /* registering is an optimization: the buffers work all the same without it */
+  iov = malloc(depth * sizeof(struct iovec));
+  if (iov != NULL) {
+    for (i = 0; i < depth; ++i) {
+      iov[i].iov_base = uc->bufs + i * uc->bufSize;
+      iov[i].iov_len = uc->bufSize;
+    }
+
+    uc->registered = (ringRegister(uc->ringFd, IORING_REGISTER_BUFFERS, iov, depth) == 0);
+    free(iov);
+  }
+
+  return 0;
+
+fail:
+  savedErrno = errno;
+  uringCopyDestroy(uc);
+  errno = savedErrno;
+  return -1;
+}
+
+void
+uringCopyDestroy(struct uringCopy *uc) {
+  if (uc->sqes != MAP_FAILED) {
+    munmap(uc->sqes, uc->sqEntries * sizeof(struct io_uring_sqe));
+  }
+
+  if (uc->cqRing != MAP_FAILED && uc->cqRing != uc->sqRing) {
+    munmap(uc->cqRing, uc->cqRingSize);
+  }
+
+  if (uc->sqRing != MAP_FAILED) {
+    munmap(uc->sqRing, uc->sqRingSize);
+  }
+
+  /* also unregisters the buffers */
+  if (uc->ringFd != -1) {
+    close(uc->ringFd);
+  }
+
+  free(uc->bufs);
+  free(uc->slots);
+
+  uc->ringFd = -1;
+  uc->depth = 0;
+  uc->sqRing = uc->cqRing = MAP_FAILED;
+  uc->sqes = MAP_FAILED;
+  uc->bufs = NULL;
+  uc->slots = NULL;
+}
+
+/* queues a read or a write of slot `i`, to be submitted with the next
+ * io_uring_enter. There is always room: at most two entries per slot are queued */
+static void
+queueRw(struct uringCopy *uc, unsigned i, int write, int fd, size_t bufPos, size_t len,
+        off_t offset, int link) {
+  struct io_uring_sqe *sqe;
+  unsigned tail, index;
+
+  tail = *uc->sqTail;
+  index = tail & *uc->sqMask;
+  sqe = &uc->sqes[index];
+
+  memset(sqe, 0, sizeof(*sqe));
+  if (uc->registered) {
+    sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    sqe->buf_index = i;
+  } else {
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+  }
+  sqe->fd = fd;
+  sqe->addr = (uint64_t) (uintptr_t) (uc->bufs + i * uc->bufSize + bufPos);
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->flags = link ? IOSQE_IO_LINK : 0;
+  sqe->user_data = (i << 1) | (write ? 1 : 0);
+
+  uc->sqArray[index] = index;
+  __atomic_store_n(uc->sqTail, tail + 1, __ATOMIC_RELEASE);
+  ++uc->toSubmit;
+}
+
+/* queues the read of the chunk of slot `i`, and the write of what it reads */
+static void
+queueChunk(struct uringCopy *uc, unsigned i, int inputFd, int outputFd) {
+  struct uringCopySlot *s = &uc->slots[i];
+
+  s->have = s->written = 0;
+  s->pair = 1;
+  s->pending = 2;
+
+  queueRw(uc, i, 0, inputFd, 0, s->len, s->offset, 1);
+  queueRw(uc, i, 1, outputFd, 0, s->len, s->offset, 0);
+}
+
+/* carries on with slot `i` once its requests completed. Returns 1 if more were
+ * queued for it, 0 if its chunk is copied (`eof` is set if the input ended
+ * before it), or -1 on error, with `errno` set */
+static int
+settle(struct uringCopy *uc, unsigned i, int inputFd, int outputFd, int *eof) {
+  struct uringCopySlot *s = &uc->slots[i];
+
+  if (s->pair) {
+    if (s->readRes < 0) {
+      errno = -s->readRes;
+      return -1;
+    }
+
+    if (s->readRes == 0) {
+      *eof = 1;
+      return 0;
+    }
+
+    /* a short read cancels the write linked to it */
+    s->have = s->readRes;
+    if (s->writeRes == -ECANCELED) {
+      s->writeRes = 0;
+    } else if (s->writeRes <= 0) {
+      errno = (s->writeRes < 0) ? -s->writeRes : EIO;
+      return -1;
+    }
+    s->written = s->writeRes;
+  } else {
+    if (s->writeRes <= 0) {
+      errno = (s->writeRes < 0) ? -s->writeRes : EIO;
+      return -1;
+    }
+    s->written += s->writeRes;
+  }
+
+  /* the rest of a short write */
+  if (s->written < s->have) {
+    s->pair = 0;
+    s->pending = 1;
+    queueRw(uc, i, 1, outputFd, s->written, s->have - s->written, s->offset + s->written, 0);
+    return 1;
+  }
+
+  /* the rest of a short read, read again into the start of the buffer */
+  if (s->have < s->len) {
+    s->offset += s->have;
+    s->len -= s->have;
+    queueChunk(uc, i, inputFd, outputFd);
+    return 1;
+  }
+
+  return 0;
+}
+
+int
+uringCopyRange(struct uringCopy *uc, int inputFd, int outputFd, off_t offset, off_t len) {
+  struct io_uring_cqe *cqe;
+  struct uringCopySlot *s;
+  off_t next = offset, end = offset + len;
+  unsigned i, head, tail, inFlight = 0;
+  int eof = 0, failed = 0, savedErrno = 0, r;
+
+  for (i = 0; i < uc->depth && next < end; ++i) {
+    uc->slots[i].offset = next;
+    uc->slots[i].len = (end - next < (off_t) uc->bufSize) ? (size_t) (end - next) : uc->bufSize;
+    next += uc->slots[i].len;
+
+    queueChunk(uc, i, inputFd, outputFd);
+    ++inFlight;
+  }
+
+  /* even after an error, every request in flight is waited for: they use the
+   * buffers */
+  while (inFlight > 0) {
+    r = ringEnter(uc->ringFd, uc->toSubmit, 1, IORING_ENTER_GETEVENTS);
+    if (r == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    uc->toSubmit -= r;
+
+    head = *uc->cqHead;
+    tail = __atomic_load_n(uc->cqTail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; ++head) {
+      cqe = &uc->cqes[head & *uc->cqMask];
+      i = (unsigned) (cqe->user_data >> 1);
+      s = &uc->slots[i];
+
+      if (cqe->user_data & 1) {
+        s->writeRes = cqe->res;
+      } else {
+        s->readRes = cqe->res;
+      }
+
+      if (--s->pending > 0) {
+        continue;
+      }
+
+      r = failed ? 0 : settle(uc, i, inputFd, outputFd, &eof);
+      if (r == 1) {
+        continue;
+      }
+
+      if (r == -1) {
+        failed = 1;
+        savedErrno = errno;
+      }
+
+      /* the slot is free: on to the next chunk, if any */
+      if (!failed && !eof && next < end) {
+        s->offset = next;
+        s->len = (end - next < (off_t) uc->bufSize) ? (size_t) (end - next) : uc->bufSize;
+        next += s->len;
+        queueChunk(uc, i, inputFd, outputFd);
+      } else {
+        --inFlight;
+      }
+    }
+
+    __atomic_store_n(uc->cqHead, head, __ATOMIC_RELEASE);
+  }
+
+  if (failed) {
+    errno = savedErrno;
+    return -1;
+  }
+
+  return 0;
+}
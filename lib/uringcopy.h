@@ -0,0 +1,83 @@
+/* uringcopy.h - Copies files with many reads and writes in flight, with io_uring.
+ *
+ * Copying with read(2) and write(2), or pread(2) and pwrite(2), keeps a single
+ * request in flight: the device waits for the program between every read, and the
+ * program waits for the device. Fast storage (NVMe drives have queues thousands of
+ * requests deep) only reaches its throughput with many requests outstanding.
+ *
+ * This copies a range of a file through io_uring(7): up to `depth` chunks of the
+ * range are in flight at once, each with a buffer of its own. A chunk is copied by
+ * a read and a write submitted together, the write linked to the read
+ * (IOSQE_IO_LINK), so the kernel starts writing a chunk as soon as it is read,
+ * without waiting for the program to see the read complete. The program only
+ * steps in once a chunk is written, to submit the next one in its place, or when
+ * a read or a write comes back short.
+ *
+ * Buffers are allocated as one block, aligned for O_DIRECT, and registered with
+ * the ring (IORING_REGISTER_BUFFERS), so the kernel does not map and pin their
+ * pages on every request. Where they cannot be registered (RLIMIT_MEMLOCK on
+ * kernels before 5.12), plain reads and writes are used on the same buffers.
+ *
+ * There is no liburing here: the ring is set up and used with the system calls
+ * and the structures of <linux/io_uring.h>, which Linux 5.6 and later support.
+ * Where io_uring is not available (an older kernel, or one with it disabled by
+ * the kernel.io_uring_disabled sysctl or by a seccomp filter, as in many
+ * containers), uringCopyInit fails, and callers copy some other way.
+ *
+ * Programs using it are built along with uringcopy.c:
+ *
+ *    $ gcc -o hcp hcp.c ../lib/uringcopy.c
+ *
+ * Author: Renato Mascarenhas Costa
+ */
+
+#ifndef URINGCOPY_H
+#define URINGCOPY_H
+
+#include <sys/types.h>
+#include <stddef.h>
+
+/* size of each of the buffers, if none is given */
+#ifndef URINGCOPY_BUFSIZ
+#  define URINGCOPY_BUFSIZ (1024 * 1024)
+#endif
+
+#define URINGCOPY_MAX_DEPTH (4096)
+
+struct uringCopySlot;
+
+struct uringCopy {
+  int ringFd;
+  unsigned depth;                /* chunks in flight at most; 0 if not set up */
+  size_t bufSize;
+  char *bufs;                    /* `depth` buffers of `bufSize` bytes */
+  int registered;                /* whether the buffers are registered */
+  struct uringCopySlot *slots;
+
+  /* the rings, as mapped from the kernel */
+  void *sqRing, *cqRing;         /* the same mapping on most kernels */
+  size_t sqRingSize, cqRingSize;
+  unsigned sqEntries;
+  struct io_uring_sqe *sqes;
+  unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+  unsigned *cqHead, *cqTail, *cqMask;
+  struct io_uring_cqe *cqes;
+  unsigned toSubmit;             /* entries queued since the last io_uring_enter */
+};
+
+/* sets up a ring with `depth` chunks in flight, each of `bufSize` bytes (0 for
+ * URINGCOPY_BUFSIZ). Returns -1 on error, with `errno` set (ENOSYS or EPERM if
+ * io_uring is not available, EINVAL if `depth` is 0 or more than
+ * URINGCOPY_MAX_DEPTH) */
+int uringCopyInit(struct uringCopy *uc, unsigned depth, size_t bufSize);
+
+/* copies `len` bytes at `offset` in `inputFd` to the same offset in `outputFd`.
+ * Copying stops early, with no error, if the input ends before the range does.
+ * Returns -1 on error, with `errno` set */
+int uringCopyRange(struct uringCopy *uc, int inputFd, int outputFd, off_t offset, off_t len);
+
+/* releases the ring and the buffers. `depth` is 0 afterwards, as it is after
+ * uringCopyInit fails */
+void uringCopyDestroy(struct uringCopy *uc);
+
+#endif